@@ -58,8 +58,8 @@ void LSDDetectorC::computeGaussianPyramid( const Mat& image, int numOctaves, int
   /* clear class fields */
   gaussianPyrs.clear();
 
-  /* insert input image into pyramid */
-  cv::Mat currentMat = image.clone();
+  /* insert input image into pyramid (the detection does not modify it, so it is not copied) */
+  cv::Mat currentMat = image;
   //cv::GaussianBlur( currentMat, currentMat, cv::Size( 5, 5 ), 1 );
   gaussianPyrs.push_back( currentMat );
 
@@ -133,7 +133,7 @@ void LSDDetectorC::detectImpl( const Mat& imageSrc, std::vector<KeyLine>& keylin
   if( imageSrc.channels() != 1 )
     cvtColor( imageSrc, image, COLOR_BGR2GRAY );
   else
-    image = imageSrc.clone();
+    image = imageSrc;
 
   /*check whether image depth is different from 0 */
   if( image.depth() != 0 )
@@ -230,7 +230,7 @@ void LSDDetectorC::detectImpl( const Mat& imageSrc, std::vector<KeyLine>& keylin
   if( imageSrc.channels() != 1 )
     cvtColor( imageSrc, image, COLOR_BGR2GRAY );
   else
-    image = imageSrc.clone();
+    image = imageSrc;
 
   /*check whether image depth is different from 0 */
   if( image.depth() != 0 )
@@ -339,7 +339,7 @@ void LSDDetectorC::detectImplFast( const Mat& imageSrc, std::vector<KeyLine>& ke
   if( imageSrc.channels() != 1 )
     cvtColor( imageSrc, image, COLOR_BGR2GRAY );
   else
-    image = imageSrc.clone();
+    image = imageSrc;
 
   /*check whether image depth is different from 0 */
   if( image.depth() != 0 )
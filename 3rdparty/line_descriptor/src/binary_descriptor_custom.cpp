@@ -41,6 +41,10 @@
 
 #include "precomp_custom.hpp"
 
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
 #ifdef _MSC_VER
     #if (_MSC_VER <= 1700)
         /* This function rounds x to the nearest integer, but rounds halfway cases away from zero. */
@@ -353,9 +357,9 @@ void BinaryDescriptor::computeGaussianPyramid( const Mat& image, const int numOc
   images_sizes.clear();
   octaveImages.clear();
 
-  /* insert input image into pyramid */
-  cv::Mat currentMat = image.clone();
-  cv::GaussianBlur( currentMat, currentMat, cv::Size( 5, 5 ), 1 );
+  /* insert input image into pyramid (blurred into a new image, the input is not modified) */
+  cv::Mat currentMat;
+  cv::GaussianBlur( image, currentMat, cv::Size( 5, 5 ), 1 );
   octaveImages.push_back( currentMat );
   images_sizes.push_back( currentMat.size() );
 
@@ -546,7 +550,7 @@ void BinaryDescriptor::computeImpl( const Mat& imageSrc, std::vector<KeyLine>& k
   if( imageSrc.channels() != 1 )
     cvtColor( imageSrc, image, COLOR_BGR2GRAY );
   else
-    image = imageSrc.clone();
+    image = imageSrc;
 
   /*check whether image's depth is different from 0 */
   if( image.depth() != 0 )
@@ -1023,6 +1027,136 @@ int BinaryDescriptor::OctaveKeyLines( cv::Mat& image, ScaleLines &keyLines )
   return 1;
 }
 
+/* gradient sums of the line support rows (positive/negative along dL and dO).
+ * Rows are independent, so they are accumulated in lanes of four while every
+ * lane keeps the scalar order of operations: the result is bit-identical to
+ * the per-row loop. */
+struct LBDRowSums
+{
+  float *pgdL, *ngdL, *pgdO, *ngdO;
+};
+
+static inline short clampCoord( float v, short maxCor )
+{
+  short tempCor = (short) round( v );
+  return ( tempCor < 0 ) ? 0 : ( tempCor > maxCor ) ? maxCor : tempCor;
+}
+
+static void lbdRowSumsScalar( const short *pdxImg, const short *pdyImg, short realWidth, short imageWidth, short imageHeight,
+                              const float *dL, const float *dO, const float *rowX0, const float *rowY0, int firstRow,
+                              int numRows, short lengthOfLSP, LBDRowSums &sums )
+{
+  for ( int hID = firstRow; hID < numRows; hID++ )
+  {
+    float sCorX = rowX0[hID];
+    float sCorY = rowY0[hID];
+    float pgdLRowSum = 0, ngdLRowSum = 0, pgdORowSum = 0, ngdORowSum = 0;
+
+    for ( short wID = 0; wID < lengthOfLSP; wID++ )
+    {
+      short xCor = clampCoord( sCorX, imageWidth );
+      short yCor = clampCoord( sCorY, imageHeight );
+
+      /* To achieve rotation invariance, each simple gradient is rotated aligned with
+       * the line direction and clockwise orthogonal direction.*/
+      short dx = pdxImg[yCor * realWidth + xCor];
+      short dy = pdyImg[yCor * realWidth + xCor];
+      float gDL = dx * dL[0] + dy * dL[1];
+      float gDO = dx * dO[0] + dy * dO[1];
+      if( gDL > 0 )
+        pgdLRowSum += gDL;
+      else
+        ngdLRowSum -= gDL;
+      if( gDO > 0 )
+        pgdORowSum += gDO;
+      else
+        ngdORowSum -= gDO;
+      sCorX += dL[0];
+      sCorY += dL[1];
+    }
+    sums.pgdL[hID] = pgdLRowSum;
+    sums.ngdL[hID] = ngdLRowSum;
+    sums.pgdO[hID] = pgdORowSum;
+    sums.ngdO[hID] = ngdORowSum;
+  }
+}
+
+#ifdef __SSE4_1__
+/* round half away from zero (as round()), then clamp to [0, maxCor] */
+static inline __m128i clampCoord4( __m128 v, __m128i maxCor )
+{
+  const __m128 signMask = _mm_set1_ps( -0.0f );
+  __m128 t = _mm_round_ps( v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC );
+  /* v - trunc(v) is exact */
+  __m128 frac = _mm_andnot_ps( signMask, _mm_sub_ps( v, t ) );
+  __m128 up = _mm_cmpge_ps( frac, _mm_set1_ps( 0.5f ) );
+  __m128 step = _mm_or_ps( _mm_set1_ps( 1.0f ), _mm_and_ps( v, signMask ) );
+  t = _mm_add_ps( t, _mm_and_ps( up, step ) );
+  __m128i c = _mm_cvttps_epi32( t );
+  return _mm_min_epi32( _mm_max_epi32( c, _mm_setzero_si128() ), maxCor );
+}
+
+static void lbdRowSumsSSE( const short *pdxImg, const short *pdyImg, short realWidth, short imageWidth, short imageHeight,
+                           const float *dL, const float *dO, const float *rowX0, const float *rowY0, int numRows,
+                           short lengthOfLSP, LBDRowSums &sums )
+{
+  const __m128 dL0 = _mm_set1_ps( dL[0] ), dL1 = _mm_set1_ps( dL[1] );
+  const __m128 dO0 = _mm_set1_ps( dO[0] ), dO1 = _mm_set1_ps( dO[1] );
+  const __m128 zero = _mm_setzero_ps();
+  const __m128i maxX = _mm_set1_epi32( imageWidth ), maxY = _mm_set1_epi32( imageHeight );
+  const __m128i stride = _mm_set1_epi32( realWidth );
+
+  int hID = 0;
+  for ( ; hID + 4 <= numRows; hID += 4 )
+  {
+    __m128 sCorX = _mm_loadu_ps( rowX0 + hID );
+    __m128 sCorY = _mm_loadu_ps( rowY0 + hID );
+    __m128 pgdL = zero, ngdL = zero, pgdO = zero, ngdO = zero;
+    int CV_DECL_ALIGNED(16) idx[4];
+
+    for ( short wID = 0; wID < lengthOfLSP; wID++ )
+    {
+      __m128i xCor = clampCoord4( sCorX, maxX );
+      __m128i yCor = clampCoord4( sCorY, maxY );
+      _mm_store_si128( (__m128i*) idx, _mm_add_epi32( _mm_mullo_epi32( yCor, stride ), xCor ) );
+
+      __m128 dx = _mm_cvtepi32_ps( _mm_setr_epi32( pdxImg[idx[0]], pdxImg[idx[1]], pdxImg[idx[2]], pdxImg[idx[3]] ) );
+      __m128 dy = _mm_cvtepi32_ps( _mm_setr_epi32( pdyImg[idx[0]], pdyImg[idx[1]], pdyImg[idx[2]], pdyImg[idx[3]] ) );
+      __m128 gDL = _mm_add_ps( _mm_mul_ps( dx, dL0 ), _mm_mul_ps( dy, dL1 ) );
+      __m128 gDO = _mm_add_ps( _mm_mul_ps( dx, dO0 ), _mm_mul_ps( dy, dO1 ) );
+
+      /* adding the masked-out +0 leaves a sum unchanged, as the branch does */
+      __m128 posL = _mm_cmpgt_ps( gDL, zero );
+      __m128 posO = _mm_cmpgt_ps( gDO, zero );
+      pgdL = _mm_add_ps( pgdL, _mm_and_ps( posL, gDL ) );
+      ngdL = _mm_sub_ps( ngdL, _mm_andnot_ps( posL, gDL ) );
+      pgdO = _mm_add_ps( pgdO, _mm_and_ps( posO, gDO ) );
+      ngdO = _mm_sub_ps( ngdO, _mm_andnot_ps( posO, gDO ) );
+
+      sCorX = _mm_add_ps( sCorX, dL0 );
+      sCorY = _mm_add_ps( sCorY, dL1 );
+    }
+    _mm_storeu_ps( sums.pgdL + hID, pgdL );
+    _mm_storeu_ps( sums.ngdL + hID, ngdL );
+    _mm_storeu_ps( sums.pgdO + hID, pgdO );
+    _mm_storeu_ps( sums.ngdO + hID, ngdO );
+  }
+
+  lbdRowSumsScalar( pdxImg, pdyImg, realWidth, imageWidth, imageHeight, dL, dO, rowX0, rowY0, hID, numRows, lengthOfLSP, sums );
+}
+#endif
+
+static void lbdRowSums( const short *pdxImg, const short *pdyImg, short realWidth, short imageWidth, short imageHeight,
+                        const float *dL, const float *dO, const float *rowX0, const float *rowY0, int numRows,
+                        short lengthOfLSP, LBDRowSums &sums )
+{
+#ifdef __SSE4_1__
+  lbdRowSumsSSE( pdxImg, pdyImg, realWidth, imageWidth, imageHeight, dL, dO, rowX0, rowY0, numRows, lengthOfLSP, sums );
+#else
+  lbdRowSumsScalar( pdxImg, pdyImg, realWidth, imageWidth, imageHeight, dL, dO, rowX0, rowY0, 0, numRows, lengthOfLSP, sums );
+#endif
+}
+
 int BinaryDescriptor::computeLBD( ScaleLines &keyLines, bool useDetectionData )
 {
   //the default length of the band is the line length.
@@ -1049,6 +1183,12 @@ int BinaryDescriptor::computeLBD( ScaleLines &keyLines, bool useDetectionData )
   float *pgdO2BandSum = new float[NUM_OF_BANDS];  //the summation of {g_dO^2 |g_dO>0 } for each band of the region;
   float *ngdO2BandSum = new float[NUM_OF_BANDS];  //the summation of {g_dO^2 |g_dO<0 } for each band of the region;
 
+  /* per-row start points and gradient sums of the line support region */
+  std::vector<float> rowBuffer( 6 * heightOfLSP );
+  float *rowX0 = &rowBuffer[0];
+  float *rowY0 = rowX0 + heightOfLSP;
+  LBDRowSums rowSums = { rowY0 + heightOfLSP, rowY0 + 2 * heightOfLSP, rowY0 + 3 * heightOfLSP, rowY0 + 4 * heightOfLSP };
+
   short numOfBitsBand = NUM_OF_BANDS * sizeof(float);
   short lengthOfLSP;  //the length of line support region, varies with lines
   short halfHeight = ( heightOfLSP - 1 ) / 2;
@@ -1056,11 +1196,7 @@ int BinaryDescriptor::computeLBD( ScaleLines &keyLines, bool useDetectionData )
   short bandID;
   float coefInGaussion;
   float lineMiddlePointX, lineMiddlePointY;
-  float sCorX, sCorY, sCorX0, sCorY0;
-  short tempCor, xCor, yCor;  //pixel coordinates in image plane
-  short dx, dy;
-  float gDL;  //store the gradient projection of pixels in support region along dL vector
-  float gDO;  //store the gradient projection of pixels in support region along dO vector
+  float sCorX0, sCorY0;
   short imageWidth, imageHeight, realWidth;
   short *pdxImg, *pdyImg;
   float *desVec;
@@ -1138,53 +1274,22 @@ int BinaryDescriptor::computeLBD( ScaleLines &keyLines, bool useDetectionData )
       sCorX0 = -dL[0] * halfWidth + dL[1] * halfHeight + lineMiddlePointX;  //hID =0; wID = 0;
       sCorY0 = -dL[1] * halfWidth - dL[0] * halfHeight + lineMiddlePointY;
 
-      /* BIAS::Matrix<float> gDLMat(heightOfLSP,lengthOfLSP) */
+      /* row start points, advanced as in the per-row loop */
       for ( short hID = 0; hID < heightOfLSP; hID++ )
       {
-        /*initialization */
-        sCorX = sCorX0;
-        sCorY = sCorY0;
-
-        pgdLRowSum = 0;
-        ngdLRowSum = 0;
-        pgdORowSum = 0;
-        ngdORowSum = 0;
-
-        for ( short wID = 0; wID < lengthOfLSP; wID++ )
-        {
-          tempCor = (short) round( sCorX );
-          xCor = ( tempCor < 0 ) ? 0 : ( tempCor > imageWidth ) ? imageWidth : tempCor;
-          tempCor = (short) round( sCorY );
-          yCor = ( tempCor < 0 ) ? 0 : ( tempCor > imageHeight ) ? imageHeight : tempCor;
-
-          /* To achieve rotation invariance, each simple gradient is rotated aligned with
-           * the line direction and clockwise orthogonal direction.*/
-          dx = pdxImg[yCor * realWidth + xCor];
-          dy = pdyImg[yCor * realWidth + xCor];
-          gDL = dx * dL[0] + dy * dL[1];
-          gDO = dx * dO[0] + dy * dO[1];
-          if( gDL > 0 )
-          {
-            pgdLRowSum += gDL;
-          }
-          else
-          {
-            ngdLRowSum -= gDL;
-          }
-          if( gDO > 0 )
-          {
-            pgdORowSum += gDO;
-          }
-          else
-          {
-            ngdORowSum -= gDO;
-          }
-          sCorX += dL[0];
-          sCorY += dL[1];
-          /* gDLMat[hID][wID] = gDL; */
-        }
+        rowX0[hID] = sCorX0;
+        rowY0[hID] = sCorY0;
         sCorX0 -= dL[1];
         sCorY0 += dL[0];
+      }
+      lbdRowSums( pdxImg, pdyImg, realWidth, imageWidth, imageHeight, dL, dO, rowX0, rowY0, heightOfLSP, lengthOfLSP, rowSums );
+
+      for ( short hID = 0; hID < heightOfLSP; hID++ )
+      {
+        pgdLRowSum = rowSums.pgdL[hID];
+        ngdLRowSum = rowSums.ngdL[hID];
+        pgdORowSum = rowSums.pgdO[hID];
+        ngdORowSum = rowSums.ngdO[hID];
         coefInGaussion = (float) gaussCoefG_[hID];
         pgdLRowSum = coefInGaussion * pgdLRowSum;
         ngdLRowSum = coefInGaussion * ngdLRowSum;
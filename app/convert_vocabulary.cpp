@@ -0,0 +1,76 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <binaryVocabulary.h>
+
+using namespace std;
+using namespace PLSLAM;
+
+static double elapsedMs(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// converts a DBoW2 text/YAML vocabulary into the binary format loaded by MapHandler
+int main(int argc, char **argv)
+{
+    if( argc != 3 )
+    {
+        cout << endl << "Usage: ./convert_vocabulary <vocabulary.yml[.gz]> <vocabulary.bin>" << endl << endl;
+        return -1;
+    }
+
+    BinaryVocabulary voc;
+    try
+    {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        voc.loadFromFile( argv[1] );
+        cout << "Loaded " << argv[1] << " (" << voc.size() << " words) in " << elapsedMs(t0) << " ms" << endl;
+        voc.saveBinary( argv[2] );
+
+        // check the conversion
+        t0 = std::chrono::steady_clock::now();
+        BinaryVocabulary bin;
+        bin.loadBinary( argv[2] );
+        cout << "Wrote " << argv[2] << ", loaded back in " << elapsedMs(t0) << " ms" << endl;
+        if( bin.size() != voc.size() || bin.getBranchingFactor() != voc.getBranchingFactor() ||
+            bin.getDepthLevels() != voc.getDepthLevels() )
+            throw std::runtime_error("the converted vocabulary does not match the input");
+    }
+    catch( const std::string &e ) // thrown by DBoW2
+    {
+        cerr << "Error: " << e << endl;
+        return -1;
+    }
+    catch( const std::exception &e )
+    {
+        cerr << "Error: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
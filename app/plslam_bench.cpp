@@ -0,0 +1,332 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+// Headless benchmark of the whole pipeline (VO, mapping and GBA) on a dataset
+// sequence: fixed seeds and thread count, per-stage latency, throughput, peak
+// RSS and ATE of the keyframe trajectory, written as a single JSON document.
+// With -R the KFs are sent to a remote back-end (plslam_server) instead.
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <sys/resource.h>
+
+#include <boost/filesystem.hpp>
+#include <eigen3/Eigen/Geometry>
+
+#include <stereoFrame.h>
+#include <stereoFrameHandler.h>
+
+#include <mapFeatures.h>
+#include <mapHandler.h>
+#include <mapLink.h>
+
+#include <config.h>
+#include <dataset.h>
+#include <frontEndRecord.h>
+#include <logger.h>
+#include <profiler.h>
+#include <threadRole.h>
+
+using namespace StVO;
+using namespace PLSLAM;
+
+struct BenchArgs {
+    string dataset, config_file, gt_dir, remote, json_file = "plslam_bench.json";
+    int frame_offset = 0, frame_number = 0, frame_step = 1, threads = 0;
+    unsigned int seed = 0;
+};
+
+void showHelp();
+bool getInputArgs(int argc, char **argv, BenchArgs &args);
+bool loadGroundTruth(const string &gt_dir, vector<long double> &gt_t, vector<Vector3d> &gt_p);
+bool computeATE(const MapHandler *map, const vector<long double> &gt_t, const vector<Vector3d> &gt_p, double &ate_rmse, int &n_matched);
+
+int main(int argc, char **argv)
+{
+    BenchArgs args;
+    if (!getInputArgs(argc, argv, args)) {
+        showHelp();
+        return -1;
+    }
+
+    if (!args.config_file.empty()) SlamConfig::loadFromFile(args.config_file);
+
+    // reproducible runs: fixed thread count (before the first use of the pool) and seeds
+    Config::numWorkerThreads() = args.threads;
+    if (args.threads > 0) cv::setNumThreads(args.threads);
+    srand(args.seed);
+    cv::theRNG().state = args.seed == 0 ? 0xffffffff : args.seed;
+
+    Profiler::instance().setEnabled(true, !Config::traceFile().empty());
+    Logger::instance().setLevel(Config::logLevel());
+
+    // the dataset is either a directory or a name under DATASETS_DIR
+    boost::filesystem::path dataset_path(args.dataset);
+    if (!boost::filesystem::is_directory(dataset_path) && getenv("DATASETS_DIR") != NULL)
+        dataset_path = boost::filesystem::path(getenv("DATASETS_DIR")) / args.dataset;
+    if (!boost::filesystem::is_directory(dataset_path)) {
+        cerr << "Invalid dataset path " << args.dataset << endl;
+        return -1;
+    }
+
+    vector<long double> gt_t;
+    vector<Vector3d> gt_p;
+    if (!args.gt_dir.empty() && !loadGroundTruth(args.gt_dir, gt_t, gt_p)) {
+        cerr << "Invalid ground truth folder " << args.gt_dir << endl;
+        return -1;
+    }
+
+    PinholeStereoCamera* cam_pin = new PinholeStereoCamera((dataset_path / "dataset_params.yaml").string());
+    Dataset dataset(dataset_path.string(), *cam_pin, args.frame_offset, args.frame_number, args.frame_step);
+    PLSLAM::MapHandler* map = NULL;
+    MapLinkClient* link = NULL;
+    if (args.remote.empty())
+        map = new PLSLAM::MapHandler(cam_pin);
+    else {
+        size_t colon = args.remote.rfind(':');
+        try {
+            if (colon == string::npos) throw std::runtime_error("Invalid back-end address " + args.remote);
+            link = new MapLinkClient(args.remote.substr(0, colon), stoi(args.remote.substr(colon + 1)),
+                                     cam_pin, SlamConfig::linkQueueSize());
+        }
+        catch (const std::exception &e) {
+            cerr << e.what() << endl;
+            return -1;
+        }
+    }
+    StereoFrameHandler* StVO = new StereoFrameHandler(cam_pin);
+    setupThread(THREAD_TRACKING);
+    FrontEndRecorder* recorder = SlamConfig::feRecordFile().empty() ? NULL : new FrontEndRecorder(cam_pin);
+
+    Profiler &prof = Profiler::instance();
+    int frame_counter = 0;
+    Mat img_l, img_r;
+    long double t;
+
+    double t_begin = prof.now();
+    while (dataset.nextFrame(img_l, img_r, t))
+    {
+        double t_frame = prof.now();
+        if (frame_counter == 0)
+        {
+            StVO->initialize(img_l, img_r, 0, t);
+            if (recorder != NULL)
+                recorder->addFrame(StVO->prev_frame, true);
+            if (link != NULL)
+                link->addKeyFrame(new PLSLAM::KeyFrame(StVO->prev_frame, 0));
+            else
+                map->initialize(new PLSLAM::KeyFrame(StVO->prev_frame, 0));
+        }
+        else
+        {
+            if (Config::trackLocalMap() && map != NULL)
+                StVO->setLocalMap(map->localMapSnapshot());
+            StVO->insertStereoPair(img_l, img_r, frame_counter, t);
+            StVO->optimizePose();
+            bool is_kf = StVO->needNewKF();
+            if (recorder != NULL)
+                recorder->addFrame(StVO->curr_frame, is_kf);
+            if (is_kf)
+            {
+                PLSLAM::KeyFrame* curr_kf = new PLSLAM::KeyFrame(StVO->curr_frame);
+                StVO->currFrameIsKF();
+                if (link != NULL)
+                    link->addKeyFrame(curr_kf);
+                else
+                    map->addKeyFrame(curr_kf);
+            }
+            StVO->updateFrame();
+        }
+        prof.addSample("Bench::frame", t_frame, prof.now() - t_frame);
+        frame_counter++;
+    }
+    if (link != NULL)
+        link->finish();
+    else
+        map->finishSLAM();
+    double t_track = prof.now() - t_begin;
+    if (recorder != NULL)
+    {
+        recorder->write(SlamConfig::feRecordFile());
+        delete recorder;
+    }
+
+    // the GBA and ATE belong to the back-end in remote mode
+    double ate_rmse = -1.0;
+    int n_matched = 0;
+    bool has_ate = false;
+    if (map != NULL)
+    {
+        double t_gba = prof.now();
+        map->globalBundleAdjustment();
+        prof.addSample("Bench::globalBundleAdjustment", t_gba, prof.now() - t_gba);
+        has_ate = !gt_t.empty() && computeATE(map, gt_t, gt_p, ate_rmse, n_matched);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // machine-readable report
+    ofstream out(args.json_file.c_str());
+    if (!out.is_open()) {
+        cerr << "Can't write " << args.json_file << endl;
+        return -1;
+    }
+    out << fixed << setprecision(4);
+    out << "{\"dataset\":\"" << dataset_path.string() << "\""
+        << ",\"config\":\"" << args.config_file << "\""
+        << ",\"threads\":" << args.threads
+        << ",\"seed\":" << args.seed
+        << ",\"frames\":" << frame_counter
+        << ",\"keyframes\":" << (link != NULL ? link->numKeyFrames() : map->max_kf_idx + 1)
+        << ",\"tracking_s\":" << t_track * 1e-6
+        << ",\"fps\":" << (t_track > 0.0 ? frame_counter / (t_track * 1e-6) : 0.0)
+        << ",\"peak_rss_mb\":" << usage.ru_maxrss / 1024.0;
+    if (link != NULL)
+        out << ",\"remote\":\"" << args.remote << "\""
+            << ",\"link_mb\":" << link->bytesSent() / (1024.0 * 1024.0)
+            << ",\"corrections\":" << link->numCorrections();
+    if (has_ate)
+        out << ",\"ate_rmse_m\":" << ate_rmse << ",\"ate_matched_kfs\":" << n_matched;
+    out << ",\"profile\":";
+    prof.writeReportJSON(out);
+    out << "}" << endl;
+    out.close();
+
+    prof.printReport(cout);
+    if (prof.writeTrace(Config::traceFile()))
+        cout << "Stage trace written to " << Config::traceFile() << endl;
+    cout << "Benchmark report written to " << args.json_file << endl;
+
+    delete StVO;
+    delete link;
+    return 0;
+}
+
+// <gt_dir>/associations.txt holds one timestamp (ns) per line of <gt_dir>/groundtruth.txt (3x4 row-major poses)
+bool loadGroundTruth(const string &gt_dir, vector<long double> &gt_t, vector<Vector3d> &gt_p)
+{
+    boost::filesystem::path dir(gt_dir);
+    ifstream f_t((dir / "associations.txt").string().c_str()), f_p((dir / "groundtruth.txt").string().c_str());
+    if (!f_t.is_open() || !f_p.is_open())
+        return false;
+
+    string line_t, line_p;
+    while (getline(f_t, line_t) && getline(f_p, line_p))
+    {
+        istringstream ss_t(line_t), ss_p(line_p);
+        long double t_ns;
+        double T[12];
+        if (!(ss_t >> t_ns)) continue;
+        int n = 0;
+        while (n < 12 && ss_p >> T[n]) n++;
+        if (n < 12) continue;
+        gt_t.push_back(t_ns * 1e-9L);
+        gt_p.push_back(Vector3d(T[3], T[7], T[11]));
+    }
+    return !gt_t.empty();
+}
+
+// RMSE of the KF positions after the rigid (Umeyama) alignment with the closest ground truth samples
+bool computeATE(const MapHandler *map, const vector<long double> &gt_t, const vector<Vector3d> &gt_p, double &ate_rmse, int &n_matched)
+{
+    const long double max_dt = 0.01;
+    vector<Vector3d> est, ref;
+    for (const KeyFrame *kf : map->map_keyframes)
+    {
+        if (kf == NULL) continue;
+        long double t = kf->stereo_frame->t;
+        size_t i = lower_bound(gt_t.begin(), gt_t.end(), t) - gt_t.begin();
+        if (i > 0 && (i == gt_t.size() || t - gt_t[i-1] < gt_t[i] - t)) i--;
+        if (i >= gt_t.size() || fabsl(gt_t[i] - t) > max_dt) continue;
+        est.push_back(kf->T_kf_w.block<3,1>(0,3));
+        ref.push_back(gt_p[i]);
+    }
+    n_matched = est.size();
+    if (n_matched < 3)
+        return false;
+
+    Matrix<double,3,Dynamic> P_est(3, n_matched), P_ref(3, n_matched);
+    for (int i = 0; i < n_matched; i++)
+    {
+        P_est.col(i) = est[i];
+        P_ref.col(i) = ref[i];
+    }
+    Matrix4d T_align = Eigen::umeyama(P_est, P_ref, false);
+    Matrix<double,3,Dynamic> P_aligned = (T_align.block<3,3>(0,0) * P_est).colwise() + T_align.block<3,1>(0,3);
+    ate_rmse = sqrt((P_aligned - P_ref).colwise().squaredNorm().mean());
+    return true;
+}
+
+void showHelp() {
+    cout << endl << "Usage: ./plslam_bench <dataset_path_or_name> [options]" << endl
+         << "Options:" << endl
+         << "\t-o Offset (number of frames to skip in the dataset directory" << endl
+         << "\t-n Number of frames to process the sequence" << endl
+         << "\t-s Parameter to skip s-1 frames (default 1)" << endl
+         << "\t-c Config file" << endl
+         << "\t-g Ground truth folder (e.g. config/asl/gt-ass/mh_01) for the ATE" << endl
+         << "\t-j JSON report file (default plslam_bench.json)" << endl
+         << "\t-t Number of worker threads (default 0, all the hardware threads)" << endl
+         << "\t-r Random seed (default 0)" << endl
+         << "\t-R Remote back-end host:port (plslam_server) instead of the local map" << endl
+         << endl;
+}
+
+bool getInputArgs(int argc, char **argv, BenchArgs &args) {
+
+    if( argc < 2 || (argc % 2) == 1 )
+        return false;
+
+    args.dataset = argv[1];
+    int nargs = argc/2 - 1;
+    for( int i = 0; i < nargs; i++ )
+    {
+        int j = 2*i + 2;
+        string opt(argv[j]), val(argv[j+1]);
+        if( opt == "-o" )
+            args.frame_offset = stoi(val);
+        else if( opt == "-n" )
+            args.frame_number = stoi(val);
+        else if( opt == "-s" )
+            args.frame_step = stoi(val);
+        else if( opt == "-c" )
+            args.config_file = val;
+        else if( opt == "-g" )
+            args.gt_dir = val;
+        else if( opt == "-j" )
+            args.json_file = val;
+        else if( opt == "-t" )
+            args.threads = stoi(val);
+        else if( opt == "-r" )
+            args.seed = (unsigned int) stoul(val);
+        else if( opt == "-R" )
+            args.remote = val;
+        else
+            return false;
+    }
+
+    return true;
+}
@@ -21,9 +21,13 @@
 *****************************************************************************/
 
 #ifdef HAS_MRPT
+#include <sceneObserver.h>
 #include <slamScene.h>
 #endif
 
+#include <fstream>
+#include <iomanip>
+
 #include <stereoFrame.h>
 #include <stereoFrameHandler.h>
 #include <boost/filesystem.hpp>
@@ -32,12 +36,18 @@
 #include <mapHandler.h>
 
 #include <dataset.h>
+#include <framePipeline.h>
+#include <frontEndRecord.h>
+#include <logger.h>
+#include <profiler.h>
+#include <threadRole.h>
 #include <timer.h>
 
 using namespace StVO;
 using namespace PLSLAM;
 
 void showHelp();
+int runLocalization(Dataset &dataset, PinholeStereoCamera* cam_pin, PLSLAM::MapHandler* map, slamScene &scene);
 bool getInputArgs(int argc, char **argv, std::string &dataset_name, int &frame_offset, int &frame_number, int &frame_step, std::string &config_file);
 
 int main(int argc, char **argv)
@@ -65,6 +75,9 @@ int main(int argc, char **argv)
         return -1;
     }
 
+    Profiler::instance().setEnabled(Config::profileStages(), !Config::traceFile().empty());
+    Logger::instance().setLevel(Config::logLevel());
+
     // read dataset root dir fron environment variable
     boost::filesystem::path dataset_path(string( getenv("DATASETS_DIR")));
     if (!boost::filesystem::exists(dataset_path) || !boost::filesystem::is_directory(dataset_path)) {
@@ -102,86 +115,255 @@ int main(int argc, char **argv)
 
     cout << " ... done. " << endl;
 
+    // offline mode: localize in or refine a map saved by a previous run
+    if( !SlamConfig::mapLoadFile().empty() )
+    {
+        cout << endl << "Loading map from " << SlamConfig::mapLoadFile() << " ..." ;
+        map->loadMap( SlamConfig::mapLoadFile() );
+        cout << " ... done (" << map->max_kf_idx + 1 << " keyframes)." << endl;
+        scene.initViewports( cam_pin->getWidth(), cam_pin->getHeight() );
+        scene.updateScene( map );
+
+        if( SlamConfig::localizationOnly() )
+            return runLocalization( dataset, cam_pin, map, scene );
+
+        cout << endl << "Performing Global Bundle Adjustment..." ;
+        map->globalBundleAdjustment();
+        cout << " ... done." << endl;
+        map->SaveKeyFrameTrajectoryTUM("pl-slam");
+        if( !SlamConfig::mapSaveFile().empty() )
+            map->saveMap( SlamConfig::mapSaveFile() );
+        scene.updateSceneGraphs( map );
+
+        while( scene.isOpen() );
+        return 0;
+    }
+
     Timer timer;
 
-    // initialize and run PL-StVO
+    // initialize and run PL-StVO (on the CPUs of the tracking thread)
+    setupThread(THREAD_TRACKING);
     int frame_counter = 0;
     StereoFrameHandler* StVO = new StereoFrameHandler(cam_pin);
     Mat img_l, img_r;
     long double t;
-    while (dataset.nextFrame(img_l, img_r, t))
+
+    // the scene is drawn by its own thread once the map is initialized
+    SceneObserver* observer = NULL;
+
+    // optionally record the output of the VO to replay the back-end (plslam_replay)
+    FrontEndRecorder* recorder = NULL;
+    if( !SlamConfig::feRecordFile().empty() )
+        recorder = new FrontEndRecorder(cam_pin);
+
+    // optionally load and extract the next frames while the current pose is optimized
+    FramePipeline* pipeline = NULL;
+    if( Config::pipelinedVO() )
     {
+        pipeline = new FramePipeline(dataset, cam_pin, Config::pipelineQueueSize());
+        pipeline->start();
+    }
+
+    while (true)
+    {
+        StereoFrame* frame = NULL;
+        if( pipeline != NULL )
+        {
+            frame = pipeline->nextFrame();
+            if( frame == NULL )
+                break;
+        }
+        else if( !dataset.nextFrame(img_l, img_r, t) )
+            break;
+
         if( frame_counter == 0 ) // initialize
         {
-            StVO->initialize(img_l,img_r,0, t);
+            if( frame != NULL )
+                StVO->initialize(frame);
+            else
+                StVO->initialize(img_l,img_r,0, t);
+            if( recorder != NULL )
+                recorder->addFrame( StVO->prev_frame, true );
             PLSLAM::KeyFrame* kf = new PLSLAM::KeyFrame( StVO->prev_frame, 0 );
             map->initialize( kf );
             // update scene
-            scene.initViewports( img_l.cols, img_r.rows );
+            scene.initViewports( StVO->prev_frame->img_l.cols, StVO->prev_frame->img_r.rows );
             scene.setImage(StVO->prev_frame->plotStereoFrame());
             scene.updateSceneSafe( map );
+            observer = new SceneObserver( scene, map, SlamConfig::sceneMaxFps() );
+            map->addObserver( observer );
         }
         else // run
         {
             // PL-StVO
             timer.start();
-            StVO->insertStereoPair( img_l, img_r, frame_counter ,t);
+            if( Config::trackLocalMap() )
+                StVO->setLocalMap( map->localMapSnapshot() );
+            if( frame != NULL )
+                StVO->insertStereoFrame( frame );
+            else
+                StVO->insertStereoPair( img_l, img_r, frame_counter ,t);
             StVO->optimizePose();
             double t1 = timer.stop(); //ms
-            cout << "------------------------------------------   Frame #" << frame_counter
-                 << "   ----------------------------------------" << endl;
-            cout << endl << "VO Runtime: " << t1 << endl;
+            LOG_INFO( "------------------------------------------   Frame #" << frame_counter
+                      << "   ----------------------------------------" );
+            LOG_INFO( "VO Runtime: " << t1 );
 
             // check if a new keyframe is needed
-            if( StVO->needNewKF() )
+            bool is_kf = StVO->needNewKF();
+            if( recorder != NULL )
+                recorder->addFrame( StVO->curr_frame, is_kf );
+            if( is_kf )
             {
-                cout <<         "#KeyFrame:     " << map->max_kf_idx + 1;
-                cout << endl << "#Points:       " << map->map_points.size();
-                cout << endl << "#Segments:     " << map->map_lines.size();
-                cout << endl << endl;
+                LOG_INFO( "#KeyFrame:     " << map->max_kf_idx + 1 <<
+                          "\n#Points:       " << map->map_points.size() <<
+                          "\n#Segments:     " << map->map_lines.size() << "\n" );
 
                 // grab StF and update KF in StVO (the StVO thread can continue after this point)
                 PLSLAM::KeyFrame* curr_kf = new PLSLAM::KeyFrame( StVO->curr_frame );
                 // update KF in StVO
                 StVO->currFrameIsKF();
                 map->addKeyFrame( curr_kf );
-                // update scene
-                scene.setImage(StVO->curr_frame->plotStereoFrame());
-                scene.updateSceneSafe( map );
+                observer->frameTracked( StVO->curr_frame, true );
             }
             else
-            {
-                scene.setImage(StVO->curr_frame->plotStereoFrame());
-                scene.setPose( StVO->curr_frame->DT );
-                scene.updateScene();
-            }
+                observer->frameTracked( StVO->curr_frame, false );
 
             // update StVO
             StVO->updateFrame();
+            if( pipeline != NULL )
+                pipeline->setThresholds( StVO->llength_th, StVO->orb_fast_th );
         }
 
         frame_counter++;
     }
 
+    if( pipeline != NULL )
+    {
+        pipeline->stop();
+        delete pipeline;
+    }
+    if( recorder != NULL )
+    {
+        recorder->write( SlamConfig::feRecordFile() );
+        cout << "Front-end record (" << recorder->numFrames() << " frames, " << recorder->numKeyFrames()
+             << " keyframes) written to " << SlamConfig::feRecordFile() << endl;
+        delete recorder;
+    }
 
 
-    // finish SLAM
+    // finish SLAM (the observer is stopped with the mapping threads, the scene is then drawn from here)
     map->finishSLAM();
+    if( observer != NULL )
+        observer->stop();
     scene.updateScene( map );
+    Logger::instance().flush();
 
     // perform GBA
     cout << endl << "Performing Global Bundle Adjustment..." ;
     map->globalBundleAdjustment();
     cout << " ... done." << endl;
     map->SaveKeyFrameTrajectoryTUM("pl-slam");
+    if( !SlamConfig::mapSaveFile().empty() )
+    {
+        map->saveMap( SlamConfig::mapSaveFile() );
+        cout << "Map saved to " << SlamConfig::mapSaveFile() << endl;
+    }
     scene.updateSceneGraphs( map );
 
+    // per-stage latency report
+    Profiler::instance().printReport(cout);
+    if( Profiler::instance().writeTrace(Config::traceFile()) )
+        cout << "Stage trace written to " << Config::traceFile() << endl;
+
     // wait until the scene is closed
     while( scene.isOpen() );
 
     return 0;
 }
 
+// localization-only mode: f2f tracking between registrations of the frames against the loaded map
+int runLocalization(Dataset &dataset, PinholeStereoCamera* cam_pin, PLSLAM::MapHandler* map, slamScene &scene) {
+
+    setupThread(THREAD_TRACKING);
+    StereoFrameHandler* StVO = new StereoFrameHandler(cam_pin);
+    Mat img_l, img_r;
+    long double t;
+
+    // StVO poses are relative to the last reference frame (as they are to the last KF in SLAM)
+    Matrix4d T_ref_w = Matrix4d::Identity(), T_last_w = Matrix4d::Identity();
+    bool localized = false;
+    int frame_counter = 0, n_localized = 0;
+
+    ofstream f("pl-slam-loc");
+    f << fixed;
+
+    while( dataset.nextFrame(img_l, img_r, t) )
+    {
+        StereoFrame* frame;
+        bool need_kf = false, lost = false;
+        if( frame_counter == 0 )
+        {
+            StVO->initialize(img_l, img_r, 0, t);
+            frame = StVO->prev_frame;
+        }
+        else
+        {
+            StVO->insertStereoPair( img_l, img_r, frame_counter, t );
+            StVO->optimizePose();
+            frame   = StVO->curr_frame;
+            lost    = frame->err_norm < 0.0;
+            need_kf = StVO->needNewKF();
+        }
+
+        // register against the map at startup, after a tracking loss and wherever SLAM would insert a KF
+        Matrix4d T_f_w = T_ref_w * frame->Tfw;
+        if( !localized || lost || need_kf || frame_counter == 0 )
+        {
+            Matrix4d T_loc;
+            if( map->localizeFrame( frame, T_loc ) )
+            {
+                T_f_w = T_loc;
+                localized = true;
+                n_localized++;
+            }
+            else if( lost )
+                localized = false;
+            // the frame becomes the new reference (no KF is inserted in the map)
+            T_ref_w = T_f_w;
+            if( frame_counter > 0 )
+                StVO->currFrameIsKF();
+        }
+        LOG_INFO( "Frame #" << frame_counter << ( localized ? "  localized (reference KF " + to_string(map->reloc_kf_idx) + ")" : "  lost" ) );
+
+        if( localized )
+        {
+            Matrix3d R = T_f_w.block<3,3>(0,0);
+            Eigen::Quaterniond q(R);
+            f << setprecision(6) << t << setprecision(7) << " " << T_f_w(0,3) << " " << T_f_w(1,3) << " " << T_f_w(2,3)
+              << " " << q.x() << " " << q.y() << " " << q.z() << " " << q.w() << endl;
+        }
+
+        // update scene (the scene integrates pose increments)
+        scene.setImage( frame->plotStereoFrame() );
+        scene.setPose( inverse_se3( T_last_w ) * T_f_w );
+        scene.updateScene();
+        T_last_w = T_f_w;
+
+        if( frame_counter > 0 )
+            StVO->updateFrame();
+        frame_counter++;
+    }
+
+    f.close();
+    Logger::instance().flush();
+    cout << endl << "Localized " << n_localized << " registrations over " << frame_counter << " frames, trajectory saved to pl-slam-loc" << endl;
+    delete StVO;
+
+    while( scene.isOpen() );
+    return 0;
+}
+
 void showHelp() {
     cout << endl << "Usage: ./imgPLSLAM <dataset_name> [options]" << endl
          << "Options:" << endl
@@ -0,0 +1,510 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+// Micro-benchmarks of the hot kernels, on synthetic inputs (fixed seed) and,
+// if an image pair is given, on a recorded stereo frame. Every benchmark is
+// run in batches for at least 0.2 s, five times, and the median time per
+// iteration is reported.
+
+#include <algorithm>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <random>
+
+#include <opencv2/highgui.hpp>
+
+#include <stereoFrame.h>
+#include <stereoFrameHandler.h>
+
+#include <mapFeatures.h>
+
+#include <config.h>
+#include <gridStructure.h>
+#include <matching.h>
+#include <poseGraph.h>
+#include <slamConfig.h>
+
+#include <g2o/core/jacobian_workspace.h>
+#include "../g2o_types/g2o_types.h"
+
+using namespace StVO;
+using namespace PLSLAM;
+
+struct MicroBenchArgs {
+    string filter, config_file, img_l, img_r, cam_params;
+    int n_features = 1000;
+};
+
+// results are accumulated here so the benchmarked calls are not optimized away
+static volatile double bench_sink = 0.0;
+
+void showHelp();
+bool getInputArgs(int argc, char **argv, MicroBenchArgs &args);
+
+void runBenchmark(const MicroBenchArgs &args, const string &name, const std::function<void()> &fn)
+{
+    if( !args.filter.empty() && name.find(args.filter) == string::npos )
+        return;
+
+    typedef std::chrono::steady_clock clock;
+    const double min_time = 0.2; // s
+
+    // grow the batch until it lasts min_time
+    long long iters = 1;
+    double elapsed = 0.0;
+    while( true )
+    {
+        clock::time_point t0 = clock::now();
+        for( long long i = 0; i < iters; i++ ) fn();
+        elapsed = std::chrono::duration<double>(clock::now() - t0).count();
+        if( elapsed >= min_time || iters >= (1LL << 30) ) break;
+        iters = elapsed > 0.0 ? std::max(iters * 2, (long long) (iters * 1.2 * min_time / elapsed)) : iters * 10;
+    }
+
+    vector<double> ns_iter(1, elapsed * 1e9 / iters);
+    for( int rep = 1; rep < 5; rep++ )
+    {
+        clock::time_point t0 = clock::now();
+        for( long long i = 0; i < iters; i++ ) fn();
+        ns_iter.push_back(std::chrono::duration<double>(clock::now() - t0).count() * 1e9 / iters);
+    }
+    std::sort(ns_iter.begin(), ns_iter.end());
+
+    cout << std::left << std::setw(56) << name << std::right << std::fixed << std::setprecision(1)
+         << std::setw(14) << ns_iter[2] << " ns" << std::setw(12) << iters << endl;
+}
+
+void randomDescriptors(std::mt19937 &rnd, int n, Mat &desc)
+{
+    std::uniform_int_distribution<int> byte(0, 255);
+    desc.create(n, 32, CV_8UC1);
+    for( int i = 0; i < n; i++ )
+        for( int j = 0; j < 32; j++ )
+            desc.at<uchar>(i,j) = (uchar) byte(rnd);
+}
+
+// copy of desc with a few flipped bits per row, so most rows have a clear match
+void noisyDescriptors(std::mt19937 &rnd, const Mat &desc, Mat &noisy)
+{
+    std::uniform_int_distribution<int> bit(0, 255);
+    noisy = desc.clone();
+    for( int i = 0; i < noisy.rows; i++ )
+        for( int k = 0; k < 12; k++ )
+        {
+            int b = bit(rnd);
+            noisy.at<uchar>(i, b / 8) ^= (uchar) (1 << (b % 8));
+        }
+}
+
+void syntheticBenchmarks(const MicroBenchArgs &args)
+{
+    std::mt19937 rnd(0);
+    const int n = args.n_features;
+    std::uniform_real_distribution<double> ux(0.0, GRID_COLS - 1), uy(0.0, GRID_ROWS - 1), noise(-0.5, 0.5);
+
+    Mat desc1, desc2;
+    randomDescriptors(rnd, n, desc1);
+    noisyDescriptors(rnd, desc1, desc2);
+
+    // points, in grid coordinates
+    vector<point_2d> pts1, pts2;
+    for( int i = 0; i < n; i++ )
+    {
+        double x = ux(rnd), y = uy(rnd);
+        pts1.push_back(std::make_pair((int) x, (int) y));
+        pts2.push_back(std::make_pair((int) (x + noise(rnd)), (int) (y + noise(rnd))));
+    }
+    GridStructure pt_grid(GRID_ROWS, GRID_COLS);
+    for( int i = 0; i < n; i++ )
+        pt_grid.add(pts2[i].first, pts2[i].second, i);
+    pt_grid.build();
+
+    // lines, in grid coordinates
+    vector<line_2d> lines1;
+    vector<std::pair<double, double>> directions2;
+    LineRowIndex ls_grid(GRID_ROWS, GRID_COLS);
+    std::uniform_real_distribution<double> len(2.0, 10.0), ang(-M_PI, M_PI);
+    for( int i = 0; i < n; i++ )
+    {
+        double x = ux(rnd), y = uy(rnd), l = len(rnd), a = ang(rnd);
+        double x2 = std::min(std::max(x + l * cos(a), 0.0), GRID_COLS - 1.0);
+        double y2 = std::min(std::max(y + l * sin(a), 0.0), GRID_ROWS - 1.0);
+        lines1.push_back(std::make_pair(std::make_pair((int) x, (int) y), std::make_pair((int) x2, (int) y2)));
+        std::pair<double, double> v(x2 - x, y2 - y);
+        if( dot(v, v) > 0.0 ) normalize(v); else v = std::make_pair(1.0, 0.0);
+        directions2.push_back(v);
+        ls_grid.add(x, y, x2, y2, i);
+    }
+    ls_grid.build();
+
+    GridWindow w;
+    w.width  = std::make_pair(Config::matchingF2FWs(), Config::matchingF2FWs());
+    w.height = std::make_pair(Config::matchingF2FWs(), Config::matchingF2FWs());
+
+    vector<int> matches_12;
+    runBenchmark(args, "matchNNR/" + to_string(n) + "x" + to_string(n), [&]() {
+        bench_sink = bench_sink + matchNNR(desc1, desc2, Config::minRatio12P(), matches_12);
+    });
+    runBenchmark(args, "match/" + to_string(n) + "x" + to_string(n), [&]() {
+        bench_sink = bench_sink + match(desc1, desc2, Config::minRatio12P(), matches_12);
+    });
+    runBenchmark(args, "matchGrid/points/" + to_string(n), [&]() {
+        bench_sink = bench_sink + matchGrid(pts1, desc1, pt_grid, desc2, w, matches_12);
+    });
+    runBenchmark(args, "matchGrid/lines/" + to_string(n), [&]() {
+        bench_sink = bench_sink + matchGrid(lines1, desc1, ls_grid, desc2, directions2, w, matches_12);
+    });
+
+    GridStructure grid(GRID_ROWS, GRID_COLS);
+    runBenchmark(args, "GridStructure/fill+build/" + to_string(n), [&]() {
+        grid.clear();
+        for( int i = 0; i < n; i++ )
+            grid.add(pts2[i].first, pts2[i].second, i);
+        grid.build();
+    });
+    LineRowIndex line_index(GRID_ROWS, GRID_COLS);
+    runBenchmark(args, "LineRowIndex/fill+build/" + to_string(n), [&]() {
+        line_index.clear();
+        for( int i = 0; i < n; i++ )
+            line_index.add(lines1[i].first.first, lines1[i].first.second, lines1[i].second.first, lines1[i].second.second, i);
+        line_index.build();
+    });
+    vector<int> indices;
+    runBenchmark(args, "GridStructure/query/" + to_string(n), [&]() {
+        size_t found = 0;
+        for( int i = 0; i < n; i++ )
+        {
+            indices.clear();
+            pt_grid.get(pts1[i].first, pts1[i].second, w, indices);
+            found += indices.size();
+        }
+        bench_sink = bench_sink + found;
+    });
+
+    // Plücker <-> orthonormal conversions
+    vector<Vector6d> plk(n);
+    vector<Vector4d> orth(n);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    for( int i = 0; i < n; i++ )
+    {
+        Vector3d P(gauss(rnd), gauss(rnd), 5.0 + gauss(rnd)), d(gauss(rnd), gauss(rnd), gauss(rnd));
+        d.normalize();
+        plk[i].head(3) = P.cross(d);
+        plk[i].tail(3) = d;
+        orth[i] = MapLine::changePlukerToOrth(plk[i]);
+    }
+    runBenchmark(args, "MapLine::changePlukerToOrth/" + to_string(n), [&]() {
+        double s = 0.0;
+        for( int i = 0; i < n; i++ ) s += MapLine::changePlukerToOrth(plk[i])(3);
+        bench_sink = bench_sink + s;
+    });
+    runBenchmark(args, "MapLine::changeOrthToPluker/" + to_string(n), [&]() {
+        double s = 0.0;
+        for( int i = 0; i < n; i++ ) s += MapLine::changeOrthToPluker(orth[i])(5);
+        bench_sink = bench_sink + s;
+    });
+}
+
+// residual and Jacobians of the g2o edges of the GBA, one landmark per edge seen from a single KF;
+// linearizeOplus goes through the Jacobian workspace as in g2o's buildSystem
+template<class Edge>
+void edgeBenchmarks(const MicroBenchArgs &args, const string &name, vector<std::unique_ptr<Edge>> &edges)
+{
+    g2o::JacobianWorkspace workspace;
+    for( auto &e : edges )
+        workspace.updateSize( e.get() );
+    workspace.allocate();
+
+    const int n = edges.size();
+    runBenchmark(args, name + "::computeError/" + to_string(n), [&]() {
+        double s = 0.0;
+        for( auto &e : edges )
+        {
+            e->computeError();
+            s += e->error()(0);
+        }
+        bench_sink = bench_sink + s;
+    });
+    runBenchmark(args, name + "::linearizeOplus/" + to_string(n), [&]() {
+        double s = 0.0;
+        for( auto &e : edges )
+        {
+            static_cast<g2o::OptimizableGraph::Edge*>( e.get() )->linearizeOplus( workspace );
+            s += workspace.workspaceForVertex(1)[0];
+        }
+        bench_sink = bench_sink + s;
+    });
+}
+
+void g2oEdgeBenchmarks(const MicroBenchArgs &args)
+{
+    std::mt19937 rnd(0);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    const int n = args.n_features;
+    const double fx = 450.0, fy = 450.0, cx = 320.0, cy = 240.0;
+
+    VertexLMPose pose;
+    Vector6d x_pose;
+    x_pose << 0.1, -0.05, 0.2, 0.01, 0.02, -0.03;
+    pose.setEstimate( expmap_se3(x_pose) );
+
+    // landmarks in front of the KF
+    vector<std::unique_ptr<VertexLMPointXYZ>> points;
+    vector<std::unique_ptr<VertexLMLineOrth>> lines_orth;
+    vector<std::unique_ptr<VertexLMLineEndpoints>> lines_endp;
+    for( int i = 0; i < n; i++ )
+    {
+        Vector3d P(gauss(rnd), gauss(rnd), 5.0 + gauss(rnd)), d(gauss(rnd), gauss(rnd), gauss(rnd));
+        d.normalize();
+        points.emplace_back( new VertexLMPointXYZ() );
+        points.back()->setEstimate( P );
+        Vector6d plk;
+        plk.head(3) = P.cross(d);
+        plk.tail(3) = d;
+        lines_orth.emplace_back( new VertexLMLineOrth() );
+        lines_orth.back()->setEstimate( MapLine::changePlukerToOrth(plk) );
+        Vector6d endp;
+        endp.head(3) = P - 0.5 * d;
+        endp.tail(3) = P + 0.5 * d;
+        lines_endp.emplace_back( new VertexLMLineEndpoints() );
+        lines_endp.back()->setEstimate( endp );
+    }
+
+    // noisy observations
+    vector<std::unique_ptr<EdgePosePoint>> pt_edges;
+    vector<std::unique_ptr<EdgePoseLine>> pluker_edges;
+    vector<std::unique_ptr<EdgePoseLineEndpoints>> endpoint_edges;
+    for( int i = 0; i < n; i++ )
+    {
+        pt_edges.emplace_back( new EdgePosePoint() );
+        pluker_edges.emplace_back( new EdgePoseLine() );
+        endpoint_edges.emplace_back( new EdgePoseLineEndpoints() );
+    }
+    for( int i = 0; i < n; i++ )
+    {
+        EdgePosePoint *e = pt_edges[i].get();
+        e->setVertex(0, points[i].get());
+        e->setVertex(1, &pose);
+        e->SetParams(fx, fy, cx, cy);
+        e->setMeasurement( Vector2d(cx + 100.0 * gauss(rnd), cy + 100.0 * gauss(rnd)) );
+        e->setInformation( Matrix2d::Identity() );
+
+        EdgePoseLine *el = pluker_edges[i].get();
+        el->setVertex(0, lines_orth[i].get());
+        el->setVertex(1, &pose);
+        el->SetParams(fx, fy, cx, cy);
+        el->setMeasurement( Vector4d(cx + 100.0 * gauss(rnd), cy + 100.0 * gauss(rnd), cx + 100.0 * gauss(rnd), cy + 100.0 * gauss(rnd)) );
+        el->setInformation( Matrix4d::Identity() );
+
+        EdgePoseLineEndpoints *ee = endpoint_edges[i].get();
+        ee->setVertex(0, lines_endp[i].get());
+        ee->setVertex(1, &pose);
+        ee->SetParams(fx, fy, cx, cy);
+        Vector3d l_obs(gauss(rnd), gauss(rnd), 0.0);
+        l_obs.head(2).normalize();
+        l_obs(2) = -l_obs(0) * cx - l_obs(1) * cy;
+        ee->setMeasurement( l_obs );
+        ee->setInformation( Matrix2d::Identity() );
+    }
+
+    edgeBenchmarks(args, "EdgePosePoint", pt_edges);
+    edgeBenchmarks(args, "EdgePoseLine", pluker_edges);
+    edgeBenchmarks(args, "EdgePoseLineEndpoints", endpoint_edges);
+}
+
+// ring of KFs with drifted odometry closed by two loops in turn, as the loop closure does on the
+// persistent graph (a loop that does not iterate would only keep the spanning tree guess)
+void poseGraphBenchmarks(const MicroBenchArgs &args)
+{
+    std::mt19937 rnd(0);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    const int n_kf = 200;
+
+    vector<Matrix4d> T_true(n_kf), T_drift(n_kf);
+    for( int i = 0; i < n_kf; i++ )
+    {
+        Vector6d x;
+        double a = 2.0 * M_PI * i / n_kf;
+        x << 20.0 * cos(a), 20.0 * sin(a), 0.0, 0.0, 0.0, a;
+        T_true[i] = expmap_se3(x);
+    }
+    vector<Vector6d> odom(n_kf);
+    T_drift[0] = T_true[0];
+    for( int i = 1; i < n_kf; i++ )
+    {
+        Vector6d noise;
+        for( int k = 0; k < 6; k++ ) noise(k) = ( k < 3 ? 0.02 : 0.002 ) * gauss(rnd);
+        odom[i] = logmap_se3( inverse_se3(T_true[i-1]) * T_true[i] ) + noise;
+        T_drift[i] = T_drift[i-1] * expmap_se3(odom[i]);
+    }
+
+    PoseGraph pose_graph;
+    auto closeLoop = [&](int i, int j) {
+        for( int k = 0; k < n_kf; k++ )
+            pose_graph.setVertex( k, T_drift[k], k == 0 );
+        pose_graph.addEdge( i, j, logmap_se3( inverse_se3(T_true[i]) * T_true[j] ), true );
+        int n_iters = pose_graph.optimize( i, SlamConfig::maxItersPGO(), SlamConfig::pgoMinGain() );
+        if( n_iters <= 0 && SlamConfig::maxItersPGO() > 0 )
+            throw std::runtime_error("[MicroBench] a loop on the persistent pose graph did not iterate");
+        return n_iters;
+    };
+    for( int i = 1; i < n_kf; i++ )
+    {
+        pose_graph.setVertex( i-1, T_drift[i-1], i == 1 );
+        pose_graph.setVertex( i, T_drift[i] );
+        pose_graph.addEdge( i-1, i, odom[i] );
+    }
+    closeLoop( 0, n_kf / 2 );
+    closeLoop( n_kf / 2, n_kf - 1 );
+
+    // the graph keeps both loops, each run restarts from the drifted guess
+    runBenchmark(args, "PoseGraph::optimize/loop/" + to_string(n_kf), [&]() {
+        bench_sink = bench_sink + closeLoop( n_kf / 2, n_kf - 1 );
+    });
+}
+
+void recordedBenchmarks(const MicroBenchArgs &args)
+{
+    Mat img_l = imread(args.img_l, CV_LOAD_IMAGE_UNCHANGED);
+    Mat img_r = imread(args.img_r, CV_LOAD_IMAGE_UNCHANGED);
+    if( img_l.empty() || img_r.empty() )
+        throw std::runtime_error("[MicroBench] Can't read the stereo pair");
+
+    PinholeStereoCamera cam(args.cam_params);
+    cam.rectifyImagesLR(img_l, img_l, img_r, img_r);
+    double llength_th = Config::minLineLength() * std::min(cam.getWidth(), cam.getHeight());
+
+    StereoFrame frame(img_l, img_r, 0, &cam, 0.0);
+    vector<KeyPoint> points_l, points_r;
+    vector<KeyLine> lines_l, lines_r;
+    Mat pdesc_l, pdesc_r, ldesc_l, ldesc_r;
+    if( Config::hasPoints() )
+    {
+        frame.detectPointFeatures(img_l, points_l, pdesc_l, Config::orbFastTh());
+        frame.detectPointFeatures(img_r, points_r, pdesc_r, Config::orbFastTh());
+    }
+    if( Config::hasLines() )
+    {
+        frame.detectLineFeatures(img_l, lines_l, ldesc_l, llength_th);
+        frame.detectLineFeatures(img_r, lines_r, ldesc_r, llength_th);
+    }
+
+    vector<KeyPoint> points;
+    vector<KeyLine> lines;
+    Mat desc;
+    if( Config::hasPoints() )
+    {
+        runBenchmark(args, "StereoFrame::detectPointFeatures", [&]() {
+            frame.detectPointFeatures(img_l, points, desc, Config::orbFastTh());
+        });
+        runBenchmark(args, "StereoFrame::matchStereoPoints/" + to_string(points_l.size()), [&]() {
+            Mat pdesc = pdesc_l.clone();
+            frame.matchStereoPoints(points_l, points_r, pdesc, pdesc_r, true);
+            bench_sink = bench_sink + frame.stereo_pt.size();
+        });
+    }
+    if( Config::hasLines() )
+    {
+        runBenchmark(args, "StereoFrame::detectLineFeatures", [&]() {
+            frame.detectLineFeatures(img_l, lines, desc, llength_th);
+        });
+        runBenchmark(args, "StereoFrame::matchStereoLines/" + to_string(lines_l.size()), [&]() {
+            Mat ldesc = ldesc_l.clone();
+            frame.matchStereoLines(lines_l, lines_r, ldesc, ldesc_r, true);
+            bench_sink = bench_sink + frame.stereo_ls.size();
+        });
+    }
+
+    // whole VO frame on the same pair: extraction, f2f matching and pose optimization
+    StereoFrameHandler handler(&cam);
+    handler.initialize(img_l, img_r, 0, 0.0);
+    int idx = 1;
+    runBenchmark(args, "StereoFrameHandler::insertStereoPair+optimizePose", [&]() {
+        handler.insertStereoPair(img_l, img_r, idx, (long double) idx);
+        handler.optimizePose();
+        handler.updateFrame();
+        idx++;
+    });
+}
+
+int main(int argc, char **argv)
+{
+    MicroBenchArgs args;
+    if (!getInputArgs(argc, argv, args)) {
+        showHelp();
+        return -1;
+    }
+
+    if (!args.config_file.empty()) SlamConfig::loadFromFile(args.config_file);
+
+    cout << std::left << std::setw(56) << "benchmark" << std::right << std::setw(17) << "time/iter" << std::setw(12) << "iterations" << endl;
+    syntheticBenchmarks(args);
+    g2oEdgeBenchmarks(args);
+    poseGraphBenchmarks(args);
+    if (!args.img_l.empty() && !args.img_r.empty() && !args.cam_params.empty())
+        recordedBenchmarks(args);
+
+    return 0;
+}
+
+void showHelp() {
+    cout << endl << "Usage: ./plslam_microbench [options]" << endl
+         << "Options:" << endl
+         << "\t-f Only run the benchmarks whose name contains this string" << endl
+         << "\t-n Number of synthetic features (default 1000)" << endl
+         << "\t-c Config file" << endl
+         << "\t-l Left image of a recorded stereo pair" << endl
+         << "\t-r Right image of a recorded stereo pair" << endl
+         << "\t-p Camera parameters of the recorded pair (dataset_params.yaml)" << endl
+         << endl;
+}
+
+bool getInputArgs(int argc, char **argv, MicroBenchArgs &args) {
+
+    if( (argc % 2) == 0 )
+        return false;
+
+    int nargs = (argc - 1) / 2;
+    for( int i = 0; i < nargs; i++ )
+    {
+        int j = 2*i + 1;
+        string opt(argv[j]), val(argv[j+1]);
+        if( opt == "-f" )
+            args.filter = val;
+        else if( opt == "-n" )
+            args.n_features = std::max(1, stoi(val));
+        else if( opt == "-c" )
+            args.config_file = val;
+        else if( opt == "-l" )
+            args.img_l = val;
+        else if( opt == "-r" )
+            args.img_r = val;
+        else if( opt == "-p" )
+            args.cam_params = val;
+        else
+            return false;
+    }
+
+    return true;
+}
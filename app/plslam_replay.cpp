@@ -0,0 +1,186 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+// Replay of the back-end from a front-end record (fe_record_file of plslam_dataset or
+// plslam_bench): the recorded KFs are fed to the MapHandler as the VO did, without images,
+// extraction or tracking, and the mapping latencies are written as a JSON document.
+
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <sys/resource.h>
+
+#include <mapHandler.h>
+
+#include <config.h>
+#include <frontEndRecord.h>
+#include <logger.h>
+#include <profiler.h>
+#include <threadRole.h>
+
+using namespace StVO;
+using namespace PLSLAM;
+
+struct ReplayArgs {
+    string record_file, config_file, json_file = "plslam_replay.json";
+    int threads = 0, multithread = -1;
+    unsigned int seed = 0;
+};
+
+void showHelp();
+bool getInputArgs(int argc, char **argv, ReplayArgs &args);
+
+int main(int argc, char **argv)
+{
+    ReplayArgs args;
+    if (!getInputArgs(argc, argv, args)) {
+        showHelp();
+        return -1;
+    }
+
+    if (!args.config_file.empty()) SlamConfig::loadFromFile(args.config_file);
+    if (args.multithread >= 0) SlamConfig::multithreadSLAM() = args.multithread > 0;
+
+    // reproducible runs: fixed thread count (before the first use of the pool) and seeds
+    Config::numWorkerThreads() = args.threads;
+    if (args.threads > 0) cv::setNumThreads(args.threads);
+    srand(args.seed);
+    cv::theRNG().state = args.seed == 0 ? 0xffffffff : args.seed;
+
+    Profiler::instance().setEnabled(true, !Config::traceFile().empty());
+    Logger::instance().setLevel(Config::logLevel());
+
+    FrontEndReplay* replay = NULL;
+    try {
+        replay = new FrontEndReplay(args.record_file);
+    }
+    catch (const std::runtime_error &e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
+
+    PinholeStereoCamera* cam_pin = replay->camera();
+    PLSLAM::MapHandler* map = new PLSLAM::MapHandler(cam_pin);
+    setupThread(THREAD_TRACKING);
+
+    Profiler &prof = Profiler::instance();
+    int n_kfs = 0;
+
+    double t_begin = prof.now();
+    for (int i = 0; i < replay->numFrames(); i++)
+    {
+        if (!replay->isKeyFrame(i))
+            continue;
+        double t_kf = prof.now();
+        if (n_kfs == 0)
+            map->initialize(replay->keyFrame(i, cam_pin, 0));
+        else
+            map->addKeyFrame(replay->keyFrame(i, cam_pin));
+        prof.addSample("Replay::keyFrame", t_kf, prof.now() - t_kf);
+        n_kfs++;
+    }
+    if (n_kfs == 0) {
+        cerr << args.record_file << " has no keyframes" << endl;
+        return -1;
+    }
+    map->finishSLAM();
+    double t_replay = prof.now() - t_begin;
+
+    double t_gba = prof.now();
+    map->globalBundleAdjustment();
+    prof.addSample("Replay::globalBundleAdjustment", t_gba, prof.now() - t_gba);
+    map->SaveKeyFrameTrajectoryTUM("pl-slam-replay");
+    if (!SlamConfig::mapSaveFile().empty())
+        map->saveMap(SlamConfig::mapSaveFile());
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // machine-readable report
+    ofstream out(args.json_file.c_str());
+    if (!out.is_open()) {
+        cerr << "Can't write " << args.json_file << endl;
+        return -1;
+    }
+    out << fixed << setprecision(4);
+    out << "{\"record\":\"" << args.record_file << "\""
+        << ",\"config\":\"" << args.config_file << "\""
+        << ",\"threads\":" << args.threads
+        << ",\"multithread\":" << (SlamConfig::multithreadSLAM() ? "true" : "false")
+        << ",\"seed\":" << args.seed
+        << ",\"frames\":" << replay->numFrames()
+        << ",\"keyframes\":" << n_kfs
+        << ",\"replay_s\":" << t_replay * 1e-6
+        << ",\"kf_per_s\":" << (t_replay > 0.0 ? n_kfs / (t_replay * 1e-6) : 0.0)
+        << ",\"peak_rss_mb\":" << usage.ru_maxrss / 1024.0;
+    out << ",\"profile\":";
+    prof.writeReportJSON(out);
+    out << "}" << endl;
+    out.close();
+
+    prof.printReport(cout);
+    if (prof.writeTrace(Config::traceFile()))
+        cout << "Stage trace written to " << Config::traceFile() << endl;
+    cout << "Replay report written to " << args.json_file << endl;
+
+    delete replay;
+    return 0;
+}
+
+void showHelp() {
+    cout << endl << "Usage: ./plslam_replay <record_file> [options]" << endl
+         << "Options:" << endl
+         << "\t-c Config file" << endl
+         << "\t-j JSON report file (default plslam_replay.json)" << endl
+         << "\t-t Number of worker threads (default 0, all the hardware threads)" << endl
+         << "\t-m Multithreaded mapping, 0 or 1 (default from the config, 0 replays deterministically)" << endl
+         << "\t-r Random seed (default 0)" << endl
+         << endl;
+}
+
+bool getInputArgs(int argc, char **argv, ReplayArgs &args) {
+
+    if( argc < 2 || (argc % 2) == 1 )
+        return false;
+
+    args.record_file = argv[1];
+    int nargs = argc/2 - 1;
+    for( int i = 0; i < nargs; i++ )
+    {
+        int j = 2*i + 2;
+        string opt(argv[j]), val(argv[j+1]);
+        if( opt == "-c" )
+            args.config_file = val;
+        else if( opt == "-j" )
+            args.json_file = val;
+        else if( opt == "-t" )
+            args.threads = stoi(val);
+        else if( opt == "-m" )
+            args.multithread = stoi(val);
+        else if( opt == "-r" )
+            args.seed = (unsigned int) stoul(val);
+        else
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,165 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+// Back-end of a split deployment: waits for a remote front-end (plslam_bench -R) on a TCP port,
+// runs the mapping, loop closure and GBA on its KFs and streams the corrected KF poses back; the
+// mapping latencies are written as a JSON document.
+
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <sys/resource.h>
+
+#include <mapHandler.h>
+#include <mapLink.h>
+
+#include <config.h>
+#include <logger.h>
+#include <profiler.h>
+#include <threadRole.h>
+
+using namespace StVO;
+using namespace PLSLAM;
+
+struct ServerArgs {
+    string config_file, json_file = "plslam_server.json";
+    int port = 0, threads = 0;
+};
+
+void showHelp();
+bool getInputArgs(int argc, char **argv, ServerArgs &args);
+
+int main(int argc, char **argv)
+{
+    ServerArgs args;
+    if (!getInputArgs(argc, argv, args)) {
+        showHelp();
+        return -1;
+    }
+
+    if (!args.config_file.empty()) SlamConfig::loadFromFile(args.config_file);
+    Config::numWorkerThreads() = args.threads;
+    if (args.threads > 0) cv::setNumThreads(args.threads);
+
+    Profiler::instance().setEnabled(true, !Config::traceFile().empty());
+    Logger::instance().setLevel(Config::logLevel());
+
+    cout << "Waiting for a front-end on port " << args.port << endl;
+    MapLinkServer* server = NULL;
+    try {
+        server = new MapLinkServer(args.port);
+    }
+    catch (const std::runtime_error &e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
+
+    PinholeStereoCamera* cam_pin = server->camera();
+    PLSLAM::MapHandler* map = new PLSLAM::MapHandler(cam_pin);
+    setupThread(THREAD_TRACKING);
+
+    Profiler &prof = Profiler::instance();
+    double t_begin = prof.now();
+    try {
+        server->run(map, cam_pin);
+    }
+    catch (const std::runtime_error &e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
+    double t_run = prof.now() - t_begin;
+    int n_kfs = server->numKeyFrames();
+    if (n_kfs == 0) {
+        cerr << "The front-end sent no keyframes" << endl;
+        return -1;
+    }
+
+    double t_gba = prof.now();
+    map->globalBundleAdjustment();
+    prof.addSample("Server::globalBundleAdjustment", t_gba, prof.now() - t_gba);
+    server->close();
+    map->SaveKeyFrameTrajectoryTUM("pl-slam-server");
+    if (!SlamConfig::mapSaveFile().empty())
+        map->saveMap(SlamConfig::mapSaveFile());
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // machine-readable report
+    ofstream out(args.json_file.c_str());
+    if (!out.is_open()) {
+        cerr << "Can't write " << args.json_file << endl;
+        return -1;
+    }
+    out << fixed << setprecision(4);
+    out << "{\"port\":" << args.port
+        << ",\"config\":\"" << args.config_file << "\""
+        << ",\"threads\":" << args.threads
+        << ",\"keyframes\":" << n_kfs
+        << ",\"run_s\":" << t_run * 1e-6
+        << ",\"peak_rss_mb\":" << usage.ru_maxrss / 1024.0;
+    out << ",\"profile\":";
+    prof.writeReportJSON(out);
+    out << "}" << endl;
+    out.close();
+
+    prof.printReport(cout);
+    if (prof.writeTrace(Config::traceFile()))
+        cout << "Stage trace written to " << Config::traceFile() << endl;
+    cout << "Server report written to " << args.json_file << endl;
+
+    delete server;
+    return 0;
+}
+
+void showHelp() {
+    cout << endl << "Usage: ./plslam_server <port> [options]" << endl
+         << "Options:" << endl
+         << "\t-c Config file" << endl
+         << "\t-j JSON report file (default plslam_server.json)" << endl
+         << "\t-t Number of worker threads (default 0, all the hardware threads)" << endl
+         << endl;
+}
+
+bool getInputArgs(int argc, char **argv, ServerArgs &args) {
+
+    if( argc < 2 || (argc % 2) == 1 )
+        return false;
+
+    args.port = stoi(argv[1]);
+    int nargs = argc/2 - 1;
+    for( int i = 0; i < nargs; i++ )
+    {
+        int j = 2*i + 2;
+        string opt(argv[j]), val(argv[j+1]);
+        if( opt == "-c" )
+            args.config_file = val;
+        else if( opt == "-j" )
+            args.json_file = val;
+        else if( opt == "-t" )
+            args.threads = stoi(val);
+        else
+            return false;
+    }
+
+    return true;
+}
@@ -12,6 +12,7 @@
 #include <g2o/solvers/eigen/linear_solver_eigen.h>
 #include <g2o/core/block_solver.h>
 #include <iostream>
+#include <plukerOrth.h>
 using namespace g2o;
 typedef g2o::LinearSolverEigen<g2o::BlockSolverX::PoseMatrixType> SlamLinearSolver;
 
@@ -49,124 +50,98 @@ public:
 };
 
 //line vertex
+//caches the Plücker coordinates of the estimate and their Jacobian wrt the orthonormal update,
+//shared by all the edges of the line
 class VertexLMLineOrth : public BaseVertex<4, Vector4d>
 {
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-    VertexLMLineOrth() : BaseVertex<4,Vector4d>() {};
+    VertexLMLineOrth() : BaseVertex<4,Vector4d>() { updateLineCache(); };
     virtual bool read(std::istream& is) { return true; };
     virtual bool write(std::ostream& os) const { return true; };
 
+    void setEstimate(const Vector4d& et) {
+        BaseVertex<4,Vector4d>::setEstimate(et);
+        updateLineCache();
+    }
+
+    virtual void pop() {
+        BaseVertex<4,Vector4d>::pop();
+        updateLineCache();
+    }
+
     virtual void setToOriginImpl() {
         _estimate.fill(0.);
+        updateLineCache();
     }
 
     virtual void oplusImpl(const double* update)
     {
         Eigen::Map<const Vector4d> delta(update);
-        Vector4d plusD;
-        updateOrthCoord(_estimate, delta, plusD);
-        _estimate = plusD;
-    }
-
-    inline void updateOrthCoord(const Vector4d& D, const Vector4d& deltaD, Vector4d& plusD){
-        // ref: 2001, Adrien Bartol,Peter Sturm ,Structure-From-Motion Using Lines: Representation, Triangulation and Bundle Adjustment
-
-        // theta --> U,  phi --> W
-        Eigen::Vector3d theta = D.head(3);
-
-        double phi = D(3);
-        //Vector3d theta = orth.head(3);
-        //double phi = orth[3];
-        double s1 = sin(theta[0]);
-        double c1 = cos(theta[0]);
-        double s2 = sin(theta[1]);
-        double c2 = cos(theta[1]);
-        double s3 = sin(theta[2]);
-        double c3 = cos(theta[2]);
-        Eigen::Matrix3d R;
-        R <<
-          c2 * c3,   s1 * s2 * c3 - c1 * s3,   c1 * s2 * c3 + s1 * s3,
-                c2 * s3,   s1 * s2 * s3 + c1 * c3,   c1 * s2 * s3 - s1 * c3,
-                -s2,                  s1 * c2,                  c1 * c2;
-        double w1 = cos(phi);
-        double w2 = sin(phi);
-
-        // update
-        Eigen::Vector3d _delta_theta = deltaD.head(3);
-        double _delta_phi = deltaD(3);
-        Eigen::Matrix3d Rz;
-        Rz << cos(_delta_theta(2)), -sin(_delta_theta(2)), 0,
-                sin(_delta_theta(2)), cos(_delta_theta(2)), 0,
-                0, 0, 1;
-
-        Eigen::Matrix3d Ry;
-        Ry << cos(_delta_theta(1)), 0., sin(_delta_theta(1)),
-                0., 1., 0.,
-                -sin(_delta_theta(1)), 0., cos(_delta_theta(1));
-
-        Eigen::Matrix3d Rx;
-        Rx << 1., 0., 0.,
-                0., cos(_delta_theta(0)), -sin(_delta_theta(0)),
-                0., sin(_delta_theta(0)), cos(_delta_theta(0));
-        R = R * Rx * Ry * Rz;
-
-        Eigen::Matrix2d W;
-        W << w1, -w2, w2, w1;
-        Eigen::Matrix2d delta_W;
-        delta_W << cos(_delta_phi), -sin(_delta_phi),sin(_delta_phi), cos(_delta_phi);
-        W = W * delta_W;
-
-        // U' -- > theta'. W' --> phi'
-
-        Eigen::Vector3d u1 = R.col(0);
-        Eigen::Vector3d u2 = R.col(1);
-        Eigen::Vector3d u3 = R.col(2);
-        plusD[0] = atan2( u2(2),u3(2) );
-        plusD[1] = asin( -u1(2) );
-        plusD[2] = atan2( u1(1),u1(0) );
-
-        plusD[3] = asin( W(1,0) );
-
-//////////////////////////////////////////////////////////
-        /*
-        // SO3参数方法，得到的雅克比更上面一样的。用上面的形式就OK。
-        Eigen::Map<const Eigen::Vector3d> theta(x);
-        double phi = *(x + 3);
-        double s1 = sin(theta[0]);
-        double c1 = cos(theta[0]);
-        double s2 = sin(theta[1]);
-        double c2 = cos(theta[1]);
-        double s3 = sin(theta[2]);
-        double c3 = cos(theta[2]);
-        Matrix3d R;
-        R <<
+        _estimate = PLSLAM::orthPlus(_estimate, delta);
+        updateLineCache();
+    }
+
+    const Vector6d& pluker() const { return _pluker; }
+    const Matrix<double,6,4>& jacobianPlukerOrth() const { return _jac_pluker_orth; }
+
+    // Plücker line (n = w1*u1, d = w2*u2) and its derivative wrt the update R*Rx*Ry*Rz, W*dW of oplusImpl
+    void updateLineCache() {
+        double s1 = sin(_estimate[0]);
+        double c1 = cos(_estimate[0]);
+        double s2 = sin(_estimate[1]);
+        double c2 = cos(_estimate[1]);
+        double s3 = sin(_estimate[2]);
+        double c3 = cos(_estimate[2]);
+        Eigen::Matrix3d U;
+        U <<
           c2 * c3,   s1 * s2 * c3 - c1 * s3,   c1 * s2 * c3 + s1 * s3,
                 c2 * s3,   s1 * s2 * s3 + c1 * c3,   c1 * s2 * s3 - s1 * c3,
                 -s2,                  s1 * c2,                  c1 * c2;
-
-        Sophus::SO3<double> U = Sophus::SO3<double>::exp(theta);
-        Sophus::SO3<double> U1(R);
-
-        std::cout << U.matrix() << "\n\n" <<U1.matrix()<<"\n\n"<<R<<"\n\n";
-
-        std::cout << theta <<"\n\n" << U1.log() << "\n\n"<<  Sophus::SO3<double>::exp(U1.log()).matrix() << "\n\n";
-         */
+        double w1 = cos(_estimate[3]);
+        double w2 = sin(_estimate[3]);
+
+        _pluker.head(3) = w1 * U.col(0);
+        _pluker.tail(3) = w2 * U.col(1);
+
+        _jac_pluker_orth.setZero();
+        _jac_pluker_orth.block<3,1>(0,1) = -w1 * U.col(2);
+        _jac_pluker_orth.block<3,1>(0,2) =  w1 * U.col(1);
+        _jac_pluker_orth.block<3,1>(0,3) = -w2 * U.col(0);
+        _jac_pluker_orth.block<3,1>(3,0) =  w2 * U.col(2);
+        _jac_pluker_orth.block<3,1>(3,2) = -w2 * U.col(0);
+        _jac_pluker_orth.block<3,1>(3,3) =  w1 * U.col(1);
     }
+
+protected:
+    Vector6d _pluker;
+    Matrix<double,6,4> _jac_pluker_orth;
 };
 
 //Pose Vertex
+//caches the rotation, translation and [t]x*R blocks of the Plücker transform of the estimate
 class VertexLMPose : public BaseVertex<6, Matrix4d>
 {
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-    VertexLMPose() : BaseVertex<6,Matrix4d>() {}
+    VertexLMPose() : BaseVertex<6,Matrix4d>() { updatePoseCache(); }
 
     virtual bool read(std::istream& is) { return true; };
     virtual bool write(std::ostream& os) const { return true; };
 
+    void setEstimate(const Matrix4d& et) {
+        BaseVertex<6,Matrix4d>::setEstimate(et);
+        updatePoseCache();
+    }
+
+    virtual void pop() {
+        BaseVertex<6,Matrix4d>::pop();
+        updatePoseCache();
+    }
+
     virtual void setToOriginImpl() {
         _estimate.setIdentity();
+        updatePoseCache();
     }
 
     virtual void oplusImpl(const double* update)  //左乘 平移在前，旋转在后
@@ -200,15 +175,31 @@ public:
         Matrix3d delta_rot = temp.toRotationMatrix();
         _estimate.block<3,3>(0,0) = delta_rot * _estimate.block<3,3>(0,0);
         _estimate.block<3,1>(0,3) += delta.head(3);
+        updatePoseCache();
+    }
+
+    const Matrix3d& rotation() const { return _R; }
+    const Vector3d& translation() const { return _t; }
+    const Matrix3d& translationHatRotation() const { return _tR; }
+
+    void updatePoseCache() {
+        _R  = _estimate.block<3,3>(0,0);
+        _t  = _estimate.block<3,1>(0,3);
+        _tR = ::vechat(_t) * _R;
     }
+
+protected:
+    Matrix3d _R, _tR;
+    Vector3d _t;
 };
 
+//reprojection error of a point, residual and Jacobians are evaluated in a single pass
 class EdgePosePoint : public BaseBinaryEdge<2, Vector2d, VertexLMPointXYZ, VertexLMPose>
 {
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-    EdgePosePoint() : BaseBinaryEdge<2, Vector2d, VertexLMPointXYZ, VertexLMPose>() {}
+    EdgePosePoint() : BaseBinaryEdge<2, Vector2d, VertexLMPointXYZ, VertexLMPose>(), _linearized(false) {}
 
     bool read(std::istream &is) { return true; }
 
@@ -222,89 +213,76 @@ public:
     }
 
     void computeError() {
-        Vector3d Pc = computePc();
-        Vector2d obs(_measurement);
-
-        _error = obs - cam_project(Pc);
-        //std::cout<<"_error: "<<_error<<std::endl;
+        evaluate(false);
     }
 
-    Vector3d computePc() {
-        const VertexLMPointXYZ *vPoint = dynamic_cast<const VertexLMPointXYZ *>(_vertices[0]);
-        const VertexLMPose *vPose = dynamic_cast<const VertexLMPose *>(_vertices[1]);
-
-        const Matrix4d &ns = vPose->estimate();
-        Matrix3d Rcw = ns.block<3,3>(0,0);
-        Vector3d Pcw = ns.block<3,1>(0,3);
-        const Vector3d &Pw = vPoint->estimate();
-
-        Vector3d Pc = Rcw * Pw + Pcw;
-
-        return Pc;
-        //Vector3d Pwc = Rwb*Pbc + Pwb;
-        //Matrix3d Rcw = (Rwb*Rbc).transpose();
-        //Vector3d Pcw = -Rcw*Pwc;
-        //Vector3d Pc = Rcw*Pw + Pcw;
+    virtual void linearizeOplus() {
+        if( !_linearized )
+            evaluate(true);
+        _linearized = false;
+        _jacobianOplusXi = _jac_i;
+        _jacobianOplusXj = _jac_j;
     }
 
-    inline Vector2d project2d(const Vector3d &v) const {
-        Vector2d res;
-        res(0) = v(0) / v(2);
-        res(1) = v(1) / v(2);
-        return res;
+    // evaluates the Jacobians ahead of the solver (e.g. all the edges in parallel before an
+    // iteration) into the matrices of the edge, the next linearizeOplus copies them to the
+    // Jacobian workspace of g2o (only mapped, and shared by the edges, during buildSystem)
+    void prepareLinearization() {
+        evaluate(true);
+        _linearized = true;
     }
 
-    Vector2d cam_project(const Vector3d &trans_xyz) const {
-        Vector2d proj = project2d(trans_xyz);
-        Vector2d res;
-        res[0] = proj[0] * fx + cx;
-        res[1] = proj[1] * fy + cy;
-        return res;
+    Vector3d computePc() const {
+        const VertexLMPointXYZ *vPoint = static_cast<const VertexLMPointXYZ *>(_vertices[0]);
+        const VertexLMPose *vPose = static_cast<const VertexLMPose *>(_vertices[1]);
+        return vPose->rotation() * vPoint->estimate() + vPose->translation();
     }
 
-    bool isDepthPositive() {
-        Vector3d Pc = computePc();
-        return Pc(2) > 0.0;
+    bool isDepthPositive() const {
+        return computePc()(2) > 0.0;
     }
 
-    //
-    virtual void linearizeOplus(){
-        const VertexLMPointXYZ *vPoint = dynamic_cast<const VertexLMPointXYZ *>(_vertices[0]);
-        const VertexLMPose *vPose = dynamic_cast<const VertexLMPose *>(_vertices[1]);
-
-        const Matrix3d Rot = vPose->estimate().block<3,3>(0,0);
-        const Vector3d Trans = vPose->estimate().block<3,1>(0,3);
+protected:
 
-        const Vector3d Pw = vPoint->estimate();
+    void evaluate(bool jacobians) {
+        const VertexLMPointXYZ *vPoint = static_cast<const VertexLMPointXYZ *>(_vertices[0]);
+        const VertexLMPose *vPose = static_cast<const VertexLMPose *>(_vertices[1]);
 
-        Vector3d Pc = computePc();
+        const Vector3d RPw = vPose->rotation() * vPoint->estimate();
+        const Vector3d Pc  = RPw + vPose->translation();
 
-        double x = Pc(0);
-        double y = Pc(1);
-        double z = Pc(2);
-        double invz = 1.0 / z;
-        double invz2 = invz * invz;
+        double invz = 1.0 / Pc(2);
+        double u = Pc(0) * invz;
+        double v = Pc(1) * invz;
+        _error(0) = _measurement(0) - ( fx * u + cx );
+        _error(1) = _measurement(1) - ( fy * v + cy );
+        if( !jacobians )
+            return;
 
         Matrix<double,2,3> jac_pixel_cam;
-        jac_pixel_cam << fx / z, 0, -fx * x * invz2,
-                         0, fy / z, -fy * y * invz2;
+        jac_pixel_cam << fx * invz, 0, -fx * u * invz,
+                         0, fy * invz, -fy * v * invz;
 
-        _jacobianOplusXi = - jac_pixel_cam * Rot;
-
-        _jacobianOplusXj.block<2,3>(0,0) = - jac_pixel_cam;
-        _jacobianOplusXj.block<2,3>(0,3) = - jac_pixel_cam * (- ::vechat(Rot*Pw));
+        // left perturbation of the pose: translation first, then rotation (see VertexLMPose::oplusImpl)
+        _jac_i = - jac_pixel_cam * vPose->rotation();
+        _jac_j.block<2,3>(0,0) = - jac_pixel_cam;
+        _jac_j.block<2,3>(0,3) = jac_pixel_cam * ::vechat(RPw);
     }
 
-protected:
     double fx, fy, cx, cy;
+    bool _linearized;
+    Matrix<double,2,3> _jac_i;
+    Matrix<double,2,6> _jac_j;
 };
 
+//point-to-line distance of the observed endpoints to the projected Plücker line, residual and
+//Jacobians are evaluated in a single pass from the quantities cached by the vertices
 class EdgePoseLine : public BaseBinaryEdge<4, Vector4d, VertexLMLineOrth, VertexLMPose>
 {
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-    EdgePoseLine() : BaseBinaryEdge<4, Vector4d, VertexLMLineOrth, VertexLMPose>() {}
+    EdgePoseLine() : BaseBinaryEdge<4, Vector4d, VertexLMLineOrth, VertexLMPose>(), _linearized(false) {}
 
     bool read(std::istream &is) { return true; }
 
@@ -315,190 +293,169 @@ public:
         fy = fy_;
         cx = cx_;
         cy = cy_;
+        plukerK << fy,     0,      0,
+                0,      fx,     0,
+                -fy*cx, -fx*cy, fx*fy;
     }
 
     void computeError() {
-        const VertexLMLineOrth* vLine = dynamic_cast<const VertexLMLineOrth* >(_vertices[0]);
-        const VertexLMPose* vPose = dynamic_cast<const VertexLMPose* >(_vertices[1]);
+        evaluate(false);
+    }
+
+    virtual void linearizeOplus() {
+        if( !_linearized )
+            evaluate(true);
+        _linearized = false;
+        _jacobianOplusXi = _jac_i;
+        _jacobianOplusXj = _jac_j;
+    }
 
-        const Vector4d obs(_measurement);
+    // evaluates the Jacobians ahead of the solver (e.g. all the edges in parallel before an
+    // iteration) into the matrices of the edge, the next linearizeOplus copies them to the
+    // Jacobian workspace of g2o (only mapped, and shared by the edges, during buildSystem)
+    void prepareLinearization() {
+        evaluate(true);
+        _linearized = true;
+    }
 
-        const Matrix4d Tcw = vPose->estimate();
-        const Vector4d Lw = vLine->estimate();
+protected:
 
-        Vector6d plukerLw = changeOrthToPluker(Lw);
-        Vector6d plukerLc = getTransformMatrix(Tcw) * plukerLw;
+    void evaluate(bool jacobians) {
+        const VertexLMLineOrth* vLine = static_cast<const VertexLMLineOrth* >(_vertices[0]);
+        const VertexLMPose* vPose = static_cast<const VertexLMPose* >(_vertices[1]);
+
+        const Vector6d &Lw = vLine->pluker();
+        const Matrix3d &Rcw = vPose->rotation();
+
+        // only the normal of the Plücker line in the camera frame is projected
+        const Vector3d Rnw = Rcw * Lw.head<3>();
+        const Vector3d dc  = Rcw * Lw.tail<3>();
+        const Vector3d nc  = Rnw + vPose->translationHatRotation() * Lw.tail<3>();
+        const Vector3d l   = plukerK * nc;
+
+        double inv_norm  = 1.0 / sqrt( l(0)*l(0) + l(1)*l(1) );
+        double inv_norm2 = inv_norm * inv_norm;
+        const Vector4d &obs = _measurement;
+        double e0 = ( l(0) * obs(0) + l(1) * obs(1) + l(2) ) * inv_norm;
+        double e1 = ( l(0) * obs(2) + l(1) * obs(3) + l(2) ) * inv_norm;
+        _error << e0, e1, 0, 0;
+        if( !jacobians )
+            return;
+
+        Matrix<double,2,3> jac_err_l;
+        jac_err_l << obs(0) * inv_norm - l(0) * e0 * inv_norm2, obs(1) * inv_norm - l(1) * e0 * inv_norm2, inv_norm,
+                     obs(2) * inv_norm - l(0) * e1 * inv_norm2, obs(3) * inv_norm - l(1) * e1 * inv_norm2, inv_norm;
+        const Matrix<double,2,3> jac_err_nc = jac_err_l * plukerK;
+
+        // pose: nc' = Exp(phi)*R*nw + [t+rho]x*Exp(phi)*R*dw
+        const Matrix3d dc_hat = ::vechat(dc);
+        _jac_j.setZero();
+        _jac_j.block<2,3>(0,0) = - jac_err_nc * dc_hat;
+        _jac_j.block<2,3>(0,3) = - jac_err_nc * ( ::vechat(Rnw) + ::vechat(vPose->translation()) * dc_hat );
+
+        // line: nc = [R, [t]x*R] * Lw
+        Matrix<double,2,6> jac_err_lw;
+        jac_err_lw.block<2,3>(0,0) = jac_err_nc * Rcw;
+        jac_err_lw.block<2,3>(0,3) = jac_err_nc * vPose->translationHatRotation();
+        _jac_i.setZero();
+        _jac_i.block<2,4>(0,0) = jac_err_lw * vLine->jacobianPlukerOrth();
+    }
 
-        Vector3d plukerLcPixel = getPlukerK() * plukerLc.head(3);
-        double lx = plukerLcPixel(0);
-        double ly = plukerLcPixel(1);
-        double lz = plukerLcPixel(2);
+    double fx,fy,cx,cy;
+    Matrix3d plukerK;
+    bool _linearized;
+    Matrix<double,4,4> _jac_i;
+    Matrix<double,4,6> _jac_j;
 
-        double fenmu = sqrt( lx*lx + ly*ly);
+};
 
-        Vector4d error;
-        error(0) = ( lx * obs(0) + ly * obs(1) + lz ) / fenmu;
-        error(1) = ( lx * obs(2) + ly * obs(3) + lz ) / fenmu;
-        error(2) = 0;
-        error(3) = 0;
+//endpoint line vertex (3D start and end points)
+class VertexLMLineEndpoints : public BaseVertex<6, Vector6d>
+{
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    VertexLMLineEndpoints() : BaseVertex<6,Vector6d>() {};
+    virtual bool read(std::istream& is) { return true; };
+    virtual bool write(std::ostream& os) const { return true; };
 
-        _error = error;
-       // std::cout<<"_error: "<<_error.transpose()<<std::endl;
+    virtual void setToOriginImpl() {
+        _estimate.fill(0.);
     }
 
-    Matrix3d getPlukerK(){
-        Matrix3d plukerK;
-        plukerK << fy,     0,      0,
-                0,      fx,     0,
-                -fy*cx, -fx*cy, fx*fy;
-        return plukerK;
+    virtual void oplusImpl(const double* update)
+    {
+        Eigen::Map<const Vector6d> v(update);
+        _estimate += v;
     }
+};
 
-    Matrix6d getTransformMatrix(const Matrix4d& T){
-        Matrix6d temp;
-        temp.setZero();
-        temp.block<3,3>(0,0) = T.block<3,3>(0,0);
-        temp.block<3,3>(0,3) = ::vechat(T.block<3,1>(0,3)) * T.block<3,3>(0,0);
-        temp.block<3,3>(3,3) = T.block<3,3>(0,0);
+//distance of the projected endpoints to the observed 2D line (normalized line equation)
+class EdgePoseLineEndpoints : public BaseBinaryEdge<2, Vector3d, VertexLMLineEndpoints, VertexLMPose>
+{
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-        return temp;
-    }
+    EdgePoseLineEndpoints() : BaseBinaryEdge<2, Vector3d, VertexLMLineEndpoints, VertexLMPose>(), _linearized(false) {}
 
-    Vector6d changeOrthToPluker(const Vector4d& orthLine ){
-        double s1 = sin(orthLine[0]);
-        double c1 = cos(orthLine[0]);
-        double s2 = sin(orthLine[1]);
-        double c2 = cos(orthLine[1]);
-        double s3 = sin(orthLine[2]);
-        double c3 = cos(orthLine[2]);
-        Eigen::Matrix3d R;
-        R <<
-          c2 * c3,   s1 * s2 * c3 - c1 * s3,   c1 * s2 * c3 + s1 * s3,
-                c2 * s3,   s1 * s2 * s3 + c1 * c3,   c1 * s2 * s3 - s1 * c3,
-                -s2,                  s1 * c2,                  c1 * c2;
+    bool read(std::istream &is) { return true; }
 
-        double w1 = cos(orthLine[3]);
-        double w2 = sin(orthLine[3]);
+    bool write(std::ostream &os) const { return true; }
 
-        Vector6d plukerLine;
-        plukerLine.head(3) = w1 * R.col(0);
-        plukerLine.tail(3) = w2 * R.col(1);
-        return plukerLine;
+    void SetParams(const double &fx_, const double &fy_, const double &cx_, const double &cy_) {
+        fx = fx_;
+        fy = fy_;
+        cx = cx_;
+        cy = cy_;
+    }
+
+    void computeError() {
+        evaluate(false);
     }
 
     virtual void linearizeOplus() {
-        const VertexLMLineOrth* vLine = dynamic_cast<const VertexLMLineOrth* >(_vertices[0]);
-        const VertexLMPose* vPose = dynamic_cast<const VertexLMPose* >(_vertices[1]);
-
-        const Vector4d obs(_measurement);
-
-        const Matrix4d Tcw = vPose->estimate();
-        const Vector4d Lw = vLine->estimate();
-
-        const Matrix3d Rcw = Tcw.block<3,3>(0,0);
-        const Vector3d Pcw = Tcw.block<3,1>(0,3);
-
-        Vector6d plukerLw = changeOrthToPluker(Lw);
-        Vector6d plukerLc = getTransformMatrix(Tcw) * plukerLw;
-
-        Vector3d plukerLcPixel = getPlukerK() * plukerLc.head(3);
-        double lx = plukerLcPixel(0);
-        double ly = plukerLcPixel(1);
-        double lz = plukerLcPixel(2);
-        double fenmu = sqrt(lx*lx + ly*ly);
-
-        Vector2d error;
-        error(0) = ( lx * obs(0) + ly * obs(1) + lz ) / fenmu;
-        error(1) = ( lx * obs(2) + ly * obs(3) + lz ) / fenmu;
-
-        Matrix<double,1,3> jac_err0_lcPixel;
-        jac_err0_lcPixel << -lx * error(0) / (fenmu*fenmu) + obs(0) /fenmu,
-                            -ly * error(0) / (fenmu*fenmu) + obs(1) /fenmu,
-                            1.0 / fenmu;
-        Matrix<double,1,3> jac_err1_lcPixel;
-        jac_err1_lcPixel << -lx * error(1) / (fenmu*fenmu) + obs(2) /fenmu,
-                -ly * error(1) / (fenmu*fenmu) + obs(3) /fenmu,
-                1.0 / fenmu;
-
-        Matrix<double,3,6> jac_lcPixel_lc;
-        jac_lcPixel_lc.setZero();
-        jac_lcPixel_lc.block<3,3>(0,0) = getPlukerK();
-
-        Matrix<double,6,6> jac_lc_rt;
-        jac_lc_rt.setZero();
-        jac_lc_rt.block<3,3>(0,0) = - vechat(Rcw*Lw.tail(3));
-        jac_lc_rt.block<3,3>(0,3) = - vechat(Rcw*Lw.head(3)) - vechat(Pcw) * vechat(Rcw*Lw.tail(3));
-
-        Matrix<double,4,6> jac_error_pose;
-        jac_error_pose.block<1,6>(0,0) = jac_err0_lcPixel * jac_lcPixel_lc * jac_lc_rt;
-        jac_error_pose.block<1,6>(1,0) = jac_err1_lcPixel * jac_lcPixel_lc * jac_lc_rt;
-        jac_error_pose.block<2,6>(2,0) = Matrix<double,2,6>::Zero();
-        _jacobianOplusXj = jac_error_pose;
-
-        Matrix<double,6,6> jac_lc_lw;
-        jac_lc_lw = getTransformMatrix(Tcw);
-
-        Matrix3d U = getOrhtRFromPluker(plukerLw);
-        Matrix2d W = getOrthWFromPluker(plukerLw);
-
-        Matrix<double,6,4> jac_lw_orth;
-        jac_lw_orth = jacobianFromPlukerToOrth(U, W);
-
-        Matrix<double,4,4> jac_error_orth;
-        jac_error_orth.block<1,4>(0,0) = jac_err0_lcPixel * jac_lcPixel_lc * jac_lc_lw * jac_lw_orth;
-        jac_error_orth.block<1,4>(1,0) = jac_err1_lcPixel * jac_lcPixel_lc * jac_lc_lw * jac_lw_orth;
-        jac_error_orth.block<2,4>(2,0) = Matrix<double,2,4>::Zero();
-        _jacobianOplusXi = jac_error_orth;
-
-    }
-
-    Matrix<double,6,4> jacobianFromPlukerToOrth(const Matrix3d& u, const Matrix2d& w){
-        double w1 = w(0,0);
-        double w2 = w(1,0);
-        Vector3d u1 = u.col(0);
-        Vector3d u2 = u.col(1);
-        Vector3d u3 = u.col(2);
-        Matrix<double,6,4> temp;
-        temp.setZero();
-        temp.block<3,1>(0,1) = -w1 * u3;
-        temp.block<3,1>(0,2) = w1 * u2;
-        temp.block<3,1>(0,3) = -w2 * u1;
-        temp.block<3,1>(3,0) = w2 * u3;
-        temp.block<3,1>(3,2) = -w2 * u1;
-        temp.block<3,1>(3,3) = w1 * u2;
-        return temp;
-    }
-
-    Matrix2d getOrthWFromPluker(const Vector6d& plukerLine)
-    {
-        Matrix2d temp;
-        double nnorm = plukerLine.head(3).norm();
-        double dnorm = plukerLine.tail(3).norm();
-        double fenmu = sqrt(nnorm*nnorm + dnorm*dnorm);
-        temp << nnorm / fenmu, -dnorm / fenmu, dnorm / fenmu, nnorm / fenmu;
-        return temp;
+        if( !_linearized )
+            evaluate(true);
+        _linearized = false;
+        _jacobianOplusXi = _jac_i;
+        _jacobianOplusXj = _jac_j;
     }
 
-    Matrix3d getOrhtRFromPluker(const Vector6d &plukerLine)
-    {
-        Matrix3d R;
-        Vector3d n = plukerLine.head(3);
-        Vector3d d = plukerLine.tail(3);
-        Vector3d n0 = n;
-        Vector3d d0 = d;
-        n.normalize();
-        d.normalize();
-        R.col(0) = n;
-        R.col(1) = d;
-        R.col(2) = n0.cross(d0) / (n0.cross(d0).norm());
-        return R;
+    // same as EdgePosePoint::prepareLinearization
+    void prepareLinearization() {
+        evaluate(true);
+        _linearized = true;
     }
 
+protected:
 
+    void evaluate(bool jacobians) {
+        const VertexLMLineEndpoints* vLine = static_cast<const VertexLMLineEndpoints* >(_vertices[0]);
+        const VertexLMPose* vPose = static_cast<const VertexLMPose* >(_vertices[1]);
 
-protected:
-    double fx,fy,cx,cy;
+        const Vector3d &l = _measurement;
+        for( int k = 0; k < 2; k++ )
+        {
+            const Vector3d RPw = vPose->rotation() * vLine->estimate().segment<3>(3*k);
+            const Vector3d Pc  = RPw + vPose->translation();
+            double invz = 1.0 / Pc(2);
+            double u = Pc(0) * invz;
+            double v = Pc(1) * invz;
+            _error(k) = l(0) * ( fx * u + cx ) + l(1) * ( fy * v + cy ) + l(2);
+            if( !jacobians )
+                continue;
+
+            Matrix<double,1,3> jac_err_cam;
+            jac_err_cam << l(0) * fx * invz, l(1) * fy * invz, - ( l(0) * fx * u + l(1) * fy * v ) * invz;
+            _jac_i.block<1,3>(k,3*k)     = jac_err_cam * vPose->rotation();
+            _jac_i.block<1,3>(k,3*(1-k)) = Matrix<double,1,3>::Zero();
+            _jac_j.block<1,3>(k,0)       = jac_err_cam;
+            _jac_j.block<1,3>(k,3)       = - jac_err_cam * ::vechat(RPw);
+        }
+    }
 
+    double fx, fy, cx, cy;
+    bool _linearized;
+    Matrix<double,2,6> _jac_i, _jac_j;
 };
 
 
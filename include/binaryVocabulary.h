@@ -0,0 +1,102 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <DBoW2/TemplatedVocabulary.h>
+#include <DBoW2/FORB.h>
+
+namespace PLSLAM {
+
+// Binary vocabulary file (little endian, every table 8-byte aligned):
+//
+//   VocFileHeader | VocNodeRecord[num_nodes] | uint32 word -> node[num_words] | descriptors[num_nodes]
+//
+// Node 0 is the root. The descriptors of a mapped file are used in place, only the tree links
+// are rebuilt at load time, so loading avoids the text parsing of the YAML vocabularies.
+static const char     VOC_FILE_MAGIC[8]  = { 'P', 'L', 'S', 'L', 'V', 'O', 'C', '\0' };
+static const uint32_t VOC_FILE_VERSION   = 1;
+static const uint32_t VOC_FILE_ENDIAN    = 0x01020304;
+
+struct VocFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;
+    int32_t  k, L;
+    int32_t  scoring, weighting;
+    uint64_t num_nodes;
+    uint64_t num_words;
+    uint64_t desc_bytes;
+};
+
+struct VocNodeRecord {
+    uint32_t parent;
+    uint32_t word_id;                   // VOC_NO_WORD for inner nodes
+    double   weight;
+};
+
+static const uint32_t VOC_NO_WORD = 0xffffffff;
+
+static_assert(sizeof(VocFileHeader) == 56, "unexpected vocabulary record layout");
+static_assert(sizeof(VocNodeRecord) == 16, "unexpected vocabulary record layout");
+
+// ORB vocabulary that can also be stored in (and mapped from) the binary format above
+class BinaryVocabulary : public DBoW2::TemplatedVocabulary<DBoW2::FORB::TDescriptor, DBoW2::FORB>
+{
+
+public:
+
+    BinaryVocabulary() { }
+
+    // loads a binary or a text/YAML vocabulary (detected from the file magic)
+    void loadFromFile( const std::string &filename );
+
+    // throw std::runtime_error on I/O errors or invalid files
+    void loadBinary( const std::string &filename );
+    void saveBinary( const std::string &filename ) const;
+
+    static bool isBinary( const std::string &filename );
+
+    // BoW vector and direct index (nodes levelsup levels above the words) of the rows of desc,
+    // same result as the vector<Mat> transform without copying the rows to a vector
+    void transformRows( const cv::Mat &desc, DBoW2::BowVector &v, DBoW2::FeatureVector &fv, int levelsup ) const;
+
+    // heap bytes of the tree (the descriptors of a binary vocabulary stay in the file mapping)
+    size_t memoryUsage() const;
+
+    // process-wide read-only instance of the vocabulary of filename, loaded by its first user and
+    // released with the last one (several SLAM instances of a process share it)
+    static std::shared_ptr<const BinaryVocabulary> shared( const std::string &filename );
+
+private:
+
+    struct MappedFile;
+    std::shared_ptr<const MappedFile> mapping;   // keeps the mapped descriptors alive (shared by copies)
+
+};
+
+}
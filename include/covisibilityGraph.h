@@ -0,0 +1,121 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <unordered_map>
+#include <vector>
+
+namespace PLSLAM {
+
+// Symmetric weighted graph stored as adjacency lists, so memory and updates
+// scale with the number of edges instead of (#KFs)^2. Nodes are KF indices;
+// an edge is removed as soon as its weight drops to zero.
+template<typename T>
+class WeightedGraph {
+public:
+
+    typedef std::unordered_map<int, T> Adjacency;
+
+    int size() const { return static_cast<int>(adj.size()); }
+
+    void resize(int n) { adj.resize(n); }
+
+    void addNode() { adj.emplace_back(); }
+
+    void clear() { adj.clear(); }
+
+    T weight(int i, int j) const {
+        if (i < 0 || i >= size()) return T(0);
+        typename Adjacency::const_iterator it = adj[i].find(j);
+        return (it == adj[i].end()) ? T(0) : it->second;
+    }
+
+    void setWeight(int i, int j, T w) {
+        set(i, j, w);
+        if (i != j) set(j, i, w);
+    }
+
+    void increaseWeight(int i, int j, T w = T(1)) {
+        adj[i][j] += w;
+        if (i != j) adj[j][i] += w;
+    }
+
+    // weights never go below zero (the dense unsigned version silently wrapped)
+    void decreaseWeight(int i, int j, T w = T(1)) {
+        decrease(i, j, w);
+        if (i != j) decrease(j, i, w);
+    }
+
+    const Adjacency& neighbors(int i) const { return adj[i]; }
+
+    // remove every edge incident to i
+    void clearNode(int i) {
+        for (typename Adjacency::const_iterator it = adj[i].begin(); it != adj[i].end(); ++it)
+            if (it->first != i) adj[it->first].erase(i);
+        adj[i].clear();
+    }
+
+    std::size_t numEdges() const {
+        std::size_t n = 0;
+        for (const Adjacency &a : adj) n += a.size();
+        return n;
+    }
+
+    // heap bytes estimate: buckets plus one node (entry and next pointer) per edge
+    std::size_t memoryUsage() const {
+        std::size_t n = adj.capacity() * sizeof(Adjacency);
+        for (const Adjacency &a : adj)
+            n += a.bucket_count() * sizeof(void*) + a.size() * (sizeof(typename Adjacency::value_type) + sizeof(void*));
+        return n;
+    }
+
+    // dense export, only intended for debugging / visualization of small maps
+    std::vector<std::vector<T>> denseExport() const {
+        std::vector<std::vector<T>> dense(adj.size(), std::vector<T>(adj.size(), T(0)));
+        for (std::size_t i = 0; i < adj.size(); ++i)
+            for (typename Adjacency::const_iterator it = adj[i].begin(); it != adj[i].end(); ++it)
+                dense[i][it->first] = it->second;
+        return dense;
+    }
+
+private:
+
+    void set(int i, int j, T w) {
+        if (w == T(0)) adj[i].erase(j);
+        else adj[i][j] = w;
+    }
+
+    void decrease(int i, int j, T w) {
+        typename Adjacency::iterator it = adj[i].find(j);
+        if (it == adj[i].end()) return;
+        if (it->second <= w) adj[i].erase(it);
+        else it->second -= w;
+    }
+
+    std::vector<Adjacency> adj;
+};
+
+typedef WeightedGraph<unsigned int> CovisibilityGraph;   // number of common landmarks between KFs
+
+} // namespace PLSLAM
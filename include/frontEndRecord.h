@@ -0,0 +1,96 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <string>
+
+//Eigen
+#include <eigen3/Eigen/Core>
+
+#include <mapSerialization.h>
+
+class PinholeStereoCamera;
+namespace StVO {
+class StereoFrame;
+}
+
+namespace PLSLAM {
+
+class KeyFrame;
+
+// Front-end records: the output of the VO (pose wrt the previous KF and KF decision of every tracked
+// frame, plus the stereo features and descriptors of the KFs) in the container of the map files
+// (MAP_SEC_META with the camera, MAP_SEC_REC_FRAMES), so the back-end can be replayed from the KFs
+// the MapHandler received without running the extraction and tracking again.
+
+// Collects the frames of a sequence in memory and writes them at the end (tracking thread only).
+class FrontEndRecorder {
+public:
+
+    explicit FrontEndRecorder(const PinholeStereoCamera *cam);
+
+    // to be called before currFrameIsKF, which resets the pose of the frame
+    void addFrame(const StVO::StereoFrame *frame, bool is_kf);
+
+    int numFrames() const { return n_frames; }
+    int numKeyFrames() const { return n_kfs; }
+
+    // throws std::runtime_error if the file cannot be written
+    void write(const std::string &file) const;
+
+private:
+
+    MapFileWriter out;
+    int n_frames, n_kfs;
+};
+
+// Reads a front-end record and rebuilds the KFs of the MapHandler from it.
+class FrontEndReplay {
+public:
+
+    // throws std::runtime_error on I/O errors or if the file is not a front-end record
+    explicit FrontEndReplay(const std::string &file);
+
+    // camera of the record, owned by the caller
+    PinholeStereoCamera* camera() const;
+
+    int numFrames() const { return int(n_frames); }
+    bool isKeyFrame(int i) const { return frames[i].is_kf != 0; }
+    int frameIdx(int i) const { return frames[i].frame_idx; }
+    long double time(int i) const { return frames[i].t; }
+    Eigen::Matrix4d pose(int i) const { return Eigen::Map<const Eigen::Matrix4d>(frames[i].Tfw); }
+
+    // KF of frame i (pose wrt the previous KF, as the KFs of the VO), without images so it is compact as
+    // the KFs of a loaded map; throws std::runtime_error if the frame is not a KF
+    KeyFrame* keyFrame(int i, PinholeStereoCamera *cam, int kf_idx = -1) const;
+
+private:
+
+    MapFileReader in;
+    const MapMetaRecord *meta;
+    const MapRecFrameRecord *frames;
+    uint64_t n_frames;
+};
+
+} // namespace PLSLAM
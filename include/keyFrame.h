@@ -22,6 +22,8 @@
 
 #pragma once
 #include <vector>
+#include <atomic>
+#include <future>
 #include <eigen3/Eigen/Core>
 #include <opencv/cv.h>
 
@@ -53,27 +55,56 @@ public:
 
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-    KeyFrame() { }
+    KeyFrame() : reduced(false), rig(0), rig_kf(-1), has_prior(false), t_queued(-1.0), bow_pending(false) { }
     KeyFrame( const StVO::StereoFrame* sf );
     KeyFrame( const StVO::StereoFrame* sf, int kf_idx_ );
     ~KeyFrame();
 
     Mat plotKeyFrame();
 
+    // drops the images, right descriptors and raw keypoints, keeping a thumbnail
+    void makeCompact( double thumbnail_scale );
+
+    // images (with the thumbnail) and features of the KF, BoW vectors included
+    StVO::FrameMemory memoryUsage() const;
+
     bool     local;
+    int      local_epoch;     // last local map epoch this KF was added to
+
+    bool     compact;         // images released (see makeCompact)
+    double   thumbnail_scale;
+    Mat      thumbnail;
+
+    bool     reduced;         // pose-graph-only KF (pg_retention_kfs): landmarks dropped, features kept for the LC
 
     int       f_idx;
     string    img_name;
 
     int      kf_idx;
+    int      rig;             // stereo rig of the platform (MapHandler::addRig), 0 for the map camera
+    int      rig_kf;          // index among the KFs of its rig, as its front-end counts them
     Matrix4d T_kf_w;
     Vector6d x_kf_w;
     Matrix6d xcov_kf_w;
 
+    // marginalization prior (x_prior_kf_w, xinfo_prior_kf_w) of a KF once it has been optimized in an LBA window,
+    // rebuilt by each LBA it observes (xcov_kf_w is the covariance of the VO motion from the previous frame)
+    bool     has_prior;
+    Vector6d x_prior_kf_w;
+    Matrix6d xinfo_prior_kf_w;
+
     DBoW2::BowVector descDBoW_P, descDBoW_L;
+    DBoW2::FeatureVector featDBoW_P, featDBoW_L;    // direct index: features (rows of the left descriptors) per node
+    // BoW encoding on the task pool (see MapHandler::startBowVectors): the future is set before the KF is
+    // handed to the mapping threads and only waited on (shared, so several threads can wait), the vectors
+    // can be read once bow_pending is false
+    std::shared_future<void> bow_task;
+    std::atomic<bool>        bow_pending;
 
     StVO::StereoFrame* stereo_frame;
 
+    double   t_queued;        // profiler time when the VO queued it for the mapper (-1 if not profiled)
+
 
 
 };
@@ -0,0 +1,123 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+//Eigen
+#include <eigen3/Eigen/Core>
+
+class PinholeStereoCamera;
+
+namespace PLSLAM {
+
+class KeyFrame;
+
+// Compact KF messages between a front-end and a remote back-end (see mapLink.h). A KF message
+// (little endian, not aligned) holds:
+//
+//   KFMessageHeader | points | lines | point descriptors | line descriptors | [BoW words]
+//
+// The pose wrt the previous KF is stored in se3 (double) with the upper triangle of its
+// covariance (float). The features only keep their image coordinates and disparities, quantized
+// to step pixels (uint16), with their octave and inlier flag: the 3D points, line equations and
+// Plücker coordinates are recovered with the camera of the receiver, as the KLT tracking does.
+// Descriptors are sent as their packed binary rows. Bump KF_MESSAGE_VERSION whenever the layout
+// changes.
+
+static const uint32_t KF_MESSAGE_MAGIC   = 0x464b4c50;    // "PLKF"
+static const uint16_t KF_MESSAGE_VERSION = 1;
+
+enum KFMessageFlags : uint16_t {
+    KF_MSG_HAS_BOW = 1
+};
+
+#pragma pack(push, 1)
+struct KFMessageHeader {
+    uint32_t magic;
+    uint16_t version, flags;
+    int32_t  kf_seq;                    // index of the KF in the sequence of the front-end
+    double   t;
+    double   x_kf_prev[6];
+    float    cov_kf_prev[21];
+    float    inv_width, inv_height;
+    float    step;
+    uint32_t n_points, n_lines;
+    uint16_t pdesc_cols, ldesc_cols;    // bytes per descriptor row
+};
+
+struct KFMessagePoint {
+    uint16_t u, v, disp;
+    uint8_t  level, inlier;
+};
+
+struct KFMessageLine {
+    uint16_t su, sv, sdisp, eu, ev, edisp;
+    uint8_t  level, inlier;
+};
+
+struct KFMessageWord {
+    uint32_t word;
+    float    value;
+};
+
+// corrected pose of a KF, streamed back by the back-end
+struct KFCorrection {
+    int32_t kf_seq;
+    double  x_kf_w[6];
+};
+#pragma pack(pop)
+
+static_assert(sizeof(KFMessageHeader) == 176, "unexpected KF message layout");
+static_assert(sizeof(KFMessagePoint)  == 8,   "unexpected KF message layout");
+static_assert(sizeof(KFMessageLine)   == 14,  "unexpected KF message layout");
+static_assert(sizeof(KFCorrection)    == 52,  "unexpected KF message layout");
+
+// in place conversion between the host byte order and the little endian messages (no-op on little
+// endian hosts), of size bytes of width-byte values
+void littleEndian(void *data, size_t size, size_t width);
+template<typename T>
+void littleEndian(T &v) {
+    static_assert(std::is_arithmetic<T>::value, "littleEndian: no conversion for this type");
+    littleEndian(&v, sizeof(T), sizeof(T));
+}
+void littleEndian(KFMessageHeader &h);
+void littleEndian(KFMessagePoint &p);
+void littleEndian(KFMessageLine &l);
+void littleEndian(KFMessageWord &w);
+void littleEndian(KFCorrection &c);
+
+// appends the message of kf (with its BoW vectors if it has them) to msg
+void encodeKeyFrame(const KeyFrame *kf, int kf_seq, std::vector<uint8_t> &msg);
+// KF of a message, compact as the KFs of a loaded map (kf_seq is returned in its kf_idx); throws
+// std::runtime_error on malformed messages
+KeyFrame* decodeKeyFrame(const uint8_t *msg, size_t size, PinholeStereoCamera *cam);
+
+void encodeCorrections(const std::vector<KFCorrection> &corrections, std::vector<uint8_t> &msg);
+void decodeCorrections(const uint8_t *msg, size_t size, std::vector<KFCorrection> &corrections);
+
+} // namespace PLSLAM
@@ -0,0 +1,116 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <eigen3/Eigen/Core>
+
+#include <mapFeatures.h>
+#include <keyFrame.h>
+
+namespace PLSLAM {
+
+// Out-of-core storage of the landmark descriptors (lm_paging). The landmarks are bucketed in cubic
+// tiles of lm_tile_size meters (points by their position, lines by their first observer KF); the
+// descriptor lists of the tiles farther than lm_page_radius + 1 tiles from the current KF are moved
+// to a memory mapped page file, and the ones within lm_page_radius tiles are brought back, so the
+// resident descriptors are bounded by the neighbourhood of the camera and not by the map size.
+// The local landmarks are never paged out; the map pages in any other landmark before touching its
+// descriptors (pageIn is a no-op for the resident ones). The tile of a landmark is fixed when it is
+// registered, the blocks of the landmarks culled while paged out are recycled when their tile is
+// paged in again.
+// The page file is grown in chunks and its blocks are recycled through power-of-two size classes.
+class LandmarkPager {
+public:
+
+    LandmarkPager();
+    ~LandmarkPager();
+
+    void open(const std::string &filename);
+    bool isOpen() const { return fd >= 0; }
+    // forgets every record (the landmarks are assumed resident), the file is kept for reuse
+    void clear();
+
+    // registers the new landmarks and pages the tiles in or out around center
+    void update(const Eigen::Vector3d &center, const std::vector<MapPoint*> &points,
+                const std::vector<MapLine*> &lines, const std::vector<KeyFrame*> &kfs);
+
+    void pageIn(MapPoint *pt);
+    void pageIn(MapLine *ls);
+    // descriptors of the landmark without paging it in (headers into the page file if it is paged)
+    std::vector<cv::Mat> rowList(const MapPoint *pt) const;
+    std::vector<cv::Mat> rowList(const MapLine *ls) const;
+
+    size_t pagedBytes() const { return paged_bytes; }
+
+private:
+
+    struct TileKey {
+        int x, y, z;
+        bool operator==(const TileKey &o) const { return x == o.x && y == o.y && z == o.z; }
+    };
+    struct TileHash {
+        size_t operator()(const TileKey &k) const {
+            return size_t(k.x) * 73856093u ^ size_t(k.y) * 19349663u ^ size_t(k.z) * 83492791u;
+        }
+    };
+    struct Tile {
+        Tile() : n_paged(0) {}
+        std::vector<int> pts, lines;
+        int n_paged;
+    };
+    struct Record {
+        Record() : offset(0), rows(-1), n_obs(0), size_class(-1) {}
+        bool paged() const { return rows >= 0; }
+        size_t offset;
+        int rows, n_obs, size_class;
+        TileKey tile;
+    };
+
+    TileKey tileOf(const Eigen::Vector3d &P) const;
+    template<typename LM> void registerLM(LM *lm, const TileKey &key, std::vector<Record> &recs, bool line);
+    template<typename LM> void pageOut(LM *lm, std::vector<Record> &recs);
+    template<typename LM> void pageIn(LM *lm, std::vector<Record> &recs);
+    template<typename LM> std::vector<cv::Mat> rowList(const LM *lm, const std::vector<Record> &recs) const;
+
+    size_t allocate(int size_class);
+    void   release(Record &rec);
+    void   reserve(size_t bytes);
+
+    int    fd;
+    char  *base;
+    size_t file_size, file_end, paged_bytes;
+    std::vector<std::vector<size_t>> free_blocks;      // free offsets of each size class
+
+    double tile_size;
+    size_t next_pt, next_ls;                           // first handles not registered yet
+    std::vector<Record> pt_rec, ls_rec;                // by landmark handle
+    std::unordered_map<TileKey, Tile, TileHash> tiles;
+
+};
+
+}
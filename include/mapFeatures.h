@@ -27,6 +27,8 @@
 #include <opencv/cv.h>
 #include <eigen3/Eigen/Core>
 
+#include <hamming.h>
+
 using namespace cv;
 using namespace std;
 using namespace Eigen;
@@ -37,6 +39,53 @@ typedef Matrix<double,6,6> Matrix6d;
 
 namespace PLSLAM{
 
+// Descriptors observed for a landmark, packed as 256-bit rows in one allocation (row i belongs to
+// observation i). With desc_max_obs only the most recent rows are kept, they then belong to the
+// last observations. The representative descriptor is chosen among the last desc_history rows
+// only: their pairwise Hamming distances and row sums are cached, so that a new observation costs
+// desc_history distances instead of the full n x n matrix (erasing a row rebuilds the cache).
+class DescriptorList
+{
+
+public:
+
+    DescriptorList() : n_obs(0), base(0), hist(0), cache_valid(false) { }
+
+    int  size()  const { return rows.size(); }          // stored rows (<= observations())
+    bool empty() const { return rows.empty(); }
+    int  observations() const { return n_obs; }
+    const StVO::Desc256& operator[](int i) const { return rows[i]; }   // invalidated by push_back / erase
+    const StVO::Desc256* data() const { return rows.data(); }
+
+    void push_back(const Mat &desc);
+    void push_back(const StVO::Desc256 &desc);
+    void append(const DescriptorList &other);           // the observations of other follow the ones of this list
+    void erase(int obs);                                // the descriptor of observation obs (if still stored)
+    void clear();
+    void assign(const vector<Mat> &descs, int n_obs_ = -1);
+    void assign(const StVO::Desc256 *descs, int n, int n_obs_);
+    vector<Mat> rowList() const;                        // headers into the list
+    void trim(int max_rows);                            // keeps the last max(max_rows, desc_history) rows, releasing the rest
+    size_t bytes() const;                               // heap bytes of the rows and the cache
+
+    // medoid of the recent descriptors, or their bitwise majority (desc_majority_vote), as a copy
+    StVO::Desc256 representative();
+
+private:
+
+    void rebuildCache();
+    void applyCap();
+    StVO::Desc256 majorityVote() const;
+
+    vector<StVO::Desc256> rows;
+    int         n_obs;                // observations, the oldest ones may have no row
+    int         base;                 // rows dropped from the front, the cache slots use base + row
+    int         hist;                 // window size the cache was built for
+    bool        cache_valid;
+    vector<int> dist;                 // hist x hist distances, row r of the list uses slot (base + r) % hist
+    vector<int> row_sum;              // sum of the distances of each slot to the rest of the window
+};
+
 class MapPoint
 {
 
@@ -51,15 +100,21 @@ public:
     void addMapPointObservation(Mat desc_, int kf_obs_, Vector2d obs_, Vector3d dir_,  double sigma2_ = 1.f);
     void updateAverageDescDir();
 
+    // heap bytes of the observation lists (descriptors apart), and their pruning under a memory budget
+    size_t observationBytes() const;
+    void   compactObservations(int max_desc_rows);
+
     int            idx;
 
     bool           inlier;
     bool           local;
+    int            local_epoch;       // last local map epoch this LM was added to
+    bool           cull_pending;      // queued in the culling candidates of the map
     Vector3d       point3D;
     Vector3d       med_obs_dir;
-    Mat            med_desc;
+    StVO::Desc256  med_desc;
 
-    vector<Mat>      desc_list;       // list with the descriptor of each observation
+    DescriptorList   desc_list;       // list with the descriptor of each observation
     vector<Vector2d> obs_list;        // list with the coordinates of each observation
     vector<Vector3d> dir_list;        // list with the direction unit vector of each observation
     vector<int>      kf_obs_list;     // list with KF index where the feature has been observed
@@ -86,15 +141,20 @@ public:
     void addMapLineObservation(Mat desc_, int kf_obs_, Vector3d obs_, Vector3d dir_, Vector4d pts_,  double sigma2_ = 1.f);
     void updateAverageDescDir();
 
+    size_t observationBytes() const;
+    void   compactObservations(int max_desc_rows);
+
     int            idx;
 
     bool           inlier;
     bool           local;
+    int            local_epoch;       // last local map epoch this LM was added to
+    bool           cull_pending;      // queued in the culling candidates of the map
     Vector6d       line3D;            // 3D endpoints of the line segment
     Vector3d       med_obs_dir;
-    Mat            med_desc;
+    StVO::Desc256  med_desc;
 
-    vector<Mat>      desc_list;       // list with the descriptor of each observation
+    DescriptorList   desc_list;       // list with the descriptor of each observation
     vector<Vector3d> obs_list;        // list with the coordinates of each observation ( 2D line equation, normalized by sqrt(lx2+ly2) )
     vector<Vector4d> pts_list;        // list with the coordinates of each endpoint (four coordinates)
     vector<Vector3d> dir_list;        // list with the direction unit vector of each observation (middle point)
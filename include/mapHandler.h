@@ -22,8 +22,13 @@
 
 #pragma once
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <deque>
 #include <list>
 #include <map>
+#include <chrono>
+#include <thread>
 #include <eigen3/Eigen/Eigen>
 #include <eigen3/Eigen/Sparse>
 #include <eigen3/Eigen/CholmodSupport>
@@ -55,6 +60,17 @@
 #include <stereoFrameHandler.h>
 #include <keyFrame.h>
 #include <mapFeatures.h>
+#include <plukerOrth.h>
+#include <covisibilityGraph.h>
+#include <placeRecognition.h>
+#include <poseGraph.h>
+#include <schurSolver.h>
+#include <spscQueue.h>
+#include <mapLock.h>
+#include <profiledMutex.h>
+#include <mapObserver.h>
+#include <mapStore.h>
+#include <landmarkPager.h>
 
 using namespace std;
 using namespace Eigen;
@@ -64,7 +80,13 @@ typedef Matrix<int,  6,1> Vector6i;
 typedef Matrix<float,6,1> Vector6f;
 typedef Matrix<float,6,6> Matrix6f;
 typedef Matrix<float,7,1> Vector7f;
-typedef DBoW2::TemplatedVocabulary<DBoW2::FORB::TDescriptor, DBoW2::FORB> Vocabulary;
+
+// g2o types of the Plücker LBA (g2o_types/g2o_types.h)
+class VertexLMPose;
+class VertexLMPointXYZ;
+class VertexLMLineOrth;
+class EdgePosePoint;
+class EdgePoseLine;
 
 namespace PLSLAM
 {
@@ -81,9 +103,26 @@ public:
 
     void initialize(KeyFrame* kf0);
     void finishSLAM();
+    // KF of the rig curr_kf->rig, thread safe so that the front-end of each rig can add its own
     void addKeyFrame(KeyFrame *curr_kf);
 
+    // multi-rig platforms: registers a stereo rig besides the map camera (rig 0) with its pose in the
+    // rig 0 frame, before its first KF; the rigs share the intrinsics of cam (runtime_error otherwise)
+    // and start tracking on the same frame, so the first KF of a rig is placed by the extrinsics
+    int addRig( const PinholeStereoCamera* rig_cam, const Matrix4d &T_rig0_rig );
+    int numRigs() const { return rig_extrinsics.size(); }
+    bool isInitialized() const { return initialized; }
+    // blocks until the map is initialized (true), or until wakeInitWaiters once cancel is set (false)
+    bool waitInitialized( const std::atomic<bool> &cancel );
+    void wakeInitWaiters();
+
+    // front-ends feeding the map (StreamingSLAM), the last one detached finishes the mapping threads
+    void attachFrontEnd();
+    void detachFrontEnd();
+
     void addKeyFrame_multiThread(KeyFrame *curr_kf, KeyFrame *prev_kf);
+    KeyFrame* insertKeyFrame(KeyFrame *curr_kf);
+    void flushKFBacklog();
     void handlerThread();
 
     void startThreads();
@@ -101,19 +140,33 @@ public:
     void lookForCommonMatches(KeyFrame *kf0, KeyFrame *&kf1);
 
     void expandGraphs();
+    void covisibleKFs( int kf_idx, int min_weight, int n_recent, vector<int> &kf_list ) const;
+    void graphSuccessors( int kf_idx, int kf_last, int min_weight, vector<int> &kf_list ) const;
     void formLocalMap();
     void formLocalMap( KeyFrame * kf );
     void formLocalMap_old();
     void removeBadMapLandmarks();
-    void removeRedundantKFs();
+    // cull the KFs whose landmarks are almost all observed by 3 other KFs, stopping after
+    // time_budget ms (0 for no limit) or as soon as a new KF is waiting; returns the KFs removed
+    int removeRedundantKFs( double time_budget );
+    bool isRedundantKF( int kf_idx );
+    // applies the memory budgets (mem_budget_*): compacts the non-local KFs, prunes the observations
+    // of the non-local landmarks and culls KFs, in that order, and publishes the profiler gauges
+    void enforceMemoryBudget();
+    void removeKeyFrame( int kf_idx );
+    // pose-graph-only retention (pg_retention_kfs): the KFs older than the newest pg_retention_kfs
+    // ones and out of the local map drop their landmarks, keeping their pose, BoW vectors and features
+    int  reduceOldKFs();
+    void reduceKeyFrame( int kf_idx );
     void loopClosure();
-    bool lookForLoopCandidates(int kf_idx_curr, int &kf_idx_prev);
-    void insertKFBowVectorP(KeyFrame *kf);
-    void insertKFBowVectorL(KeyFrame *kf);
-    void insertKFBowVectorPL(KeyFrame *kf);
+    bool lookForLoopCandidates(int kf_idx_curr, vector<int> &kf_idx_prevs);
+    int verifyLoopCandidates(const KeyFrame* kf, const vector<int> &kf_idxs, Vector6d &pose_inc,
+                             vector<Vector4i> &lc_pt_idx, vector<Vector4i> &lc_ls_idx);
     bool isLoopClosure(const KeyFrame* kf0, const KeyFrame* kf1, Vector6d &pose_inc,
                        vector<Vector4i> &lc_pt_idx, vector<Vector4i> &lc_ls_idx,
                        vector<PointFeature*> &lc_points, vector<LineFeature*>  &lc_lines);
+    bool initRelativePoseRANSAC( vector<PointFeature*> &lc_points, vector<LineFeature*> &lc_lines,
+                                 Matrix4d &T_inc ) const;
     bool computeRelativePoseGN( vector<PointFeature*> &lc_points, vector<LineFeature*> &lc_lines,
                                 vector<Vector4i>      &lc_pt_idx, vector<Vector4i>     &lc_ls_idx,
                                 Vector6d &pose_inc ) const;
@@ -123,6 +176,8 @@ public:
     bool loopClosureOptimizationEssGraphG2O();
     bool loopClosureOptimizationCovGraphG2O();
     void loopClosureFuseLandmarks();
+    void fuseDuplicatePoints();
+    void fusePointInto( int keep, int drop, map<pair<int,int>,int> &graph_inc );
 
     int localBundleAdjustment();
     int levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> kf_list, vector<int> pt_list, vector<int> ls_list, vector<Vector6i> pt_obs_list, vector<Vector6i> ls_obs_list  );
@@ -134,6 +189,9 @@ public:
     void localBundleAdjustmentForPlukerWithG2O();
 
     void globalBundleAdjustment();
+    // sparse GBA of all the KFs and landmarks on the g2o types, the edges are linearized on the
+    // thread pool and the optimization stops after time_budget ms (0 for no limit)
+    void globalBundleAdjustmentG2O( double time_budget );
     void levMarquardtOptimizationGBA( vector<double> X_aux, vector<int> kf_list, vector<int> pt_list, vector<int> ls_list, vector<Vector6i> pt_obs_list, vector<Vector6i> ls_obs_list  );
 
     PinholeStereoCamera* cam;
@@ -141,6 +199,8 @@ public:
     vector<KeyFrame*> map_keyframes;
     vector<MapPoint*> map_points;
     vector<MapLine*>  map_lines;
+    // live (non NULL) entries of the stores above, for dense iteration
+    LiveHandles live_kfs, live_pts, live_ls;
 
     list<PointFeature*> matched_pt;
     list<LineFeature*>  matched_ls;
@@ -148,13 +208,32 @@ public:
     map<int,vector<int>> map_points_kf_idx; // base KF list from which the LM is observed
     map<int,vector<int>> map_lines_kf_idx;
 
-    vector< vector<unsigned int> > full_graph;
+    CovisibilityGraph full_graph;
 
-    vector< vector<float> > conf_matrix;
-    Vocabulary              dbow_voc_p, dbow_voc_l;
+    std::shared_ptr<const Vocabulary> dbow_voc_p, dbow_voc_l;    // shared by the MapHandlers of the process
+    PlaceRecognition        place_rec;
+    // pose graph of the loop closures, kept between loops (only used by the LC thread)
+    PoseGraph               pose_graph;
+    // information of the relative poses of the KFs i < j linked in the essential graph, from the joint
+    // marginal covariance of the last LBA window that optimized both (pg_retention_kfs)
+    map< pair<int,int>, Matrix6d, less< pair<int,int> >,
+         Eigen::aligned_allocator< pair<const pair<int,int>, Matrix6d> > > kf_pose_info;
+    int reduced_kf_idx;     // the KFs before it are reduced, culled or were local when visited
 
     unsigned int max_pt_idx, max_ls_idx, max_kf_idx ;
 
+    // current local map (sorted map indices) and its epoch stamp
+    int local_epoch;
+    vector<int> local_kf_idx, local_pt_idx, local_ls_idx;
+    // culling candidates: LMs that left the local map (or were created outside it) and are not settled yet
+    vector<int> cull_pt_idx, cull_ls_idx;
+    // per-KF counts of observed and redundant landmarks, to rank the KF culling candidates
+    KFRedundancy kf_redundancy;
+    // sub-map of each KF (submap_max_kfs), only the last one is active
+    SubMaps submaps;
+    // page file of the descriptors of the landmarks far from the camera (lm_paging)
+    LandmarkPager lm_pager;
+
     KeyFrame *prev_kf, *curr_kf;
     Matrix4d Twf, DT;
 
@@ -162,7 +241,6 @@ public:
     Vector7f time;
 
     // VO status
-    mutex m_insert_kf;
     enum VOStatus{
         VO_PROCESSING,
         VO_INSERTING_KF
@@ -179,17 +257,24 @@ public:
     };
     LBAState lba_thread_status;
 
-    // Local Mapping
-    std::mutex lba_mutex;
-    std::condition_variable lba_start, lba_join;
+    // Local Mapping (the locks of the mapping threads report their contention, see ProfiledMutex)
+    ProfiledMutex lba_mutex{"MapHandler::lba_mutex"};
+    std::condition_variable_any lba_start, lba_join;
 
     vector< Vector3i > lc_idxs,  lc_idx_list;
     vector< Vector6d > lc_poses, lc_pose_list;
     vector< vector<Vector4i> > lc_pt_idxs;
     vector< vector<Vector4i> > lc_ls_idxs;
 
-    std::mutex lc_mutex;
-    std::condition_variable lc_start, lc_join;
+    ProfiledMutex lc_mutex{"MapHandler::lc_mutex"};
+    std::condition_variable_any lc_start, lc_join;
+    std::deque<KeyFrame*> lc_queue;     // KFs waiting for loop detection (handler -> LC thread, NULL stops it)
+    std::atomic<int> lc_last_kf_idx;    // last KF processed by the LC thread (older KFs can be culled)
+
+    // guards map_keyframes, map_points, map_lines, the graphs and the lm-kf indices: the handler, LBA
+    // and the LC correction write them exclusively, LC detection and the viewer read them shared
+    // (never taken by the VO thread)
+    mutable SharedMutex map_mutex{"MapHandler::map_mutex"};
 
     enum LCState{
         LC_IDLE,
@@ -202,24 +287,138 @@ public:
 
 
     // KF queue
-    std::list<pair<KeyFrame*,KeyFrame*>> kf_queue;  // list of curr_kf_mt and prev_kf_mt
-    std::mutex kf_queue_mutex;
-    std::condition_variable new_kf;
-    KeyFrame* curr_kf_mt;
-    KeyFrame* prev_kf_mt;
-
-    std::mutex cout_mutex;
-    void print_msg(const std::string &msg);
+    SPSCQueue<pair<KeyFrame*,KeyFrame*>> kf_queue;   // lock-free queue of the new KFs and the previous KF of the VO
+    std::list<pair<KeyFrame*,KeyFrame*>> kf_backlog; // KFs deferred while kf_queue is full (VO thread only)
+    unsigned int kf_deferred;                        // number of insertions that found kf_queue full
+    // only used to sleep the handler while kf_queue is empty
+    ProfiledMutex kf_queue_mutex{"MapHandler::kf_queue_mutex"};
+    std::condition_variable_any new_kf;
+    vector<KeyFrame*> vo_last_kf;                    // last KF added by the VO thread of each rig
+    // serializes the front-ends of the rigs (kf_queue has a single producer)
+    ProfiledMutex kf_producer_mutex{"MapHandler::kf_producer_mutex"};
+    int front_ends;                                  // attached front-ends (kf_producer_mutex)
+    vector<pair<KeyFrame*,KeyFrame*>> kf_batch_mt;   // (previous, new) KFs inserted for the next local mapping
 
     void SaveKeyFrameTrajectoryTUM(const string &filename);
 
+    // binary map persistence (see mapSerialization.h), only while the mapping threads are idle
+    void saveMap(const string &filename) const;
+    void loadMap(const string &filename);
+
+    // localization-only mode: pose of a frame against the map (no KF insertion), searching the
+    // last reference KF and its covisible KFs first and then the place recognition candidates
+    bool localizeFrame( const StereoFrame* frame, Matrix4d &T_f_w );
+    int  reloc_kf_idx;      // reference KF of the last successful localization (-1 if lost)
+
+    // last local map published for the VO front-end (see StereoFrameHandler::setLocalMap)
+    std::shared_ptr<const StVO::LocalMapSnapshot> localMapSnapshot( int rig = 0 ) const;
+
+    // notified (from the mapping threads) after every change of the map, must outlive the map threads
+    void addObserver( MapObserver* observer );
+
+    // map entities inserted or modified (changed) and erased since the last call, for incremental
+    // drawing; if all is set the lists are empty and the whole map must be redrawn. Single
+    // consumer, to be called with map_mutex read-locked
+    struct MapChanges {
+        vector<int> kfs, pts, ls;
+        vector<int> erased_kfs, erased_pts, erased_ls;
+        bool all;
+    };
+    void takeChanges( MapChanges &changes ) const;
+
+    // heap bytes of the map per subsystem (estimates, see memoryUsage.h), with map_mutex locked
+    struct MapMemory {
+        size_t kf_images       = 0;     // KF images and thumbnails
+        size_t kf_features     = 0;     // KFs, their features, descriptors and BoW vectors
+        size_t lm_descriptors  = 0;     // landmark descriptor rows in memory
+        size_t lm_observations = 0;     // landmarks and their observation lists
+        size_t lm_paged        = 0;     // descriptor rows in the page file (lm_paging), not in the total
+        size_t graphs          = 0;     // covisibility graph, LM-KF indices and LBA graph handles
+        size_t vocabulary      = 0;     // vocabularies (shared by the MapHandlers of the process)
+
+        size_t total() const { return kf_images + kf_features + lm_descriptors + lm_observations + graphs + vocabulary; }
+    };
+    MapMemory memoryUsage() const;
+
     static bool lId(KeyFrame* pKF1, KeyFrame* pKF2){
         return pKF1->kf_idx<pKF2->kf_idx;
     }
 
 private:
 
-    bool threads_started;
+    std::atomic<bool> threads_started;
+    Config *config;                 // session of the creator (SlamConfig), used by the mapping threads
+    bool mem_over_budget;           // mem_budget_total still exceeded after the last enforcement
+    std::atomic<bool> initialized;  // first KF (rig 0) inserted, the other rigs can start
+    ProfiledMutex init_mutex{"MapHandler::init_mutex"};
+    std::condition_variable_any init_cv;
+    void setInitialized( bool value );
+
+    // per rig: pose in the rig 0 frame, last KF inserted in the map and number of KFs inserted
+    vector<Matrix4d, Eigen::aligned_allocator<Matrix4d>> rig_extrinsics;
+    vector<KeyFrame*> rig_last_kf;
+    vector<int>       rig_kf_count;
+    // world pose of a new KF of its rig (its VO pose is relative to the last KF of the rig, or to
+    // the rig origin for the first one), returns the KF it is matched with
+    KeyFrame* placeRigKeyFrame( KeyFrame* kf );
+    // the last KF of a rig is the reference of its next one, it is neither culled nor reduced
+    bool isRigLastKF( int kf_idx ) const;
+
+    // map-to-KF matching: frustum bounds (x/z, y/z) of the left camera and reusable buffers
+    double frustum_x[2], frustum_y[2];
+    Mat proj_desc, unmatched_desc;  // preallocated, only the first rows are valid
+
+    bool inFrustum( const Vector3d &P ) const;
+
+    // graph of localBundleAdjustmentForPlukerWithG2O, kept between LBAs: vertices indexed by map
+    // handle and the edges of each landmark, only synced with the window on every call
+    std::unique_ptr<g2o::SparseOptimizer> lba_optimizer;
+    vector<VertexLMPose*>           lba_kf_vertex;
+    vector<VertexLMPointXYZ*>       lba_pt_vertex;
+    vector<VertexLMLineOrth*>       lba_ls_vertex;
+    vector<vector<EdgePosePoint*>>  lba_pt_edges;
+    vector<vector<EdgePoseLine*>>   lba_ls_edges;
+    vector<int> lba_graph_kfs, lba_graph_pts, lba_graph_ls;    // handles with a vertex in the graph
+    void resetLBAGraph();
+    // anytime LBA: a new KF is waiting in kf_queue (only if lba_interrupt is set)
+    bool lbaInterrupted() const;
+
+    // local map snapshot, replaced after each LBA
+    void publishLocalMap( const KeyFrame* kf );
+    mutable ProfiledMutex snapshot_mutex{"MapHandler::snapshot_mutex"};
+    vector<std::shared_ptr<const StVO::LocalMapSnapshot>> local_map_snapshot;    // per rig
+    vector<MapObserver*> observers;
+    void notifyMapChanged();
+    void addLocalKF( KeyFrame * kf );
+    void queueCullCandidate( MapPoint* pt );
+    void queueCullCandidate( MapLine* ls );
+    void cullLandmarks( bool pluker_lines );
+    void selectLBAWindow( vector<int> &pt_idx, vector<int> &ls_idx, vector<bool> &obs_kf ) const;
+    // assign a new KF to the active sub-map, closing it first if it is full
+    void assignSubmap( KeyFrame* kf );
+    void closeSubmap();
+    // sliding-window LBA (lba_marginalize): the observers that have been in a window are optimized against
+    // a prior instead of being fixed, with the information of their point observations left out of this
+    // one (the ones in it are optimized with the KF, a prior with them would count them twice)
+    void addPriorKFs( const vector<bool> &obs_kf, const vector<int> &pt_idx, vector<int> &kf_list, vector<double> &X_aux );
+    Matrix6d droppedPointsInformation( const KeyFrame* kf, const vector<bool> &window_pt ) const;
+    double addKFPriors( const vector<int> &kf_list, const VectorXd &X, SchurSolver &solver, VectorXd &g ) const;
+    // solver last solved without damping and linearized at the final estimate of the window
+    void updateKFPriors( const vector<int> &kf_list, const SchurSolver &solver );
+    // removes the observations of a KF, erasing the LMs only observed by it
+    void detachKeyFrame( int kf_idx );
+    // g2o information of the constraint between the KFs i and j of the pose graph (identity if unknown)
+    Matrix6d poseConstraintInformation( int i, int j ) const;
+    void erasePoseInformation( int kf_idx );
+    // BoW vectors and direct indices (lc_bow_levels_up) of the left descriptors of the KF
+    void computeBowVectors( KeyFrame* kf ) const;
+    // pipelined encoding: started on the task pool when the KF is handed to the mapper, and waited
+    // for (once) by the first stage that reads the vectors
+    void startBowVectors( KeyFrame* kf ) const;
+    void waitBowVectors( KeyFrame* kf ) const;
+    // descriptor matching of two KFs, restricted to the features under the same vocabulary nodes
+    // when both direct indices are available (brute force otherwise)
+    int matchKFDescriptors( const KeyFrame* kf0, const KeyFrame* kf1, bool lines, vector<int> &matches_12 ) const;
 
     inline Matrix3d vectorHat(const Vector3d& vec){
         Matrix3d temp;
@@ -249,91 +448,6 @@ private:
         return temp;
     }
 
-    inline void updateOrthCoord(Vector4d& D, Vector4d& deltaD, Vector4d& plusD){
-        // ref: 2001, Adrien Bartol,Peter Sturm ,Structure-From-Motion Using Lines: Representation, Triangulation and Bundle Adjustment
-
-        // theta --> U,  phi --> W
-        Eigen::Vector3d theta = D.head(3);
-
-        double phi = D(3);
-        //Vector3d theta = orth.head(3);
-        //double phi = orth[3];
-        double s1 = sin(theta[0]);
-        double c1 = cos(theta[0]);
-        double s2 = sin(theta[1]);
-        double c2 = cos(theta[1]);
-        double s3 = sin(theta[2]);
-        double c3 = cos(theta[2]);
-        Eigen::Matrix3d R;
-        R <<
-          c2 * c3,   s1 * s2 * c3 - c1 * s3,   c1 * s2 * c3 + s1 * s3,
-                c2 * s3,   s1 * s2 * s3 + c1 * c3,   c1 * s2 * s3 - s1 * c3,
-                -s2,                  s1 * c2,                  c1 * c2;
-        double w1 = cos(phi);
-        double w2 = sin(phi);
-
-        // update
-        Eigen::Vector3d _delta_theta = deltaD.head(3);
-        double _delta_phi = deltaD(3);
-        Eigen::Matrix3d Rz;
-        Rz << cos(_delta_theta(2)), -sin(_delta_theta(2)), 0,
-                sin(_delta_theta(2)), cos(_delta_theta(2)), 0,
-                0, 0, 1;
-
-        Eigen::Matrix3d Ry;
-        Ry << cos(_delta_theta(1)), 0., sin(_delta_theta(1)),
-                0., 1., 0.,
-                -sin(_delta_theta(1)), 0., cos(_delta_theta(1));
-
-        Eigen::Matrix3d Rx;
-        Rx << 1., 0., 0.,
-                0., cos(_delta_theta(0)), -sin(_delta_theta(0)),
-                0., sin(_delta_theta(0)), cos(_delta_theta(0));
-        R = R * Rx * Ry * Rz;
-
-        Eigen::Matrix2d W;
-        W << w1, -w2, w2, w1;
-        Eigen::Matrix2d delta_W;
-        delta_W << cos(_delta_phi), -sin(_delta_phi),sin(_delta_phi), cos(_delta_phi);
-        W = W * delta_W;
-
-        // U' -- > theta'. W' --> phi'
-
-        Eigen::Vector3d u1 = R.col(0);
-        Eigen::Vector3d u2 = R.col(1);
-        Eigen::Vector3d u3 = R.col(2);
-        plusD[0] = atan2( u2(2),u3(2) );
-        plusD[1] = asin( -u1(2) );
-        plusD[2] = atan2( u1(1),u1(0) );
-
-        plusD[3] = asin( W(1,0) );
-
-//////////////////////////////////////////////////////////
-        /*
-        // SO3参数方法，得到的雅克比更上面一样的。用上面的形式就OK。
-        Eigen::Map<const Eigen::Vector3d> theta(x);
-        double phi = *(x + 3);
-        double s1 = sin(theta[0]);
-        double c1 = cos(theta[0]);
-        double s2 = sin(theta[1]);
-        double c2 = cos(theta[1]);
-        double s3 = sin(theta[2]);
-        double c3 = cos(theta[2]);
-        Matrix3d R;
-        R <<
-          c2 * c3,   s1 * s2 * c3 - c1 * s3,   c1 * s2 * c3 + s1 * s3,
-                c2 * s3,   s1 * s2 * s3 + c1 * c3,   c1 * s2 * s3 - s1 * c3,
-                -s2,                  s1 * c2,                  c1 * c2;
-
-        Sophus::SO3<double> U = Sophus::SO3<double>::exp(theta);
-        Sophus::SO3<double> U1(R);
-
-        std::cout << U.matrix() << "\n\n" <<U1.matrix()<<"\n\n"<<R<<"\n\n";
-
-        std::cout << theta <<"\n\n" << U1.log() << "\n\n"<<  Sophus::SO3<double>::exp(U1.log()).matrix() << "\n\n";
-         */
-    }
-
 };
 
 }
@@ -0,0 +1,178 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Eigen
+#include <eigen3/Eigen/Core>
+
+#include <boundedQueue.h>
+#include <kfMessage.h>
+#include <mapObserver.h>
+
+class Config;
+class PinholeStereoCamera;
+
+namespace PLSLAM {
+
+class KeyFrame;
+class MapHandler;
+
+// Split deployment: the front-end (StereoFrameHandler) runs on the robot and sends its KFs to a
+// MapHandler on a remote back-end, which streams the corrected KF poses back. Both ends talk over
+// one TCP connection of framed messages (uint32 type | uint32 size | payload, little endian):
+//
+//   front-end -> back-end: LINK_HELLO (camera), LINK_KEYFRAME (see kfMessage.h)..., LINK_END
+//   back-end -> front-end: LINK_CORRECTIONS (KFs whose pose changed since the last ones)...
+//
+// the back-end closes the connection once it has sent its last corrections.
+
+enum MapLinkMessage : uint32_t {
+    LINK_HELLO = 1,
+    LINK_KEYFRAME,
+    LINK_END,
+    LINK_CORRECTIONS
+};
+
+#pragma pack(push, 1)
+struct MapLinkHello {
+    uint32_t magic;
+    uint16_t version, pad;
+    double   fx, fy, cx, cy, b;
+    int32_t  width, height;
+};
+#pragma pack(pop)
+
+// Framed messages over a connected stream socket (closed with the link).
+class MessageLink {
+public:
+
+    explicit MessageLink(int fd_);
+    ~MessageLink();
+
+    MessageLink(const MessageLink&) = delete;
+    MessageLink& operator=(const MessageLink&) = delete;
+
+    // thread safe, false once the connection is lost
+    bool send(uint32_t type, const std::vector<uint8_t> &payload);
+    // blocking, single reader; false at the end of the stream or once the connection is lost
+    bool receive(uint32_t &type, std::vector<uint8_t> &payload);
+    // unblocks the pending send and receive calls, which then fail
+    void shutdown();
+
+    size_t bytesSent() const { return bytes_sent; }
+
+    // connected sockets, throw std::runtime_error
+    static int connectTo(const std::string &host, int port);
+    static int acceptOn(int port);
+
+private:
+
+    int fd;
+    std::mutex send_mtx;
+    std::atomic<size_t> bytes_sent;
+};
+
+// Front-end side: stands in for the MapHandler of the tracking loop. The KFs are encoded and sent
+// by the link thread, the VO thread only blocks while queue_size KFs are waiting for the network.
+class MapLinkClient {
+public:
+
+    // connects to the back-end and announces the camera, throws std::runtime_error
+    MapLinkClient(const std::string &host, int port, const PinholeStereoCamera *cam, int queue_size);
+    ~MapLinkClient();
+
+    // as MapHandler::initialize for the first KF and addKeyFrame for the next ones (kf is then deleted)
+    void addKeyFrame(KeyFrame *kf);
+    // sends the queued KFs and the end of the sequence, and waits for the last corrections
+    void finish();
+
+    int numKeyFrames() const { return n_kfs; }
+    int numCorrections() const { return n_corrections; }
+    size_t bytesSent() const { return link.bytesSent(); }
+
+private:
+
+    void sendLoop();
+    void receiveLoop();
+
+    MessageLink link;
+    StVO::BoundedQueue<KeyFrame*> queue;
+    std::thread sender, receiver;
+    Config *config;                             // session of the creator, used by the link threads
+    int n_kfs;
+    bool finished;
+
+    std::atomic<int> n_corrections;             // KF poses received from the back-end
+};
+
+// Back-end side: feeds the KFs of one front-end to a MapHandler and streams the corrections back
+// (after each map change, from its own thread).
+class MapLinkServer : public MapObserver {
+public:
+
+    // waits for a front-end on port and reads its camera, throws std::runtime_error
+    explicit MapLinkServer(int port);
+    ~MapLinkServer();
+
+    // camera of the front-end, owned by the caller
+    PinholeStereoCamera* camera() const;
+
+    // runs the map of the front-end (created with its camera) until the end of its sequence, then
+    // finishes the mapping threads; throws std::runtime_error on malformed messages
+    void run(MapHandler *map_, PinholeStereoCamera *cam);
+    // sends the poses changed since the last corrections (e.g. after the GBA) and closes the link
+    void close();
+
+    void frameTracked(StVO::StereoFrame*, bool) {}
+    void mapChanged(const MapHandler*);
+
+    int numKeyFrames() const { return n_kfs; }
+
+private:
+
+    void correctionLoop();
+    void sendCorrections();
+
+    MessageLink link;
+    MapLinkHello hello;
+    Config *config;                             // session of the creator, used by the corrector thread
+    MapHandler *map;
+    int n_kfs;
+
+    std::thread corrector;
+    std::mutex mtx;
+    std::condition_variable wake;
+    bool changed, stopping;
+    std::vector<KFCorrection> sent;             // last pose sent of each KF (corrector thread)
+};
+
+} // namespace PLSLAM
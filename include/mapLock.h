@@ -0,0 +1,145 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <profiler.h>
+
+namespace PLSLAM {
+
+// Reader/writer lock for the map (C++11 has no std::shared_mutex). Any number
+// of readers may hold it together, writers are exclusive and take precedence
+// over new readers, so a steady stream of readers cannot starve the mapper.
+// A named lock reports its contention to the Profiler while it is enabled (as
+// StVO::ProfiledMutex, aggregated in StVO::StageHistogram): "<name>.wait" /
+// "<name>.wait_shared" for the contended exclusive / shared acquisitions and
+// "<name>.hold" for the exclusive holds.
+class SharedMutex {
+public:
+
+    explicit SharedMutex(const char *name = NULL) : n_readers(0), n_waiting_writers(0), writer(false),
+        t_locked(-1.0) {
+        if (name == NULL)
+            return;
+        wait_hist.reset(new StVO::StageHistogram(std::string(name) + ".wait"));
+        wait_shared_hist.reset(new StVO::StageHistogram(std::string(name) + ".wait_shared"));
+        hold_hist.reset(new StVO::StageHistogram(std::string(name) + ".hold"));
+    }
+    SharedMutex(const SharedMutex&) = delete;
+    SharedMutex& operator=(const SharedMutex&) = delete;
+
+    // exclusive access (usable with std::lock_guard and std::unique_lock)
+    void lock() {
+        bool profiled = profiling();
+        std::unique_lock<std::mutex> lk(m);
+        double t_start = ( profiled && (writer || n_readers > 0) ) ? StVO::Profiler::instance().now() : -1.0;
+        n_waiting_writers++;
+        cv_writers.wait(lk, [this]{ return !writer && n_readers == 0; });
+        n_waiting_writers--;
+        writer = true;
+        t_locked = profiled ? StVO::Profiler::instance().now() : -1.0;
+        lk.unlock();
+        if (t_start >= 0.0)
+            wait_hist->add(StVO::Profiler::instance().now() - t_start);
+    }
+
+    void unlock() {
+        double t_start = t_locked, t_end = t_start >= 0.0 ? StVO::Profiler::instance().now() : 0.0;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            writer = false;
+            if (n_waiting_writers > 0)
+                cv_writers.notify_one();
+            else
+                cv_readers.notify_all();
+        }
+        if (t_start >= 0.0)
+            hold_hist->add(t_end - t_start);
+    }
+
+    // shared access
+    void lock_shared() {
+        bool profiled = profiling();
+        std::unique_lock<std::mutex> lk(m);
+        double t_start = ( profiled && (writer || n_waiting_writers > 0) ) ? StVO::Profiler::instance().now() : -1.0;
+        cv_readers.wait(lk, [this]{ return !writer && n_waiting_writers == 0; });
+        n_readers++;
+        lk.unlock();
+        if (t_start >= 0.0)
+            wait_shared_hist->add(StVO::Profiler::instance().now() - t_start);
+    }
+
+    bool try_lock_shared() {
+        std::lock_guard<std::mutex> lk(m);
+        if (writer || n_waiting_writers > 0)
+            return false;
+        n_readers++;
+        return true;
+    }
+
+    void unlock_shared() {
+        std::lock_guard<std::mutex> lk(m);
+        n_readers--;
+        if (n_readers == 0 && n_waiting_writers > 0)
+            cv_writers.notify_one();
+    }
+
+private:
+
+    bool profiling() const { return hold_hist && StVO::Profiler::instance().enabled(); }
+
+    std::mutex m;
+    std::condition_variable cv_readers, cv_writers;
+    int  n_readers, n_waiting_writers;
+    bool writer;
+
+    double t_locked;    // start of the current exclusive hold (-1 while not profiled)
+    std::unique_ptr<StVO::StageHistogram> wait_hist, wait_shared_hist, hold_hist;
+};
+
+// RAII shared lock, optionally non-blocking (check owns_lock() then)
+class SharedLock {
+public:
+
+    explicit SharedLock(SharedMutex &mtx) : mtx(&mtx), owns(true) { mtx.lock_shared(); }
+    SharedLock(SharedMutex &mtx, std::try_to_lock_t) : mtx(&mtx), owns(mtx.try_lock_shared()) {}
+    SharedLock(const SharedLock&) = delete;
+    SharedLock& operator=(const SharedLock&) = delete;
+    ~SharedLock() { unlock(); }
+
+    void lock()   { if (!owns) { mtx->lock_shared(); owns = true; } }
+    void unlock() { if (owns)  { mtx->unlock_shared(); owns = false; } }
+    bool owns_lock() const { return owns; }
+
+private:
+
+    SharedMutex *mtx;
+    bool owns;
+};
+
+} // namespace PLSLAM
@@ -0,0 +1,49 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+namespace StVO {
+class StereoFrame;
+}
+
+namespace PLSLAM {
+
+class MapHandler;
+
+// Receives the progress of the SLAM pipeline, e.g. to visualize it. The
+// callbacks come from the tracking and mapping threads, so they must only
+// record what changed and return: any heavy work (drawing) belongs to the
+// observer's own thread.
+class MapObserver {
+public:
+
+    virtual ~MapObserver() {}
+
+    // tracking thread, after the pose of frame is estimated (is_kf if it becomes a KF)
+    virtual void frameTracked(StVO::StereoFrame *frame, bool is_kf) = 0;
+
+    // mapping threads, after KF insertion, LBA, culling or loop closure (the map may be locked)
+    virtual void mapChanged(const MapHandler *map) = 0;
+};
+
+} // namespace PLSLAM
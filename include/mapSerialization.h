@@ -0,0 +1,325 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//OpenCV
+#include <opencv/cv.h>
+
+namespace StVO {
+class StereoFrame;
+}
+
+namespace PLSLAM {
+
+// Binary map file (little endian, every section 8-byte aligned):
+//
+//   MapFileHeader | MapSectionEntry[num_sections] | section data ...
+//
+// Sections are arrays of the fixed-size records below, so a mapped file can be read in place.
+// Variable-length data (observation lists, BoW vectors, descriptors, strings) is stored in the
+// shared pool sections and referenced by index ranges (MapListRef) or byte ranges (MapBlobRef).
+// Eigen matrices are stored column-major. Bump MAP_FILE_VERSION whenever a record changes.
+
+static const char     MAP_FILE_MAGIC[8]  = { 'P', 'L', 'S', 'L', 'M', 'A', 'P', '\0' };
+static const uint32_t MAP_FILE_VERSION   = 1;
+static const uint32_t MAP_FILE_ENDIAN    = 0x01020304;
+
+enum MapSectionType : uint32_t {
+    MAP_SEC_META = 1,
+    MAP_SEC_KEYFRAMES,
+    MAP_SEC_KF_POINTS,
+    MAP_SEC_KF_LINES,
+    MAP_SEC_BOW_WORDS,
+    MAP_SEC_POINTS,
+    MAP_SEC_LINES,
+    MAP_SEC_GRAPH_EDGES,
+    MAP_SEC_KF_POINT_LMS,
+    MAP_SEC_KF_LINE_LMS,
+    MAP_SEC_DOUBLES,
+    MAP_SEC_INTS,
+    MAP_SEC_MATS,
+    MAP_SEC_BLOB,
+    MAP_SEC_REC_FRAMES                  // front-end records (see frontEndRecord.h)
+};
+
+struct MapFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint64_t num_sections;
+    uint64_t file_size;
+};
+
+struct MapSectionEntry {
+    uint32_t type;
+    uint32_t record_size;
+    uint64_t offset;
+    uint64_t count;
+};
+
+// count elements starting at begin (record index, or scalar index for vectors in MAP_SEC_DOUBLES)
+struct MapListRef {
+    uint64_t begin;
+    uint64_t count;
+};
+
+// byte range inside the blob section
+struct MapBlobRef {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// cv::Mat stored in the blob section (MAP_SEC_MATS holds the descriptor lists)
+struct MapMatRef {
+    uint64_t offset;
+    int32_t  rows, cols, type, pad;
+};
+
+struct MapMetaRecord {
+    double   fx, fy, cx, cy, b;
+    int32_t  width, height;
+    uint32_t max_kf_idx, max_pt_idx, max_ls_idx;
+    uint32_t pad;
+};
+
+struct MapKeyFrameRecord {
+    double     T_kf_w[16];
+    double     x_kf_w[6];
+    double     xcov_kf_w[36];
+    double     t;
+    double     inv_width, inv_height;
+    MapListRef points, lines;           // MAP_SEC_KF_POINTS / MAP_SEC_KF_LINES
+    MapListRef bow_p, bow_l;            // MAP_SEC_BOW_WORDS
+    MapMatRef  pdesc_l, ldesc_l;
+    MapBlobRef img_name;
+    int32_t    kf_idx;                  // -1 for KFs removed from the map
+    int32_t    f_idx, frame_idx;
+    int32_t    pad;
+};
+
+struct MapKFPointRecord {
+    double  pl[2], pl_obs[2];
+    double  disp;
+    double  P[3];
+    double  sigma2;
+    double  covP_an[9];
+    int32_t idx, level;
+    uint8_t inlier, pad[7];
+};
+
+struct MapKFLineRecord {
+    double  spl[2], epl[2], spl_obs[2], epl_obs[2];
+    double  sdisp, edisp, angle, sdisp_obs, edisp_obs;
+    double  sP[3], eP[3];
+    double  le[3], le_obs[3];
+    double  sigma2;
+    double  covE_an[9], covS_an[9];
+    double  NDc[6];
+    int32_t idx, level;
+    uint8_t inlier, pad[7];
+};
+
+struct MapBowWordRecord {
+    uint32_t word, pad;
+    double   value;
+};
+
+// list members index MAP_SEC_DOUBLES, MAP_SEC_INTS or MAP_SEC_MATS
+struct MapPointRecord {
+    double     point3D[3];
+    double     med_obs_dir[3];
+    MapMatRef  med_desc;
+    MapListRef desc_list, obs_list, dir_list, kf_obs_list, sigma_list;
+    int32_t    idx;                     // -1 for removed landmarks
+    uint8_t    inlier, pad[3];
+};
+
+struct MapLineRecord {
+    double     line3D[6];
+    double     med_obs_dir[3];
+    double     NDw[6], orthNDw[4];
+    double     first_kf_pose[16], first_kf_obs[4], first_NDw[6];
+    double     error;
+    MapMatRef  med_desc;
+    MapListRef desc_list, obs_list, pts_list, dir_list, NDw_obs_list, kf_obs_list, sigma_list;
+    int32_t    idx;                     // -1 for removed landmarks
+    int32_t    first_kf_id;
+    uint8_t    inlier, pad[7];
+};
+
+struct MapGraphEdgeRecord {
+    int32_t  i, j;                      // i <= j
+    uint32_t weight, pad;
+};
+
+// landmarks whose base KF is kf_idx (list in MAP_SEC_INTS)
+struct MapKFLandmarksRecord {
+    int32_t    kf_idx, pad;
+    MapListRef lms;
+};
+
+// tracked frame of a front-end record, the features and descriptors are only stored for the KFs
+struct MapRecFrameRecord {
+    double     Tfw[16];                 // pose wrt the previous KF
+    double     Tfw_cov[36];
+    double     t;
+    double     err_norm;
+    double     inv_width, inv_height;
+    MapListRef points, lines;           // MAP_SEC_KF_POINTS / MAP_SEC_KF_LINES
+    MapMatRef  pdesc_l, ldesc_l;
+    int32_t    frame_idx;
+    uint8_t    is_kf, pad[3];
+};
+
+static_assert(sizeof(MapFileHeader)        == 32,  "unexpected map record layout");
+static_assert(sizeof(MapSectionEntry)      == 24,  "unexpected map record layout");
+static_assert(sizeof(MapMetaRecord)        == 64,  "unexpected map record layout");
+static_assert(sizeof(MapKeyFrameRecord)    == 632, "unexpected map record layout");
+static_assert(sizeof(MapKFPointRecord)     == 160, "unexpected map record layout");
+static_assert(sizeof(MapKFLineRecord)      == 416, "unexpected map record layout");
+static_assert(sizeof(MapPointRecord)       == 160, "unexpected map record layout");
+static_assert(sizeof(MapLineRecord)        == 520, "unexpected map record layout");
+static_assert(sizeof(MapRecFrameRecord)    == 536, "unexpected map record layout");
+
+// Collects the sections of a map file in memory and writes them in a single pass.
+class MapFileWriter {
+public:
+
+    template<typename T>
+    void add(MapSectionType type, const T &rec) {
+        Section &s = section(type, sizeof(T));
+        const char *p = reinterpret_cast<const char*>(&rec);
+        s.data.insert(s.data.end(), p, p + sizeof(T));
+        ++s.count;
+    }
+
+    // index of the next record of the section
+    uint64_t count(MapSectionType type) const;
+
+    // appends n vectors of dim doubles / ints to the pools
+    MapListRef addDoubles(const double *v, uint64_t n, int dim = 1);
+    MapListRef addInts(const int *v, uint64_t n);
+
+    template<typename Vec>
+    MapListRef addVectors(const std::vector<Vec> &v) {
+        std::vector<double> d;
+        d.reserve(v.size() * Vec::SizeAtCompileTime);
+        for (const Vec &x : v)
+            for (int k = 0; k < Vec::SizeAtCompileTime; ++k)
+                d.push_back(x(k));
+        return addDoubles(d.data(), v.size(), Vec::SizeAtCompileTime);
+    }
+
+    MapMatRef  addMat(const cv::Mat &m);
+    MapListRef addMats(const std::vector<cv::Mat> &v);
+    MapBlobRef addString(const std::string &s);
+
+    // throws std::runtime_error if the file cannot be written
+    void write(const std::string &file) const;
+
+private:
+
+    struct Section {
+        MapSectionType    type;
+        uint32_t          record_size;
+        uint64_t          count;
+        std::vector<char> data;
+    };
+
+    Section& section(MapSectionType type, uint32_t record_size);
+    MapBlobRef addBytes(const void *p, uint64_t n);
+
+    std::vector<Section> sections;
+};
+
+// Maps a map file read-only and gives bounds-checked access to its sections.
+class MapFileReader {
+public:
+
+    // throws std::runtime_error on I/O errors, bad magic, endianness or version
+    explicit MapFileReader(const std::string &file);
+    ~MapFileReader();
+
+    MapFileReader(const MapFileReader&) = delete;
+    MapFileReader& operator=(const MapFileReader&) = delete;
+
+    template<typename T>
+    const T* records(MapSectionType type, uint64_t &n) const {
+        const MapSectionEntry *e = find(type, sizeof(T));
+        n = (e == NULL) ? 0 : e->count;
+        return (e == NULL) ? NULL : reinterpret_cast<const T*>(base + e->offset);
+    }
+
+    // list of the records of a section, checked against its size
+    template<typename T>
+    const T* list(MapSectionType type, const MapListRef &ref) const {
+        uint64_t n;
+        const T *r = records<T>(type, n);
+        check(ref, n, 1);
+        return r == NULL ? NULL : r + ref.begin;
+    }
+
+    const double* doubles(const MapListRef &ref, int dim = 1) const;
+    const int32_t* ints(const MapListRef &ref) const;
+
+    template<typename Vec>
+    void vectors(const MapListRef &ref, std::vector<Vec> &v) const {
+        const double *d = doubles(ref, Vec::SizeAtCompileTime);
+        v.resize(ref.count);
+        for (uint64_t i = 0; i < ref.count; ++i)
+            for (int k = 0; k < Vec::SizeAtCompileTime; ++k)
+                v[i](k) = d[i * Vec::SizeAtCompileTime + k];
+    }
+
+    // descriptors are copied out of the mapping
+    cv::Mat mat(const MapMatRef &ref) const;
+    void mats(const MapListRef &ref, std::vector<cv::Mat> &v) const;
+    std::string str(const MapBlobRef &ref) const;
+
+    uint32_t version() const { return header->version; }
+
+private:
+
+    const MapSectionEntry* find(MapSectionType type, size_t record_size) const;
+    const char* blob(uint64_t offset, uint64_t size) const;
+    void check(const MapListRef &ref, uint64_t n, int dim) const;
+
+    int fd;
+    const char *base;
+    size_t size;
+    const MapFileHeader *header;
+    const MapSectionEntry *entries;
+};
+
+// stereo features of a frame in MAP_SEC_KF_POINTS / MAP_SEC_KF_LINES (the covariances use the camera
+// of the frame); reading creates them in the arena of sf and updates its feature arrays
+void writeStereoFeatures(MapFileWriter &out, const StVO::StereoFrame *sf, MapListRef &points, MapListRef &lines);
+void readStereoFeatures(const MapFileReader &in, const MapListRef &points, const MapListRef &lines, StVO::StereoFrame *sf);
+
+} // namespace PLSLAM
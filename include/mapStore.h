@@ -0,0 +1,279 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <vector>
+
+namespace PLSLAM {
+
+// Dense list of the live handles of a map store (map_keyframes, map_points, map_lines). The handles
+// are the stable indices into the store that KFs, features and graphs refer to; they are never
+// reused, so they are inserted in increasing order and the list iterates in map order. Erasing only
+// marks the entry, the list is compacted once a quarter of it is dead, so deletion is O(1) amortized
+// and iterating visits at most a third more entries than the live ones.
+// The list also journals the handles inserted, touched (moved or recolored) and erased since the
+// last takeChanges(), so a viewer can apply deltas instead of redrawing the whole store.
+class LiveHandles {
+public:
+
+    LiveHandles() : n_dead(0), all_changed(true) {}
+
+    void clear() {
+        dense.clear();
+        pos.clear();
+        n_dead = 0;
+        journal.clear();
+        changed.clear();
+        erased.clear();
+        all_changed = true;
+    }
+
+    void insert(int h) {
+        if (h >= int(pos.size()))
+            pos.resize(h + 1, -1);
+        if (pos[h] >= 0)
+            return;
+        pos[h] = dense.size();
+        dense.push_back(h);
+        touch(h);
+    }
+
+    void erase(int h) {
+        if (!contains(h))
+            return;
+        dense[pos[h]] = -1;
+        pos[h] = -1;
+        n_dead++;
+        if (!all_changed) {
+            if (h >= int(journal.size()))
+                journal.resize(h + 1, NONE);
+            if (journal[h] != ERASED) {
+                journal[h] = ERASED;
+                erased.push_back(h);
+            }
+        }
+        if (4 * n_dead > int(dense.size()))
+            compact();
+    }
+
+    bool contains(int h) const { return h >= 0 && h < int(pos.size()) && pos[h] >= 0; }
+
+    // journal a live handle whose entry was modified
+    void touch(int h) {
+        if (all_changed || !contains(h))
+            return;
+        if (h >= int(journal.size()))
+            journal.resize(h + 1, NONE);
+        if (journal[h] == NONE) {
+            journal[h] = CHANGED;
+            changed.push_back(h);
+        }
+    }
+
+    // journal the whole store (e.g. after a loop closure or a global BA)
+    void touchAll() {
+        all_changed = true;
+        resetJournal();
+    }
+
+    // hand over the journal and reset it; returns true if the whole store must be redrawn, in that
+    // case the lists are left empty. Handles erased after being changed are only reported as erased.
+    // Single consumer, called with the store read-locked (the journal is state of the consumer).
+    bool takeChanges(std::vector<int> &changed_, std::vector<int> &erased_) const {
+        changed_.clear();
+        erased_.clear();
+        bool all = all_changed;
+        if (!all) {
+            for (int h : changed)
+                if (journal[h] == CHANGED)
+                    changed_.push_back(h);
+            erased_ = erased;
+        }
+        resetJournal();
+        all_changed = false;
+        return all;
+    }
+
+    int size() const { return int(dense.size()) - n_dead; }
+    bool empty() const { return size() == 0; }
+
+    // drop the erased entries (also done automatically by erase)
+    void compact() {
+        int n = 0;
+        for (int h : dense) {
+            if (h < 0)
+                continue;
+            pos[h] = n;
+            dense[n++] = h;
+        }
+        dense.resize(n);
+        n_dead = 0;
+    }
+
+    class const_iterator {
+    public:
+        const_iterator(const int *p_, const int *e_) : p(p_), e(e_) { skip(); }
+        int operator*() const { return *p; }
+        const_iterator& operator++() { ++p; skip(); return *this; }
+        bool operator!=(const const_iterator &other) const { return p != other.p; }
+        bool operator==(const const_iterator &other) const { return p == other.p; }
+    private:
+        void skip() { while (p != e && *p < 0) ++p; }
+        const int *p, *e;
+    };
+
+    const_iterator begin() const { return const_iterator(dense.data(), dense.data() + dense.size()); }
+    const_iterator end()   const { return const_iterator(dense.data() + dense.size(), dense.data() + dense.size()); }
+
+private:
+
+    std::vector<int> dense;     // live handles in increasing order, -1 for the erased ones
+    std::vector<int> pos;       // position of each handle in dense, -1 if not live
+    int n_dead;
+
+    void resetJournal() const {
+        for (int h : changed)
+            journal[h] = NONE;
+        for (int h : erased)
+            journal[h] = NONE;
+        changed.clear();
+        erased.clear();
+    }
+
+    // change journal
+    enum { NONE = 0, CHANGED = 1, ERASED = 2 };
+    mutable std::vector<unsigned char> journal;     // journal state of each handle
+    mutable std::vector<int> changed, erased;
+    mutable bool all_changed;
+};
+
+// Per-KF counters of the landmarks a KF observes and of the ones among them that are also observed by
+// at least min_others other KFs, kept up to date as landmarks gain or lose observations so the
+// redundant KF candidates are ranked without visiting their features. A landmark contributes through
+// its KF observation list: remove() its contribution before changing the list and add() it back after.
+// The counters only rank the candidates, a KF is always checked exactly before being culled.
+class KFRedundancy {
+public:
+
+    explicit KFRedundancy(int min_others_ = 3) : min_others(min_others_) {}
+
+    void clear() {
+        n_lms.clear();
+        n_red.clear();
+    }
+
+    void add(const std::vector<int> &kf_obs)    { update(kf_obs, 1); }
+    void remove(const std::vector<int> &kf_obs) { update(kf_obs, -1); }
+
+    // overwrite the counters of a KF with an exact count
+    void reset(int kf_idx, int n_lms_, int n_red_) {
+        grow(kf_idx);
+        n_lms[kf_idx] = n_lms_;
+        n_red[kf_idx] = n_red_;
+    }
+
+    int landmarks(int kf_idx) const { return kf_idx < int(n_lms.size()) ? n_lms[kf_idx] : 0; }
+    int redundant(int kf_idx) const { return kf_idx < int(n_red.size()) ? n_red[kf_idx] : 0; }
+
+    int minOthers() const { return min_others; }
+
+private:
+
+    void grow(int kf_idx) {
+        if (kf_idx >= int(n_lms.size())) {
+            n_lms.resize(kf_idx + 1, 0);
+            n_red.resize(kf_idx + 1, 0);
+        }
+    }
+
+    void update(const std::vector<int> &kf_obs, int sign) {
+        int red = (int(kf_obs.size()) - 1 >= min_others) ? sign : 0;
+        for (int kf_idx : kf_obs) {
+            if (kf_idx < 0) continue;
+            grow(kf_idx);
+            n_lms[kf_idx] += sign;
+            n_red[kf_idx] += red;
+        }
+    }
+
+    int min_others;
+    std::vector<int> n_lms, n_red;
+};
+
+// Partition of the KFs into sub-maps of consecutive KF handles. Only the last sub-map is active
+// (local map, LBA, KF culling); the closed ones are frozen: their KFs are compacted, never enter
+// the local map again and are fixed in the loop closure and the global BA, where they anchor the
+// active sub-map through the loop closure edges and the landmarks shared with it.
+class SubMaps {
+public:
+
+    SubMaps() { clear(); }
+
+    void clear() {
+        kf_submap.clear();
+        first_kf.assign(1, -1);
+        n_kfs.assign(1, 0);
+    }
+
+    // assign a new KF (handles in increasing order) to the active sub-map
+    void addKF(int kf_idx) {
+        if (kf_idx >= int(kf_submap.size()))
+            kf_submap.resize(kf_idx + 1, active());
+        kf_submap[kf_idx] = active();
+        if (first_kf.back() < 0)
+            first_kf.back() = kf_idx;
+        n_kfs.back()++;
+    }
+
+    // close the active sub-map, the next KFs start a new one
+    void close() {
+        first_kf.push_back(-1);
+        n_kfs.push_back(0);
+    }
+
+    int count()  const { return int(first_kf.size()); }
+    int active() const { return count() - 1; }
+
+    int of(int kf_idx) const { return kf_idx < int(kf_submap.size()) ? kf_submap[kf_idx] : active(); }
+    bool frozen(int kf_idx) const { return of(kf_idx) != active(); }
+
+    // a landmark is frozen if all its observers are
+    bool frozen(const std::vector<int> &kf_obs) const {
+        for (int kf_idx : kf_obs)
+            if (!frozen(kf_idx))
+                return false;
+        return true;
+    }
+
+    int firstKF(int s) const { return first_kf[s]; }
+    int size(int s)    const { return n_kfs[s]; }     // KFs inserted in the sub-map (culled ones included)
+
+private:
+
+    std::vector<int> kf_submap;     // sub-map of each KF handle
+    std::vector<int> first_kf;      // first KF handle of each sub-map (-1 while empty)
+    std::vector<int> n_kfs;
+};
+
+} // namespace PLSLAM
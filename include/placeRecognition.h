@@ -0,0 +1,82 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <utility>
+
+#include <DBoW2/TemplatedVocabulary.h>
+#include <DBoW2/TemplatedDatabase.h>
+#include <DBoW2/FORB.h>
+#include <DBoW2/BowVector.h>
+#include <DBoW2/QueryResults.h>
+
+#include <binaryVocabulary.h>
+#include <keyFrame.h>
+
+typedef PLSLAM::BinaryVocabulary Vocabulary;
+typedef DBoW2::TemplatedDatabase<DBoW2::FORB::TDescriptor, DBoW2::FORB>   BowDatabase;
+
+namespace PLSLAM{
+
+// Place recognition over the keyframes of the map: the BoW vectors of every KF are stored in an
+// inverted file (DBoW2 database) per feature type, so a query only visits the KFs sharing words
+// with the query KF instead of scoring the whole map.
+class PlaceRecognition
+{
+
+public:
+
+    PlaceRecognition();
+    ~PlaceRecognition();
+
+    // builds an empty database for each available vocabulary (NULL if the feature is not used)
+    void setVocabularies( const Vocabulary *voc_p_, const Vocabulary *voc_l_ );
+    void clear();
+
+    // KFs must be inserted in increasing kf_idx order
+    void addKeyFrame( const KeyFrame *kf );
+
+    // similarity between kf_q and kf (combining points and lines with the dispersion of kf_q features)
+    double score( const KeyFrame *kf_q, const KeyFrame *kf ) const;
+
+    // returns up to max_results (kf_idx, score) pairs with kf_idx <= max_kf_idx, sorted by score
+    // (entries whose KF has been removed from the map, i.e. NULL in keyframes, are skipped)
+    void query( const KeyFrame *kf_q, int max_kf_idx, int max_results, const std::vector<KeyFrame*> &keyframes,
+                std::vector<std::pair<int,double>> &candidates ) const;
+
+    int size() const { return entry_kf_idx.size(); }
+
+private:
+
+    void   featureWeights( const KeyFrame *kf, double &w_p, double &w_l ) const;
+    double weightedScore( const KeyFrame *kf_q, const KeyFrame *kf, double w_p, double w_l ) const;
+    int    maxEntryId( int max_kf_idx ) const;
+
+    const Vocabulary *voc_p, *voc_l;
+    BowDatabase      *db_p,  *db_l;
+    std::vector<int>  entry_kf_idx;     // database entry id -> kf_idx
+
+};
+
+}
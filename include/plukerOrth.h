@@ -0,0 +1,122 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+#include <cmath>
+#include <eigen3/Eigen/Core>
+
+// orthonormal representation (U,W) of the Plücker lines, ref: 2005, Adrien Bartoli, Peter Sturm,
+// Structure-From-Motion Using Lines: Representation, Triangulation and Bundle Adjustment
+// theta --> U = Rz(theta2)*Ry(theta1)*Rx(theta0),  phi --> W = [cos(phi) -sin(phi); sin(phi) cos(phi)]
+// the kernels evaluate the trigonometry of each angle once and only the entries of U they need
+
+namespace PLSLAM
+{
+
+// Plücker line (n = w1*u1, d = w2*u2) of an orthonormal line
+inline Eigen::Matrix<double,6,1> orthToPluker(const Eigen::Vector4d& orth)
+{
+    double s1 = sin(orth[0]), c1 = cos(orth[0]);
+    double s2 = sin(orth[1]), c2 = cos(orth[1]);
+    double s3 = sin(orth[2]), c3 = cos(orth[2]);
+    double w1 = cos(orth[3]), w2 = sin(orth[3]);
+    Eigen::Matrix<double,6,1> plk;
+    plk << w1 * c2 * c3,
+           w1 * c2 * s3,
+          -w1 * s2,
+           w2 * ( s1 * s2 * c3 - c1 * s3 ),
+           w2 * ( s1 * s2 * s3 + c1 * c3 ),
+           w2 * s1 * c2;
+    return plk;
+}
+
+// orthonormal line of a Plücker line, only the last row of U = [n/|n| d/|d| nxd/|nxd|] is needed for theta0
+inline Eigen::Vector4d plukerToOrth(const Eigen::Matrix<double,6,1>& plk)
+{
+    Eigen::Vector3d n = plk.head<3>();
+    Eigen::Vector3d d = plk.tail<3>();
+    double n_norm  = n.norm();
+    double d_norm  = d.norm();
+    double nd_norm = n.cross(d).norm();
+    double nd_z    = n(0) * d(1) - n(1) * d(0);
+    Eigen::Vector4d orth;
+    orth[0] = atan2( d(2) / d_norm, nd_z / nd_norm );
+    orth[1] = asin( -n(2) / n_norm );
+    orth[2] = atan2( n(1), n(0) );
+    orth[3] = asin( d_norm / sqrt( n_norm*n_norm + d_norm*d_norm ) );
+    return orth;
+}
+
+// orthonormal update U' = U*Rx(dtheta0)*Ry(dtheta1)*Rz(dtheta2), W' = W*W(dphi)
+inline Eigen::Vector4d orthPlus(const Eigen::Vector4d& orth, const Eigen::Vector4d& delta)
+{
+    double s1 = sin(orth[0]), c1 = cos(orth[0]);
+    double s2 = sin(orth[1]), c2 = cos(orth[1]);
+    double s3 = sin(orth[2]), c3 = cos(orth[2]);
+    Eigen::Matrix3d U;
+    U <<
+      c2 * c3,   s1 * s2 * c3 - c1 * s3,   c1 * s2 * c3 + s1 * s3,
+            c2 * s3,   s1 * s2 * s3 + c1 * c3,   c1 * s2 * s3 - s1 * c3,
+            -s2,                  s1 * c2,                  c1 * c2;
+
+    double sa = sin(delta[0]), ca = cos(delta[0]);
+    double sb = sin(delta[1]), cb = cos(delta[1]);
+    double sc = sin(delta[2]), cc = cos(delta[2]);
+    // columns of Rx*Ry*Rz, only u1' and the last entries of u2', u3' are needed
+    Eigen::Vector3d m1(  cb * cc,  sa * sb * cc + ca * sc, -ca * sb * cc + sa * sc );
+    Eigen::Vector3d m2( -cb * sc, -sa * sb * sc + ca * cc,  ca * sb * sc + sa * cc );
+    Eigen::Vector3d m3(  sb,      -sa * cb,                 ca * cb );
+    Eigen::Vector3d u1 = U * m1;
+    double u2z = U.row(2).dot(m2);
+    double u3z = U.row(2).dot(m3);
+
+    Eigen::Vector4d plus;
+    plus[0] = atan2( u2z, u3z );
+    plus[1] = asin( -u1(2) );
+    plus[2] = atan2( u1(1), u1(0) );
+    plus[3] = asin( sin( orth[3] + delta[3] ) );
+    return plus;
+}
+
+// batched versions over the columns of the line matrices
+inline void orthToPluker(const Eigen::Matrix<double,4,Eigen::Dynamic>& orth, Eigen::Matrix<double,6,Eigen::Dynamic>& plk)
+{
+    plk.resize(6, orth.cols());
+    for( int i = 0; i < orth.cols(); i++ )
+        plk.col(i) = orthToPluker( orth.col(i) );
+}
+
+inline void plukerToOrth(const Eigen::Matrix<double,6,Eigen::Dynamic>& plk, Eigen::Matrix<double,4,Eigen::Dynamic>& orth)
+{
+    orth.resize(4, plk.cols());
+    for( int i = 0; i < plk.cols(); i++ )
+        orth.col(i) = plukerToOrth( plk.col(i) );
+}
+
+// updates the orthonormal lines stored consecutively in X(begin:end) with the increments DX
+inline void orthPlus(Eigen::VectorXd& X, const Eigen::VectorXd& DX, int begin, int end)
+{
+    for( int i = begin; i + 4 <= end; i += 4 )
+        X.segment<4>(i) = orthPlus( X.segment<4>(i), DX.segment<4>(i) );
+}
+
+}
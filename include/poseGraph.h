@@ -0,0 +1,105 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <atomic>
+#include <map>
+#include <utility>
+#include <vector>
+
+//Eigen
+#include <eigen3/Eigen/Core>
+
+//g2o
+#include <g2o/core/sparse_optimizer.h>
+#include <g2o/core/sparse_optimizer_terminate_action.h>
+
+namespace g2o {
+class EdgeSE3;
+}
+
+namespace PLSLAM {
+
+// Persistent pose graph of the loop closure. The KF vertices and the KF to KF
+// and loop constraints are kept between loops and only the new ones are added,
+// and each optimization solves the KFs from the oldest one touched by the new
+// constraints on (as the affected part of an incremental factorization in
+// chronological order) with the older KFs fixed. The KF to KF constraints are
+// re-measured from the current poses on each loop, and the loops of a culled KF
+// are re-anchored on a neighbouring KF. Not thread safe, it is only used by the
+// loop closure. Besides the KFs, the graph can hold one vertex per closed
+// sub-map (its origin, the KFs of the sub-map move rigidly with it).
+class PoseGraph {
+public:
+
+    PoseGraph();
+    ~PoseGraph();
+
+    void clear();
+
+    // id of the rigid vertex of sub-map s (above any KF index, so it is always solved)
+    static int submapVertex(int s) { return ( 1 << 30 ) + s; }
+
+    bool hasVertex(int idx) const;
+    // adds the vertex of KF idx or resets its estimate to T_kf_w
+    void setVertex(int idx, const Eigen::Matrix4d &T_kf_w, bool fixed = false);
+    // removes the vertex of a culled KF with its KF to KF constraints, its loops are moved to the
+    // closest KF it was constrained to (with the relative pose of both vertices)
+    void removeVertex(int idx);
+
+    // relative pose constraint between KFs i < j (x_ij in the se3 ordering of auxiliar, information
+    // in the one of g2o::EdgeSE3), a KF to KF constraint already in the graph takes the new
+    // measurement and a loop is added only once (false if it already was in the graph)
+    bool addEdge(int i, int j, const Eigen::Matrix<double,6,1> &x_ij, bool loop = false,
+                 const Eigen::Matrix<double,6,6> &information = Eigen::Matrix<double,6,6>::Identity());
+    // a re-anchored loop keeps the KFs it was added with
+    bool hasEdge(int i, int j, bool loop = false) const { return ( loop ? loops : edges ).count( std::make_pair(i,j) ) > 0; }
+
+    // optimizes the vertices with index >= first_idx (the others are fixed for it) until the
+    // relative decrease of the error is below min_gain or max_iters, returns the iterations
+    // (-1 if the optimizer could not be started, the graph is left as it was)
+    int optimize(int first_idx, int max_iters, double min_gain);
+
+    Eigen::Matrix4d pose(int idx);
+
+    int numVertices() const { return n_vertices; }
+    int numEdges() const { return edges.size() + loops.size(); }
+    // heap bytes estimate (readable from any thread)
+    size_t memoryUsage() const { return bytes; }
+
+private:
+
+    PoseGraph(const PoseGraph&);
+    PoseGraph& operator=(const PoseGraph&);
+
+    void updateBytes();
+
+    g2o::SparseOptimizer optimizer;
+    g2o::SparseOptimizerTerminateAction *terminate;
+    std::map< std::pair<int,int>, g2o::EdgeSE3* > edges, loops;
+    int n_vertices;
+    std::atomic<size_t> bytes;
+};
+
+} // namespace PLSLAM
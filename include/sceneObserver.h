@@ -0,0 +1,71 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <mapObserver.h>
+#include <slamScene.h>
+
+namespace PLSLAM {
+
+// Draws the pipeline in a slamScene from its own thread, at most max_fps
+// times per second. The tracking thread only composes the pose increments
+// and (throttled) renders the frame image; the map is redrawn when it has
+// changed, under a shared lock that is never waited for.
+class SceneObserver : public MapObserver {
+public:
+
+    SceneObserver(slamScene &scene_, const MapHandler *map_, double max_fps = 30.0);
+    virtual ~SceneObserver();
+
+    void frameTracked(StVO::StereoFrame *frame, bool is_kf);
+    void mapChanged(const MapHandler *map);
+
+    // stops the drawing thread, the scene can then be used directly again
+    void stop();
+
+private:
+
+    void run();
+
+    slamScene &scene;
+    const MapHandler *map;
+    std::chrono::steady_clock::duration period;
+
+    std::mutex mtx;
+    std::condition_variable wake;
+    Mat image;
+    // motion since the last KF, and the part of it already drawn
+    Matrix4d kf_DT, drawn_DT;
+    unsigned int kf_seq;
+    bool has_image, has_pose, map_dirty, stopping;
+    std::chrono::steady_clock::time_point last_image;
+    std::thread viewer;
+};
+
+} // namespace PLSLAM
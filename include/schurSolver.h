@@ -0,0 +1,116 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/Sparse>
+#include <eigen3/Eigen/CholmodSupport>
+
+namespace PLSLAM{
+
+// Sparse block solver for the normal equations of the bundle adjustment problems, H * DX = g, with
+// the state ordered as [ 6-DoF poses | landmarks ] (landmark blocks of any size, e.g. 3 for points,
+// 4 for orthonormal lines, 6 for endpoint lines). The landmarks are marginalized with the Schur
+// complement, so only the reduced camera system (sparse, 6*Nkf) is factorized with Cholmod, and its
+// symbolic factorization is reused while the structure of the problem does not change.
+class SchurSolver
+{
+
+public:
+
+    typedef Eigen::Matrix<double,6,6> Matrix6d;
+    typedef Eigen::Matrix<double,6,1> Vector6d;
+    typedef Eigen::Matrix<double,Eigen::Dynamic,6> MatrixX6d;
+
+    SchurSolver() : Nkf(0), N(0), analyzed(false), structure_changed(true), factorized(false) {}
+    SchurSolver( int Nkf_, const std::vector<int> &lm_dims );
+
+    void resize( int Nkf_, const std::vector<int> &lm_dims );
+    // zero all the blocks, keeping the structure (and the symbolic factorization)
+    void setZero();
+
+    int size() const { return N; }
+    int landmarkOffset( int lm ) const { return lm_off[lm]; }
+
+    // accumulate the blocks of H (kf - local pose index, lm - local landmark index)
+    void addPose( int kf, const Matrix6d &Hii )                 { Hpp[kf] += Hii; }
+    void addLandmark( int lm, const Eigen::MatrixXd &Hjj )      { Hll[lm] += Hjj; }
+    void addPoseLandmark( int kf, int lm, const Eigen::MatrixXd &Hji );     // Hji = H(lm_rows, kf_cols)
+
+    // Levenberg-Marquardt helpers: max. abs. value of the diagonal and H(i,i) += lambda * H(i,i)
+    double maxDiagonal() const;
+    void   addRelativeDamping( double lambda );
+    void   removeRelativeDamping( double lambda );      // undoes addRelativeDamping( lambda )
+
+    // solves H * DX = g (g and DX with the full state layout), if the solver fails DX is zero and returns false
+    bool solve( const Eigen::VectorXd &g, Eigen::VectorXd &DX );
+
+    // marginal covariance of a pose (block of the inverse of the last reduced camera system), false if
+    // the last solve did not factorize it. It is the one of the estimate only if that solve had no
+    // damping and was linearized at the estimate
+    bool poseCovariance( int kf, Matrix6d &cov ) const;
+    // joint marginal covariance of all the poses (6*Nkf x 6*Nkf), with the cross terms
+    bool poseCovariances( Eigen::MatrixXd &cov ) const;
+
+    // partial sums of one task of a parallel evaluation of the observations: the pose blocks and the
+    // pose rows of g are private to the task and added by merge() (one task at a time), the landmark
+    // blocks go straight to the solver, so all the observations of a landmark must go to the same task
+    class Accumulator
+    {
+    public:
+        explicit Accumulator( SchurSolver &solver_ );
+
+        void addPose( int kf, const Matrix6d &Hii )                 { Hpp[kf] += Hii; }
+        void addLandmark( int lm, const Eigen::MatrixXd &Hjj )      { solver.Hll[lm] += Hjj; }
+        void addPoseLandmark( int kf, int lm, const Eigen::MatrixXd &Hji ) { new_blocks |= solver.addPoseLandmarkBlock( kf, lm, Hji ); }
+
+        void merge( Eigen::VectorXd &g );
+
+        Eigen::VectorXd g_pose;     // first 6*Nkf rows of g
+        double          err;
+
+    private:
+        SchurSolver &solver;
+        std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d>> Hpp;
+        bool new_blocks;
+    };
+
+private:
+
+    bool addPoseLandmarkBlock( int kf, int lm, const Eigen::MatrixXd &Hji );   // true if the block is new
+
+    int Nkf, N;
+    std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d>> Hpp;      // pose blocks
+    std::vector<Eigen::MatrixXd>                             Hll;      // landmark blocks
+    std::vector<int>                                         lm_off;   // offset of each landmark in the state
+    std::vector<std::vector<std::pair<int,MatrixX6d>>>       Hlp;      // landmark-pose blocks (per landmark)
+
+    Eigen::SparseMatrix<double>                              S;        // reduced camera system
+    Eigen::CholmodSupernodalLLT<Eigen::SparseMatrix<double>> chol;
+    bool analyzed, structure_changed, factorized;
+
+};
+
+}
@@ -43,13 +43,37 @@ public:
     static int&     minLMEssGraph()     { return getInstance().min_lm_ess_graph; }
     static int&     minLMCovGraph()     { return getInstance().min_lm_cov_graph; }
     static int&     minKFLocalMap()     { return getInstance().min_kf_local_map; }
+    static int&     lbaMaxKFs()         { return getInstance().lba_max_kfs; }
+    static int&     lbaMaxLMs()         { return getInstance().lba_max_lms; }
+    static int&     lbaMaxFixedKFs()    { return getInstance().lba_max_fixed_kfs; }
     static double&  maxLM3DErr()        { return getInstance().max_lm_3d_err; }
     static double&  maxLMDirErr()       { return getInstance().max_lm_dir_err; }
     static double&  lambdaLbaLM()       { return getInstance().lambda_lba_lm; }
     static double&  lambdaLbaK()        { return getInstance().lambda_lba_k; }
     static int&     maxItersLba()       { return getInstance().max_iters_lba; }
+    static double&  lbaTimeBudget()     { return getInstance().lba_time_budget; }
+    static bool&    lbaInterrupt()      { return getInstance().lba_interrupt; }
+    static bool&    lbaMarginalize()    { return getInstance().lba_marginalize; }
+    static int&     submapMaxKFs()      { return getInstance().submap_max_kfs; }
+    static bool&    lmPaging()          { return getInstance().lm_paging; }
+    static std::string&  lmPageFile()   { return getInstance().lm_page_file; }
+    static double&  lmTileSize()        { return getInstance().lm_tile_size; }
+    static int&     lmPageRadius()      { return getInstance().lm_page_radius; }
+    static double&  memBudgetImages()   { return getInstance().mem_budget_images; }
+    static double&  memBudgetLandmarks() { return getInstance().mem_budget_landmarks; }
+    static double&  memBudgetTotal()    { return getInstance().mem_budget_total; }
+    static int&     memPruneDescRows()  { return getInstance().mem_prune_desc_rows; }
+    static bool&    gbaG2O()            { return getInstance().gba_g2o; }
+    static int&     maxItersGBA()       { return getInstance().max_iters_gba; }
+    static double&  gbaTimeBudget()     { return getInstance().gba_time_budget; }
+    static bool&    gbaAfterLC()        { return getInstance().gba_after_lc; }
     static int&     minLMObs()          { return getInstance().min_lm_obs; }
+    static int&     descHistory()       { return getInstance().desc_history; }
+    static bool&    descMajorityVote()  { return getInstance().desc_majority_vote; }
+    static int&     descMaxObs()        { return getInstance().desc_max_obs; }
     static double&  maxCommonFtsKF()    { return getInstance().max_common_fts_kf; }
+    static bool&    kfCulling()         { return getInstance().kf_culling; }
+    static double&  kfCullTimeBudget()  { return getInstance().kf_cull_time_budget; }
     static double&  maxDirLineError()   { return getInstance().max_dir_line_error; }
     static double&  maxPointLineError() { return getInstance().max_point_line_error; }
     static double&  maxPointPointError(){ return getInstance().max_point_point_error; }
@@ -62,16 +86,36 @@ public:
     static double&  lcRot()             { return getInstance().lc_rot; }
     static double&  lcMat()             { return getInstance().lc_mat; }
     static int&     maxItersPGO()       { return getInstance().max_iters_pgo; }
+    static bool&    pgoIncremental()    { return getInstance().pgo_incremental; }
+    static double&  pgoMinGain()        { return getInstance().pgo_min_gain; }
+    static int&     pgRetentionKFs()    { return getInstance().pg_retention_kfs; }
     static int&     lcKFDist()          { return getInstance().lc_kf_dist; }
     static int&     lcKFMaxDist()       { return getInstance().lc_kf_max_dist; }
     static int&     lcNKFClosest()      { return getInstance().lc_nkf_closest; }
     static double&  lcInlierRatio()     { return getInstance().lc_inlier_ratio; }
+    static int&     lcMaxCandidates()   { return getInstance().lc_max_candidates; }
+    static int&     lcVerifyCandidates() { return getInstance().lc_verify_candidates; }
+    static int&     lcRansacHyps()      { return getInstance().lc_ransac_hyps; }
+    static double&  lcFuseVoxel()       { return getInstance().lc_fuse_voxel; }
+    static int&     lcFuseDescTh()      { return getInstance().lc_fuse_desc_th; }
+    static int&     lcBowLevelsUp()     { return getInstance().lc_bow_levels_up; }
+    static int&     lcBowMaxDist()      { return getInstance().lc_bow_max_dist; }
     static int&     minPointMatches()   { return getInstance().min_pt_matches; }
     static int&     minLineMatches()    { return getInstance().min_ls_matches; }
     static double&  kfInlierRatio()     { return getInstance().kf_inlier_ratio; }
     static bool&    fastMatching()      { return getInstance().fast_matching; }
     static bool&    hasRefinement()     { return getInstance().has_refinement; }
     static bool&    multithreadSLAM()   { return getInstance().mutithread_slam; }
+    static int&     kfQueueSize()       { return getInstance().kf_queue_size; }
+    static int&     kfBatchMax()        { return getInstance().kf_batch_max; }
+    static bool&    compactKFs()        { return getInstance().compact_kfs; }
+    static double&  kfThumbnailScale()  { return getInstance().kf_thumbnail_scale; }
+    static std::string&  mapSaveFile()  { return getInstance().map_save_file; }
+    static std::string&  mapLoadFile()  { return getInstance().map_load_file; }
+    static std::string&  feRecordFile() { return getInstance().fe_record_file; }
+    static int&          linkQueueSize() { return getInstance().link_queue_size; }
+    static bool&    localizationOnly()  { return getInstance().localization_only; }
+    static double&  sceneMaxFps()       { return getInstance().scene_max_fps; }
 
     // SLAM parameters
     int    max_kf_num_frames;
@@ -83,6 +127,9 @@ public:
     int    min_lm_cov_graph;
     int    min_lm_ess_graph;
     int    min_kf_local_map;
+    int    lba_max_kfs;
+    int    lba_max_lms;
+    int    lba_max_fixed_kfs;
     double max_lm_3d_err;
     double max_lm_dir_err;
     double max_dir_line_error;
@@ -91,8 +138,29 @@ public:
     double lambda_lba_lm;
     double lambda_lba_k;
     int    max_iters_lba;
+    double lba_time_budget;
+    bool   lba_interrupt;
+    bool   lba_marginalize;
+    int    submap_max_kfs;
+    bool   lm_paging;
+    std::string lm_page_file;
+    double lm_tile_size;
+    int    lm_page_radius;
+    double mem_budget_images;
+    double mem_budget_landmarks;
+    double mem_budget_total;
+    int    mem_prune_desc_rows;
+    bool   gba_g2o;
+    int    max_iters_gba;
+    double gba_time_budget;
+    bool   gba_after_lc;
     int    min_lm_obs;
+    int    desc_history;
+    bool   desc_majority_vote;
+    int    desc_max_obs;
     double max_common_fts_kf;
+    bool   kf_culling;
+    double kf_cull_time_budget;
     std::string vocabulary_p, vocabulary_l;
     double lc_res;
     double lc_unc;
@@ -101,16 +169,36 @@ public:
     double lc_rot;
     double lc_mat;
     int    max_iters_pgo;
+    bool   pgo_incremental;
+    double pgo_min_gain;
+    int    pg_retention_kfs;
     int    lc_kf_dist;
     int    lc_kf_max_dist;
     int    lc_nkf_closest;
     double lc_inlier_ratio;
+    int    lc_max_candidates;
+    int    lc_verify_candidates;
+    int    lc_ransac_hyps;
+    double lc_fuse_voxel;
+    int    lc_fuse_desc_th;
+    int    lc_bow_levels_up;
+    int    lc_bow_max_dist;
     int    min_pt_matches;
     int    min_ls_matches;
     double kf_inlier_ratio;
     bool   fast_matching;
     bool   has_refinement;
     bool   mutithread_slam;
+    int    kf_queue_size;
+    int    kf_batch_max;
+    bool   compact_kfs;
+    double kf_thumbnail_scale;
+    std::string map_save_file;
+    std::string map_load_file;
+    std::string fe_record_file;
+    int         link_queue_size;
+    bool   localization_only;
+    double scene_max_fps;
 
 };
 
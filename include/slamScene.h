@@ -88,6 +88,16 @@ public:
     CMatrixDouble33 getCovFormat(MatrixXd cov_);
     CPose3D getPoseXYZ(VectorXd x);
 
+    // incremental landmark drawing from the map change journal (see MapHandler::takeChanges)
+    void updateLandmarks(const MapHandler* map);
+    void updatePoint(const MapHandler* map, int h);
+    void updateLine(const MapHandler* map, int h);
+    void drawPoint(int h, const Vector3d &P, bool local);
+    void drawLine(int h, const Vector6d &L, bool local);
+    void dropPoint(int h);
+    void dropLine(int h);
+    bool isDecimated(int h, const Vector3d &P, bool local) const;
+
     CDisplayWindow3D*           win;
     COpenGLScenePtr             theScene;
     COpenGLViewportPtr          image, legend, help;
@@ -120,6 +130,18 @@ public:
 
     float           b, sigmaP, sigmaL, f, cx, cy, bsigmaL, bsigmaP;
 
+    // landmarks further than lodDist from the last KF (0 disables) are drawn one out of lodStep
+    float           lodDist;
+    int             lodStep;
+    // camera position at the last evaluation of the whole drawn set
+    Vector3d        lod_center;
+    // slot of each landmark handle in its point cloud / set of lines (-1 if not drawn), the cloud
+    // holding it and the handle stored at each slot
+    vector<int>     pt_slot, ls_slot;
+    vector<char>    pt_in_local, ls_in_local;
+    vector<int>     pt_handles, pt_handles_local, ls_handles, ls_handles_local;
+    bool            points_synced, lines_synced;
+
 };
 
 }
@@ -0,0 +1,114 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace PLSLAM {
+
+// Bounded lock-free ring buffer for one producer thread and one consumer
+// thread. tryPush/tryPop never block; the capacity is rounded up to a power
+// of two. Counters are only written by their owning side.
+template<typename T>
+class SPSCQueue {
+public:
+
+    explicit SPSCQueue(std::size_t capacity = 64) { reset(capacity); }
+
+    // not thread safe, call before the threads start
+    void reset(std::size_t capacity) {
+        std::size_t cap = 2;
+        while (cap < capacity)
+            cap <<= 1;
+        buffer.assign(cap, T());
+        mask = cap - 1;
+        head.store(0);
+        tail.store(0);
+        n_pushed = n_popped = n_rejected = max_depth = 0;
+    }
+
+    // producer side
+    bool tryPush(const T &item) {
+        const std::size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) {
+            n_rejected++;
+            return false;
+        }
+        buffer[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        n_pushed++;
+        const std::size_t d = t + 1 - head.load(std::memory_order_relaxed);
+        if (d > max_depth)
+            max_depth = d;
+        return true;
+    }
+
+    // consumer side
+    bool tryPop(T &item) {
+        const std::size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = buffer[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        n_popped++;
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    // approximate when called concurrently
+    std::size_t depth() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    std::size_t capacity() const { return mask + 1; }
+
+    // back-pressure statistics (read them once both threads are idle)
+    std::size_t pushed()   const { return n_pushed; }
+    std::size_t popped()   const { return n_popped; }
+    std::size_t rejected() const { return n_rejected; }
+    std::size_t maxDepth() const { return max_depth; }
+
+private:
+
+    std::vector<T> buffer;
+    std::size_t mask;
+
+    // consumer index and counter, padded away from the producer ones to
+    // avoid false sharing (the object itself may not be cache-line aligned)
+    char pad0[64];
+    std::atomic<std::size_t> head;
+    std::size_t n_popped;
+    char pad1[64];
+    // producer index and counters
+    std::atomic<std::size_t> tail;
+    std::size_t n_pushed, n_rejected, max_depth;
+    char pad2[64];
+};
+
+} // namespace PLSLAM
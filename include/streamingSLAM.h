@@ -0,0 +1,86 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <framePipeline.h>
+#include <stereoFrameHandler.h>
+#include <mapHandler.h>
+#include <mapObserver.h>
+
+namespace PLSLAM {
+
+// Library entry point for live stereo input. A camera driver pushes the image pairs (not copied,
+// see FramePipeline::pushStereoPair) from its own thread; the features are extracted on the
+// pipeline thread and the tracking thread of this class estimates the poses and inserts the KFs
+// into the map. The results are published through the observers: frameTracked for every tracked
+// frame (tracking thread) and mapChanged from the mapping threads.
+// On multi-rig platforms one instance per stereo rig (MapHandler::addRig) feeds the same map: rig 0
+// initializes it and the others wait for it, their tracking and extraction threads use the CPUs
+// of the session they are created in (cpus_tracking). The last instance stopped finishes the
+// mapping threads, the KFs of a rig added after it are rejected.
+class StreamingSLAM {
+public:
+
+    StreamingSLAM(PinholeStereoCamera *cam_, MapHandler *map_, int queue_size = 2,
+                  StVO::FramePipeline::DropPolicy policy = StVO::FramePipeline::DROP_OLDEST, int rig_ = 0);
+    ~StreamingSLAM();
+
+    // before start()
+    void addObserver(MapObserver *observer);
+
+    void start();
+    // processes the queued pairs and, for the last front-end of the map, finishes the mapping threads
+    // (the map is then ready for GBA)
+    void stop();
+
+    bool pushStereoPair(const cv::Mat &img_l, const cv::Mat &img_r, long double t,
+                        std::shared_ptr<void> owner = std::shared_ptr<void>())
+    { return pipeline.pushStereoPair(img_l, img_r, t, owner); }
+
+    int trackedFrames() const { return n_tracked; }
+    int droppedFrames() const { return pipeline.droppedFrames(); }
+
+private:
+
+    void track();
+
+    StVO::StereoFrameHandler vo;
+    StVO::FramePipeline pipeline;
+    MapHandler *map;
+    int rig;
+    std::vector<MapObserver*> observers;
+
+    std::thread tracker;
+    std::atomic<int> n_tracked;
+    bool started;
+    std::atomic<bool> stopping;     // interrupts the wait of the other rigs for rig 0
+    Config *config;                 // session of the creator, used by the tracking thread
+};
+
+} // namespace PLSLAM
@@ -0,0 +1,104 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <condition_variable>
+#include <cstddef>
+#include <list>
+#include <mutex>
+
+namespace StVO {
+
+// Blocking FIFO with a maximum size, shared by two pipeline stages. Once
+// closed, push() discards new items and pop() drains the remaining ones.
+template<typename T>
+class BoundedQueue {
+public:
+
+    explicit BoundedQueue(std::size_t max_size_ = 2) : max_size(max_size_ < 1 ? 1 : max_size_), closed(false) { }
+
+    bool push(const T &item) {
+        std::unique_lock<std::mutex> lk(mtx);
+        not_full.wait(lk, [this]{ return closed || items.size() < max_size; });
+        if (closed) return false;
+        items.push_back(item);
+        lk.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    // non-blocking push, false if the queue is full or closed
+    bool tryPush(const T &item) {
+        std::unique_lock<std::mutex> lk(mtx);
+        if (closed || items.size() >= max_size) return false;
+        items.push_back(item);
+        lk.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    // non-blocking push that makes room by dropping the oldest items, returns the number dropped
+    // (or -1 if closed); the dropped items are destroyed out of the lock
+    int pushDropOldest(const T &item) {
+        std::list<T> dropped;
+        std::unique_lock<std::mutex> lk(mtx);
+        if (closed) return -1;
+        while (items.size() >= max_size)
+            dropped.splice(dropped.end(), items, items.begin());
+        items.push_back(item);
+        lk.unlock();
+        not_empty.notify_one();
+        return int(dropped.size());
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lk(mtx);
+        not_empty.wait(lk, [this]{ return closed || !items.empty(); });
+        if (items.empty()) return false;
+        item = items.front();
+        items.pop_front();
+        lk.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            closed = true;
+        }
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+private:
+
+    std::list<T> items;
+    std::size_t max_size;
+    bool closed;
+    std::mutex mtx;
+    std::condition_variable not_full, not_empty;
+};
+
+} // namespace StVO
@@ -35,6 +35,22 @@ public:
 
     static Config& getInstance();
 
+    // Per-session configuration (several SLAM instances in one process): while a Scope is alive the
+    // getters of its thread, and of the thread pool tasks it submits, read cfg instead of the
+    // process-wide instance (NULL restores it)
+    class Scope {
+    public:
+        explicit Scope(Config *cfg);
+        ~Scope();
+    private:
+        Config *prev;
+    };
+    // configuration of the calling thread, NULL for the process-wide one
+    static Config* current();
+
+    // line_model resolved with the build default, for the VO and the back-end (map lines, LBA, GBA)
+    static bool plukerLines();
+
     // Keyframe selection parameters (for SLAM, if any)
     static double&  minEntropyRatio()   { return getInstance().min_entropy_ratio; }
     static double&  maxKFTDist()        { return getInstance().max_kf_t_dist; }
@@ -43,17 +59,46 @@ public:
     // flags
     static bool&    hasPoints()         { return getInstance().has_points; }
     static bool&    hasLines()          { return getInstance().has_lines; }
+    static int&     lineModel()         { return getInstance().line_model; }
     static bool&    useFLDLines()       { return getInstance().use_fld_lines; }
+    static bool&    useGPUFeatures()    { return getInstance().use_gpu_features; }
     static bool&    lrInParallel()      { return getInstance().lr_in_parallel; }
     static bool&    plInParallel()      { return getInstance().pl_in_parallel; }
     static bool&    bestLRMatches()     { return getInstance().best_lr_matches; }
+    static int&     mihMinRows()        { return getInstance().mih_min_rows; }
+    static int&     mihRadius()         { return getInstance().mih_radius; }
+    static bool&    kltTracking()       { return getInstance().klt_tracking; }
+    static int&     kltWinSize()        { return getInstance().klt_win_size; }
+    static int&     kltLevels()         { return getInstance().klt_levels; }
+    static double&  kltMinTracks()      { return getInstance().klt_min_tracks; }
+    static double&  kltKFMargin()       { return getInstance().klt_kf_margin; }
     static bool&    adaptativeFAST()    { return getInstance().adaptative_fast; }
     static bool&    useMotionModel()    { return getInstance().use_motion_model; }
+    static bool&    trackLocalMap()     { return getInstance().track_local_map; }
+    static bool&    pipelinedVO()       { return getInstance().pipelined_vo; }
+    static int&     pipelineQueueSize() { return getInstance().pipeline_queue_size; }
+    static int&     datasetPrefetch()   { return getInstance().dataset_prefetch; }
+    static bool&    rectifyGray()       { return getInstance().rectify_gray; }
+    static bool&    rectifyCrop()       { return getInstance().rectify_crop; }
+    static int&     numWorkerThreads()  { return getInstance().num_worker_threads; }
+    static std::string& cpusTracking()  { return getInstance().cpus_tracking; }
+    static int&     prioTracking()      { return getInstance().prio_tracking; }
+    static std::string& cpusWorkers()   { return getInstance().cpus_workers; }
+    static int&     prioWorkers()       { return getInstance().prio_workers; }
+    static std::string& cpusMapping()   { return getInstance().cpus_mapping; }
+    static int&     prioMapping()       { return getInstance().prio_mapping; }
+    static bool&    profileStages()     { return getInstance().profile_stages; }
+    static std::string& traceFile()     { return getInstance().trace_file; }
+    static int&     logLevel()          { return getInstance().log_level; }
 
     // points detection and matching
     static int&     matchingStrategy()  { return getInstance().matching_strategy; }
     static int&     matchingSWs()       { return getInstance().matching_s_ws; }
     static int&     matchingF2FWs()     { return getInstance().matching_f2f_ws; }
+    static int&     localMapWs()        { return getInstance().local_map_ws; }
+    static bool&    f2fAdaptiveWs()     { return getInstance().f2f_adaptive_ws; }
+    static double&  f2fWsSigma()        { return getInstance().f2f_ws_sigma; }
+    static int&     f2fMaxWs()          { return getInstance().f2f_max_ws; }
 
 
     static int&     orbNFeatures()      { return getInstance().orb_nfeatures; }
@@ -69,8 +114,15 @@ public:
     static int&     fastIncTh()         { return getInstance().fast_inc_th; }
     static int&     fastFeatTh()        { return getInstance().fast_feat_th; }
     static double&  fastErrTh()         { return getInstance().fast_err_th; }
+    static bool&    featBudget()        { return getInstance().feat_budget; }
+    static double&  featLatencyTarget() { return getInstance().feat_latency_target; }
+    static int&     featMaxDesc()       { return getInstance().feat_max_desc; }
+    static int&     featGridCols()      { return getInstance().feat_grid_cols; }
+    static int&     featGridRows()      { return getInstance().feat_grid_rows; }
+    static double&  featOversample()    { return getInstance().feat_oversample; }
     static double&  maxDistEpip()       { return getInstance().max_dist_epip; }
     static double&  minDisp()           { return getInstance().min_disp; }
+    static double&  stereoMinDepth()    { return getInstance().stereo_min_depth; }
     static double&  minRatio12P()       { return getInstance().min_ratio_12_p; }
 
     static double&  rgbdMinDepth()      { return getInstance().rgbd_min_depth; }
@@ -87,6 +139,12 @@ public:
     static double&  lsdLogEps()         { return getInstance().lsd_log_eps; }
     static double&  lsdDensityTh()      { return getInstance().lsd_density_th; }
     static int&     lsdNBins()          { return getInstance().lsd_n_bins; }
+    static int&     lsdTiles()          { return getInstance().lsd_tiles; }
+    static bool&    lsMerge()           { return getInstance().ls_merge; }
+    static double&  lsMergeAngle()      { return getInstance().ls_merge_angle; }
+    static double&  lsMergeDist()       { return getInstance().ls_merge_dist; }
+    static double&  lsMergeGap()        { return getInstance().ls_merge_gap; }
+    static bool&    lsBucketing()       { return getInstance().ls_bucketing; }
     static double&  lineHorizTh()       { return getInstance().line_horiz_th; }
     static double&  minLineLength()     { return getInstance().min_line_length; }
     static double&  minRatio12L()       { return getInstance().min_ratio_12_l; }
@@ -100,8 +158,11 @@ public:
     static int&     minFeatures()       { return getInstance().min_features; }
     static int&     maxIters()          { return getInstance().max_iters; }
     static int&     maxItersRef()       { return getInstance().max_iters_ref; }
+    static bool&    poseWarmStart()     { return getInstance().pose_warm_start; }
     static double&  minError()          { return getInstance().min_error; }
     static double&  minErrorChange()    { return getInstance().min_error_change; }
+    static double&  minRelChange()      { return getInstance().min_rel_change; }
+    static double&  minStepNorm()       { return getInstance().min_step_norm; }
     static double&  inlierK()           { return getInstance().inlier_k; }
 
     // SLAM parameters (keyframe selection)
@@ -112,17 +173,46 @@ public:
     // flags
     bool has_points;
     bool has_lines;
+    int  line_model;
     bool lr_in_parallel;
     bool pl_in_parallel;
     bool best_lr_matches;
+    int  mih_min_rows;
+    int  mih_radius;
+    bool klt_tracking;
+    int  klt_win_size;
+    int  klt_levels;
+    double klt_min_tracks;
+    double klt_kf_margin;
     bool adaptative_fast;
     bool use_fld_lines;
+    bool use_gpu_features;
     bool use_motion_model;
+    bool track_local_map;
+    bool pipelined_vo;
+    int pipeline_queue_size;
+    int dataset_prefetch;
+    bool rectify_gray;
+    bool rectify_crop;
+    int num_worker_threads;
+    std::string cpus_tracking;
+    int prio_tracking;
+    std::string cpus_workers;
+    int prio_workers;
+    std::string cpus_mapping;
+    int prio_mapping;
+    bool profile_stages;
+    std::string trace_file;
+    int log_level;
 
     // points detection and matching
     int matching_strategy;
     int matching_s_ws;
     int matching_f2f_ws;
+    int local_map_ws;
+    bool f2f_adaptive_ws;
+    double f2f_ws_sigma;
+    int f2f_max_ws;
 
     int    orb_nfeatures;
     double orb_scale_factor;
@@ -138,9 +228,16 @@ public:
     int    fast_inc_th;
     int    fast_feat_th;
     double fast_err_th;
+    bool   feat_budget;
+    double feat_latency_target;
+    int    feat_max_desc;
+    int    feat_grid_cols;
+    int    feat_grid_rows;
+    double feat_oversample;
 
     double max_dist_epip;
     double min_disp;
+    double stereo_min_depth;
     double min_ratio_12_p;
     double stereo_overlap_th;
     double f2f_overlap_th;
@@ -159,6 +256,12 @@ public:
     double lsd_log_eps;
     double lsd_density_th;
     int    lsd_n_bins;
+    int    lsd_tiles;
+    bool   ls_merge;
+    double ls_merge_angle;
+    double ls_merge_dist;
+    double ls_merge_gap;
+    bool   ls_bucketing;
     double line_horiz_th;
     double min_line_length;
     double min_ratio_12_l;
@@ -169,9 +272,15 @@ public:
     int    min_features;
     int    max_iters;
     int    max_iters_ref;
+    bool   pose_warm_start;
     double min_error;
     double min_error_change;
+    double min_rel_change;
+    double min_step_norm;
     double inlier_k;
 
+    // a SlamConfig, which then also serves the SlamConfig getters of its scope
+    bool   slam_config;
+
 };
 
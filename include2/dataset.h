@@ -23,12 +23,17 @@
 #pragma once
 
 //STL
+#include <atomic>
 #include <list>
+#include <memory>
 #include <string>
+#include <thread>
 
 //OpenCV
 #include <opencv2/core.hpp>
 
+#include "boundedQueue.h"
+#include "config.h"
 #include "pinholeStereoCamera.h"
 
 namespace StVO {
@@ -50,9 +55,25 @@ public:
 
 private:
 
+    struct ImagePair {
+        cv::Mat img_l, img_r;
+        long double t;
+    };
+
+    // Decodes the next pair (left and right in parallel) and rectifies it
+    void readFrame(ImagePair &pair);
+
+    // Reader thread, keeps up to Config::datasetPrefetch() frames ahead of nextFrame()
+    void prefetchFrames();
+
     std::list<std::string> images_l, images_r;
     const PinholeStereoCamera &cam;
     std::list<long double> img_time;
+
+    std::size_t n_left;
+    std::unique_ptr<BoundedQueue<ImagePair>> prefetch_queue;
+    std::thread reader;
+    Config *config;                 // session of the creator, used by the reader thread
 };
 
 } // namespace StVO
@@ -0,0 +1,116 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+//Eigen
+#include <eigen3/Eigen/Core>
+
+#include <stereoFeatures.h>
+
+namespace StVO {
+
+// Per-frame storage for stereo features. Objects are constructed in place in
+// aligned blocks of BlockSize elements, so consecutive features are contiguous
+// in memory and the pointers stored in stereo_pt / stereo_ls stay valid until
+// the arena is destroyed. A feature is referred to by its index in the frame.
+template<typename T, int BlockSize = 128>
+class FeatureArena {
+public:
+
+    FeatureArena() : n(0) {}
+
+    ~FeatureArena() {
+        clear();
+        for (T *block : blocks)
+            Eigen::internal::aligned_free(block);
+    }
+
+    template<typename... Args>
+    T* create(Args &&... args) {
+        if (n == blocks.size() * BlockSize)
+            blocks.push_back(static_cast<T*>(Eigen::internal::aligned_malloc(sizeof(T) * BlockSize)));
+        T *obj = blocks[n / BlockSize] + n % BlockSize;
+        new (obj) T(std::forward<Args>(args)...);
+        ++n;
+        return obj;
+    }
+
+    // destroys all the objects, keeping the blocks for reuse
+    void clear() {
+        for (size_t i = 0; i < n; ++i)
+            (*this)[i].~T();
+        n = 0;
+    }
+
+    size_t size() const { return n; }
+    size_t capacity() const { return blocks.size() * BlockSize; }     // objects of the allocated blocks
+
+    T& operator[](size_t i) { return blocks[i / BlockSize][i % BlockSize]; }
+    const T& operator[](size_t i) const { return blocks[i / BlockSize][i % BlockSize]; }
+
+private:
+
+    FeatureArena(const FeatureArena&);
+    FeatureArena& operator=(const FeatureArena&);
+
+    std::vector<T*> blocks;
+    size_t n;
+};
+
+// Arenas with the features of one frame. A frame promoted to KF gives the KF a
+// copy of its features (StereoFrame::copyFeatures) in arenas of its own
+struct FrameFeatureArena {
+    FeatureArena<PointFeature> points;
+    FeatureArena<LineFeature>  lines;
+};
+
+// Structure-of-arrays copy of the stereo geometry of the point features,
+// column i corresponds to stereo_pt[i]. Indices and inlier flags change during
+// tracking and stay on the PointFeature objects.
+struct PointArrays {
+    Eigen::Matrix<double,2,Eigen::Dynamic> pl;
+    Eigen::Matrix<double,1,Eigen::Dynamic> disp;
+    Eigen::Matrix<double,3,Eigen::Dynamic> P;
+
+    void assign(const std::vector<PointFeature*> &points);
+    int size() const { return pl.cols(); }
+};
+
+// Structure-of-arrays copy of the stereo geometry of the line segments,
+// column i corresponds to stereo_ls[i]
+struct LineArrays {
+    Eigen::Matrix<double,2,Eigen::Dynamic> spl, epl;
+    Eigen::Matrix<double,1,Eigen::Dynamic> sdisp, edisp;
+    Eigen::Matrix<double,3,Eigen::Dynamic> sP, eP;
+
+    void assign(const std::vector<LineFeature*> &lines);
+    int size() const { return spl.cols(); }
+};
+
+} // namespace StVO
@@ -0,0 +1,72 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+#include <vector>
+
+//OpenCV
+#include <opencv2/core.hpp>
+
+namespace StVO {
+
+// Per-frame feature budget. It sets the number of point and line features each
+// image keeps and the FAST threshold of the next frame: the caps shrink while the
+// extraction takes longer than feat_latency_target and grow back when it is below,
+// and they are scaled down together so points and lines never exceed feat_max_desc
+// descriptors. The points are spread over a grid of the image before being described.
+class FeatureBudget {
+public:
+
+    FeatureBudget();
+
+    // back to the Config limits (new sequence)
+    void reset();
+
+    // feeds the number of point candidates of the last left image and its extraction time [ms]
+    void update(int n_pt_detected, double elapsed_ms);
+
+    int fastTh()          const { return fast_th; }
+    int maxPoints()       const { return n_points; }
+    int maxLines()        const { return n_lines; }     // 0 for no cap
+    int pointCandidates() const;
+    double latency()      const { return latency_ms; }
+
+    // keeps the maxPoints() best keypoints spread over the grid (and their descriptor rows)
+    void selectPoints(std::vector<cv::KeyPoint> &points, cv::Size size, cv::Mat *desc = NULL) const;
+
+    // indices (in ascending order) of the n best features by response, at first each cell of the
+    // cols x rows grid gets its share and the rest is filled with the best remaining ones
+    static void selectBucketed(const std::vector<cv::Point2f> &pos, const std::vector<float> &response, int n,
+                               cv::Size size, int cols, int rows, std::vector<int> &selected);
+
+private:
+
+    void computeCaps();
+
+    int    fast_th;
+    int    n_points, n_lines;
+    double scale;           // ratio of the Config caps available within the latency target
+    double latency_ms;      // smoothed extraction time
+};
+
+} // namespace StVO
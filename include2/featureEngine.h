@@ -0,0 +1,87 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/ximgproc/fast_line_detector.hpp>
+#ifdef USE_CUDA_FEATURES
+#include <opencv2/cudafeatures2d.hpp>
+#endif
+
+#include <line_descriptor_custom.hpp>
+#include <line_descriptor/descriptor_custom.hpp>
+
+namespace StVO {
+
+// Per-thread feature extraction context. The OpenCV detectors and descriptors
+// are created once per thread and reused across frames, their parameters are
+// refreshed from Config on each call. It also keeps the scratch images of the
+// line detection, so they are only reallocated when the image size changes.
+class FeatureEngine {
+public:
+
+    // context of the calling thread
+    static FeatureEngine& local();
+
+    cv::Ptr<cv::ORB> orb(int fast_th);
+
+    // ORB detection on the GPU (same keypoints and CV_8U descriptors as the CPU one), returns false
+    // if it is disabled, not built (USE_CUDA_FEATURES) or there is no device, so the caller can fall back
+    bool detectORBOnGPU(const cv::Mat &img, int fast_th, std::vector<cv::KeyPoint> &points, cv::Mat &pdesc);
+
+    cv::Ptr<cv::line_descriptor::BinaryDescriptor> lbd();
+
+    cv::Ptr<cv::line_descriptor::LSDDetectorC> lsd();
+
+    // recreated only when the min. length changes (it has no setter)
+    cv::Ptr<cv::ximgproc::FastLineDetector> fld(double min_line_length);
+
+    // OpenCV LSD used on the image strips, recreated only when the options change
+    cv::Ptr<cv::LineSegmentDetector> segmentDetector(const cv::line_descriptor::LSDDetectorC::LSDOptions &opts);
+
+    // scratch images of the FLD detection
+    cv::Mat img_gray, fld_img;
+
+private:
+
+    FeatureEngine();
+    FeatureEngine(const FeatureEngine&);
+    FeatureEngine& operator=(const FeatureEngine&);
+
+    cv::Ptr<cv::ORB> orb_;
+    cv::Ptr<cv::line_descriptor::BinaryDescriptor> lbd_;
+    cv::Ptr<cv::line_descriptor::LSDDetectorC> lsd_;
+    cv::Ptr<cv::ximgproc::FastLineDetector> fld_;
+    double fld_min_length;
+    cv::Ptr<cv::LineSegmentDetector> segment_detector_;
+    cv::line_descriptor::LSDDetectorC::LSDOptions segment_opts;
+#ifdef USE_CUDA_FEATURES
+    cv::Ptr<cv::cuda::ORB> cuda_orb_;
+    cv::cuda::GpuMat gpu_img, gpu_desc;
+#endif
+};
+
+} // namespace StVO
@@ -0,0 +1,104 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <atomic>
+#include <memory>
+#include <thread>
+
+//OpenCV
+#include <opencv2/core.hpp>
+
+#include "boundedQueue.h"
+#include "config.h"
+#include "dataset.h"
+#include "pinholeStereoCamera.h"
+#include "stereoFrame.h"
+
+namespace StVO {
+
+// Staged front-end: a loader thread reads and rectifies the images, an
+// extraction thread detects and stereo-matches the features, and the caller
+// runs the F2F tracking, pose optimization and KF decision. The stages are
+// connected by bounded queues, so the features of frame N+1 are extracted
+// while the pose of frame N is being optimized.
+// Without a dataset the images are pushed by the caller (e.g. a camera driver)
+// instead of the loader thread, and the drop policy sets what happens when the
+// front-end falls behind: the driver waits, or the oldest / newest pair is dropped.
+class FramePipeline {
+public:
+
+    enum DropPolicy { BLOCK, DROP_OLDEST, DROP_NEWEST };
+
+    FramePipeline(Dataset &dataset_, PinholeStereoCamera *cam_, int queue_size = 2);
+    FramePipeline(PinholeStereoCamera *cam_, int queue_size = 2, DropPolicy policy_ = BLOCK);
+    virtual ~FramePipeline();
+
+    void start();
+    void stop();
+
+    // Blocks until the next frame has its stereo features, returns NULL at the end of the sequence
+    StereoFrame* nextFrame();
+
+    // Live input: the images are not copied, they must stay valid until owner is released (with the
+    // frame, or right away if the pair is dropped); false if the pair was dropped or the stream ended
+    bool pushStereoPair(const cv::Mat &img_l, const cv::Mat &img_r, long double t,
+                        std::shared_ptr<void> owner = std::shared_ptr<void>());
+    // Ends the live input, nextFrame returns NULL once the queued pairs are processed
+    void endOfStream();
+    int  droppedFrames() const { return n_dropped; }
+
+    // Detection thresholds for the frames extracted from now on (adaptative FAST)
+    void setThresholds(double llength_th_, int orb_fast_th_);
+
+private:
+
+    struct ImagePair {
+        cv::Mat img_l, img_r;
+        std::shared_ptr<void> owner;
+        long double t;
+        int idx;
+    };
+
+    void loadImages();
+    void extractFeatures();
+
+    Dataset *dataset;               // NULL for live input
+    PinholeStereoCamera *cam;
+    DropPolicy policy;
+    std::atomic<int> n_pushed, n_dropped;
+
+    BoundedQueue<ImagePair> image_queue;
+    BoundedQueue<StereoFrame*> frame_queue;
+
+    std::atomic<double> llength_th;
+    std::atomic<int> orb_fast_th;
+    FeatureBudget feat_budget;      // only used by the extraction thread
+
+    std::thread loader, extractor;
+    bool started;
+    Config *config;                 // session of the creator, used by the stage threads
+};
+
+} // namespace StVO
@@ -23,19 +23,20 @@
 #pragma once
 
 //STL
-#include <list>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
 namespace StVO {
 
-void getLineCoords(double x1, double y1, double x2, double y2, std::list<std::pair<int, int>> &line_coords);
+void getLineCoords(double x1, double y1, double x2, double y2, std::vector<std::pair<int, int>> &line_coords);
 
 struct GridWindow {
     std::pair<int, int> width, height;
 };
 
+// Flat (CSR) grid: the indices of all the cells are stored in one array,
+// bucketed by cell with a counting sort. The storage is kept by clear(), so
+// a grid can be reused without allocating once it has reached its size.
 class GridStructure {
 public:
 
@@ -45,16 +46,94 @@ public:
 
     ~GridStructure();
 
-    std::list<int>& at(int x, int y);
+    // Adds idx to the cell (x, y), out of bounds cells are ignored
+    void add(int x, int y, int idx);
 
-    void get(int x, int y, const GridWindow &w, std::unordered_set<int> &indices) const;
+    // Buckets the added indices by cell, must be called before get()
+    void build();
+
+    // Appends to indices the content of the cells in the window around (x, y)
+    void get(int x, int y, const GridWindow &w, std::vector<int> &indices) const;
+
+    void clear();
+
+private:
+
+    std::vector<std::pair<int, int>> entries; // (cell, idx) in insertion order
+    std::vector<int> cell_start;              // offset of each cell in cell_idx (column-major)
+    std::vector<int> cell_idx;
+    bool built;
+};
+
+// Row-band index of line segments: a segment is stored once per grid row it
+// crosses, with its x-extent inside that row, and each row is sorted by x.
+// A query is a binary search per row, there is no per-cell rasterization.
+class LineRowIndex {
+public:
+
+    int rows, cols;
+
+    LineRowIndex(int rows, int cols);
+
+    // Adds the segment (x1, y1)-(x2, y2), in cell units, the rows out of bounds are ignored
+    void add(double x1, double y1, double x2, double y2, int idx);
+
+    // Sorts the added segments by row and x, must be called before get()
+    void build();
+
+    // Appends the segments crossing the rows [min_y, max_y) within the columns [min_x, max_x)
+    void get(double min_x, double max_x, int min_y, int max_y, std::vector<int> &indices) const;
+
+    // Same window as GridStructure::get around the cell (x, y)
+    void get(int x, int y, const GridWindow &w, std::vector<int> &indices) const;
 
     void clear();
 
 private:
 
-    std::vector<std::vector<std::list<int>>> grid;
-    std::list<int> out_of_bounds;
+    struct Span {
+        float x_min, x_max;
+        int idx;
+    };
+
+    std::vector<std::pair<int, Span>> entries; // (row, span) in insertion order
+    std::vector<int> row_start;                // offset of each row in spans
+    std::vector<Span> spans;
+    std::vector<float> row_width;              // widest span of each row, bounds the search
+    bool built;
+};
+
+// Epipolar-band index of rectified keypoints: the points are bucketed by
+// bands of rows and sorted by x within each band, so the candidates of a
+// point are a contiguous span of the bands around its row.
+class EpipolarBandIndex {
+public:
+
+    EpipolarBandIndex(double band_height);
+
+    // Adds the point (x, y) in pixels, negative rows are ignored
+    void add(double x, double y, int idx);
+
+    // Sorts the added points by band and x, must be called before get()
+    void build();
+
+    // Appends the points with x in [min_x, max_x] and |y' - y| <= max_dy
+    void get(double y, double max_dy, double min_x, double max_x, std::vector<int> &indices) const;
+
+    void clear();
+
+private:
+
+    struct Entry {
+        float x, y;
+        int idx;
+    };
+
+    double band_height;
+    std::vector<std::pair<int, Entry>> entries; // (band, point) in insertion order
+    std::vector<int> band_start;                // offset of each band in points
+    std::vector<Entry> points;
+    bool built;
 };
 
 } // namespace StVO
@@ -0,0 +1,71 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <cstdint>
+#include <vector>
+
+//OpenCV
+#include <opencv2/core.hpp>
+
+namespace StVO {
+
+// Best and second best Hamming distances of one query descriptor
+struct HammingMatch {
+    int idx;            // row of the best train descriptor (-1 if none)
+    int best, second;   // INT_MAX when there are fewer than 1 / 2 candidates
+};
+
+// Packed 256-bit binary descriptor (ORB, LBD), with the layout of a 32-byte CV_8U row
+struct Desc256 {
+    uint64_t w[4];
+
+    Desc256() { w[0] = w[1] = w[2] = w[3] = 0; }
+    // copies a 32-byte CV_8U row (an empty one gives zeros), throws std::runtime_error otherwise
+    explicit Desc256(const cv::Mat &row);
+
+    const uchar* data() const { return reinterpret_cast<const uchar*>(w); }
+    // header on the descriptor, valid while it lives
+    cv::Mat mat() const { return cv::Mat(1, 32, CV_8U, const_cast<uint64_t*>(w)); }
+};
+
+// Hamming distance between two binary descriptors (rows of CV_8U matrices)
+int hammingDistance(const cv::Mat &a, const cv::Mat &b);
+int hammingDistance(const Desc256 &a, const Desc256 &b);
+
+// 1-vs-many: distances from the query row to the train rows listed in idx
+// (all the train rows in order when idx is NULL), written to dist[0..n)
+void hammingDistances(const cv::Mat &query, const cv::Mat &train, const int *idx, int n, int *dist);
+void hammingDistances(const Desc256 &query, const Desc256 *train, const int *idx, int n, int *dist);
+
+// 1-vs-many: best and second best train rows for the query row
+HammingMatch hammingBest2(const cv::Mat &query, const cv::Mat &train, const int *idx = NULL, int n = -1);
+
+// many-vs-many: best and second best train rows for every query row
+void hammingBest2(const cv::Mat &query, const cv::Mat &train, std::vector<HammingMatch> &matches);
+
+// Name of the kernel selected for the running CPU ("avx512", "avx2", "neon" or "scalar")
+const char* hammingKernelName();
+
+} // namespace StVO
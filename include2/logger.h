@@ -0,0 +1,126 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace StVO {
+
+enum LogLevel {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+};
+
+// Process-wide asynchronous console logger. The callers format the message and
+// publish it in a bounded ring without locks (a full ring drops the message and
+// counts it), a writer thread prints the messages in order, the warnings and
+// errors to stderr. Messages longer than a slot are truncated.
+class Logger {
+public:
+
+    static Logger& instance();
+
+    // runtime level (log_level), the messages below it are not formatted
+    void setLevel(int level) { min_level.store(level, std::memory_order_relaxed); }
+    bool enabled(int level) const { return level >= min_level.load(std::memory_order_relaxed); }
+
+    void write(int level, const std::string &msg);
+    // blocks until the messages published so far are printed
+    void flush();
+    long long dropped() const { return n_dropped.load(std::memory_order_relaxed); }
+
+private:
+
+    Logger();
+    ~Logger();
+    Logger(const Logger&);
+    Logger& operator=(const Logger&);
+
+    static const std::size_t RING_SIZE  = 4096;    // power of two
+    static const std::size_t SLOT_CHARS = 256;
+
+    struct Slot {
+        std::atomic<std::size_t> seq;    // index + 1 once published, index + RING_SIZE once printed
+        int level;
+        std::size_t len;
+        char text[SLOT_CHARS];
+    };
+
+    void writerLoop();
+    // prints the published messages, false if there were none
+    bool drain();
+
+    std::unique_ptr<Slot[]> ring;
+    std::atomic<std::size_t> head;       // next slot claimed by a producer
+    std::size_t tail;                    // next slot printed (writer only)
+    std::atomic<std::size_t> n_written;
+    std::atomic<long long> n_dropped;
+    std::atomic<int> min_level;
+    std::atomic<bool> running;
+    std::thread writer;
+};
+
+} // namespace StVO
+
+// compile-time level, the logging calls below it are removed (LOG_MIN_LEVEL in CMake)
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 1
+#endif
+
+// msg is a stream expression, e.g. LOG_INFO("[MapHandler] culled " << n << " KFs")
+#define LOG_AT(level, msg) do { \
+    if (StVO::Logger::instance().enabled(level)) { \
+        std::ostringstream log_os_; \
+        log_os_ << msg; \
+        StVO::Logger::instance().write(level, log_os_.str()); \
+    } } while (0)
+
+#if LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(msg) LOG_AT(StVO::LOG_LEVEL_DEBUG, msg)
+#else
+#define LOG_DEBUG(msg) do { } while (0)
+#endif
+#if LOG_MIN_LEVEL <= 1
+#define LOG_INFO(msg) LOG_AT(StVO::LOG_LEVEL_INFO, msg)
+#else
+#define LOG_INFO(msg) do { } while (0)
+#endif
+#if LOG_MIN_LEVEL <= 2
+#define LOG_WARN(msg) LOG_AT(StVO::LOG_LEVEL_WARN, msg)
+#else
+#define LOG_WARN(msg) do { } while (0)
+#endif
+#if LOG_MIN_LEVEL <= 3
+#define LOG_ERROR(msg) LOG_AT(StVO::LOG_LEVEL_ERROR, msg)
+#else
+#define LOG_ERROR(msg) do { } while (0)
+#endif
@@ -49,14 +49,39 @@ inline void normalize(std::pair<double, double> &v) {
 
 int matchNNR(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<int> &matches_12);
 
-int match(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<int> &matches_12);
+// same as matchNNR, searching desc2 through a multi-index hash (MihIndex) when it is a 256-bit
+// descriptor set with more than mih_min_rows rows (a match that passes the ratio test beyond the
+// mih_radius search distance may be missed)
+int matchNNRIndexed(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<int> &matches_12);
+
+// indexed selects matchNNRIndexed in both directions, for the call sites with large candidate sets
+int match(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<int> &matches_12, bool indexed = false);
 
 int distance(const cv::Mat &a, const cv::Mat &b);
 
+// same as match, but each feature of groups1[g] is only compared to the features of groups2[g]
+// (e.g. the features of two frames under the same vocabulary node); the matches are also within
+// max_dist, since the ratio test always passes for a single candidate in the group
+int matchGroups(const cv::Mat &desc1, const cv::Mat &desc2,
+                const std::vector<const std::vector<unsigned int>*> &groups1,
+                const std::vector<const std::vector<unsigned int>*> &groups2,
+                float nnr, int max_dist, std::vector<int> &matches_12);
+
 //Points
 int matchGrid(const std::vector<point_2d> &points1, const cv::Mat &desc1, const GridStructure &grid, const cv::Mat &desc2, const GridWindow &w, std::vector<int> &matches_12);
 
+// same, with a search window per point
+int matchGrid(const std::vector<point_2d> &points1, const cv::Mat &desc1, const GridStructure &grid, const cv::Mat &desc2, const std::vector<GridWindow> &w, std::vector<int> &matches_12);
+
+// stereo points in pixels, the candidates of (x, y) are within the band |y' - y| <= max_dy
+// and the disparities x - x' in [min_disp, max_disp]
+int matchEpipolar(const std::vector<std::pair<double, double>> &points1, const cv::Mat &desc1, const EpipolarBandIndex &index, const cv::Mat &desc2,
+                  double max_dy, double min_disp, double max_disp, std::vector<int> &matches_12);
+
 //Lines
-int matchGrid(const std::vector<line_2d> &lines1, const cv::Mat &desc1, const GridStructure &grid, const cv::Mat &desc2, const std::vector<std::pair<double, double>> &directions2, const GridWindow &w, std::vector<int> &matches_12);
+int matchGrid(const std::vector<line_2d> &lines1, const cv::Mat &desc1, const LineRowIndex &grid, const cv::Mat &desc2, const std::vector<std::pair<double, double>> &directions2, const GridWindow &w, std::vector<int> &matches_12);
+
+// same, with a search window per line
+int matchGrid(const std::vector<line_2d> &lines1, const cv::Mat &desc1, const LineRowIndex &grid, const cv::Mat &desc2, const std::vector<std::pair<double, double>> &directions2, const std::vector<GridWindow> &w, std::vector<int> &matches_12);
 
 } // namesapce StVO
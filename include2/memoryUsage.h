@@ -0,0 +1,62 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include <opencv/cv.h>
+
+namespace StVO {
+
+// Heap bytes of the containers, for the per-subsystem memory accounting. The
+// figures are estimates: allocator overheads are ignored and shared buffers
+// are counted by every holder.
+
+template<typename T, typename A>
+inline std::size_t vectorBytes(const std::vector<T,A> &v) {
+    return v.capacity() * sizeof(T);
+}
+
+// nodes of a std::map (three pointers and the color per node)
+template<typename K, typename V, typename C, typename A>
+inline std::size_t mapBytes(const std::map<K,V,C,A> &m) {
+    return m.size() * (sizeof(typename std::map<K,V,C,A>::value_type) + 4 * sizeof(void*));
+}
+
+// headers into external buffers (memory-mapped files, caller-owned images) do not count
+inline std::size_t matBytes(const cv::Mat &m) {
+    return (m.u != NULL) ? m.total() * m.elemSize() : 0;
+}
+
+// bytes of a frame (or a KF) split by what the eviction policies can release
+struct FrameMemory {
+    std::size_t images;     // full resolution images and thumbnails
+    std::size_t features;   // features, keypoints, descriptors and BoW vectors
+
+    FrameMemory() : images(0), features(0) {}
+};
+
+} // namespace StVO
@@ -0,0 +1,72 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <cstdint>
+#include <vector>
+
+//OpenCV
+#include <opencv2/core.hpp>
+
+#include "hamming.h"
+
+namespace StVO {
+
+// Multi-index hashing of 256-bit binary descriptors (ORB, LBD), as the Mihasher of the line
+// descriptor matcher: the codes are split into m substrings of about log2(N) bits, each one the key
+// of a table. A code closer than m * (r + 1) to the query has a substring within distance r of the
+// query one, so probing every table up to radius r finds all of them. The tables are flat (CSR).
+class MihIndex {
+public:
+
+    MihIndex() : n_chunks(0) {}
+
+    // 32-byte CV_8U rows, copied (throws std::runtime_error for other descriptors)
+    explicit MihIndex(const cv::Mat &desc) { build(desc); }
+
+    void build(const cv::Mat &desc);
+
+    int size() const { return codes.size(); }
+
+    // Best and second best rows for the query row, probing the tables up to max_radius and stopping
+    // as soon as the ratio test best < nnr * second is decided. The search is exact up to the
+    // distance m * (r + 1) of the last radius r, the second best is clamped to it (so a match that
+    // passes the test also passes it with the exhaustive search) and a best beyond it gives idx -1
+    HammingMatch best2(const cv::Mat &query, float nnr, int max_radius) const;
+
+private:
+
+    struct Chunk {
+        int start, bits;    // bit range of the substring in the code
+        int offset;         // first bucket of the table in buckets
+    };
+
+    std::vector<Desc256> codes;
+    int n_chunks;
+    std::vector<Chunk> chunks;
+    std::vector<uint32_t> buckets;  // begin of each bucket in ids, 2^bits + 1 entries per table
+    std::vector<int> ids;           // rows of the codes, bucketed by table and key
+};
+
+} // namespace StVO
@@ -52,6 +52,9 @@ private:
     //pluker
     Matrix3d            plukerK;
 
+    // Crops the rectification maps, the image size and the principal point to the valid region of both cameras
+    void cropToValidROI();
+
 public:
 
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -75,6 +78,8 @@ public:
     // Proyection and Back-projection
     Vector3d backProjection_unit(const double &u, const double &v, const double &disp, double &depth);
     Vector3d backProjection(const double &u, const double &v, const double &disp);
+    // analytic covariance of backProjection for an image noise of variance sigma2_px
+    Matrix3d backProjectionCov(double u, double v, double disp, double sigma2_px) const;
     Vector2d projection(const Vector3d &P);
     Vector3d projectionNH(Vector3d P);
     Vector2d nonHomogeneous( Vector3d x);
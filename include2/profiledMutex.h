@@ -0,0 +1,94 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <mutex>
+#include <string>
+
+#include <profiler.h>
+
+namespace StVO {
+
+// std::mutex that reports its contention to the Profiler while it is enabled: the time spent waiting
+// by the contended acquisitions ("<name>.wait", its count is the number of them) and the time it is
+// held ("<name>.hold"). Both are aggregated in a StageHistogram, so a lock does not take the Profiler
+// mutex. Waits on it go through a std::condition_variable_any with a WaitLock, which keeps the release
+// and re-lock around the wait out of the statistics (a polling wait would add a pair per wake-up).
+class ProfiledMutex {
+public:
+
+    explicit ProfiledMutex(const char *name) : t_locked(-1.0), wait_hist(std::string(name) + ".wait"),
+        hold_hist(std::string(name) + ".hold") {}
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+    void lock() {
+        Profiler &prof = Profiler::instance();
+        if (!prof.enabled()) {
+            m.lock();
+            t_locked = -1.0;
+            return;
+        }
+        if (!m.try_lock()) {
+            double t_start = prof.now();
+            m.lock();
+            wait_hist.add(prof.now() - t_start);
+        }
+        t_locked = prof.now();
+    }
+
+    bool try_lock() {
+        if (!m.try_lock())
+            return false;
+        t_locked = Profiler::instance().enabled() ? Profiler::instance().now() : -1.0;
+        return true;
+    }
+
+    void unlock() {
+        double t_start = t_locked, t_end = t_start >= 0.0 ? Profiler::instance().now() : 0.0;
+        t_locked = -1.0;
+        m.unlock();
+        if (t_start >= 0.0)
+            hold_hist.add(t_end - t_start);
+    }
+
+    // lockable of the condition variable waits on a held ProfiledMutex: the hold ends at the first
+    // wait, and the re-locks (and the holds after them) are not profiled
+    class WaitLock {
+    public:
+        explicit WaitLock(ProfiledMutex &pm_) : pm(pm_) {}
+        void lock()   { pm.m.lock(); }
+        void unlock() { pm.unlock(); }
+    private:
+        ProfiledMutex &pm;
+    };
+
+private:
+
+    std::mutex m;
+    double t_locked;    // start of the current hold (-1 while not profiled), written by the owner
+    StageHistogram wait_hist, hold_hist;
+};
+
+} // namespace StVO
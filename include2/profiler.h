@@ -0,0 +1,161 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace StVO {
+
+class StageHistogram;
+
+// Process-wide registry of per-stage latencies. Stages are coarse (one sample
+// per detection/matching/optimization call), so a single mutex is enough.
+// When tracing is enabled every sample is also kept as an event and can be
+// exported in the Chrome trace format (chrome://tracing, Perfetto).
+class Profiler {
+public:
+
+    static Profiler& instance();
+
+    void setEnabled(bool enabled, bool trace = false);
+    bool enabled() const { return is_enabled; }
+
+    // t_start and duration in microseconds since the profiler epoch
+    void addSample(const char *stage, double t_start, double duration);
+    void addCount(const char *name, long long n = 1);
+    // level that is overwritten (e.g. bytes of a subsystem), the peak is kept as well
+    void setGauge(const char *name, long long value);
+
+    // microseconds elapsed since the profiler epoch
+    double now() const;
+
+    // stable copy of a generated stage or counter name (stages are kept by pointer in the trace)
+    const char* intern(const std::string &name);
+
+    // stages aggregated by a StageHistogram, reported with the sampled ones while registered
+    void addHistogram(StageHistogram *hist);
+    void removeHistogram(StageHistogram *hist);
+
+    // count, mean, p50, p95, p99 and max (ms) for every stage
+    void printReport(std::ostream &os) const;
+    // same statistics as a JSON object: {"stages":{name:{count,mean_ms,...}},"counters":{name:n},
+    // "gauges":{name:{last,peak}}}
+    void writeReportJSON(std::ostream &os) const;
+    bool writeTrace(const std::string &file) const;
+    void clear();
+
+private:
+
+    Profiler();
+
+    struct Event {
+        const char *stage;
+        double t_start, duration;
+        int tid;
+    };
+
+    int threadIndex();
+
+    bool is_enabled, is_tracing;
+    std::chrono::steady_clock::time_point epoch;
+
+    mutable std::mutex mtx;
+    std::map<std::string, std::vector<double>> samples;
+    std::map<std::string, long long> counters;
+    std::map<std::string, std::pair<long long, long long>> gauges;    // last and peak
+    std::map<std::thread::id, int> thread_ids;
+    std::set<std::string> names;
+    std::set<StageHistogram*> histograms;
+    std::vector<Event> events;
+};
+
+// Stage too frequent for one sample per call (e.g. the acquisitions of a lock): only the count, sum, max
+// and a log2 histogram of the durations are kept, lock-free, so its percentiles are the upper bound of
+// their bucket. It is registered in the Profiler for its lifetime and not traced.
+class StageHistogram {
+public:
+
+    explicit StageHistogram(const std::string &name);
+    ~StageHistogram();
+    StageHistogram(const StageHistogram&) = delete;
+    StageHistogram& operator=(const StageHistogram&) = delete;
+
+    // duration in microseconds, from any thread
+    void add(double duration);
+    void clear();
+
+    const char* name() const { return stage; }
+    long long count() const { return n.load(std::memory_order_relaxed); }
+    // microseconds
+    double mean() const;
+    double max() const { return 1e-3 * max_ns.load(std::memory_order_relaxed); }
+    double percentile(double p) const;
+
+private:
+
+    static const int n_buckets = 40;    // bucket b > 0 holds the durations in [2^(b-1), 2^b) us
+
+    const char *stage;
+    std::atomic<long long> n, sum_ns, max_ns;
+    std::atomic<long long> buckets[n_buckets];
+};
+
+// Records the lifetime of the scope as one sample of the given stage
+class ScopedTimer {
+public:
+
+    explicit ScopedTimer(const char *stage_) : stage(stage_), active(Profiler::instance().enabled()) {
+        if (active) t_start = Profiler::instance().now();
+    }
+
+    ~ScopedTimer() {
+        if (active) {
+            Profiler &prof = Profiler::instance();
+            prof.addSample(stage, t_start, prof.now() - t_start);
+        }
+    }
+
+private:
+
+    ScopedTimer(const ScopedTimer&);
+    ScopedTimer& operator=(const ScopedTimer&);
+
+    const char *stage;
+    bool active;
+    double t_start;
+};
+
+} // namespace StVO
+
+#define PROFILE_CONCAT_IMPL(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_IMPL(a, b)
+#define PROFILE_SCOPE(stage) StVO::ScopedTimer PROFILE_CONCAT(profile_scope_, __LINE__)(stage)
@@ -25,6 +25,7 @@
 #include <config.h>
 using namespace Eigen;
 typedef Eigen::Matrix<double, 6, 1> Vector6d;
+class PinholeStereoCamera;
 namespace StVO{
 
 class PointFeature
@@ -46,6 +47,9 @@ public:
 
     PointFeature* safeCopy();
 
+    // analytic covariance of P, only computed on the first use (most matches never need it)
+    const Matrix3d& covariance( const PinholeStereoCamera *cam ) const;
+
     int idx;
     Vector2d pl, pl_obs;
     double   disp;
@@ -53,7 +57,8 @@ public:
     bool inlier;
     int level;
     double sigma2 = 1.0;
-    Matrix3d covP_an;
+    mutable Matrix3d covP_an;
+    mutable bool has_cov = false;   // covP_an is set
 
 };
 
@@ -111,6 +116,10 @@ public:
 
     LineFeature* safeCopy();
 
+    // analytic covariances of sP and eP, only computed on the first use
+    const Matrix3d& startCovariance( const PinholeStereoCamera *cam ) const;
+    const Matrix3d& endCovariance( const PinholeStereoCamera *cam ) const;
+
     int idx;
     Vector2d spl,epl, spl_obs, epl_obs;  //spl,epl: left img line start and end pixel
     double   sdisp, edisp, angle, sdisp_obs, edisp_obs;
@@ -121,7 +130,8 @@ public:
     int level;
     double sigma2 = 1.0;
 
-    Matrix3d covE_an, covS_an;
+    mutable Matrix3d covE_an, covS_an;
+    mutable bool has_cov = false;   // covE_an and covS_an are set
 
     //pluker
     Vector6d NDc;
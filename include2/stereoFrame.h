@@ -23,6 +23,7 @@
 #pragma once
 
 #include <future>
+#include <memory>
 #include <thread>
 #include <time.h>
 #include <set>
@@ -45,6 +46,9 @@ using namespace Eigen;
 
 #include <config.h>
 #include <stereoFeatures.h>
+#include <featureArena.h>
+#include <featureBudget.h>
+#include <memoryUsage.h>
 #include <pinholeStereoCamera.h>
 #include <auxiliar.h>
 
@@ -68,10 +72,20 @@ public:
     ~StereoFrame();
 
     void extractStereoFeatures( double llength_th, int fast_th = 20 );
+    // extraction within the caps and FAST threshold of the budget, which is then updated
+    void extractStereoFeatures( double llength_th, FeatureBudget &budget_ );
     void extractRGBDFeatures(   double llength_th, int fast_th = 20 );
 
+    // tracks the left features of prev by pyramidal optical flow instead of extracting new ones (false if
+    // less than min_tracks are tracked), their depth comes from the prev features moved by DT_pred
+    bool trackStereoFeatures( const StereoFrame* prev, const Matrix4d &DT_pred, int min_tracks );
+    // depth of the tracked features from the prev features moved by DT, without the ones not flagged
+    // in pt_inlier / ls_inlier (empty flags keep all of them)
+    void updateTrackedFeatures( const StereoFrame* prev, const Matrix4d &DT,
+                                const vector<bool> &pt_inlier = vector<bool>(), const vector<bool> &ls_inlier = vector<bool>() );
+
     void detectStereoPoints(int fast_th = 20);
-    void detectPointFeatures( Mat img, vector<KeyPoint> &points, Mat &pdesc, int fast_th = 20 );
+    void detectPointFeatures( Mat img, vector<KeyPoint> &points, Mat &pdesc, int fast_th = 20, int *n_detected = NULL );
     void matchStereoPoints(vector<KeyPoint> points_l, vector<KeyPoint> points_r, Mat &pdesc_l_, Mat pdesc_r, bool initial = false );
     void matchPointFeatures(BFMatcher* bfm, Mat pdesc_1, Mat pdesc_2, vector<vector<DMatch>> &pmatches_12);
 
@@ -88,13 +102,26 @@ public:
     void lineDescriptorMAD( const vector<vector<DMatch>> matches, double &nn_mad, double &nn12_mad );
 
     //for pluker
-    Vector4d pi_from_ppp(Vector3d x1, Vector3d x2, Vector3d x3);
-    Vector6d pipi_plk( Vector4d pi1, Vector4d pi2);
+    Vector4d pi_from_ppp(const Vector3d& x1, const Vector3d& x2, const Vector3d& x3);
+    Vector6d pipi_plk(const Vector4d& pi1, const Vector4d& pi2);
+    // Plücker coordinates of a line from its endpoints in the left and right images
+    Vector6d stereoPluker( const Vector3d &sp_l, const Vector3d &ep_l, const Vector3d &sp_r, const Vector3d &ep_r );
 
     Mat  plotStereoFrame();
 
+    // copies the features of sf into an arena of this frame, with their covariances, so the frame
+    // (a KF of the mapper) never shares a feature with the tracker and the copies are only read
+    // concurrently
+    void copyFeatures( const StereoFrame* sf );
+    void updateFeatureArrays();
+
+    // heap bytes of the images and of the features of the frame
+    FrameMemory memoryUsage() const;
+
     int frame_idx;
     Mat img_l, img_r;
+    std::shared_ptr<void> img_owner;    // externally owned images (FramePipeline::pushStereoPair), released with the frame
+    Mat gray_l, gray_r;     // single channel images shared by all the detectors (only during the extraction, gray_l is kept with klt_tracking)
     Matrix4d Tfw;
     Matrix4d DT;
 
@@ -106,8 +133,16 @@ public:
     Vector6d DT_cov_eig;
     double   err_norm;
 
+    // features are owned by the arena, stereo_pt / stereo_ls index them
+    std::shared_ptr< FrameFeatureArena > arena;
     vector< PointFeature* > stereo_pt;
     vector< LineFeature*  > stereo_ls;
+    PointArrays pt_arrays;
+    LineArrays  ls_arrays;
+
+    // features tracked from the previous frame (trackStereoFeatures), with the index of their source feature
+    bool        klt_tracked;
+    vector<int> pt_src, ls_src;
 
     vector<KeyPoint> points_l, points_r;
     vector<KeyLine>  lines_l,  lines_r;
@@ -115,6 +150,9 @@ public:
 
     PinholeStereoCamera *cam;
 
+    const FeatureBudget *budget;    // caps of the current extraction (NULL for the Config ones)
+    int n_pt_detected;              // point candidates of the left image in the last extraction
+
     double inv_width, inv_height; // grid cell
     long double t;
 };
@@ -21,6 +21,8 @@
 *****************************************************************************/
 
 #pragma once
+#include <deque>
+#include <memory>
 #include <stereoFrame.h>
 #include <stereoFeatures.h>
 
@@ -31,6 +33,62 @@ class StereoFrame;
 
 namespace StVO{
 
+// scalar of the batched pose observations and jacobians, single precision with
+// USE_FLOAT_POSE (the normal equations are still accumulated in double)
+#ifdef USE_FLOAT_POSE
+typedef float  PoseScalar;
+#else
+typedef double PoseScalar;
+#endif
+
+// Inlier observations of the pose problem stored column-wise, gathered once
+// per solve so that each iteration computes residuals and jacobians in batch.
+// Storage only grows, so the snapshot does not allocate in steady state.
+struct PoseObservations
+{
+    int n_pt = 0, n_ls = 0;
+
+    // point features
+    Matrix<PoseScalar,3,Dynamic> P, P_;
+    Matrix<PoseScalar,2,Dynamic> pl_obs;
+    Matrix<PoseScalar,1,Dynamic> sigma2_pt;
+
+    // line segment features
+    Matrix<PoseScalar,3,Dynamic> sP, eP, le_obs;
+    Matrix<PoseScalar,2,Dynamic> spl, epl, spl_obs, epl_obs;
+    Matrix<PoseScalar,6,Dynamic> NDc;
+    Matrix<PoseScalar,1,Dynamic> sigma2_ls;
+
+    // per-iteration jacobians, residual norms, overlaps and weights
+    Matrix<PoseScalar,6,Dynamic> J_pt, J_ls, Jw;
+    Matrix<PoseScalar,1,Dynamic> r_pt, r_ls, overlap_ls, w, rw;
+    vector<double> res;
+
+    void reserve( int n_pt_, int n_ls_ );
+    size_t bytes() const;
+};
+
+// Local map landmarks published by the mapper for the VO front-end of a rig,
+// expressed in the coordinates of its KF kf_idx (counted by that front-end), with
+// their representative descriptors. A snapshot is never modified once published.
+struct LocalMapSnapshot
+{
+    int kf_idx = -1;
+    int rig = 0;
+    Matrix<double,3,Dynamic> P;
+    Mat pdesc;
+};
+
+// heap bytes of the tracking front-end, see StereoFrameHandler::memoryUsage
+struct TrackingMemory
+{
+    FrameMemory frames;         // previous and current frames (the features of a KF are shared with the map)
+    size_t      buffers = 0;    // pose problem and matching buffers
+    size_t      local_map = 0;  // local map snapshot in use (published by the mapper)
+
+    size_t total() const { return frames.images + frames.features + buffers + local_map; }
+};
+
 class StereoFrameHandler
 {
 
@@ -42,12 +100,18 @@ public:
     ~StereoFrameHandler();
 
     void initialize( const Mat img_l_, const Mat img_r_, const int idx_, const long double t_);
+    void initialize( StereoFrame* frame );
     void insertStereoPair(const Mat img_l_, const Mat img_r_, const int idx_, const long double t_);
+    void insertStereoFrame( StereoFrame* frame );
     void updateFrame();
 
     void f2fTracking();
     void matchF2FPoints();
     void matchF2FLines();
+
+    // local map tracking: the snapshot is used once its KF is the current reference KF
+    void setLocalMap( const std::shared_ptr<const LocalMapSnapshot> &snapshot );
+    void trackLocalMap();
     double f2fLineSegmentOverlap( Vector2d spl_obs, Vector2d epl_obs, Vector2d spl_proj, Vector2d epl_proj  );
 
     bool isGoodSolution( Matrix4d DT, Matrix6d DTcov, double err );
@@ -61,11 +125,15 @@ public:
     // adaptative fast
     int orb_fast_th;
     double llength_th;
+    FeatureBudget feat_budget;      // caps and FAST threshold with feat_budget
 
     // slam-specific functions
     bool needNewKF();
     void currFrameIsKF();
 
+    // memory accounting, also published as profiler gauges by updateFrame
+    TrackingMemory memoryUsage() const;
+
     //list< boost::shared_ptr<PointFeature> > matched_pt;
     //list< boost::shared_ptr<LineFeature>  > matched_ls;
     list< PointFeature* > matched_pt;
@@ -76,18 +144,45 @@ public:
     PinholeStereoCamera *cam;
 
     int  n_inliers, n_inliers_pt, n_inliers_ls;
+    int  pose_iters;                    // solver iterations of the last optimizePose (both stages)
 
     // slam-specific variables
     bool     prev_f_iskf;
+    bool     prev_f_shared, curr_f_shared;   // frame promoted to a KF (the KF has a copy of its features)
     double   entropy_first_prevKF;
     Matrix4d T_prevKF;
     Matrix6d cov_prevKF_currF;
     int      N_prevKF_currF;
+    double   kf_t_dist, kf_r_dist, kf_entropy_ratio;    // KF criteria of the last needNewKF
+    int      kf_count;                  // index of the current reference KF
+
+    // local map snapshot and its pose wrt the current reference KF
+    std::shared_ptr<const LocalMapSnapshot> local_map;
+    Matrix4d T_prevKF_map;
+    // transform from each of the last KFs to the next one (the last into the current KF), places the
+    // snapshots published for an older KF
+    std::deque<Matrix4d, Eigen::aligned_allocator<Matrix4d>> kf_chain;
+    int      n_inliers_map;             // point matches with the local map (last frame)
+
+    // optical flow tracking between KFs (klt_tracking), features of the last extraction
+    int      n_extracted;
 
 //    bool recurse;
 
 private:
 
+    // motion model guided f2f matching (false if it has to fall back to brute force)
+    bool predictMotion( Matrix4d &DT_pred, Matrix6d &DT_pred_cov );
+    bool matchF2FPointsGuided( std::vector<int> &matches_12 );
+    bool matchF2FLinesGuided( std::vector<int> &matches_12 );
+
+    // optical flow tracking of the features of prev_frame (false if they have to be extracted)
+    bool trackStereoFrame( StereoFrame* frame );
+    bool nearNewKF() const;
+    void updateTrackedFrame();
+    // full stereo extraction of a tracked frame taken as a KF
+    void extractKFFeatures();
+
     void prefilterOutliers( Matrix4d DT );
     void removeOutliers( Matrix4d DT );
     void gaussNewtonOptimization(Matrix4d &DT, Matrix6d &DT_cov, double &err_, int max_iters);
@@ -98,6 +193,24 @@ private:
     void optimizeFunctionsRobust(Matrix4d DT, Matrix6d &H, Vector6d &g, double &e);
     void optimizePoseDebug();
 
+    // batched residuals and jacobians over the inlier snapshot
+    void buildPoseObservations();
+    void pointJacobians( const Matrix4d &DT );
+    void lineJacobians( const Matrix4d &DT );
+    void plukerLineJacobians( const Matrix4d &DT );
+    PoseObservations pose_obs;
+
+    // robust normal equations specialized on the features (points, lines, Plücker lines), so each
+    // configuration runs its own kernel without per-frame branches; the overload picks it from Config
+    enum PoseFeatures { POSE_POINTS = 1, POSE_LINES = 2, POSE_PLUKER = 4 };
+    template< int F > void robustNormalEquations( const Matrix4d &DT, Matrix6d &H, Vector6d &g, double &e );
+    void robustNormalEquations( bool pluker, const Matrix4d &DT, Matrix6d &H, Vector6d &g, double &e );
+
+    // current points matched by f2f tracking, and reusable buffers of local map tracking
+    vector<bool> f2f_pt_matched;
+    vector<int>  map_visible;
+    Mat          map_desc;
+
 
     //pluker
     void optimizeFunctionsUsingPluker(Matrix4d DT, Matrix6d &H, Vector6d &g, double &e);
@@ -0,0 +1,107 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace StVO {
+
+// Persistent pool of worker threads with one task deque per worker. Workers
+// pop their own deque from the back and steal from the front of the others.
+// wait() runs pending tasks until the awaited future is ready, so tasks can
+// submit and wait for nested tasks without blocking the workers.
+class ThreadPool {
+public:
+
+    explicit ThreadPool(unsigned int n_workers);
+    virtual ~ThreadPool();
+
+    // Shared pool, created on first use with Config::numWorkerThreads() workers
+    static ThreadPool& global();
+
+    unsigned int size() const { return workers.size(); }
+
+    template<typename F, typename... Args>
+    std::future<typename std::result_of<typename std::decay<F>::type(typename std::decay<Args>::type...)>::type>
+    submit(F &&f, Args &&... args) {
+        typedef typename std::result_of<typename std::decay<F>::type(typename std::decay<Args>::type...)>::type R;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        std::future<R> fut = task->get_future();
+        push([task]() { (*task)(); });
+        return fut;
+    }
+
+    // Runs other tasks while waiting, then returns the result of the future
+    template<typename R>
+    R wait(std::future<R> &fut) {
+        while (fut.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if (!tryRun())
+                fut.wait_for(std::chrono::microseconds(50));
+        }
+        return fut.get();
+    }
+
+    // Same for a future shared by several waiters, which stays valid
+    template<typename R>
+    R wait(const std::shared_future<R> &fut) {
+        while (fut.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if (!tryRun())
+                fut.wait_for(std::chrono::microseconds(50));
+        }
+        return fut.get();
+    }
+
+private:
+
+    typedef std::function<void()> Task;
+
+    struct WorkQueue {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    void push(Task task);
+    bool tryRun();
+    void workerLoop(int idx);
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+
+    std::mutex sleep_mtx;
+    std::condition_variable wake;
+    std::atomic<unsigned int> pending, next_queue;
+    bool stopping;
+};
+
+} // namespace StVO
@@ -0,0 +1,55 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <string>
+#include <vector>
+
+namespace StVO {
+
+// Roles of the threads of the system. The tracking path (tracking, feature
+// extraction) and the mapping threads get the CPUs and priority of their role
+// from Config, the others are only named.
+enum ThreadRole {
+    THREAD_TRACKING,        // VO front-end (plslam_dataset / StreamingSLAM)
+    THREAD_EXTRACTION,      // FramePipeline feature extraction
+    THREAD_LOADER,          // image loading and prefetching
+    THREAD_WORKER,          // shared task pool
+    THREAD_KF_HANDLER,      // KF insertion in the map
+    THREAD_LOCAL_MAPPING,   // local BA
+    THREAD_LOOP_CLOSURE,
+    THREAD_VIEWER,
+    THREAD_LOGGER,          // asynchronous console output
+    THREAD_LINK             // network link between a remote front-end and back-end
+};
+
+// Names the calling thread after its role (idx >= 0 is appended, e.g. for the
+// workers) and applies the CPU affinity and priority of the role. Settings that
+// fail (e.g. real-time priority without privileges) are reported and ignored.
+void setupThread( ThreadRole role, int idx = -1 );
+
+// CPUs of a list like "0,2-3" (throws runtime_error if malformed)
+std::vector<int> parseCpuList( const std::string &cpus );
+
+} // namespace StVO
@@ -0,0 +1,55 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#pragma once
+
+//STL
+#include <vector>
+
+//OpenCV
+#include <opencv2/core.hpp>
+
+#include <line_descriptor_custom.hpp>
+#include <line_descriptor/descriptor_custom.hpp>
+
+namespace StVO {
+
+// Detects the LSD line segments of a grayscale image on n_strips horizontal
+// strips in parallel (see ThreadPool). The strips overlap by a few rows: the
+// segments cut by a seam are merged, and the ones repeated in the overlap are
+// kept by the strip containing their midpoint. The KeyLines are filled as
+// LSDDetectorC::detect does with a single octave.
+void detectLinesTiled(const cv::Mat &img, const cv::line_descriptor::LSDDetectorC::LSDOptions &opts, int n_strips,
+                      std::vector<cv::line_descriptor::KeyLine> &keylines);
+
+// Joins the collinear fragments of the same segment: same direction within ang_th
+// degrees, both endpoints of the shorter one within max_dist pixels of the line of
+// the longer one and at most max_gap pixels between them along it. The longest
+// segments absorb the shorter ones, the class_id are reassigned.
+void mergeCollinearLines(const cv::Mat &img, double ang_th, double max_dist, double max_gap,
+                         std::vector<cv::line_descriptor::KeyLine> &keylines);
+
+// Keeps the n segments of highest response spread over a cols x rows grid of the
+// image (by their midpoint, see FeatureBudget::selectBucketed).
+void selectLinesBucketed(std::vector<cv::line_descriptor::KeyLine> &keylines, int n, cv::Size size, int cols, int rows);
+
+} // namespace StVO
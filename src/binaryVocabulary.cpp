@@ -0,0 +1,256 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "binaryVocabulary.h"
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memoryUsage.h>
+
+namespace PLSLAM{
+
+static uint64_t align8(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+
+struct BinaryVocabulary::MappedFile
+{
+    MappedFile( const std::string &filename ) : data(NULL), size(0)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if( fd < 0 )
+            throw std::runtime_error("[BinaryVocabulary] cannot open " + filename);
+        struct stat st;
+        if( fstat(fd, &st) == 0 && st.st_size > 0 )
+        {
+            size = st.st_size;
+            void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = (p == MAP_FAILED) ? NULL : static_cast<const char*>(p);
+        }
+        close(fd);
+        if( data == NULL )
+            throw std::runtime_error("[BinaryVocabulary] cannot map " + filename);
+    }
+
+    ~MappedFile() { munmap(const_cast<char*>(data), size); }
+
+    const char *data;
+    size_t      size;
+};
+
+bool BinaryVocabulary::isBinary( const std::string &filename )
+{
+    char magic[sizeof(VOC_FILE_MAGIC)];
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, VOC_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+std::shared_ptr<const BinaryVocabulary> BinaryVocabulary::shared( const std::string &filename )
+{
+    static std::mutex mtx;
+    static std::map<std::string, std::weak_ptr<const BinaryVocabulary>> cache;
+
+    // loaded under the lock, so concurrent sessions do not load it twice
+    std::lock_guard<std::mutex> lk(mtx);
+    std::shared_ptr<const BinaryVocabulary> voc = cache[filename].lock();
+    if( !voc )
+    {
+        std::shared_ptr<BinaryVocabulary> loaded = std::make_shared<BinaryVocabulary>();
+        loaded->loadFromFile( filename );
+        voc = loaded;
+        cache[filename] = voc;
+    }
+    return voc;
+}
+
+void BinaryVocabulary::loadFromFile( const std::string &filename )
+{
+    if( isBinary(filename) )
+        loadBinary(filename);
+    else
+    {
+        load(filename);
+        mapping.reset();
+    }
+}
+
+void BinaryVocabulary::loadBinary( const std::string &filename )
+{
+    std::shared_ptr<const MappedFile> file = std::make_shared<const MappedFile>(filename);
+    if( file->size < sizeof(VocFileHeader) )
+        throw std::runtime_error("[BinaryVocabulary] " + filename + " is not a vocabulary file");
+
+    const VocFileHeader *h = reinterpret_cast<const VocFileHeader*>(file->data);
+    if( std::memcmp(h->magic, VOC_FILE_MAGIC, sizeof(h->magic)) != 0 )
+        throw std::runtime_error("[BinaryVocabulary] " + filename + ": bad magic");
+    if( h->endian != VOC_FILE_ENDIAN )
+        throw std::runtime_error("[BinaryVocabulary] " + filename + ": unsupported endianness");
+    if( h->version != VOC_FILE_VERSION )
+        throw std::runtime_error("[BinaryVocabulary] " + filename + ": unsupported version " + std::to_string(h->version));
+
+    const uint64_t off_nodes = sizeof(VocFileHeader);
+    const uint64_t off_words = off_nodes + h->num_nodes * sizeof(VocNodeRecord);
+    const uint64_t off_desc  = off_words + align8(h->num_words * sizeof(uint32_t));
+    if( h->num_nodes == 0 || h->num_nodes > file->size || h->num_words > h->num_nodes ||
+        h->desc_bytes != DBoW2::FORB::L || off_desc + h->num_nodes * h->desc_bytes != file->size )
+        throw std::runtime_error("[BinaryVocabulary] " + filename + ": truncated or corrupted file");
+
+    const VocNodeRecord *nodes = reinterpret_cast<const VocNodeRecord*>(file->data + off_nodes);
+    const uint32_t      *words = reinterpret_cast<const uint32_t*>(file->data + off_words);
+    const char          *desc  = file->data + off_desc;
+
+    m_k         = h->k;
+    m_L         = h->L;
+    m_scoring   = static_cast<DBoW2::ScoringType>(h->scoring);
+    m_weighting = static_cast<DBoW2::WeightingType>(h->weighting);
+    createScoringObject();
+
+    // children are stored in increasing id order, as created by the k-means tree
+    m_words.clear();
+    m_nodes.clear();
+    m_nodes.resize(h->num_nodes);
+    for( uint64_t i = 0; i < h->num_nodes; i++ )
+    {
+        Node &n = m_nodes[i];
+        n.id         = i;
+        n.parent     = nodes[i].parent;
+        n.weight     = nodes[i].weight;
+        n.word_id    = (nodes[i].word_id == VOC_NO_WORD) ? 0 : nodes[i].word_id;
+        n.descriptor = cv::Mat(1, h->desc_bytes, CV_8U, const_cast<char*>(desc + i * h->desc_bytes));
+        if( i > 0 )
+        {
+            if( n.parent >= i )
+                throw std::runtime_error("[BinaryVocabulary] " + filename + ": invalid node parent");
+            m_nodes[n.parent].children.push_back(i);
+        }
+    }
+
+    m_words.resize(h->num_words);
+    for( uint64_t w = 0; w < h->num_words; w++ )
+    {
+        if( words[w] >= h->num_nodes )
+            throw std::runtime_error("[BinaryVocabulary] " + filename + ": invalid word node");
+        m_words[w] = &m_nodes[words[w]];
+    }
+
+    mapping = file;
+}
+
+void BinaryVocabulary::saveBinary( const std::string &filename ) const
+{
+    VocFileHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, VOC_FILE_MAGIC, sizeof(h.magic));
+    h.version    = VOC_FILE_VERSION;
+    h.endian     = VOC_FILE_ENDIAN;
+    h.k          = m_k;
+    h.L          = m_L;
+    h.scoring    = m_scoring;
+    h.weighting  = m_weighting;
+    h.num_nodes  = m_nodes.size();
+    h.num_words  = m_words.size();
+    h.desc_bytes = DBoW2::FORB::L;
+
+    std::vector<VocNodeRecord> nodes(m_nodes.size());
+    std::vector<char> desc(m_nodes.size() * h.desc_bytes, 0);
+    for( size_t i = 0; i < m_nodes.size(); i++ )
+    {
+        const Node &n = m_nodes[i];
+        if( n.id != i || (i > 0 && n.parent >= i) )
+            throw std::runtime_error("[BinaryVocabulary] the vocabulary tree is not stored in creation order");
+        nodes[i].parent  = n.parent;
+        nodes[i].word_id = n.isLeaf() && i > 0 ? n.word_id : VOC_NO_WORD;
+        nodes[i].weight  = n.weight;
+        if( !n.descriptor.empty() )
+        {
+            if( n.descriptor.total() * n.descriptor.elemSize() != h.desc_bytes || !n.descriptor.isContinuous() )
+                throw std::runtime_error("[BinaryVocabulary] unexpected descriptor size");
+            std::memcpy(&desc[i * h.desc_bytes], n.descriptor.data, h.desc_bytes);
+        }
+    }
+    std::vector<uint32_t> words(align8(m_words.size() * sizeof(uint32_t)) / sizeof(uint32_t), 0);
+    for( size_t w = 0; w < m_words.size(); w++ )
+        words[w] = m_words[w]->id;
+
+    std::ofstream out(filename.c_str(), std::ios::binary | std::ios::trunc);
+    if( !out )
+        throw std::runtime_error("[BinaryVocabulary] cannot open " + filename);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(VocNodeRecord));
+    out.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint32_t));
+    out.write(desc.data(), desc.size());
+    if( !out )
+        throw std::runtime_error("[BinaryVocabulary] error writing " + filename);
+}
+
+void BinaryVocabulary::transformRows( const cv::Mat &desc, DBoW2::BowVector &v, DBoW2::FeatureVector &fv, int levelsup ) const
+{
+    v.clear();
+    fv.clear();
+    if( empty() )
+        return;
+
+    DBoW2::LNorm norm;
+    const bool must = m_scoring_object->mustNormalize(norm);
+    const bool tf   = ( m_weighting == DBoW2::TF || m_weighting == DBoW2::TF_IDF );
+    for( int i = 0; i < desc.rows; i++ )
+    {
+        DBoW2::WordId    id;
+        DBoW2::NodeId    nid;
+        DBoW2::WordValue w;
+        transform( desc.row(i), id, w, &nid, levelsup );
+        if( w <= 0 )
+            continue;   // stopped word
+        if( tf )
+            v.addWeight(id, w);
+        else
+            v.addIfNotExist(id, w);
+        fv.addFeature(nid, i);
+    }
+
+    // TF weights are divided by the number of words unless the scoring normalizes them
+    if( tf && !v.empty() && !must )
+    {
+        const double nd = v.size();
+        for( auto &vw : v )
+            vw.second /= nd;
+    }
+    if( must )
+        v.normalize(norm);
+}
+
+size_t BinaryVocabulary::memoryUsage() const
+{
+    size_t bytes = StVO::vectorBytes(m_nodes) + StVO::vectorBytes(m_words);
+    for( const Node &n : m_nodes )
+        bytes += StVO::vectorBytes(n.children) + StVO::matBytes(n.descriptor);
+    return bytes;
+}
+
+}
@@ -0,0 +1,124 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include <frontEndRecord.h>
+
+#include <stdexcept>
+
+#include <keyFrame.h>
+#include <pinholeStereoCamera.h>
+#include <stereoFrame.h>
+
+namespace PLSLAM {
+
+// Recorder
+
+FrontEndRecorder::FrontEndRecorder(const PinholeStereoCamera *cam) : n_frames(0), n_kfs(0)
+{
+    MapMetaRecord meta = MapMetaRecord();
+    meta.fx = cam->getFx();
+    meta.fy = cam->getFy();
+    meta.cx = cam->getCx();
+    meta.cy = cam->getCy();
+    meta.b  = cam->getB();
+    meta.width  = cam->getWidth();
+    meta.height = cam->getHeight();
+    out.add(MAP_SEC_META, meta);
+}
+
+void FrontEndRecorder::addFrame(const StVO::StereoFrame *frame, bool is_kf)
+{
+    MapRecFrameRecord rec = MapRecFrameRecord();
+    Map<Matrix4d>(rec.Tfw)     = frame->Tfw;
+    Map<Matrix6d>(rec.Tfw_cov) = frame->Tfw_cov;
+    rec.t          = frame->t;
+    rec.err_norm   = frame->err_norm;
+    rec.inv_width  = frame->inv_width;
+    rec.inv_height = frame->inv_height;
+    rec.frame_idx  = frame->frame_idx;
+    rec.is_kf      = is_kf;
+    if (is_kf) {
+        rec.pdesc_l = out.addMat(frame->pdesc_l);
+        rec.ldesc_l = out.addMat(frame->ldesc_l);
+        writeStereoFeatures(out, frame, rec.points, rec.lines);
+        ++n_kfs;
+    }
+    out.add(MAP_SEC_REC_FRAMES, rec);
+    ++n_frames;
+}
+
+void FrontEndRecorder::write(const std::string &file) const
+{
+    out.write(file);
+}
+
+// Replay
+
+FrontEndReplay::FrontEndReplay(const std::string &file) : in(file)
+{
+    uint64_t n;
+    meta   = in.records<MapMetaRecord>(MAP_SEC_META, n);
+    frames = in.records<MapRecFrameRecord>(MAP_SEC_REC_FRAMES, n_frames);
+    if (meta == NULL || n != 1 || frames == NULL)
+        throw std::runtime_error("[FrontEndReplay] " + file + " is not a front-end record");
+}
+
+PinholeStereoCamera* FrontEndReplay::camera() const
+{
+    return new PinholeStereoCamera(meta->width, meta->height, meta->fx, meta->fy, meta->cx, meta->cy, meta->b);
+}
+
+KeyFrame* FrontEndReplay::keyFrame(int i, PinholeStereoCamera *cam, int kf_idx) const
+{
+    const MapRecFrameRecord &rec = frames[i];
+    if (!rec.is_kf)
+        throw std::runtime_error("[FrontEndReplay] frame " + std::to_string(i) + " is not a KF");
+
+    KeyFrame* kf = new KeyFrame();
+    kf->kf_idx      = kf_idx;
+    kf->f_idx       = rec.frame_idx;
+    kf->local       = false;
+    kf->local_epoch = -1;
+    kf->compact     = true;
+    kf->thumbnail_scale = 0.0;
+    kf->T_kf_w      = Map<const Matrix4d>(rec.Tfw);
+    kf->x_kf_w      = logmap_se3(kf->T_kf_w);
+    kf->xcov_kf_w   = Map<const Matrix6d>(rec.Tfw_cov);
+    kf->has_prior   = false;
+
+    StVO::StereoFrame* sf = new StVO::StereoFrame();
+    kf->stereo_frame = sf;
+    sf->cam        = cam;
+    sf->frame_idx  = rec.frame_idx;
+    sf->t          = rec.t;
+    sf->Tfw        = kf->T_kf_w;
+    sf->Tfw_cov    = kf->xcov_kf_w;
+    sf->err_norm   = rec.err_norm;
+    sf->inv_width  = rec.inv_width;
+    sf->inv_height = rec.inv_height;
+    sf->pdesc_l    = in.mat(rec.pdesc_l);
+    sf->ldesc_l    = in.mat(rec.ldesc_l);
+    readStereoFeatures(in, rec.points, rec.lines, sf);
+    return kf;
+}
+
+} // namespace PLSLAM
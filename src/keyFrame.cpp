@@ -26,67 +26,94 @@
 
 #include <opencv2/imgproc.hpp>
 
+#include <threadPool.h>
+
 namespace PLSLAM{
 
 KeyFrame::KeyFrame( const StereoFrame* sf )
 {
     kf_idx    = -1;
+    rig       = 0;
+    rig_kf    = -1;
+    local     = false;
+    local_epoch = -1;
+    compact   = false;
+    thumbnail_scale = 1.0;
+    reduced   = false;
     x_kf_w    = logmap_se3( T_kf_w );
 
     T_kf_w    = sf->Tfw ;
     xcov_kf_w = sf->Tfw_cov;
+    has_prior = false;
+    t_queued  = -1.0;
+    bow_pending = false;
 
     stereo_frame = new StereoFrame( sf->img_l, sf->img_r, kf_idx, sf->cam, sf->t );
+    // the KFs outlive the buffers of a live stream, they keep a copy of the images
+    if( sf->img_owner )
+    {
+        stereo_frame->img_l = sf->img_l.clone();
+        stereo_frame->img_r = sf->img_r.clone();
+    }
     stereo_frame->pdesc_l   = sf->pdesc_l;
     stereo_frame->pdesc_r   = sf->pdesc_r;
     stereo_frame->ldesc_l   = sf->ldesc_l;
     stereo_frame->ldesc_r   = sf->ldesc_r;
 
-    std::vector<PointFeature*> &stereo_pt = stereo_frame->stereo_pt;
-    stereo_pt.resize(sf->stereo_pt.size());
-    for (int idx = 0; idx < stereo_pt.size(); ++idx)
-        stereo_pt[idx] = sf->stereo_pt[idx]->safeCopy();
-
-    std::vector<LineFeature*> &stereo_ls = stereo_frame->stereo_ls;
-    stereo_ls.resize(sf->stereo_ls.size());
-    for (int idx = 0; idx < stereo_ls.size(); ++idx)
-        stereo_ls[idx] = sf->stereo_ls[idx]->safeCopy();
+    stereo_frame->copyFeatures( sf );
 }
 
 KeyFrame::KeyFrame( const StereoFrame* sf, int kf_idx_ )
 {
     kf_idx    = kf_idx_;
+    rig       = 0;
+    rig_kf    = -1;
+    local     = false;
+    local_epoch = -1;
+    compact   = false;
+    thumbnail_scale = 1.0;
+    reduced   = false;
     T_kf_w    = sf->Tfw;
     x_kf_w    = logmap_se3( T_kf_w );
     xcov_kf_w = sf->Tfw_cov;
+    has_prior = false;
+    t_queued  = -1.0;
+    bow_pending = false;
 
     stereo_frame = new StereoFrame( sf->img_l, sf->img_r, kf_idx, sf->cam, sf->t );
+    // the KFs outlive the buffers of a live stream, they keep a copy of the images
+    if( sf->img_owner )
+    {
+        stereo_frame->img_l = sf->img_l.clone();
+        stereo_frame->img_r = sf->img_r.clone();
+    }
     stereo_frame->pdesc_l   = sf->pdesc_l;
     stereo_frame->pdesc_r   = sf->pdesc_r;
     stereo_frame->ldesc_l   = sf->ldesc_l;
     stereo_frame->ldesc_r   = sf->ldesc_r;
 
-    std::vector<PointFeature*> &stereo_pt = stereo_frame->stereo_pt;
-    stereo_pt.resize(sf->stereo_pt.size());
-    for (int idx = 0; idx < stereo_pt.size(); ++idx)
-        stereo_pt[idx] = sf->stereo_pt[idx]->safeCopy();
-
-    std::vector<LineFeature*> &stereo_ls = stereo_frame->stereo_ls;
-    stereo_ls.resize(sf->stereo_ls.size());
-    for (int idx = 0; idx < stereo_ls.size(); ++idx)
-        stereo_ls[idx] = sf->stereo_ls[idx]->safeCopy();
+    stereo_frame->copyFeatures( sf );
 }
 
 KeyFrame::~KeyFrame() {
 
+    // the BoW encoding reads the descriptors of the frame
+    if( bow_task.valid() )
+        StVO::ThreadPool::global().wait( bow_task );
     delete stereo_frame;
 }
 
 Mat KeyFrame::plotKeyFrame()
 {
-    // create new image to modify it
+    // create new image to modify it (compact KFs are drawn on their thumbnail)
     Mat img_l_aux;
-    stereo_frame->img_l.copyTo( img_l_aux );
+    double s = compact ? thumbnail_scale : 1.0;
+    if( compact )
+        thumbnail.copyTo( img_l_aux );
+    else
+        stereo_frame->img_l.copyTo( img_l_aux );
+    if( img_l_aux.empty() )
+        return img_l_aux;
     if( img_l_aux.channels() == 1 )
         cvtColor(img_l_aux, img_l_aux, CV_GRAY2BGR, 3);
     else if (img_l_aux.channels() == 4)
@@ -107,7 +134,7 @@ Mat KeyFrame::plotKeyFrame()
         if( (*pt_it)->idx != -1 )
         {
             g = 200;
-            p = cv::Point( int((*pt_it)->pl(0)), int((*pt_it)->pl(1)) );
+            p = cv::Point( int(s*(*pt_it)->pl(0)), int(s*(*pt_it)->pl(1)) );
             circle( img_l_aux, p, radius, Scalar(b,g,r), thick);
         }
     }
@@ -117,8 +144,8 @@ Mat KeyFrame::plotKeyFrame()
         if( (*ls_it)->idx != -1 )
         {
             g = 200;
-            p = cv::Point( int((*ls_it)->spl(0)), int((*ls_it)->spl(1)) );
-            q = cv::Point( int((*ls_it)->epl(0)), int((*ls_it)->epl(1)) );
+            p = cv::Point( int(s*(*ls_it)->spl(0)), int(s*(*ls_it)->spl(1)) );
+            q = cv::Point( int(s*(*ls_it)->epl(0)), int(s*(*ls_it)->epl(1)) );
             line( img_l_aux, p, q, Scalar(b,g,r), thick);
         }
     }
@@ -126,4 +153,44 @@ Mat KeyFrame::plotKeyFrame()
     return img_l_aux;
 }
 
+void KeyFrame::makeCompact( double thumbnail_scale_ )
+{
+    if( compact )
+        return;
+
+    if( thumbnail_scale_ > 0.0 && !stereo_frame->img_l.empty() )
+        cv::resize( stereo_frame->img_l, thumbnail, Size(), thumbnail_scale_, thumbnail_scale_, INTER_AREA );
+    thumbnail_scale = thumbnail_scale_;
+
+    // mapping, loop closure and GBA only use the left features, descriptors and BoW vectors
+    stereo_frame->img_l.release();
+    stereo_frame->img_r.release();
+    stereo_frame->gray_l.release();
+    stereo_frame->pdesc_r.release();
+    stereo_frame->ldesc_r.release();
+    vector<KeyPoint>().swap( stereo_frame->points_l );
+    vector<KeyPoint>().swap( stereo_frame->points_r );
+    vector<KeyLine>().swap( stereo_frame->lines_l );
+    vector<KeyLine>().swap( stereo_frame->lines_r );
+
+    compact = true;
+}
+
+StVO::FrameMemory KeyFrame::memoryUsage() const
+{
+    StVO::FrameMemory mem = stereo_frame->memoryUsage();
+    mem.images   += StVO::matBytes( thumbnail );
+    // the BoW vectors are written by the task pool until the encoding ends
+    if( bow_pending )
+        return mem;
+    mem.features += StVO::mapBytes( descDBoW_P ) + StVO::mapBytes( descDBoW_L );
+    for( const DBoW2::FeatureVector *fv : { &featDBoW_P, &featDBoW_L } )
+    {
+        mem.features += StVO::mapBytes( *fv );
+        for( const auto &node : *fv )
+            mem.features += StVO::vectorBytes( node.second );
+    }
+    return mem;
+}
+
 }
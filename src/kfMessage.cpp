@@ -0,0 +1,309 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include <kfMessage.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <keyFrame.h>
+#include <pinholeStereoCamera.h>
+
+namespace PLSLAM {
+
+namespace {
+
+template<typename T>
+void put(std::vector<uint8_t> &msg, T v) {
+    littleEndian(v);
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(&v);
+    msg.insert(msg.end(), p, p + sizeof(T));
+}
+
+// bounds-checked reads from a message
+struct MessageReader {
+    const uint8_t *p, *end;
+    template<typename T>
+    void get(T &v) { bytes(&v, sizeof(T)); littleEndian(v); }
+    void bytes(void *dst, size_t n) {
+        if (n > size_t(end - p))
+            throw std::runtime_error("[decodeKeyFrame] truncated message");
+        std::memcpy(dst, p, n);
+        p += n;
+    }
+};
+
+uint16_t quantize(double x, double step) {
+    return uint16_t(std::min(std::max(std::round(x / step), 0.0), 65535.0));
+}
+
+void putDescriptors(std::vector<uint8_t> &msg, const Mat &desc, size_t rows) {
+    if (desc.rows != int(rows) || (rows > 0 && desc.type() != CV_8UC1))
+        throw std::runtime_error("[encodeKeyFrame] the descriptors do not match the features");
+    for (int i = 0; i < desc.rows; i++)
+        msg.insert(msg.end(), desc.ptr<uint8_t>(i), desc.ptr<uint8_t>(i) + desc.cols);
+}
+
+void putBow(std::vector<uint8_t> &msg, const DBoW2::BowVector &bow) {
+    put(msg, uint32_t(bow.size()));
+    for (const auto &w : bow) {
+        KFMessageWord word = { uint32_t(w.first), float(w.second) };
+        put(msg, word);
+    }
+}
+
+void getBow(MessageReader &in, DBoW2::BowVector &bow) {
+    uint32_t n;
+    in.get(n);
+    for (uint32_t i = 0; i < n; i++) {
+        KFMessageWord word;
+        in.get(word);
+        bow.insert(bow.end(), std::make_pair(DBoW2::WordId(word.word), DBoW2::WordValue(word.value)));
+    }
+}
+
+}
+
+void littleEndian(void *data, size_t size, size_t width)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint8_t *p = static_cast<uint8_t*>(data);
+    for (size_t i = 0; i + width <= size; i += width)
+        std::reverse(p + i, p + i + width);
+#else
+    (void)data; (void)size; (void)width;
+#endif
+}
+
+#define KF_MSG_FIELD(f) littleEndian(&(f), sizeof(f), sizeof(f))
+#define KF_MSG_ARRAY(f) littleEndian((f), sizeof(f), sizeof((f)[0]))
+
+void littleEndian(KFMessageHeader &h)
+{
+    KF_MSG_FIELD(h.magic);
+    KF_MSG_FIELD(h.version);
+    KF_MSG_FIELD(h.flags);
+    KF_MSG_FIELD(h.kf_seq);
+    KF_MSG_FIELD(h.t);
+    KF_MSG_ARRAY(h.x_kf_prev);
+    KF_MSG_ARRAY(h.cov_kf_prev);
+    KF_MSG_FIELD(h.inv_width);
+    KF_MSG_FIELD(h.inv_height);
+    KF_MSG_FIELD(h.step);
+    KF_MSG_FIELD(h.n_points);
+    KF_MSG_FIELD(h.n_lines);
+    KF_MSG_FIELD(h.pdesc_cols);
+    KF_MSG_FIELD(h.ldesc_cols);
+}
+
+void littleEndian(KFMessagePoint &p)
+{
+    KF_MSG_FIELD(p.u);
+    KF_MSG_FIELD(p.v);
+    KF_MSG_FIELD(p.disp);
+}
+
+void littleEndian(KFMessageLine &l)
+{
+    KF_MSG_FIELD(l.su);
+    KF_MSG_FIELD(l.sv);
+    KF_MSG_FIELD(l.sdisp);
+    KF_MSG_FIELD(l.eu);
+    KF_MSG_FIELD(l.ev);
+    KF_MSG_FIELD(l.edisp);
+}
+
+void littleEndian(KFMessageWord &w)
+{
+    KF_MSG_FIELD(w.word);
+    KF_MSG_FIELD(w.value);
+}
+
+void littleEndian(KFCorrection &c)
+{
+    KF_MSG_FIELD(c.kf_seq);
+    KF_MSG_ARRAY(c.x_kf_w);
+}
+
+#undef KF_MSG_FIELD
+#undef KF_MSG_ARRAY
+
+void encodeKeyFrame(const KeyFrame *kf, int kf_seq, std::vector<uint8_t> &msg)
+{
+    const StereoFrame *sf = kf->stereo_frame;
+    const bool has_bow = !kf->descDBoW_P.empty() || !kf->descDBoW_L.empty();
+
+    KFMessageHeader h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic   = KF_MESSAGE_MAGIC;
+    h.version = KF_MESSAGE_VERSION;
+    h.flags   = has_bow ? KF_MSG_HAS_BOW : 0;
+    h.kf_seq  = kf_seq;
+    h.t       = double(sf->t);
+    Vector6d x_kf_prev = logmap_se3(kf->T_kf_w);
+    std::memcpy(h.x_kf_prev, x_kf_prev.data(), sizeof(h.x_kf_prev));
+    for (int i = 0, k = 0; i < 6; i++)
+        for (int j = i; j < 6; j++)
+            h.cov_kf_prev[k++] = float(kf->xcov_kf_w(i,j));
+    h.inv_width  = float(sf->inv_width);
+    h.inv_height = float(sf->inv_height);
+    // 1/16 px, coarser for the images that do not fit in 16 bits then
+    h.step       = std::max(1.f / 16.f, float(std::max(sf->cam->getWidth(), sf->cam->getHeight())) / 65535.f);
+    h.n_points   = sf->stereo_pt.size();
+    h.n_lines    = sf->stereo_ls.size();
+    h.pdesc_cols = h.n_points > 0 ? sf->pdesc_l.cols : 0;
+    h.ldesc_cols = h.n_lines  > 0 ? sf->ldesc_l.cols : 0;
+    put(msg, h);
+
+    for (const PointFeature *pt : sf->stereo_pt) {
+        KFMessagePoint p = { quantize(pt->pl(0), h.step), quantize(pt->pl(1), h.step), quantize(pt->disp, h.step),
+                             uint8_t(pt->level), uint8_t(pt->inlier) };
+        put(msg, p);
+    }
+    for (const LineFeature *ls : sf->stereo_ls) {
+        KFMessageLine l = { quantize(ls->spl(0), h.step), quantize(ls->spl(1), h.step), quantize(ls->sdisp, h.step),
+                            quantize(ls->epl(0), h.step), quantize(ls->epl(1), h.step), quantize(ls->edisp, h.step),
+                            uint8_t(ls->level), uint8_t(ls->inlier) };
+        put(msg, l);
+    }
+    putDescriptors(msg, sf->pdesc_l, h.n_points);
+    putDescriptors(msg, sf->ldesc_l, h.n_lines);
+    if (has_bow) {
+        putBow(msg, kf->descDBoW_P);
+        putBow(msg, kf->descDBoW_L);
+    }
+}
+
+KeyFrame* decodeKeyFrame(const uint8_t *msg, size_t size, PinholeStereoCamera *cam)
+{
+    MessageReader in = { msg, msg + size };
+    KFMessageHeader h;
+    in.get(h);
+    if (h.magic != KF_MESSAGE_MAGIC)
+        throw std::runtime_error("[decodeKeyFrame] not a KF message");
+    if (h.version != KF_MESSAGE_VERSION)
+        throw std::runtime_error("[decodeKeyFrame] unsupported KF message version " + std::to_string(h.version));
+    // the features and descriptors must fit in the message before anything is allocated for them
+    const uint64_t n_bytes = uint64_t(h.n_points) * (sizeof(KFMessagePoint) + h.pdesc_cols) +
+                             uint64_t(h.n_lines)  * (sizeof(KFMessageLine)  + h.ldesc_cols);
+    if (n_bytes > uint64_t(in.end - in.p))
+        throw std::runtime_error("[decodeKeyFrame] truncated message");
+
+    KeyFrame* kf = new KeyFrame();
+    kf->kf_idx      = h.kf_seq;
+    kf->f_idx       = h.kf_seq;
+    kf->local       = false;
+    kf->local_epoch = -1;
+    kf->compact     = true;
+    kf->thumbnail_scale = 0.0;
+    std::memcpy(kf->x_kf_w.data(), h.x_kf_prev, sizeof(h.x_kf_prev));
+    kf->T_kf_w      = expmap_se3(kf->x_kf_w);
+    for (int i = 0, k = 0; i < 6; i++)
+        for (int j = i; j < 6; j++, k++)
+            kf->xcov_kf_w(i,j) = kf->xcov_kf_w(j,i) = h.cov_kf_prev[k];
+    kf->has_prior   = false;
+
+    StereoFrame* sf = new StereoFrame();
+    kf->stereo_frame = sf;
+    sf->cam        = cam;
+    sf->frame_idx  = h.kf_seq;
+    sf->t          = h.t;
+    sf->Tfw        = kf->T_kf_w;
+    sf->Tfw_cov    = kf->xcov_kf_w;
+    sf->inv_width  = h.inv_width;
+    sf->inv_height = h.inv_height;
+
+    try {
+        const double step = h.step;
+        sf->stereo_pt.reserve(h.n_points);
+        for (uint32_t i = 0; i < h.n_points; i++) {
+            KFMessagePoint p;
+            in.get(p);
+            Vector2d pl(p.u * step, p.v * step);
+            double disp = p.disp * step;
+            PointFeature* pt = sf->arena->points.create(pl, disp, cam->backProjection(pl(0), pl(1), disp), -1, int(p.level));
+            pt->inlier = p.inlier != 0;
+            pt->covariance(cam);    // the KF features are only read once it is in the map
+            sf->stereo_pt.push_back(pt);
+        }
+        sf->stereo_ls.reserve(h.n_lines);
+        for (uint32_t i = 0; i < h.n_lines; i++) {
+            KFMessageLine l;
+            in.get(l);
+            Vector3d sp_l(l.su * step, l.sv * step, 1.0), ep_l(l.eu * step, l.ev * step, 1.0);
+            double sdisp = l.sdisp * step, edisp = l.edisp * step;
+            Vector3d le_l = sp_l.cross(ep_l);
+            le_l = le_l / std::sqrt(le_l(0)*le_l(0) + le_l(1)*le_l(1));
+            Vector3d sp_r(sp_l(0) - sdisp, sp_l(1), 1.0), ep_r(ep_l(0) - edisp, ep_l(1), 1.0);
+            LineFeature* ls = sf->arena->lines.create(sp_l.head(2), sdisp, cam->backProjection(sp_l(0), sp_l(1), sdisp),
+                                                      ep_l.head(2), edisp, cam->backProjection(ep_l(0), ep_l(1), edisp),
+                                                      le_l, std::atan2(ep_l(1) - sp_l(1), ep_l(0) - sp_l(0)), -1, int(l.level),
+                                                      sf->stereoPluker(sp_l, ep_l, sp_r, ep_r));
+            ls->inlier = l.inlier != 0;
+            ls->startCovariance(cam);
+            sf->stereo_ls.push_back(ls);
+        }
+        if (h.n_points > 0) {
+            sf->pdesc_l.create(h.n_points, h.pdesc_cols, CV_8UC1);
+            in.bytes(sf->pdesc_l.data, sf->pdesc_l.total());
+        }
+        if (h.n_lines > 0) {
+            sf->ldesc_l.create(h.n_lines, h.ldesc_cols, CV_8UC1);
+            in.bytes(sf->ldesc_l.data, sf->ldesc_l.total());
+        }
+        if (h.flags & KF_MSG_HAS_BOW) {
+            getBow(in, kf->descDBoW_P);
+            getBow(in, kf->descDBoW_L);
+        }
+        if (in.p != in.end)
+            throw std::runtime_error("[decodeKeyFrame] unexpected bytes after the KF");
+    }
+    catch (...) {
+        delete kf;
+        throw;
+    }
+    sf->updateFeatureArrays();
+    return kf;
+}
+
+void encodeCorrections(const std::vector<KFCorrection> &corrections, std::vector<uint8_t> &msg)
+{
+    put(msg, uint32_t(corrections.size()));
+    for (const KFCorrection &c : corrections)
+        put(msg, c);
+}
+
+void decodeCorrections(const uint8_t *msg, size_t size, std::vector<KFCorrection> &corrections)
+{
+    MessageReader in = { msg, msg + size };
+    uint32_t n;
+    in.get(n);
+    if (n > (size - sizeof(n)) / sizeof(KFCorrection))
+        throw std::runtime_error("[decodeCorrections] truncated message");
+    corrections.resize(n);
+    for (uint32_t i = 0; i < n; i++)
+        in.get(corrections[i]);
+}
+
+} // namespace PLSLAM
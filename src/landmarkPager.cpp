@@ -0,0 +1,276 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "landmarkPager.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <slamConfig.h>
+
+namespace PLSLAM {
+
+// the page file grows in chunks, so it is not remapped on every page out
+static const size_t PAGE_CHUNK = size_t(64) << 20;
+static const int    MIN_CLASS  = 6;                    // 64 bytes
+
+static int sizeClass(size_t bytes)
+{
+    int c = MIN_CLASS;
+    while( (size_t(1) << c) < bytes )
+        c++;
+    return c;
+}
+
+LandmarkPager::LandmarkPager()
+    : fd(-1), base(NULL), file_size(0), file_end(0), paged_bytes(0), tile_size(10.0), next_pt(0), next_ls(0)
+{
+}
+
+LandmarkPager::~LandmarkPager()
+{
+    if( base != NULL )
+        munmap(base, file_size);
+    if( fd >= 0 )
+        ::close(fd);
+}
+
+void LandmarkPager::open(const std::string &filename)
+{
+    fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if( fd < 0 )
+        throw std::runtime_error("[LandmarkPager] cannot open " + filename);
+    tile_size = std::max( 1e-3, SlamConfig::lmTileSize() );
+    clear();
+}
+
+void LandmarkPager::clear()
+{
+    file_end    = 0;
+    paged_bytes = 0;
+    free_blocks.clear();
+    next_pt = next_ls = 0;
+    pt_rec.clear();
+    ls_rec.clear();
+    tiles.clear();
+}
+
+LandmarkPager::TileKey LandmarkPager::tileOf(const Eigen::Vector3d &P) const
+{
+    TileKey key;
+    key.x = int( std::floor( P(0) / tile_size ) );
+    key.y = int( std::floor( P(1) / tile_size ) );
+    key.z = int( std::floor( P(2) / tile_size ) );
+    return key;
+}
+
+void LandmarkPager::reserve(size_t bytes)
+{
+    if( bytes <= file_size )
+        return;
+    size_t new_size = ( bytes + PAGE_CHUNK - 1 ) / PAGE_CHUNK * PAGE_CHUNK;
+    if( ftruncate(fd, new_size) != 0 )
+        throw std::runtime_error("[LandmarkPager] cannot grow the page file");
+    if( base != NULL )
+        munmap(base, file_size);
+    void *p = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if( p == MAP_FAILED )
+    {
+        base = NULL;
+        file_size = 0;
+        throw std::runtime_error("[LandmarkPager] cannot map the page file");
+    }
+    base = static_cast<char*>(p);
+    file_size = new_size;
+}
+
+size_t LandmarkPager::allocate(int size_class)
+{
+    if( size_class >= int(free_blocks.size()) )
+        free_blocks.resize(size_class + 1);
+    std::vector<size_t> &blocks = free_blocks[size_class];
+    if( !blocks.empty() )
+    {
+        size_t offset = blocks.back();
+        blocks.pop_back();
+        return offset;
+    }
+    size_t offset = file_end;
+    file_end += size_t(1) << size_class;
+    reserve(file_end);
+    return offset;
+}
+
+void LandmarkPager::release(Record &rec)
+{
+    if( !rec.paged() )
+        return;
+    free_blocks[rec.size_class].push_back( rec.offset );
+    paged_bytes -= size_t(1) << rec.size_class;
+    tiles[rec.tile].n_paged--;
+    rec.rows = -1;
+}
+
+template<typename LM>
+void LandmarkPager::registerLM(LM *lm, const TileKey &key, std::vector<Record> &recs, bool line)
+{
+    if( lm->idx >= int(recs.size()) )
+        recs.resize(lm->idx + 1);
+    recs[lm->idx].tile = key;
+    Tile &tile = tiles[key];
+    ( line ? tile.lines : tile.pts ).push_back(lm->idx);
+}
+
+template<typename LM>
+void LandmarkPager::pageOut(LM *lm, std::vector<Record> &recs)
+{
+    Record &rec = recs[lm->idx];
+    const DescriptorList &list = lm->desc_list;
+    if( rec.paged() || list.empty() )
+        return;
+    size_t bytes   = list.size() * sizeof(StVO::Desc256);
+    rec.size_class = sizeClass( bytes );
+    rec.offset     = allocate( rec.size_class );
+    memcpy( base + rec.offset, list.data(), bytes );
+    rec.rows  = list.size();
+    rec.n_obs = list.observations();
+    lm->desc_list.clear();
+    paged_bytes += size_t(1) << rec.size_class;
+    tiles[rec.tile].n_paged++;
+}
+
+template<typename LM>
+void LandmarkPager::pageIn(LM *lm, std::vector<Record> &recs)
+{
+    if( lm == NULL || lm->idx >= int(recs.size()) || !recs[lm->idx].paged() )
+        return;
+    Record &rec = recs[lm->idx];
+    lm->desc_list.assign( reinterpret_cast<const StVO::Desc256*>( base + rec.offset ), rec.rows, rec.n_obs );
+    release( rec );
+}
+
+void LandmarkPager::pageIn(MapPoint *pt)
+{
+    pageIn( pt, pt_rec );
+}
+
+void LandmarkPager::pageIn(MapLine *ls)
+{
+    pageIn( ls, ls_rec );
+}
+
+template<typename LM>
+std::vector<cv::Mat> LandmarkPager::rowList(const LM *lm, const std::vector<Record> &recs) const
+{
+    if( lm->idx >= int(recs.size()) || !recs[lm->idx].paged() )
+        return lm->desc_list.rowList();
+    const Record &rec = recs[lm->idx];
+    std::vector<cv::Mat> list;
+    for( int r = 0; r < rec.rows; r++ )
+        list.push_back( cv::Mat( 1, sizeof(StVO::Desc256), CV_8U, base + rec.offset + r * sizeof(StVO::Desc256) ) );
+    return list;
+}
+
+std::vector<cv::Mat> LandmarkPager::rowList(const MapPoint *pt) const
+{
+    return rowList( pt, pt_rec );
+}
+
+std::vector<cv::Mat> LandmarkPager::rowList(const MapLine *ls) const
+{
+    return rowList( ls, ls_rec );
+}
+
+void LandmarkPager::update(const Eigen::Vector3d &center, const std::vector<MapPoint*> &points,
+                           const std::vector<MapLine*> &lines, const std::vector<KeyFrame*> &kfs)
+{
+
+    if( !isOpen() )
+        return;
+
+    // register the landmarks created since the last update (their tiles are fixed from now on)
+    for( ; next_pt < points.size(); next_pt++ )
+    {
+        if( points[next_pt] != NULL )
+            registerLM( points[next_pt], tileOf( points[next_pt]->point3D ), pt_rec, false );
+    }
+    for( ; next_ls < lines.size(); next_ls++ )
+    {
+        MapLine *ls = lines[next_ls];
+        if( ls == NULL )
+            continue;
+        // lines by their first observer, the Plucker lines have no endpoints
+        Eigen::Vector3d P = center;
+        for( int kf_idx : ls->kf_obs_list )
+        {
+            if( kf_idx >= 0 && kf_idx < int(kfs.size()) && kfs[kf_idx] != NULL )
+            {
+                P = kfs[kf_idx]->T_kf_w.block<3,1>(0,3);
+                break;
+            }
+        }
+        registerLM( ls, tileOf( P ), ls_rec, true );
+    }
+
+    const TileKey c = tileOf( center );
+    const int radius = std::max( 0, SlamConfig::lmPageRadius() );
+    for( auto &it : tiles )
+    {
+        const TileKey &key = it.first;
+        Tile &tile = it.second;
+        int d = std::max( std::abs(key.x - c.x), std::max( std::abs(key.y - c.y), std::abs(key.z - c.z) ) );
+        bool near = d <= radius;
+        bool far  = d > radius + 1;
+        // the tiles in between keep their state, so the camera moving along a border does not thrash
+        if( !( near && tile.n_paged > 0 ) && !( far && tile.n_paged < int(tile.pts.size() + tile.lines.size()) ) )
+            continue;
+
+        // drop the deleted landmarks, the ones culled while paged out still hold a block
+        auto dead_pt = [&](int i){ if( points[i] != NULL ) return false; release( pt_rec[i] ); return true; };
+        auto dead_ls = [&](int i){ if( lines[i]  != NULL ) return false; release( ls_rec[i] ); return true; };
+        tile.pts.erase( std::remove_if( tile.pts.begin(), tile.pts.end(), dead_pt ), tile.pts.end() );
+        tile.lines.erase( std::remove_if( tile.lines.begin(), tile.lines.end(), dead_ls ), tile.lines.end() );
+        for( int i : tile.pts )
+        {
+            if( near )
+                pageIn( points[i], pt_rec );
+            else if( !points[i]->local )
+                pageOut( points[i], pt_rec );
+        }
+        for( int i : tile.lines )
+        {
+            if( near )
+                pageIn( lines[i], ls_rec );
+            else if( !lines[i]->local )
+                pageOut( lines[i], ls_rec );
+        }
+    }
+
+}
+
+}
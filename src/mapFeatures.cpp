@@ -21,14 +21,248 @@
 *****************************************************************************/
 
 #include "mapFeatures.h"
+#include <hamming.h>
+#include <memoryUsage.h>
+#include <slamConfig.h>
+#include <plukerOrth.h>
+#include <climits>
+#include <cstring>
 #include <Eigen/Dense>
 #include <Eigen/Core>
 namespace PLSLAM{
 
+// Landmark descriptors
+
+void DescriptorList::push_back(const Mat &desc)
+{
+    push_back( StVO::Desc256( desc ) );
+}
+
+void DescriptorList::push_back(const StVO::Desc256 &desc)
+{
+
+    rows.push_back( desc );
+    n_obs++;
+
+    // the cache is only kept once it has been built (never in majority vote mode)
+    if( cache_valid && hist != max( 1, SlamConfig::descHistory() ) )
+        cache_valid = false;
+    if( cache_valid )
+    {
+        int r     = rows.size() - 1;
+        int s     = (base + r) % hist;
+        int first = max( 0, r - hist + 1 );
+
+        // the row leaving the window used the same slot, remove its distances
+        if( r - hist >= 0 )
+        {
+            for( int q = first; q < r; q++ )
+                row_sum[(base + q) % hist] -= dist[s * hist + (base + q) % hist];
+        }
+
+        // distances from the new row to the rest of the window
+        int n = r - first;
+        vector<int> idx(n), d(n);
+        for( int k = 0; k < n; k++ )
+            idx[k] = first + k;
+        StVO::hammingDistances( rows[r], rows.data(), idx.data(), n, d.data() );
+        dist[s * hist + s] = 0;
+        row_sum[s] = 0;
+        for( int k = 0; k < n; k++ )
+        {
+            int t = (base + idx[k]) % hist;
+            dist[s * hist + t] = d[k];
+            dist[t * hist + s] = d[k];
+            row_sum[t] += d[k];
+            row_sum[s] += d[k];
+        }
+    }
+
+    applyCap();
+
+}
+
+void DescriptorList::append(const DescriptorList &other)
+{
+    // the rows must stay the last observations: if the oldest observations of other have no row,
+    // the rows of this list would be followed by that gap, so they are dropped (they are the oldest)
+    int n = n_obs + other.n_obs;
+    if( other.size() < other.n_obs && !rows.empty() )
+    {
+        rows.clear();
+        cache_valid = false;
+    }
+    for( const StVO::Desc256 &desc : other.rows )
+        push_back( desc );
+    n_obs = n;
+}
+
+void DescriptorList::applyCap()
+{
+    // the dropped rows are out of the cache window, so the slots of the rest are kept
+    int cap = SlamConfig::descMaxObs();
+    if( cap <= 0 )
+        return;
+    cap = max( cap, max( 1, SlamConfig::descHistory() ) );
+    if( int(rows.size()) <= cap )
+        return;
+    int n_drop = rows.size() - cap;
+    rows.erase( rows.begin(), rows.begin() + n_drop );
+    base += n_drop;
+}
+
+void DescriptorList::trim(int max_rows)
+{
+    // like applyCap, the dropped rows are out of the cache window
+    max_rows = max( max_rows, max( 1, SlamConfig::descHistory() ) );
+    if( int(rows.size()) > max_rows )
+    {
+        int n_drop = rows.size() - max_rows;
+        rows.erase( rows.begin(), rows.begin() + n_drop );
+        base += n_drop;
+    }
+    if( rows.capacity() > rows.size() )
+        vector<StVO::Desc256>( rows ).swap( rows );
+}
+
+size_t DescriptorList::bytes() const
+{
+    return rows.capacity() * sizeof(StVO::Desc256) + ( dist.capacity() + row_sum.capacity() ) * sizeof(int);
+}
+
+void DescriptorList::erase(int obs)
+{
+    if( obs < 0 || obs >= n_obs )
+        return;
+    n_obs--;
+    int i = obs - ( n_obs + 1 - int(rows.size()) );
+    if( i < 0 )
+        return;
+    rows.erase( rows.begin() + i );
+    cache_valid = false;
+}
+
+void DescriptorList::clear()
+{
+    vector<StVO::Desc256>().swap( rows );
+    n_obs = 0;
+    base  = 0;
+    cache_valid = false;
+}
+
+void DescriptorList::assign(const vector<Mat> &descs, int n_obs_)
+{
+    clear();
+    rows.reserve( descs.size() );
+    for( const Mat &desc : descs )
+        rows.push_back( StVO::Desc256( desc ) );
+    n_obs = max( n_obs_, int(rows.size()) );
+}
+
+void DescriptorList::assign(const StVO::Desc256 *descs, int n, int n_obs_)
+{
+    clear();
+    rows.assign( descs, descs + n );
+    n_obs = max( n_obs_, n );
+}
+
+vector<Mat> DescriptorList::rowList() const
+{
+    vector<Mat> list;
+    for( const StVO::Desc256 &desc : rows )
+        list.push_back( desc.mat() );
+    return list;
+}
+
+void DescriptorList::rebuildCache()
+{
+
+    hist = max( 1, SlamConfig::descHistory() );
+    dist.assign( hist * hist, 0 );
+    row_sum.assign( hist, 0 );
+
+    int n_rows = rows.size();
+    int first  = max( 0, n_rows - hist );
+    vector<int> idx, d;
+    for( int r = first + 1; r < n_rows; r++ )
+    {
+        int n = r - first;
+        idx.resize(n);
+        d.resize(n);
+        for( int k = 0; k < n; k++ )
+            idx[k] = first + k;
+        StVO::hammingDistances( rows[r], rows.data(), idx.data(), n, d.data() );
+        int s = (base + r) % hist;
+        for( int k = 0; k < n; k++ )
+        {
+            int t = (base + idx[k]) % hist;
+            dist[s * hist + t] = d[k];
+            dist[t * hist + s] = d[k];
+            row_sum[t] += d[k];
+            row_sum[s] += d[k];
+        }
+    }
+    cache_valid = true;
+
+}
+
+StVO::Desc256 DescriptorList::majorityVote() const
+{
+
+    int n_rows = rows.size();
+    int first  = max( 0, n_rows - max( 1, SlamConfig::descHistory() ) );
+    int n      = n_rows - first;
+    StVO::Desc256 desc;
+    uchar* out = reinterpret_cast<uchar*>( desc.w );
+    const uchar* last = rows.back().data();
+    for( int b = 0; b < 32; b++ )
+    {
+        for( int k = 0; k < 8; k++ )
+        {
+            int ones = 0;
+            for( int r = first; r < n_rows; r++ )
+                ones += ( rows[r].data()[b] >> k ) & 1;
+            // ties are resolved with the most recent descriptor
+            if( 2 * ones > n || ( 2 * ones == n && ( ( last[b] >> k ) & 1 ) ) )
+                out[b] |= uchar( 1 << k );
+        }
+    }
+    return desc;
+
+}
+
+StVO::Desc256 DescriptorList::representative()
+{
+
+    if( rows.empty() )
+        return StVO::Desc256();
+    if( SlamConfig::descMajorityVote() )
+        return majorityVote();
+
+    if( !cache_valid || hist != max( 1, SlamConfig::descHistory() ) )
+        rebuildCache();
+
+    // the one with least mean distance to the rest of the window
+    int n_rows   = rows.size();
+    int first    = max( 0, n_rows - hist );
+    int best_idx = first;
+    int best_sum = INT_MAX;
+    for( int r = first; r < n_rows; r++ )
+    {
+        if( row_sum[(base + r) % hist] < best_sum )
+        {
+            best_sum = row_sum[(base + r) % hist];
+            best_idx = r;
+        }
+    }
+    return rows[best_idx];
+
+}
+
 // Point features
 
 MapPoint::MapPoint(int idx_, Vector3d point3D_, Mat desc_, int kf_obs_, Vector2d obs_, Vector3d dir_, double sigma2_ ) :
-    idx(idx_), point3D(point3D_), inlier(true)
+    idx(idx_), point3D(point3D_), inlier(true), local(false), local_epoch(-1), cull_pending(false)
 {
     desc_list.push_back( desc_ );
     obs_list.push_back( obs_ );
@@ -36,7 +270,7 @@ MapPoint::MapPoint(int idx_, Vector3d point3D_, Mat desc_, int kf_obs_, Vector2d
     dir_list.push_back( dir_ );
     sigma_list.push_back(sigma2_);
     med_obs_dir = dir_;
-    med_desc    = desc_;
+    med_desc    = StVO::Desc256( desc_ );
 }
 
 void MapPoint::addMapPointObservation(Mat desc_, int kf_obs_, Vector2d obs_, Vector3d dir_,  double sigma2_ )
@@ -53,50 +287,38 @@ void MapPoint::updateAverageDescDir()
 {
 
     // descriptor
-    // - check distances between all the observed descriptors
-    int n = desc_list.size();
-    MatrixXf conf_desc(n,n);
-    for(int i = 0; i < n; i++ )
-    {
-        conf_desc(i,i) = 0;
-        for(int j = i+1 ; j < n; j++ )
-        {
-            int d = norm(desc_list[i],desc_list[j],NORM_HAMMING);
-            conf_desc(i,j) = d;
-            conf_desc(j,i) = d;
-        }
-    }
-
-    // - select the one with least mean distance to the rest
-    int max_dist = 99999;
-    int max_idx  = 0;
-    for(int i = 0; i < n; i++)
-    {
-        vector<int> dist_idx;
-        for(int j = 0; j < n; j++)
-            dist_idx.push_back( conf_desc(i,j) );
-        sort( dist_idx.begin(), dist_idx.end() );
-        int idx_median = dist_idx[ int(1+0.5*(n-1)) ];
-        if( idx_median < max_dist )
-        {
-            max_dist = idx_median;
-            max_idx  = i;
-        }
-    }
-    med_desc = desc_list[max_idx];
+    if( !desc_list.empty() )
+        med_desc = desc_list.representative();
 
     // direction
-    Vector3d med_dir;
+    int n = dir_list.size();
+    Vector3d med_dir = Vector3d::Zero();
     for(int i = 0; i < n; i++)
         med_dir += dir_list[i];
-    med_obs_dir = med_dir / n;
+    if( n > 0 )
+        med_obs_dir = med_dir / n;
+
+}
+
+size_t MapPoint::observationBytes() const
+{
+    return StVO::vectorBytes(obs_list) + StVO::vectorBytes(dir_list) + StVO::vectorBytes(kf_obs_list) + StVO::vectorBytes(sigma_list);
+}
 
+void MapPoint::compactObservations(int max_desc_rows)
+{
+    // the geometry of every observation is kept for the bundle adjustment, only the slack is released
+    desc_list.trim( max_desc_rows );
+    obs_list.shrink_to_fit();
+    dir_list.shrink_to_fit();
+    kf_obs_list.shrink_to_fit();
+    sigma_list.shrink_to_fit();
 }
 
 // Line segment features
 
 MapLine::MapLine(int idx_, Vector6d line3D_, Mat desc_, int kf_obs_, Vector3d obs_, Vector3d dir_, Vector4d pts_, double sigma2_) :
-    idx(idx_), line3D(line3D_), inlier(true)
+    idx(idx_), line3D(line3D_), inlier(true), local(false), local_epoch(-1), cull_pending(false)
 {
     desc_list.push_back( desc_ );
     obs_list.push_back( obs_ );
@@ -105,17 +327,17 @@ MapLine::MapLine(int idx_, Vector6d line3D_, Mat desc_, int kf_obs_, Vector3d ob
     pts_list.push_back(pts_);
     sigma_list.push_back(sigma2_);
     med_obs_dir = dir_;
-    med_desc    = desc_;
+    med_desc    = StVO::Desc256( desc_ );
 }
 
 MapLine::MapLine(int idx_, Vector6d NDw_, Mat desc_, int kf_obs_, Vector4d obs_,  double sigma2) :
-    idx(idx_), NDw(NDw_), inlier(true)
+    idx(idx_), NDw(NDw_), inlier(true), local(false), local_epoch(-1), cull_pending(false)
 {
     desc_list.push_back(desc_);
     NDw_obs_list.push_back(obs_);
     kf_obs_list.push_back(kf_obs_);
     sigma_list.push_back(sigma2);
-    med_desc = desc_;
+    med_desc = StVO::Desc256( desc_ );
 }
 
 void MapLine::addMapLineObservation(Mat desc_, int kf_obs_, Vector3d obs_, Vector3d dir_, Vector4d pts_, double sigma2_)
@@ -141,86 +363,42 @@ void MapLine::updateAverageDescDir()
 {
 
     // descriptor
-    // - check distances between all the observed descriptors
-    int n = desc_list.size();
-    MatrixXf conf_desc(n,n);
-    for(int i = 0; i < n; i++ )
-    {
-        conf_desc(i,i) = 0;
-        for(int j = i+1 ; j < n; j++ )
-        {
-            int d = norm(desc_list[i],desc_list[j],NORM_HAMMING);
-            conf_desc(i,j) = d;
-            conf_desc(j,i) = d;
-        }
-    }
-
-    // - select the one with least mean distance to the rest
-    int max_dist = 99999;
-    int max_idx  = 0;
-    for(int i = 0; i < n; i++)
-    {
-        vector<int> dist_idx;
-        for(int j = 0; j < n; j++)
-            dist_idx.push_back( conf_desc(i,j) );
-        sort( dist_idx.begin(), dist_idx.end() );
-        int idx_median = dist_idx[ int(1+0.5*(n-1)) ];
-        if( idx_median < max_dist )
-        {
-            max_dist = idx_median;
-            max_idx  = i;
-        }
-    }
-    med_desc = desc_list[max_idx];
-#ifdef USE_LINE_PLUKER
-
-#else
-    // direction
-    Vector3d med_dir;
+    if( !desc_list.empty() )
+        med_desc = desc_list.representative();
+    // direction (only the endpoint observations have one)
+    int n = dir_list.size();
+    Vector3d med_dir = Vector3d::Zero();
     for(int i = 0; i < n; i++)
         med_dir += dir_list[i];
-    med_obs_dir = med_dir / n;
-#endif
+    if( n > 0 )
+        med_obs_dir = med_dir / n;
 }
 
-Vector4d MapLine::changePlukerToOrth(const Vector6d& plukerLine)
+size_t MapLine::observationBytes() const
 {
-    Vector4d orthLine;
-    Matrix3d R = getOrhtRFromPluker(plukerLine);
-    Vector3d u1 = R.col(0);
-    Vector3d u2 = R.col(1);
-    Vector3d u3 = R.col(2);
-    orthLine[0] = atan2( u2(2),u3(2) );
-    orthLine[1] = asin( -u1(2) );
-    orthLine[2] = atan2( u1(1),u1(0) );
+    return StVO::vectorBytes(obs_list) + StVO::vectorBytes(pts_list) + StVO::vectorBytes(dir_list) + StVO::vectorBytes(kf_obs_list)
+         + StVO::vectorBytes(sigma_list) + StVO::vectorBytes(NDw_obs_list);
+}
 
-    Matrix2d W = getOrthWFromPluker(plukerLine);
-    orthLine[3] = asin(W(1,0));
+void MapLine::compactObservations(int max_desc_rows)
+{
+    desc_list.trim( max_desc_rows );
+    obs_list.shrink_to_fit();
+    pts_list.shrink_to_fit();
+    dir_list.shrink_to_fit();
+    kf_obs_list.shrink_to_fit();
+    sigma_list.shrink_to_fit();
+    NDw_obs_list.shrink_to_fit();
+}
 
-    return orthLine;
+Vector4d MapLine::changePlukerToOrth(const Vector6d& plukerLine)
+{
+    return plukerToOrth(plukerLine);
 }
 
 Vector6d MapLine::changeOrthToPluker(const Vector4d& orthLine)
 {
-    double s1 = sin(orthLine[0]);
-    double c1 = cos(orthLine[0]);
-    double s2 = sin(orthLine[1]);
-    double c2 = cos(orthLine[1]);
-    double s3 = sin(orthLine[2]);
-    double c3 = cos(orthLine[2]);
-    Eigen::Matrix3d R;
-    R <<
-      c2 * c3,   s1 * s2 * c3 - c1 * s3,   c1 * s2 * c3 + s1 * s3,
-            c2 * s3,   s1 * s2 * s3 + c1 * c3,   c1 * s2 * s3 - s1 * c3,
-            -s2,                  s1 * c2,                  c1 * c2;
-
-    double w1 = cos(orthLine[3]);
-    double w2 = sin(orthLine[3]);
-
-    Vector6d plukerLine;
-    plukerLine.head(3) = w1 * R.col(0);
-    plukerLine.tail(3) = w2 * R.col(1);
-    return plukerLine;
+    return orthToPluker(orthLine);
 }
 
 Matrix3d MapLine::getOrhtRFromPluker(const Vector6d &plukerLine)
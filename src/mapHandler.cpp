@@ -22,34 +22,213 @@
 
 #include "mapHandler.h"
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <random>
+#include <set>
 #include <opencv2/imgproc.hpp>
 
+#include <logger.h>
+#include <mapSerialization.h>
 #include <matching.h>
+#include <profiler.h>
+#include <threadPool.h>
+#include <threadRole.h>
 #include <timer.h>
 
 #include "../g2o_types/g2o_types.h"
 #include <g2o/core/robust_kernel_impl.h>
+#include <g2o/core/hyper_graph_action.h>
 
 namespace PLSLAM
 {
 
 MapHandler::MapHandler(PinholeStereoCamera* cam_)
-    : cam(cam_), threads_started(false)
+    : local_epoch(0), reloc_kf_idx(-1), cam(cam_), threads_started(false), config(Config::current()), mem_over_budget(false)
 {
-    // load vocabulary
+    // load vocabulary (binary vocabularies are mapped, see convert_vocabulary), or reuse the one of
+    // another instance
     if( SlamConfig::hasPoints() )
-        dbow_voc_p.load( SlamConfig::dbowVocP() );
+        dbow_voc_p = Vocabulary::shared( SlamConfig::dbowVocP() );
     if( SlamConfig::hasLines() )
-        dbow_voc_l.load( SlamConfig::dbowVocL() );
+        dbow_voc_l = Vocabulary::shared( SlamConfig::dbowVocL() );
+    place_rec.setVocabularies( dbow_voc_p.get(), dbow_voc_l.get() );
 
     lc_state = LC_IDLE;
+    lc_last_kf_idx = -1;
+    reduced_kf_idx = 0;
+    initialized = false;
+    front_ends = 0;
+
+    // the map camera is rig 0
+    rig_extrinsics.assign( 1, Matrix4d::Identity() );
+    rig_last_kf.assign( 1, NULL );
+    rig_kf_count.assign( 1, 0 );
+    vo_last_kf.assign( 1, NULL );
+    local_map_snapshot.resize( 1 );
+
+    if( SlamConfig::lmPaging() )
+        lm_pager.open( SlamConfig::lmPageFile() );
+
+    // bounds of the image on the normalized plane, so culling needs no projection
+    frustum_x[0] = -cam->getCx() / cam->getFx();
+    frustum_x[1] = (cam->getWidth() - cam->getCx()) / cam->getFx();
+    frustum_y[0] = -cam->getCy() / cam->getFy();
+    frustum_y[1] = (cam->getHeight() - cam->getCy()) / cam->getFy();
 
 }
 
+bool MapHandler::inFrustum( const Vector3d &P ) const
+{
+    return P(2) > 0.0 &&
+           P(0) > frustum_x[0] * P(2) && P(0) < frustum_x[1] * P(2) &&
+           P(1) > frustum_y[0] * P(2) && P(1) < frustum_y[1] * P(2);
+}
+
+// evaluates the Jacobians of the edges on the thread pool before every iteration, into matrices
+// owned by each edge, so the g2o solver only copies them to its workspace and assembles the Hessian
+// (the edges only read the caches of their vertices)
+class ParallelLinearization : public g2o::HyperGraphAction
+{
+public:
+    vector<EdgePosePoint*>          pt_edges;
+    vector<EdgePoseLine*>           pluker_edges;
+    vector<EdgePoseLineEndpoints*>  endpoint_edges;
+
+    virtual HyperGraphAction* operator()( const g2o::HyperGraph* graph, Parameters* parameters = 0 )
+    {
+        prepare( pt_edges );
+        prepare( pluker_edges );
+        prepare( endpoint_edges );
+        return this;
+    }
+
+private:
+    template<typename E>
+    static void prepare( const vector<E*> &edges )
+    {
+        StVO::ThreadPool &pool = StVO::ThreadPool::global();
+        size_t chunk = ( edges.size() + pool.size() ) / ( pool.size() + 1 );
+        if( chunk == 0 )
+            return;
+        vector<std::future<void>> jobs;
+        for( size_t b = chunk; b < edges.size(); b += chunk )
+            jobs.push_back( pool.submit( [&edges, b, chunk]() {
+                for( size_t i = b; i < std::min( b + chunk, edges.size() ); i++ )
+                    edges[i]->prepareLinearization();
+            } ) );
+        for( size_t i = 0; i < std::min( chunk, edges.size() ); i++ )
+            edges[i]->prepareLinearization();
+        for( std::future<void> &job : jobs )
+            pool.wait( job );
+    }
+};
+
+// raises the stop flag of the optimizer once the time budget (ms, 0 for none) is spent or the
+// optional interruption condition holds
+class OptimizationTimeBudget : public g2o::HyperGraphAction
+{
+public:
+    OptimizationTimeBudget( double budget_, bool *stop_, std::function<bool()> interrupt_ = std::function<bool()>() )
+        : budget(budget_), stop(stop_), interrupt(interrupt_), t0(std::chrono::steady_clock::now()) {}
+
+    virtual HyperGraphAction* operator()( const g2o::HyperGraph* graph, Parameters* parameters = 0 )
+    {
+        if( expired() )
+            *stop = true;
+        return this;
+    }
+
+    bool expired() const
+    {
+        double elapsed = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - t0 ).count();
+        return ( budget > 0.0 && elapsed > budget ) || ( interrupt && interrupt() );
+    }
+
+private:
+    double budget;
+    bool *stop;
+    std::function<bool()> interrupt;
+    std::chrono::steady_clock::time_point t0;
+};
+
+// vertices, robust kernel and camera of a line edge of the GBA (either line model)
+template<typename E>
+static void setupLineEdge( E *e, g2o::OptimizableGraph::Vertex *v_line, VertexLMPose *v_pose, double th_huber,
+                           double fx, double fy, double cx, double cy )
+{
+    e->setVertex(0, v_line);
+    e->setVertex(1, v_pose);
+    g2o::RobustKernelHuber *rk = new g2o::RobustKernelHuber;
+    rk->setDelta(th_huber);
+    e->setRobustKernel(rk);
+    e->SetParams(fx, fy, cx, cy);
+}
+
+// evaluates body( obs, acc ) for every observation of a bundle adjustment problem on the thread pool,
+// with one accumulator per task merged in order at the end; the observations of a landmark (column 1,
+// contiguous in obs_list) are never split between tasks. Returns the error summed by the tasks
+template<typename F>
+static double evaluateObservations( const vector<Vector6i> &obs_list, SchurSolver &solver, VectorXd &g, F body )
+{
+    const size_t min_task_obs = 256;   // fewer observations per task do not pay the dispatch
+    StVO::ThreadPool &pool = StVO::ThreadPool::global();
+    size_t n_tasks = std::min<size_t>( pool.size() + 1, std::max<size_t>( 1, obs_list.size() / min_task_obs ) );
+
+    vector<size_t> bounds( 1, 0 );
+    for( size_t t = 1; t < n_tasks; t++ )
+    {
+        size_t b = std::max( bounds.back(), obs_list.size() * t / n_tasks );
+        while( b > 0 && b < obs_list.size() && obs_list[b](1) == obs_list[b-1](1) )
+            b++;
+        if( b > bounds.back() && b < obs_list.size() )
+            bounds.push_back( b );
+    }
+    bounds.push_back( obs_list.size() );
+
+    vector<SchurSolver::Accumulator> accs;
+    accs.reserve( bounds.size() - 1 );
+    for( size_t t = 0; t + 1 < bounds.size(); t++ )
+        accs.emplace_back( solver );
+    auto run = [&]( size_t t ) {
+        for( size_t i = bounds[t]; i < bounds[t+1]; i++ )
+            body( obs_list[i], accs[t] );
+    };
+    vector<std::future<void>> jobs;
+    for( size_t t = 1; t < accs.size(); t++ )
+        jobs.push_back( pool.submit( run, t ) );
+    run( 0 );
+    for( std::future<void> &job : jobs )
+        pool.wait( job );
+
+    double err = 0.0;
+    for( SchurSolver::Accumulator &acc : accs )
+    {
+        acc.merge( g );
+        err += acc.err;
+    }
+    return err;
+}
+
+// grows buf (never shrinks) so that it holds at least rows descriptors like desc
+static void reserveDescRows( Mat &buf, int rows, const Mat &desc )
+{
+    if (buf.rows < rows || buf.cols != desc.cols || buf.type() != desc.type())
+        buf.create(std::max(rows, buf.rows), desc.cols, desc.type());
+}
+
 void MapHandler::initialize( KeyFrame *kf0 )
 {
-    curr_kf = kf0;
+    curr_kf    = kf0;
+    vo_last_kf.assign( rig_extrinsics.size(), NULL );
+    vo_last_kf[0] = kf0;
+    rig_last_kf.assign( rig_extrinsics.size(), NULL );
+    rig_last_kf[0] = kf0;
+    rig_kf_count.assign( rig_extrinsics.size(), 0 );
+    rig_kf_count[0] = 1;
+    kf0->rig    = 0;
+    kf0->rig_kf = 0;
 
     Twf = Matrix4d::Identity();
     DT = Matrix4d::Identity();
@@ -60,21 +239,30 @@ void MapHandler::initialize( KeyFrame *kf0 )
     map_points_kf_idx.clear();
     map_lines.clear();
     map_lines_kf_idx.clear();
+    live_kfs.clear();
+    live_pts.clear();
+    live_ls.clear();
+    kf_redundancy.clear();
+    submaps.clear();
+    lm_pager.clear();
+    resetLBAGraph();
     full_graph.clear();
-    conf_matrix.clear();
+    pose_graph.clear();
+    kf_pose_info.clear();
+    reduced_kf_idx = 0;
     lc_idx_list.clear();
     lc_pose_list.clear();
+    lc_last_kf_idx = -1;
     max_pt_idx = 0;
     max_ls_idx = 0;
     max_kf_idx = 0;
+    local_kf_idx.clear();
+    local_pt_idx.clear();
+    local_ls_idx.clear();
+    local_epoch = 0;
 
     // initialize graphs
     full_graph.resize(1);
-    full_graph[0].resize(1);
-    full_graph[0][0] = 0;
-    conf_matrix.resize(1);
-    conf_matrix[0].resize(1);
-    conf_matrix[0][0] = 1.0;
 
     // reset indices
     for (PointFeature* pt : kf0->stereo_frame->stereo_pt)
@@ -83,26 +271,16 @@ void MapHandler::initialize( KeyFrame *kf0 )
         ls->idx = -1;
 
     // initialize DBoW descriptor vector and LC status
-    vector<Mat> curr_desc;
-    if( SlamConfig::hasPoints() )
-    {
-        curr_desc.reserve( kf0->stereo_frame->pdesc_l.rows );
-        for ( int i = 0; i < kf0->stereo_frame->pdesc_l.rows; i++ )
-            curr_desc.push_back( kf0->stereo_frame->pdesc_l.row(i) );
-        dbow_voc_p.transform( curr_desc, kf0->descDBoW_P );
-        curr_desc.clear();
-    }
-    if( SlamConfig::hasLines() )
-    {
-        curr_desc.reserve( kf0->stereo_frame->ldesc_l.rows );
-        for ( int i = 0; i < kf0->stereo_frame->ldesc_l.rows; i++ )
-            curr_desc.push_back( kf0->stereo_frame->ldesc_l.row(i) );
-        dbow_voc_l.transform( curr_desc, kf0->descDBoW_L );
-    }
+    startBowVectors( kf0 );
+    waitBowVectors( kf0 );
+    place_rec.clear();
+    place_rec.addKeyFrame( kf0 );
 
     // insert keyframe and add to map of indexes
     vector<int> aux_vec;
     map_keyframes.push_back( kf0 );
+    live_kfs.insert( kf0->kf_idx );
+    submaps.addKF( kf0->kf_idx );
     map_points_kf_idx.insert( std::pair<int,vector<int>>(kf0->kf_idx,aux_vec) );
     map_lines_kf_idx.insert(  std::pair<int,vector<int>>(kf0->kf_idx,aux_vec) );
 
@@ -110,6 +288,7 @@ void MapHandler::initialize( KeyFrame *kf0 )
         startThreads();
 
     time = Vector7f::Zero();
+    setInitialized( true );
 }
 
 void MapHandler::finishSLAM()
@@ -120,64 +299,56 @@ void MapHandler::finishSLAM()
 
 void MapHandler::addKeyFrame( KeyFrame *curr_kf )
 {
+    PROFILE_SCOPE("MapHandler::addKeyFrame");
     Timer timer;
 
-    this->prev_kf = this->curr_kf;
-    this->curr_kf = curr_kf;
+    // the front-ends of the other rigs may run in their own session
+    Config::Scope scope(config);
+    std::lock_guard<ProfiledMutex> producer_lk(kf_producer_mutex);
+    if( curr_kf->rig < 0 || curr_kf->rig >= int(rig_extrinsics.size()) )
+        throw std::runtime_error("[MapHandler] KF of the unknown rig " + to_string(curr_kf->rig));
+    // the mapping threads were finished (killThreads lowers the flag before it queues the stop signal
+    // under this lock, so the KFs queued before it are still inserted)
+    if( SlamConfig::multithreadSLAM() && !threads_started )
+    {
+        LOG_WARN( "[MapHandler] KF of rig " << curr_kf->rig << " rejected, the mapping threads are finished" );
+        delete curr_kf;
+        return;
+    }
+
+    // the BoW encoding runs on the task pool while the KF is queued / matched
+    startBowVectors( curr_kf );
 
     if( SlamConfig::multithreadSLAM() )
     {
-        // expand graphs
-        expandGraphs();
-        // select previous keyframe
-        KeyFrame* prev_kf;
-        prev_kf = map_keyframes.back();
-        max_kf_idx++;
-        curr_kf->kf_idx = max_kf_idx;
-        curr_kf->local  = true;
-        // update pose of current keyframe wrt previous one (in case of LC)
-        Matrix4d T_curr_w = prev_kf->T_kf_w * curr_kf->T_kf_w;
-        curr_kf->x_kf_w = logmap_se3(T_curr_w);
-        curr_kf->T_kf_w = expmap_se3(curr_kf->x_kf_w);
-        // Estimates Twf
-        Twf = expmap_se3(logmap_se3(  inverse_se3( curr_kf->T_kf_w ) ));
-        // estimates pose increment
-        DT = expmap_se3(logmap_se3( Twf * prev_kf->T_kf_w ));
-        // reset indices
-        for (PointFeature* pt : curr_kf->stereo_frame->stereo_pt)
-            pt->idx = -1;
-        for (LineFeature* ls : curr_kf->stereo_frame->stereo_ls)
-            ls->idx = -1;
-        // insert keyframe and add to map of indexes
-        vector<int> aux_vec;
-        map_keyframes.push_back( curr_kf );
-        map_points_kf_idx.insert( std::make_pair(curr_kf->kf_idx, aux_vec) );
-        map_lines_kf_idx.insert(  std::make_pair(curr_kf->kf_idx, aux_vec) );
-        // call
-        addKeyFrame_multiThread(curr_kf,prev_kf);
+        // the handler thread inserts the KF in the map (see insertKeyFrame), prev_kf / curr_kf
+        // are then set by the local mapping thread for each KF it matches
+        addKeyFrame_multiThread(curr_kf,vo_last_kf[curr_kf->rig]);
+        vo_last_kf[curr_kf->rig] = curr_kf;
         return;
     }
 
+    this->curr_kf = curr_kf;
+
 
     // reset time variable
     time = Vector7f::Zero();
 
+    // the map is written until the local map is published (the LC optimization locks it itself)
+    std::unique_lock<SharedMutex> map_lk(map_mutex);
+
     // expand graphs
     timer.start();
     expandGraphs();
     time(0) = timer.stop(); //ms
 
-    // select previous keyframe
-    KeyFrame* prev_kf;
-    prev_kf = map_keyframes.back();
+    // select previous keyframe (of the same rig) and update the pose of the current one wrt it
+    // (in case of LC)
     max_kf_idx++;
     curr_kf->kf_idx = max_kf_idx;
     curr_kf->local  = true;
-
-    // update pose of current keyframe wrt previous one (in case of LC)
-    Matrix4d T_curr_w = prev_kf->T_kf_w * curr_kf->T_kf_w;
-    curr_kf->x_kf_w = logmap_se3(T_curr_w);
-    curr_kf->T_kf_w = expmap_se3(curr_kf->x_kf_w);
+    KeyFrame* prev_kf = placeRigKeyFrame( curr_kf );
+    this->prev_kf = prev_kf;
 
     // Estimates Twf
     Twf = expmap_se3(logmap_se3(  inverse_se3( curr_kf->T_kf_w ) ));
@@ -191,24 +362,29 @@ void MapHandler::addKeyFrame( KeyFrame *curr_kf )
     for (LineFeature* ls : curr_kf->stereo_frame->stereo_ls)
         ls->idx = -1;
 
+    // the direct index of the BoW vectors guides the KF to KF matching, the encoding is only waited
+    // for here when it is kept (lc_bow_levels_up), otherwise it overlaps the matching
+    timer.start();
+    if( SlamConfig::lcBowLevelsUp() >= 0 )
+        waitBowVectors( curr_kf );
+    time(2) = timer.stop(); //ms
+
     // look for common matches and update the full graph
     timer.start();
     lookForCommonMatches( prev_kf, curr_kf );
     time(1) = timer.stop(); //ms
 
+    // insert the new KF in the inverted index (the combined score is computed at query time)
     timer.start();
-    if( SlamConfig::hasPoints() && SlamConfig::hasLines() )
-        insertKFBowVectorPL(curr_kf);
-    else if( SlamConfig::hasPoints() )
-        insertKFBowVectorP(curr_kf);
-    else if( SlamConfig::hasLines() )
-        insertKFBowVectorL(curr_kf);
-
-    time(2) = timer.stop(); //ms
+    waitBowVectors( curr_kf );
+    time(2) += timer.stop(); //ms
+    place_rec.addKeyFrame( curr_kf );
 
     // insert keyframe and add to map of indexes
     vector<int> aux_vec;
     map_keyframes.push_back( curr_kf );
+    live_kfs.insert( curr_kf->kf_idx );
+    assignSubmap( curr_kf );
     map_points_kf_idx.insert( std::make_pair(curr_kf->kf_idx, aux_vec) );
     map_lines_kf_idx.insert(  std::make_pair(curr_kf->kf_idx, aux_vec) );
 
@@ -217,21 +393,88 @@ void MapHandler::addKeyFrame( KeyFrame *curr_kf )
     formLocalMap();
     time(3) = timer.stop(); //ms
 
-    // perform local bundle adjustment
+    // perform local bundle adjustment (line model of the map)
     timer.start();
-    localBundleAdjustment();
+    if( Config::plukerLines() )
+        localBundleAdjustmentForPlukerWithG2O();
+    else
+        localBundleAdjustment();
     time(4) = timer.stop(); //ms
 
     // Recent map LMs culling (implement filters for line segments, which seems to be unaccurate)
     timer.start();
-    removeBadMapLandmarks();
+    if( Config::plukerLines() )
+        removeBadMapLandmarksForPluker();
+    else
+        removeBadMapLandmarks();
+    reduceOldKFs();
     time(5) = timer.stop(); //ms
 
+    publishLocalMap(curr_kf);
+    map_lk.unlock();
 
     // LC
     timer.start();
     loopClosure();
     time(6) = timer.stop(); //ms
+
+    notifyMapChanged();
+}
+
+void MapHandler::addObserver( MapObserver* observer )
+{
+    observers.push_back( observer );
+}
+
+void MapHandler::notifyMapChanged()
+{
+    for( MapObserver* observer : observers )
+        observer->mapChanged( this );
+}
+
+void MapHandler::takeChanges( MapChanges &changes ) const
+{
+    bool all_kfs = live_kfs.takeChanges( changes.kfs, changes.erased_kfs );
+    bool all_pts = live_pts.takeChanges( changes.pts, changes.erased_pts );
+    bool all_ls  = live_ls.takeChanges(  changes.ls,  changes.erased_ls  );
+    changes.all  = all_kfs || all_pts || all_ls;
+}
+
+void MapHandler::publishLocalMap( const KeyFrame* kf )
+{
+    if( !Config::trackLocalMap() || !SlamConfig::hasPoints() || local_pt_idx.empty() )
+        return;
+
+    // local points in the coordinates of kf, with their representative descriptors
+    std::shared_ptr<StVO::LocalMapSnapshot> snapshot = std::make_shared<StVO::LocalMapSnapshot>();
+    snapshot->kf_idx = kf->rig_kf;
+    snapshot->rig    = kf->rig;
+    snapshot->P.resize( 3, local_pt_idx.size() );
+    Mat desc;
+    const Matrix4d Tkw = inverse_se3( kf->T_kf_w );
+    int n = 0;
+    for( int lm_idx : local_pt_idx )
+    {
+        MapPoint* pt = map_points[lm_idx];
+        if( pt == NULL || !pt->inlier ) continue;
+        if( desc.empty() )
+            desc.create( local_pt_idx.size(), sizeof(StVO::Desc256), CV_8U );
+        snapshot->P.col(n) = Tkw.block<3,3>(0,0) * pt->point3D + Tkw.block<3,1>(0,3);
+        memcpy( desc.ptr(n), pt->med_desc.data(), sizeof(StVO::Desc256) );
+        n++;
+    }
+    snapshot->P.conservativeResize( 3, n );
+    if( n > 0 )
+        snapshot->pdesc = desc.rowRange(0, n);
+
+    std::lock_guard<ProfiledMutex> lk(snapshot_mutex);
+    local_map_snapshot[kf->rig] = snapshot;
+}
+
+std::shared_ptr<const StVO::LocalMapSnapshot> MapHandler::localMapSnapshot( int rig ) const
+{
+    std::lock_guard<ProfiledMutex> lk(snapshot_mutex);
+    return local_map_snapshot[rig];
 }
 
 int MapHandler::matchKF2KFPoints(KeyFrame *prev_kf, KeyFrame *curr_kf) {
@@ -254,17 +497,21 @@ int MapHandler::matchKF2KFPoints(KeyFrame *prev_kf, KeyFrame *curr_kf) {
         std::vector<point_2d> pj_points;
         pj_points.reserve(prev_frame->stereo_pt.size());
 
-        for (PointFeature* pt : prev_frame->stereo_pt) {
-            Vector2d point = cam->projection( DT.block(0,0,3,3) * pt->P + DT.col(3).head(3) );
+        // transform the contiguous 3D points of the previous KF at once
+        Matrix<double,3,Dynamic> P_ = DT.block<3,3>(0,0) * prev_frame->pt_arrays.P;
+        P_.colwise() += DT.block<3,1>(0,3);
+        for (int idx = 0; idx < P_.cols(); ++idx) {
+            Vector2d point = cam->projection( P_.col(idx) );
             pj_points.push_back(std::make_pair(point(0) * curr_frame->inv_width, point(1) * curr_frame->inv_height));
         }
 
         //Fill in grid
-        GridStructure grid(GRID_ROWS, GRID_COLS);
-        for (int idx = 0; idx < curr_frame->stereo_pt.size(); ++idx) {
-            PointFeature* point = curr_frame->stereo_pt[idx];
-            grid.at(point->pl(0) * curr_frame->inv_width, point->pl(1) * curr_frame->inv_height).push_back(idx);
-        }
+        static thread_local GridStructure grid(GRID_ROWS, GRID_COLS); // storage reused across KFs
+        grid.clear();
+        const Matrix<double,2,Dynamic> &pl = curr_frame->pt_arrays.pl;
+        for (int idx = 0; idx < pl.cols(); ++idx)
+            grid.add(pl(0,idx) * curr_frame->inv_width, pl(1,idx) * curr_frame->inv_height, idx);
+        grid.build();
 
         GridWindow w;
         int ws = SlamConfig::matchingF2FWs();
@@ -277,7 +524,7 @@ int MapHandler::matchKF2KFPoints(KeyFrame *prev_kf, KeyFrame *curr_kf) {
     if (curr_frame->stereo_pt.size() > SlamConfig::minPointMatches() &&
             prev_frame->stereo_pt.size() > SlamConfig::minPointMatches() &&
             matches < SlamConfig::minPointMatches()) {
-        matches = match(prev_frame->pdesc_l, curr_frame->pdesc_l, SlamConfig::minRatio12P(), matches_12);
+        matches = matchKFDescriptors(prev_kf, curr_kf, false, matches_12);
     }
 
     for (int i1 = 0; i1 < matches_12.size(); ++i1) {
@@ -316,12 +563,13 @@ int MapHandler::matchKF2KFPoints(KeyFrame *prev_kf, KeyFrame *curr_kf) {
                                               kf2_idx,
                                               curr_frame->stereo_pt[i2]->pl,
                                               dir);
+            kf_redundancy.add( map_point->kf_obs_list );
             // add 3D landmark to map
             map_points.push_back(map_point);
+            live_pts.insert( map_point->idx );
             max_pt_idx++;
             // update full graph (new feature)
-            full_graph[kf2_idx][kf1_idx]++;
-            full_graph[kf1_idx][kf2_idx]++;
+            full_graph.increaseWeight( kf2_idx, kf1_idx );
 
             // if has refine pose:
             if (SlamConfig::hasRefinement()) {
@@ -339,15 +587,17 @@ int MapHandler::matchKF2KFPoints(KeyFrame *prev_kf, KeyFrame *curr_kf) {
                 Vector3d p3d = curr_kf->T_kf_w.block(0,0,3,3) * curr_frame->stereo_pt[i2]->P + curr_kf->T_kf_w.col(3).head(3);
                 //Vector3d dir = kf1->stereo_frame->stereo_pt[lr_tdx]->P / kf1->stereo_frame->stereo_pt[lr_tdx]->P.norm();
                 Vector3d dir = p3d.normalized();
+                lm_pager.pageIn( map_points[lm_idx] );
+                kf_redundancy.remove( map_points[lm_idx]->kf_obs_list );
                 map_points[lm_idx]->addMapPointObservation(curr_frame->pdesc_l.row(i2),
                                                            kf2_idx,
                                                            curr_frame->stereo_pt[i2]->pl,
                                                            dir);
+                kf_redundancy.add( map_points[lm_idx]->kf_obs_list );
                 // update full graph (previously observed feature)
                 for (int obs : map_points[lm_idx]->kf_obs_list) {
                     if (obs != kf2_idx) {
-                        full_graph[kf2_idx][obs]++;
-                        full_graph[obs][kf2_idx]++;
+                        full_graph.increaseWeight( kf2_idx, obs );
                     }
                 }
 
@@ -385,33 +635,36 @@ int MapHandler::matchKF2KFLines(KeyFrame *prev_kf, KeyFrame *curr_kf) {
         std::vector<line_2d> pj_lines;
         pj_lines.reserve(prev_frame->stereo_ls.size());
 
-        for (LineFeature* ls : prev_frame->stereo_ls) {
-            Vector3d sP_ = DT.block(0,0,3,3) * ls->sP + DT.col(3).head(3);
-            Vector2d spl_proj = cam->projection( sP_ );
-
-            Vector3d eP_ = DT.block(0,0,3,3) * ls->eP + DT.col(3).head(3);
-            Vector2d epl_proj = cam->projection( eP_ );
+        // transform the contiguous endpoints of the previous KF at once
+        const LineArrays &prev_ls = prev_frame->ls_arrays;
+        Matrix<double,3,Dynamic> sP_ = DT.block<3,3>(0,0) * prev_ls.sP;
+        Matrix<double,3,Dynamic> eP_ = DT.block<3,3>(0,0) * prev_ls.eP;
+        sP_.colwise() += DT.block<3,1>(0,3);
+        eP_.colwise() += DT.block<3,1>(0,3);
+        for (int idx = 0; idx < prev_ls.size(); ++idx) {
+            Vector2d spl_proj = cam->projection( sP_.col(idx) );
+            Vector2d epl_proj = cam->projection( eP_.col(idx) );
 
             pj_lines.push_back(std::make_pair(std::make_pair(spl_proj(0), spl_proj(1)),
                                               std::make_pair(epl_proj(0), epl_proj(1))));
         }
 
-        //Fill in grid
-        list<point_2d> line_coords;
-        GridStructure grid(GRID_ROWS, GRID_COLS);
-        std::vector<std::pair<double, double>> directions(curr_frame->stereo_ls.size());
-        for (int idx = 0; idx < curr_frame->stereo_ls.size(); ++idx) {
-            LineFeature* line = curr_frame->stereo_ls[idx];
+        //Fill in row index
+        static thread_local LineRowIndex grid(GRID_ROWS, GRID_COLS); // storage reused across KFs
+        grid.clear();
+        const LineArrays &curr_ls = curr_frame->ls_arrays;
+        std::vector<std::pair<double, double>> directions(curr_ls.size());
+        for (int idx = 0; idx < curr_ls.size(); ++idx) {
+            const double sx = curr_ls.spl(0,idx) * curr_frame->inv_width,  sy = curr_ls.spl(1,idx) * curr_frame->inv_height;
+            const double ex = curr_ls.epl(0,idx) * curr_frame->inv_width,  ey = curr_ls.epl(1,idx) * curr_frame->inv_height;
 
             std::pair<double, double> &v = directions[idx];
-            v = std::make_pair((line->epl(0) - line->spl(0)) * curr_frame->inv_width, (line->epl(1) - line->spl(1)) * curr_frame->inv_height);
+            v = std::make_pair(ex - sx, ey - sy);
             normalize(v);
 
-            getLineCoords(line->spl(0) * curr_frame->inv_width, line->spl(1) * curr_frame->inv_height,
-                          line->epl(0) * curr_frame->inv_width, line->epl(1) * curr_frame->inv_height, line_coords);
-            for (const point_2d &p : line_coords)
-                grid.at(p.first, p.second).push_back(idx);
+            grid.add(sx, sy, ex, ey, idx);
         }
+        grid.build();
 
         GridWindow w;
         int ws = SlamConfig::matchingF2FWs();
@@ -424,154 +677,104 @@ int MapHandler::matchKF2KFLines(KeyFrame *prev_kf, KeyFrame *curr_kf) {
     if (curr_frame->stereo_ls.size() > SlamConfig::minLineMatches() &&
             prev_frame->stereo_ls.size() > SlamConfig::minLineMatches() &&
             matches < SlamConfig::minLineMatches()) {
-        matches = match(prev_frame->ldesc_l, curr_frame->ldesc_l, SlamConfig::minRatio12L(), matches_12);
+        matches = matchKFDescriptors(prev_kf, curr_kf, true, matches_12);
 //        if (matches < SlamConfig::minLineMatches()) return 0;
     }
     double precent = 0;
     double total = matches_12.size();
     double bad = 0;
-#ifdef USE_LINE_PLUKER
-    for (int i1 = 0; i1 < matches_12.size(); ++i1) {
-        const int i2 = matches_12[i1];
-        if (i2 < 0) continue;
-
-        // this shouldn't happen
-        if (prev_frame->stereo_ls[i1] == nullptr)
-            throw runtime_error("[MapHandler] NULL stereo line (prev)");
-        if (curr_frame->stereo_ls[i2] == nullptr)
-            throw runtime_error("[MapHandler] NULL stereo line (curr)");
-
-        // new 3D landmark
-        if (prev_frame->stereo_ls[i1]->idx == -1) {
-            // assign indices
-            prev_frame->stereo_ls[i1]->idx = max_ls_idx;
-            curr_frame->stereo_ls[i2]->idx = max_ls_idx;
-            // create new 3D landmark with the observation from previous KF
-            Matrix4d Tfw = ( prev_kf->T_kf_w );
-            Vector6d plukerLW = TransformForPluker(Tfw, prev_frame->stereo_ls[i1]->NDc);
-            //提高数值稳定性
-            double d = plukerLW.head(3).norm() / plukerLW.tail(3).norm();
-        //    std::cout<<"d: "<<d<<std::endl;
-            Vector6d new_pluker_lw;
-            plukerLW.tail(3).normalize();
-            plukerLW.head(3).normalize();
-            new_pluker_lw.tail(3) = plukerLW.tail(3);
-            new_pluker_lw.head(3) = plukerLW.head(3) * d;
-            Vector4d pts;
-            pts << prev_frame->stereo_ls[i1]->spl, prev_frame->stereo_ls[i1]->epl;
-            //test for debug
-            Vector6d plukerLc = TransformForPluker(Tfw.inverse(),new_pluker_lw);
-            Vector3d plukerLc_pixel = cam->getPlukerK() * plukerLc.head(3);
-            double lx = plukerLc_pixel(0);
-            double ly = plukerLc_pixel(1);
-            double lz = plukerLc_pixel(2);
-            double fenmu = sqrt(lx*lx + ly*ly);
-            Vector2d error;
-            error(0) = (pts(0) * lx + pts(1) * ly + lz ) / fenmu;
-            error(1) = (pts(2) * lx + pts(3) * ly + lz ) / fenmu;
-//            std::cout<<"Error when construct MapLine: "<<error.norm()<<std::endl;
-            //end test
-
-            //test for debug
-            Vector4d pts2;
-            pts2 << curr_frame->stereo_ls[i2]->spl, curr_frame->stereo_ls[i2]->epl;
-            Vector6d plukerLc2 = TransformForPluker(curr_kf->T_kf_w.inverse(),new_pluker_lw);
-            Vector3d plukerLc2_pixel = cam->getPlukerK() * plukerLc2.head(3);
-            double lx2 = plukerLc2_pixel(0);
-            double ly2 = plukerLc2_pixel(1);
-            double lz2 = plukerLc2_pixel(2);
-            double fenmu2 = sqrt(lx2*lx2 + ly2*ly2);
-            Vector2d error2;
-            error2(0) = (pts2(0) * lx2 + pts2(1) * ly2 + lz2 ) / fenmu2;
-            error2(1) = (pts2(2) * lx2 + pts2(3) * ly2 + lz2 ) / fenmu2;
-            //         std::cout<<"Error when AddObs to MapLine: "<<error2.norm()<<std::endl;
-            //end test
-            if(error2.norm()>sqrt(5.991)){
-                curr_frame->stereo_ls[i2]->idx = -1;
-                prev_frame->stereo_ls[i1]->idx = -1;
-                bad++;
-                continue;
-            }
-
-            MapLine* map_line = new MapLine(max_ls_idx,
-                                            new_pluker_lw,
-                                            prev_frame->ldesc_l.row(i1),
-                                            kf1_idx,
-                                            pts);
-
-            //test for debug
-            map_line->first_kf_id = kf1_idx;
-            map_line->first_kf_pose = Tfw;
-            map_line->first_kf_obs = pts;
-            map_line->error = error.norm();
-            map_line->first_NDw = new_pluker_lw;
-         //   std::cout<<"Pluker: "<<map_line->NDw.transpose()<<std::endl;
-            // add new 3D landmark to kf_idx where it was first observed
-            map_lines_kf_idx.at( kf1_idx ).push_back( max_ls_idx );
-            // add observation of the 3D landmark from current KF
-            pts << curr_frame->stereo_ls[i2]->spl, curr_frame->stereo_ls[i2]->epl;
-
-            map_line->addMapLineObservation(curr_frame->ldesc_l.row(i2),
-                                            kf2_idx,
-                                            pts);
-
-            // add 3D landmark to map
-            map_lines.push_back(map_line);
-            max_ls_idx++;
-            // update full graph (new feature)
-            full_graph[kf2_idx][kf1_idx]++;
-            full_graph[kf1_idx][kf2_idx]++;
+    if (Config::plukerLines()) {
+        for (int i1 = 0; i1 < matches_12.size(); ++i1) {
+            const int i2 = matches_12[i1];
+            if (i2 < 0) continue;
 
-            // if has refine pose:
-            if (SlamConfig::hasRefinement()) {
-                LineFeature* ls = prev_frame->stereo_ls[i1];
-                ls->sdisp_obs   = curr_frame->stereo_ls[i2]->sdisp;
-                ls->edisp_obs   = curr_frame->stereo_ls[i2]->edisp;
-                ls->spl_obs     = curr_frame->stereo_ls[i2]->spl;
-                ls->epl_obs     = curr_frame->stereo_ls[i2]->epl;
-                ls->le_obs      = curr_frame->stereo_ls[i2]->le;
-                ls->inlier      = true;
-                matched_ls.push_back( ls );
-            }
-        } else { // 3D landmark exists: copy idx && add observation to map landmark
-            // copy idx
-            int lm_idx = prev_frame->stereo_ls[i1]->idx;
-            if (map_lines[lm_idx] != nullptr) {
-                curr_frame->stereo_ls[i2]->idx = lm_idx;
-                // add observation of the 3D landmark from current KF
+            // this shouldn't happen
+            if (prev_frame->stereo_ls[i1] == nullptr)
+                throw runtime_error("[MapHandler] NULL stereo line (prev)");
+            if (curr_frame->stereo_ls[i2] == nullptr)
+                throw runtime_error("[MapHandler] NULL stereo line (curr)");
+
+            // new 3D landmark
+            if (prev_frame->stereo_ls[i1]->idx == -1) {
+                // assign indices
+                prev_frame->stereo_ls[i1]->idx = max_ls_idx;
+                curr_frame->stereo_ls[i2]->idx = max_ls_idx;
+                // create new 3D landmark with the observation from previous KF
+                Matrix4d Tfw = ( prev_kf->T_kf_w );
+                Vector6d plukerLW = TransformForPluker(Tfw, prev_frame->stereo_ls[i1]->NDc);
+                //提高数值稳定性
+                double d = plukerLW.head(3).norm() / plukerLW.tail(3).norm();
+            //    std::cout<<"d: "<<d<<std::endl;
+                Vector6d new_pluker_lw;
+                plukerLW.tail(3).normalize();
+                plukerLW.head(3).normalize();
+                new_pluker_lw.tail(3) = plukerLW.tail(3);
+                new_pluker_lw.head(3) = plukerLW.head(3) * d;
                 Vector4d pts;
-                pts << curr_frame->stereo_ls[i2]->spl, curr_frame->stereo_ls[i2]->epl;
+                pts << prev_frame->stereo_ls[i1]->spl, prev_frame->stereo_ls[i1]->epl;
+                //test for debug
+                Vector6d plukerLc = TransformForPluker(Tfw.inverse(),new_pluker_lw);
+                Vector3d plukerLc_pixel = cam->getPlukerK() * plukerLc.head(3);
+                double lx = plukerLc_pixel(0);
+                double ly = plukerLc_pixel(1);
+                double lz = plukerLc_pixel(2);
+                double fenmu = sqrt(lx*lx + ly*ly);
+                Vector2d error;
+                error(0) = (pts(0) * lx + pts(1) * ly + lz ) / fenmu;
+                error(1) = (pts(2) * lx + pts(3) * ly + lz ) / fenmu;
+    //            std::cout<<"Error when construct MapLine: "<<error.norm()<<std::endl;
+                //end test
 
                 //test for debug
-                Vector6d plukerLc2 = TransformForPluker(curr_kf->T_kf_w.inverse(),map_lines[lm_idx]->NDw);
+                Vector4d pts2;
+                pts2 << curr_frame->stereo_ls[i2]->spl, curr_frame->stereo_ls[i2]->epl;
+                Vector6d plukerLc2 = TransformForPluker(curr_kf->T_kf_w.inverse(),new_pluker_lw);
                 Vector3d plukerLc2_pixel = cam->getPlukerK() * plukerLc2.head(3);
                 double lx2 = plukerLc2_pixel(0);
                 double ly2 = plukerLc2_pixel(1);
                 double lz2 = plukerLc2_pixel(2);
                 double fenmu2 = sqrt(lx2*lx2 + ly2*ly2);
                 Vector2d error2;
-                error2(0) = (pts(0) * lx2 + pts(1) * ly2 + lz2 ) / fenmu2;
-                error2(1) = (pts(2) * lx2 + pts(3) * ly2 + lz2 ) / fenmu2;
-               // std::cout<<"Error when AddObs to MapLine: "<<error2.norm()<<std::endl;
+                error2(0) = (pts2(0) * lx2 + pts2(1) * ly2 + lz2 ) / fenmu2;
+                error2(1) = (pts2(2) * lx2 + pts2(3) * ly2 + lz2 ) / fenmu2;
+                //         std::cout<<"Error when AddObs to MapLine: "<<error2.norm()<<std::endl;
                 //end test
                 if(error2.norm()>sqrt(5.991)){
                     curr_frame->stereo_ls[i2]->idx = -1;
+                    prev_frame->stereo_ls[i1]->idx = -1;
                     bad++;
-              //      std::cout<<"delete in before the obs size: "<<map_lines[lm_idx]->kf_obs_list.size()<<std::endl;
                     continue;
                 }
-                map_lines[lm_idx]->addMapLineObservation(curr_frame->ldesc_l.row(i2),
-                                                         kf2_idx,
-                                                         pts);
 
-                //       std::cout<<"curr map_line obs size: "<<map_lines[lm_idx]->NDw_obs_list.size()<<std::endl;
-                // update full graph (previously observed feature)
-                for (int obs : map_lines[lm_idx]->kf_obs_list) {
-                    if (obs != kf2_idx) {
-                        full_graph[kf2_idx][obs]++;
-                        full_graph[obs][kf2_idx]++;
-                    }
-                }
+                MapLine* map_line = new MapLine(max_ls_idx,
+                                                new_pluker_lw,
+                                                prev_frame->ldesc_l.row(i1),
+                                                kf1_idx,
+                                                pts);
+
+                //test for debug
+                map_line->first_kf_id = kf1_idx;
+                map_line->first_kf_pose = Tfw;
+                map_line->first_kf_obs = pts;
+                map_line->error = error.norm();
+                map_line->first_NDw = new_pluker_lw;
+             //   std::cout<<"Pluker: "<<map_line->NDw.transpose()<<std::endl;
+                // add new 3D landmark to kf_idx where it was first observed
+                map_lines_kf_idx.at( kf1_idx ).push_back( max_ls_idx );
+                // add observation of the 3D landmark from current KF
+                pts << curr_frame->stereo_ls[i2]->spl, curr_frame->stereo_ls[i2]->epl;
+
+                map_line->addMapLineObservation(curr_frame->ldesc_l.row(i2),
+                                                kf2_idx,
+                                                pts);
+                kf_redundancy.add( map_line->kf_obs_list );
+
+                // add 3D landmark to map
+                map_lines.push_back(map_line);
+                live_ls.insert( map_line->idx );
+                max_ls_idx++;
+                // update full graph (new feature)
+                full_graph.increaseWeight( kf2_idx, kf1_idx );
 
                 // if has refine pose:
                 if (SlamConfig::hasRefinement()) {
@@ -584,96 +787,115 @@ int MapHandler::matchKF2KFLines(KeyFrame *prev_kf, KeyFrame *curr_kf) {
                     ls->inlier      = true;
                     matched_ls.push_back( ls );
                 }
+            } else { // 3D landmark exists: copy idx && add observation to map landmark
+                // copy idx
+                int lm_idx = prev_frame->stereo_ls[i1]->idx;
+                if (map_lines[lm_idx] != nullptr) {
+                    curr_frame->stereo_ls[i2]->idx = lm_idx;
+                    // add observation of the 3D landmark from current KF
+                    Vector4d pts;
+                    pts << curr_frame->stereo_ls[i2]->spl, curr_frame->stereo_ls[i2]->epl;
+
+                    //test for debug
+                    Vector6d plukerLc2 = TransformForPluker(curr_kf->T_kf_w.inverse(),map_lines[lm_idx]->NDw);
+                    Vector3d plukerLc2_pixel = cam->getPlukerK() * plukerLc2.head(3);
+                    double lx2 = plukerLc2_pixel(0);
+                    double ly2 = plukerLc2_pixel(1);
+                    double lz2 = plukerLc2_pixel(2);
+                    double fenmu2 = sqrt(lx2*lx2 + ly2*ly2);
+                    Vector2d error2;
+                    error2(0) = (pts(0) * lx2 + pts(1) * ly2 + lz2 ) / fenmu2;
+                    error2(1) = (pts(2) * lx2 + pts(3) * ly2 + lz2 ) / fenmu2;
+                   // std::cout<<"Error when AddObs to MapLine: "<<error2.norm()<<std::endl;
+                    //end test
+                    if(error2.norm()>sqrt(5.991)){
+                        curr_frame->stereo_ls[i2]->idx = -1;
+                        bad++;
+                  //      std::cout<<"delete in before the obs size: "<<map_lines[lm_idx]->kf_obs_list.size()<<std::endl;
+                        continue;
+                    }
+                    lm_pager.pageIn( map_lines[lm_idx] );
+                    kf_redundancy.remove( map_lines[lm_idx]->kf_obs_list );
+                    map_lines[lm_idx]->addMapLineObservation(curr_frame->ldesc_l.row(i2),
+                                                             kf2_idx,
+                                                             pts);
+                    kf_redundancy.add( map_lines[lm_idx]->kf_obs_list );
+
+                    //       std::cout<<"curr map_line obs size: "<<map_lines[lm_idx]->NDw_obs_list.size()<<std::endl;
+                    // update full graph (previously observed feature)
+                    for (int obs : map_lines[lm_idx]->kf_obs_list) {
+                        if (obs != kf2_idx) {
+                            full_graph.increaseWeight( kf2_idx, obs );
+                        }
+                    }
+
+                    // if has refine pose:
+                    if (SlamConfig::hasRefinement()) {
+                        LineFeature* ls = prev_frame->stereo_ls[i1];
+                        ls->sdisp_obs   = curr_frame->stereo_ls[i2]->sdisp;
+                        ls->edisp_obs   = curr_frame->stereo_ls[i2]->edisp;
+                        ls->spl_obs     = curr_frame->stereo_ls[i2]->spl;
+                        ls->epl_obs     = curr_frame->stereo_ls[i2]->epl;
+                        ls->le_obs      = curr_frame->stereo_ls[i2]->le;
+                        ls->inlier      = true;
+                        matched_ls.push_back( ls );
+                    }
+                }
             }
         }
-    }
-    std::cout<<"Total num: "<<total<<" while bad is: "<<bad<<std::endl;
-#else
-    for (int i1 = 0; i1 < matches_12.size(); ++i1) {
-        const int i2 = matches_12[i1];
-        if (i2 < 0) continue;
-
-        // this shouldn't happen
-        if (prev_frame->stereo_ls[i1] == nullptr)
-            throw runtime_error("[MapHandler] NULL stereo line (prev)");
-        if (curr_frame->stereo_ls[i2] == nullptr)
-            throw runtime_error("[MapHandler] NULL stereo line (curr)");
-
-        // new 3D landmark
-        if (prev_frame->stereo_ls[i1]->idx == -1) {
-            // assign indices
-            prev_frame->stereo_ls[i1]->idx = max_ls_idx;
-            curr_frame->stereo_ls[i2]->idx = max_ls_idx;
-            // create new 3D landmark with the observation from previous KF
-            Matrix4d Tfw = ( prev_kf->T_kf_w );
-            Vector3d sP3d = Tfw.block(0,0,3,3) * prev_frame->stereo_ls[i1]->sP + Tfw.col(3).head(3);
-            Vector3d eP3d = Tfw.block(0,0,3,3) * prev_frame->stereo_ls[i1]->eP + Tfw.col(3).head(3);
-            Vector6d L3d;
-            L3d << sP3d, eP3d;
-            Vector3d mP3d = 0.5*(sP3d+eP3d);
-            mP3d = mP3d.normalized();
-            Vector4d pts;
-            pts << prev_frame->stereo_ls[i1]->spl, prev_frame->stereo_ls[i1]->epl;
-            MapLine* map_line = new MapLine(max_ls_idx,
-                                            L3d,
-                                            prev_frame->ldesc_l.row(i1),
-                                            kf1_idx,
-                                            prev_frame->stereo_ls[i1]->le,
-                                            mP3d,
-                                            pts);
-            // add new 3D landmark to kf_idx where it was first observed
-            map_lines_kf_idx.at( kf1_idx ).push_back( max_ls_idx );
-            // add observation of the 3D landmark from current KF
-            mP3d = 0.5*( curr_frame->stereo_ls[i2]->sP + curr_frame->stereo_ls[i2]->eP );
-            mP3d = curr_kf->T_kf_w.block(0,0,3,3) * mP3d + curr_kf->T_kf_w.col(3).head(3);
-            mP3d = mP3d.normalized();
-            pts << curr_frame->stereo_ls[i2]->spl, curr_frame->stereo_ls[i2]->epl;
-            map_line->addMapLineObservation(curr_frame->ldesc_l.row(i2),
-                                            kf2_idx,
-                                            curr_frame->stereo_ls[i2]->le,
-                                            mP3d,
-                                            pts);
-            // add 3D landmark to map
-            map_lines.push_back(map_line);
-            max_ls_idx++;
-            // update full graph (new feature)
-            full_graph[kf2_idx][kf1_idx]++;
-            full_graph[kf1_idx][kf2_idx]++;
+        LOG_DEBUG( "Total num: " << total << " while bad is: " << bad );
+    } else {
+        for (int i1 = 0; i1 < matches_12.size(); ++i1) {
+            const int i2 = matches_12[i1];
+            if (i2 < 0) continue;
 
-            // if has refine pose:
-            if (SlamConfig::hasRefinement()) {
-                LineFeature* ls = prev_frame->stereo_ls[i1];
-                ls->sdisp_obs   = curr_frame->stereo_ls[i2]->sdisp;
-                ls->edisp_obs   = curr_frame->stereo_ls[i2]->edisp;
-                ls->spl_obs     = curr_frame->stereo_ls[i2]->spl;
-                ls->epl_obs     = curr_frame->stereo_ls[i2]->epl;
-                ls->le_obs      = curr_frame->stereo_ls[i2]->le;
-                ls->inlier      = true;
-                matched_ls.push_back( ls );
-            }
-        } else { // 3D landmark exists: copy idx && add observation to map landmark
-            // copy idx
-            int lm_idx = prev_frame->stereo_ls[i1]->idx;
-            if (map_lines[lm_idx] != nullptr) {
-                curr_frame->stereo_ls[i2]->idx = lm_idx;
+            // this shouldn't happen
+            if (prev_frame->stereo_ls[i1] == nullptr)
+                throw runtime_error("[MapHandler] NULL stereo line (prev)");
+            if (curr_frame->stereo_ls[i2] == nullptr)
+                throw runtime_error("[MapHandler] NULL stereo line (curr)");
+
+            // new 3D landmark
+            if (prev_frame->stereo_ls[i1]->idx == -1) {
+                // assign indices
+                prev_frame->stereo_ls[i1]->idx = max_ls_idx;
+                curr_frame->stereo_ls[i2]->idx = max_ls_idx;
+                // create new 3D landmark with the observation from previous KF
+                Matrix4d Tfw = ( prev_kf->T_kf_w );
+                Vector3d sP3d = Tfw.block(0,0,3,3) * prev_frame->stereo_ls[i1]->sP + Tfw.col(3).head(3);
+                Vector3d eP3d = Tfw.block(0,0,3,3) * prev_frame->stereo_ls[i1]->eP + Tfw.col(3).head(3);
+                Vector6d L3d;
+                L3d << sP3d, eP3d;
+                Vector3d mP3d = 0.5*(sP3d+eP3d);
+                mP3d = mP3d.normalized();
+                Vector4d pts;
+                pts << prev_frame->stereo_ls[i1]->spl, prev_frame->stereo_ls[i1]->epl;
+                MapLine* map_line = new MapLine(max_ls_idx,
+                                                L3d,
+                                                prev_frame->ldesc_l.row(i1),
+                                                kf1_idx,
+                                                prev_frame->stereo_ls[i1]->le,
+                                                mP3d,
+                                                pts);
+                // add new 3D landmark to kf_idx where it was first observed
+                map_lines_kf_idx.at( kf1_idx ).push_back( max_ls_idx );
                 // add observation of the 3D landmark from current KF
-                Vector3d mP3d = 0.5*(curr_frame->stereo_ls[i2]->sP+curr_frame->stereo_ls[i2]->eP);
+                mP3d = 0.5*( curr_frame->stereo_ls[i2]->sP + curr_frame->stereo_ls[i2]->eP );
                 mP3d = curr_kf->T_kf_w.block(0,0,3,3) * mP3d + curr_kf->T_kf_w.col(3).head(3);
                 mP3d = mP3d.normalized();
-                Vector4d pts;
                 pts << curr_frame->stereo_ls[i2]->spl, curr_frame->stereo_ls[i2]->epl;
-                map_lines[lm_idx]->addMapLineObservation(curr_frame->ldesc_l.row(i2),
-                                                         kf2_idx,
-                                                         curr_frame->stereo_ls[i2]->le,
-                                                         mP3d,
-                                                         pts);
-                // update full graph (previously observed feature)
-                for (int obs : map_lines[lm_idx]->kf_obs_list) {
-                    if (obs != kf2_idx) {
-                        full_graph[kf2_idx][obs]++;
-                        full_graph[obs][kf2_idx]++;
-                    }
-                }
+                map_line->addMapLineObservation(curr_frame->ldesc_l.row(i2),
+                                                kf2_idx,
+                                                curr_frame->stereo_ls[i2]->le,
+                                                mP3d,
+                                                pts);
+                kf_redundancy.add( map_line->kf_obs_list );
+                // add 3D landmark to map
+                map_lines.push_back(map_line);
+                live_ls.insert( map_line->idx );
+                max_ls_idx++;
+                // update full graph (new feature)
+                full_graph.increaseWeight( kf2_idx, kf1_idx );
 
                 // if has refine pose:
                 if (SlamConfig::hasRefinement()) {
@@ -686,10 +908,47 @@ int MapHandler::matchKF2KFLines(KeyFrame *prev_kf, KeyFrame *curr_kf) {
                     ls->inlier      = true;
                     matched_ls.push_back( ls );
                 }
+            } else { // 3D landmark exists: copy idx && add observation to map landmark
+                // copy idx
+                int lm_idx = prev_frame->stereo_ls[i1]->idx;
+                if (map_lines[lm_idx] != nullptr) {
+                    curr_frame->stereo_ls[i2]->idx = lm_idx;
+                    // add observation of the 3D landmark from current KF
+                    Vector3d mP3d = 0.5*(curr_frame->stereo_ls[i2]->sP+curr_frame->stereo_ls[i2]->eP);
+                    mP3d = curr_kf->T_kf_w.block(0,0,3,3) * mP3d + curr_kf->T_kf_w.col(3).head(3);
+                    mP3d = mP3d.normalized();
+                    Vector4d pts;
+                    pts << curr_frame->stereo_ls[i2]->spl, curr_frame->stereo_ls[i2]->epl;
+                    lm_pager.pageIn( map_lines[lm_idx] );
+                    kf_redundancy.remove( map_lines[lm_idx]->kf_obs_list );
+                    map_lines[lm_idx]->addMapLineObservation(curr_frame->ldesc_l.row(i2),
+                                                             kf2_idx,
+                                                             curr_frame->stereo_ls[i2]->le,
+                                                             mP3d,
+                                                             pts);
+                    kf_redundancy.add( map_lines[lm_idx]->kf_obs_list );
+                    // update full graph (previously observed feature)
+                    for (int obs : map_lines[lm_idx]->kf_obs_list) {
+                        if (obs != kf2_idx) {
+                            full_graph.increaseWeight( kf2_idx, obs );
+                        }
+                    }
+
+                    // if has refine pose:
+                    if (SlamConfig::hasRefinement()) {
+                        LineFeature* ls = prev_frame->stereo_ls[i1];
+                        ls->sdisp_obs   = curr_frame->stereo_ls[i2]->sdisp;
+                        ls->edisp_obs   = curr_frame->stereo_ls[i2]->edisp;
+                        ls->spl_obs     = curr_frame->stereo_ls[i2]->spl;
+                        ls->epl_obs     = curr_frame->stereo_ls[i2]->epl;
+                        ls->le_obs      = curr_frame->stereo_ls[i2]->le;
+                        ls->inlier      = true;
+                        matched_ls.push_back( ls );
+                    }
+                }
             }
         }
     }
-#endif
 
     return matches;
 }
@@ -699,39 +958,48 @@ int MapHandler::matchMap2KFPoints() {
     int kf2_idx = curr_kf->kf_idx;
     StVO::StereoFrame* curr_frame = curr_kf->stereo_frame;
 
-    // select local map
-    vector<MapPoint*> map_local_points;
-    std::vector<point_2d> pj_points;
-    Mat map_lpt_desc;
-
     if (!SlamConfig::hasPoints() || curr_frame->stereo_pt.empty())
         return 0;
 
-    for (MapPoint* pt : map_points) {
+    const Matrix3d Rwf = Twf.block(0,0,3,3);
+    const Vector3d twf = Twf.col(3).head(3);
+
+    // select local map (only the local LMs, culled against the frustum)
+    vector<MapPoint*> map_local_points;
+    std::vector<point_2d> pj_points;
+    map_local_points.reserve(local_pt_idx.size());
+    pj_points.reserve(local_pt_idx.size());
+    if (!local_pt_idx.empty())
+        reserveDescRows(proj_desc, local_pt_idx.size(), curr_frame->pdesc_l);
+    for (int lm_idx : local_pt_idx) {
+        MapPoint* pt = map_points[lm_idx];
         // if it is local and not found in the current KF
         if (pt != nullptr && pt->local && pt->kf_obs_list.back() != kf2_idx) {
             // if the LM is projected inside the current image
-            Vector3d Pf = Twf.block(0,0,3,3) * pt->point3D + Twf.col(3).head(3);
-            Vector2d pf = cam->projection(Pf);
-            if (pf(0) > 0 && pf(0) < cam->getWidth() && pf(1) > 0 && pf(1) < cam->getHeight() && Pf(2) > 0.0) {
+            Vector3d Pf = Rwf * pt->point3D + twf;
+            if (inFrustum(Pf)) {
+                Vector2d pf = cam->projection(Pf);
                 // add the point and its representative descriptor
+                memcpy(proj_desc.ptr(map_local_points.size()), pt->med_desc.data(), sizeof(StVO::Desc256));
                 map_local_points.push_back(pt);
                 pj_points.push_back(std::make_pair(pf(0) * curr_frame->inv_width, pf(1) * curr_frame->inv_height));
-                map_lpt_desc.push_back(pt->med_desc.row(0));
             }
         }
     }
+    const Mat map_lpt_desc = proj_desc.rowRange(0, map_local_points.size());
 
     // select unmatched points
     vector<PointFeature*> unmatched_points;
-    Mat unmatched_pt_desc;
-    for( int idx = 0; idx < curr_kf->stereo_frame->stereo_pt.size(); ++idx) {
-        PointFeature* pt = curr_kf->stereo_frame->stereo_pt[idx];
+    unmatched_points.reserve(curr_frame->stereo_pt.size());
+    reserveDescRows(unmatched_desc, curr_frame->stereo_pt.size(), curr_frame->pdesc_l);
+    for( int idx = 0; idx < curr_frame->stereo_pt.size(); ++idx) {
+        PointFeature* pt = curr_frame->stereo_pt[idx];
         if (pt != nullptr && pt->idx == -1) {
+            curr_frame->pdesc_l.row(idx).copyTo(unmatched_desc.row(unmatched_points.size()));
             unmatched_points.push_back(pt);
-            unmatched_pt_desc.push_back(curr_kf->stereo_frame->pdesc_l.row(idx));
         }
     }
+    const Mat unmatched_pt_desc = unmatched_desc.rowRange(0, unmatched_points.size());
 
     if (map_local_points.empty() || unmatched_points.empty())
         return 0;
@@ -742,11 +1010,13 @@ int MapHandler::matchMap2KFPoints() {
     // track points from local map (small window; if it fails, run standard matching)
     if (SlamConfig::fastMatching()) {
         //Fill in grid
-        GridStructure grid(GRID_ROWS, GRID_COLS);
+        static thread_local GridStructure grid(GRID_ROWS, GRID_COLS); // storage reused across KFs
+        grid.clear();
         for (int idx = 0; idx < unmatched_points.size(); ++idx) {
             PointFeature* point = unmatched_points[idx];
-            grid.at(point->pl(0) * curr_frame->inv_width, point->pl(1) * curr_frame->inv_height).push_back(idx);
+            grid.add(point->pl(0) * curr_frame->inv_width, point->pl(1) * curr_frame->inv_height, idx);
         }
+        grid.build();
 
         GridWindow w;
         int ws = SlamConfig::matchingF2FWs();
@@ -759,7 +1029,7 @@ int MapHandler::matchMap2KFPoints() {
     if (pj_points.size() > SlamConfig::minPointMatches() &&
             map_local_points.size() > SlamConfig::minPointMatches() &&
             matches < SlamConfig::minPointMatches()) {
-        matches = match(map_lpt_desc, unmatched_pt_desc, SlamConfig::minRatio12P(), matches_12);
+        matches = match(map_lpt_desc, unmatched_pt_desc, SlamConfig::minRatio12P(), matches_12, true);
 //        if (matches < SlamConfig::minPointMatches()) return 0;
     }
 
@@ -781,12 +1051,14 @@ int MapHandler::matchMap2KFPoints() {
             unmatched_points[i2]->idx = lm_idx;
             // add observation of the 3D LM from current KF
             dir_kf = curr_kf->T_kf_w.block(0,0,3,3) * dir_kf + curr_kf->T_kf_w.col(3).head(3);
+            lm_pager.pageIn( map_points[lm_idx] );
+            kf_redundancy.remove( map_points[lm_idx]->kf_obs_list );
             map_points[lm_idx]->addMapPointObservation( unmatched_pt_desc.row(i2), kf2_idx, unmatched_points[i2]->pl, dir_kf );
+            kf_redundancy.add( map_points[lm_idx]->kf_obs_list );
             // update full graph (previously observed feature)
             for (int obs : map_points[lm_idx]->kf_obs_list) {
                 if (obs != kf2_idx) {
-                    full_graph[kf2_idx][obs]++;
-                    full_graph[obs][kf2_idx]++;
+                    full_graph.increaseWeight( kf2_idx, obs );
                 }
             }
         }
@@ -801,42 +1073,50 @@ int MapHandler::matchMap2KFLines() {
     int kf2_idx = curr_kf->kf_idx;
     StVO::StereoFrame* curr_frame = curr_kf->stereo_frame;
 
-    // select local map
-    vector<MapLine*> map_local_lines;
-    std::vector<line_2d> pj_lines;
-    Mat map_lls_desc;
-
     if (!SlamConfig::hasLines() || curr_frame->stereo_ls.empty())
         return 0;
 
-    for (MapLine* ls : map_lines) {
+    const Matrix3d Rwf = Twf.block(0,0,3,3);
+    const Vector3d twf = Twf.col(3).head(3);
+
+    // select local map (only the local LMs, culled against the frustum)
+    vector<MapLine*> map_local_lines;
+    std::vector<line_2d> pj_lines;
+    map_local_lines.reserve(local_ls_idx.size());
+    pj_lines.reserve(local_ls_idx.size());
+    if (!local_ls_idx.empty())
+        reserveDescRows(proj_desc, local_ls_idx.size(), curr_frame->ldesc_l);
+    for (int lm_idx : local_ls_idx) {
+        MapLine* ls = map_lines[lm_idx];
         if (ls != nullptr && ls->local && ls->kf_obs_list.back() != kf2_idx) {
             // if the LM is projected inside the current image
-            Vector3d sPf = Twf.block(0,0,3,3) * ls->line3D.head(3) + Twf.col(3).head(3);
-            Vector2d spf = cam->projection( sPf );
-            Vector3d ePf = Twf.block(0,0,3,3) * ls->line3D.tail(3) + Twf.col(3).head(3);
-            Vector2d epf = cam->projection( ePf );
-            if (spf(0) > 0 && spf(0) < cam->getWidth() && spf(1) > 0 && spf(1) < cam->getHeight() && sPf(2) > 0.0 &&
-                    epf(0) > 0 && epf(0) < cam->getWidth() && epf(1) > 0 && epf(1) < cam->getHeight() && ePf(2) > 0.0) {
-                // add the point and its representative descriptor
+            Vector3d sPf = Rwf * ls->line3D.head(3) + twf;
+            Vector3d ePf = Rwf * ls->line3D.tail(3) + twf;
+            if (inFrustum(sPf) && inFrustum(ePf)) {
+                Vector2d spf = cam->projection( sPf );
+                Vector2d epf = cam->projection( ePf );
+                // add the line and its representative descriptor
+                memcpy(proj_desc.ptr(map_local_lines.size()), ls->med_desc.data(), sizeof(StVO::Desc256));
                 map_local_lines.push_back( ls );
                 pj_lines.push_back(std::make_pair(std::make_pair(spf(0) * curr_frame->inv_width, spf(1) * curr_frame->inv_height),
                                                   std::make_pair(epf(0) * curr_frame->inv_width, epf(1) * curr_frame->inv_height)));
-                map_lls_desc.push_back( ls->med_desc.row(0) );
             }
         }
     }
+    const Mat map_lls_desc = proj_desc.rowRange(0, map_local_lines.size());
 
     // select unmatched line segments
     vector<LineFeature*> unmatched_lines;
-    Mat unmatched_ls_desc;
+    unmatched_lines.reserve(curr_frame->stereo_ls.size());
+    reserveDescRows(unmatched_desc, curr_frame->stereo_ls.size(), curr_frame->ldesc_l);
     for( int idx = 0; idx < curr_frame->stereo_ls.size(); ++idx) {
         LineFeature *ls = curr_frame->stereo_ls[idx];
         if (ls != nullptr && ls->idx == -1) {
+            curr_frame->ldesc_l.row(idx).copyTo(unmatched_desc.row(unmatched_lines.size()));
             unmatched_lines.push_back( ls );
-            unmatched_ls_desc.push_back( curr_frame->ldesc_l.row(idx) );
         }
     }
+    const Mat unmatched_ls_desc = unmatched_desc.rowRange(0, unmatched_lines.size());
 
     if (map_local_lines.empty() || unmatched_lines.empty())
         return 0;
@@ -846,9 +1126,9 @@ int MapHandler::matchMap2KFLines() {
 
     // track lines from local map (small window; if it fails, run standard matching)
     if (SlamConfig::fastMatching()) {
-        //Fill in grid
-        list<point_2d> line_coords;
-        GridStructure grid(GRID_ROWS, GRID_COLS);
+        //Fill in row index
+        static thread_local LineRowIndex grid(GRID_ROWS, GRID_COLS); // storage reused across KFs
+        grid.clear();
         std::vector<std::pair<double, double>> directions(unmatched_lines.size());
         for (int idx = 0; idx < unmatched_lines.size(); ++idx) {
             LineFeature* line = unmatched_lines[idx];
@@ -857,11 +1137,10 @@ int MapHandler::matchMap2KFLines() {
             v = std::make_pair((line->epl(0) - line->spl(0)) * curr_frame->inv_width, (line->epl(1) - line->spl(1)) * curr_frame->inv_height);
             normalize(v);
 
-            getLineCoords(line->spl(0) * curr_frame->inv_width, line->spl(1) * curr_frame->inv_height,
-                          line->epl(0) * curr_frame->inv_width, line->epl(1) * curr_frame->inv_height, line_coords);
-            for (const point_2d &p : line_coords)
-                grid.at(p.first, p.second).push_back(idx);
+            grid.add(line->spl(0) * curr_frame->inv_width, line->spl(1) * curr_frame->inv_height,
+                     line->epl(0) * curr_frame->inv_width, line->epl(1) * curr_frame->inv_height, idx);
         }
+        grid.build();
 
         GridWindow w;
         int ws = SlamConfig::matchingF2FWs();
@@ -874,7 +1153,7 @@ int MapHandler::matchMap2KFLines() {
     if (pj_lines.size() > SlamConfig::minLineMatches() &&
             map_local_lines.size() > SlamConfig::minLineMatches() &&
             matches < SlamConfig::minLineMatches()) {
-        matches = match(map_lls_desc, unmatched_ls_desc, SlamConfig::minRatio12L(), matches_12);
+        matches = match(map_lls_desc, unmatched_ls_desc, SlamConfig::minRatio12L(), matches_12, true);
 //        if (matches < SlamConfig::minLineMatches()) return 0;
     }
 
@@ -901,16 +1180,17 @@ int MapHandler::matchMap2KFLines() {
             mP3d = mP3d.normalized();
             Vector4d pts;
             pts << unmatched_lines[i2]->spl, unmatched_lines[i2]->epl;
-            #ifdef USE_LINE_PLUKER
-            map_lines[lm_idx]->addMapLineObservation( unmatched_ls_desc.row(i2), kf2_idx, pts);
-            #else
-            map_lines[lm_idx]->addMapLineObservation( unmatched_ls_desc.row(i2), kf2_idx, unmatched_lines[i2]->le, mP3d, pts );
-            #endif
+            lm_pager.pageIn( map_lines[lm_idx] );
+            kf_redundancy.remove( map_lines[lm_idx]->kf_obs_list );
+            if( Config::plukerLines() )
+                map_lines[lm_idx]->addMapLineObservation( unmatched_ls_desc.row(i2), kf2_idx, pts);
+            else
+                map_lines[lm_idx]->addMapLineObservation( unmatched_ls_desc.row(i2), kf2_idx, unmatched_lines[i2]->le, mP3d, pts );
+            kf_redundancy.add( map_lines[lm_idx]->kf_obs_list );
             // update full graph (previously observed feature)
             for (int obs : map_lines[lm_idx]->kf_obs_list) {
                 if (obs != kf2_idx) {
-                    full_graph[kf2_idx][obs]++;
-                    full_graph[obs][kf2_idx]++;
+                    full_graph.increaseWeight( kf2_idx, obs );
                 }
             }
         }
@@ -991,216 +1271,675 @@ void MapHandler::lookForCommonMatches( KeyFrame* kf0, KeyFrame* &kf1 )
 
 void MapHandler::expandGraphs()
 {
-    int g_size = full_graph.size() + 1;
     // full graph
-    full_graph.resize( g_size );
-    for(unsigned int i = 0; i < g_size; i++ )
-        full_graph[i].resize( g_size );
-    // confusion matrix
-    conf_matrix.resize( g_size );
-    for(unsigned int i = 0; i < g_size; i++ )
-        conf_matrix[i].resize( g_size );
+    full_graph.addNode();
 }
 
-void MapHandler::formLocalMap()
+void MapHandler::covisibleKFs( int kf_idx, int min_weight, int n_recent, vector<int> &kf_list ) const
 {
-
-    // for the Single Thread version
-
-    // reset local KFs & LMs
-    for( vector<KeyFrame*>::iterator kf_it = map_keyframes.begin(); kf_it != map_keyframes.end(); kf_it++ )
+    // previous KFs sharing at least min_weight landmarks with kf_idx, plus the n_recent previous ones
+    kf_list.clear();
+    for( auto nb : full_graph.neighbors(kf_idx) )
     {
-        if( (*kf_it) != NULL )
-            (*kf_it)->local = false;
+        if( nb.first < kf_idx - n_recent && int(nb.second) >= min_weight && map_keyframes[nb.first] != NULL )
+            kf_list.push_back( nb.first );
     }
-    for( vector<MapPoint*>::iterator pt_it = map_points.begin(); pt_it != map_points.end(); pt_it++ )
+    for( int i = max(0, kf_idx - n_recent); i < kf_idx; i++ )
     {
-        if( (*pt_it) != NULL )
-            (*pt_it)->local = false;
+        if( map_keyframes[i] != NULL )
+            kf_list.push_back( i );
     }
-    for( vector<MapLine*>::iterator  ls_it = map_lines.begin(); ls_it != map_lines.end(); ls_it++ )
+    sort( kf_list.begin(), kf_list.end() );
+}
+
+void MapHandler::graphSuccessors( int kf_idx, int kf_last, int min_weight, vector<int> &kf_list ) const
+{
+    // following KFs (up to kf_last) sharing at least min_weight landmarks with kf_idx, plus the next one
+    kf_list.clear();
+    for( auto nb : full_graph.neighbors(kf_idx) )
     {
-        if( (*ls_it) != NULL )
-            (*ls_it)->local = false;
+        if( nb.first > kf_idx + 1 && nb.first <= kf_last && int(nb.second) >= min_weight )
+            kf_list.push_back( nb.first );
     }
+    if( kf_idx + 1 <= kf_last )
+        kf_list.push_back( kf_idx + 1 );
+    sort( kf_list.begin(), kf_list.end() );
+}
 
-    // set first KF and their associated LMs as local
-    map_keyframes.back()->local = true;
-    for( vector<PointFeature*>::iterator pt_it = map_keyframes.back()->stereo_frame->stereo_pt.begin(); pt_it != map_keyframes.back()->stereo_frame->stereo_pt.end(); pt_it++ )
+void MapHandler::formLocalMap()
+{
+    // for the Single Thread version
+    formLocalMap( map_keyframes.back() );
+}
+
+void MapHandler::formLocalMap( KeyFrame * kf )
+{
+
+    // KFs of the previous local map, compacted below if they leave it
+    vector<int> prev_local_kf_idx;
+    if( SlamConfig::compactKFs() || SlamConfig::submapMaxKFs() > 0 )
+        prev_local_kf_idx = local_kf_idx;
+
+    // reset only the members of the previous local map, not the whole map
+    for( int i_kf : local_kf_idx )
+    {
+        if( i_kf < map_keyframes.size() && map_keyframes[i_kf] != NULL )
+        {
+            map_keyframes[i_kf]->local = false;
+            live_kfs.touch( i_kf );
+        }
+    }
+    // (their LMs become culling candidates, the ones still local are skipped by the culling)
+    for( int i_pt : local_pt_idx )
     {
-        if( (*pt_it) != NULL )
+        if( i_pt < map_points.size() && map_points[i_pt] != NULL )
         {
-            int lm_idx = (*pt_it)->idx;
-            if( lm_idx != -1 && map_points[lm_idx] != NULL )
-                map_points[lm_idx]->local = true;
+            map_points[i_pt]->local = false;
+            live_pts.touch( i_pt );
+            queueCullCandidate( map_points[i_pt] );
         }
     }
-    for( vector<LineFeature*>::iterator ls_it = map_keyframes.back()->stereo_frame->stereo_ls.begin(); ls_it != map_keyframes.back()->stereo_frame->stereo_ls.end(); ls_it++ )
+    for( int i_ls : local_ls_idx )
     {
-        if( (*ls_it) != NULL )
+        if( i_ls < map_lines.size() && map_lines[i_ls] != NULL )
         {
-            int lm_idx = (*ls_it)->idx;
-            if( lm_idx != -1 && map_lines[lm_idx] != NULL )
-                map_lines[lm_idx]->local = true;
+            map_lines[i_ls]->local = false;
+            live_ls.touch( i_ls );
+            queueCullCandidate( map_lines[i_ls] );
         }
     }
+    local_kf_idx.clear();
+    local_pt_idx.clear();
+    local_ls_idx.clear();
+    local_epoch++;
+
+    // set first KF and their associated LMs as local
+    addLocalKF( kf );
 
     // loop over covisibility graph / full graph if we want to find more points
     int g_size = full_graph.size()-1;
-    for( int i = 0; i < g_size; i++ )
+    vector<int> local_kfs;
+    covisibleKFs( g_size, SlamConfig::minLMCovGraph(), SlamConfig::minKFLocalMap(), local_kfs );
+    // the KFs of the closed sub-maps stay out of the local map, as the reduced ones (no landmarks)
+    local_kfs.erase( remove_if( local_kfs.begin(), local_kfs.end(), [this](int i){ return submaps.frozen(i) || map_keyframes[i]->reduced; } ),
+                     local_kfs.end() );
+    int max_kfs = SlamConfig::lbaMaxKFs();
+    if( max_kfs > 0 && int(local_kfs.size()) > max_kfs - 1 )
     {
-        if( full_graph[g_size][i] >= SlamConfig::minLMCovGraph() || abs(g_size-i) <= SlamConfig::minKFLocalMap() )
-        {
-            map_keyframes[i]->local = true;
-            // loop over the landmarks seen by KF{i}
-            for( vector<PointFeature*>::iterator pt_it = map_keyframes[i]->stereo_frame->stereo_pt.begin(); pt_it != map_keyframes[i]->stereo_frame->stereo_pt.end(); pt_it++ )
-            {
-                int lm_idx = (*pt_it)->idx;
-                if( lm_idx != -1 && map_points[lm_idx] != NULL )
-                    map_points[lm_idx]->local = true;
-            }
-            for( vector<LineFeature*>::iterator ls_it = map_keyframes[i]->stereo_frame->stereo_ls.begin(); ls_it != map_keyframes[i]->stereo_frame->stereo_ls.end(); ls_it++ )
-            {
-                int lm_idx = (*ls_it)->idx;
-                if( lm_idx != -1 && map_lines[lm_idx] != NULL )
-                    map_lines[lm_idx]->local = true;
-            }
-        }
+        // keep the KFs sharing more landmarks with the current one (the most recent on ties)
+        vector<pair<int,int>> ranked;
+        for( int i : local_kfs )
+            ranked.push_back( make_pair( int(full_graph.weight(g_size,i)), i ) );
+        sort( ranked.begin(), ranked.end(), [](const pair<int,int> &a, const pair<int,int> &b)
+                                            { return a.first > b.first || (a.first == b.first && a.second > b.second); } );
+        local_kfs.clear();
+        for( int k = 0; k < max(0, max_kfs - 1); k++ )
+            local_kfs.push_back( ranked[k].second );
+    }
+    for( int i : local_kfs )
+        addLocalKF( map_keyframes[i] );
+
+    // keep the map ordering expected by the bundle adjustment
+    sort( local_kf_idx.begin(), local_kf_idx.end() );
+    sort( local_pt_idx.begin(), local_pt_idx.end() );
+    sort( local_ls_idx.begin(), local_ls_idx.end() );
+
+    // descriptors of the landmarks around the KF in memory, the far ones in the page file
+    lm_pager.update( kf->T_kf_w.block<3,1>(0,3), map_points, map_lines, map_keyframes );
+
+    // release the images of the KFs that left the local map (always for the frozen ones)
+    for( int i_kf : prev_local_kf_idx )
+    {
+        if( i_kf < map_keyframes.size() && map_keyframes[i_kf] != NULL && map_keyframes[i_kf]->local_epoch != local_epoch &&
+            ( SlamConfig::compactKFs() || submaps.frozen(i_kf) ) )
+            map_keyframes[i_kf]->makeCompact( SlamConfig::kfThumbnailScale() );
     }
 
 }
 
-void MapHandler::formLocalMap( KeyFrame * kf )
+void MapHandler::assignSubmap( KeyFrame* kf )
 {
+    int max_kfs = SlamConfig::submapMaxKFs();
+    if( max_kfs > 0 && submaps.size( submaps.active() ) >= max_kfs )
+        closeSubmap();
+    submaps.addKF( kf->kf_idx );
+}
 
-    // reset local KFs & LMs
-    for( vector<KeyFrame*>::iterator kf_it = map_keyframes.begin(); kf_it != map_keyframes.end(); kf_it++ )
-    {
-        if( (*kf_it) != NULL )
-            (*kf_it)->local = false;
-    }
-    for( vector<MapPoint*>::iterator pt_it = map_points.begin(); pt_it != map_points.end(); pt_it++ )
+void MapHandler::closeSubmap()
+{
+    // KFs of the closed sub-map: the ones out of the local map are compacted now, the rest when they
+    // leave it (formLocalMap); they are only used by the place recognition and as fixed anchors
+    int s = submaps.active();
+    for( int i_kf = max( 0, submaps.firstKF(s) ); i_kf < map_keyframes.size(); i_kf++ )
     {
-        if( (*pt_it) != NULL )
-            (*pt_it)->local = false;
+        KeyFrame* kf = map_keyframes[i_kf];
+        if( kf != NULL && !kf->local && !kf->compact )
+            kf->makeCompact( SlamConfig::kfThumbnailScale() );
     }
-    for( vector<MapLine*>::iterator  ls_it = map_lines.begin(); ls_it != map_lines.end(); ls_it++ )
+    submaps.close();
+    LOG_INFO( "[MapHandler] sub-map " << s << " closed" );
+}
+
+void MapHandler::addLocalKF( KeyFrame * kf )
+{
+
+    if( kf->local_epoch != local_epoch )
     {
-        if( (*ls_it) != NULL )
-            (*ls_it)->local = false;
+        kf->local_epoch = local_epoch;
+        kf->local = true;
+        local_kf_idx.push_back( kf->kf_idx );
+        live_kfs.touch( kf->kf_idx );
     }
 
-    // set first KF and their associated LMs as local
-    kf->local = true;
+    // loop over the landmarks seen by the KF
     for( vector<PointFeature*>::iterator pt_it = kf->stereo_frame->stereo_pt.begin(); pt_it != kf->stereo_frame->stereo_pt.end(); pt_it++ )
     {
-        if( (*pt_it) != NULL )
+        if( (*pt_it) == NULL )
+            continue;
+        int lm_idx = (*pt_it)->idx;
+        if( lm_idx != -1 && map_points[lm_idx] != NULL && map_points[lm_idx]->local_epoch != local_epoch )
         {
-            int lm_idx = (*pt_it)->idx;
-            if( lm_idx != -1 && map_points[lm_idx] != NULL )
-                map_points[lm_idx]->local = true;
+            map_points[lm_idx]->local_epoch = local_epoch;
+            map_points[lm_idx]->local = true;
+            local_pt_idx.push_back( lm_idx );
+            live_pts.touch( lm_idx );
+            lm_pager.pageIn( map_points[lm_idx] );
         }
     }
     for( vector<LineFeature*>::iterator ls_it = kf->stereo_frame->stereo_ls.begin(); ls_it != kf->stereo_frame->stereo_ls.end(); ls_it++ )
     {
-        if( (*ls_it) != NULL )
-        {
-            int lm_idx = (*ls_it)->idx;
-            if( lm_idx != -1 && map_lines[lm_idx] != NULL )
-                map_lines[lm_idx]->local = true;
-        }
-    }
-
-    // loop over covisibility graph / full graph if we want to find more points
-    int g_size = full_graph.size()-1;
-    for( int i = 0; i < g_size; i++ )
-    {
-        if( full_graph[g_size][i] >= SlamConfig::minLMCovGraph() || abs(g_size-i) <= SlamConfig::minKFLocalMap() )
+        if( (*ls_it) == NULL )
+            continue;
+        int lm_idx = (*ls_it)->idx;
+        if( lm_idx != -1 && map_lines[lm_idx] != NULL && map_lines[lm_idx]->local_epoch != local_epoch )
         {
-            map_keyframes[i]->local = true;
-            // loop over the landmarks seen by KF{i}
-            for( vector<PointFeature*>::iterator pt_it = map_keyframes[i]->stereo_frame->stereo_pt.begin(); pt_it != map_keyframes[i]->stereo_frame->stereo_pt.end(); pt_it++ )
-            {
-                int lm_idx = (*pt_it)->idx;
-                if( lm_idx != -1 && map_points[lm_idx] != NULL )
-                    map_points[lm_idx]->local = true;
-            }
-            for( vector<LineFeature*>::iterator ls_it = map_keyframes[i]->stereo_frame->stereo_ls.begin(); ls_it != map_keyframes[i]->stereo_frame->stereo_ls.end(); ls_it++ )
-            {
-                int lm_idx = (*ls_it)->idx;
-                if( lm_idx != -1 && map_lines[lm_idx] != NULL )
-                    map_lines[lm_idx]->local = true;
-            }
+            map_lines[lm_idx]->local_epoch = local_epoch;
+            map_lines[lm_idx]->local = true;
+            local_ls_idx.push_back( lm_idx );
+            live_ls.touch( lm_idx );
+            lm_pager.pageIn( map_lines[lm_idx] );
         }
     }
 
 }
 
-// -----------------------------------------------------------------------------------------------------------------------------
-// Parallelization functions
-// -----------------------------------------------------------------------------------------------------------------------------
-
-void MapHandler::addKeyFrame_multiThread(KeyFrame *curr_kf , KeyFrame *prev_kf) {
+void MapHandler::selectLBAWindow( vector<int> &pt_idx, vector<int> &ls_idx, vector<bool> &obs_kf ) const
+{
 
-    if (!threads_started) return;
+    auto by_obs = [](const pair<int,int> &a, const pair<int,int> &b){ return a.first > b.first; };
 
+    // local landmarks, capped at lba_max_lms (the most observed ones are the best constrained)
+    vector<pair<int,int>> pts, lss;
+    for( int i_pt : local_pt_idx )
     {
-        std::lock_guard<std::mutex> lk(kf_queue_mutex);
-        kf_queue.push_back(std::make_pair(curr_kf,prev_kf));
+        if( map_points[i_pt] != NULL && map_points[i_pt]->local )
+            pts.push_back( make_pair( int(map_points[i_pt]->obs_list.size()), i_pt ) );
     }
-    new_kf.notify_one();
-}
-
+    for( int i_ls : local_ls_idx )
+    {
+        if( map_lines[i_ls] != NULL && map_lines[i_ls]->local )
+            lss.push_back( make_pair( int(map_lines[i_ls]->obs_list.size()), i_ls ) );
+    }
+    int max_lms = SlamConfig::lbaMaxLMs();
+    if( max_lms > 0 && int(pts.size() + lss.size()) > max_lms )
+    {
+        // the budget is split between points and lines in proportion to their number
+        int max_pts = int( double(max_lms) * pts.size() / double(pts.size() + lss.size()) );
+        int max_lss = max_lms - max_pts;
+        if( int(pts.size()) > max_pts )
+        {
+            nth_element( pts.begin(), pts.begin() + max_pts, pts.end(), by_obs );
+            pts.resize( max_pts );
+        }
+        if( int(lss.size()) > max_lss )
+        {
+            nth_element( lss.begin(), lss.begin() + max_lss, lss.end(), by_obs );
+            lss.resize( max_lss );
+        }
+    }
+    pt_idx.clear();
+    ls_idx.clear();
+    for( auto &pt : pts )
+        pt_idx.push_back( pt.second );
+    for( auto &ls : lss )
+        ls_idx.push_back( ls.second );
+    // keep the map ordering expected by the bundle adjustment
+    sort( pt_idx.begin(), pt_idx.end() );
+    sort( ls_idx.begin(), ls_idx.end() );
+
+    // KFs contributing observations: the window and the (fixed) observers outside it, capped at
+    // lba_max_fixed_kfs (the ones observing more of the optimized landmarks are kept)
+    obs_kf.assign( map_keyframes.size(), false );
+    for( int i_kf : local_kf_idx )
+        obs_kf[i_kf] = true;
+    vector<int> n_obs( map_keyframes.size(), 0 );
+    for( int i_pt : pt_idx )
+    {
+        for( int i_kf : map_points[i_pt]->kf_obs_list )
+            if( !obs_kf[i_kf] ) n_obs[i_kf]++;
+    }
+    for( int i_ls : ls_idx )
+    {
+        for( int i_kf : map_lines[i_ls]->kf_obs_list )
+            if( !obs_kf[i_kf] ) n_obs[i_kf]++;
+    }
+    vector<pair<int,int>> fixed_kfs;
+    for( int i = 0; i < n_obs.size(); i++ )
+    {
+        if( n_obs[i] > 0 && map_keyframes[i] != NULL )
+            fixed_kfs.push_back( make_pair( n_obs[i], i ) );
+    }
+    int max_fixed = SlamConfig::lbaMaxFixedKFs();
+    if( max_fixed > 0 && int(fixed_kfs.size()) > max_fixed )
+    {
+        nth_element( fixed_kfs.begin(), fixed_kfs.begin() + max_fixed, fixed_kfs.end(), by_obs );
+        fixed_kfs.resize( max_fixed );
+    }
+    for( auto &kf : fixed_kfs )
+        obs_kf[kf.second] = true;
+
+}
+
+void MapHandler::addPriorKFs( const vector<bool> &obs_kf, const vector<int> &pt_idx, vector<int> &kf_list, vector<double> &X_aux )
+{
+    if( !SlamConfig::lbaMarginalize() )
+        return;
+    vector<bool> window_pt( map_points.size(), false );
+    for( int i_pt : pt_idx )
+        if( map_points[i_pt] != NULL && map_points[i_pt]->local )
+            window_pt[i_pt] = true;
+    for( int i = 1; i < obs_kf.size(); i++ )
+    {
+        KeyFrame* kf = map_keyframes[i];
+        if( obs_kf[i] && kf != NULL && !kf->local && kf->has_prior && !submaps.frozen(i) )
+        {
+            // the dropped observations are linearized at the current estimate
+            kf->x_prior_kf_w     = logmap_se3( kf->T_kf_w );
+            kf->xinfo_prior_kf_w = droppedPointsInformation( kf, window_pt );
+            Vector6d pose_aux = kf->x_prior_kf_w;
+            for(int j = 0; j < 6; j++)
+                X_aux.push_back( pose_aux(j) );
+            kf_list.push_back( kf->kf_idx );
+        }
+    }
+}
+
+Matrix6d MapHandler::droppedPointsInformation( const KeyFrame* kf, const vector<bool> &window_pt ) const
+{
+    // each point out of the window is marginalized (Schur complement) with its other observers fixed, the
+    // Jacobians are the ones of the point observations of the LBA (the line observations are left out)
+    Matrix6d info = Matrix6d::Zero();
+    for( const PointFeature* st_pt : kf->stereo_frame->stereo_pt )
+    {
+        if( st_pt == NULL || st_pt->idx == -1 || st_pt->idx >= int(window_pt.size()) || window_pt[st_pt->idx] )
+            continue;
+        const MapPoint* pt = map_points[st_pt->idx];
+        if( pt == NULL || !pt->inlier )
+            continue;
+        Matrix6d Hpp = Matrix6d::Zero();
+        Matrix<double,6,3> Hpl = Matrix<double,6,3>::Zero();
+        Matrix3d Hll = Matrix3d::Zero();
+        for( int i = 0; i < pt->obs_list.size(); i++ )
+        {
+            const KeyFrame* kf_obs = map_keyframes[ pt->kf_obs_list[i] ];
+            if( kf_obs == NULL )
+                continue;
+            Matrix4d Tiw   = inverse_se3( kf_obs->T_kf_w );
+            Vector3d Xwi   = Tiw.block(0,0,3,3) * pt->point3D + Tiw.block(0,3,3,1);
+            Vector2d p_err = pt->obs_list[i] - cam->projection( Xwi );
+            double p_err_norm = p_err.norm();
+            double gx   = Xwi(0);
+            double gy   = Xwi(1);
+            double gz   = Xwi(2);
+            double gz2  = 1.0 / std::max(SlamConfig::homogTh(),gz*gz);
+            double fxdx = cam->getFx() * p_err(0);
+            double fydy = cam->getFy() * p_err(1);
+            double w    = robustWeightCauchy(p_err_norm) / pow( std::max(SlamConfig::homogTh(),p_err_norm), 2 );
+            Vector3d Jij_Xwj;
+            Jij_Xwj << + gz2 * fxdx * gz,
+                       + gz2 * fydy * gz,
+                       - gz2 * ( fxdx*gx + fydy*gy );
+            Hll += Tiw.block(0,0,3,3).transpose() * Jij_Xwj * Jij_Xwj.transpose() * Tiw.block(0,0,3,3) * w;
+            if( kf_obs != kf )
+                continue;
+            Vector6d Jij_Tiw;
+            Jij_Tiw << + gz2 * fxdx * gz,
+                       + gz2 * fydy * gz,
+                       - gz2 * ( fxdx*gx + fydy*gy ),
+                       - gz2 * ( fxdx*gx*gy + fydy*gy*gy + fydy*gz*gz ),
+                       + gz2 * ( fxdx*gx*gx + fxdx*gz*gz + fydy*gx*gy ),
+                       + gz2 * ( fydy*gx*gz - fxdx*gy*gz );
+            Hpp += Jij_Tiw * Jij_Tiw.transpose() * w;
+            Hpl += Jij_Tiw * Jij_Xwj.transpose() * Tiw.block(0,0,3,3) * w;
+        }
+        // each observation constrains one direction, the point needs three independent ones
+        SelfAdjointEigenSolver<Matrix3d> eig( Hll );
+        if( eig.eigenvalues()(0) <= 1e-9 * eig.eigenvalues()(2) )
+            continue;
+        info += Hpp - Hpl * eig.eigenvectors() * eig.eigenvalues().cwiseInverse().asDiagonal() * eig.eigenvectors().transpose() * Hpl.transpose();
+    }
+    return info;
+}
+
+double MapHandler::addKFPriors( const vector<int> &kf_list, const VectorXd &X, SchurSolver &solver, VectorXd &g ) const
+{
+    // e = x - x_prior, the pose update x <- x (-) DX gives H += Info and g += Info * e
+    double err = 0.0;
+    for( int i = 0; i < kf_list.size(); i++ )
+    {
+        const KeyFrame* kf = map_keyframes[ kf_list[i] ];
+        if( kf->local || !kf->has_prior )
+            continue;
+        const Matrix6d &info = kf->xinfo_prior_kf_w;
+        if( !info.allFinite() )
+            continue;
+        Vector6d e = X.segment<6>(6*i) - kf->x_prior_kf_w;
+        solver.addPose( i, info );
+        g.segment<6>(6*i) += info * e;
+        err += e.dot( info * e );
+    }
+    return err;
+}
+
+void MapHandler::updateKFPriors( const vector<int> &kf_list, const SchurSolver &solver )
+{
+    // the window KFs take a prior once out of it (built by the next LBAs they observe)
+    for( int i = 0; SlamConfig::lbaMarginalize() && i < kf_list.size(); i++ )
+    {
+        KeyFrame* kf = map_keyframes[ kf_list[i] ];
+        if( kf->local )
+            kf->has_prior = true;
+    }
+
+    const bool constraints = SlamConfig::pgRetentionKFs() > 0;
+    MatrixXd cov;
+    if( !constraints || !solver.poseCovariances( cov ) )
+        return;
+
+    // relative poses of the window KFs linked in the essential graph: with the perturbations
+    // T * exp(-d) of the LBA, T_ab moves by exp(-e) with e = d_b - Ad(T_ba) * d_a
+    const int min_weight = min( SlamConfig::minLMEssGraph(), SlamConfig::minLMCovGraph() );
+    for( int i = 0; constraints && i < kf_list.size(); i++ )
+    {
+        for( int k = 0; k < kf_list.size(); k++ )
+        {
+            int a = kf_list[i], b = kf_list[k];
+            const KeyFrame *kf_a = map_keyframes[a], *kf_b = map_keyframes[b];
+            if( a >= b || !kf_a->local || !kf_b->local ||
+                ( b != a + 1 && int(full_graph.weight(a,b)) < min_weight ) )
+                continue;
+            Matrix6d A    = adjoint_se3( inverse_se3( kf_b->T_kf_w ) * kf_a->T_kf_w );
+            Matrix6d C_ab = cov.block<6,6>( 6*i, 6*k );
+            Matrix6d S    = cov.block<6,6>( 6*k, 6*k ) + A * cov.block<6,6>( 6*i, 6*i ) * A.transpose()
+                          - A * C_ab - C_ab.transpose() * A.transpose();
+            Eigen::LDLT<Matrix6d> ldlt( 0.5 * ( S + S.transpose() ) );
+            if( ldlt.info() != Eigen::Success || !ldlt.isPositive() )
+                continue;
+            Matrix6d info = ldlt.solve( Matrix6d::Identity() );
+            if( info.allFinite() )
+                kf_pose_info[ make_pair(a,b) ] = info;
+        }
+    }
+}
+
+Matrix6d MapHandler::poseConstraintInformation( int i, int j ) const
+{
+    auto it = kf_pose_info.find( make_pair( min(i,j), max(i,j) ) );
+    if( it == kf_pose_info.end() )
+        return Matrix6d::Identity();
+    // from the (t, w) ordering of the marginals to the (t, q) error of g2o::EdgeSE3 (q ~ w/2), scaled
+    // to the trace of the identity weights of the other constraints: the loop constraints have no
+    // covariance, so only the shape is kept (documented with pg_retention_kfs)
+    Matrix6d D = Matrix6d::Identity();
+    D.bottomRightCorner<3,3>() *= 2.0;
+    Matrix6d info = D * it->second * D;
+    double tr = info.trace();
+    if( !( tr > 0.0 ) || !info.allFinite() )
+        return Matrix6d::Identity();
+    return info * ( 6.0 / tr );
+}
+
+void MapHandler::erasePoseInformation( int kf_idx )
+{
+    // the constraints of a KF are with its neighbors in the full graph, or the next and previous KFs
+    vector<int> others( 1, kf_idx - 1 );
+    others.push_back( kf_idx + 1 );
+    for( auto nb : full_graph.neighbors(kf_idx) )
+        others.push_back( nb.first );
+    for( int j : others )
+        kf_pose_info.erase( make_pair( min(kf_idx,j), max(kf_idx,j) ) );
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------
+// Parallelization functions
+// -----------------------------------------------------------------------------------------------------------------------------
+
+void MapHandler::addKeyFrame_multiThread(KeyFrame *curr_kf , KeyFrame *prev_kf) {
+
+    // under kf_producer_mutex, from addKeyFrame (which rejects the KFs once the threads are finished)
+    // never block the VO thread: KFs that do not fit are kept in order and flushed on the next call
+    if (Profiler::instance().enabled())
+        curr_kf->t_queued = Profiler::instance().now();
+    kf_backlog.push_back(std::make_pair(curr_kf,prev_kf));
+    flushKFBacklog();
+    if (!kf_backlog.empty())
+        kf_deferred++;
+    new_kf.notify_one();
+}
+
+void MapHandler::flushKFBacklog() {
+
+    while (!kf_backlog.empty() && kf_queue.tryPush(kf_backlog.front()))
+        kf_backlog.pop_front();
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------
+// Multi-rig functions
+// -----------------------------------------------------------------------------------------------------------------------------
+
+int MapHandler::addRig( const PinholeStereoCamera* rig_cam, const Matrix4d &T_rig0_rig )
+{
+    // the map projects every KF with cam
+    const double tol = 1e-6;
+    if( fabs(rig_cam->getFx() - cam->getFx()) > tol || fabs(rig_cam->getFy() - cam->getFy()) > tol ||
+        fabs(rig_cam->getCx() - cam->getCx()) > tol || fabs(rig_cam->getCy() - cam->getCy()) > tol ||
+        fabs(rig_cam->getB()  - cam->getB())  > tol ||
+        rig_cam->getWidth() != cam->getWidth() || rig_cam->getHeight() != cam->getHeight() )
+        throw std::runtime_error("[MapHandler] the rigs must share the (rectified) intrinsics of the map camera");
+
+    std::lock_guard<ProfiledMutex> producer_lk(kf_producer_mutex);
+    std::lock_guard<SharedMutex> map_lk(map_mutex);
+    rig_extrinsics.push_back( T_rig0_rig );
+    rig_last_kf.push_back( NULL );
+    rig_kf_count.push_back( 0 );
+    vo_last_kf.push_back( NULL );
+    {
+        std::lock_guard<ProfiledMutex> lk(snapshot_mutex);
+        local_map_snapshot.resize( rig_extrinsics.size() );
+    }
+    return int(rig_extrinsics.size()) - 1;
+}
+
+void MapHandler::setInitialized( bool value )
+{
+    {
+        std::lock_guard<ProfiledMutex> lk(init_mutex);
+        initialized = value;
+    }
+    init_cv.notify_all();
+}
+
+bool MapHandler::waitInitialized( const std::atomic<bool> &cancel )
+{
+    std::unique_lock<ProfiledMutex> lk(init_mutex);
+    ProfiledMutex::WaitLock wait_lk(init_mutex);
+    init_cv.wait(wait_lk, [&]{ return initialized || cancel; });
+    return initialized;
+}
+
+void MapHandler::wakeInitWaiters()
+{
+    // under the lock, so a waiter can not miss it between its check of cancel and its sleep
+    std::lock_guard<ProfiledMutex> lk(init_mutex);
+    init_cv.notify_all();
+}
+
+void MapHandler::attachFrontEnd()
+{
+    std::lock_guard<ProfiledMutex> producer_lk(kf_producer_mutex);
+    front_ends++;
+}
+
+void MapHandler::detachFrontEnd()
+{
+    bool last;
+    {
+        std::lock_guard<ProfiledMutex> producer_lk(kf_producer_mutex);
+        last = ( --front_ends == 0 );
+    }
+    // killThreads takes kf_producer_mutex
+    if( last )
+        finishSLAM();
+}
+
+KeyFrame* MapHandler::placeRigKeyFrame( KeyFrame* kf )
+{
+    KeyFrame* prev = rig_last_kf[kf->rig];
+    Matrix4d T_curr_w;
+    if( prev != NULL )
+        T_curr_w = prev->T_kf_w * kf->T_kf_w;
+    else
+    {
+        // the rigs start on the same frame as rig 0, whose first KF is the world origin; the first KF
+        // of the rig is matched with the last one of rig 0
+        T_curr_w = rig_extrinsics[kf->rig] * kf->T_kf_w;
+        prev = rig_last_kf[0];
+    }
+    kf->x_kf_w = logmap_se3(T_curr_w);
+    kf->T_kf_w = expmap_se3(kf->x_kf_w);
+    kf->rig_kf = rig_kf_count[kf->rig]++;
+    rig_last_kf[kf->rig] = kf;
+    return prev;
+}
+
+bool MapHandler::isRigLastKF( int kf_idx ) const
+{
+    for( const KeyFrame* kf : rig_last_kf )
+        if( kf != NULL && kf->kf_idx == kf_idx )
+            return true;
+    return false;
+}
+
 void MapHandler::handlerThread() {
 
     if (!threads_started) return;
+    Config::Scope scope(config);
+    setupThread(THREAD_KF_HANDLER);
 
+    bool stopping = false;
     while (true) {
 
-        std::unique_lock<std::mutex> lk(kf_queue_mutex);
-        if (kf_queue.empty())
-            new_kf.wait(lk, [this]{return !kf_queue.empty();});
-
-        curr_kf_mt = kf_queue.front().first;
-        prev_kf_mt = kf_queue.front().second;
-        kf_queue.pop_front();
+        // the KFs waiting in the queue are inserted together (up to kf_batch_max) after the
+        // corrections of any finished loop closure, the local mapping then matches each of them
+        // but forms a single local map and runs a single LBA (their BoW vectors are encoded on the
+        // task pool since addKeyFrame, the local mapping and the loop closure threads wait for them)
+        kf_batch_mt.clear();
+        while( !stopping )
+        {
+            pair<KeyFrame*,KeyFrame*> kf_pair;
+            if( kf_batch_mt.empty() )
+            {
+                // the producer notifies without locking, so a missed wake-up only costs one timeout
+                PROFILE_SCOPE("MapHandler::wait.newKF");
+                while (!kf_queue.tryPop(kf_pair)) {
+                    // the polling wait takes no samples of the lock
+                    std::unique_lock<ProfiledMutex> lk(kf_queue_mutex);
+                    ProfiledMutex::WaitLock wait_lk(kf_queue_mutex);
+                    new_kf.wait_for(wait_lk, std::chrono::milliseconds(1), [this]{return !kf_queue.empty();});
+                }
+            }
+            else if( int(kf_batch_mt.size()) >= SlamConfig::kfBatchMax() || !kf_queue.tryPop(kf_pair) )
+                break;
 
-        lk.unlock();
+            // the previous KF of the VO is NULL for the first KF of a rig > 0
+            if( kf_pair.first == nullptr )
+            {
+                stopping = true;
+                break;
+            }
+            std::lock_guard<SharedMutex> map_lk(map_mutex);
+            KeyFrame* prev = insertKeyFrame( kf_pair.first );
+            kf_batch_mt.push_back( make_pair( prev, kf_pair.first ) );
+        }
+        if( !kf_batch_mt.empty() )
+            Profiler::instance().setGauge( "MapHandler::kfBatchSize", kf_batch_mt.size() );
 
         // notify threads
         {
-            std::lock_guard<std::mutex> lk(lba_mutex);
+            std::lock_guard<ProfiledMutex> lk(lba_mutex);
             lba_thread_status = LBA_ACTIVE;
         }
         lba_start.notify_one();
 
-//        {
-//            std::lock_guard<std::mutex> lk(lc_mutex);
-//            lc_thread_status = LC_ACTIVE;
-//        }
-//        lc_start.notify_one();
-
-        if( curr_kf_mt == nullptr || prev_kf_mt == nullptr ) return;
+        if( kf_batch_mt.empty() ) {
+            // stop the loop closure thread once it has processed the pending KFs
+            {
+                std::lock_guard<ProfiledMutex> lk(lc_mutex);
+                lc_queue.push_back(nullptr);
+            }
+            lc_start.notify_one();
+            return;
+        }
 
-        // join localMapping and loopClosure threads
-        std::unique_lock<std::mutex> lba_lk(lba_mutex);
+        // join localMapping thread
+        std::unique_lock<ProfiledMutex> lba_lk(lba_mutex);
         if( lba_thread_status != LBA_IDLE )
-            lba_join.wait(lba_lk, [this]{return (lba_thread_status == LBA_IDLE);});
+        {
+            PROFILE_SCOPE("MapHandler::wait.lbaJoin");
+            ProfiledMutex::WaitLock wait_lk(lba_mutex);
+            lba_join.wait(wait_lk, [this]{return (lba_thread_status == LBA_IDLE);});
+        }
+        lba_lk.unlock();
 
-//        std::unique_lock<std::mutex> lc_lk(lc_mutex);
-//        if ( lc_thread_status != LC_IDLE )
-//            lc_join.wait(lc_lk, [this]{return (lc_thread_status == LC_IDLE);});
+        // loop detection and correction run asynchronously on the LC thread
+        {
+            std::lock_guard<ProfiledMutex> lk(lc_mutex);
+            for( auto &kfs : kf_batch_mt )
+                lc_queue.push_back(kfs.second);
+        }
+        lc_start.notify_one();
+    }
 
-        // loop closure
-//        if( lc_state == LC_READY )
-//        {
-//            loopClosureOptimizationCovGraphG2O();
-//            lc_state = LC_IDLE;
-//        }
 
-    }
+}
 
+KeyFrame* MapHandler::insertKeyFrame(KeyFrame *curr_kf) {
 
+    // expand graphs
+    expandGraphs();
+    // select previous keyframe (of the same rig) and update the pose of the current one wrt it
+    // (in case of LC)
+    max_kf_idx++;
+    curr_kf->kf_idx = max_kf_idx;
+    curr_kf->local  = true;
+    KeyFrame* prev_kf = placeRigKeyFrame( curr_kf );
+    // Estimates Twf
+    Twf = expmap_se3(logmap_se3(  inverse_se3( curr_kf->T_kf_w ) ));
+    // estimates pose increment
+    DT = expmap_se3(logmap_se3( Twf * prev_kf->T_kf_w ));
+    // reset indices
+    for (PointFeature* pt : curr_kf->stereo_frame->stereo_pt)
+        pt->idx = -1;
+    for (LineFeature* ls : curr_kf->stereo_frame->stereo_ls)
+        ls->idx = -1;
+    // insert keyframe and add to map of indexes
+    vector<int> aux_vec;
+    map_keyframes.push_back( curr_kf );
+    live_kfs.insert( curr_kf->kf_idx );
+    assignSubmap( curr_kf );
+    map_points_kf_idx.insert( std::make_pair(curr_kf->kf_idx, aux_vec) );
+    map_lines_kf_idx.insert(  std::make_pair(curr_kf->kf_idx, aux_vec) );
+    return prev_kf;
 }
 
 void MapHandler::startThreads() {
@@ -1208,22 +1947,27 @@ void MapHandler::startThreads() {
     if (threads_started) return;
     threads_started = true;
 
+    kf_queue.reset(SlamConfig::kfQueueSize());
+    kf_backlog.clear();
+    kf_deferred = 0;
+
     std::thread handler(&MapHandler::handlerThread, this);
     handler.detach();
 
     {
-        std::lock_guard<std::mutex> lk(lba_mutex);
+        std::lock_guard<ProfiledMutex> lk(lba_mutex);
         lba_thread_status = LBA_IDLE;
     }
     std::thread localMapping(&MapHandler::localMappingThread, this);
     localMapping.detach();
 
-//    {
-//        std::lock_guard<std::mutex> lk(lc_mutex);
-//        lc_thread_status = LC_IDLE;
-//    }
-//    std::thread loopClosure(&MapHandler::loopClosureThread, this);
-//    loopClosure.detach();
+    {
+        std::lock_guard<ProfiledMutex> lk(lc_mutex);
+        lc_thread_status = LC_IDLE;
+        lc_queue.clear();
+    }
+    std::thread loopClosure(&MapHandler::loopClosureThread, this);
+    loopClosure.detach();
 }
 
 void MapHandler::killThreads() {
@@ -1231,58 +1975,107 @@ void MapHandler::killThreads() {
     if (!threads_started) return;
     threads_started = false;
 
-    {
-        std::lock_guard<std::mutex> lk(kf_queue_mutex);
-        kf_queue.push_back(std::make_pair(nullptr,nullptr));
+    // enqueue the stop signal after the deferred KFs (the front-ends of the other rigs are done)
+    std::lock_guard<ProfiledMutex> producer_lk(kf_producer_mutex);
+    kf_backlog.push_back(std::make_pair(nullptr,nullptr));
+    while (!kf_backlog.empty()) {
+        flushKFBacklog();
+        new_kf.notify_one();
+        if (!kf_backlog.empty())
+            std::this_thread::yield();
     }
-    new_kf.notify_one();
 
-    print_msg("[Waiting for threads to finish...");
+    LOG_INFO( "[Waiting for threads to finish..." );
 
-    std::unique_lock<std::mutex> lba_lk(lba_mutex);
+    std::unique_lock<ProfiledMutex> lba_lk(lba_mutex);
+    ProfiledMutex::WaitLock lba_wait_lk(lba_mutex);
     if (lba_thread_status != LBA_TERMINATED)
-        lba_join.wait(lba_lk, [this]{return (lba_thread_status == LBA_TERMINATED);});
+        lba_join.wait(lba_wait_lk, [this]{return (lba_thread_status == LBA_TERMINATED);});
+
+    LOG_INFO( "[KF queue] capacity: " << kf_queue.capacity() <<
+              "\tmax depth: " << kf_queue.maxDepth() <<
+              "\tdeferred: " << kf_deferred <<
+              "\tfull pushes: " << kf_queue.rejected() );
 
-//    std::unique_lock<std::mutex> lc_lk(lc_mutex);
-//    if (lc_thread_status != LC_TERMINATED)
-//        lc_join.wait(lc_lk, [this]{return (lc_thread_status == LC_TERMINATED);});
+    std::unique_lock<ProfiledMutex> lc_lk(lc_mutex);
+    ProfiledMutex::WaitLock lc_wait_lk(lc_mutex);
+    if (lc_thread_status != LC_TERMINATED)
+        lc_join.wait(lc_wait_lk, [this]{return (lc_thread_status == LC_TERMINATED);});
 }
 
 void MapHandler::localMappingThread() {
 
     if (!threads_started) return;
+    Config::Scope scope(config);
+    setupThread(THREAD_LOCAL_MAPPING);
 
-    std::unique_lock<std::mutex> lk(lba_mutex, std::defer_lock);
+    std::unique_lock<ProfiledMutex> lk(lba_mutex, std::defer_lock);
     while (true) {
 
         lk.lock();
-        if (lba_thread_status != LBA_ACTIVE)
-            lba_start.wait(lk, [this]{return (lba_thread_status == LBA_ACTIVE);});
+        if (lba_thread_status != LBA_ACTIVE) {
+            PROFILE_SCOPE("MapHandler::wait.lbaStart");
+            ProfiledMutex::WaitLock wait_lk(lba_mutex);
+            lba_start.wait(wait_lk, [this]{return (lba_thread_status == LBA_ACTIVE);});
+        }
         lk.unlock();
 
-        if (curr_kf_mt == nullptr || prev_kf_mt == nullptr) break;
+        if (kf_batch_mt.empty()) break;
+
+        // latency of the KFs of the batch from their enqueueing by the VO
+        Profiler &prof = Profiler::instance();
+        for( auto &kfs : kf_batch_mt )
+            if( kfs.second->t_queued >= 0.0 )
+                prof.addSample( "MapHandler::kfQueueLatency", kfs.second->t_queued, prof.now() - kfs.second->t_queued );
 
-        // reset indices
-        for (PointFeature* pt : curr_kf_mt->stereo_frame->stereo_pt)
-            pt->idx = -1;
-        for (LineFeature* ls : curr_kf_mt->stereo_frame->stereo_ls)
-            ls->idx = -1;
+        std::unique_lock<SharedMutex> map_lk(map_mutex);
 
-        // look for common matches and update the full graph
-        lookForCommonMatches( prev_kf_mt, curr_kf_mt );
+        // look for common matches and update the full graph, for each KF of the batch in order
+        for( auto &kfs : kf_batch_mt )
+        {
+            prev_kf = kfs.first;
+            curr_kf = kfs.second;
+            Twf = expmap_se3(logmap_se3( inverse_se3( curr_kf->T_kf_w ) ));
+            DT  = expmap_se3(logmap_se3( Twf * prev_kf->T_kf_w ));
+            if( SlamConfig::lcBowLevelsUp() >= 0 )
+                waitBowVectors( curr_kf );
+            lookForCommonMatches( prev_kf, curr_kf );
+        }
         // form local map
-        formLocalMap(curr_kf_mt);
-        // perform local bundle adjustment
-#ifdef USE_LINE_PLUKER
-       // localBundleAdjustmentForPluker();
-       localBundleAdjustmentForPlukerWithG2O();
-        removeBadMapLandmarksForPluker();
-#else
-        int lba = localBundleAdjustment();
+        formLocalMap(curr_kf);
+        // perform local bundle adjustment and recent map LMs culling (implement filters for line
+        // segments, which seems to be unaccurate) with the line model of the map
+        if( Config::plukerLines() )
+        {
+            // localBundleAdjustmentForPluker();
+            localBundleAdjustmentForPlukerWithG2O();
+            removeBadMapLandmarksForPluker();
+        }
+        else
+        {
+            localBundleAdjustment();
+            removeBadMapLandmarks();
+        }
+        // the front-end of each rig of the batch tracks against the local map from its newest KF
+        vector<const KeyFrame*> rig_newest( rig_extrinsics.size(), NULL );
+        for( auto &kfs : kf_batch_mt )
+            rig_newest[kfs.second->rig] = kfs.second;
+        for( const KeyFrame* kf : rig_newest )
+            if( kf != NULL )
+                publishLocalMap(kf);
+
+        // background KF culling, only while no new KF is waiting and no LC correction is pending
+        if( SlamConfig::kfCulling() && kf_queue.empty() && lc_state == LC_IDLE )
+        {
+            int n_culled = removeRedundantKFs( SlamConfig::kfCullTimeBudget() );
+            if( n_culled > 0 )
+                LOG_INFO( "[MapHandler] culled " << n_culled << " redundant KFs" );
+        }
+        enforceMemoryBudget();
+        reduceOldKFs();
+        map_lk.unlock();
+        notifyMapChanged();
 
-        // recent map LMs culling (implement filters for line segments, which seems to be unaccurate)
-        removeBadMapLandmarks();
-#endif
         lk.lock();
         lba_thread_status = LBA_IDLE;
         lk.unlock();
@@ -1296,78 +2089,93 @@ void MapHandler::localMappingThread() {
 
     lba_join.notify_one();
 
-    print_msg("[localMappingThread] terminated.");
+    LOG_INFO( "[localMappingThread] terminated." );
 }
 
 void MapHandler::loopClosureThread() {
 
     if (!threads_started) return;
+    Config::Scope scope(config);
+    setupThread(THREAD_LOOP_CLOSURE);
 
-    std::unique_lock<std::mutex> lk(lc_mutex, std::defer_lock);
+    std::unique_lock<ProfiledMutex> lk(lc_mutex, std::defer_lock);
     while (true) {
 
         lk.lock();
-        if (lc_thread_status != LC_ACTIVE)
-            lc_start.wait(lk, [this]{return (lc_thread_status == LC_ACTIVE);});
+        if (lc_queue.empty()) {
+            PROFILE_SCOPE("MapHandler::wait.lcStart");
+            ProfiledMutex::WaitLock wait_lk(lc_mutex);
+            lc_start.wait(wait_lk, [this]{return !lc_queue.empty();});
+        }
+        KeyFrame* kf = lc_queue.front();
+        lc_queue.pop_front();
+        lc_thread_status = LC_ACTIVE;
         lk.unlock();
 
-        if ( curr_kf_mt == nullptr && prev_kf_mt == nullptr ) break; // stop loop closure thread
-
-        // insert BOW vector
-        if( SlamConfig::hasPoints() && SlamConfig::hasLines() )
-            insertKFBowVectorPL(curr_kf_mt);
-        else if( SlamConfig::hasPoints() && !SlamConfig::hasLines() )
-            insertKFBowVectorP(curr_kf_mt);
-        else if( !SlamConfig::hasPoints() && SlamConfig::hasLines() )
-            insertKFBowVectorL(curr_kf_mt);
-
-        // look for loop closure candidates
-        int lc_kf_idx = -1;
-        lookForLoopCandidates(curr_kf_mt->kf_idx, lc_kf_idx);
-        //bool inl_ratio_condition = false;
-        if( lc_kf_idx >= 0 )
+        if ( kf == nullptr ) break; // stop loop closure thread
+
+        // insert the BoW vectors (the place recognition database is only used by this thread), the
+        // culling bound (lc_last_kf_idx) keeps the KF alive until then
+        waitBowVectors( kf );
+        place_rec.addKeyFrame( kf );
+
+        // look for loop closure candidates and verify them (read-only, concurrent with other readers)
         {
+            SharedLock map_lk(map_mutex);
+            vector<int> lc_kf_idxs;
+            if( lookForLoopCandidates(kf->kf_idx, lc_kf_idxs) )
+            {
 
-            vector<Vector4i> lc_pt_idx, lc_ls_idx;
-            vector<PointFeature*> lc_points;
-            vector<LineFeature*>  lc_lines;
-            Vector6d pose_inc;
+                vector<Vector4i> lc_pt_idx, lc_ls_idx;
+                Vector6d pose_inc;
 
-            bool isLC = isLoopClosure( map_keyframes[lc_kf_idx], curr_kf_mt, pose_inc, lc_pt_idx, lc_ls_idx, lc_points, lc_lines );
+                int lc_kf_idx = verifyLoopCandidates( kf, lc_kf_idxs, pose_inc, lc_pt_idx, lc_ls_idx );
+                bool isLC = ( lc_kf_idx >= 0 );
 
-            // if it is loop closure, add information and update status
-            if( isLC )
-            {
-                lc_pt_idxs.push_back( lc_pt_idx );
-                lc_ls_idxs.push_back( lc_ls_idx );
-                lc_poses.push_back( pose_inc );
-                lc_pose_list.push_back( pose_inc );
-                Vector3i lc_idx;
-                lc_idx(0) = map_keyframes[lc_kf_idx]->kf_idx;
-                lc_idx(1) = curr_kf_mt->kf_idx;
-                lc_idx(2) = 1;
-                lc_idxs.push_back( lc_idx );
-                lc_idx_list.push_back(lc_idx);
-                if( lc_state == LC_IDLE )
-                    lc_state = LC_ACTIVE;
+                // if it is loop closure, add information and update status
+                if( isLC )
+                {
+                    lc_pt_idxs.push_back( lc_pt_idx );
+                    lc_ls_idxs.push_back( lc_ls_idx );
+                    lc_poses.push_back( pose_inc );
+                    lc_pose_list.push_back( pose_inc );
+                    Vector3i lc_idx;
+                    lc_idx(0) = map_keyframes[lc_kf_idx]->kf_idx;
+                    lc_idx(1) = kf->kf_idx;
+                    lc_idx(2) = 1;
+                    lc_idxs.push_back( lc_idx );
+                    lc_idx_list.push_back(lc_idx);
+                    if( lc_state == LC_IDLE )
+                        lc_state = LC_ACTIVE;
+                }
+                else
+                {
+                    if( lc_state == LC_ACTIVE )
+                        lc_state = LC_READY;
+                }
             }
             else
             {
                 if( lc_state == LC_ACTIVE )
                     lc_state = LC_READY;
             }
-
-            for (PointFeature* pt : lc_points)
-                delete pt;
-            for (LineFeature* ls : lc_lines)
-                delete ls;
         }
-        else
+
+        // pose graph optimization and landmark fusion (the optimization runs without the map lock)
+        if( lc_state == LC_READY )
         {
-            if( lc_state == LC_ACTIVE )
-                lc_state = LC_READY;
+            loopClosureOptimizationCovGraphG2O();
+            notifyMapChanged();
+            // refine the whole corrected map (within the GBA time budget)
+            if( SlamConfig::gbaAfterLC() )
+            {
+                globalBundleAdjustment();
+                notifyMapChanged();
+            }
         }
 
+        lc_last_kf_idx = kf->kf_idx;
+
         lk.lock();
         lc_thread_status = LC_IDLE;
         lk.unlock();
@@ -1376,13 +2184,17 @@ void MapHandler::loopClosureThread() {
 
     }
 
+    // close the loop detected by the last KFs
+    if( lc_state == LC_ACTIVE )
+        loopClosureOptimizationCovGraphG2O();
+
     lk.lock();
     lc_thread_status = LC_TERMINATED;
     lk.unlock();
 
     lc_join.notify_one();
 
-    print_msg("[LoopClosureThread] terminated.");
+    LOG_INFO( "[LoopClosureThread] terminated." );
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------
@@ -1391,62 +2203,72 @@ void MapHandler::loopClosureThread() {
 
 int MapHandler::localBundleAdjustment()
 {
+    PROFILE_SCOPE("MapHandler::localBundleAdjustment");
 
     vector<double> X_aux;
 
+    // bounded window: optimized landmarks and the KFs whose observations are used
+    vector<int>  lba_pt_idx, lba_ls_idx;
+    vector<bool> lba_obs_kf;
+    selectLBAWindow( lba_pt_idx, lba_ls_idx, lba_obs_kf );
+
     // create list of local keyframes
     vector<int> kf_list;
-    for( vector<KeyFrame*>::iterator kf_it = map_keyframes.begin(); kf_it != map_keyframes.end(); kf_it++)
+    for( int i_kf : local_kf_idx )
     {
-        if( (*kf_it)!= NULL )
+        KeyFrame* kf = map_keyframes[i_kf];
+        if( kf != NULL )
         {
-            if( (*kf_it)->local && (*kf_it)->kf_idx != 0 )
+            if( kf->local && kf->kf_idx != 0 )
             {
-                Vector6d pose_aux = (*kf_it)->x_kf_w;
+                Vector6d pose_aux = kf->x_kf_w;
                 for(int i = 0; i < 6; i++)
                     X_aux.push_back( pose_aux(i) );
-                kf_list.push_back( (*kf_it)->kf_idx );
+                kf_list.push_back( kf->kf_idx );
             }
         }
     }
 
+    // observers outside the window optimized against their marginalization prior
+    addPriorKFs( lba_obs_kf, lba_pt_idx, kf_list, X_aux );
+
+    // local index of each KF in kf_list (-1 if not optimized)
+    vector<int> kf_local( map_keyframes.size(), -1 );
+    for( int j = 0; j < kf_list.size(); j++ )
+        kf_local[ kf_list[j] ] = j;
+
     // create list of local point landmarks
     vector<Vector6i> pt_obs_list;
     vector<int> pt_list;
     int lm_local_idx = 0;
-    for( vector<MapPoint*>::iterator pt_it = map_points.begin(); pt_it != map_points.end(); pt_it++)
+    for( int i_pt : lba_pt_idx )
     {
-        if( (*pt_it)!= NULL )
+        MapPoint* pt = map_points[i_pt];
+        if( pt != NULL )
         {
-            if( (*pt_it)->local )
+            if( pt->local )
             {
-                Vector3d point_aux = (*pt_it)->point3D;
+                Vector3d point_aux = pt->point3D;
                 for(int i = 0; i < 3; i++)
                     X_aux.push_back( point_aux(i) );
                 // gather all observations
-                for( int i = 0; i < (*pt_it)->obs_list.size(); i++)
+                for( int i = 0; i < pt->obs_list.size(); i++)
                 {
+                    if( !lba_obs_kf[ pt->kf_obs_list[i] ] )
+                        continue;
                     Vector6i obs_aux;
-                    obs_aux(0) = (*pt_it)->idx; // LM idx
+                    obs_aux(0) = pt->idx; // LM idx
                     obs_aux(1) = lm_local_idx;  // LM local idx
                     obs_aux(2) = i;             // LM obs idx
-                    int kf_obs_list_ = (*pt_it)->kf_obs_list[i];
+                    int kf_obs_list_ = pt->kf_obs_list[i];
                     obs_aux(3) = kf_obs_list_;  // KF idx
-                    obs_aux(4) = -1;            // KF local idx (-1 if not local)
+                    obs_aux(4) = kf_local[kf_obs_list_];  // KF local idx (-1 if not local)
                     obs_aux(5) = 1;             // 1 if the observation is an inlier
-                    for( int j = 0; j < kf_list.size(); j++ )
-                    {
-                        if( kf_list[j] == kf_obs_list_ )
-                        {
-                            obs_aux(4) = j;
-                            break;
-                        }
-                    }
                     pt_obs_list.push_back( obs_aux );
                 }
                 lm_local_idx++;
                 // pt_list
-                pt_list.push_back( (*pt_it)->idx );
+                pt_list.push_back( pt->idx );
             }
         }
     }
@@ -1455,39 +2277,34 @@ int MapHandler::localBundleAdjustment()
     vector<Vector6i> ls_obs_list;
     vector<int> ls_list;
     lm_local_idx = 0;
-    for( vector<MapLine*>::iterator ls_it = map_lines.begin(); ls_it != map_lines.end(); ls_it++)
+    for( int i_ls : lba_ls_idx )
     {
-        if( (*ls_it)!= NULL )
+        MapLine* ls = map_lines[i_ls];
+        if( ls != NULL )
         {
-            if( (*ls_it)->local )
+            if( ls->local )
             {
-                Vector6d line_aux = (*ls_it)->line3D;
+                Vector6d line_aux = ls->line3D;
                 for(int i = 0; i < 6; i++)
                     X_aux.push_back( line_aux(i) );
                 // gather all observations
-                for( int i = 0; i < (*ls_it)->obs_list.size(); i++)
+                for( int i = 0; i < ls->obs_list.size(); i++)
                 {
+                    if( !lba_obs_kf[ ls->kf_obs_list[i] ] )
+                        continue;
                     Vector6i obs_aux;
-                    obs_aux(0) = (*ls_it)->idx; // LM idx
+                    obs_aux(0) = ls->idx; // LM idx
                     obs_aux(1) = lm_local_idx;  // LM local idx
                     obs_aux(2) = i;             // LM obs idx
-                    int kf_obs_list_ = (*ls_it)->kf_obs_list[i];
+                    int kf_obs_list_ = ls->kf_obs_list[i];
                     obs_aux(3) = kf_obs_list_;  // KF idx
-                    obs_aux(4) = -1;            // KF local idx (-1 if not local)
+                    obs_aux(4) = kf_local[kf_obs_list_];  // KF local idx (-1 if not local)
                     obs_aux(5) = 1;             // 1 if the observation is an inlier
-                    for( int j = 0; j < kf_list.size(); j++ )
-                    {
-                        if( kf_list[j] == kf_obs_list_ )
-                        {
-                            obs_aux(4) = j;
-                            break;
-                        }
-                    }
                     ls_obs_list.push_back( obs_aux );
                 }
                 lm_local_idx++;
                 // ls_list
-                ls_list.push_back( (*ls_it)->idx );
+                ls_list.push_back( ls->idx );
             }
         }
     }
@@ -1504,62 +2321,72 @@ int MapHandler::localBundleAdjustment()
 //pluker
 int MapHandler::localBundleAdjustmentForPluker()
 {
+    PROFILE_SCOPE("MapHandler::localBundleAdjustmentForPluker");
 
     vector<double> X_aux;
 
+    // bounded window: optimized landmarks and the KFs whose observations are used
+    vector<int>  lba_pt_idx, lba_ls_idx;
+    vector<bool> lba_obs_kf;
+    selectLBAWindow( lba_pt_idx, lba_ls_idx, lba_obs_kf );
+
     // create list of local keyframes
     vector<int> kf_list;
-    for( vector<KeyFrame*>::iterator kf_it = map_keyframes.begin(); kf_it != map_keyframes.end(); kf_it++)
+    for( int i_kf : local_kf_idx )
     {
-        if( (*kf_it)!= NULL )
+        KeyFrame* kf = map_keyframes[i_kf];
+        if( kf != NULL )
         {
-            if( (*kf_it)->local && (*kf_it)->kf_idx != 0 )
+            if( kf->local && kf->kf_idx != 0 )
             {
-                Vector6d pose_aux = (*kf_it)->x_kf_w;
+                Vector6d pose_aux = kf->x_kf_w;
                 for(int i = 0; i < 6; i++)
                     X_aux.push_back( pose_aux(i) );
-                kf_list.push_back( (*kf_it)->kf_idx );
+                kf_list.push_back( kf->kf_idx );
             }
         }
     }
 
+    // observers outside the window optimized against their marginalization prior
+    addPriorKFs( lba_obs_kf, lba_pt_idx, kf_list, X_aux );
+
+    // local index of each KF in kf_list (-1 if not optimized)
+    vector<int> kf_local( map_keyframes.size(), -1 );
+    for( int j = 0; j < kf_list.size(); j++ )
+        kf_local[ kf_list[j] ] = j;
+
     // create list of local point landmarks
     vector<Vector6i> pt_obs_list;
     vector<int> pt_list;
     int lm_local_idx = 0;
-    for( vector<MapPoint*>::iterator pt_it = map_points.begin(); pt_it != map_points.end(); pt_it++)
+    for( int i_pt : lba_pt_idx )
     {
-        if( (*pt_it)!= NULL )
+        MapPoint* pt = map_points[i_pt];
+        if( pt != NULL )
         {
-            if( (*pt_it)->local )
+            if( pt->local )
             {
-                Vector3d point_aux = (*pt_it)->point3D;
+                Vector3d point_aux = pt->point3D;
                 for(int i = 0; i < 3; i++)
                     X_aux.push_back( point_aux(i) );
                 // gather all observations
-                for( int i = 0; i < (*pt_it)->obs_list.size(); i++)
+                for( int i = 0; i < pt->obs_list.size(); i++)
                 {
+                    if( !lba_obs_kf[ pt->kf_obs_list[i] ] )
+                        continue;
                     Vector6i obs_aux;
-                    obs_aux(0) = (*pt_it)->idx; // LM idx
+                    obs_aux(0) = pt->idx; // LM idx
                     obs_aux(1) = lm_local_idx;  // LM local idx
                     obs_aux(2) = i;             // LM obs idx
-                    int kf_obs_list_ = (*pt_it)->kf_obs_list[i];
+                    int kf_obs_list_ = pt->kf_obs_list[i];
                     obs_aux(3) = kf_obs_list_;  // KF idx
-                    obs_aux(4) = -1;            // KF local idx (-1 if not local)
+                    obs_aux(4) = kf_local[kf_obs_list_];  // KF local idx (-1 if not local)
                     obs_aux(5) = 1;             // 1 if the observation is an inlier
-                    for( int j = 0; j < kf_list.size(); j++ )
-                    {
-                        if( kf_list[j] == kf_obs_list_ )
-                        {
-                            obs_aux(4) = j;
-                            break;
-                        }
-                    }
                     pt_obs_list.push_back( obs_aux );
                 }
                 lm_local_idx++;
                 // pt_list
-                pt_list.push_back( (*pt_it)->idx );
+                pt_list.push_back( pt->idx );
             }
         }
     }
@@ -1568,40 +2395,35 @@ int MapHandler::localBundleAdjustmentForPluker()
     vector<Vector6i> ls_obs_list;
     vector<int> ls_list;
     lm_local_idx = 0;
-    for( vector<MapLine*>::iterator ls_it = map_lines.begin(); ls_it != map_lines.end(); ls_it++)
+    for( int i_ls : lba_ls_idx )
     {
-        if( (*ls_it)!= NULL )
+        MapLine* ls = map_lines[i_ls];
+        if( ls != NULL )
         {
-            if( (*ls_it)->local )
+            if( ls->local )
             {
-                (*ls_it)->orthNDw = MapLine::changePlukerToOrth( (*ls_it)->NDw );
-                Vector4d line_aux = (*ls_it)->orthNDw;
+                ls->orthNDw = MapLine::changePlukerToOrth( ls->NDw );
+                Vector4d line_aux = ls->orthNDw;
                 for(int i = 0; i < 4; i++)
                     X_aux.push_back( line_aux(i) );
                 // gather all observations
-                for( int i = 0; i < (*ls_it)->obs_list.size(); i++)
+                for( int i = 0; i < ls->obs_list.size(); i++)
                 {
+                    if( !lba_obs_kf[ ls->kf_obs_list[i] ] )
+                        continue;
                     Vector6i obs_aux;
-                    obs_aux(0) = (*ls_it)->idx; // LM idx
+                    obs_aux(0) = ls->idx; // LM idx
                     obs_aux(1) = lm_local_idx;  // LM local idx
                     obs_aux(2) = i;             // LM obs idx
-                    int kf_obs_list_ = (*ls_it)->kf_obs_list[i];
+                    int kf_obs_list_ = ls->kf_obs_list[i];
                     obs_aux(3) = kf_obs_list_;  // KF idx
-                    obs_aux(4) = -1;            // KF local idx (-1 if not local)
+                    obs_aux(4) = kf_local[kf_obs_list_];  // KF local idx (-1 if not local)
                     obs_aux(5) = 1;             // 1 if the observation is an inlier
-                    for( int j = 0; j < kf_list.size(); j++ )
-                    {
-                        if( kf_list[j] == kf_obs_list_ )
-                        {
-                            obs_aux(4) = j;
-                            break;
-                        }
-                    }
                     ls_obs_list.push_back( obs_aux );
                 }
                 lm_local_idx++;
                 // ls_list
-                ls_list.push_back( (*ls_it)->idx );
+                ls_list.push_back( ls->idx );
             }
         }
     }
@@ -1624,17 +2446,22 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
 
     VectorXd X = VectorXd::Zero(N), DX = VectorXd::Zero(N);
     VectorXd g = VectorXd::Zero(N);
-    MatrixXd H = MatrixXd::Zero(N,N);
 
     for(int i = 0; i < N; i++)
         X(i) = X_aux[i];
-    SparseMatrix<double> H_(N,N);
 
     // create Levenberg-Marquardt parameters
     double err = 0.0, err_prev = 999999999.9;
     double lambda = SlamConfig::lambdaLbaLM(), lambda_k = SlamConfig::lambdaLbaK();
     int    max_iters = SlamConfig::maxItersLba();
 
+    // sparse block solver (landmarks are marginalized with the Schur complement)
+    int Npt_lm = pt_obs_list.empty() ? 0 : pt_obs_list.back()(1)+1;
+    int Nls_lm = ls_obs_list.empty() ? 0 : ls_obs_list.back()(1)+1;
+    vector<int> lm_dims( Npt_lm, 3 );
+    lm_dims.insert( lm_dims.end(), Nls_lm, 4 );
+    SchurSolver solver( Nkf, lm_dims );
+
     // estimate H and g to precalculate lambda
     //---------------------------------------------------------------------------------------------
     // point observations
@@ -1642,13 +2469,13 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
     int Npt = 0, Npt_obs = 0;
     if( pt_obs_list.size() != 0 )
         Npt = pt_obs_list.back()(1)+1; //参与优化的特征点数目
-    for( vector<Vector6i>::iterator pt_it = pt_obs_list.begin(); pt_it != pt_obs_list.end(); pt_it++ )
+    double err_pt = evaluateObservations( pt_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
     {
-        int lm_idx_map = (*pt_it)(0);  //特征点全局ID
-        int lm_idx_loc = (*pt_it)(1);  //特征点在当前参与优化的特征点中的下标
-        int lm_idx_obs = (*pt_it)(2);  //观测在特征点观测vector中的下标
-        int kf_idx_map = (*pt_it)(3);  //该观测对应的关键帧全局ID
-        int kf_idx_loc = (*pt_it)(4);  //该观测对应的关键帧在kf_list中的下标
+        int lm_idx_map = obs(0);  //特征点全局ID
+        int lm_idx_loc = obs(1);  //特征点在当前参与优化的特征点中的下标
+        int lm_idx_obs = obs(2);  //观测在特征点观测vector中的下标
+        int kf_idx_map = obs(3);  //该观测对应的关键帧全局ID
+        int kf_idx_loc = obs(4);  //该观测对应的关键帧在kf_list中的下标
         if( map_points[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
         {
             // grab 3D LM (Xwj)
@@ -1704,26 +2531,25 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
             if( kf_idx_loc == -1 )
             {
                 g.block(jdx,0,3,1) += Jij_Xwj * p_err_norm * w ;
-                err += p_err_norm * p_err_norm * w ;
-                H.block(jdx,jdx,3,3) += Jij_Xwj * Jij_Xwj.transpose() * w ;
+                acc.err += p_err_norm * p_err_norm * w ;
+                acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
 
-                point_error += p_err_norm * p_err_norm * w;
             }
             else
             {
-                g.block(idx,0,6,1) += Jij_Tiw * p_err_norm * w;
+                acc.g_pose.block(idx,0,6,1) += Jij_Tiw * p_err_norm * w;
                 g.block(jdx,0,3,1) += Jij_Xwj * p_err_norm * w;
-                err += p_err_norm * p_err_norm * w;
+                acc.err += p_err_norm * p_err_norm * w;
                 Haux = Jij_Xwj * Jij_Tiw.transpose() * w ;
-                H.block(idx,idx,6,6) += Jij_Tiw * Jij_Tiw.transpose() * w;
-                H.block(jdx,idx,3,6) += Haux;
-                H.block(idx,jdx,6,3) += Haux.transpose();
-                H.block(jdx,jdx,3,3) += Jij_Xwj * Jij_Xwj.transpose() * w;
+                acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                acc.addPoseLandmark( kf_idx_loc, lm_idx_loc, Haux );
+                acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
 
-                point_error += p_err_norm * p_err_norm * w;
             }
         }
-    }
+    } );
+    err += err_pt;
+    point_error += err_pt;
     // todo:
     // 这里求导的Tiw是原Tiw的逆,后面更新好像没考率这个问题？
     // line segment observations
@@ -1731,18 +2557,18 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
     int Nls = 0, Nls_obs = 0;
     if( ls_obs_list.size() != 0 )
         Nls = ls_obs_list.back()(1)+1;
-    for( vector<Vector6i>::iterator ls_it = ls_obs_list.begin(); ls_it != ls_obs_list.end(); ls_it++ )
+    double err_ls = evaluateObservations( ls_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
     {
-        int lm_idx_map = (*ls_it)(0);
-        int lm_idx_loc = (*ls_it)(1);
-        int lm_idx_obs = (*ls_it)(2);
-        int kf_idx_map = (*ls_it)(3);
-        int kf_idx_loc = (*ls_it)(4);
+        int lm_idx_map = obs(0);
+        int lm_idx_loc = obs(1);
+        int lm_idx_obs = obs(2);
+        int kf_idx_map = obs(3);
+        int kf_idx_loc = obs(4);
         if( map_lines[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
         {
             // grab 3D LM (Pwj and Qwj)
             Vector6d NDw = map_lines[lm_idx_map]->NDw;
-            std::cout<<"NDw: "<<NDw.transpose()<<std::endl;
+            LOG_DEBUG( "NDw: " << NDw.transpose() );
             Matrix3d Rw = MapLine::getOrhtRFromPluker(NDw);
             Matrix2d Ww = MapLine::getOrthWFromPluker(NDw);
             Matrix<double,6,4> jacobianPO = MapLine::jacobianFromPlukerToOrth(Rw, Ww);
@@ -1822,47 +2648,39 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
             if( kf_idx_loc == -1 )
             {
                 g.block(jdx,0,4,1) += Jij_Lwj.transpose() * l_err_norm * w;
-                err += l_err_norm * l_err_norm * w;
-                H.block(jdx,jdx,4,4) += Jij_Lwj.transpose() * Jij_Lwj * w;
+                acc.err += l_err_norm * l_err_norm * w;
+                acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj.transpose() * Jij_Lwj * w );
 
-                line_error += l_err_norm * l_err_norm * w;
             }
             else
             {
-                g.block(idx,0,6,1) += Jij_Tiw.transpose() * l_err_norm * w;
+                acc.g_pose.block(idx,0,6,1) += Jij_Tiw.transpose() * l_err_norm * w;
                 g.block(jdx,0,4,1) += Jij_Lwj.transpose() * l_err_norm * w;
-                err += l_err_norm * l_err_norm * w;
+                acc.err += l_err_norm * l_err_norm * w;
                 Haux = Jij_Lwj.transpose() * Jij_Tiw * w;
-                H.block(idx,idx,6,6) += Jij_Tiw.transpose() * Jij_Tiw * w;
-                H.block(jdx,idx,4,6) += Haux;
-                H.block(idx,jdx,6,4) += Haux.transpose();
-                H.block(jdx,jdx,4,4) += Jij_Lwj.transpose() * Jij_Lwj * w;
+                acc.addPose( kf_idx_loc, Jij_Tiw.transpose() * Jij_Tiw * w );
+                acc.addPoseLandmark( kf_idx_loc, Npt + lm_idx_loc, Haux );
+                acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj.transpose() * Jij_Lwj * w );
 
-                line_error += l_err_norm * l_err_norm * w;
             }
         }
-    }
-    std::cout<<"Pluker LBA Point total error: "<<point_error<<"   "<<"Point Num: "<<Npt<<std::endl;
-    std::cout<<"Pluker LBA Line total error: "<<line_error<<"   "<<"Point Num: "<<Nls<<std::endl;
+    } );
+    err += err_ls;
+    line_error += err_ls;
+    LOG_DEBUG( "Pluker LBA Point total error: " << point_error << "   " << "Point Num: " << Npt );
+    LOG_DEBUG( "Pluker LBA Line total error: " << line_error << "   " << "Point Num: " << Nls );
     // todo:
     //好像一直是除以0？
+    err += addKFPriors( kf_list, X, solver, g );
     err /= (Npt_obs+Nls_obs);
 
     // initial guess of lambda
-    double Hmax = 0.0;
-    for( int i = 0; i < N; i++)
-    {
-        if( H(i,i) > Hmax || H(i,i) < -Hmax )
-            Hmax = fabs( H(i,i) );
-    }
+    double Hmax = solver.maxDiagonal();
     lambda *= Hmax;
 
     // solve the first iteration
-    for(int i = 0; i < N; i++)
-        H(i,i) += lambda * H(i,i) ;
-    H_ = H.sparseView();
-    SimplicialLDLT< SparseMatrix<double> > solver1(H_);
-    DX = solver1.solve( g );
+    solver.addRelativeDamping( lambda );
+    solver.solve( g, DX );
 
     // update KFs
     for( int i = 0; i < Nkf; i++)
@@ -1877,18 +2695,7 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
     for( int i = 6*Nkf; i < 6*Nkf+3*Npt; i++)
         X(i) += DX(i);
     // update line LMs
-    for( int i = 6*Nkf+3*Npt; i < N; i=i+4)
-    {
-        Vector4d D(X(i),X(i+1),X(i+2),X(i+3));
-        Vector4d deltaD(DX(i),DX(i+1),DX(i+2),DX(i+3));
-        Vector4d plusD;
-        updateOrthCoord(D, deltaD, plusD);
-
-        X(i) = plusD(0);
-        X(i+1) = plusD(1);
-        X(i+2) = plusD(2);
-        X(i+3) = plusD(3);
-    }
+    orthPlus(X, DX, 6*Nkf+3*Npt, N);
 
 
     // update error
@@ -1896,23 +2703,24 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
 
     // LM iterations
     //---------------------------------------------------------------------------------------------
-    int iters;
-    point_error = 0; line_error = 0;
-    for( iters = 1; iters < max_iters; iters++)
+    // a rejected step leaves X unchanged, so its evaluation is reused with the new damping
+    bool   relinearize = true;
+    double lambda_damped = 0.0;
+    // estimate hessian and gradient (reset) at X
+    auto linearize = [&]()
     {
-        // estimate hessian and gradient (reset)
         DX = VectorXd::Zero(N);
         g  = VectorXd::Zero(N);
-        H  = MatrixXd::Zero(N,N);
+        solver.setZero();
         err = 0.0;
         // - point observations
-        for( vector<Vector6i>::iterator pt_it = pt_obs_list.begin(); pt_it != pt_obs_list.end(); pt_it++ )
+        err_pt = evaluateObservations( pt_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
         {
-            int lm_idx_map = (*pt_it)(0);
-            int lm_idx_loc = (*pt_it)(1);
-            int lm_idx_obs = (*pt_it)(2);
-            int kf_idx_map = (*pt_it)(3);
-            int kf_idx_loc = (*pt_it)(4);
+            int lm_idx_map = obs(0);
+            int lm_idx_loc = obs(1);
+            int lm_idx_obs = obs(2);
+            int kf_idx_map = obs(3);
+            int kf_idx_loc = obs(4);
             if( map_points[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
             {
                 // grab 3D LM (Xwj)
@@ -1970,39 +2778,40 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
                 if( kf_idx_loc == -1 )
                 {
                     g.block(jdx,0,3,1) += Jij_Xwj * p_err_norm * w;
-                    err += p_err_norm * p_err_norm * w;
-                    H.block(jdx,jdx,3,3) += Jij_Xwj * Jij_Xwj.transpose() * w;
+                    acc.err += p_err_norm * p_err_norm * w;
+                    acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
 
-                    point_error += p_err_norm * p_err_norm * w;
                 }
                 else
                 {
-                    g.block(idx,0,6,1) += Jij_Tiw * p_err_norm * w;
+                    acc.g_pose.block(idx,0,6,1) += Jij_Tiw * p_err_norm * w;
                     g.block(jdx,0,3,1) += Jij_Xwj * p_err_norm * w;
-                    err += p_err_norm * p_err_norm * w;
+                    acc.err += p_err_norm * p_err_norm * w;
                     Haux = Jij_Xwj * Jij_Tiw.transpose() * w ;
-                    H.block(idx,idx,6,6) += Jij_Tiw * Jij_Tiw.transpose() * w ;
-                    H.block(jdx,idx,3,6) += Haux;
-                    H.block(idx,jdx,6,3) += Haux.transpose();
-                    H.block(jdx,jdx,3,3) += Jij_Xwj * Jij_Xwj.transpose() * w ;
+                    acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                    acc.addPoseLandmark( kf_idx_loc, lm_idx_loc, Haux );
+                    acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
 
-                    point_error += p_err_norm * p_err_norm * w;
                 }
             }
-        }
+        } );
+        err += err_pt;
+        point_error += err_pt;
         // line segment observations
-        for( vector<Vector6i>::iterator ls_it = ls_obs_list.begin(); ls_it != ls_obs_list.end(); ls_it++ )
+        // Plücker coordinates of the local lines, converted once and shared by all their observations
+        Matrix<double,6,Dynamic> NDw_loc;
+        orthToPluker( Map<const Matrix<double,4,Dynamic> >( X.data()+6*Nkf+3*Npt, 4, Nls ), NDw_loc );
+        err_ls = evaluateObservations( ls_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
         {
-            int lm_idx_map = (*ls_it)(0);
-            int lm_idx_loc = (*ls_it)(1);
-            int lm_idx_obs = (*ls_it)(2);
-            int kf_idx_map = (*ls_it)(3);
-            int kf_idx_loc = (*ls_it)(4);
+            int lm_idx_map = obs(0);
+            int lm_idx_loc = obs(1);
+            int lm_idx_obs = obs(2);
+            int kf_idx_map = obs(3);
+            int kf_idx_loc = obs(4);
             if( map_lines[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
             {
-                Vector4d NDw_orth = X.block(6*Nkf+3*Npt+4*lm_idx_loc,0,4,1);
                 // grab 3D LM (Pwj and Qwj)
-                Vector6d NDw = MapLine::changeOrthToPluker(NDw_orth);
+                Vector6d NDw = NDw_loc.col(lm_idx_loc);
                 Matrix3d Rw = MapLine::getOrhtRFromPluker(NDw);
                 Matrix2d Ww = MapLine::getOrthWFromPluker(NDw);
                 Matrix<double,6,4> jacobianPO = MapLine::jacobianFromPlukerToOrth(Rw, Ww);
@@ -2082,49 +2891,58 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
                 if( kf_idx_loc == -1 )
                 {
                     g.block(jdx,0,4,1) += Jij_Lwj.transpose() * l_err_norm * w;
-                    err += l_err_norm * l_err_norm * w;
-                    H.block(jdx,jdx,4,4) += Jij_Lwj.transpose() * Jij_Lwj * w;
+                    acc.err += l_err_norm * l_err_norm * w;
+                    acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj.transpose() * Jij_Lwj * w );
 
-                    line_error += l_err_norm * l_err_norm * w;
                 }
                 else
                 {
-                    g.block(idx,0,6,1) += Jij_Tiw.transpose() * l_err_norm * w;
+                    acc.g_pose.block(idx,0,6,1) += Jij_Tiw.transpose() * l_err_norm * w;
                     g.block(jdx,0,4,1) += Jij_Lwj.transpose() * l_err_norm * w;
-                    err += l_err_norm * l_err_norm * w;
+                    acc.err += l_err_norm * l_err_norm * w;
                     Haux = Jij_Lwj.transpose() * Jij_Tiw * w;
-                    H.block(idx,idx,6,6) += Jij_Tiw.transpose() * Jij_Tiw * w;
-                    H.block(jdx,idx,4,6) += Haux;
-                    H.block(idx,jdx,6,4) += Haux.transpose();
-                    H.block(jdx,jdx,4,4) += Jij_Lwj.transpose() * Jij_Lwj * w;
-                    line_error += l_err_norm * l_err_norm * w;
+                    acc.addPose( kf_idx_loc, Jij_Tiw.transpose() * Jij_Tiw * w );
+                    acc.addPoseLandmark( kf_idx_loc, Npt + lm_idx_loc, Haux );
+                    acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj.transpose() * Jij_Lwj * w );
                 }
             }
-        }
-        std::cout<<"Pluker LBA Point total error: "<<point_error<<"   "<<"Point Num: "<<Npt<<std::endl;
-        std::cout<<"Pluker LBA Line total error: "<<line_error<<"   "<<"Point Num: "<<Nls<<std::endl;
+        } );
+        err += err_ls;
+        line_error += err_ls;
+        LOG_DEBUG( "Pluker LBA Point total error: " << point_error << "   " << "Point Num: " << Npt );
+        LOG_DEBUG( "Pluker LBA Line total error: " << line_error << "   " << "Point Num: " << Nls );
         // todo:
         //好像一直是除以0？
+        err += addKFPriors( kf_list, X, solver, g );
         err /= (Npt_obs+Nls_obs);
+    };
+    int iters;
+    point_error = 0; line_error = 0;
+    for( iters = 1; iters < max_iters; iters++)
+    {
+        if( relinearize )
+            linearize();
+        else
+            solver.removeRelativeDamping( lambda_damped );
 
         // if the difference is very small stop
         if( abs(err-err_prev) < Config::minErrorChange() || err < Config::minError() )
             break;
         // add lambda to hessian
-        for(int i = 0; i < N; i++)
-            H(i,i) += lambda * H(i,i) ;
+        solver.addRelativeDamping( lambda );
+        lambda_damped = lambda;
         // solve iteration
-        H_ = H.sparseView();
-        SimplicialLDLT< SparseMatrix<double> > solver1(H_);
-        DX = solver1.solve( g );
+        solver.solve( g, DX );
 
         // update lambda
         if( err > err_prev ){
             lambda /= lambda_k;
+            relinearize = false;
         }
         else
         {
             lambda *= lambda_k;
+            relinearize = true;
             // update KFs
             for( int i = 0; i < Nkf; i++)
             {
@@ -2136,18 +2954,7 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
             for( int i = 6*Nkf; i < 6*Nkf+3*Npt; i++)
                 X(i) += DX(i);
             // update line LMs
-            for( int i = 6*Nkf+3*Npt; i < N; i=i+4)
-            {
-                Vector4d D(X(i),X(i+1),X(i+2),X(i+3));
-                Vector4d deltaD(DX(i),DX(i+1),DX(i+2),DX(i+3));
-                Vector4d plusD;
-                updateOrthCoord(D, deltaD, plusD);
-
-                X(i) = plusD(0);
-                X(i+1) = plusD(1);
-                X(i+2) = plusD(2);
-                X(i+3) = plusD(3);
-            }
+            orthPlus(X, DX, 6*Nkf+3*Npt, N);
         }
         // if the parameter change is small stop
         if( DX.norm() < Config::minErrorChange() )
@@ -2160,9 +2967,7 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
     if( vo_status != VO_INSERTING_KF )
     {
 
-        m_insert_kf.lock();
-
-        // Update KFs and LMs
+        // Update KFs and LMs (the map lock is held by the caller in multithread mode)
         //---------------------------------------------------------------------------------------------
         // update KFs
         for( int i = 0; i < Nkf; i++)
@@ -2170,6 +2975,14 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
             Matrix4d Test = expmap_se3( X.block( 6*i,0,6,1 ) );
             map_keyframes[ kf_list[i] ]->T_kf_w = Test;
         }
+        // the marginals are taken from the undamped system at the final X (the last one is damped and at
+        // the X before the last step), its solve only factorizes it
+        if( SlamConfig::pgRetentionKFs() > 0 )
+        {
+            linearize();
+            solver.solve( g, DX );
+        }
+        updateKFPriors( kf_list, solver );
         // update point LMs
         for( int i = 0; i < Npt; i++)
         {
@@ -2226,10 +3039,12 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
                             }
                         }
                         // remove observations from map points
-                        map_points[lm_idx_map]->desc_list.erase( map_points[lm_idx_map]->desc_list.begin() + lm_idx_obs );
+                        kf_redundancy.remove( map_points[lm_idx_map]->kf_obs_list );
+                        map_points[lm_idx_map]->desc_list.erase( lm_idx_obs );
                         map_points[lm_idx_map]->obs_list.erase( map_points[lm_idx_map]->obs_list.begin() + lm_idx_obs );
                         map_points[lm_idx_map]->dir_list.erase( map_points[lm_idx_map]->dir_list.begin() + lm_idx_obs );
                         map_points[lm_idx_map]->kf_obs_list.erase( map_points[lm_idx_map]->kf_obs_list.begin() + lm_idx_obs );
+                        kf_redundancy.add( map_points[lm_idx_map]->kf_obs_list );
                         // remove idx from KeyFrame stereo points
                         for(vector<PointFeature*>::iterator st_pt = map_keyframes[kf_obs]->stereo_frame->stereo_pt.begin();
                             st_pt != map_keyframes[kf_obs]->stereo_frame->stereo_pt.end(); st_pt++ )
@@ -2248,8 +3063,7 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
                             int idx = map_points[lm_idx_map]->kf_obs_list[i];
                             if( kf_obs != idx )
                             {
-                                full_graph[kf_obs][idx]--;
-                                full_graph[idx][kf_obs]--;
+                                full_graph.decreaseWeight( kf_obs, idx );
                             }
                         }
                     }
@@ -2286,11 +3100,13 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
                             }
                         }
                         // remove observations
-                        map_lines[lm_idx_map]->desc_list.erase( map_lines[lm_idx_map]->desc_list.begin() + lm_idx_obs );
+                        kf_redundancy.remove( map_lines[lm_idx_map]->kf_obs_list );
+                        map_lines[lm_idx_map]->desc_list.erase( lm_idx_obs );
                         map_lines[lm_idx_map]->obs_list.erase( map_lines[lm_idx_map]->obs_list.begin() + lm_idx_obs );
                         map_lines[lm_idx_map]->pts_list.erase( map_lines[lm_idx_map]->pts_list.begin() + lm_idx_obs );
                         map_lines[lm_idx_map]->dir_list.erase( map_lines[lm_idx_map]->dir_list.begin() + lm_idx_obs );
                         map_lines[lm_idx_map]->kf_obs_list.erase( map_lines[lm_idx_map]->kf_obs_list.begin() + lm_idx_obs );
+                        kf_redundancy.add( map_lines[lm_idx_map]->kf_obs_list );
                         // remove idx from KeyFrame stereo lines
                         for(vector<LineFeature*>::iterator st_ls = map_keyframes[kf_obs]->stereo_frame->stereo_ls.begin();
                             st_ls != map_keyframes[kf_obs]->stereo_frame->stereo_ls.end(); st_ls++ )
@@ -2309,8 +3125,7 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
                             int idx = map_lines[lm_idx_map]->kf_obs_list[i];
                             if( kf_obs != idx )
                             {
-                                full_graph[kf_obs][idx]--;
-                                full_graph[idx][kf_obs]--;
+                                full_graph.decreaseWeight( kf_obs, idx );
                             }
                         }
                     }
@@ -2321,8 +3136,6 @@ int MapHandler::levMarquardtOptimizationLBAForPluker( vector<double> X_aux, vect
             }
         }
 
-        m_insert_kf.unlock();
-
     }
     else
         return -1;
@@ -2340,17 +3153,26 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
 
     VectorXd X = VectorXd::Zero(N), DX = VectorXd::Zero(N);
     VectorXd g = VectorXd::Zero(N);
-    MatrixXd H = MatrixXd::Zero(N,N);
 
     for(int i = 0; i < N; i++)
         X(i) = X_aux[i];
-    SparseMatrix<double> H_(N,N);
 
     // create Levenberg-Marquardt parameters
     double err = 0.0, err_prev = 999999999.9;
     double lambda = SlamConfig::lambdaLbaLM(), lambda_k = SlamConfig::lambdaLbaK();
     int    max_iters = SlamConfig::maxItersLba();
 
+    // sparse block solver (landmarks are marginalized with the Schur complement)
+    int Npt_lm = pt_obs_list.empty() ? 0 : pt_obs_list.back()(1)+1;
+    int Nls_lm = ls_obs_list.empty() ? 0 : ls_obs_list.back()(1)+1;
+    vector<int> lm_dims( Npt_lm, 3 );
+    lm_dims.insert( lm_dims.end(), Nls_lm, 6 );
+    SchurSolver solver( Nkf, lm_dims );
+
+    // anytime stop: time budget or a new KF waiting, the best iterate evaluated so far is kept
+    bool stop = false;
+    OptimizationTimeBudget budget( SlamConfig::lbaTimeBudget(), &stop, [this]{ return lbaInterrupted(); } );
+
     // estimate H and g to precalculate lambda
     //---------------------------------------------------------------------------------------------
     // point observations
@@ -2358,13 +3180,13 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
     int Npt = 0, Npt_obs = 0;
     if( pt_obs_list.size() != 0 )
         Npt = pt_obs_list.back()(1)+1;
-    for( vector<Vector6i>::iterator pt_it = pt_obs_list.begin(); pt_it != pt_obs_list.end(); pt_it++ )
+    double err_pt = evaluateObservations( pt_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
     {
-        int lm_idx_map = (*pt_it)(0);
-        int lm_idx_loc = (*pt_it)(1);
-        int lm_idx_obs = (*pt_it)(2);
-        int kf_idx_map = (*pt_it)(3);
-        int kf_idx_loc = (*pt_it)(4);
+        int lm_idx_map = obs(0);
+        int lm_idx_loc = obs(1);
+        int lm_idx_obs = obs(2);
+        int kf_idx_map = obs(3);
+        int kf_idx_loc = obs(4);
         if( map_points[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
         {
             // grab 3D LM (Xwj)
@@ -2417,36 +3239,35 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
             if( kf_idx_loc == -1 )
             {
                 g.block(jdx,0,3,1) += Jij_Xwj * p_err_norm * w ;
-                err += p_err_norm * p_err_norm * w ;
-                H.block(jdx,jdx,3,3) += Jij_Xwj * Jij_Xwj.transpose() * w ;
-                point_error += p_err_norm * p_err_norm * w;
+                acc.err += p_err_norm * p_err_norm * w ;
+                acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
             }
             else
             {
-                g.block(idx,0,6,1) += Jij_Tiw * p_err_norm * w;
+                acc.g_pose.block(idx,0,6,1) += Jij_Tiw * p_err_norm * w;
                 g.block(jdx,0,3,1) += Jij_Xwj * p_err_norm * w;
-                err += p_err_norm * p_err_norm * w;
+                acc.err += p_err_norm * p_err_norm * w;
                 Haux = Jij_Xwj * Jij_Tiw.transpose() * w ;
-                H.block(idx,idx,6,6) += Jij_Tiw * Jij_Tiw.transpose() * w;
-                H.block(jdx,idx,3,6) += Haux;
-                H.block(idx,jdx,6,3) += Haux.transpose();
-                H.block(jdx,jdx,3,3) += Jij_Xwj * Jij_Xwj.transpose() * w;
-                point_error += p_err_norm * p_err_norm * w;
+                acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                acc.addPoseLandmark( kf_idx_loc, lm_idx_loc, Haux );
+                acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
             }
         }
-    }
+    } );
+    err += err_pt;
+    point_error += err_pt;
     // line segment observations
     double line_error = 0;
     int Nls = 0, Nls_obs = 0;
     if( ls_obs_list.size() != 0 )
         Nls = ls_obs_list.back()(1)+1;
-    for( vector<Vector6i>::iterator ls_it = ls_obs_list.begin(); ls_it != ls_obs_list.end(); ls_it++ )
+    double err_ls = evaluateObservations( ls_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
     {
-        int lm_idx_map = (*ls_it)(0);
-        int lm_idx_loc = (*ls_it)(1);
-        int lm_idx_obs = (*ls_it)(2);
-        int kf_idx_map = (*ls_it)(3);
-        int kf_idx_loc = (*ls_it)(4);
+        int lm_idx_map = obs(0);
+        int lm_idx_loc = obs(1);
+        int lm_idx_obs = obs(2);
+        int kf_idx_map = obs(3);
+        int kf_idx_loc = obs(4);
         if( map_lines[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
         {
             // grab 3D LM (Pwj and Qwj)
@@ -2530,42 +3351,34 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
             if( kf_idx_loc == -1 )
             {
                 g.block(jdx,0,6,1) += Jij_Lwj * l_err_norm * w;
-                err += l_err_norm * l_err_norm * w;
-                H.block(jdx,jdx,6,6) += Jij_Lwj * Jij_Lwj.transpose() * w;
-                line_error += l_err_norm * l_err_norm * w;
+                acc.err += l_err_norm * l_err_norm * w;
+                acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj * Jij_Lwj.transpose() * w );
             }
             else
             {
-                g.block(idx,0,6,1) += Jij_Tiw * l_err_norm * w;
+                acc.g_pose.block(idx,0,6,1) += Jij_Tiw * l_err_norm * w;
                 g.block(jdx,0,6,1) += Jij_Lwj * l_err_norm * w;
-                err += l_err_norm * l_err_norm * w;
+                acc.err += l_err_norm * l_err_norm * w;
                 Haux = Jij_Lwj * Jij_Tiw.transpose() * w;
-                H.block(idx,idx,6,6) += Jij_Tiw * Jij_Tiw.transpose() * w;
-                H.block(jdx,idx,6,6) += Haux;
-                H.block(idx,jdx,6,6) += Haux.transpose();
-                H.block(jdx,jdx,6,6) += Jij_Lwj * Jij_Lwj.transpose() * w;
-                line_error += l_err_norm * l_err_norm * w;
+                acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                acc.addPoseLandmark( kf_idx_loc, Npt + lm_idx_loc, Haux );
+                acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj * Jij_Lwj.transpose() * w );
             }
         }
-    }
+    } );
+    err += err_ls;
+    line_error += err_ls;
+    err += addKFPriors( kf_list, X, solver, g );
     err /= (Npt_obs+Nls_obs);
-    std::cout<<"Point error: "<<point_error<<"  "<<"Point Num: "<<Npt<<std::endl;
-    std::cout<<"Line error: "<<line_error<<"   "<<"Line Num: "<<Nls<<std::endl;
+    LOG_DEBUG( "Point error: " << point_error << "  " << "Point Num: " << Npt );
+    LOG_DEBUG( "Line error: " << line_error << "   " << "Line Num: " << Nls );
     // initial guess of lambda
-    double Hmax = 0.0;
-    for( int i = 0; i < N; i++)
-    {
-        if( H(i,i) > Hmax || H(i,i) < -Hmax )
-            Hmax = fabs( H(i,i) );
-    }
+    double Hmax = solver.maxDiagonal();
     lambda *= Hmax;
 
     // solve the first iteration
-    for(int i = 0; i < N; i++)
-        H(i,i) += lambda * H(i,i) ;
-    H_ = H.sparseView();
-    SimplicialLDLT< SparseMatrix<double> > solver1(H_);
-    DX = solver1.solve( g );
+    solver.addRelativeDamping( lambda );
+    solver.solve( g, DX );
 
     // update KFs
     for( int i = 0; i < Nkf; i++)
@@ -2587,26 +3400,30 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
 
     // update error
     err_prev = err;
+    VectorXd X_best = X;
+    double err_best = numeric_limits<double>::max();
 
     // LM iterations
     //---------------------------------------------------------------------------------------------
-    int iters;
-    for( iters = 1; iters < max_iters; iters++)
+    // a rejected step leaves X unchanged, so its evaluation is reused with the new damping
+    bool   relinearize = true;
+    double lambda_damped = 0.0;
+    // estimate hessian and gradient (reset) at X
+    auto linearize = [&]()
     {
-        // estimate hessian and gradient (reset)
         DX = VectorXd::Zero(N);
         g  = VectorXd::Zero(N);
-        H  = MatrixXd::Zero(N,N);
+        solver.setZero();
         err = 0.0;        
         // - point observations
         double point_error_lm = 0;
-        for( vector<Vector6i>::iterator pt_it = pt_obs_list.begin(); pt_it != pt_obs_list.end(); pt_it++ )
+        err_pt = evaluateObservations( pt_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
         {
-            int lm_idx_map = (*pt_it)(0);
-            int lm_idx_loc = (*pt_it)(1);
-            int lm_idx_obs = (*pt_it)(2);
-            int kf_idx_map = (*pt_it)(3);
-            int kf_idx_loc = (*pt_it)(4);
+            int lm_idx_map = obs(0);
+            int lm_idx_loc = obs(1);
+            int lm_idx_obs = obs(2);
+            int kf_idx_map = obs(3);
+            int kf_idx_loc = obs(4);
             if( map_points[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
             {
                 // grab 3D LM (Xwj)
@@ -2664,33 +3481,32 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
                 if( kf_idx_loc == -1 )
                 {
                     g.block(jdx,0,3,1) += Jij_Xwj * p_err_norm * w;
-                    err += p_err_norm * p_err_norm * w;
-                    H.block(jdx,jdx,3,3) += Jij_Xwj * Jij_Xwj.transpose() * w;
-                    point_error_lm += p_err_norm * p_err_norm * w;
+                    acc.err += p_err_norm * p_err_norm * w;
+                    acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
                 }
                 else
                 {
-                    g.block(idx,0,6,1) += Jij_Tiw * p_err_norm * w;
+                    acc.g_pose.block(idx,0,6,1) += Jij_Tiw * p_err_norm * w;
                     g.block(jdx,0,3,1) += Jij_Xwj * p_err_norm * w;
-                    err += p_err_norm * p_err_norm * w;
+                    acc.err += p_err_norm * p_err_norm * w;
                     Haux = Jij_Xwj * Jij_Tiw.transpose() * w ;
-                    H.block(idx,idx,6,6) += Jij_Tiw * Jij_Tiw.transpose() * w ;
-                    H.block(jdx,idx,3,6) += Haux;
-                    H.block(idx,jdx,6,3) += Haux.transpose();
-                    H.block(jdx,jdx,3,3) += Jij_Xwj * Jij_Xwj.transpose() * w ;
-                    point_error_lm += p_err_norm * p_err_norm * w;
+                    acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                    acc.addPoseLandmark( kf_idx_loc, lm_idx_loc, Haux );
+                    acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
                 }
             }
-        }
+        } );
+        err += err_pt;
+        point_error_lm += err_pt;
         // - line segment observations
         double line_error_lm =0;
-        for( vector<Vector6i>::iterator ls_it = ls_obs_list.begin(); ls_it != ls_obs_list.end(); ls_it++ )
+        err_ls = evaluateObservations( ls_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
         {
-            int lm_idx_map = (*ls_it)(0);
-            int lm_idx_loc = (*ls_it)(1);
-            int lm_idx_obs = (*ls_it)(2);
-            int kf_idx_map = (*ls_it)(3);
-            int kf_idx_loc = (*ls_it)(4);
+            int lm_idx_map = obs(0);
+            int lm_idx_loc = obs(1);
+            int lm_idx_obs = obs(2);
+            int kf_idx_map = obs(3);
+            int kf_idx_loc = obs(4);
             if( map_lines[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
             {
                 // grab 3D LM (Pwj and Qwj)
@@ -2773,45 +3589,64 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
                 if( kf_idx_loc == -1 )
                 {
                     g.block(jdx,0,6,1) += Jij_Lwj * l_err_norm * w;
-                    err += l_err_norm * l_err_norm * w;
-                    H.block(jdx,jdx,6,6) += Jij_Lwj * Jij_Lwj.transpose() * w;
-                    line_error_lm += l_err_norm * l_err_norm * w;
+                    acc.err += l_err_norm * l_err_norm * w;
+                    acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj * Jij_Lwj.transpose() * w );
                 }
                 else
                 {
-                    g.block(idx,0,6,1) += Jij_Tiw * l_err_norm * w;
+                    acc.g_pose.block(idx,0,6,1) += Jij_Tiw * l_err_norm * w;
                     g.block(jdx,0,6,1) += Jij_Lwj * l_err_norm * w;
-                    err += l_err_norm * l_err_norm * w;
+                    acc.err += l_err_norm * l_err_norm * w;
                     Haux = Jij_Lwj * Jij_Tiw.transpose() * w;
-                    H.block(idx,idx,6,6) += Jij_Tiw * Jij_Tiw.transpose() * w;
-                    H.block(jdx,idx,6,6) += Haux;
-                    H.block(idx,jdx,6,6) += Haux.transpose();
-                    H.block(jdx,jdx,6,6) += Jij_Lwj * Jij_Lwj.transpose() * w;
-                    line_error_lm += l_err_norm * l_err_norm * w;
+                    acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                    acc.addPoseLandmark( kf_idx_loc, Npt + lm_idx_loc, Haux );
+                    acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj * Jij_Lwj.transpose() * w );
                 }
             }
-        }
-        std::cout<<"Point error LM: "<<point_error_lm<<"  "<<"Point Num: "<<Npt<<std::endl;
-        std::cout<<"Line error LM: "<<line_error_lm<<"  "<<"Line Num: "<<Nls<<std::endl;
+        } );
+        err += err_ls;
+        line_error_lm += err_ls;
+        LOG_DEBUG( "Point error LM: " << point_error_lm << "  " << "Point Num: " << Npt );
+        LOG_DEBUG( "Line error LM: " << line_error_lm << "  " << "Line Num: " << Nls );
+        err += addKFPriors( kf_list, X, solver, g );
         err /= (Npt+Nls);
+    };
+    int iters;
+    for( iters = 1; iters < max_iters; iters++)
+    {
+        if( relinearize )
+            linearize();
+        else
+            solver.removeRelativeDamping( lambda_damped );
+        if( err < err_best )
+        {
+            err_best = err;
+            X_best   = X;
+        }
         // if the difference is very small stop
         if( abs(err-err_prev) < Config::minErrorChange() || err < Config::minError() )
             break;
+        // out of budget or interrupted: go back to the best iterate
+        if( budget.expired() )
+        {
+            X = X_best;
+            break;
+        }
         // add lambda to hessian
-        for(int i = 0; i < N; i++)
-            H(i,i) += lambda * H(i,i) ;
+        solver.addRelativeDamping( lambda );
+        lambda_damped = lambda;
         // solve iteration
-        H_ = H.sparseView();
-        SimplicialLDLT< SparseMatrix<double> > solver1(H_);
-        DX = solver1.solve( g );
+        solver.solve( g, DX );
 
         // update lambda
         if( err > err_prev ){
             lambda /= lambda_k;
+            relinearize = false;
         }
         else
         {
             lambda *= lambda_k;
+            relinearize = true;
             // update KFs
             for( int i = 0; i < Nkf; i++)
             {
@@ -2841,9 +3676,7 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
     if( vo_status != VO_INSERTING_KF )
     {
 
-    m_insert_kf.lock();
-
-    // Update KFs and LMs
+    // Update KFs and LMs (the map lock is held by the caller in multithread mode)
     //---------------------------------------------------------------------------------------------
     // update KFs
     for( int i = 0; i < Nkf; i++)
@@ -2851,6 +3684,14 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
         Matrix4d Test = expmap_se3( X.block( 6*i,0,6,1 ) );
         map_keyframes[ kf_list[i] ]->T_kf_w = Test;
     }
+    // the marginals are taken from the undamped system at the final X (the last one is damped and at
+    // the X before the last step), its solve only factorizes it
+    if( SlamConfig::pgRetentionKFs() > 0 )
+    {
+        linearize();
+        solver.solve( g, DX );
+    }
+    updateKFPriors( kf_list, solver );
     // update point LMs
     for( int i = 0; i < Npt; i++)
     {
@@ -2910,10 +3751,12 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
                         }
                     }
                     // remove observations from map points
-                    map_points[lm_idx_map]->desc_list.erase( map_points[lm_idx_map]->desc_list.begin() + lm_idx_obs );
+                    kf_redundancy.remove( map_points[lm_idx_map]->kf_obs_list );
+                    map_points[lm_idx_map]->desc_list.erase( lm_idx_obs );
                     map_points[lm_idx_map]->obs_list.erase( map_points[lm_idx_map]->obs_list.begin() + lm_idx_obs );
                     map_points[lm_idx_map]->dir_list.erase( map_points[lm_idx_map]->dir_list.begin() + lm_idx_obs );
                     map_points[lm_idx_map]->kf_obs_list.erase( map_points[lm_idx_map]->kf_obs_list.begin() + lm_idx_obs );
+                    kf_redundancy.add( map_points[lm_idx_map]->kf_obs_list );
                     // remove idx from KeyFrame stereo points
                     for(vector<PointFeature*>::iterator st_pt = map_keyframes[kf_obs]->stereo_frame->stereo_pt.begin();
                         st_pt != map_keyframes[kf_obs]->stereo_frame->stereo_pt.end(); st_pt++ )
@@ -2932,8 +3775,7 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
                         int idx = map_points[lm_idx_map]->kf_obs_list[i];
                         if( kf_obs != idx )
                         {
-                            full_graph[kf_obs][idx]--;
-                            full_graph[idx][kf_obs]--;
+                            full_graph.decreaseWeight( kf_obs, idx );
                         }
                     }
                 }
@@ -2970,11 +3812,13 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
                         }
                     }
                     // remove observations
-                    map_lines[lm_idx_map]->desc_list.erase( map_lines[lm_idx_map]->desc_list.begin() + lm_idx_obs );
+                    kf_redundancy.remove( map_lines[lm_idx_map]->kf_obs_list );
+                    map_lines[lm_idx_map]->desc_list.erase( lm_idx_obs );
                     map_lines[lm_idx_map]->obs_list.erase( map_lines[lm_idx_map]->obs_list.begin() + lm_idx_obs );
                     map_lines[lm_idx_map]->pts_list.erase( map_lines[lm_idx_map]->pts_list.begin() + lm_idx_obs );
                     map_lines[lm_idx_map]->dir_list.erase( map_lines[lm_idx_map]->dir_list.begin() + lm_idx_obs );
                     map_lines[lm_idx_map]->kf_obs_list.erase( map_lines[lm_idx_map]->kf_obs_list.begin() + lm_idx_obs );
+                    kf_redundancy.add( map_lines[lm_idx_map]->kf_obs_list );
                     // remove idx from KeyFrame stereo lines
                     for(vector<LineFeature*>::iterator st_ls = map_keyframes[kf_obs]->stereo_frame->stereo_ls.begin();
                         st_ls != map_keyframes[kf_obs]->stereo_frame->stereo_ls.end(); st_ls++ )
@@ -2993,8 +3837,7 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
                         int idx = map_lines[lm_idx_map]->kf_obs_list[i];
                         if( kf_obs != idx )
                         {
-                            full_graph[kf_obs][idx]--;
-                            full_graph[idx][kf_obs]--;
+                            full_graph.decreaseWeight( kf_obs, idx );
                         }
                     }
                 }
@@ -3005,8 +3848,6 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
         }
     }
 
-    m_insert_kf.unlock();
-
     }
     else
         return -1;
@@ -3021,60 +3862,71 @@ int MapHandler::levMarquardtOptimizationLBA( vector<double> X_aux, vector<int> k
 
 void MapHandler::globalBundleAdjustment()
 {
+    PROFILE_SCOPE("MapHandler::globalBundleAdjustment");
+
+    std::lock_guard<SharedMutex> map_lk(map_mutex);
+
+    if( SlamConfig::gbaG2O() )
+    {
+        globalBundleAdjustmentG2O( SlamConfig::gbaTimeBudget() );
+        live_kfs.touchAll();
+        live_pts.touchAll();
+        live_ls.touchAll();
+        return;
+    }
 
     vector<double> X_aux;
 
-    // create list of keyframes
+    // create list of keyframes (the reduced ones have no observations)
     vector<int> kf_list;
-    for( vector<KeyFrame*>::iterator kf_it = map_keyframes.begin(); kf_it != map_keyframes.end(); kf_it++)
+    for( int i_kf : live_kfs )
     {
-        if( (*kf_it)!= NULL )
+        KeyFrame* kf = map_keyframes[i_kf];
+        if( kf != NULL )
         {
-            if( (*kf_it)->kf_idx != 0 )
+            if( kf->kf_idx != 0 && !kf->reduced )
             {
-                Vector6d pose_aux = (*kf_it)->x_kf_w;
+                Vector6d pose_aux = kf->x_kf_w;
                 for(int i = 0; i < 6; i++)
                     X_aux.push_back( pose_aux(i) );
-                kf_list.push_back( (*kf_it)->kf_idx );
+                kf_list.push_back( kf->kf_idx );
             }
         }
     }
 
+    // local index of each KF in kf_list (-1 if not optimized)
+    vector<int> kf_local( map_keyframes.size(), -1 );
+    for( int j = 0; j < kf_list.size(); j++ )
+        kf_local[ kf_list[j] ] = j;
+
     // create list of point landmarks
     vector<Vector6i> pt_obs_list;
     vector<int> pt_list;
     int lm_local_idx = 0;
-    for( vector<MapPoint*>::iterator pt_it = map_points.begin(); pt_it != map_points.end(); pt_it++)
+    for( int i_pt : live_pts )
     {
-        if( (*pt_it)!= NULL )
+        MapPoint* pt = map_points[i_pt];
+        if( pt != NULL )
         {
-            Vector3d point_aux = (*pt_it)->point3D;
+            Vector3d point_aux = pt->point3D;
             for(int i = 0; i < 3; i++)
                 X_aux.push_back( point_aux(i) );
             // gather all observations
-            for( int i = 0; i < (*pt_it)->obs_list.size(); i++)
+            for( int i = 0; i < pt->obs_list.size(); i++)
             {
                 Vector6i obs_aux;
-                obs_aux(0) = (*pt_it)->idx; // LM idx
+                obs_aux(0) = pt->idx; // LM idx
                 obs_aux(1) = lm_local_idx;  // LM local idx
                 obs_aux(2) = i;             // LM obs idx
-                int kf_obs_list_ = (*pt_it)->kf_obs_list[i];
+                int kf_obs_list_ = pt->kf_obs_list[i];
                 obs_aux(3) = kf_obs_list_;  // KF idx
-                obs_aux(4) = -1;            // KF local idx (-1 if not local)
+                obs_aux(4) = kf_local[kf_obs_list_];  // KF local idx (-1 if not local)
                 obs_aux(5) = 1;             // 1 if the observation is an inlier
-                for( int j = 0; j < kf_list.size(); j++ )
-                {
-                    if( kf_list[j] == kf_obs_list_ )
-                    {
-                        obs_aux(4) = j;
-                        break;
-                    }
-                }
                 pt_obs_list.push_back( obs_aux );
             }
             lm_local_idx++;
             // pt_list
-            pt_list.push_back( (*pt_it)->idx );
+            pt_list.push_back( pt->idx );
         }
     }
 
@@ -3082,42 +3934,38 @@ void MapHandler::globalBundleAdjustment()
     vector<Vector6i> ls_obs_list;
     vector<int> ls_list;
     lm_local_idx = 0;
-    for( vector<MapLine*>::iterator ls_it = map_lines.begin(); ls_it != map_lines.end(); ls_it++)
+    for( int i_ls : live_ls )
     {
-        if( (*ls_it)!= NULL )
+        MapLine* ls = map_lines[i_ls];
+        if( ls != NULL )
         {
-            Vector6d line_aux = (*ls_it)->line3D;
+            Vector6d line_aux = ls->line3D;
             for(int i = 0; i < 6; i++)
                 X_aux.push_back( line_aux(i) );
             // gather all observations
-            for( int i = 0; i < (*ls_it)->obs_list.size(); i++)
+            for( int i = 0; i < ls->obs_list.size(); i++)
             {
                 Vector6i obs_aux;
-                obs_aux(0) = (*ls_it)->idx; // LM idx
+                obs_aux(0) = ls->idx; // LM idx
                 obs_aux(1) = lm_local_idx;  // LM local idx
                 obs_aux(2) = i;             // LM obs idx
-                int kf_obs_list_ = (*ls_it)->kf_obs_list[i];
+                int kf_obs_list_ = ls->kf_obs_list[i];
                 obs_aux(3) = kf_obs_list_;  // KF idx
-                obs_aux(4) = -1;            // KF local idx (-1 if not local)
+                obs_aux(4) = kf_local[kf_obs_list_];  // KF local idx (-1 if not local)
                 obs_aux(5) = 1;             // 1 if the observation is an inlier
-                for( int j = 0; j < kf_list.size(); j++ )
-                {
-                    if( kf_list[j] == kf_obs_list_ )
-                    {
-                        obs_aux(4) = j;
-                        break;
-                    }
-                }
                 ls_obs_list.push_back( obs_aux );
             }
             lm_local_idx++;
             // ls_list
-            ls_list.push_back( (*ls_it)->idx );
+            ls_list.push_back( ls->idx );
         }
     }
 
     // Levenberg-Marquardt optimization
     levMarquardtOptimizationGBA(X_aux,kf_list,pt_list,ls_list,pt_obs_list,ls_obs_list);
+    live_kfs.touchAll();
+    live_pts.touchAll();
+    live_ls.touchAll();
 
     // -------------------------------------------------------------------------------------------------------------------
 
@@ -3125,36 +3973,205 @@ void MapHandler::globalBundleAdjustment()
     // Recent KFs culling
 }
 
+void MapHandler::globalBundleAdjustmentG2O( double time_budget )
+{
+    PROFILE_SCOPE("MapHandler::globalBundleAdjustmentG2O");
+
+    double fx = cam->getFx();
+    double fy = cam->getFy();
+    double cx = cam->getCx();
+    double cy = cam->getCy();
+
+    g2o::SparseOptimizer optimizer;
+    auto linearSolver = g2o::make_unique<SlamLinearSolver>();
+    auto blockSolver = g2o::make_unique<g2o::BlockSolverX>(std::move(linearSolver));
+    optimizer.setAlgorithm(new g2o::OptimizationAlgorithmLevenberg(std::move(blockSolver)));
+
+    // stops the optimization once the budget is spent (counted from the graph construction)
+    bool stop = false;
+    std::unique_ptr<OptimizationTimeBudget> budget;
+    if (time_budget > 0.0) {
+        budget.reset(new OptimizationTimeBudget(time_budget, &stop));
+        optimizer.setForceStopFlag(&stop);
+        optimizer.addPostIterationAction(budget.get());
+    }
+
+    // with sub-maps only the active one is refined: its landmarks and KFs, plus the frozen KFs that also
+    // observe them (fixed)
+    bool submap_gba = SlamConfig::submapMaxKFs() > 0;
+    vector<bool> gba_kf(map_keyframes.size(), !submap_gba);
+    if (submap_gba) {
+        for (int i_kf : live_kfs)
+            gba_kf[i_kf] = !submaps.frozen(i_kf);
+        for (int i_pt : live_pts)
+            if (!submaps.frozen(map_points[i_pt]->kf_obs_list))
+                for (int i_kf : map_points[i_pt]->kf_obs_list)
+                    gba_kf[i_kf] = true;
+        for (int i_ls : live_ls)
+            if (!submaps.frozen(map_lines[i_ls]->kf_obs_list))
+                for (int i_kf : map_lines[i_ls]->kf_obs_list)
+                    gba_kf[i_kf] = true;
+    }
+    // the reduced KFs have no observations, the pose graph of the LC keeps them in place
+    for (int i_kf : live_kfs)
+        if (map_keyframes[i_kf]->reduced)
+            gba_kf[i_kf] = false;
+
+    // KF vertices (ids 3*idx, 3*idx+1 and 3*idx+2 for KFs, points and lines), the oldest one fixes the gauge
+    vector<VertexLMPose *> kf_vertex(map_keyframes.size(), NULL);
+    int gauge_kf = -1;
+    for (int i_kf : live_kfs) {
+        if (!gba_kf[i_kf])
+            continue;
+        if (gauge_kf < 0)
+            gauge_kf = i_kf;
+        KeyFrame *kf = map_keyframes[i_kf];
+        VertexLMPose *vPose = new VertexLMPose();
+        vPose->setEstimate((kf->T_kf_w).inverse());
+        vPose->setId(3 * kf->kf_idx);
+        vPose->setFixed(i_kf == gauge_kf || submaps.frozen(i_kf));
+        optimizer.addVertex(vPose);
+        kf_vertex[kf->kf_idx] = vPose;
+    }
+
+    ParallelLinearization linearization;
+    const double thHuber = sqrt(5.991);
+
+    // point landmarks
+    vector<pair<MapPoint *, VertexLMPointXYZ *>> pt_vertex;
+    for (int i_pt : live_pts) {
+        MapPoint *pMP = map_points[i_pt];
+        if (submap_gba && submaps.frozen(pMP->kf_obs_list))
+            continue;
+        VertexLMPointXYZ *vPoint = new VertexLMPointXYZ();
+        vPoint->setEstimate(pMP->point3D);
+        vPoint->setId(3 * pMP->idx + 1);
+        vPoint->setMarginalized(true);
+        optimizer.addVertex(vPoint);
+        pt_vertex.push_back(make_pair(pMP, vPoint));
+
+        for (int i = 0; i < pMP->kf_obs_list.size(); i++) {
+            VertexLMPose *vPose = kf_vertex[pMP->kf_obs_list[i]];
+            if (vPose == NULL)
+                continue;
+            EdgePosePoint *e = new EdgePosePoint();
+            e->setVertex(0, vPoint);
+            e->setVertex(1, vPose);
+            e->setMeasurement(pMP->obs_list[i]);
+            e->setInformation(Eigen::Matrix2d::Identity() / pMP->sigma_list[i]);
+            g2o::RobustKernelHuber *rk = new g2o::RobustKernelHuber;
+            rk->setDelta(thHuber);
+            e->setRobustKernel(rk);
+            e->SetParams(fx, fy, cx, cy);
+            optimizer.addEdge(e);
+            linearization.pt_edges.push_back(e);
+        }
+    }
+
+    // line landmarks (Plücker lines in orthonormal representation, or 3D endpoints, see line_model)
+    const bool pluker = Config::plukerLines();
+    vector<pair<MapLine *, VertexLMLineOrth *>> ls_orth_vertex;
+    vector<pair<MapLine *, VertexLMLineEndpoints *>> ls_endp_vertex;
+    for (int i_ls : live_ls) {
+        MapLine *lML = map_lines[i_ls];
+        if (submap_gba && submaps.frozen(lML->kf_obs_list))
+            continue;
+        g2o::OptimizableGraph::Vertex *vLine;
+        if (pluker) {
+            VertexLMLineOrth *v = new VertexLMLineOrth();
+            v->setEstimate(MapLine::changePlukerToOrth(lML->NDw));
+            ls_orth_vertex.push_back(make_pair(lML, v));
+            vLine = v;
+        } else {
+            VertexLMLineEndpoints *v = new VertexLMLineEndpoints();
+            v->setEstimate(lML->line3D);
+            ls_endp_vertex.push_back(make_pair(lML, v));
+            vLine = v;
+        }
+        vLine->setId(3 * lML->idx + 2);
+        vLine->setMarginalized(true);
+        optimizer.addVertex(vLine);
+
+        for (int i = 0; i < lML->kf_obs_list.size(); i++) {
+            VertexLMPose *vPose = kf_vertex[lML->kf_obs_list[i]];
+            if (vPose == NULL)
+                continue;
+            if (pluker) {
+                EdgePoseLine *e = new EdgePoseLine();
+                e->setMeasurement(lML->NDw_obs_list[i]);
+                e->setInformation(Eigen::Matrix4d::Identity() / lML->sigma_list[i]);
+                setupLineEdge(e, vLine, vPose, thHuber, fx, fy, cx, cy);
+                optimizer.addEdge(e);
+                linearization.pluker_edges.push_back(e);
+            } else {
+                EdgePoseLineEndpoints *e = new EdgePoseLineEndpoints();
+                e->setMeasurement(lML->obs_list[i]);
+                e->setInformation(Eigen::Matrix2d::Identity() / lML->sigma_list[i]);
+                setupLineEdge(e, vLine, vPose, thHuber, fx, fy, cx, cy);
+                optimizer.addEdge(e);
+                linearization.endpoint_edges.push_back(e);
+            }
+        }
+    }
+
+    optimizer.addPreIterationAction(&linearization);
+    optimizer.initializeOptimization();
+    optimizer.optimize(SlamConfig::maxItersGBA());
+    optimizer.removePreIterationAction(&linearization);
+    if (budget)
+        optimizer.removePostIterationAction(budget.get());
+
+    // recover KFs and landmarks
+    for (int i_kf : live_kfs) {
+        KeyFrame *kf = map_keyframes[i_kf];
+        if (kf_vertex[i_kf] == NULL || kf_vertex[i_kf]->fixed())
+            continue;
+        kf->T_kf_w = kf_vertex[kf->kf_idx]->estimate().inverse();
+        kf->x_kf_w = logmap_se3(kf->T_kf_w);
+    }
+    for (const pair<MapPoint *, VertexLMPointXYZ *> &pt : pt_vertex)
+        pt.first->point3D = pt.second->estimate();
+    for (auto &ls : ls_orth_vertex)
+        ls.first->NDw = MapLine::changeOrthToPluker(ls.second->estimate());
+    for (auto &ls : ls_endp_vertex)
+        ls.first->line3D = ls.second->estimate();
+
+}
+
 void MapHandler::levMarquardtOptimizationGBA( vector<double> X_aux, vector<int> kf_list, vector<int> pt_list, vector<int> ls_list, vector<Vector6i> pt_obs_list, vector<Vector6i> ls_obs_list  )
 {
 
     // create Levenberg-Marquardt variables
     int    Nkf = kf_list.size();
     int      N = X_aux.size();
-    VectorXd DX, X(N), gdense(N);
-    SparseVector<double> g(N);
-    SparseMatrix<double> H(N,N);
+    VectorXd DX, X(N), g = VectorXd::Zero(N);
     for(int i = 0; i < N; i++)
         X.coeffRef(i) = X_aux[i];
-    H.reserve( VectorXi::Constant(N,5000) );
 
     // create Levenberg-Marquardt parameters
     double err, err_prev = 999999999.9;
     double lambda = SlamConfig::lambdaLbaLM(), lambda_k = SlamConfig::lambdaLbaK();
 
+    // sparse block solver (landmarks are marginalized with the Schur complement)
+    int Npt_lm = pt_obs_list.empty() ? 0 : pt_obs_list.back()(1)+1;
+    int Nls_lm = ls_obs_list.empty() ? 0 : ls_obs_list.back()(1)+1;
+    vector<int> lm_dims( Npt_lm, 3 );
+    lm_dims.insert( lm_dims.end(), Nls_lm, 6 );
+    SchurSolver solver( Nkf, lm_dims );
+
     // estimate H and g to precalculate lambda
     //---------------------------------------------------------------------------------------------
     // point observations
     int Npt = 0, Npt_obs = 0;
     if( pt_obs_list.size() != 0 )
         Npt = pt_obs_list.back()(1)+1;
-    for( vector<Vector6i>::iterator pt_it = pt_obs_list.begin(); pt_it != pt_obs_list.end(); pt_it++ )
+    double err_pt = evaluateObservations( pt_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
     {
-        int lm_idx_map = (*pt_it)(0);
-        int lm_idx_loc = (*pt_it)(1);
-        int lm_idx_obs = (*pt_it)(2);
-        int kf_idx_map = (*pt_it)(3);
-        int kf_idx_loc = (*pt_it)(4);
+        int lm_idx_map = obs(0);
+        int lm_idx_loc = obs(1);
+        int lm_idx_obs = obs(2);
+        int kf_idx_map = obs(3);
+        int kf_idx_loc = obs(4);
         if( map_points[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
         {
             // grab 3D LM (Xwj)
@@ -3205,65 +4222,33 @@ void MapHandler::levMarquardtOptimizationGBA( vector<double> X_aux, vector<int>
             int jdx = 6*Nkf + 3*lm_idx_loc;
             if( kf_idx_loc == -1 )
             {
-                err += p_err_norm * p_err_norm * w;
-                Vector3d gi;
-                Matrix3d Hjj;
-                Hjj = Jij_Xwj * Jij_Xwj.transpose() * w;
-                gi  = Jij_Xwj * p_err_norm * w;
-                for(int i = 0; i < 3; i++)
-                {
-                    g.coeffRef(jdx+i) += gi(i);
-                    for(int j = 0; j < 3; j++)
-                        H.coeffRef(i+jdx,j+jdx) += Hjj(i,j);
-                }
+                acc.err += p_err_norm * p_err_norm * w;
+                g.segment<3>(jdx) += Jij_Xwj * p_err_norm * w;
+                acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
             }
             else
             {
-                err += p_err_norm * p_err_norm * w;
-                Vector3d gj;
-                Vector6d gi;
-                Matrix6d Hii;
-                gi = Jij_Tiw * p_err_norm * w;
-                gj = Jij_Xwj * p_err_norm * w;
-                Hii = Jij_Tiw * Jij_Tiw.transpose() * w;
-                for(int i = 0; i < 6; i++)
-                {
-                    g.coeffRef(i+idx) += gi(i);
-                    for(int j = 0; j < 6; j++)
-                        H.coeffRef(i+idx,j+idx) += Hii(i,j);
-                }
-                Matrix3d Hjj;
-                Hjj = Jij_Xwj * Jij_Xwj.transpose() * w;
-                for(int i = 0; i < 3; i++)
-                {
-                    g.coeffRef(i+jdx) += gj(i);
-                    for(int j = 0; j < 3; j++)
-                        H.coeffRef(i+jdx,j+jdx) += Hjj(i,j);
-                }
-                MatrixXd Hij  = MatrixXd::Zero(3,6);
-                Hij = Jij_Xwj * Jij_Tiw.transpose() * w;
-                for(int i = 0; i < 3; i++)
-                {
-                    for(int j = 0; j < 6; j++)
-                    {
-                        H.coeffRef(i+jdx,j+idx) += Hij(i,j);
-                        H.coeffRef(j+idx,i+jdx) += Hij(i,j);
-                    }
-                }
+                acc.err += p_err_norm * p_err_norm * w;
+                acc.g_pose.segment<6>(idx) += Jij_Tiw * p_err_norm * w;
+                g.segment<3>(jdx) += Jij_Xwj * p_err_norm * w;
+                acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                acc.addPoseLandmark( kf_idx_loc, lm_idx_loc, Jij_Xwj * Jij_Tiw.transpose() * w );
+                acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
             }
         }
-    }
+    } );
+    err += err_pt;
     // line segment observations
     int Nls = 0, Nls_obs = 0;
     if( ls_obs_list.size() != 0 )
         Nls = ls_obs_list.back()(1)+1;
-    for( vector<Vector6i>::iterator ls_it = ls_obs_list.begin(); ls_it != ls_obs_list.end(); ls_it++ )
+    double err_ls = evaluateObservations( ls_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
     {
-        int lm_idx_map = (*ls_it)(0);
-        int lm_idx_loc = (*ls_it)(1);
-        int lm_idx_obs = (*ls_it)(2);
-        int kf_idx_map = (*ls_it)(3);
-        int kf_idx_loc = (*ls_it)(4);
+        int lm_idx_map = obs(0);
+        int lm_idx_loc = obs(1);
+        int lm_idx_obs = obs(2);
+        int kf_idx_map = obs(3);
+        int kf_idx_loc = obs(4);
         if( map_lines[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
         {
             // grab 3D LM (Pwj and Qwj)
@@ -3339,66 +4324,34 @@ void MapHandler::levMarquardtOptimizationGBA( vector<double> X_aux, vector<int>
             double w  = 1.0;
             w = robustWeightCauchy(l_err_norm) ;
             // update hessian, gradient, and error
-            VectorXd gi = VectorXd::Zero(N), gj = VectorXd::Zero(N);
             int idx = 6 * kf_idx_loc;
             int jdx = 6*Nkf + 3*Npt + 6*lm_idx_loc;
             if( kf_idx_loc == -1 )
             {
-                gj = Jij_Lwj * l_err_norm * w;
-                err += l_err_norm * l_err_norm * w;
-                Matrix6d Hjj;
-                Hjj = Jij_Lwj * Jij_Lwj.transpose() * w;
-                for(int i = 0; i < 6; i++)
-                {
-                    g.coeffRef(jdx+i) += gj(i);
-                    for(int j = 0; j < 6; j++)
-                        H.coeffRef(i+jdx,j+jdx) += Hjj(i,j);
-                }
+                g.segment<6>(jdx) += Jij_Lwj * l_err_norm * w;
+                acc.err += l_err_norm * l_err_norm * w;
+                acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj * Jij_Lwj.transpose() * w );
             }
             else
             {
-                gi = Jij_Tiw * l_err_norm * w;
-                gj = Jij_Lwj * l_err_norm * w;
-                err += l_err_norm * l_err_norm * w;
-                Matrix6d Hii, Hjj;
-                MatrixXd Hij   = MatrixXd::Zero(3,6);
-                Hii = Jij_Tiw * Jij_Tiw.transpose() * w;
-                Hjj = Jij_Lwj * Jij_Lwj.transpose() * w;
-                Hij = Jij_Lwj * Jij_Tiw.transpose() * w;
-                for(int i = 0; i < 6; i++)
-                {
-                    g.coeffRef(i+idx) += gi(i);
-                    g.coeffRef(i+jdx) += gj(i);
-                    for(int j = 0; j < 6; j++)
-                    {
-                        H.coeffRef(idx+i,idx+j) += Hii(i,j);
-                        H.coeffRef(jdx+i,jdx+j) += Hjj(i,j);
-                        H.coeffRef(idx+i,jdx+j) += Hij(i,j);
-                        H.coeffRef(jdx+j,idx+i) += Hij(i,j);
-                    }
-                }
+                acc.g_pose.segment<6>(idx) += Jij_Tiw * l_err_norm * w;
+                g.segment<6>(jdx) += Jij_Lwj * l_err_norm * w;
+                acc.err += l_err_norm * l_err_norm * w;
+                acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                acc.addPoseLandmark( kf_idx_loc, Npt + lm_idx_loc, Jij_Lwj * Jij_Tiw.transpose() * w );
+                acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj * Jij_Lwj.transpose() * w );
             }
         }
-    }
+    } );
+    err += err_ls;
     err /= (Npt_obs+Nls_obs);
 
     // initial guess of lambda
-    int Hmax = 0.0;
-    for( int i = 0; i < N; i++)
-    {
-        if( H.coeffRef(i,i) > Hmax || H.coeffRef(i,i) < -Hmax )
-            Hmax = fabs( H.coeffRef(i,i) );
-    }
+    double Hmax = solver.maxDiagonal();
     lambda *= Hmax;
     // solve the first iteration
-    H.makeCompressed();
-    for(int i = 0; i < N; i++)
-    {
-        H.coeffRef(i,i) += lambda * H.coeffRef(i,i);
-        gdense(i) = g.coeffRef(i);
-    }
-    SimplicialLDLT< SparseMatrix<double> > solver1(H);
-    DX = solver1.solve( gdense );
+    solver.addRelativeDamping( lambda );
+    solver.solve( g, DX );
     // update KFs
     for( int i = 0; i < Nkf; i++)
     {
@@ -3414,271 +4367,223 @@ void MapHandler::levMarquardtOptimizationGBA( vector<double> X_aux, vector<int>
 
     // LM iterations
     //---------------------------------------------------------------------------------------------
+    // a rejected step leaves X unchanged, so its evaluation is reused with the new damping
+    bool   relinearize = true;
+    double lambda_damped = 0.0;
     int iters;
     for( iters = 1; iters < SlamConfig::maxItersLba(); iters++ )
     {
-        // estimate hessian and gradient (reset)
-        DX.setZero();
-        g.setZero();
-        H.setZero();
-        H.reserve( VectorXi::Constant(N,5000) );
-        err = 0.0;
-        // - point observations
-        for( vector<Vector6i>::iterator pt_it = pt_obs_list.begin(); pt_it != pt_obs_list.end(); pt_it++ )
+        if( relinearize )
         {
-            int lm_idx_map = (*pt_it)(0);
-            int lm_idx_loc = (*pt_it)(1);
-            int lm_idx_obs = (*pt_it)(2);
-            int kf_idx_map = (*pt_it)(3);
-            int kf_idx_loc = (*pt_it)(4);
-            if( map_points[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
+            // estimate hessian and gradient (reset)
+            DX.setZero();
+            g.setZero();
+            solver.setZero();
+            err = 0.0;
+            // - point observations
+            err_pt = evaluateObservations( pt_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
             {
-                // grab 3D LM (Xwj)
-                Vector3d Xwj = X.block(6*Nkf+3*lm_idx_loc,0,3,1);
-                // grab 6DoF KF (Tiw)
-                Matrix4d Tiw;
-                if( kf_idx_loc != -1 )
-                    Tiw = expmap_se3( X.block( 6*kf_idx_loc,0,6,1 ) );
-                else
-                    Tiw = map_keyframes[kf_idx_map]->T_kf_w;
-                // projection error
-                Tiw = inverse_se3( Tiw );
-                Vector3d Xwi   = Tiw.block(0,0,3,3) * Xwj + Tiw.block(0,3,3,1);
-                Vector2d p_prj = cam->projection( Xwi );
-                Vector2d p_obs = map_points[lm_idx_map]->obs_list[lm_idx_obs];
-                Vector2d p_err    = p_obs - p_prj;
-                double p_err_norm = p_err.norm();
-                // useful variables
-                double gx   = Xwi(0);
-                double gy   = Xwi(1);
-                double gz   = Xwi(2);
-                double gz2  = gz*gz;
-                gz2         = 1.0 / std::max(SlamConfig::homogTh(),gz2);
-                double fx   = cam->getFx();
-                double fy   = cam->getFy();
-                double dx   = p_err(0);
-                double dy   = p_err(1);
-                double fxdx = fx*dx;
-                double fydy = fy*dy;
-                // estimate Jacobian wrt KF pose
-                Vector6d Jij_Tiw = Vector6d::Zero();
-                Jij_Tiw << + gz2 * fxdx * gz,
-                           + gz2 * fydy * gz,
-                           - gz2 * ( fxdx*gx + fydy*gy ),
-                           - gz2 * ( fxdx*gx*gy + fydy*gy*gy + fydy*gz*gz ),
-                           + gz2 * ( fxdx*gx*gx + fxdx*gz*gz + fydy*gx*gy ),
-                           + gz2 * ( fydy*gx*gz - fxdx*gy*gz );
-                Jij_Tiw = Jij_Tiw / std::max(SlamConfig::homogTh(),p_err_norm);
-                // estimate Jacobian wrt LM
-                Vector3d Jij_Xwj = Vector3d::Zero();
-                Jij_Xwj << + gz2 * fxdx * gz,
-                           + gz2 * fydy * gz,
-                           - gz2 * ( fxdx*gx + fydy*gy );
-                Jij_Xwj = Jij_Xwj.transpose() * Tiw.block(0,0,3,3) / std::max(SlamConfig::homogTh(),p_err_norm);
-                // if employing robust cost function
-                double  w = 1.0;
-                w = robustWeightCauchy(p_err_norm) ;
-                // update hessian, gradient, and error
-                int idx = 6 * kf_idx_loc;
-                int jdx = 6*Nkf + 3*lm_idx_loc;
-                if( kf_idx_loc == -1 )
-                {
-                    err += p_err_norm * p_err_norm * w;
-                    Vector3d gi;
-                    Matrix3d Hjj;
-                    Hjj = Jij_Xwj * Jij_Xwj.transpose() * w;
-                    gi  = Jij_Xwj * p_err_norm * w;
-                    for(int i = 0; i < 3; i++)
-                    {
-                        g.coeffRef(jdx+i) += gi(i);
-                        for(int j = 0; j < 3; j++)
-                            H.coeffRef(i+jdx,j+jdx) += Hjj(i,j);
-                    }
-                }
-                else
+                int lm_idx_map = obs(0);
+                int lm_idx_loc = obs(1);
+                int lm_idx_obs = obs(2);
+                int kf_idx_map = obs(3);
+                int kf_idx_loc = obs(4);
+                if( map_points[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
                 {
-                    err += p_err_norm * p_err_norm * w;
-                    Vector3d gj;
-                    Vector6d gi;
-                    Matrix6d Hii;
-                    gi = Jij_Tiw * p_err_norm * w;
-                    gj = Jij_Xwj * p_err_norm * w;
-                    Hii = Jij_Tiw * Jij_Tiw.transpose() * w;
-                    for(int i = 0; i < 6; i++)
-                    {
-                        g.coeffRef(i+idx) += gi(i);
-                        for(int j = 0; j < 6; j++)
-                            H.coeffRef(i+idx,j+idx) += Hii(i,j);
-                    }
-                    Matrix3d Hjj;
-                    Hjj = Jij_Xwj * Jij_Xwj.transpose() * w;
-                    for(int i = 0; i < 3; i++)
+                    // grab 3D LM (Xwj)
+                    Vector3d Xwj = X.block(6*Nkf+3*lm_idx_loc,0,3,1);
+                    // grab 6DoF KF (Tiw)
+                    Matrix4d Tiw;
+                    if( kf_idx_loc != -1 )
+                        Tiw = expmap_se3( X.block( 6*kf_idx_loc,0,6,1 ) );
+                    else
+                        Tiw = map_keyframes[kf_idx_map]->T_kf_w;
+                    // projection error
+                    Tiw = inverse_se3( Tiw );
+                    Vector3d Xwi   = Tiw.block(0,0,3,3) * Xwj + Tiw.block(0,3,3,1);
+                    Vector2d p_prj = cam->projection( Xwi );
+                    Vector2d p_obs = map_points[lm_idx_map]->obs_list[lm_idx_obs];
+                    Vector2d p_err    = p_obs - p_prj;
+                    double p_err_norm = p_err.norm();
+                    // useful variables
+                    double gx   = Xwi(0);
+                    double gy   = Xwi(1);
+                    double gz   = Xwi(2);
+                    double gz2  = gz*gz;
+                    gz2         = 1.0 / std::max(SlamConfig::homogTh(),gz2);
+                    double fx   = cam->getFx();
+                    double fy   = cam->getFy();
+                    double dx   = p_err(0);
+                    double dy   = p_err(1);
+                    double fxdx = fx*dx;
+                    double fydy = fy*dy;
+                    // estimate Jacobian wrt KF pose
+                    Vector6d Jij_Tiw = Vector6d::Zero();
+                    Jij_Tiw << + gz2 * fxdx * gz,
+                               + gz2 * fydy * gz,
+                               - gz2 * ( fxdx*gx + fydy*gy ),
+                               - gz2 * ( fxdx*gx*gy + fydy*gy*gy + fydy*gz*gz ),
+                               + gz2 * ( fxdx*gx*gx + fxdx*gz*gz + fydy*gx*gy ),
+                               + gz2 * ( fydy*gx*gz - fxdx*gy*gz );
+                    Jij_Tiw = Jij_Tiw / std::max(SlamConfig::homogTh(),p_err_norm);
+                    // estimate Jacobian wrt LM
+                    Vector3d Jij_Xwj = Vector3d::Zero();
+                    Jij_Xwj << + gz2 * fxdx * gz,
+                               + gz2 * fydy * gz,
+                               - gz2 * ( fxdx*gx + fydy*gy );
+                    Jij_Xwj = Jij_Xwj.transpose() * Tiw.block(0,0,3,3) / std::max(SlamConfig::homogTh(),p_err_norm);
+                    // if employing robust cost function
+                    double  w = 1.0;
+                    w = robustWeightCauchy(p_err_norm) ;
+                    // update hessian, gradient, and error
+                    int idx = 6 * kf_idx_loc;
+                    int jdx = 6*Nkf + 3*lm_idx_loc;
+                    if( kf_idx_loc == -1 )
                     {
-                        g.coeffRef(i+jdx) += gj(i);
-                        for(int j = 0; j < 3; j++)
-                            H.coeffRef(i+jdx,j+jdx) += Hjj(i,j);
+                        acc.err += p_err_norm * p_err_norm * w;
+                        g.segment<3>(jdx) += Jij_Xwj * p_err_norm * w;
+                        acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
                     }
-                    MatrixXd Hij  = MatrixXd::Zero(3,6);
-                    Hij = Jij_Xwj * Jij_Tiw.transpose() * w;
-                    for(int i = 0; i < 3; i++)
+                    else
                     {
-                        for(int j = 0; j < 6; j++)
-                        {
-                            H.coeffRef(i+jdx,j+idx) += Hij(i,j);
-                            H.coeffRef(j+idx,i+jdx) += Hij(i,j);
-                        }
+                        acc.err += p_err_norm * p_err_norm * w;
+                        acc.g_pose.segment<6>(idx) += Jij_Tiw * p_err_norm * w;
+                        g.segment<3>(jdx) += Jij_Xwj * p_err_norm * w;
+                        acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                        acc.addPoseLandmark( kf_idx_loc, lm_idx_loc, Jij_Xwj * Jij_Tiw.transpose() * w );
+                        acc.addLandmark( lm_idx_loc, Jij_Xwj * Jij_Xwj.transpose() * w );
                     }
                 }
-            }
-        }
-        // - line segment observations
-        for( vector<Vector6i>::iterator ls_it = ls_obs_list.begin(); ls_it != ls_obs_list.end(); ls_it++ )
-        {
-            int lm_idx_map = (*ls_it)(0);
-            int lm_idx_loc = (*ls_it)(1);
-            int lm_idx_obs = (*ls_it)(2);
-            int kf_idx_map = (*ls_it)(3);
-            int kf_idx_loc = (*ls_it)(4);
-            if( map_lines[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
+            } );
+            err += err_pt;
+            // - line segment observations
+            err_ls = evaluateObservations( ls_obs_list, solver, g, [&]( const Vector6i &obs, SchurSolver::Accumulator &acc )
             {
-                // grab 3D LM (Pwj and Qwj)
-                //Vector3d Pwj   = map_lines[lm_idx_map]->line3D.head(3);
-                //Vector3d Qwj   = map_lines[lm_idx_map]->line3D.tail(3);
-                Vector3d Pwj = X.block(6*Nkf+3*Npt+3*lm_idx_loc,0,3,1);
-                Vector3d Qwj = X.block(6*Nkf+3*Npt+3*lm_idx_loc,0,3,1);
-                // grab 6DoF KF (Tiw)
-                Matrix4d Tiw   = map_keyframes[kf_idx_map]->T_kf_w;
-                // projection error
-                Tiw = inverse_se3( Tiw );
-                Vector3d Pwi   = Tiw.block(0,0,3,3) * Pwj + Tiw.block(0,3,3,1);
-                Vector3d Qwi   = Tiw.block(0,0,3,3) * Qwj + Tiw.block(0,3,3,1);
-                Vector2d p_prj = cam->projection( Pwi );
-                Vector2d q_prj = cam->projection( Qwi );
-                Vector3d l_obs = map_lines[lm_idx_map]->obs_list[lm_idx_obs];
-                Vector2d l_err;
-                l_err(0) = l_obs(0) * p_prj(0) + l_obs(1) * p_prj(1) + l_obs(2);
-                l_err(1) = l_obs(0) * q_prj(0) + l_obs(1) * q_prj(1) + l_obs(2);
-                double l_err_norm = l_err.norm();
-                // start point
-                double gx   = Pwi(0);
-                double gy   = Pwi(1);
-                double gz   = Pwi(2);
-                double gz2  = gz*gz;
-                gz2         = 1.0 / std::max(SlamConfig::homogTh(),gz2);
-                double fx   = cam->getFx();
-                double fy   = cam->getFy();
-                double lx   = l_err(0);
-                double ly   = l_err(1);
-                double fxlx = fx*lx;
-                double fyly = fy*ly;
-                // - jac. wrt. KF pose
-                Vector6d Jij_Piw = Vector6d::Zero();
-                Jij_Piw << + gz2 * fxlx * gz,
-                           + gz2 * fyly * gz,
-                           - gz2 * ( fxlx*gx + fyly*gy ),
-                           - gz2 * ( fxlx*gx*gy + fyly*gy*gy + fyly*gz*gz ),
-                           + gz2 * ( fxlx*gx*gx + fxlx*gz*gz + fyly*gx*gy ),
-                           + gz2 * ( fyly*gx*gz - fxlx*gy*gz );
-                // - jac. wrt. LM
-                Vector3d Jij_Pwj = Vector3d::Zero();
-                Jij_Pwj << + gz2 * fxlx * gz,
-                           + gz2 * fyly * gz,
-                           - gz2 * ( fxlx*gx + fyly*gy );
-                Jij_Pwj = Jij_Pwj.transpose() * Tiw.block(0,0,3,3) * l_err(0) / std::max(SlamConfig::homogTh(),l_err_norm);
-                // end point
-                gx   = Qwi(0);
-                gy   = Qwi(1);
-                gz   = Qwi(2);
-                gz2  = gz*gz;
-                gz2  = 1.0 / std::max(SlamConfig::homogTh(),gz2);
-                // - jac. wrt. KF pose
-                Vector6d Jij_Qiw = Vector6d::Zero();
-                Jij_Qiw << + gz2 * fxlx * gz,
-                           + gz2 * fyly * gz,
-                           - gz2 * ( fxlx*gx + fyly*gy ),
-                           - gz2 * ( fxlx*gx*gy + fyly*gy*gy + fyly*gz*gz ),
-                           + gz2 * ( fxlx*gx*gx + fxlx*gz*gz + fyly*gx*gy ),
-                           + gz2 * ( fyly*gx*gz - fxlx*gy*gz );
-                // - jac. wrt. LM
-                Vector3d Jij_Qwj = Vector3d::Zero();
-                Jij_Qwj << + gz2 * fxlx * gz,
-                           + gz2 * fyly * gz,
-                           - gz2 * ( fxlx*gx + fyly*gy );
-                Jij_Qwj = Jij_Qwj.transpose() * Tiw.block(0,0,3,3) * l_err(1) / std::max(SlamConfig::homogTh(),l_err_norm);
-                // estimate Jacobian wrt KF pose
-                Vector6d Jij_Tiw = Vector6d::Zero();
-                Jij_Tiw = ( Jij_Piw * l_err(0) + Jij_Qiw * l_err(1) ) / std::max(SlamConfig::homogTh(),l_err_norm);
-                // estimate Jacobian wrt LM
-                Vector6d Jij_Lwj = Vector6d::Zero();
-                Jij_Lwj.head(3) = Jij_Pwj;
-                Jij_Lwj.tail(3) = Jij_Qwj;
-                // if employing robust cost function
-                double  w = 1.0;
-                double s2 = map_lines[lm_idx_map]->sigma_list[lm_idx_obs];
-                //double w = 1.0 / ( 1.0 + l_err_norm * l_err_norm * s2 );
-                w = robustWeightCauchy(l_err_norm) ;
-                // update hessian, gradient, and error
-                VectorXd gi = VectorXd::Zero(N), gj = VectorXd::Zero(N);
-                int idx = 6 * kf_idx_loc;
-                int jdx = 6*Nkf + 3*Npt + 6*lm_idx_loc;
-                if( kf_idx_loc == -1 )
+                int lm_idx_map = obs(0);
+                int lm_idx_loc = obs(1);
+                int lm_idx_obs = obs(2);
+                int kf_idx_map = obs(3);
+                int kf_idx_loc = obs(4);
+                if( map_lines[lm_idx_map] != NULL && map_keyframes[kf_idx_map] != NULL)
                 {
-                    gj = Jij_Lwj * l_err_norm * w;
-                    err += l_err_norm * l_err_norm * w;
-                    Matrix6d Hjj;
-                    Hjj = Jij_Lwj * Jij_Lwj.transpose() * w;
-                    for(int i = 0; i < 6; i++)
+                    // grab 3D LM (Pwj and Qwj)
+                    //Vector3d Pwj   = map_lines[lm_idx_map]->line3D.head(3);
+                    //Vector3d Qwj   = map_lines[lm_idx_map]->line3D.tail(3);
+                    Vector3d Pwj = X.block(6*Nkf+3*Npt+3*lm_idx_loc,0,3,1);
+                    Vector3d Qwj = X.block(6*Nkf+3*Npt+3*lm_idx_loc,0,3,1);
+                    // grab 6DoF KF (Tiw)
+                    Matrix4d Tiw   = map_keyframes[kf_idx_map]->T_kf_w;
+                    // projection error
+                    Tiw = inverse_se3( Tiw );
+                    Vector3d Pwi   = Tiw.block(0,0,3,3) * Pwj + Tiw.block(0,3,3,1);
+                    Vector3d Qwi   = Tiw.block(0,0,3,3) * Qwj + Tiw.block(0,3,3,1);
+                    Vector2d p_prj = cam->projection( Pwi );
+                    Vector2d q_prj = cam->projection( Qwi );
+                    Vector3d l_obs = map_lines[lm_idx_map]->obs_list[lm_idx_obs];
+                    Vector2d l_err;
+                    l_err(0) = l_obs(0) * p_prj(0) + l_obs(1) * p_prj(1) + l_obs(2);
+                    l_err(1) = l_obs(0) * q_prj(0) + l_obs(1) * q_prj(1) + l_obs(2);
+                    double l_err_norm = l_err.norm();
+                    // start point
+                    double gx   = Pwi(0);
+                    double gy   = Pwi(1);
+                    double gz   = Pwi(2);
+                    double gz2  = gz*gz;
+                    gz2         = 1.0 / std::max(SlamConfig::homogTh(),gz2);
+                    double fx   = cam->getFx();
+                    double fy   = cam->getFy();
+                    double lx   = l_err(0);
+                    double ly   = l_err(1);
+                    double fxlx = fx*lx;
+                    double fyly = fy*ly;
+                    // - jac. wrt. KF pose
+                    Vector6d Jij_Piw = Vector6d::Zero();
+                    Jij_Piw << + gz2 * fxlx * gz,
+                               + gz2 * fyly * gz,
+                               - gz2 * ( fxlx*gx + fyly*gy ),
+                               - gz2 * ( fxlx*gx*gy + fyly*gy*gy + fyly*gz*gz ),
+                               + gz2 * ( fxlx*gx*gx + fxlx*gz*gz + fyly*gx*gy ),
+                               + gz2 * ( fyly*gx*gz - fxlx*gy*gz );
+                    // - jac. wrt. LM
+                    Vector3d Jij_Pwj = Vector3d::Zero();
+                    Jij_Pwj << + gz2 * fxlx * gz,
+                               + gz2 * fyly * gz,
+                               - gz2 * ( fxlx*gx + fyly*gy );
+                    Jij_Pwj = Jij_Pwj.transpose() * Tiw.block(0,0,3,3) * l_err(0) / std::max(SlamConfig::homogTh(),l_err_norm);
+                    // end point
+                    gx   = Qwi(0);
+                    gy   = Qwi(1);
+                    gz   = Qwi(2);
+                    gz2  = gz*gz;
+                    gz2  = 1.0 / std::max(SlamConfig::homogTh(),gz2);
+                    // - jac. wrt. KF pose
+                    Vector6d Jij_Qiw = Vector6d::Zero();
+                    Jij_Qiw << + gz2 * fxlx * gz,
+                               + gz2 * fyly * gz,
+                               - gz2 * ( fxlx*gx + fyly*gy ),
+                               - gz2 * ( fxlx*gx*gy + fyly*gy*gy + fyly*gz*gz ),
+                               + gz2 * ( fxlx*gx*gx + fxlx*gz*gz + fyly*gx*gy ),
+                               + gz2 * ( fyly*gx*gz - fxlx*gy*gz );
+                    // - jac. wrt. LM
+                    Vector3d Jij_Qwj = Vector3d::Zero();
+                    Jij_Qwj << + gz2 * fxlx * gz,
+                               + gz2 * fyly * gz,
+                               - gz2 * ( fxlx*gx + fyly*gy );
+                    Jij_Qwj = Jij_Qwj.transpose() * Tiw.block(0,0,3,3) * l_err(1) / std::max(SlamConfig::homogTh(),l_err_norm);
+                    // estimate Jacobian wrt KF pose
+                    Vector6d Jij_Tiw = Vector6d::Zero();
+                    Jij_Tiw = ( Jij_Piw * l_err(0) + Jij_Qiw * l_err(1) ) / std::max(SlamConfig::homogTh(),l_err_norm);
+                    // estimate Jacobian wrt LM
+                    Vector6d Jij_Lwj = Vector6d::Zero();
+                    Jij_Lwj.head(3) = Jij_Pwj;
+                    Jij_Lwj.tail(3) = Jij_Qwj;
+                    // if employing robust cost function
+                    double  w = 1.0;
+                    double s2 = map_lines[lm_idx_map]->sigma_list[lm_idx_obs];
+                    //double w = 1.0 / ( 1.0 + l_err_norm * l_err_norm * s2 );
+                    w = robustWeightCauchy(l_err_norm) ;
+                    // update hessian, gradient, and error
+                    int idx = 6 * kf_idx_loc;
+                    int jdx = 6*Nkf + 3*Npt + 6*lm_idx_loc;
+                    if( kf_idx_loc == -1 )
                     {
-                        g.coeffRef(jdx+i) += gj(i);
-                        for(int j = 0; j < 6; j++)
-                            H.coeffRef(i+jdx,j+jdx) += Hjj(i,j);
+                        g.segment<6>(jdx) += Jij_Lwj * l_err_norm * w;
+                        acc.err += l_err_norm * l_err_norm * w;
+                        acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj * Jij_Lwj.transpose() * w );
                     }
-                }
-                else
-                {
-                    gi = Jij_Tiw * l_err_norm * w;
-                    gj = Jij_Lwj * l_err_norm * w;
-                    err += l_err_norm * l_err_norm * w;
-                    Matrix6d Hii, Hjj;
-                    MatrixXd Hij   = MatrixXd::Zero(3,6);
-                    Hii = Jij_Tiw * Jij_Tiw.transpose() * w;
-                    Hjj = Jij_Lwj * Jij_Lwj.transpose() * w;
-                    Hij = Jij_Lwj * Jij_Tiw.transpose() * w;
-                    for(int i = 0; i < 6; i++)
+                    else
                     {
-                        g.coeffRef(i+idx) += gi(i);
-                        g.coeffRef(i+jdx) += gj(i);
-                        for(int j = 0; j < 6; j++)
-                        {
-                            H.coeffRef(idx+i,idx+j) += Hii(i,j);
-                            H.coeffRef(jdx+i,jdx+j) += Hjj(i,j);
-                            H.coeffRef(idx+i,jdx+j) += Hij(i,j);
-                            H.coeffRef(jdx+j,idx+i) += Hij(j,i);
-                        }
+                        acc.g_pose.segment<6>(idx) += Jij_Tiw * l_err_norm * w;
+                        g.segment<6>(jdx) += Jij_Lwj * l_err_norm * w;
+                        acc.err += l_err_norm * l_err_norm * w;
+                        acc.addPose( kf_idx_loc, Jij_Tiw * Jij_Tiw.transpose() * w );
+                        acc.addPoseLandmark( kf_idx_loc, Npt + lm_idx_loc, Jij_Lwj * Jij_Tiw.transpose() * w );
+                        acc.addLandmark( Npt + lm_idx_loc, Jij_Lwj * Jij_Lwj.transpose() * w );
                     }
                 }
-            }
+            } );
+            err += err_ls;
+            err /= (Npt_obs+Nls_obs);
         }
-        err /= (Npt_obs+Nls_obs);
+        else
+            solver.removeRelativeDamping( lambda_damped );
         // if the difference is very small stop
         if( abs(err-err_prev) < numeric_limits<double>::epsilon() || err < numeric_limits<double>::epsilon() )
             break;
         // add lambda to diagonal
-        for(int i = 0; i < N; i++)
-            H.coeffRef(i,i) += lambda * H.coeffRef(i,i) ;
+        solver.addRelativeDamping( lambda );
+        lambda_damped = lambda;
         // solve iteration
-        H.makeCompressed();
-        for( int i = 0; i < N; i++)
-            gdense(i) = g.coeffRef(i);
-        SimplicialLDLT< SparseMatrix<double> > solver1(H);
-        DX = solver1.solve( gdense );
+        solver.solve( g, DX );
         // update lambda
         if( err > err_prev ){
             lambda /= lambda_k;
+            relinearize = false;
         }
         else
         {
             lambda *= lambda_k;
+            relinearize = true;
             // update KFs
             for( int i = 0; i < Nkf; i++)
             {
@@ -3731,319 +4636,511 @@ void MapHandler::levMarquardtOptimizationGBA( vector<double> X_aux, vector<int>
 
 void MapHandler::removeBadMapLandmarks()
 {
+    PROFILE_SCOPE("MapHandler::removeBadMapLandmarks");
+    cullLandmarks( false );
+}
+
+//pluker
+void MapHandler::removeBadMapLandmarksForPluker()
+{
+    PROFILE_SCOPE("MapHandler::removeBadMapLandmarksForPluker");
+    cullLandmarks( true );
+}
+
+void MapHandler::queueCullCandidate( MapPoint* pt )
+{
+    if( pt != NULL && !pt->cull_pending )
+    {
+        pt->cull_pending = true;
+        cull_pt_idx.push_back( pt->idx );
+    }
+}
+
+void MapHandler::queueCullCandidate( MapLine* ls )
+{
+    if( ls != NULL && !ls->cull_pending )
+    {
+        ls->cull_pending = true;
+        cull_ls_idx.push_back( ls->idx );
+    }
+}
+
+void MapHandler::cullLandmarks( bool pluker_lines )
+{
+
+    // only the candidates are visited: LMs are refined (inlier flag, observations) while they are
+    // local, so once out of the local map and old enough their status does not change anymore
 
     // point features
-    for( vector<MapPoint*>::iterator pt_it = map_points.begin(); pt_it != map_points.end(); pt_it++)
+    int n_pending = 0;
+    for( int lm_idx : cull_pt_idx )
     {
-        if( (*pt_it)!=NULL )
+        MapPoint* pt = map_points[lm_idx];
+        if( pt == NULL )
+            continue;
+        // back in the local map, queued again when leaving it
+        if( pt->local )
+        {
+            pt->cull_pending = false;
+            continue;
+        }
+        // too recent, checked again after the next KFs
+        if( max_kf_idx - pt->kf_obs_list[0] <= 10 )
+        {
+            cull_pt_idx[n_pending++] = lm_idx;
+            continue;
+        }
+        pt->cull_pending = false;
+        if( pt->inlier == false || pt->obs_list.size() < SlamConfig::minLMObs() )
         {
-            if( (*pt_it)->local == false && max_kf_idx - (*pt_it)->kf_obs_list[0] > 10 )
+            int kf_obs = pt->kf_obs_list[0];
+            // remove idx from KeyFrame stereo points
+            for(vector<PointFeature*>::iterator st_pt = map_keyframes[kf_obs]->stereo_frame->stereo_pt.begin();
+                st_pt != map_keyframes[kf_obs]->stereo_frame->stereo_pt.end(); st_pt++ )
             {
-                if( (*pt_it)->inlier == false || (*pt_it)->obs_list.size() < SlamConfig::minLMObs() )
+                if( (*st_pt)->idx == lm_idx )
                 {
-                    int kf_obs = (*pt_it)->kf_obs_list[0];
-                    int lm_idx = (*pt_it)->idx;
-                    // remove idx from KeyFrame stereo points
-                    for(vector<PointFeature*>::iterator st_pt = map_keyframes[kf_obs]->stereo_frame->stereo_pt.begin();
-                        st_pt != map_keyframes[kf_obs]->stereo_frame->stereo_pt.end(); st_pt++ )
-                    {
-                        if( (*st_pt)->idx == lm_idx )
-                        {
-                            (*st_pt)->idx = -1;
-                            break;
-                        }
-                    }
-                    // remove from map_points_kf_idx
-                    int iter = 0;
-                    for( auto it = map_points_kf_idx.at(kf_obs).begin(); it != map_points_kf_idx.at(kf_obs).end(); it++, iter++)
-                    {
-                        if( (*it) == lm_idx )
-                        {
-                            map_points_kf_idx.at(kf_obs).erase( map_points_kf_idx.at(kf_obs).begin() + iter );
-                            break;
-                        }
-                    }
-                    // remove LM
-                    delete (*pt_it);
-                    (*pt_it) = nullptr;
+                    (*st_pt)->idx = -1;
+                    break;
                 }
             }
+            // remove from map_points_kf_idx
+            vector<int> &kf_pts = map_points_kf_idx.at(kf_obs);
+            vector<int>::iterator it = find( kf_pts.begin(), kf_pts.end(), lm_idx );
+            if( it != kf_pts.end() )
+                kf_pts.erase( it );
+            // remove LM
+            kf_redundancy.remove( pt->kf_obs_list );
+            delete pt;
+            map_points[lm_idx] = nullptr;
+            live_pts.erase( lm_idx );
         }
     }
+    cull_pt_idx.resize( n_pending );
 
     // line features
-    for( vector<MapLine*>::iterator ls_it = map_lines.begin(); ls_it != map_lines.end(); ls_it++)
+    n_pending = 0;
+    for( int lm_idx : cull_ls_idx )
     {
-        if((*ls_it) != NULL)
+        MapLine* ls = map_lines[lm_idx];
+        if( ls == NULL )
+            continue;
+        if( ls->local )
         {
-            if( (*ls_it)->local == false && max_kf_idx-(*ls_it)->kf_obs_list[0] > 10 )
+            ls->cull_pending = false;
+            continue;
+        }
+        if( max_kf_idx - ls->kf_obs_list[0] <= 10 )
+        {
+            cull_ls_idx[n_pending++] = lm_idx;
+            continue;
+        }
+        ls->cull_pending = false;
+        int n_obs = pluker_lines ? ls->NDw_obs_list.size() : ls->obs_list.size();
+        if( ls->inlier == false || n_obs < SlamConfig::minLMObs() )
+        {
+            int kf_obs = ls->kf_obs_list[0];
+            // remove idx from KeyFrame stereo lines
+            for(vector<LineFeature*>::iterator st_ls = map_keyframes[kf_obs]->stereo_frame->stereo_ls.begin();
+                st_ls != map_keyframes[kf_obs]->stereo_frame->stereo_ls.end(); st_ls++ )
             {
-                if( (*ls_it)->inlier == false || (*ls_it)->obs_list.size() < SlamConfig::minLMObs() )
+                if( (*st_ls)->idx == lm_idx )
                 {
-                    int kf_obs = (*ls_it)->kf_obs_list[0];
-                    int lm_idx = (*ls_it)->idx;
-                    // remove idx from KeyFrame stereo points
-                    for(vector<LineFeature*>::iterator st_ls = map_keyframes[kf_obs]->stereo_frame->stereo_ls.begin();
-                        st_ls != map_keyframes[kf_obs]->stereo_frame->stereo_ls.end(); st_ls++ )
-                    {
-                        if( (*st_ls)->idx == lm_idx )
-                        {
-                            (*st_ls)->idx = -1;
-                            break;
-                        }
-                    }
-                    // remove from map_points_kf_idx
-                    int iter = 0;
-                    for( auto it = map_lines_kf_idx.at(kf_obs).begin(); it != map_lines_kf_idx.at(kf_obs).end(); it++, iter++)
-                    {
-                        if( (*it) == lm_idx )
-                        {
-                            map_lines_kf_idx.at(kf_obs).erase( map_lines_kf_idx.at(kf_obs).begin() + iter );
-                            break;
-                        }
-                    }
-
-                    // remove LM
-                    delete (*ls_it);
-                    (*ls_it) = nullptr;
+                    (*st_ls)->idx = -1;
+                    break;
                 }
             }
+            // remove from map_lines_kf_idx
+            vector<int> &kf_lines = map_lines_kf_idx.at(kf_obs);
+            vector<int>::iterator it = find( kf_lines.begin(), kf_lines.end(), lm_idx );
+            if( it != kf_lines.end() )
+                kf_lines.erase( it );
+            // remove LM
+            kf_redundancy.remove( ls->kf_obs_list );
+            delete ls;
+            map_lines[lm_idx] = nullptr;
+            live_ls.erase( lm_idx );
         }
     }
+    cull_ls_idx.resize( n_pending );
+
 }
 
-//pluker
-void MapHandler::removeBadMapLandmarksForPluker()
+int MapHandler::removeRedundantKFs( double time_budget )
 {
+    PROFILE_SCOPE("MapHandler::removeRedundantKFs");
 
-    // point features
-    for( vector<MapPoint*>::iterator pt_it = map_points.begin(); pt_it != map_points.end(); pt_it++)
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+    // KFs referenced by a loop closure and the ones the LC thread has not processed yet are kept
+    vector<bool> lc_kfs( map_keyframes.size(), false );
+    for( const Vector3i &lc_idx : lc_idx_list )
+    {
+        lc_kfs[ lc_idx(0) ] = true;
+        lc_kfs[ lc_idx(1) ] = true;
+    }
+    int last_kf_idx = min( int(max_kf_idx) - 2, lc_last_kf_idx.load() );
+
+    // rank the candidates by the tracked ratio of redundant landmarks (no feature is visited here)
+    vector<pair<double,int>> candidates;
+    for( int i_kf : live_kfs )
+    {
+        KeyFrame* kf = map_keyframes[i_kf];
+        if( kf == NULL || kf->local || i_kf <= 1 || i_kf > last_kf_idx || lc_kfs[i_kf] || submaps.frozen(i_kf) ||
+            isRigLastKF(i_kf) )
+            continue;
+        int n_lms = kf_redundancy.landmarks(i_kf);
+        double ratio = (n_lms > 0) ? double(kf_redundancy.redundant(i_kf)) / double(n_lms) : 0.0;
+        if( ratio >= SlamConfig::maxCommonFtsKF() )
+            candidates.push_back( make_pair(ratio, i_kf) );
+    }
+    sort( candidates.begin(), candidates.end(),
+          [](const pair<double,int> &c1, const pair<double,int> &c2) { return c1.first > c2.first; } );
+
+    // verify and remove them until the budget is spent or a new KF is waiting
+    int n_culled = 0;
+    for( const pair<double,int> &c : candidates )
     {
-        if( (*pt_it)!=NULL )
+        double elapsed = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - t0 ).count();
+        if( (time_budget > 0.0 && elapsed > time_budget) || !kf_queue.empty() )
+            break;
+        if( isRedundantKF( c.second ) )
         {
-            if( (*pt_it)->local == false && max_kf_idx - (*pt_it)->kf_obs_list[0] > 10 )
-            {
-                if( (*pt_it)->inlier == false || (*pt_it)->obs_list.size() < SlamConfig::minLMObs() )
-                {
-                    int kf_obs = (*pt_it)->kf_obs_list[0];
-                    int lm_idx = (*pt_it)->idx;
-                    // remove idx from KeyFrame stereo points
-                    for(vector<PointFeature*>::iterator st_pt = map_keyframes[kf_obs]->stereo_frame->stereo_pt.begin();
-                        st_pt != map_keyframes[kf_obs]->stereo_frame->stereo_pt.end(); st_pt++ )
-                    {
-                        if( (*st_pt)->idx == lm_idx )
-                        {
-                            (*st_pt)->idx = -1;
-                            break;
-                        }
-                    }
-                    // remove from map_points_kf_idx
-                    int iter = 0;
-                    for( auto it = map_points_kf_idx.at(kf_obs).begin(); it != map_points_kf_idx.at(kf_obs).end(); it++, iter++)
-                    {
-                        if( (*it) == lm_idx )
-                        {
-                            map_points_kf_idx.at(kf_obs).erase( map_points_kf_idx.at(kf_obs).begin() + iter );
-                            break;
-                        }
-                    }
-                    // remove LM
-                    delete (*pt_it);
-                    (*pt_it) = nullptr;
-                }
-            }
+            removeKeyFrame( c.second );
+            n_culled++;
         }
     }
 
-    // line features
-    for( vector<MapLine*>::iterator ls_it = map_lines.begin(); ls_it != map_lines.end(); ls_it++)
+    // the persistent LBA graph may still refer to the removed KFs
+    if( n_culled > 0 )
+        resetLBAGraph();
+
+    return n_culled;
+}
+
+MapHandler::MapMemory MapHandler::memoryUsage() const
+{
+    MapMemory mem;
+    for( int i_kf : live_kfs )
     {
-        if((*ls_it) != NULL)
-        {
-            if( (*ls_it)->local == false && max_kf_idx-(*ls_it)->kf_obs_list[0] > 10 )
-            {
-                if( (*ls_it)->inlier == false || (*ls_it)->NDw_obs_list.size() < SlamConfig::minLMObs() )
-                {
-                    int kf_obs = (*ls_it)->kf_obs_list[0];
-                    int lm_idx = (*ls_it)->idx;
-                    // remove idx from KeyFrame stereo points
-                    for(vector<LineFeature*>::iterator st_ls = map_keyframes[kf_obs]->stereo_frame->stereo_ls.begin();
-                        st_ls != map_keyframes[kf_obs]->stereo_frame->stereo_ls.end(); st_ls++ )
-                    {
-                        if( (*st_ls)->idx == lm_idx )
-                        {
-                            (*st_ls)->idx = -1;
-                            break;
-                        }
-                    }
-                    // remove from map_points_kf_idx
-                    int iter = 0;
-                    for( auto it = map_lines_kf_idx.at(kf_obs).begin(); it != map_lines_kf_idx.at(kf_obs).end(); it++, iter++)
-                    {
-                        if( (*it) == lm_idx )
-                        {
-                            map_lines_kf_idx.at(kf_obs).erase( map_lines_kf_idx.at(kf_obs).begin() + iter );
-                            break;
-                        }
-                    }
+        const KeyFrame* kf = map_keyframes[i_kf];
+        StVO::FrameMemory fm = kf->memoryUsage();
+        mem.kf_images   += fm.images;
+        mem.kf_features += fm.features + sizeof(KeyFrame) + sizeof(StereoFrame);
+    }
+    for( int i_pt : live_pts )
+    {
+        const MapPoint* pt = map_points[i_pt];
+        mem.lm_descriptors  += pt->desc_list.bytes();
+        mem.lm_observations += pt->observationBytes() + sizeof(MapPoint);
+    }
+    for( int i_ls : live_ls )
+    {
+        const MapLine* ls = map_lines[i_ls];
+        mem.lm_descriptors  += ls->desc_list.bytes();
+        mem.lm_observations += ls->observationBytes() + sizeof(MapLine);
+    }
+    mem.lm_observations += StVO::vectorBytes(map_keyframes) + StVO::vectorBytes(map_points) + StVO::vectorBytes(map_lines);
+    mem.lm_paged = lm_pager.pagedBytes();
+
+    mem.graphs = full_graph.memoryUsage() + pose_graph.memoryUsage() + StVO::mapBytes(map_points_kf_idx) + StVO::mapBytes(map_lines_kf_idx)
+               + StVO::mapBytes(kf_pose_info) + StVO::vectorBytes(lba_kf_vertex) + StVO::vectorBytes(lba_pt_vertex) + StVO::vectorBytes(lba_ls_vertex)
+               + StVO::vectorBytes(lba_pt_edges) + StVO::vectorBytes(lba_ls_edges);
+    for( const auto &lm_kfs : map_points_kf_idx )
+        mem.graphs += StVO::vectorBytes(lm_kfs.second);
+    for( const auto &lm_kfs : map_lines_kf_idx )
+        mem.graphs += StVO::vectorBytes(lm_kfs.second);
+    for( const vector<EdgePosePoint*> &edges : lba_pt_edges )
+        mem.graphs += StVO::vectorBytes(edges);
+    for( const vector<EdgePoseLine*> &edges : lba_ls_edges )
+        mem.graphs += StVO::vectorBytes(edges);
+
+    if( dbow_voc_p )
+        mem.vocabulary += dbow_voc_p->memoryUsage();
+    if( dbow_voc_l && dbow_voc_l != dbow_voc_p )
+        mem.vocabulary += dbow_voc_l->memoryUsage();
+    return mem;
+}
 
-                    // remove LM
-                    delete (*ls_it);
-                    (*ls_it) = nullptr;
-                }
-            }
-        }
+void MapHandler::enforceMemoryBudget()
+{
+    const double mb = 1024.0 * 1024.0;
+    const double budget_img   = SlamConfig::memBudgetImages()    * mb;
+    const double budget_lm    = SlamConfig::memBudgetLandmarks() * mb;
+    const double budget_total = SlamConfig::memBudgetTotal()     * mb;
+    Profiler &prof = Profiler::instance();
+    if( budget_img <= 0.0 && budget_lm <= 0.0 && budget_total <= 0.0 && !prof.enabled() )
+        return;
+
+    PROFILE_SCOPE("MapHandler::enforceMemoryBudget");
+
+    MapMemory mem = memoryUsage();
+    auto overTotal = [&]() { return budget_total > 0.0 && mem.total() > budget_total; };
+
+    // image dropping: the KFs out of the local map are compacted, the oldest first
+    int n_compacted = 0;
+    for( int i_kf = 0; i_kf < int(map_keyframes.size()); i_kf++ )
+    {
+        if( !( (budget_img > 0.0 && mem.kf_images > budget_img) || overTotal() ) )
+            break;
+        KeyFrame* kf = map_keyframes[i_kf];
+        if( kf == NULL || kf->local || kf->compact )
+            continue;
+        StVO::FrameMemory before = kf->memoryUsage();
+        kf->makeCompact( SlamConfig::kfThumbnailScale() );
+        StVO::FrameMemory after = kf->memoryUsage();
+        mem.kf_images   -= min( mem.kf_images,   before.images   - min( before.images,   after.images ) );
+        mem.kf_features -= min( mem.kf_features, before.features - min( before.features, after.features ) );
+        n_compacted++;
+    }
+
+    // observation pruning: the non-local landmarks keep their last mem_prune_desc_rows descriptors
+    int n_pruned = 0;
+    auto overLandmarks = [&]() { return ( budget_lm > 0.0 && mem.lm_descriptors + mem.lm_observations > budget_lm ) || overTotal(); };
+    const int max_rows = SlamConfig::memPruneDescRows();
+    for( int i_pt : live_pts )
+    {
+        if( !overLandmarks() )
+            break;
+        MapPoint* pt = map_points[i_pt];
+        if( pt->local )
+            continue;
+        size_t desc_bytes = pt->desc_list.bytes(), obs_bytes = pt->observationBytes();
+        pt->compactObservations( max_rows );
+        mem.lm_descriptors  -= min( mem.lm_descriptors,  desc_bytes - min( desc_bytes, pt->desc_list.bytes() ) );
+        mem.lm_observations -= min( mem.lm_observations, obs_bytes  - min( obs_bytes,  pt->observationBytes() ) );
+        if( pt->desc_list.bytes() < desc_bytes )
+            n_pruned++;
+    }
+    for( int i_ls : live_ls )
+    {
+        if( !overLandmarks() )
+            break;
+        MapLine* ls = map_lines[i_ls];
+        if( ls->local )
+            continue;
+        size_t desc_bytes = ls->desc_list.bytes(), obs_bytes = ls->observationBytes();
+        ls->compactObservations( max_rows );
+        mem.lm_descriptors  -= min( mem.lm_descriptors,  desc_bytes - min( desc_bytes, ls->desc_list.bytes() ) );
+        mem.lm_observations -= min( mem.lm_observations, obs_bytes  - min( obs_bytes,  ls->observationBytes() ) );
+        if( ls->desc_list.bytes() < desc_bytes )
+            n_pruned++;
+    }
+
+    // KF culling, also without kf_culling, once nothing else can be released
+    int n_culled = 0;
+    if( overTotal() && kf_queue.empty() && lc_state == LC_IDLE )
+    {
+        n_culled = removeRedundantKFs( SlamConfig::kfCullTimeBudget() );
+        if( n_culled > 0 )
+            LOG_INFO( "[MapHandler] memory budget: culled " << n_culled << " KFs" );
+    }
+    if( n_compacted > 0 || n_pruned > 0 || n_culled > 0 )
+        mem = memoryUsage();
+
+    bool over = overTotal();
+    if( over && !mem_over_budget )
+        LOG_WARN( "[MapHandler] memory budget exceeded: " << int(mem.total() / mb) << " MB in the map" );
+    mem_over_budget = over;
+
+    if( prof.enabled() )
+    {
+        prof.setGauge( "MapHandler::bytes.kf_images",       mem.kf_images );
+        prof.setGauge( "MapHandler::bytes.kf_features",     mem.kf_features );
+        prof.setGauge( "MapHandler::bytes.lm_descriptors",  mem.lm_descriptors );
+        prof.setGauge( "MapHandler::bytes.lm_observations", mem.lm_observations );
+        prof.setGauge( "MapHandler::bytes.lm_paged",        mem.lm_paged );
+        prof.setGauge( "MapHandler::bytes.graphs",          mem.graphs );
+        prof.setGauge( "MapHandler::bytes.vocabulary",      mem.vocabulary );
+        prof.setGauge( "MapHandler::bytes.total",           mem.total() );
+        prof.addCount( "MapHandler::memCompactedKFs", n_compacted );
+        prof.addCount( "MapHandler::memPrunedLMs",    n_pruned );
+        prof.addCount( "MapHandler::memCulledKFs",    n_culled );
     }
 }
 
-void MapHandler::removeRedundantKFs()
+bool MapHandler::isRedundantKF( int kf_idx )
 {
+    const KeyFrame* kf = map_keyframes[kf_idx];
+    const int min_others = kf_redundancy.minOthers();
 
-    // select which KFs are going to remove
-    vector<int> kf_idxs;
-    for( vector<KeyFrame*>::iterator kf_it = map_keyframes.begin(); kf_it != map_keyframes.end(); kf_it++)
+    // exact count, which also resyncs the tracked counters of the KF
+    int n_lms = 0, n_red = 0;
+    for( const PointFeature* st_pt : kf->stereo_frame->stereo_pt )
     {
-        if((*kf_it) != NULL)
-        {
-            int kf_idx = (*kf_it)->kf_idx;
-            if( !(*kf_it)->local && kf_idx > 1 && kf_idx < max_kf_idx )
-            {
-                // estimate number of landmarks observed by this KF
-                int n_feats = 0;
-                for( vector<PointFeature*>::iterator pt_it = (*kf_it)->stereo_frame->stereo_pt.begin();
-                     pt_it != (*kf_it)->stereo_frame->stereo_pt.end(); pt_it++ )
-                {
-                    if( (*pt_it)->idx != -1 )
-                        n_feats++;
-                }
-                for( vector<LineFeature*>::iterator ls_it = (*kf_it)->stereo_frame->stereo_ls.begin();
-                     ls_it != (*kf_it)->stereo_frame->stereo_ls.end(); ls_it++)
-                {
-                    if( (*ls_it)->idx != -1 )
-                        n_feats++;
-                }
-                int max_n_feats = int( SlamConfig::maxCommonFtsKF() * double(n_feats) );
-                // check if the KF is redundant
-                int n_graph = full_graph.size();
-                for(int i = 0; i < n_graph-1, i != kf_idx; i++)
-                {
-                    if( map_keyframes[i] != NULL )
-                    {
-                        if( full_graph[kf_idx][i] > n_feats )
-                            kf_idxs.push_back(kf_idx);
-                    }
-                }
-            }
-        }
-    }
-
-    // eliminate KFs, LMs observed only by this KFs, and all observations from this KF
-    for( int i = 0; i < kf_idxs.size(); i++)
+        if( st_pt == NULL || st_pt->idx == -1 || map_points[st_pt->idx] == NULL )
+            continue;
+        const vector<int> &kf_obs = map_points[st_pt->idx]->kf_obs_list;
+        set<int> others( kf_obs.begin(), kf_obs.end() );
+        others.erase( kf_idx );
+        n_lms++;
+        if( int(others.size()) >= min_others )
+            n_red++;
+    }
+    for( const LineFeature* st_ls : kf->stereo_frame->stereo_ls )
     {
-        int kf_idx = kf_idxs[i];
-        if( map_keyframes[kf_idx] != NULL )
-        {
-            // delete observation from map_points_kf_idx
-            if( !(map_points_kf_idx.find(kf_idx) == map_points_kf_idx.end()) )
-            {
-                for( auto it = map_points_kf_idx.at(kf_idx).begin(); it != map_points_kf_idx.at(kf_idx).end(); it++)
-                {
-                    if( map_points[(*it)] != NULL &&  map_points[(*it)]->kf_obs_list.size() <= 1 )
-                    {
-                        bool found = false;
-                        for( int k = 1; k < map_points[(*it)]->kf_obs_list.size(); k++)
-                        {
-                            map_points_kf_idx.find( map_points[(*it)]->kf_obs_list[k] );
-                            int new_kf_base = map_points[(*it)]->kf_obs_list[k];    // if the second dont exist...
-                            if( !(map_points_kf_idx.find(new_kf_base)==map_points_kf_idx.end()) )
-                            {
-                                map_points_kf_idx.at(new_kf_base).push_back( (*it) );
-                                found = true;
-                            }
-                        }
-                        if( !found )
-                            map_points[(*it)]->inlier = false;
-                    }
-                }
-                map_points_kf_idx.erase(kf_idx);
-            }
+        if( st_ls == NULL || st_ls->idx == -1 || map_lines[st_ls->idx] == NULL )
+            continue;
+        const vector<int> &kf_obs = map_lines[st_ls->idx]->kf_obs_list;
+        set<int> others( kf_obs.begin(), kf_obs.end() );
+        others.erase( kf_idx );
+        n_lms++;
+        if( int(others.size()) >= min_others )
+            n_red++;
+    }
+    kf_redundancy.reset( kf_idx, n_lms, n_red );
+
+    return n_lms > 0 && double(n_red) >= SlamConfig::maxCommonFtsKF() * double(n_lms);
+}
 
-            // delete observation from map_lines_kf_idx
-            for( auto it = map_lines_kf_idx.at(kf_idx).begin(); it != map_lines_kf_idx.at(kf_idx).end(); it++)
-            {
-                if( map_points[(*it)]!= NULL )
-                {
-                    int new_kf_base = map_lines[(*it)]->kf_obs_list[1];
-                    map_lines_kf_idx.at(new_kf_base).push_back( (*it) );
-                }
-            }
-            map_lines_kf_idx.erase(kf_idx);
+void MapHandler::removeKeyFrame( int kf_idx )
+{
+    detachKeyFrame( kf_idx );
+    erasePoseInformation( kf_idx );
 
-            // iterate over point features
-            for( vector<PointFeature*>::iterator pt_it = map_keyframes[kf_idx]->stereo_frame->stereo_pt.begin();
-                 pt_it != map_keyframes[kf_idx]->stereo_frame->stereo_pt.end(); pt_it++)
-            {
-                int pt_idx = (*pt_it)->idx;
-                if( pt_idx != -1 )
-                {
-                    if( map_points[pt_idx] != NULL )
-                    {
-                        for( int j = 0; j < map_points[pt_idx]->obs_list.size(); j++)
-                        {
-                            if( map_points[pt_idx]->kf_obs_list[j] == kf_idx )
-                            {
-                                // delete observation
-                                map_points[pt_idx]->desc_list.erase( map_points[pt_idx]->desc_list.begin() + j );
-                                map_points[pt_idx]->obs_list.erase( map_points[pt_idx]->obs_list.begin() + j );
-                                map_points[pt_idx]->dir_list.erase( map_points[pt_idx]->dir_list.begin() + j );
-                                map_points[pt_idx]->kf_obs_list.erase( map_points[pt_idx]->kf_obs_list.begin() + j );
-                                // update main descriptor and direction
-                                map_points[pt_idx]->updateAverageDescDir();
-                            }
-                        }
-                    }
-                }
-            }
+    // update full graph
+    full_graph.clearNode( kf_idx );
 
-            // iterate over line segment features
-            for( vector<LineFeature*>::iterator ls_it = map_keyframes[kf_idx]->stereo_frame->stereo_ls.begin();
-                 ls_it != map_keyframes[kf_idx]->stereo_frame->stereo_ls.end(); ls_it++)
-            {
-                int ls_idx = (*ls_it)->idx;
-                if( ls_idx != -1 )
-                {
-                    if( map_lines[ls_idx] != NULL )
-                    {
-                        for( int j = 0; j < map_lines[ls_idx]->obs_list.size(); j++)
-                        {
-                            if( map_lines[ls_idx]->kf_obs_list[j] == kf_idx )
-                            {
-                                // delete observation
-                                map_lines[ls_idx]->desc_list.erase( map_lines[ls_idx]->desc_list.begin() + j );
-                                map_lines[ls_idx]->obs_list.erase( map_lines[ls_idx]->obs_list.begin() + j );
-                                map_lines[ls_idx]->dir_list.erase( map_lines[ls_idx]->dir_list.begin() + j );
-                                map_lines[ls_idx]->kf_obs_list.erase( map_lines[ls_idx]->kf_obs_list.begin() + j );
-                                map_lines[ls_idx]->pts_list.erase( map_lines[ls_idx]->pts_list.begin() + j );
-                                // update main descriptor and direction
-                                map_lines[ls_idx]->updateAverageDescDir();
-                            }
-                        }
-                    }
-                }
-            }
+    // erase KF
+    delete map_keyframes[kf_idx];
+    map_keyframes[kf_idx] = nullptr;
+    live_kfs.erase( kf_idx );
+}
+
+int MapHandler::reduceOldKFs()
+{
+    const int n_keep = SlamConfig::pgRetentionKFs();
+    if( n_keep <= 0 )
+        return 0;
+
+    PROFILE_SCOPE("MapHandler::reduceOldKFs");
 
-            // update full graph
-            for( int k = 0; k < full_graph.size()-1; k++ )
+    // the cursor only moves past the visited KFs that are reduced or culled, the old ones still in
+    // the local map (revisited places) are visited again by the next calls
+    int n_reduced = 0;
+    bool contiguous = true;
+    for( int i_kf = reduced_kf_idx; i_kf < int(map_keyframes.size()) - n_keep; i_kf++ )
+    {
+        KeyFrame* kf = map_keyframes[i_kf];
+        if( kf != NULL && !kf->reduced )
+        {
+            if( kf->local || isRigLastKF(i_kf) )
             {
-                full_graph[kf_idx][k] = 0;
-                full_graph[k][kf_idx] = 0;
+                contiguous = false;
+                continue;
             }
-
-            // erase KF
-            delete map_keyframes[kf_idx];
-            map_keyframes[kf_idx] = nullptr;
+            reduceKeyFrame( i_kf );
+            n_reduced++;
         }
+        if( contiguous )
+            reduced_kf_idx = i_kf + 1;
     }
+    if( n_reduced > 0 )
+        Profiler::instance().addCount( "MapHandler::reducedKFs", n_reduced );
+    return n_reduced;
+}
+
+void MapHandler::reduceKeyFrame( int kf_idx )
+{
+    KeyFrame* kf = map_keyframes[kf_idx];
+
+    // the covisibility weights are kept, they are the edges of the pose graph of the LC (weighted by
+    // kf_pose_info), and so are the left features and descriptors to verify and fuse new loops
+    detachKeyFrame( kf_idx );
+    if( !kf->compact )
+        kf->makeCompact( SlamConfig::kfThumbnailScale() );
+    kf->reduced = true;
+    live_kfs.touch( kf_idx );
+}
+
+void MapHandler::detachKeyFrame( int kf_idx )
+{
+    KeyFrame* kf = map_keyframes[kf_idx];
+
+    // point features: remove the observations of kf, the LMs only observed by kf are erased
+    for( PointFeature* st_pt : kf->stereo_frame->stereo_pt )
+    {
+        if( st_pt == NULL || st_pt->idx == -1 )
+            continue;
+        int lm_idx = st_pt->idx;
+        st_pt->idx = -1;
+        MapPoint* pt = map_points[lm_idx];
+        if( pt == NULL )
+            continue;
+        vector<int>::iterator obs_it = find( pt->kf_obs_list.begin(), pt->kf_obs_list.end(), kf_idx );
+        if( obs_it == pt->kf_obs_list.end() )
+            continue;
+        int j = obs_it - pt->kf_obs_list.begin();
+        kf_redundancy.remove( pt->kf_obs_list );
+        lm_pager.pageIn( pt );
+        if( pt->kf_obs_list.size() == 1 )
+        {
+            delete pt;
+            map_points[lm_idx] = nullptr;
+            live_pts.erase( lm_idx );
+            continue;
+        }
+        // the next observer becomes the base KF
+        if( j == 0 )
+            map_points_kf_idx.at( pt->kf_obs_list[1] ).push_back( lm_idx );
+        if( pt->sigma_list.size() == pt->kf_obs_list.size() )
+            pt->sigma_list.erase( pt->sigma_list.begin() + j );
+        pt->desc_list.erase( j );
+        pt->obs_list.erase( pt->obs_list.begin() + j );
+        pt->dir_list.erase( pt->dir_list.begin() + j );
+        pt->kf_obs_list.erase( pt->kf_obs_list.begin() + j );
+        pt->updateAverageDescDir();
+        kf_redundancy.add( pt->kf_obs_list );
+        queueCullCandidate( pt );
+    }
+
+    // line segment features (the Plücker lines only keep NDw_obs_list)
+    for( LineFeature* st_ls : kf->stereo_frame->stereo_ls )
+    {
+        if( st_ls == NULL || st_ls->idx == -1 )
+            continue;
+        int lm_idx = st_ls->idx;
+        st_ls->idx = -1;
+        MapLine* ls = map_lines[lm_idx];
+        if( ls == NULL )
+            continue;
+        vector<int>::iterator obs_it = find( ls->kf_obs_list.begin(), ls->kf_obs_list.end(), kf_idx );
+        if( obs_it == ls->kf_obs_list.end() )
+            continue;
+        int j = obs_it - ls->kf_obs_list.begin();
+        kf_redundancy.remove( ls->kf_obs_list );
+        lm_pager.pageIn( ls );
+        if( ls->kf_obs_list.size() == 1 )
+        {
+            delete ls;
+            map_lines[lm_idx] = nullptr;
+            live_ls.erase( lm_idx );
+            continue;
+        }
+        if( j == 0 )
+            map_lines_kf_idx.at( ls->kf_obs_list[1] ).push_back( lm_idx );
+        const size_t n_obs = ls->kf_obs_list.size();
+        if( ls->sigma_list.size() == n_obs )
+            ls->sigma_list.erase( ls->sigma_list.begin() + j );
+        if( ls->obs_list.size() == n_obs )
+            ls->obs_list.erase( ls->obs_list.begin() + j );
+        if( ls->dir_list.size() == n_obs )
+            ls->dir_list.erase( ls->dir_list.begin() + j );
+        if( ls->pts_list.size() == n_obs )
+            ls->pts_list.erase( ls->pts_list.begin() + j );
+        if( ls->NDw_obs_list.size() == n_obs )
+            ls->NDw_obs_list.erase( ls->NDw_obs_list.begin() + j );
+        ls->desc_list.erase( j );
+        ls->kf_obs_list.erase( ls->kf_obs_list.begin() + j );
+        ls->updateAverageDescDir();
+        kf_redundancy.add( ls->kf_obs_list );
+        queueCullCandidate( ls );
+    }
+
+    // the base KF lists are kept (empty) so that every kf_idx stays valid
+    map_points_kf_idx.at( kf_idx ).clear();
+    map_lines_kf_idx.at( kf_idx ).clear();
+    kf_redundancy.reset( kf_idx, 0, 0 );
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------
@@ -4052,25 +5149,25 @@ void MapHandler::removeRedundantKFs()
 
 void MapHandler::loopClosure()
 {
+    PROFILE_SCOPE("MapHandler::loopClosure");
 
     Timer timer;
 
     // look for loop closure candidates
-    int kf_prev_idx, kf_curr_idx;
-    kf_curr_idx = max_kf_idx;
+    int kf_curr_idx = max_kf_idx;
+    vector<int> kf_prev_idxs;
     timer.start();
-    bool is_lc_candidate = lookForLoopCandidates(kf_curr_idx,kf_prev_idx);
+    bool is_lc_candidate = lookForLoopCandidates(kf_curr_idx,kf_prev_idxs);
     time(4) = timer.stop(); // ms
 
     // compute relative transformation if it is LC candidate
     if( is_lc_candidate )
     {
         vector<Vector4i> lc_pt_idx, lc_ls_idx;
-        vector<PointFeature*> lc_points;
-        vector<LineFeature*>  lc_lines;
         Vector6d pose_inc;
         timer.start();
-        bool isLC = isLoopClosure( map_keyframes[kf_prev_idx], map_keyframes[kf_curr_idx], pose_inc, lc_pt_idx, lc_ls_idx, lc_points, lc_lines );
+        int kf_prev_idx = verifyLoopCandidates( map_keyframes[kf_curr_idx], kf_prev_idxs, pose_inc, lc_pt_idx, lc_ls_idx );
+        bool isLC = ( kf_prev_idx >= 0 );
         time(5) = timer.stop(); //ms
         // if it is loop closure, add information and update status
         if( isLC )
@@ -4093,11 +5190,6 @@ void MapHandler::loopClosure()
             if( lc_state == LC_ACTIVE )
                 lc_state = LC_READY;
         }
-
-        for (PointFeature* pt : lc_points)
-            delete pt;
-        for (LineFeature* ls : lc_lines)
-            delete ls;
     }
     else
     {
@@ -4115,189 +5207,109 @@ void MapHandler::loopClosure()
     }
 }
 
-void MapHandler::insertKFBowVectorP( KeyFrame* kf  )
-{
-
-    // transform Mat to vector<Mat>
-    vector<Mat> curr_desc;
-    curr_desc.reserve( kf->stereo_frame->pdesc_l.rows );
-    for ( int i = 0; i < kf->stereo_frame->pdesc_l.rows; i++ )
-        curr_desc.push_back( kf->stereo_frame->pdesc_l.row(i) );
-    // transform to DBoW2::BowVector
-    dbow_voc_p.transform( curr_desc, kf->descDBoW_P );
-
-    // fill the confusion matrix for the new KF
-    int idx = kf->kf_idx;
-    for( int i = 0; i < idx; i++)
-    {
-        if( map_keyframes[i] != NULL )
-        {
-            double score = dbow_voc_p.score( kf->descDBoW_P, map_keyframes[i]->descDBoW_P );
-            conf_matrix[idx][i] = score;
-            conf_matrix[i][idx] = score;
-        }
-    }
-    conf_matrix[idx][idx] = dbow_voc_p.score( kf->descDBoW_P, kf->descDBoW_P );
-}
-
-void MapHandler::insertKFBowVectorL( KeyFrame* kf  )
-{
-
-    // transform Mat to vector<Mat>
-    vector<Mat> curr_desc;
-    curr_desc.reserve( kf->stereo_frame->ldesc_l.rows );
-    for ( int i = 0; i < kf->stereo_frame->ldesc_l.rows; i++ )
-        curr_desc.push_back( kf->stereo_frame->ldesc_l.row(i) );
-    // transform to DBoW2::BowVector
-    dbow_voc_l.transform( curr_desc, kf->descDBoW_L );
-
-    // fill the confusion matrix for the new KF
-    int idx = kf->kf_idx;
-    for( int i = 0; i < idx; i++)
-    {
-        if( map_keyframes[i] != NULL )
-        {
-            double score = dbow_voc_l.score( kf->descDBoW_L, map_keyframes[i]->descDBoW_L );
-            conf_matrix[idx][i] = score;
-            conf_matrix[i][idx] = score;
-        }
-    }
-    conf_matrix[idx][idx] = dbow_voc_l.score( kf->descDBoW_L, kf->descDBoW_L );
-}
-
-void MapHandler::insertKFBowVectorPL( KeyFrame* kf  )
+bool MapHandler::lookForLoopCandidates( int kf_curr_idx, vector<int> &kf_prev_idxs )
 {
+    PROFILE_SCOPE("MapHandler::lookForLoopCandidates");
+    kf_prev_idxs.clear();
 
-    // Point Features
-    // --------------------------------------------------------------
-    // transform Mat to vector<Mat>
-    vector<Mat> curr_desc;
-    curr_desc.reserve( kf->stereo_frame->pdesc_l.rows );
-    for ( int i = 0; i < kf->stereo_frame->pdesc_l.rows; i++ )
-        curr_desc.push_back( kf->stereo_frame->pdesc_l.row(i) );
-    // transform to DBoW2::BowVector
-    dbow_voc_p.transform( curr_desc, kf->descDBoW_P );
-
-    // estimate dispersion of point features
-    vector<double> pt_x, pt_y;
-    for (PointFeature* pt : kf->stereo_frame->stereo_pt)
-    {
-        pt_x.push_back( pt->pl(0) );
-        pt_y.push_back( pt->pl(1) );
-    }
-    double std_pt = vector_stdv( pt_x ) + vector_stdv( pt_y );
-    int    n_pt   = pt_x.size();
-
-    // Line Segment Features
-    // --------------------------------------------------------------
-    // transform Mat to vector<Mat>
-    curr_desc.clear();
-    curr_desc.reserve( kf->stereo_frame->ldesc_l.rows );
-    for ( int i = 0; i < kf->stereo_frame->ldesc_l.rows; i++ )
-        curr_desc.push_back( kf->stereo_frame->ldesc_l.row(i) );
-    // transform to DBoW2::BowVector
-    dbow_voc_l.transform( curr_desc, kf->descDBoW_L );
-
-    // estimate dispersion of point features
-    vector<double> ls_x, ls_y;
-    for (LineFeature* ls : kf->stereo_frame->stereo_ls)
-    {
-        Vector2d mp;
-        mp << (ls->spl + ls->epl)*0.5;
-        ls_x.push_back( mp(0) );
-        ls_y.push_back( mp(1) );
-    }
-    double std_ls = vector_stdv( ls_x ) + vector_stdv( ls_y );
-    double std_pl = std_ls + std_pt;
-    int    n_ls  = ls_x.size();
-    int    n_pl  = n_pt + n_ls;
-
-    // Combined Approach
-    // --------------------------------------------------------------
-    // fill the confusion matrix for the new KF
-    double score, score_p, score_l;
-    int idx = kf->kf_idx;
-    for( int i = 0; i < idx; i++)
-    {
-        if( map_keyframes[i] != NULL )
-        {
-            score_p = dbow_voc_p.score( kf->descDBoW_P, map_keyframes[i]->descDBoW_P );
-            score_l = dbow_voc_l.score( kf->descDBoW_L, map_keyframes[i]->descDBoW_L );
-            score = 0.0;
-            score += ( score_p * n_pt   + score_l * n_ls   ) / n_pl;    // strategy#1
-            score += ( score_p * std_pt + score_l * std_ls ) / std_pl;  // strategy#2
-            conf_matrix[idx][i] = score;
-            conf_matrix[i][idx] = score;
-        }
-    }
-    score_p = dbow_voc_p.score( kf->descDBoW_P, kf->descDBoW_P );
-    score_l = dbow_voc_l.score( kf->descDBoW_L, kf->descDBoW_L);
-    score = 0.0;
-    score += ( score_p * n_pt   + score_l * n_ls   ) / n_pl;    // strategy#1
-    score += ( score_p * std_pt + score_l * std_ls ) / std_pl;  // strategy#2
-    conf_matrix[idx][idx] = score;
-}
-
-bool MapHandler::lookForLoopCandidates( int kf_curr_idx, int &kf_prev_idx )
-{
-    bool is_lc_candidate = false;
-    kf_prev_idx = -1;
+    KeyFrame* kf_curr = map_keyframes[kf_curr_idx];
+    if( kf_curr == NULL )
+        return false;
 
-    // find the best matches
-    vector<Vector2d> max_confmat;
-    for(int i = 0; i < kf_curr_idx - SlamConfig::lcKFDist(); i++)
-    {
-        if( map_keyframes[i] != NULL )
-        {
-            Vector2d aux;
-            aux(0) = i;
-            aux(1) = conf_matrix[i][kf_curr_idx];
-            max_confmat.push_back( aux );
-        }
-    }
+    // find the best matches (only KFs sharing words with the current one are visited)
+    int max_kf_idx = kf_curr_idx - SlamConfig::lcKFDist() - 1;
+    vector<pair<int,double>> candidates;
+    place_rec.query( kf_curr, max_kf_idx, SlamConfig::lcMaxCandidates(), map_keyframes, candidates );
 
-    // if there are enough matches..
-    if( max_confmat.size() > SlamConfig::lcKFMaxDist() )
+    // if there are enough KFs to look for a loop..
+    if( max_kf_idx >= SlamConfig::lcKFMaxDist() && !candidates.empty() )
     {
-        sort( max_confmat.begin(), max_confmat.end(), sort_confmat_by_score() );
-
         // find the minimum score in the covisibility graph
         double lc_min_score = 1.0;
-        for( int i = 0; i < kf_curr_idx; i++ )
+        vector<int> cov_kfs;
+        covisibleKFs( kf_curr_idx, SlamConfig::minLMCovGraph(), SlamConfig::minKFLocalMap()+3, cov_kfs );
+        for( int i : cov_kfs )
         {
-            if( full_graph[i][kf_curr_idx] >= SlamConfig::minLMCovGraph() || kf_curr_idx - i <= SlamConfig::minKFLocalMap()+3 )
-            {
-                double score_i = conf_matrix[i][kf_curr_idx];
-                if( score_i < lc_min_score && score_i > 0.001 )
-                    lc_min_score = score_i;
-            }
+            double score_i = place_rec.score( kf_curr, map_keyframes[i] );
+            if( score_i < lc_min_score && score_i > 0.001 )
+                lc_min_score = score_i;
         }
 
-        // the best match must has an score above lc_dbow_score_max
-        int idx_max = int( max_confmat[0](0) );
-        int Nkf_closest = 0;
-        if( max_confmat[0](1) >= lc_min_score )
+        // the best matches (sorted by score) must have an score above lc_dbow_score_max
+        for( int c = 0; c < candidates.size() && candidates[c].second >= lc_min_score &&
+                        int(kf_prev_idxs.size()) < SlamConfig::lcVerifyCandidates(); c++ )
         {
-            // there must be at least lc_nkf_closest KFs conected to the LC candidate with a score above lc_dbow_score_min
-            for( int i = 1; i < max_confmat.size(); i++ )
+            // there must be at least lc_nkf_closest KFs in the group of the LC candidate with a score above lc_dbow_score_min
+            int idx_max = candidates[c].first;
+            int Nkf_closest = 0;
+            for( int i = 0; i < candidates.size(); i++ )
             {
-                int idx = int( max_confmat[i](0) );
-                // frame closest && connected by the cov_graph && score > lc_dbow_score_min
-                if( abs(idx-idx_max) <= SlamConfig::lcKFMaxDist() &&
-                    max_confmat[i](1) >= lc_min_score * 0.8 )
+                int idx = candidates[i].first;
+                if( i == c ) continue;
+                // frame closest or connected by the cov_graph && score > lc_dbow_score_min
+                bool same_group = abs(idx-idx_max) <= SlamConfig::lcKFMaxDist() ||
+                                  int(full_graph.weight(idx,idx_max)) >= SlamConfig::minLMCovGraph();
+                if( same_group && candidates[i].second >= lc_min_score * 0.8 )
                     Nkf_closest++;
             }
 
             // update in case of being loop closure candidate
             if( Nkf_closest >= SlamConfig::lcNKFClosest() )
-            {
-                is_lc_candidate = true;
-                kf_prev_idx     = idx_max;
-            }
+                kf_prev_idxs.push_back( idx_max );
         }
     }
 
-    return is_lc_candidate;
+    return !kf_prev_idxs.empty();
+}
+
+int MapHandler::verifyLoopCandidates( const KeyFrame* kf, const vector<int> &kf_idxs, Vector6d &pose_inc,
+                                      vector<Vector4i> &lc_pt_idx, vector<Vector4i> &lc_ls_idx )
+{
+    PROFILE_SCOPE("MapHandler::verifyLoopCandidates");
+
+    // one verification per candidate on the pool, the ones ranked after an accepted candidate are skipped
+    const int n = kf_idxs.size();
+    vector<Vector6d> poses(n);
+    vector<vector<Vector4i>> pt_idxs(n), ls_idxs(n);
+    std::atomic<int> best(n);
+    auto verify = [&]( int r )
+    {
+        if( best.load() < r )
+            return;
+        vector<PointFeature*> lc_points;
+        vector<LineFeature*>  lc_lines;
+        bool is_lc = isLoopClosure( map_keyframes[kf_idxs[r]], kf, poses[r], pt_idxs[r], ls_idxs[r], lc_points, lc_lines );
+        for (PointFeature* pt : lc_points)
+            delete pt;
+        for (LineFeature* ls : lc_lines)
+            delete ls;
+        int b = best.load();
+        while( is_lc && r < b && !best.compare_exchange_weak(b, r) ) {}
+    };
+
+    if( n > 1 && ThreadPool::global().size() > 1 )
+    {
+        vector<std::future<void>> tasks;
+        tasks.reserve(n);
+        for( int r = 0; r < n; r++ )
+            tasks.push_back( ThreadPool::global().submit(verify, r) );
+        for( std::future<void> &t : tasks )
+            ThreadPool::global().wait(t);
+    }
+    else
+    {
+        for( int r = 0; r < n; r++ )
+            verify(r);
+    }
+
+    // the best ranked candidate passing the verification
+    const int b = best.load();
+    if( b == n )
+        return -1;
+    pose_inc = poses[b];
+    lc_pt_idx.swap( pt_idxs[b] );
+    lc_ls_idx.swap( ls_idxs[b] );
+    return kf_idxs[b];
 }
 
 bool MapHandler::isLoopClosure( const KeyFrame* kf0, const KeyFrame* kf1, Vector6d &pose_inc,
@@ -4331,16 +5343,16 @@ bool MapHandler::isLoopClosure( const KeyFrame* kf0, const KeyFrame* kf1, Vector
     if( SlamConfig::hasPoints() && !kf1->stereo_frame->stereo_pt.empty() && !kf0->stereo_frame->stereo_pt.empty() )
     {
         vector<int> matches_12;
-        common_pt = match(kf0->stereo_frame->pdesc_l, kf1->stereo_frame->pdesc_l, SlamConfig::minRatio12P(), matches_12);
+        common_pt = matchKFDescriptors(kf0, kf1, false, matches_12);
 
         for (int i1 = 0; i1 < matches_12.size(); ++i1) {
             const int i2 = matches_12[i1];
             if (i2 < 0) continue;
 
-            // save data for optimization
+            // save data for optimization (with the disparity in kf1 for the minimal solver)
             Vector3d P       = kf0->stereo_frame->stereo_pt[i1]->P;
             Vector2d pl_obs  = kf1->stereo_frame->stereo_pt[i2]->pl;
-            PointFeature* pt = new PointFeature( P, pl_obs );
+            PointFeature* pt = new PointFeature( pl_obs, kf1->stereo_frame->stereo_pt[i2]->disp, P, pl_obs );
             lc_points.push_back(pt);
             // save indices for fusing LMs
             Vector4i idx;
@@ -4357,7 +5369,7 @@ bool MapHandler::isLoopClosure( const KeyFrame* kf0, const KeyFrame* kf1, Vector
     if( SlamConfig::hasLines() && !kf1->stereo_frame->stereo_ls.empty() && !kf0->stereo_frame->stereo_ls.empty() )
     {
         vector<int> matches_12;
-        common_ls = match(kf0->stereo_frame->ldesc_l, kf1->stereo_frame->ldesc_l, SlamConfig::minRatio12L(), matches_12);
+        common_ls = matchKFDescriptors(kf0, kf1, true, matches_12);
 
         for (int i1 = 0; i1 < matches_12.size(); ++i1) {
             const int i2 = matches_12[i1];
@@ -4410,6 +5422,99 @@ bool MapHandler::isLoopClosure( const KeyFrame* kf0, const KeyFrame* kf1, Vector
 
 }
 
+bool MapHandler::initRelativePoseRANSAC( vector<PointFeature*> &lc_points, vector<LineFeature*> &lc_lines,
+                                         Matrix4d &T_inc ) const
+{
+    PROFILE_SCOPE("MapHandler::initRelativePoseRANSAC");
+
+    // the points are triangulated in both KFs, a sample of 3 gives a pose hypothesis (absolute orientation)
+    const int n_pt = lc_points.size(), n_ls = lc_lines.size();
+    const int n_hyps = SlamConfig::lcRansacHyps();
+    if( n_hyps <= 0 || n_pt < 3 )
+        return false;
+
+    const double th = sqrt(7.815);
+    auto inlier = [&]( const Matrix4d &T, int k )
+    {
+        if( k < n_pt )
+        {
+            const PointFeature* pt = lc_points[k];
+            Vector3d P_ = T.block<3,3>(0,0) * pt->P + T.block<3,1>(0,3);
+            return P_(2) > 0.0 && ( cam->projection( P_ ) - pt->pl_obs ).norm() < th;
+        }
+        const LineFeature* ls = lc_lines[k-n_pt];
+        Vector3d sP_ = T.block<3,3>(0,0) * ls->sP + T.block<3,1>(0,3);
+        Vector3d eP_ = T.block<3,3>(0,0) * ls->eP + T.block<3,1>(0,3);
+        if( sP_(2) <= 0.0 || eP_(2) <= 0.0 )
+            return false;
+        Vector2d spl_proj = cam->projection( sP_ );
+        Vector2d epl_proj = cam->projection( eP_ );
+        Vector2d err_i;
+        err_i(0) = ls->le_obs(0) * spl_proj(0) + ls->le_obs(1) * spl_proj(1) + ls->le_obs(2);
+        err_i(1) = ls->le_obs(0) * epl_proj(0) + ls->le_obs(1) * epl_proj(1) + ls->le_obs(2);
+        return err_i.norm() < th;
+    };
+
+    // hypotheses from non-degenerate samples (fixed seed, the verification is repeatable)
+    std::mt19937 rnd(n_pt * 7919 + n_ls);
+    std::uniform_int_distribution<int> pick(0, n_pt-1);
+    vector<Matrix4d, Eigen::aligned_allocator<Matrix4d>> hyps;
+    hyps.reserve(n_hyps);
+    for( int trial = 0; trial < 4 * n_hyps && int(hyps.size()) < n_hyps; trial++ )
+    {
+        int i0 = pick(rnd), i1 = pick(rnd), i2 = pick(rnd);
+        if( i0 == i1 || i0 == i2 || i1 == i2 )
+            continue;
+        Matrix3d P0, P1;
+        int k = 0;
+        for( int i : { i0, i1, i2 } )
+        {
+            const PointFeature* pt = lc_points[i];
+            P0.col(k)   = pt->P;
+            P1.col(k++) = cam->backProjection( pt->pl(0), pt->pl(1), pt->disp );
+        }
+        if( (P0.col(1)-P0.col(0)).cross(P0.col(2)-P0.col(0)).norm() < 1e-4 )
+            continue;
+        hyps.push_back( umeyama( P0, P1, false ) );
+    }
+    if( hyps.empty() )
+        return false;
+
+    // preemptive scoring: the observations are scored in blocks and half of the hypotheses drop after each block
+    const int block = 10;
+    vector<int> order( n_pt + n_ls );
+    for( int k = 0; k < order.size(); k++ )
+        order[k] = k;
+    std::shuffle( order.begin(), order.end(), rnd );
+    vector<pair<int,int>> score( hyps.size() ); // (inliers, hypothesis)
+    for( int h = 0; h < score.size(); h++ )
+        score[h] = make_pair(0, h);
+    for( int start = 0; start < order.size() && score.size() > 1; start += block )
+    {
+        const int end = std::min<int>( start + block, order.size() );
+        for( pair<int,int> &s : score )
+            for( int k = start; k < end; k++ )
+                s.first += inlier( hyps[s.second], order[k] );
+        sort( score.begin(), score.end(),
+              [](const pair<int,int> &a, const pair<int,int> &b) { return a.first > b.first; } );
+        score.resize( std::max<int>( 1, score.size() / 2 ) );
+    }
+
+    // the inliers of the best hypothesis start the robust GN
+    const Matrix4d &T_best = hyps[score[0].second];
+    int n_inl = 0;
+    for( int k = 0; k < n_pt + n_ls; k++ )
+        n_inl += inlier( T_best, k );
+    if( n_inl < 6 )
+        return false;
+    for( int k = 0; k < n_pt; k++ )
+        lc_points[k]->inlier = inlier( T_best, k );
+    for( int k = 0; k < n_ls; k++ )
+        lc_lines[k]->inlier = inlier( T_best, n_pt + k );
+    T_inc = T_best;
+    return true;
+}
+
 bool MapHandler::computeRelativePoseGN( vector<PointFeature*> &lc_points, vector<LineFeature*> &lc_lines,
                                         vector<Vector4i>      &lc_pt_idx, vector<Vector4i>     &lc_ls_idx,
                                         Vector6d &pose_inc) const
@@ -4682,6 +5787,9 @@ bool MapHandler::computeRelativePoseRobustGN( vector<PointFeature*> &lc_points,
     // create GN variables
     Vector6d x_inc = Vector6d::Zero(), x_prev = Vector6d::Zero();
     Matrix4d T_inc = Matrix4d::Identity(), T_prev = Matrix4d::Zero();
+
+    // start from the best minimal-solver hypothesis and its inliers (identity and all the matches otherwise)
+    initRelativePoseRANSAC( lc_points, lc_lines, T_inc );
     Matrix6d H_l, H_p, H;
     Vector6d g_l, g_p, g;
     H = Matrix6d::Zero();
@@ -5143,10 +6251,11 @@ bool MapHandler::loopClosureOptimizationEssGraphG2O()
     // introduce edges
     for( int i = kf_prev_idx; i <= kf_curr_idx; i++ )
     {
-        for( int j = i+1; j <= kf_curr_idx; j++ )
+        vector<int> edge_kfs;
+        graphSuccessors( i, kf_curr_idx, SlamConfig::minLMEssGraph(), edge_kfs );
+        for( int j : edge_kfs )
         {
-            if( map_keyframes[i] != NULL && map_keyframes[j] != NULL &&
-                ( full_graph[i][j] >= SlamConfig::minLMEssGraph() || abs(i-j) == 1  ) )
+            if( map_keyframes[i] != NULL && map_keyframes[j] != NULL )
             {
                 // kf2kf constraint
                 Matrix4d T_ji_constraint = inverse_se3( map_keyframes[i]->T_kf_w ) * map_keyframes[j]->T_kf_w;
@@ -5157,7 +6266,7 @@ bool MapHandler::loopClosureOptimizationEssGraphG2O()
                 Vector6d x;
                 x = reverse_se3(logmap_se3(T_ji_constraint) );
                 e_se3->setMeasurement( g2o::SE3Quat::exp(x) );
-                e_se3->setInformation( Matrix6d::Identity() );
+                e_se3->setInformation( poseConstraintInformation(i,j) );
                 optimizer.addEdge( e_se3 );
             }
         }
@@ -5292,6 +6401,12 @@ bool MapHandler::loopClosureOptimizationEssGraphG2O()
 
     // fuse local map from both sides of the loop and update graphs
     loopClosureFuseLandmarks();
+    fuseDuplicatePoints();
+
+    // the whole map has been corrected
+    live_kfs.touchAll();
+    live_pts.touchAll();
+    live_ls.touchAll();
 
     lc_state = LC_IDLE;
 
@@ -5301,20 +6416,9 @@ bool MapHandler::loopClosureOptimizationEssGraphG2O()
 bool MapHandler::loopClosureOptimizationCovGraphG2O()
 {
 
-    // define G2O variables
-    //g2o::SparseOptimizer optimizer;
-    //optimizer.setVerbose(false);
-    //g2o::BlockSolver_6_3::LinearSolverType* linearSolver;
-    //linearSolver = new g2o::LinearSolverCholmod<g2o::BlockSolver_6_3::PoseMatrixType>();
-    //g2o::BlockSolver_6_3* solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
-    //g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
-     typedef g2o::BlockSolver<g2o::BlockSolverTraits<6,3>> BlockSolverType;
-    typedef g2o::LinearSolverCholmod<BlockSolverType::PoseMatrixType> LinearSolverType;
-    auto solver = new g2o::OptimizationAlgorithmLevenberg(g2o::make_unique<BlockSolverType>(
-            g2o::make_unique<LinearSolverType>()));
-    g2o::SparseOptimizer optimizer;
-    solver->setUserLambdaInit(1e-10);
-    optimizer.setAlgorithm(solver);
+    // the graph is built under the shared map lock, the optimization runs without it and the
+    // correction is applied under the exclusive one
+    SharedLock map_lk(map_mutex);
 
     // select min and max KF indices
     int kf_prev_idx =  2 * max_kf_idx;
@@ -5327,157 +6431,162 @@ bool MapHandler::loopClosureOptimizationCovGraphG2O()
             kf_curr_idx = (*it)(1);
     }
     kf_prev_idx = 0;
-
-    // grab the KFs included in the optimization
-    vector<int> kf_list;
-    for( int i = kf_prev_idx; i <= kf_curr_idx; i++)
+    // with sub-maps the KFs of the sub-map of the loop are solved from its first KF on, and each
+    // closed sub-map before it is a single rigid vertex (its origin) chained to the next one, with
+    // the loops of its KFs expressed from the origin (the first sub-map fixes the gauge)
+    bool submap_lc = SlamConfig::submapMaxKFs() > 0 && kf_curr_idx >= 0;
+    int s_lc = submap_lc ? submaps.of(kf_curr_idx) : 0;
+    if( submap_lc )
+        kf_prev_idx = max( 0, submaps.firstKF(s_lc) );
+    // KF handles of sub-map s are [ firstKF(s), firstKF(s+1) )
+    vector<int> origin_kf( s_lc, -1 );
+    for( int s = 0; s < s_lc; s++ )
     {
-        if( map_keyframes[i] != NULL )
+        int end_idx = submaps.firstKF(s+1) >= 0 ? submaps.firstKF(s+1) : kf_prev_idx;
+        for( int i = max( 0, submaps.firstKF(s) ); i < end_idx && origin_kf[s] < 0; i++ )
+            if( map_keyframes[i] != NULL )
+                origin_kf[s] = i;
+    }
+
+    // the pose graph persists between loops (pgo_incremental) and only the KFs from the oldest one
+    // closing a new loop on are solved, otherwise it is rebuilt and solved from kf_prev_idx
+    if( !SlamConfig::pgoIncremental() )
+        pose_graph.clear();
+    int first_idx = kf_prev_idx;
+    if( SlamConfig::pgoIncremental() )
+    {
+        int oldest_idx = kf_curr_idx;
+        // (the loop of a culled KF is re-anchored in the graph, or can not be added anymore)
+        for( auto it = lc_idx_list.begin(); it != lc_idx_list.end(); it++ )
         {
-            // check if it is a LC vertex
-            bool is_lc_i = false;
-            bool is_lc_j = false;
-            int id = 0;
-            for( auto it = lc_idx_list.begin(); it != lc_idx_list.end(); it++, id++ )
-            {
-                if( (*it)(0) == i )
-                {
-                    is_lc_i = true;
-                    break;
-                }
-                if( (*it)(1) == i )
-                {
-                    is_lc_j = true;
-                    break;
-                }
-            }
-            kf_list.push_back(i);
-            // create SE3 vertex
-            g2o::VertexSE3* v_se3 = new g2o::VertexSE3();
-            v_se3->setId(i);
-            v_se3->setMarginalized( false );
-            if( is_lc_j )
-            {
-                // update pose of LC vertex
-                v_se3->setFixed(false);
-                v_se3->setEstimate( g2o::SE3Quat::exp( reverse_se3(logmap_se3( (expmap_se3(lc_pose_list[id])) * map_keyframes[lc_idx_list[id](0)]->T_kf_w )) ) );
-            }
-            else
-            {
-                v_se3->setEstimate( g2o::SE3Quat::exp( reverse_se3(map_keyframes[i]->x_kf_w) ) );
-                if( i == 0 )
-                    v_se3->setFixed(true);
-            }
-            optimizer.addVertex( v_se3 );
+            int i = (*it)(0), j = (*it)(1);
+            int i_graph = i < kf_prev_idx ? PoseGraph::submapVertex( submaps.of(i) ) : i;
+            if( !pose_graph.hasEdge( i_graph, j, true ) && map_keyframes[i] != NULL && map_keyframes[j] != NULL )
+                oldest_idx = min( oldest_idx, max( i, kf_prev_idx ) );
         }
+        first_idx = max( first_idx, oldest_idx );
     }
 
-    // introduce edges
-    for( int i = kf_prev_idx; i <= kf_curr_idx; i++ )
+    // the KFs of the closed sub-maps leave the graph (their loops with the old KFs go with them)
+    for( int i = 0; i < kf_prev_idx; i++ )
+        if( pose_graph.hasVertex(i) )
+            pose_graph.removeVertex(i);
+
+    // update the KF vertices to the current poses (culled KFs leave the graph), and grab the KFs
+    // solved by the optimization with their poses before optimizing
+    vector<int> kf_list;
+    vector<Matrix4d> kf_poses;
+    for( int i = kf_prev_idx; i <= kf_curr_idx; i++)
     {
-        for( int j = i+1; j <= kf_curr_idx; j++ )
+        if( map_keyframes[i] == NULL )
         {
-            if( map_keyframes[i] != NULL && map_keyframes[j] != NULL &&
-                ( full_graph[i][j] >= SlamConfig::minLMEssGraph() || full_graph[i][j] >= SlamConfig::minLMCovGraph() || abs(i-j) == 1  ) )
-            {
-                // kf2kf constraint
-                Matrix4d T_ji_constraint = inverse_se3( map_keyframes[i]->T_kf_w ) * map_keyframes[j]->T_kf_w;
-                // add edge
-                g2o::EdgeSE3* e_se3 = new g2o::EdgeSE3();
-                e_se3->setVertex( 0, optimizer.vertex(i) );
-                e_se3->setVertex( 1, optimizer.vertex(j) );
-                Vector6d x;
-                x = reverse_se3(logmap_se3(T_ji_constraint) );
-                e_se3->setMeasurement( g2o::SE3Quat::exp(x) );
-                e_se3->setInformation( Matrix6d::Identity() );
-                optimizer.addEdge( e_se3 );
-            }
+            pose_graph.removeVertex(i);
+            continue;
+        }
+        pose_graph.setVertex( i, map_keyframes[i]->T_kf_w, i == 0 );
+        if( i >= first_idx )
+        {
+            kf_list.push_back(i);
+            kf_poses.push_back(map_keyframes[i]->T_kf_w);
         }
     }
-
-    // introduce loop closure edges
+    // LC vertices start from the pose of the loop
     int id = 0;
     for( auto it = lc_idx_list.begin(); it != lc_idx_list.end(); it++, id++ )
     {
-        // add edge
-        g2o::EdgeSE3* e_se3 = new g2o::EdgeSE3();
-        e_se3->setVertex( 0, optimizer.vertex((*it)(0)) );
-        e_se3->setVertex( 1, optimizer.vertex((*it)(1)) );
-        Vector6d x;
-        x = reverse_se3( lc_pose_list[id] );
-        e_se3->setMeasurement( g2o::SE3Quat::exp(x) );
-        e_se3->information() = Matrix6d::Identity();
-        optimizer.addEdge( e_se3 );
+        int i = (*it)(0), j = (*it)(1);
+        if( j >= first_idx && j >= kf_prev_idx && map_keyframes[i] != NULL && map_keyframes[j] != NULL )
+            pose_graph.setVertex( j, expmap_se3(lc_pose_list[id]) * map_keyframes[i]->T_kf_w );
     }
 
-    // optimize graph
-    optimizer.initializeOptimization();
-    optimizer.computeInitialGuess();
-    optimizer.computeActiveErrors();
-    optimizer.optimize(SlamConfig::maxItersPGO());
+    // sub-map origins, chained with their current relative poses (from the previous origin to the next
+    // one and to the first KF of the sub-map of the loop)
+    vector<Matrix4d> origin_poses( s_lc, Matrix4d::Identity() );
+    int prev_graph_idx = -1;
+    Matrix4d T_prev = Matrix4d::Identity();
+    for( int s = 0; s <= s_lc && submap_lc; s++ )
+    {
+        int kf_idx = -1, graph_idx = -1;
+        if( s < s_lc )
+        {
+            if( origin_kf[s] < 0 )
+                continue;
+            kf_idx    = origin_kf[s];
+            graph_idx = PoseGraph::submapVertex(s);
+            origin_poses[s] = map_keyframes[kf_idx]->T_kf_w;
+            pose_graph.setVertex( graph_idx, origin_poses[s], prev_graph_idx < 0 );
+        }
+        else
+        {
+            for( int i = kf_prev_idx; i <= kf_curr_idx && kf_idx < 0; i++ )
+                if( map_keyframes[i] != NULL )
+                    kf_idx = i;
+            graph_idx = kf_idx;
+        }
+        if( prev_graph_idx >= 0 && kf_idx >= 0 )
+            pose_graph.addEdge( prev_graph_idx, graph_idx, logmap_se3( inverse_se3(T_prev) * map_keyframes[kf_idx]->T_kf_w ) );
+        if( kf_idx >= 0 )
+        {
+            prev_graph_idx = graph_idx;
+            T_prev = map_keyframes[kf_idx]->T_kf_w;
+        }
+    }
 
-    // recover pose and update map
-    Matrix4d Tkfw_corr;
-    for( auto kf_it = kf_list.begin(); kf_it != kf_list.end(); kf_it++)
+    // introduce the new edges and re-measure the ones in the graph (LBA refines the KFs between loops)
+    for( int i = kf_prev_idx; i <= kf_curr_idx; i++ )
     {
-        g2o::VertexSE3* v_se3 = static_cast<g2o::VertexSE3*>(optimizer.vertex( (*kf_it) ));
-        g2o::SE3Quat Tiw_corr =  v_se3->estimateAsSE3Quat();
-        Vector6d x;
-        Matrix4d Tkfw, Tkfw_prev;
-        x = reverse_se3(Tiw_corr.log());
-        Tkfw = expmap_se3( x );
-        Tkfw_prev = map_keyframes[ (*kf_it) ]->T_kf_w;
-        map_keyframes[ (*kf_it) ]->T_kf_w = Tkfw;
-        map_keyframes[ (*kf_it) ]->x_kf_w = logmap_se3(Tkfw);
-        // update map
-        Tkfw_corr = Tkfw * inverse_se3( Tkfw_prev );
-        for( auto it = map_points_kf_idx.at((*kf_it)).begin(); it != map_points_kf_idx.at((*kf_it)).end(); it++ )
+        if( map_keyframes[i] == NULL )
+            continue;
+        vector<int> edge_kfs;
+        graphSuccessors( i, kf_curr_idx, min( SlamConfig::minLMEssGraph(), SlamConfig::minLMCovGraph() ), edge_kfs );
+        for( int j : edge_kfs )
         {
-           if( map_points[(*it)] != NULL )
-           {
-               // update 3D position
-               Vector3d point3D = map_points[(*it)]->point3D;
-               map_points[(*it)]->point3D = Tkfw_corr.block(0,0,3,3) * point3D + Tkfw_corr.block(0,3,3,1);
-               // update direction of observation
-               Vector3d obs_dir = map_points[(*it)]->med_obs_dir;
-               map_points[(*it)]->med_obs_dir = Tkfw_corr.block(0,0,3,3) * obs_dir + Tkfw_corr.block(0,3,3,1);
-               // update direction of each observation
-               for( auto dir_it = map_points[(*it)]->dir_list.begin(); dir_it != map_points[(*it)]->dir_list.end(); dir_it++)
-               {
-                   Vector3d dir_list_ = (*dir_it);
-                   (*dir_it) = Tkfw_corr.block(0,0,3,3) * dir_list_ + Tkfw_corr.block(0,3,3,1);
-               }
-           }
+            if( map_keyframes[j] != NULL )
+            {
+                // kf2kf constraint
+                Matrix4d T_ji_constraint = inverse_se3( map_keyframes[i]->T_kf_w ) * map_keyframes[j]->T_kf_w;
+                pose_graph.addEdge( i, j, logmap_se3(T_ji_constraint), false, poseConstraintInformation(i,j) );
+            }
         }
-        for( auto it = map_lines_kf_idx.at((*kf_it)).begin(); it != map_lines_kf_idx.at((*kf_it)).end(); it++ )
+    }
+
+    // introduce the new loop closure edges, a KF of a closed sub-map is rigidly attached to its origin
+    id = 0;
+    for( auto it = lc_idx_list.begin(); it != lc_idx_list.end(); it++, id++ )
+    {
+        int i = (*it)(0), j = (*it)(1);
+        if( i < kf_prev_idx && j >= kf_prev_idx )
         {
-           if( map_lines[(*it)] != NULL )
-           {
-               // update 3D position
-               Vector3d sP3D = map_lines[(*it)]->line3D.head(3);
-               Vector3d eP3D = map_lines[(*it)]->line3D.tail(3);
-               map_lines[(*it)]->line3D.head(3) = Tkfw_corr.block(0,0,3,3) * sP3D + Tkfw_corr.block(0,3,3,1);
-               map_lines[(*it)]->line3D.tail(3) = Tkfw_corr.block(0,0,3,3) * eP3D + Tkfw_corr.block(0,3,3,1);
-               // update direction of observation
-               Vector3d obs_dir = map_lines[(*it)]->med_obs_dir;
-               map_lines[(*it)]->med_obs_dir = Tkfw_corr.block(0,0,3,3) * obs_dir + Tkfw_corr.block(0,3,3,1);
-               // update direction of each observation
-               for( auto dir_it = map_lines[(*it)]->dir_list.begin(); dir_it != map_lines[(*it)]->dir_list.end(); dir_it++)
-               {
-                   Vector3d dir_list_ = (*dir_it);
-                   (*dir_it) = Tkfw_corr.block(0,0,3,3) * dir_list_ + Tkfw_corr.block(0,3,3,1);
-               }
-           }
+            int s = submaps.of(i);
+            if( map_keyframes[i] == NULL || map_keyframes[j] == NULL || origin_kf[s] < 0 )
+                continue;
+            Matrix4d T_origin_i = inverse_se3( origin_poses[s] ) * map_keyframes[i]->T_kf_w;
+            pose_graph.addEdge( PoseGraph::submapVertex(s), j, logmap_se3( T_origin_i * expmap_se3(lc_pose_list[id]) ), true );
         }
+        else if( pose_graph.hasVertex(i) && pose_graph.hasVertex(j) )
+            pose_graph.addEdge( i, j, lc_pose_list[id], true );
     }
 
-    // update pose and map of the rest of frames
-    for( int i = kf_curr_idx + 1; i < map_keyframes.size(); i++ )
+    // optimize graph
+    map_lk.unlock();
+    int n_iters = pose_graph.optimize( first_idx, SlamConfig::maxItersPGO(), SlamConfig::pgoMinGain() );
+    if( n_iters < 0 )
     {
-        // update pose
+        // the map is left uncorrected (the pose graph logs why)
+        lc_state = LC_IDLE;
+        return false;
+    }
+    Profiler::instance().addCount( "MapHandler::pgoIterations", n_iters );
+    // the correction would only be the spanning tree guess of the graph
+    if( n_iters == 0 && SlamConfig::maxItersPGO() > 0 )
+        LOG_WARN( "[MapHandler] the pose graph of the loop closure did not iterate" );
+    Profiler::instance().setGauge( "MapHandler::pgoSolvedKFs", kf_list.size() );
+    std::lock_guard<SharedMutex> map_wr_lk(map_mutex);
+
+    // update the pose of a KF and its landmarks with a correction
+    auto correctKF = [this]( int i, const Matrix4d &Tkfw_corr ) {
         map_keyframes[i]->T_kf_w = Tkfw_corr * map_keyframes[i]->T_kf_w;
-        map_keyframes[i]->x_kf_w = logmap_se3(map_keyframes[i]->T_kf_w);
-        // update landmarks
+        map_keyframes[i]->x_kf_w = logmap_se3( map_keyframes[i]->T_kf_w );
         for( auto it = map_points_kf_idx.at(i).begin(); it != map_points_kf_idx.at(i).end(); it++ )
         {
            if( map_points[(*it)] != NULL )
@@ -5516,6 +6625,36 @@ bool MapHandler::loopClosureOptimizationCovGraphG2O()
                }
            }
         }
+    };
+
+    // closed sub-maps move rigidly with their origin
+    for( int s = 1; s < s_lc; s++ )
+    {
+        if( origin_kf[s] < 0 )
+            continue;
+        Matrix4d Tkfw_corr = pose_graph.pose( PoseGraph::submapVertex(s) ) * inverse_se3( origin_poses[s] );
+        int end_idx = submaps.firstKF(s+1) >= 0 ? submaps.firstKF(s+1) : kf_prev_idx;
+        for( int i = origin_kf[s]; i < end_idx; i++ )
+            if( map_keyframes[i] != NULL )
+                correctKF( i, Tkfw_corr );
+    }
+
+    // recover pose and update map (as a correction, since LBA may have refined the KFs meanwhile)
+    Matrix4d Tkfw_corr = Matrix4d::Identity();
+    int kf_pose_id = 0;
+    for( auto kf_it = kf_list.begin(); kf_it != kf_list.end(); kf_it++, kf_pose_id++)
+    {
+        Matrix4d Tkfw = pose_graph.pose( (*kf_it) );
+        Tkfw_corr = Tkfw * inverse_se3( kf_poses[kf_pose_id] );
+        if( map_keyframes[ (*kf_it) ] != NULL )
+            correctKF( (*kf_it), Tkfw_corr );
+    }
+
+    // update pose and map of the rest of frames (including the KFs inserted during the optimization)
+    for( int i = kf_curr_idx + 1; i < map_keyframes.size(); i++ )
+    {
+        if( map_keyframes[i] != NULL )
+            correctKF( i, Tkfw_corr );
     }
 
     // mark as optimized the lc_idx_list edges
@@ -5524,6 +6663,12 @@ bool MapHandler::loopClosureOptimizationCovGraphG2O()
 
     // fuse local map from both sides of the loop and update graphs
     loopClosureFuseLandmarks();
+    fuseDuplicatePoints();
+
+    // the whole map has been corrected
+    live_kfs.touchAll();
+    live_pts.touchAll();
+    live_ls.touchAll();
 
     lc_state = LC_IDLE;
 
@@ -5537,7 +6682,8 @@ void MapHandler::loopClosureFuseLandmarks()
     int lc_idx = 0;
     for( auto idx_it = lc_pt_idxs.begin(); idx_it != lc_pt_idxs.end(); idx_it++, lc_idx++ )
     {
-        if( lc_idx_list[lc_idx](2) == 1 )   // if not already optimized
+        // if not already optimized (the reduced KFs take no new observations, they stay pose-only)
+        if( lc_idx_list[lc_idx](2) == 1 && !map_keyframes[ lc_idx_list[lc_idx](0) ]->reduced )
         {
             int kf_prev_idx = lc_idx_list[lc_idx](0);
             int kf_curr_idx = lc_idx_list[lc_idx](1);
@@ -5548,6 +6694,9 @@ void MapHandler::loopClosureFuseLandmarks()
                 int lm_ldx0  = (*lm_it)(1); // lr_qdx
                 int lm_idx1  = (*lm_it)(2);
                 int lm_ldx1  = (*lm_it)(3); // lr_tdx
+                // the LMs of the old KF may be paged out
+                if( lm_idx0 != -1 ) lm_pager.pageIn( map_points[lm_idx0] );
+                if( lm_idx1 != -1 ) lm_pager.pageIn( map_points[lm_idx1] );
                 // if the LM exists just once, add observation
                 if( lm_idx0 == -1 && lm_idx1 != -1 )
                 {
@@ -5555,12 +6704,13 @@ void MapHandler::loopClosureFuseLandmarks()
                     {
                         map_keyframes[kf_prev_idx]->stereo_frame->stereo_pt[lm_ldx0]->idx = lm_idx1;
                         Vector3d dir  = map_keyframes[kf_prev_idx]->stereo_frame->stereo_pt[lm_ldx0]->P / map_keyframes[kf_prev_idx]->stereo_frame->stereo_pt[lm_ldx0]->P.norm();
+                        kf_redundancy.remove( map_points[lm_idx1]->kf_obs_list );
                         map_points[lm_idx1]->addMapPointObservation( map_keyframes[kf_prev_idx]->stereo_frame->pdesc_l.row(lm_ldx0), map_keyframes[kf_prev_idx]->kf_idx, map_keyframes[kf_prev_idx]->stereo_frame->stereo_pt[lm_ldx0]->pl, dir );
+                        kf_redundancy.add( map_points[lm_idx1]->kf_obs_list );
                         // increase full graph for each KF that has already observed this LM
                         for( auto kf_it = map_points[lm_idx1]->kf_obs_list.begin(); kf_it != map_points[lm_idx1]->kf_obs_list.end(); kf_it++)
                         {
-                            full_graph[(*kf_it)][kf_curr_idx]++;
-                            full_graph[kf_curr_idx][(*kf_it)]++;
+                            full_graph.increaseWeight( (*kf_it), kf_curr_idx );
                         }
                     }
                 }
@@ -5570,14 +6720,15 @@ void MapHandler::loopClosureFuseLandmarks()
                     {
                         map_keyframes[kf_curr_idx]->stereo_frame->stereo_pt[lm_ldx1]->idx = lm_idx0;
                         Vector3d dir  = map_keyframes[kf_curr_idx]->stereo_frame->stereo_pt[lm_ldx1]->P / map_keyframes[kf_curr_idx]->stereo_frame->stereo_pt[lm_ldx1]->P.norm();
+                        kf_redundancy.remove( map_points[lm_idx0]->kf_obs_list );
                         map_points[lm_idx0]->addMapPointObservation( map_keyframes[kf_curr_idx]->stereo_frame->pdesc_l.row(lm_ldx1),
                                                                      map_keyframes[kf_curr_idx]->kf_idx,
                                                                      map_keyframes[kf_curr_idx]->stereo_frame->stereo_pt[lm_ldx1]->pl, dir );
+                        kf_redundancy.add( map_points[lm_idx0]->kf_obs_list );
                         // increase full graph for each KF that has already observed this LM
                         for( auto kf_it = map_points[lm_idx0]->kf_obs_list.begin(); kf_it != map_points[lm_idx0]->kf_obs_list.end(); kf_it++)
                         {
-                            full_graph[(*kf_it)][kf_prev_idx]++;
-                            full_graph[kf_prev_idx][(*kf_it)]++;
+                            full_graph.increaseWeight( (*kf_it), kf_prev_idx );
                         }
                     }
                 }
@@ -5600,12 +6751,14 @@ void MapHandler::loopClosureFuseLandmarks()
                         P3d = map_keyframes[kf_curr_idx]->T_kf_w.block(0,0,3,3) *  map_keyframes[kf_curr_idx]->stereo_frame->stereo_pt[lm_ldx1]->P + map_keyframes[kf_curr_idx]->T_kf_w.col(3).head(3);
                         dir = P3d / P3d.norm();
                         map_point->addMapPointObservation(map_keyframes[kf_curr_idx]->stereo_frame->pdesc_l.row(lm_ldx1),map_keyframes[kf_curr_idx]->kf_idx,map_keyframes[kf_curr_idx]->stereo_frame->stereo_pt[lm_ldx1]->pl,dir);
+                        kf_redundancy.add( map_point->kf_obs_list );
                         // add 3D landmark to map
                         map_points.push_back(map_point);
+                        live_pts.insert( map_point->idx );
+                        queueCullCandidate( map_point );
                         // update full graph (new feature)
                         max_pt_idx++;
-                        full_graph[kf_prev_idx][kf_curr_idx]++;
-                        full_graph[kf_curr_idx][kf_prev_idx]++;
+                        full_graph.increaseWeight( kf_prev_idx, kf_curr_idx );
                     }
                 }
                 // if the LM observed is different in each KF, then fuse them and erase the old one
@@ -5614,13 +6767,15 @@ void MapHandler::loopClosureFuseLandmarks()
                     if( map_points[lm_idx0] != NULL && map_points[lm_idx1] != NULL
                         && map_keyframes[kf_curr_idx]->stereo_frame->stereo_pt[lm_ldx1] != NULL )
                     {
+                        kf_redundancy.remove( map_points[lm_idx0]->kf_obs_list );
+                        kf_redundancy.remove( map_points[lm_idx1]->kf_obs_list );
                         int Nobs_lm_prev = map_points[lm_idx0]->kf_obs_list.size();
                         // fuse LMs while updating the full graph
+                        map_points[lm_idx0]->desc_list.append( map_points[lm_idx1]->desc_list );
                         int iter = 0;
-                        for( auto it = map_points[lm_idx1]->desc_list.begin(); it != map_points[lm_idx1]->desc_list.end(); it++, iter++)
+                        for( ; iter < map_points[lm_idx1]->kf_obs_list.size(); iter++)
                         {
-                            // concatenate desc, obs, dir, and kf_obs lists
-                            map_points[lm_idx0]->desc_list.push_back(   (*it) );
+                            // concatenate obs, dir, and kf_obs lists
                             map_points[lm_idx0]->obs_list.push_back(    map_points[lm_idx1]->obs_list[iter]    );
                             map_points[lm_idx0]->dir_list.push_back(    map_points[lm_idx1]->dir_list[iter]    );
                             map_points[lm_idx0]->kf_obs_list.push_back( map_points[lm_idx1]->kf_obs_list[iter] );
@@ -5629,8 +6784,7 @@ void MapHandler::loopClosureFuseLandmarks()
                             for( int i = 0; i < Nobs_lm_prev; i++ )
                             {
                                 int idx = map_points[lm_idx0]->kf_obs_list[i];
-                                full_graph[idx][jdx]++;
-                                full_graph[jdx][idx]++;
+                                full_graph.increaseWeight( idx, jdx );
                             }
                             // update average descriptor and direction of observation
                             map_points[lm_idx0]->updateAverageDescDir();
@@ -5648,9 +6802,11 @@ void MapHandler::loopClosureFuseLandmarks()
                                 break;
                             }
                         }
+                        kf_redundancy.add( map_points[lm_idx0]->kf_obs_list );
                         // erase old landmark
                         delete map_points[lm_idx1];
                         map_points[lm_idx1] = nullptr;
+                        live_pts.erase( lm_idx1 );
                     }
                 }
             }
@@ -5661,7 +6817,7 @@ void MapHandler::loopClosureFuseLandmarks()
     lc_idx = 0;
     for( auto idx_it = lc_ls_idxs.begin(); idx_it != lc_ls_idxs.end(); idx_it++, lc_idx++ )
     {
-        if( lc_idx_list[lc_idx](2) == 1 )   // if not already optimized
+        if( lc_idx_list[lc_idx](2) == 1 && !map_keyframes[ lc_idx_list[lc_idx](0) ]->reduced )
         {
             int kf_prev_idx = lc_idx_list[lc_idx](0);
             int kf_curr_idx = lc_idx_list[lc_idx](1);
@@ -5672,6 +6828,8 @@ void MapHandler::loopClosureFuseLandmarks()
                 int lm_ldx0  = (*lm_it)(1); // lr_qdx
                 int lm_idx1  = (*lm_it)(2);
                 int lm_ldx1  = (*lm_it)(3); // lr_tdx
+                if( lm_idx0 != -1 ) lm_pager.pageIn( map_lines[lm_idx0] );
+                if( lm_idx1 != -1 ) lm_pager.pageIn( map_lines[lm_idx1] );
                 // if the LM exists just once, add observation
                 if( lm_idx0 == -1 && lm_idx1 != -1 )
                 {
@@ -5683,15 +6841,16 @@ void MapHandler::loopClosureFuseLandmarks()
                         Vector4d pts;
                         pts.head(2) = map_keyframes[kf_prev_idx]->stereo_frame->stereo_ls[lm_ldx0]->spl_obs;
                         pts.tail(2) = map_keyframes[kf_prev_idx]->stereo_frame->stereo_ls[lm_ldx0]->epl_obs;
+                        kf_redundancy.remove( map_lines[lm_idx1]->kf_obs_list );
                         map_lines[lm_idx1]->addMapLineObservation( map_keyframes[kf_prev_idx]->stereo_frame->ldesc_l.row(lm_ldx0),
                                                                    map_keyframes[kf_prev_idx]->kf_idx,
                                                                    map_keyframes[kf_prev_idx]->stereo_frame->stereo_ls[lm_ldx0]->le,
                                                                    dir, pts );
+                        kf_redundancy.add( map_lines[lm_idx1]->kf_obs_list );
                         // increase full graph for each KF that has already observed this LM
                         for( auto kf_it = map_lines[lm_idx1]->kf_obs_list.begin(); kf_it != map_lines[lm_idx1]->kf_obs_list.end(); kf_it++)
                         {
-                            full_graph[(*kf_it)][kf_curr_idx]++;
-                            full_graph[kf_curr_idx][(*kf_it)]++;
+                            full_graph.increaseWeight( (*kf_it), kf_curr_idx );
                         }
                     }
                 }
@@ -5705,14 +6864,15 @@ void MapHandler::loopClosureFuseLandmarks()
                         Vector4d pts;
                         pts.head(2) = map_keyframes[kf_curr_idx]->stereo_frame->stereo_ls[lm_ldx1]->spl_obs;
                         pts.tail(2) = map_keyframes[kf_curr_idx]->stereo_frame->stereo_ls[lm_ldx1]->epl_obs;
+                        kf_redundancy.remove( map_lines[lm_idx0]->kf_obs_list );
                         map_lines[lm_idx0]->addMapLineObservation( map_keyframes[kf_curr_idx]->stereo_frame->ldesc_l.row(lm_ldx1),
                                                                    map_keyframes[kf_curr_idx]->kf_idx,
                                                                    map_keyframes[kf_curr_idx]->stereo_frame->stereo_ls[lm_ldx1]->le, dir, pts );
+                        kf_redundancy.add( map_lines[lm_idx0]->kf_obs_list );
                         // increase full graph for each KF that has already observed this LM
                         for( auto kf_it = map_lines[lm_idx0]->kf_obs_list.begin(); kf_it != map_lines[lm_idx0]->kf_obs_list.end(); kf_it++)
                         {
-                            full_graph[(*kf_it)][kf_prev_idx]++;
-                            full_graph[kf_prev_idx][(*kf_it)]++;
+                            full_graph.increaseWeight( (*kf_it), kf_prev_idx );
                         }
                     }
                 }
@@ -5747,12 +6907,14 @@ void MapHandler::loopClosureFuseLandmarks()
                         pts.tail(2) = map_keyframes[kf_prev_idx]->stereo_frame->stereo_ls[lm_ldx1]->epl;
                         map_line->addMapLineObservation(map_keyframes[kf_curr_idx]->stereo_frame->ldesc_l.row(lm_ldx1),map_keyframes[kf_curr_idx]->kf_idx,
                                                         map_keyframes[kf_curr_idx]->stereo_frame->stereo_ls[lm_ldx1]->le,dir,pts);
+                        kf_redundancy.add( map_line->kf_obs_list );
                         // add 3D landmark to map
                         map_lines.push_back(map_line);
+                        live_ls.insert( map_line->idx );
+                        queueCullCandidate( map_line );
                         // update full graph (new feature)
                         max_ls_idx++;
-                        full_graph[kf_prev_idx][kf_curr_idx]++;
-                        full_graph[kf_curr_idx][kf_prev_idx]++;
+                        full_graph.increaseWeight( kf_prev_idx, kf_curr_idx );
                     }
                 }
                 // if the LM observed is different in each KF, then fuse them and erase the old one
@@ -5761,13 +6923,15 @@ void MapHandler::loopClosureFuseLandmarks()
                     if( map_lines[lm_idx0] != NULL && map_lines[lm_idx1] != NULL
                         && map_keyframes[kf_curr_idx]->stereo_frame->stereo_ls[lm_ldx1] != NULL )
                     {
+                        kf_redundancy.remove( map_lines[lm_idx0]->kf_obs_list );
+                        kf_redundancy.remove( map_lines[lm_idx1]->kf_obs_list );
                         int Nobs_lm_prev = map_lines[lm_idx0]->kf_obs_list.size();
                         // fuse LMs while updating the full graph
+                        map_lines[lm_idx0]->desc_list.append( map_lines[lm_idx1]->desc_list );
                         int iter = 0;
-                        for( auto it = map_lines[lm_idx1]->desc_list.begin(); it != map_lines[lm_idx1]->desc_list.end(); it++, iter++)
+                        for( ; iter < map_lines[lm_idx1]->kf_obs_list.size(); iter++)
                         {
-                            // concatenate desc, obs, dir, pts, and kf_obs lists
-                            map_lines[lm_idx0]->desc_list.push_back(   (*it) );
+                            // concatenate obs, dir, pts, and kf_obs lists
                             map_lines[lm_idx0]->obs_list.push_back(    map_lines[lm_idx1]->obs_list[iter]    );
                             map_lines[lm_idx0]->dir_list.push_back(    map_lines[lm_idx1]->dir_list[iter]    );
                             map_lines[lm_idx0]->pts_list.push_back(    map_lines[lm_idx1]->pts_list[iter]    );
@@ -5777,8 +6941,7 @@ void MapHandler::loopClosureFuseLandmarks()
                             for( int i = 0; i < Nobs_lm_prev; i++ )
                             {
                                 int idx = map_lines[lm_idx0]->kf_obs_list[i];
-                                full_graph[idx][jdx]++;
-                                full_graph[jdx][idx]++;
+                                full_graph.increaseWeight( idx, jdx );
                             }
                             // update average descriptor and direction of observation
                             map_lines[lm_idx0]->updateAverageDescDir();
@@ -5796,9 +6959,11 @@ void MapHandler::loopClosureFuseLandmarks()
                                 break;
                             }
                         }
+                        kf_redundancy.add( map_lines[lm_idx0]->kf_obs_list );
                         // erase old landmark
                         delete map_lines[lm_idx1];
                         map_lines[lm_idx1] = nullptr;
+                        live_ls.erase( lm_idx1 );
                     }
                 }
             }
@@ -5807,19 +6972,134 @@ void MapHandler::loopClosureFuseLandmarks()
 
 }
 
-void MapHandler::print_msg(const std::string &msg) {
+void MapHandler::fuseDuplicatePoints()
+{
+    PROFILE_SCOPE("MapHandler::fuseDuplicatePoints");
+
+    const double voxel = SlamConfig::lcFuseVoxel();
+    if( voxel <= 0.0 )
+        return;
+
+    // voxel hash of the corrected points: (key, idx) sorted by key, each voxel is a contiguous run
+    auto voxelKey = [voxel]( const Vector3d &P, int dx, int dy, int dz )
+    {
+        const long long off = 1 << 20, mask = (1 << 21) - 1;
+        const long long x = static_cast<long long>( floor( P(0) / voxel ) ) + dx + off;
+        const long long y = static_cast<long long>( floor( P(1) / voxel ) ) + dy + off;
+        const long long z = static_cast<long long>( floor( P(2) / voxel ) ) + dz + off;
+        return ( (x & mask) << 42 ) | ( (y & mask) << 21 ) | ( z & mask );
+    };
+    vector<pair<long long,int>> cells;
+    cells.reserve( live_pts.size() );
+    for( int i_pt : live_pts )
+        if( map_points[i_pt] != NULL )
+            cells.push_back( make_pair( voxelKey( map_points[i_pt]->point3D, 0, 0, 0 ), i_pt ) );
+    sort( cells.begin(), cells.end() );
+
+    // a duplicate is close, looks alike, and is never observed by a KF of the other point
+    auto isDuplicate = [&]( const MapPoint* a, const MapPoint* b )
+    {
+        if( ( a->point3D - b->point3D ).norm() > voxel )
+            return false;
+        if( StVO::hammingDistance( a->med_desc, b->med_desc ) > SlamConfig::lcFuseDescTh() )
+            return false;
+        for( int kf_a : a->kf_obs_list )
+            if( find( b->kf_obs_list.begin(), b->kf_obs_list.end(), kf_a ) != b->kf_obs_list.end() )
+                return false;
+        return true;
+    };
 
+    // the point with fewer observations is fused into the other one
+    map<pair<int,int>,int> graph_inc;
+    int n_fused = 0;
+    for( const pair<long long,int> &c : cells )
     {
-        std::lock_guard<std::mutex> lock(cout_mutex);
-        cout << msg << endl;
+        int i_pt = c.second;
+        for( int d = 0; d < 27 && map_points[i_pt] != NULL; d++ )
+        {
+            const long long key = voxelKey( map_points[i_pt]->point3D, d % 3 - 1, (d / 3) % 3 - 1, d / 9 - 1 );
+            auto it = lower_bound( cells.begin(), cells.end(), make_pair( key, numeric_limits<int>::min() ) );
+            for( ; it != cells.end() && it->first == key && map_points[i_pt] != NULL; it++ )
+            {
+                const int j_pt = it->second;
+                if( j_pt == i_pt || map_points[j_pt] == NULL || !isDuplicate( map_points[i_pt], map_points[j_pt] ) )
+                    continue;
+                if( map_points[i_pt]->kf_obs_list.size() >= map_points[j_pt]->kf_obs_list.size() )
+                    fusePointInto( i_pt, j_pt, graph_inc );
+                else
+                    fusePointInto( j_pt, i_pt, graph_inc );
+                n_fused++;
+            }
+        }
     }
+
+    // the covisibility of all the fusions at once
+    for( const pair<pair<int,int>,int> &inc : graph_inc )
+        full_graph.increaseWeight( inc.first.first, inc.first.second, inc.second );
+
+    if( n_fused > 0 )
+        LOG_INFO( "[MapHandler] fused " << n_fused << " duplicate points after loop closure" );
+}
+
+void MapHandler::fusePointInto( int keep, int drop, map<pair<int,int>,int> &graph_inc )
+{
+    MapPoint* pt_keep = map_points[keep];
+    MapPoint* pt_drop = map_points[drop];
+    lm_pager.pageIn( pt_keep );
+    lm_pager.pageIn( pt_drop );
+
+    // the KFs of both points become covisible
+    for( int jdx : pt_drop->kf_obs_list )
+        for( int idx : pt_keep->kf_obs_list )
+            graph_inc[ make_pair( min(idx, jdx), max(idx, jdx) ) ]++;
+
+    kf_redundancy.remove( pt_keep->kf_obs_list );
+    kf_redundancy.remove( pt_drop->kf_obs_list );
+
+    // concatenate desc, obs, dir, and kf_obs lists
+    const bool with_sigma = pt_keep->sigma_list.size() == pt_keep->kf_obs_list.size() &&
+                            pt_drop->sigma_list.size() == pt_drop->kf_obs_list.size();
+    pt_keep->desc_list.append( pt_drop->desc_list );
+    for( int i = 0; i < pt_drop->kf_obs_list.size(); i++ )
+    {
+        pt_keep->obs_list.push_back(    pt_drop->obs_list[i]    );
+        pt_keep->dir_list.push_back(    pt_drop->dir_list[i]    );
+        pt_keep->kf_obs_list.push_back( pt_drop->kf_obs_list[i] );
+        if( with_sigma )
+            pt_keep->sigma_list.push_back( pt_drop->sigma_list[i] );
+
+        // the stereo features of the observing KF point to the kept LM
+        KeyFrame* kf = map_keyframes[ pt_drop->kf_obs_list[i] ];
+        if( kf != NULL )
+            for( PointFeature* pt : kf->stereo_frame->stereo_pt )
+                if( pt != NULL && pt->idx == drop )
+                    pt->idx = keep;
+    }
+    pt_keep->updateAverageDescDir();
+    kf_redundancy.add( pt_keep->kf_obs_list );
+
+    // remove from map_points_kf_idx
+    vector<int> &kf_pts = map_points_kf_idx.at( pt_drop->kf_obs_list[0] );
+    auto it = find( kf_pts.begin(), kf_pts.end(), drop );
+    if( it != kf_pts.end() )
+        kf_pts.erase( it );
+
+    // erase old landmark
+    delete pt_drop;
+    map_points[drop] = nullptr;
+    live_pts.erase( drop );
+    live_pts.touch( keep );
 }
 
 void MapHandler::SaveKeyFrameTrajectoryTUM(const string &filename)
 {
     cout << endl << "Saving keyframe trajectory to " << filename << " ..." << endl;
 
-    vector<KeyFrame*> vpKFs = map_keyframes;
+    // culled KFs leave empty slots
+    vector<KeyFrame*> vpKFs;
+    for (KeyFrame* kf : map_keyframes)
+        if (kf != NULL)
+            vpKFs.push_back(kf);
     sort(vpKFs.begin(),vpKFs.end(),MapHandler::lId);
 
     ofstream f;
@@ -5848,9 +7128,491 @@ void MapHandler::SaveKeyFrameTrajectoryTUM(const string &filename)
     cout << endl << "trajectory saved!" << endl;
 }
 
+void MapHandler::saveMap(const string &filename) const
+{
+    PROFILE_SCOPE("MapHandler::saveMap");
+    SharedLock map_lk(map_mutex);
+
+    MapFileWriter out;
+
+    MapMetaRecord meta = MapMetaRecord();
+    meta.fx = cam->getFx();
+    meta.fy = cam->getFy();
+    meta.cx = cam->getCx();
+    meta.cy = cam->getCy();
+    meta.b  = cam->getB();
+    meta.width  = cam->getWidth();
+    meta.height = cam->getHeight();
+    meta.max_kf_idx = max_kf_idx;
+    meta.max_pt_idx = max_pt_idx;
+    meta.max_ls_idx = max_ls_idx;
+    out.add(MAP_SEC_META, meta);
+
+    // keyframes (removed KFs are kept as empty slots so that kf_idx still indexes map_keyframes)
+    for (const KeyFrame* kf : map_keyframes)
+    {
+        MapKeyFrameRecord rec = MapKeyFrameRecord();
+        rec.kf_idx = -1;
+        if( kf != NULL )
+        {
+            const StereoFrame* sf = kf->stereo_frame;
+            rec.kf_idx    = kf->kf_idx;
+            rec.f_idx     = kf->f_idx;
+            rec.frame_idx = sf->frame_idx;
+            rec.t         = sf->t;
+            rec.inv_width  = sf->inv_width;
+            rec.inv_height = sf->inv_height;
+            Map<Matrix4d>(rec.T_kf_w)    = kf->T_kf_w;
+            Map<Vector6d>(rec.x_kf_w)    = kf->x_kf_w;
+            Map<Matrix6d>(rec.xcov_kf_w) = kf->xcov_kf_w;
+            rec.pdesc_l  = out.addMat( sf->pdesc_l );
+            rec.ldesc_l  = out.addMat( sf->ldesc_l );
+            rec.img_name = out.addString( kf->img_name );
+
+            writeStereoFeatures( out, sf, rec.points, rec.lines );
+
+            waitBowVectors( kf );
+            const DBoW2::BowVector* bow[2] = { &kf->descDBoW_P, &kf->descDBoW_L };
+            MapListRef* bow_ref[2] = { &rec.bow_p, &rec.bow_l };
+            for (int k = 0; k < 2; k++)
+            {
+                bow_ref[k]->begin = out.count(MAP_SEC_BOW_WORDS);
+                bow_ref[k]->count = bow[k]->size();
+                for (const auto &w : *bow[k])
+                {
+                    MapBowWordRecord word = MapBowWordRecord();
+                    word.word  = w.first;
+                    word.value = w.second;
+                    out.add(MAP_SEC_BOW_WORDS, word);
+                }
+            }
+        }
+        out.add(MAP_SEC_KEYFRAMES, rec);
+    }
+
+    // landmarks
+    for (const MapPoint* pt : map_points)
+    {
+        MapPointRecord rec = MapPointRecord();
+        rec.idx = -1;
+        if( pt != NULL )
+        {
+            rec.idx    = pt->idx;
+            rec.inlier = pt->inlier;
+            Map<Vector3d>(rec.point3D)     = pt->point3D;
+            Map<Vector3d>(rec.med_obs_dir) = pt->med_obs_dir;
+            rec.med_desc    = out.addMat( pt->med_desc.mat() );
+            rec.desc_list   = out.addMats( lm_pager.rowList( pt ) );
+            rec.obs_list    = out.addVectors( pt->obs_list );
+            rec.dir_list    = out.addVectors( pt->dir_list );
+            rec.kf_obs_list = out.addInts( pt->kf_obs_list.data(), pt->kf_obs_list.size() );
+            rec.sigma_list  = out.addDoubles( pt->sigma_list.data(), pt->sigma_list.size() );
+        }
+        out.add(MAP_SEC_POINTS, rec);
+    }
+
+    for (const MapLine* ls : map_lines)
+    {
+        MapLineRecord rec = MapLineRecord();
+        rec.idx = -1;
+        if( ls != NULL )
+        {
+            rec.idx         = ls->idx;
+            rec.inlier      = ls->inlier;
+            rec.first_kf_id = ls->first_kf_id;
+            rec.error       = ls->error;
+            Map<Vector6d>(rec.line3D)        = ls->line3D;
+            Map<Vector3d>(rec.med_obs_dir)   = ls->med_obs_dir;
+            Map<Vector6d>(rec.NDw)           = ls->NDw;
+            Map<Vector4d>(rec.orthNDw)       = ls->orthNDw;
+            Map<Matrix4d>(rec.first_kf_pose) = ls->first_kf_pose;
+            Map<Vector4d>(rec.first_kf_obs)  = ls->first_kf_obs;
+            Map<Vector6d>(rec.first_NDw)     = ls->first_NDw;
+            rec.med_desc     = out.addMat( ls->med_desc.mat() );
+            rec.desc_list    = out.addMats( lm_pager.rowList( ls ) );
+            rec.obs_list     = out.addVectors( ls->obs_list );
+            rec.pts_list     = out.addVectors( ls->pts_list );
+            rec.dir_list     = out.addVectors( ls->dir_list );
+            rec.NDw_obs_list = out.addVectors( ls->NDw_obs_list );
+            rec.kf_obs_list  = out.addInts( ls->kf_obs_list.data(), ls->kf_obs_list.size() );
+            rec.sigma_list   = out.addDoubles( ls->sigma_list.data(), ls->sigma_list.size() );
+        }
+        out.add(MAP_SEC_LINES, rec);
+    }
+
+    // covisibility graph (each edge once)
+    for (int i = 0; i < full_graph.size(); i++)
+    {
+        for (const auto &nb : full_graph.neighbors(i))
+        {
+            if( nb.first < i )
+                continue;
+            MapGraphEdgeRecord e = MapGraphEdgeRecord();
+            e.i = i;
+            e.j = nb.first;
+            e.weight = nb.second;
+            out.add(MAP_SEC_GRAPH_EDGES, e);
+        }
+    }
+
+    // base KF of each landmark
+    const map<int,vector<int>>* lm_kf_idx[2] = { &map_points_kf_idx, &map_lines_kf_idx };
+    const MapSectionType lm_sec[2] = { MAP_SEC_KF_POINT_LMS, MAP_SEC_KF_LINE_LMS };
+    for (int k = 0; k < 2; k++)
+    {
+        for (const auto &it : *lm_kf_idx[k])
+        {
+            MapKFLandmarksRecord rec = MapKFLandmarksRecord();
+            rec.kf_idx = it.first;
+            rec.lms    = out.addInts( it.second.data(), it.second.size() );
+            out.add(lm_sec[k], rec);
+        }
+    }
+
+    out.write(filename);
+}
+
+void MapHandler::loadMap(const string &filename)
+{
+    PROFILE_SCOPE("MapHandler::loadMap");
+
+    if( !map_keyframes.empty() )
+        throw std::runtime_error("[MapHandler->loadMap] the map must be loaded before it is initialized");
+
+    MapFileReader in(filename);
+
+    uint64_t n;
+    const MapMetaRecord* meta = in.records<MapMetaRecord>(MAP_SEC_META, n);
+    if( n != 1 )
+        throw std::runtime_error("[MapHandler->loadMap] " + filename + " has no map header");
+    if( meta->width != cam->getWidth() || meta->height != cam->getHeight() ||
+        fabs(meta->fx - cam->getFx()) > 1e-6 || fabs(meta->fy - cam->getFy()) > 1e-6 ||
+        fabs(meta->cx - cam->getCx()) > 1e-6 || fabs(meta->cy - cam->getCy()) > 1e-6 ||
+        fabs(meta->b  - cam->getB())  > 1e-6 )
+        throw std::runtime_error("[MapHandler->loadMap] " + filename + " was built with a different camera");
+
+    map_points_kf_idx.clear();
+    map_lines_kf_idx.clear();
+    live_kfs.clear();
+    live_pts.clear();
+    live_ls.clear();
+    kf_redundancy.clear();
+    submaps.clear();
+    lm_pager.clear();
+    resetLBAGraph();
+    full_graph.clear();
+    pose_graph.clear();
+    kf_pose_info.clear();
+    reduced_kf_idx = 0;
+    lc_idx_list.clear();
+    lc_pose_list.clear();
+    local_kf_idx.clear();
+    local_pt_idx.clear();
+    local_ls_idx.clear();
+    local_epoch = 0;
+    reloc_kf_idx = -1;
+    place_rec.clear();
+
+    // keyframes (images are not stored, so loaded KFs are compact without thumbnail)
+    const MapKeyFrameRecord* kfs = in.records<MapKeyFrameRecord>(MAP_SEC_KEYFRAMES, n);
+    map_keyframes.assign( n, NULL );
+    for (uint64_t i = 0; i < n; i++)
+    {
+        const MapKeyFrameRecord &rec = kfs[i];
+        if( rec.kf_idx < 0 )
+            continue;
+        if( rec.kf_idx != int(i) )
+            throw std::runtime_error("[MapHandler->loadMap] " + filename + ": inconsistent KF indices");
+
+        KeyFrame* kf = new KeyFrame();
+        kf->kf_idx      = rec.kf_idx;
+        kf->rig_kf      = rec.kf_idx;
+        kf->f_idx       = rec.f_idx;
+        kf->img_name    = in.str( rec.img_name );
+        kf->local       = false;
+        kf->local_epoch = -1;
+        kf->compact     = true;
+        kf->thumbnail_scale = 0.0;
+        kf->T_kf_w      = Map<const Matrix4d>(rec.T_kf_w);
+        kf->x_kf_w      = Map<const Vector6d>(rec.x_kf_w);
+        kf->xcov_kf_w   = Map<const Matrix6d>(rec.xcov_kf_w);
+        kf->has_prior   = false;
+
+        StereoFrame* sf = new StereoFrame();
+        kf->stereo_frame = sf;
+        sf->cam        = cam;
+        sf->frame_idx  = rec.frame_idx;
+        sf->t          = rec.t;
+        sf->Tfw        = kf->T_kf_w;
+        sf->Tfw_cov    = kf->xcov_kf_w;
+        sf->inv_width  = rec.inv_width;
+        sf->inv_height = rec.inv_height;
+        sf->pdesc_l    = in.mat( rec.pdesc_l );
+        sf->ldesc_l    = in.mat( rec.ldesc_l );
+
+        readStereoFeatures( in, rec.points, rec.lines, sf );
+
+        // the direct indices of the guided matching are not stored, the vectors are recomputed then
+        DBoW2::BowVector* bow[2] = { &kf->descDBoW_P, &kf->descDBoW_L };
+        const MapListRef* bow_ref[2] = { &rec.bow_p, &rec.bow_l };
+        for (int k = 0; k < 2 && SlamConfig::lcBowLevelsUp() < 0; k++)
+        {
+            const MapBowWordRecord* words = in.list<MapBowWordRecord>(MAP_SEC_BOW_WORDS, *bow_ref[k]);
+            for (uint64_t j = 0; j < bow_ref[k]->count; j++)
+                bow[k]->insert( bow[k]->end(), std::make_pair(DBoW2::WordId(words[j].word), DBoW2::WordValue(words[j].value)) );
+        }
+        if( SlamConfig::lcBowLevelsUp() >= 0 )
+            computeBowVectors( kf );
+
+        map_keyframes[i] = kf;
+        live_kfs.insert( i );
+        submaps.addKF( i );
+        place_rec.addKeyFrame( kf );
+    }
+
+    // landmarks
+    const MapPointRecord* pts = in.records<MapPointRecord>(MAP_SEC_POINTS, n);
+    map_points.assign( n, NULL );
+    for (uint64_t i = 0; i < n; i++)
+    {
+        const MapPointRecord &rec = pts[i];
+        if( rec.idx < 0 )
+            continue;
+        MapPoint* pt = new MapPoint();
+        pt->idx         = rec.idx;
+        pt->inlier      = rec.inlier;
+        pt->local       = false;
+        pt->local_epoch = -1;
+        pt->cull_pending = false;
+        pt->point3D     = Map<const Vector3d>(rec.point3D);
+        pt->med_obs_dir = Map<const Vector3d>(rec.med_obs_dir);
+        pt->med_desc    = StVO::Desc256( in.mat( rec.med_desc ) );
+        vector<Mat> descs;
+        in.mats( rec.desc_list, descs );
+        pt->desc_list.assign( descs, int(rec.kf_obs_list.count) );
+        in.vectors( rec.obs_list, pt->obs_list );
+        in.vectors( rec.dir_list, pt->dir_list );
+        const int32_t* kf_obs = in.ints( rec.kf_obs_list );
+        pt->kf_obs_list.assign( kf_obs, kf_obs + rec.kf_obs_list.count );
+        const double* sigma = in.doubles( rec.sigma_list );
+        pt->sigma_list.assign( sigma, sigma + rec.sigma_list.count );
+        map_points[i] = pt;
+        live_pts.insert( i );
+        kf_redundancy.add( pt->kf_obs_list );
+    }
+
+    const MapLineRecord* lines = in.records<MapLineRecord>(MAP_SEC_LINES, n);
+    map_lines.assign( n, NULL );
+    for (uint64_t i = 0; i < n; i++)
+    {
+        const MapLineRecord &rec = lines[i];
+        if( rec.idx < 0 )
+            continue;
+        MapLine* ls = new MapLine();
+        ls->idx           = rec.idx;
+        ls->inlier        = rec.inlier;
+        ls->local         = false;
+        ls->local_epoch   = -1;
+        ls->cull_pending  = false;
+        ls->first_kf_id   = rec.first_kf_id;
+        ls->error         = rec.error;
+        ls->line3D        = Map<const Vector6d>(rec.line3D);
+        ls->med_obs_dir   = Map<const Vector3d>(rec.med_obs_dir);
+        ls->NDw           = Map<const Vector6d>(rec.NDw);
+        ls->orthNDw       = Map<const Vector4d>(rec.orthNDw);
+        ls->first_kf_pose = Map<const Matrix4d>(rec.first_kf_pose);
+        ls->first_kf_obs  = Map<const Vector4d>(rec.first_kf_obs);
+        ls->first_NDw     = Map<const Vector6d>(rec.first_NDw);
+        ls->med_desc      = StVO::Desc256( in.mat( rec.med_desc ) );
+        vector<Mat> descs;
+        in.mats( rec.desc_list, descs );
+        ls->desc_list.assign( descs, int(rec.kf_obs_list.count) );
+        in.vectors( rec.obs_list, ls->obs_list );
+        in.vectors( rec.pts_list, ls->pts_list );
+        in.vectors( rec.dir_list, ls->dir_list );
+        in.vectors( rec.NDw_obs_list, ls->NDw_obs_list );
+        const int32_t* kf_obs = in.ints( rec.kf_obs_list );
+        ls->kf_obs_list.assign( kf_obs, kf_obs + rec.kf_obs_list.count );
+        const double* sigma = in.doubles( rec.sigma_list );
+        ls->sigma_list.assign( sigma, sigma + rec.sigma_list.count );
+        map_lines[i] = ls;
+        live_ls.insert( i );
+        kf_redundancy.add( ls->kf_obs_list );
+    }
+
+    // the loaded LMs are not in any local map yet, let the culling check them once
+    cull_pt_idx.clear();
+    cull_ls_idx.clear();
+    for( MapPoint* pt : map_points )
+        queueCullCandidate( pt );
+    for( MapLine* ls : map_lines )
+        queueCullCandidate( ls );
+
+    // covisibility graph
+    full_graph.resize( map_keyframes.size() );
+    const MapGraphEdgeRecord* edges = in.records<MapGraphEdgeRecord>(MAP_SEC_GRAPH_EDGES, n);
+    for (uint64_t i = 0; i < n; i++)
+    {
+        if( edges[i].i < 0 || edges[i].j < 0 || edges[i].i >= full_graph.size() || edges[i].j >= full_graph.size() )
+            throw std::runtime_error("[MapHandler->loadMap] " + filename + ": covisibility edge out of range");
+        full_graph.setWeight( edges[i].i, edges[i].j, edges[i].weight );
+    }
+
+    map<int,vector<int>>* lm_kf_idx[2] = { &map_points_kf_idx, &map_lines_kf_idx };
+    const MapSectionType lm_sec[2] = { MAP_SEC_KF_POINT_LMS, MAP_SEC_KF_LINE_LMS };
+    for (int k = 0; k < 2; k++)
+    {
+        const MapKFLandmarksRecord* recs = in.records<MapKFLandmarksRecord>(lm_sec[k], n);
+        for (uint64_t i = 0; i < n; i++)
+        {
+            const int32_t* lms = in.ints( recs[i].lms );
+            (*lm_kf_idx[k])[recs[i].kf_idx].assign( lms, lms + recs[i].lms.count );
+        }
+    }
+
+    max_kf_idx = meta->max_kf_idx;
+    lc_last_kf_idx = max_kf_idx;    // the loaded KFs are already in the place recognition database
+    max_pt_idx = meta->max_pt_idx;
+    max_ls_idx = meta->max_ls_idx;
+
+    // the last KF of the map is the reference for the next insertions
+    curr_kf = prev_kf = NULL;
+    for (int i = int(map_keyframes.size()) - 1; i >= 0 && curr_kf == NULL; i--)
+        curr_kf = prev_kf = map_keyframes[i];
+    // the map files carry no rig, the loaded KFs are the ones of rig 0
+    vo_last_kf.assign( rig_extrinsics.size(), NULL );
+    rig_last_kf.assign( rig_extrinsics.size(), NULL );
+    rig_kf_count.assign( rig_extrinsics.size(), 0 );
+    vo_last_kf[0] = rig_last_kf[0] = curr_kf;
+    rig_kf_count[0] = max_kf_idx + 1;
+    setInitialized( curr_kf != NULL );
+    Twf = (curr_kf == NULL) ? Matrix4d::Identity() : inverse_se3( curr_kf->T_kf_w );
+    DT  = Matrix4d::Identity();
+}
+
+void MapHandler::startBowVectors( KeyFrame* kf ) const
+{
+    StVO::ThreadPool &pool = StVO::ThreadPool::global();
+    if( pool.size() == 0 )
+    {
+        computeBowVectors( kf );
+        return;
+    }
+    // the task reads the session of the mapper, the VO thread may be out of its scope
+    Config::Scope scope( config );
+    kf->bow_pending = true;
+    kf->bow_task = pool.submit( [this, kf]() {
+        PROFILE_SCOPE("MapHandler::bowVectors");
+        computeBowVectors( kf );
+        kf->bow_pending = false;
+    } ).share();
+}
+
+void MapHandler::waitBowVectors( KeyFrame* kf ) const
+{
+    // any thread may wait (the shared future is not consumed), with or without the map lock
+    if( !kf->bow_pending )
+        return;
+    PROFILE_SCOPE("MapHandler::wait.bowVectors");
+    StVO::ThreadPool::global().wait( kf->bow_task );
+}
+
+void MapHandler::computeBowVectors( KeyFrame* kf ) const
+{
+    // the direct index is only kept for the guided matching
+    const int levels_up = std::max( SlamConfig::lcBowLevelsUp(), 0 );
+    if( SlamConfig::hasPoints() )
+        dbow_voc_p->transformRows( kf->stereo_frame->pdesc_l, kf->descDBoW_P, kf->featDBoW_P, levels_up );
+    if( SlamConfig::hasLines() )
+        dbow_voc_l->transformRows( kf->stereo_frame->ldesc_l, kf->descDBoW_L, kf->featDBoW_L, levels_up );
+    if( SlamConfig::lcBowLevelsUp() < 0 )
+    {
+        kf->featDBoW_P.clear();
+        kf->featDBoW_L.clear();
+    }
+}
+
+int MapHandler::matchKFDescriptors( const KeyFrame* kf0, const KeyFrame* kf1, bool lines, vector<int> &matches_12 ) const
+{
+    const Mat &desc0 = lines ? kf0->stereo_frame->ldesc_l : kf0->stereo_frame->pdesc_l;
+    const Mat &desc1 = lines ? kf1->stereo_frame->ldesc_l : kf1->stereo_frame->pdesc_l;
+    const float nnr  = lines ? SlamConfig::minRatio12L() : SlamConfig::minRatio12P();
+    const DBoW2::FeatureVector &fv0 = lines ? kf0->featDBoW_L : kf0->featDBoW_P;
+    const DBoW2::FeatureVector &fv1 = lines ? kf1->featDBoW_L : kf1->featDBoW_P;
+
+    if( SlamConfig::lcBowLevelsUp() < 0 || fv0.empty() || fv1.empty() )
+        return match( desc0, desc1, nnr, matches_12, true );
+
+    // nodes of both direct indices (sorted by node id)
+    vector<const vector<unsigned int>*> groups0, groups1;
+    auto it0 = fv0.begin();
+    auto it1 = fv1.begin();
+    while( it0 != fv0.end() && it1 != fv1.end() )
+    {
+        if( it0->first < it1->first )
+            it0 = fv0.lower_bound( it1->first );
+        else if( it1->first < it0->first )
+            it1 = fv1.lower_bound( it0->first );
+        else
+        {
+            groups0.push_back( &it0->second );
+            groups1.push_back( &it1->second );
+            ++it0;
+            ++it1;
+        }
+    }
+    return matchGroups( desc0, desc1, groups0, groups1, nnr, SlamConfig::lcBowMaxDist(), matches_12 );
+}
+
+bool MapHandler::localizeFrame( const StereoFrame* frame, Matrix4d &T_f_w )
+{
+    PROFILE_SCOPE("MapHandler::localizeFrame");
+
+    // query KF sharing the features of the frame (it is not inserted in the map)
+    KeyFrame* kf_q = new KeyFrame( frame, -1 );
+
+    // first the reference KF and its covisible KFs, then the place recognition candidates
+    vector<int> kf_list;
+    if( reloc_kf_idx >= 0 && reloc_kf_idx < int(map_keyframes.size()) && map_keyframes[reloc_kf_idx] != NULL )
+    {
+        vector<pair<int,unsigned int>> cov_kfs;
+        for( auto nb : full_graph.neighbors(reloc_kf_idx) )
+            if( nb.first != reloc_kf_idx && int(nb.second) >= SlamConfig::minLMCovGraph() && map_keyframes[nb.first] != NULL )
+                cov_kfs.push_back( make_pair(nb.first, nb.second) );
+        sort( cov_kfs.begin(), cov_kfs.end(),
+              [](const pair<int,unsigned int> &a, const pair<int,unsigned int> &b) { return a.second > b.second; } );
+        kf_list.push_back( reloc_kf_idx );
+        for( int i = 0; i < int(cov_kfs.size()) && i < SlamConfig::lcMaxCandidates(); i++ )
+            kf_list.push_back( cov_kfs[i].first );
+    }
+    computeBowVectors( kf_q );
+    vector<pair<int,double>> candidates;
+    place_rec.query( kf_q, max_kf_idx, SlamConfig::lcMaxCandidates(), map_keyframes, candidates );
+    for( const pair<int,double> &c : candidates )
+        if( find(kf_list.begin(), kf_list.end(), c.first) == kf_list.end() )
+            kf_list.push_back( c.first );
+
+    // the first candidate passing the geometric verification gives the pose
+    vector<Vector4i> lc_pt_idx, lc_ls_idx;
+    Vector6d pose_inc;
+    const int i_kf = verifyLoopCandidates( kf_q, kf_list, pose_inc, lc_pt_idx, lc_ls_idx );
+    bool found = ( i_kf >= 0 );
+    if( found )
+    {
+        T_f_w = map_keyframes[i_kf]->T_kf_w * expmap_se3( pose_inc );
+        reloc_kf_idx = i_kf;
+    }
+
+    delete kf_q;
+    if( !found )
+        reloc_kf_idx = -1;
+    return found;
+}
+
 void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
+    PROFILE_SCOPE("MapHandler::localBundleAdjustmentForPlukerWithG2O");
 
-    std::cout<<"Begin local bundle adjustment ......"<<std::endl;
+    LOG_DEBUG( "Begin local bundle adjustment ......" );
     double fx = cam->getFx();
     double fy = cam->getFy();
     double cx = cam->getCx();
@@ -5867,21 +7629,29 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
 
     vector<KeyFrame *> all_map_keyframes = map_keyframes;
 
-    for (vector<KeyFrame *>::iterator kf_it = map_keyframes.begin(); kf_it != map_keyframes.end(); kf_it++) {
-        if ((*kf_it) != NULL && (*kf_it)->local == true) {
-            idx_nofix_kfs.insert(make_pair((*kf_it)->kf_idx, (*kf_it)));
-            idx_all_kfs.insert(make_pair((*kf_it)->kf_idx, (*kf_it)));
+    // bounded window: optimized landmarks and the KFs whose observations are used
+    vector<int>  lba_pt_idx, lba_ls_idx;
+    vector<bool> lba_obs_kf;
+    selectLBAWindow( lba_pt_idx, lba_ls_idx, lba_obs_kf );
+
+    for (int i_kf : local_kf_idx) {
+        KeyFrame *kf = map_keyframes[i_kf];
+        if (kf != NULL && kf->local == true) {
+            idx_nofix_kfs.insert(make_pair(kf->kf_idx, kf));
+            idx_all_kfs.insert(make_pair(kf->kf_idx, kf));
         }
     }
 
-    for (vector<MapPoint *>::iterator pt_it = map_points.begin(); pt_it != map_points.end(); pt_it++) {
-        if ((*pt_it) != NULL && (*pt_it)->local == true) {
-            local_pt.push_back((*pt_it));
+    for (int i_pt : lba_pt_idx) {
+        MapPoint *pt = map_points[i_pt];
+        if (pt != NULL && pt->local == true) {
+            local_pt.push_back(pt);
         }
     }
-    for (vector<MapLine *>::iterator ls_it = map_lines.begin(); ls_it != map_lines.end(); ls_it++) {
-        if ((*ls_it) != NULL && (*ls_it)->local == true) {
-            local_ls.push_back((*ls_it));
+    for (int i_ls : lba_ls_idx) {
+        MapLine *ls = map_lines[i_ls];
+        if (ls != NULL && ls->local == true) {
+            local_ls.push_back(ls);
         }
     }
 
@@ -5893,10 +7663,10 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
                 cerr << "[Wrong index in the map_keyframes and MapPoint obs.....]" << endl;
                 exit(0);
             } else {
-                if (all_map_keyframes[obs[i]]->local != true) {
+                // fixed KFs are tracked in idx_all_kfs, so the local window flags stay untouched
+                if (idx_all_kfs.count(obs[i]) == 0 && lba_obs_kf[obs[i]]) {
                     idx_fix_kfs.insert(make_pair(obs[i], all_map_keyframes[obs[i]]));
                     idx_all_kfs.insert(make_pair(obs[i], all_map_keyframes[obs[i]]));
-                    all_map_keyframes[obs[i]]->local = true;
                 }
             }
         }
@@ -5909,10 +7679,9 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
                 cerr << "[Wrong index in the map_keyframes and MapLine obs.....]" << endl;
                 exit(0);
             } else {
-                if (all_map_keyframes[obs[i]]->local != true) {
+                if (idx_all_kfs.count(obs[i]) == 0 && lba_obs_kf[obs[i]]) {
                     idx_fix_kfs.insert(make_pair(obs[i], all_map_keyframes[obs[i]]));
                     idx_all_kfs.insert(make_pair(obs[i], all_map_keyframes[obs[i]]));
-                    all_map_keyframes[obs[i]]->local = true;
                 }
             }
         }
@@ -5920,110 +7689,125 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
 
     assert(idx_all_kfs.size() == (idx_fix_kfs.size() + idx_nofix_kfs.size()));
 
-    g2o::SparseOptimizer optimizer;
-
-    auto linearSolver = g2o::make_unique<SlamLinearSolver>();
-    auto blockSolver = g2o::make_unique<g2o::BlockSolverX>(std::move(linearSolver));
-    g2o::OptimizationAlgorithm *algorithm = new g2o::OptimizationAlgorithmLevenberg(std::move(blockSolver));
-
-    optimizer.setAlgorithm(algorithm);
-
-    //nofix keyframe vertex
-    int max_kf_id = 0;
-    for (map<int, KeyFrame *>::const_iterator lit = idx_nofix_kfs.begin(), lend = idx_nofix_kfs.end();
-         lit != lend; lit++) {
-        KeyFrame *pKFi = lit->second;
-        int idKF = pKFi->kf_idx;
-        // Vertex of PVR
-        {
-            VertexLMPose *vPose = new VertexLMPose();
-            vPose->setEstimate((pKFi->T_kf_w).inverse());
-            vPose->setId(idKF);
-            vPose->setFixed(false);
-            if (idKF == 0) {
-                vPose->setFixed(true);
-            }
-            if (max_kf_id < idKF + 1) {
-                max_kf_id = idKF + 1;
-            }
-            optimizer.addVertex(vPose);
+    // the graph persists between LBAs (ids 3*idx, 3*idx+1 and 3*idx+2 for KFs, points and lines):
+    // vertices are added or removed as the window moves, and the edges of a landmark are only
+    // rebuilt if its observations in the window changed
+    if (!lba_optimizer) {
+        lba_optimizer.reset(new g2o::SparseOptimizer());
+        auto linearSolver = g2o::make_unique<SlamLinearSolver>();
+        auto blockSolver = g2o::make_unique<g2o::BlockSolverX>(std::move(linearSolver));
+        lba_optimizer->setAlgorithm(new g2o::OptimizationAlgorithmLevenberg(std::move(blockSolver)));
+    }
+    g2o::SparseOptimizer &optimizer = *lba_optimizer;
+    if (lba_kf_vertex.size() < map_keyframes.size())
+        lba_kf_vertex.resize(map_keyframes.size(), NULL);
+    if (lba_pt_vertex.size() < map_points.size()) {
+        lba_pt_vertex.resize(map_points.size(), NULL);
+        lba_pt_edges.resize(map_points.size());
+    }
+    if (lba_ls_vertex.size() < map_lines.size()) {
+        lba_ls_vertex.resize(map_lines.size(), NULL);
+        lba_ls_edges.resize(map_lines.size());
+    }
+
+    // landmarks that left the window (their edges are removed with them)
+    vector<bool> in_window(max(map_points.size(), map_lines.size()), false);
+    for (MapPoint *pMP : local_pt)
+        in_window[pMP->idx] = true;
+    for (int idx : lba_graph_pts) {
+        if (!in_window[idx]) {
+            optimizer.removeVertex(lba_pt_vertex[idx]);
+            lba_pt_vertex[idx] = NULL;
+            lba_pt_edges[idx].clear();
+        }
+    }
+    lba_graph_pts.clear();
+    std::fill(in_window.begin(), in_window.end(), false);
+    for (MapLine *lML : local_ls)
+        in_window[lML->idx] = true;
+    for (int idx : lba_graph_ls) {
+        if (!in_window[idx]) {
+            optimizer.removeVertex(lba_ls_vertex[idx]);
+            lba_ls_vertex[idx] = NULL;
+            lba_ls_edges[idx].clear();
         }
     }
+    lba_graph_ls.clear();
 
-    //fix keyframe vertex
-    for (map<int, KeyFrame *>::const_iterator lit = idx_fix_kfs.begin(), lend = idx_fix_kfs.end(); lit != lend; lit++) {
-        KeyFrame *pKFi = lit->second;
-        int idKF = pKFi->kf_idx;
-        // Vertex of PR
-        {
-            VertexLMPose *vPose = new VertexLMPose();
-            vPose->setEstimate((pKFi->T_kf_w).inverse());
-            vPose->setId(idKF);
-            vPose->setFixed(true);
+    // keyframe vertices, the estimates are always reloaded from the map
+    for (map<int, KeyFrame *>::const_iterator lit = idx_all_kfs.begin(), lend = idx_all_kfs.end(); lit != lend; lit++) {
+        int idKF = lit->first;
+        VertexLMPose *&vPose = lba_kf_vertex[idKF];
+        if (vPose == NULL) {
+            vPose = new VertexLMPose();
+            vPose->setId(3 * idKF);
             optimizer.addVertex(vPose);
-            if (max_kf_id < idKF + 1) {
-                max_kf_id = idKF + 1;
-            }
         }
+        vPose->setEstimate((lit->second->T_kf_w).inverse());
+        vPose->setFixed(idx_fix_kfs.count(idKF) > 0 || idKF == 0);
     }
 
     vector<EdgePosePoint *> vpEdgesMono;
-//    vpEdgesMono.reserve(nExpectedSize);
     vector<KeyFrame *> vpEdgeKFMono;
-//    vpEdgeKFMono.reserve(nExpectedSize);
     vector<MapPoint *> vpMapPointEdgeMono;
-//    vpMapPointEdgeMono.reserve(nExpectedSize);
     vector<int> vpLmObsIdx;
-    int maxPointId = max_kf_id;
+    vector<int> obs_idx;
     const float thHuberMono = sqrt(5.991);
     for (vector<MapPoint *>::iterator lit = local_pt.begin(), lend = local_pt.end(); lit != lend; lit++) {
         MapPoint *pMP = *lit;
-        VertexLMPointXYZ *vPoint = new VertexLMPointXYZ();
+        VertexLMPointXYZ *&vPoint = lba_pt_vertex[pMP->idx];
+        if (vPoint == NULL) {
+            vPoint = new VertexLMPointXYZ();
+            vPoint->setId(3 * pMP->idx + 1);
+            vPoint->setMarginalized(true);
+            optimizer.addVertex(vPoint);
+        }
         vPoint->setEstimate(pMP->point3D);
-        int id = pMP->idx + max_kf_id + 1;
-        vPoint->setId(id);
-        vPoint->setFixed(false);
-        vPoint->setMarginalized(true);
-        optimizer.addVertex(vPoint);
+        lba_graph_pts.push_back(pMP->idx);
 
-        const vector<int> observations = pMP->kf_obs_list;
+        // observations from the KFs of the window
+        obs_idx.clear();
+        for (int i = 0; i < pMP->kf_obs_list.size(); i++) {
+            if (lba_obs_kf[pMP->kf_obs_list[i]])
+                obs_idx.push_back(i);
+        }
+        vector<EdgePosePoint *> &edges = lba_pt_edges[pMP->idx];
+        bool same_obs = edges.size() == obs_idx.size();
+        for (size_t k = 0; same_obs && k < edges.size(); k++)
+            same_obs = edges[k]->vertex(1) == lba_kf_vertex[pMP->kf_obs_list[obs_idx[k]]];
+        if (!same_obs) {
+            for (EdgePosePoint *e : edges)
+                optimizer.removeEdge(e);
+            edges.clear();
+        }
 
         // Set edges between KeyFrame and MapPoint
-        for (int i = 0; i < observations.size(); i++) {
-            int kf_id = observations[i];
-            KeyFrame *pKF = NULL;
-            map<int, KeyFrame *>::iterator kf_it = idx_all_kfs.find(kf_id);
-            if (kf_it == idx_all_kfs.end()) {
-                cerr << "[can't find KeyFrame in all_idx_xfs.....]" << endl;
-                exit(0);
+        for (size_t k = 0; k < obs_idx.size(); k++) {
+            int i = obs_idx[k];
+            int kf_id = pMP->kf_obs_list[i];
+            if (!same_obs) {
+                EdgePosePoint *e = new EdgePosePoint();
+                e->setVertex(0, vPoint);
+                e->setVertex(1, lba_kf_vertex[kf_id]);
+                e->SetParams(fx, fy, cx, cy);
+                optimizer.addEdge(e);
+                edges.push_back(e);
             }
-            pKF = kf_it->second;
-
-            const Vector2d obs = pMP->obs_list[i];
-
-            EdgePosePoint *e = new EdgePosePoint();
-
-            e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex *>(optimizer.vertex(id)));
-            e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex *>(optimizer.vertex(kf_id)));
-            e->setMeasurement(obs);
+            EdgePosePoint *e = edges[k];
+            e->setMeasurement(pMP->obs_list[i]);
             const float &invSigma2 = 1.0 / pMP->sigma_list[i];
             e->setInformation(Eigen::Matrix2d::Identity() * invSigma2);
+            e->setLevel(0);
 
             g2o::RobustKernelHuber *rk = new g2o::RobustKernelHuber;
             e->setRobustKernel(rk);
             rk->setDelta(thHuberMono);
 
-            e->SetParams(fx, fy, cx, cy);
-
-            optimizer.addEdge(e);
             vpEdgesMono.push_back(e);
-            vpEdgeKFMono.push_back(pKF);
+            vpEdgeKFMono.push_back(idx_all_kfs.at(kf_id));
             vpMapPointEdgeMono.push_back(pMP);
             vpLmObsIdx.push_back(i);
         }
-
-        if (maxPointId < id + 1);
-        maxPointId = id + 1;
     }
 
     //MapLine Vertex
@@ -6035,92 +7819,84 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
     const float thHuberLine = sqrt(5.991);
     for (vector<MapLine *>::iterator lit = local_ls.begin(), lend = local_ls.end(); lit != lend; lit++) {
         MapLine *lML = *lit;
-        VertexLMLineOrth *vLine = new VertexLMLineOrth();
-        Vector6d pluker = lML->NDw;
-        Vector4d orth = MapLine::changePlukerToOrth(pluker);
-        //test for debug
-//        Vector6d pluker_for_test = MapLine::changeOrthToPluker(orth);
-//        std::cout<<"The orginal pluker: "<<pluker.transpose()<<std::endl;
-//        std::cout<<"The transfor pluker: "<<pluker_for_test.transpose()<<std::endl;
-        //end test
-        vLine->setEstimate(orth);
-        int id = lML->idx + maxPointId + 1;
-        vLine->setId(id);
-        vLine->setMarginalized(true);
-        vLine->setFixed(false);
-        optimizer.addVertex(vLine);
-
-        const vector<int> observations = lML->kf_obs_list;
+        VertexLMLineOrth *&vLine = lba_ls_vertex[lML->idx];
+        if (vLine == NULL) {
+            vLine = new VertexLMLineOrth();
+            vLine->setId(3 * lML->idx + 2);
+            vLine->setMarginalized(true);
+            optimizer.addVertex(vLine);
+        }
+        vLine->setEstimate(MapLine::changePlukerToOrth(lML->NDw));
+        lba_graph_ls.push_back(lML->idx);
+
+        // observations from the KFs of the window
+        obs_idx.clear();
+        for (int i = 0; i < lML->kf_obs_list.size(); i++) {
+            if (lba_obs_kf[lML->kf_obs_list[i]])
+                obs_idx.push_back(i);
+        }
+        vector<EdgePoseLine *> &edges = lba_ls_edges[lML->idx];
+        bool same_obs = edges.size() == obs_idx.size();
+        for (size_t k = 0; same_obs && k < edges.size(); k++)
+            same_obs = edges[k]->vertex(1) == lba_kf_vertex[lML->kf_obs_list[obs_idx[k]]];
+        if (!same_obs) {
+            for (EdgePoseLine *e : edges)
+                optimizer.removeEdge(e);
+            edges.clear();
+        }
 
-        // Set edges between KeyFrame and MapPoint
-        for (int i = 0; i < observations.size(); i++) {
-            int kf_id = observations[i];
-            KeyFrame *pKF = NULL;
-            map<int, KeyFrame *>::iterator kf_it = idx_all_kfs.find(kf_id);
-            if (kf_it == idx_all_kfs.end()) {
-                cerr << "[can't find KeyFrame in all_idx_xfs.....]" << endl;
-                exit(0);
+        // Set edges between KeyFrame and MapLine
+        for (size_t k = 0; k < obs_idx.size(); k++) {
+            int i = obs_idx[k];
+            int kf_id = lML->kf_obs_list[i];
+            if (!same_obs) {
+                EdgePoseLine *e = new EdgePoseLine();
+                e->setVertex(0, vLine);
+                e->setVertex(1, lba_kf_vertex[kf_id]);
+                e->SetParams(fx, fy, cx, cy);
+                optimizer.addEdge(e);
+                edges.push_back(e);
             }
-            pKF = kf_it->second;
-
-            const Vector4d obs = lML->NDw_obs_list[i];
-
-            EdgePoseLine *e = new EdgePoseLine();
-
-            e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex *>(optimizer.vertex(id)));
-            e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex *>(optimizer.vertex(kf_id)));
-            e->setMeasurement(obs);
+            EdgePoseLine *e = edges[k];
+            e->setMeasurement(lML->NDw_obs_list[i]);
             const float &invSigma2 = 1.0 / lML->sigma_list[i];
             e->setInformation(Eigen::Matrix4d::Identity() * invSigma2);
+            e->setLevel(0);
 
             g2o::RobustKernelHuber *rk = new g2o::RobustKernelHuber;
             e->setRobustKernel(rk);
             rk->setDelta(thHuberLine);
 
-            e->SetParams(fx, fy, cx, cy);
-
-            optimizer.addEdge(e);
             vlEdgesMono.push_back(e);
-            vlEdgeKFMono.push_back(pKF);
+            vlEdgeKFMono.push_back(idx_all_kfs.at(kf_id));
             vlMapLineEdgeMono.push_back(lML);
             vlLmObsIdx.push_back(i);
+        }
+    }
 
-            //test for debug
-            if(0){
-                Vector6d plukerLc = TransformForPluker(pKF->T_kf_w.inverse(),lML->NDw);
-                Vector3d plukerLc_pixel = cam->getPlukerK() * plukerLc.head(3);
-                double lx = plukerLc_pixel(0);
-                double ly = plukerLc_pixel(1);
-                double lz = plukerLc_pixel(2);
-                double fenmu = sqrt(lx*lx + ly*ly);
-                Vector2d error;
-                error(0) = (obs(0) * lx + obs(1) * ly + lz ) / fenmu;
-                error(1) = (obs(2) * lx + obs(3) * ly + lz ) / fenmu;
-//                std::cout<<"Error when construct MapLine: "<<error.norm()<<std::endl;
-                if(error.norm()>0.5 && i==0) {
-                    std::cout << "Curr kf Pose: " << pKF->T_kf_w << "\n"
-                              << "Curr kf obs: " << obs.transpose() << "\n"
-                              << "Curr kf idx: " << pKF->kf_idx << "\n"
-                              << "Curr kf error: " << error.norm() << "\n"
-                              << "Curr kf pluker: " << lML->NDw.transpose() << "\n"
-                              << "Keep kf Pose: " << lML->first_kf_pose << "\n"
-                              << "Keep kf obs: " << lML->first_kf_obs.transpose() << "\n"
-                              << "Keep kf idx: " << lML->first_kf_id << "\n"
-                              << "Keep kf error: " << lML->error << "\n"
-                              << "Keep kf pluker: " << lML->first_NDw.transpose() << "\n";
-                }
-                else if(error.norm()>0.5){
-                    std::cout<<"error: "<<error.norm()<<std::endl;
-                }
-            }
+    // keyframes that left the window (no landmark edge refers to them after the sync above)
+    for (int idKF : lba_graph_kfs) {
+        if (idx_all_kfs.count(idKF) == 0) {
+            optimizer.removeVertex(lba_kf_vertex[idKF]);
+            lba_kf_vertex[idKF] = NULL;
         }
     }
+    lba_graph_kfs.clear();
+    for (map<int, KeyFrame *>::const_iterator lit = idx_all_kfs.begin(), lend = idx_all_kfs.end(); lit != lend; lit++)
+        lba_graph_kfs.push_back(lit->first);
+
+    // anytime stop over both stages: g2o only keeps the accepted LM steps, so the graph holds the best
+    // iterate when the budget is spent or a new KF is waiting
+    bool stop = false;
+    OptimizationTimeBudget budget( SlamConfig::lbaTimeBudget(), &stop, [this]{ return lbaInterrupted(); } );
+    optimizer.setForceStopFlag(&stop);
+    optimizer.addPostIterationAction(&budget);
 
-    cout << "Begin optimize...." << endl;
+    LOG_DEBUG( "Begin optimize...." );
   //  optimizer.setVerbose(true);
     optimizer.initializeOptimization();
     optimizer.optimize(5);
-    cout << "End optimize" << endl;
+    LOG_DEBUG( "End optimize" );
 
     for (size_t i = 0, iend = vpEdgesMono.size(); i < iend; i++) {
         EdgePosePoint *e = vpEdgesMono[i];
@@ -6145,11 +7921,13 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
         }
         e->setRobustKernel(0);
     }
-    std::cout<<"Total Line Obs: "<<vlEdgesMono.size()<<"  Bad Obs: "<<bad_line<<std::endl;
+    LOG_DEBUG( "Total Line Obs: " << vlEdgesMono.size() << "  Bad Obs: " << bad_line );
 
    // optimizer.setVerbose(true);
     optimizer.initializeOptimization(0);
     optimizer.optimize(10);
+    optimizer.removePostIterationAction(&budget);
+    optimizer.setForceStopFlag(NULL);
 
     int bad_point_obs = 0;
     int actually_bad_point_obs = 0;
@@ -6183,10 +7961,12 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
                     }
                 }
                 // remove observations from map points
-                pMP->desc_list.erase( pMP->desc_list.begin() + lm_idx_obs );
+                kf_redundancy.remove( pMP->kf_obs_list );
+                pMP->desc_list.erase( lm_idx_obs );
                 pMP->obs_list.erase( pMP->obs_list.begin() + lm_idx_obs );
                 pMP->dir_list.erase( pMP->dir_list.begin() + lm_idx_obs );
                 pMP->kf_obs_list.erase( pMP->kf_obs_list.begin() + lm_idx_obs );
+                kf_redundancy.add( pMP->kf_obs_list );
                 // remove idx from KeyFrame stereo points
                 for(vector<PointFeature*>::iterator st_pt = kf->stereo_frame->stereo_pt.begin();
                     st_pt != kf->stereo_frame->stereo_pt.end(); st_pt++ )
@@ -6205,8 +7985,7 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
                     int idx = pMP->kf_obs_list[i];
                     if( kf_obs != idx )
                     {
-                        full_graph[kf_obs][idx]--;
-                        full_graph[idx][kf_obs]--;
+                        full_graph.decreaseWeight( kf_obs, idx );
                     }
                 }
             }
@@ -6215,8 +7994,8 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
             }
         }
     }
-    std::cout<<"All Point Edge is "<<vpEdgesMono.size()<<", Bad Point Edge is "<<bad_point_obs<<", Actually delete "
-             <<actually_bad_point_obs<<" Edges."<<std::endl;
+    LOG_DEBUG( "All Point Edge is " << vpEdgesMono.size() << ", Bad Point Edge is " << bad_point_obs
+               << ", Actually delete " << actually_bad_point_obs << " Edges." );
 
     //remove bad Line observations
     int bad_line_obs = 0;
@@ -6255,9 +8034,11 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
                 }
 
                 // remove observations from map points
-                lML->desc_list.erase( lML->desc_list.begin() + lm_idx_obs );
+                kf_redundancy.remove( lML->kf_obs_list );
+                lML->desc_list.erase( lm_idx_obs );
                 lML->NDw_obs_list.erase( lML->NDw_obs_list.begin() + lm_idx_obs );
                 lML->kf_obs_list.erase( lML->kf_obs_list.begin() + lm_idx_obs );
+                kf_redundancy.add( lML->kf_obs_list );
                // lML->pts_list.erase( lML->pts_list.begin() + lm_idx_obs );
 
                 // remove idx from KeyFrame stereo points
@@ -6278,8 +8059,7 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
                     int idx = lML->kf_obs_list[i];
                     if( kf_obs != idx )
                     {
-                        full_graph[kf_obs][idx]--;
-                        full_graph[idx][kf_obs]--;
+                        full_graph.decreaseWeight( kf_obs, idx );
                     }
                 }
             }
@@ -6289,15 +8069,15 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
 
         }
     }
-    std::cout<<"All Line Edge is "<<vlEdgesMono.size()<<", Bad Line Edge is "<<bad_line_obs<<", Actually delete "
-             <<actually_bad_line_obs<<" Edges."<<std::endl;
+    LOG_DEBUG( "All Line Edge is " << vlEdgesMono.size() << ", Bad Line Edge is " << bad_line_obs
+               << ", Actually delete " << actually_bad_line_obs << " Edges." );
 
 
     // recover Keyframes
     for(map<int, KeyFrame*>::const_iterator lit=idx_nofix_kfs.begin(), lend=idx_nofix_kfs.end(); lit!=lend; lit++)
     {
         KeyFrame* pKFi = lit->second;
-        VertexLMPose* vPose = dynamic_cast<VertexLMPose*>(optimizer.vertex(pKFi->kf_idx));
+        VertexLMPose* vPose = lba_kf_vertex[pKFi->kf_idx];
 
         pKFi->T_kf_w = vPose->estimate().inverse();
     }
@@ -6306,20 +8086,38 @@ void MapHandler::localBundleAdjustmentForPlukerWithG2O() {
     for(vector<MapPoint*>::const_iterator lit=local_pt.begin(), lend=local_pt.end(); lit!=lend; lit++)
     {
         MapPoint* pMP = *lit;
-        VertexLMPointXYZ* vPoint = dynamic_cast<VertexLMPointXYZ*>(optimizer.vertex(pMP->idx+max_kf_id+1));
+        VertexLMPointXYZ* vPoint = lba_pt_vertex[pMP->idx];
         pMP->point3D = vPoint->estimate();
     }
 
     //recover MapLines
     for(vector<MapLine*>::const_iterator lit=local_ls.begin(), lend=local_ls.end(); lit!=lend; lit++){
         MapLine* lML = *lit;
-        VertexLMLineOrth* vLine = dynamic_cast<VertexLMLineOrth*>(optimizer.vertex(lML->idx+maxPointId+1));
+        VertexLMLineOrth* vLine = lba_ls_vertex[lML->idx];
         Vector4d orth = vLine->estimate();
         lML->NDw = MapLine::changeOrthToPluker(orth);
     }
 
-    cout<<"Finish Local Bundle Adjustment !"<<endl;
+    LOG_DEBUG( "Finish Local Bundle Adjustment !" );
+
+}
+
+bool MapHandler::lbaInterrupted() const
+{
+    return SlamConfig::lbaInterrupt() && threads_started && !kf_queue.empty();
+}
 
+void MapHandler::resetLBAGraph()
+{
+    lba_optimizer.reset();
+    lba_kf_vertex.clear();
+    lba_pt_vertex.clear();
+    lba_ls_vertex.clear();
+    lba_pt_edges.clear();
+    lba_ls_edges.clear();
+    lba_graph_kfs.clear();
+    lba_graph_pts.clear();
+    lba_graph_ls.clear();
 }
 }
 
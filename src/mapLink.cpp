@@ -0,0 +1,424 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include <mapLink.h>
+
+//STL
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+//POSIX
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <auxiliar.h>
+#include <config.h>
+#include <keyFrame.h>
+#include <mapHandler.h>
+#include <mapLock.h>
+#include <pinholeStereoCamera.h>
+#include <threadRole.h>
+
+namespace PLSLAM {
+
+namespace {
+
+static const uint32_t LINK_MAGIC       = 0x4b4e4c50;            // "PLNK"
+static const uint16_t LINK_VERSION     = 1;
+static const uint32_t LINK_MAX_PAYLOAD = 256u << 20;            // guards against corrupted sizes
+
+void littleEndian(MapLinkHello &hello)
+{
+    PLSLAM::littleEndian(&hello.magic, sizeof(hello.magic), sizeof(hello.magic));
+    PLSLAM::littleEndian(&hello.version, sizeof(hello.version), sizeof(hello.version));
+    PLSLAM::littleEndian(&hello.fx, 5 * sizeof(double), sizeof(double));
+    PLSLAM::littleEndian(&hello.width, 2 * sizeof(int32_t), sizeof(int32_t));
+}
+
+void setNoDelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+bool sendAll(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+bool recvAll(int fd, uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = ::recv(fd, data, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+std::vector<uint8_t> encodeHello(const PinholeStereoCamera *cam)
+{
+    MapLinkHello hello;
+    std::memset(&hello, 0, sizeof(hello));
+    hello.magic   = LINK_MAGIC;
+    hello.version = LINK_VERSION;
+    hello.fx      = cam->getFx();
+    hello.fy      = cam->getFy();
+    hello.cx      = cam->getCx();
+    hello.cy      = cam->getCy();
+    hello.b       = cam->getB();
+    hello.width   = cam->getWidth();
+    hello.height  = cam->getHeight();
+    littleEndian(hello);
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(&hello);
+    return std::vector<uint8_t>(p, p + sizeof(hello));
+}
+
+} // namespace
+
+/* Message link */
+
+MessageLink::MessageLink(int fd_) : fd(fd_), bytes_sent(0)
+{
+    setNoDelay(fd);
+}
+
+MessageLink::~MessageLink()
+{
+    ::close(fd);
+}
+
+bool MessageLink::send(uint32_t type, const std::vector<uint8_t> &payload)
+{
+    uint32_t header[2] = { type, uint32_t(payload.size()) };
+    littleEndian(header, sizeof(header), sizeof(header[0]));
+    std::lock_guard<std::mutex> lk(send_mtx);
+    if (!sendAll(fd, reinterpret_cast<const uint8_t*>(header), sizeof(header)) ||
+        !sendAll(fd, payload.data(), payload.size()))
+        return false;
+    bytes_sent += sizeof(header) + payload.size();
+    return true;
+}
+
+bool MessageLink::receive(uint32_t &type, std::vector<uint8_t> &payload)
+{
+    uint32_t header[2];
+    if (!recvAll(fd, reinterpret_cast<uint8_t*>(header), sizeof(header)))
+        return false;
+    littleEndian(header, sizeof(header), sizeof(header[0]));
+    if (header[1] > LINK_MAX_PAYLOAD)
+        return false;
+    type = header[0];
+    payload.resize(header[1]);
+    return recvAll(fd, payload.data(), payload.size());
+}
+
+void MessageLink::shutdown()
+{
+    ::shutdown(fd, SHUT_RDWR);
+}
+
+int MessageLink::connectTo(const std::string &host, int port)
+{
+    addrinfo hints, *res = nullptr;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
+    if (err != 0)
+        throw std::runtime_error("Cannot resolve " + host + ": " + gai_strerror(err));
+
+    int fd = -1;
+    for (addrinfo *ai = res; ai != nullptr && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        throw std::runtime_error("Cannot connect to " + host + ":" + std::to_string(port) + ": " + std::strerror(errno));
+    return fd;
+}
+
+int MessageLink::acceptOn(int port)
+{
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server < 0)
+        throw std::runtime_error(std::string("Cannot create a socket: ") + std::strerror(errno));
+    int one = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(uint16_t(port));
+    if (bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(server, 1) != 0) {
+        std::string msg = std::strerror(errno);
+        ::close(server);
+        throw std::runtime_error("Cannot listen on port " + std::to_string(port) + ": " + msg);
+    }
+
+    int fd;
+    do {
+        fd = accept(server, nullptr, nullptr);
+    } while (fd < 0 && errno == EINTR);
+    std::string msg = std::strerror(errno);
+    ::close(server);
+    if (fd < 0)
+        throw std::runtime_error("Cannot accept on port " + std::to_string(port) + ": " + msg);
+    return fd;
+}
+
+/* Front-end side */
+
+MapLinkClient::MapLinkClient(const std::string &host, int port, const PinholeStereoCamera *cam, int queue_size) :
+    link(MessageLink::connectTo(host, port)), queue(size_t(std::max(queue_size, 1))), config(Config::current()),
+    n_kfs(0), finished(false), n_corrections(0)
+{
+    if (!link.send(LINK_HELLO, encodeHello(cam)))
+        throw std::runtime_error("Cannot reach the back-end at " + host + ":" + std::to_string(port));
+    sender   = std::thread(&MapLinkClient::sendLoop, this);
+    receiver = std::thread(&MapLinkClient::receiveLoop, this);
+}
+
+MapLinkClient::~MapLinkClient()
+{
+    finish();
+}
+
+void MapLinkClient::addKeyFrame(KeyFrame *kf)
+{
+    if (!queue.push(kf)) {
+        delete kf;
+        return;
+    }
+    n_kfs++;
+}
+
+void MapLinkClient::finish()
+{
+    if (finished) return;
+    finished = true;
+    queue.close();
+    sender.join();
+    receiver.join();
+}
+
+void MapLinkClient::sendLoop()
+{
+    Config::Scope scope(config);
+    setupThread(THREAD_LINK, 0);
+
+    // the KFs are encoded here, off the tracking thread, and deleted once sent
+    std::vector<uint8_t> msg;
+    int kf_seq = 0;
+    bool connected = true;
+    KeyFrame *kf;
+    while (queue.pop(kf)) {
+        if (connected) {
+            msg.clear();
+            encodeKeyFrame(kf, kf_seq++, msg);
+            connected = link.send(LINK_KEYFRAME, msg);
+            if (!connected)
+                std::cerr << "MapLinkClient: connection to the back-end lost" << std::endl;
+        }
+        delete kf;
+    }
+    if (connected)
+        link.send(LINK_END, std::vector<uint8_t>());
+}
+
+void MapLinkClient::receiveLoop()
+{
+    Config::Scope scope(config);
+    setupThread(THREAD_LINK, 1);
+
+    // until the back-end closes the link, after its last corrections (only counted, the front-end
+    // tracks wrt its last KF)
+    std::vector<uint8_t> payload;
+    std::vector<KFCorrection> batch;
+    uint32_t type;
+    while (link.receive(type, payload)) {
+        if (type != LINK_CORRECTIONS) continue;
+        try {
+            decodeCorrections(payload.data(), payload.size(), batch);
+        } catch (const std::runtime_error &e) {
+            std::cerr << "MapLinkClient: " << e.what() << std::endl;
+            continue;
+        }
+        n_corrections += int(batch.size());
+    }
+}
+
+/* Back-end side */
+
+MapLinkServer::MapLinkServer(int port) :
+    link(MessageLink::acceptOn(port)), config(Config::current()), map(nullptr), n_kfs(0), changed(false), stopping(false)
+{
+    std::vector<uint8_t> payload;
+    uint32_t type;
+    if (!link.receive(type, payload) || type != LINK_HELLO || payload.size() != sizeof(hello))
+        throw std::runtime_error("Unexpected handshake from the front-end");
+    std::memcpy(&hello, payload.data(), sizeof(hello));
+    littleEndian(hello);
+    if (hello.magic != LINK_MAGIC || hello.version != LINK_VERSION)
+        throw std::runtime_error("Unsupported front-end link version " + std::to_string(hello.version));
+}
+
+MapLinkServer::~MapLinkServer()
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (corrector.joinable())
+        corrector.join();
+}
+
+PinholeStereoCamera* MapLinkServer::camera() const
+{
+    return new PinholeStereoCamera(hello.width, hello.height, hello.fx, hello.fy, hello.cx, hello.cy, hello.b);
+}
+
+void MapLinkServer::run(MapHandler *map_, PinholeStereoCamera *cam)
+{
+    map = map_;
+    map->addObserver(this);
+    corrector = std::thread(&MapLinkServer::correctionLoop, this);
+
+    std::vector<uint8_t> payload;
+    uint32_t type;
+    bool ended = false;
+    while (!ended && link.receive(type, payload)) {
+        if (type == LINK_END) {
+            ended = true;
+        } else if (type == LINK_KEYFRAME) {
+            KeyFrame *kf = decodeKeyFrame(payload.data(), payload.size(), cam);
+            // the map numbers its KFs in insertion order, as the front-end does
+            if (kf->kf_idx != n_kfs) {
+                int kf_seq = kf->kf_idx;
+                delete kf;
+                throw std::runtime_error("KF " + std::to_string(kf_seq) + " out of sequence (expected " +
+                                         std::to_string(n_kfs) + ")");
+            }
+            if (n_kfs == 0)
+                map->initialize(kf);
+            else
+                map->addKeyFrame(kf);
+            n_kfs++;
+        }
+    }
+    if (!ended)
+        std::cerr << "MapLinkServer: connection to the front-end lost after " << n_kfs << " KFs" << std::endl;
+    if (n_kfs > 0)
+        map->finishSLAM();
+
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stopping = true;
+    }
+    wake.notify_all();
+    corrector.join();
+}
+
+void MapLinkServer::close()
+{
+    if (map != nullptr)
+        sendCorrections();
+    link.shutdown();
+}
+
+void MapLinkServer::mapChanged(const MapHandler*)
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        changed = true;
+    }
+    wake.notify_one();
+}
+
+void MapLinkServer::correctionLoop()
+{
+    Config::Scope scope(config);
+    setupThread(THREAD_LINK);
+
+    std::unique_lock<std::mutex> lk(mtx);
+    while (true) {
+        wake.wait(lk, [this]{ return changed || stopping; });
+        if (!changed) break;
+        changed = false;
+        lk.unlock();
+        sendCorrections();
+        lk.lock();
+    }
+}
+
+void MapLinkServer::sendCorrections()
+{
+    // world poses of the live KFs that moved since they were last sent
+    std::vector<KFCorrection> batch;
+    {
+        SharedLock lk(map->map_mutex);
+        for (const KeyFrame *kf : map->map_keyframes) {
+            if (kf == nullptr) continue;
+            KFCorrection c;
+            c.kf_seq = kf->kf_idx;
+            Vector6d x = logmap_se3(kf->T_kf_w);
+            std::memcpy(c.x_kf_w, x.data(), sizeof(c.x_kf_w));
+            if (c.kf_seq >= int(sent.size())) {
+                KFCorrection none;
+                std::memset(&none, 0, sizeof(none));
+                none.kf_seq = -1;
+                sent.resize(size_t(c.kf_seq) + 1, none);
+            }
+            if (sent[c.kf_seq].kf_seq >= 0 && std::memcmp(sent[c.kf_seq].x_kf_w, c.x_kf_w, sizeof(c.x_kf_w)) == 0)
+                continue;
+            sent[c.kf_seq] = c;
+            batch.push_back(c);
+        }
+    }
+    if (batch.empty()) return;
+    std::vector<uint8_t> msg;
+    encodeCorrections(batch, msg);
+    link.send(LINK_CORRECTIONS, msg);
+}
+
+} // namespace PLSLAM
@@ -0,0 +1,364 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "mapSerialization.h"
+
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stereoFrame.h>
+
+namespace PLSLAM {
+
+static uint64_t align8(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+
+// Writer
+
+MapFileWriter::Section& MapFileWriter::section(MapSectionType type, uint32_t record_size)
+{
+    for (Section &s : sections)
+        if (s.type == type) {
+            if (s.record_size != record_size)
+                throw std::runtime_error("[MapFileWriter] inconsistent record size");
+            return s;
+        }
+    Section s;
+    s.type        = type;
+    s.record_size = record_size;
+    s.count       = 0;
+    sections.push_back(s);
+    return sections.back();
+}
+
+uint64_t MapFileWriter::count(MapSectionType type) const
+{
+    for (const Section &s : sections)
+        if (s.type == type)
+            return s.count;
+    return 0;
+}
+
+MapListRef MapFileWriter::addDoubles(const double *v, uint64_t n, int dim)
+{
+    Section &s = section(MAP_SEC_DOUBLES, sizeof(double));
+    MapListRef ref = { s.count, n };
+    const char *p = reinterpret_cast<const char*>(v);
+    s.data.insert(s.data.end(), p, p + n * dim * sizeof(double));
+    s.count += n * dim;
+    return ref;
+}
+
+MapListRef MapFileWriter::addInts(const int *v, uint64_t n)
+{
+    Section &s = section(MAP_SEC_INTS, sizeof(int32_t));
+    MapListRef ref = { s.count, n };
+    for (uint64_t i = 0; i < n; ++i) {
+        int32_t x = v[i];
+        const char *p = reinterpret_cast<const char*>(&x);
+        s.data.insert(s.data.end(), p, p + sizeof(int32_t));
+    }
+    s.count += n;
+    return ref;
+}
+
+MapBlobRef MapFileWriter::addBytes(const void *p, uint64_t n)
+{
+    Section &s = section(MAP_SEC_BLOB, 1);
+    MapBlobRef ref = { s.count, n };
+    const char *c = static_cast<const char*>(p);
+    s.data.insert(s.data.end(), c, c + n);
+    s.data.resize(align8(s.data.size()), 0);
+    s.count = s.data.size();
+    return ref;
+}
+
+MapMatRef MapFileWriter::addMat(const cv::Mat &m)
+{
+    MapMatRef ref = { 0, 0, 0, 0, 0 };
+    if (m.empty())
+        return ref;
+    cv::Mat c = m.isContinuous() ? m : m.clone();
+    ref.offset = addBytes(c.data, c.total() * c.elemSize()).offset;
+    ref.rows   = c.rows;
+    ref.cols   = c.cols;
+    ref.type   = c.type();
+    return ref;
+}
+
+MapListRef MapFileWriter::addMats(const std::vector<cv::Mat> &v)
+{
+    MapListRef ref = { count(MAP_SEC_MATS), v.size() };
+    for (const cv::Mat &m : v)
+        add(MAP_SEC_MATS, addMat(m));
+    return ref;
+}
+
+MapBlobRef MapFileWriter::addString(const std::string &s)
+{
+    return addBytes(s.data(), s.size());
+}
+
+void MapFileWriter::write(const std::string &file) const
+{
+    MapFileHeader header;
+    std::memcpy(header.magic, MAP_FILE_MAGIC, sizeof(header.magic));
+    header.version      = MAP_FILE_VERSION;
+    header.endian       = MAP_FILE_ENDIAN;
+    header.num_sections = sections.size();
+
+    // lay out the sections after the table
+    std::vector<MapSectionEntry> entries(sections.size());
+    uint64_t offset = sizeof(MapFileHeader) + sections.size() * sizeof(MapSectionEntry);
+    for (size_t i = 0; i < sections.size(); ++i) {
+        entries[i].type        = sections[i].type;
+        entries[i].record_size = sections[i].record_size;
+        entries[i].offset      = offset;
+        entries[i].count       = sections[i].count;
+        offset = align8(offset + sections[i].data.size());
+    }
+    header.file_size = offset;
+
+    std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw std::runtime_error("[MapFileWriter] cannot open " + file);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!entries.empty())
+        out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(MapSectionEntry));
+    const char zeros[8] = { 0 };
+    for (size_t i = 0; i < sections.size(); ++i) {
+        const std::vector<char> &d = sections[i].data;
+        if (!d.empty())
+            out.write(d.data(), d.size());
+        out.write(zeros, align8(d.size()) - d.size());
+    }
+    if (!out)
+        throw std::runtime_error("[MapFileWriter] error writing " + file);
+}
+
+// Reader
+
+MapFileReader::MapFileReader(const std::string &file) :
+    fd(-1), base(NULL), size(0), header(NULL), entries(NULL)
+{
+    fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("[MapFileReader] cannot open " + file);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(MapFileHeader))) {
+        close(fd);
+        throw std::runtime_error("[MapFileReader] " + file + " is not a map file");
+    }
+    size = st.st_size;
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("[MapFileReader] cannot map " + file);
+    }
+    base   = static_cast<const char*>(p);
+    header = reinterpret_cast<const MapFileHeader*>(base);
+
+    std::string err;
+    if (std::memcmp(header->magic, MAP_FILE_MAGIC, sizeof(header->magic)) != 0)
+        err = "bad magic";
+    else if (header->endian != MAP_FILE_ENDIAN)
+        err = "unsupported endianness";
+    else if (header->version != MAP_FILE_VERSION)
+        err = "unsupported version " + std::to_string(header->version);
+    else if (header->file_size != size ||
+             header->num_sections > (size - sizeof(MapFileHeader)) / sizeof(MapSectionEntry))
+        err = "truncated file";
+    if (err.empty()) {
+        entries = reinterpret_cast<const MapSectionEntry*>(base + sizeof(MapFileHeader));
+        for (uint64_t i = 0; i < header->num_sections && err.empty(); ++i) {
+            const MapSectionEntry &e = entries[i];
+            if (e.record_size == 0 || e.offset % 8 != 0 || e.offset > size ||
+                e.count > (size - e.offset) / e.record_size)
+                err = "corrupted section table";
+        }
+    }
+    if (!err.empty()) {
+        munmap(const_cast<char*>(base), size);
+        close(fd);
+        throw std::runtime_error("[MapFileReader] " + file + ": " + err);
+    }
+}
+
+MapFileReader::~MapFileReader()
+{
+    munmap(const_cast<char*>(base), size);
+    close(fd);
+}
+
+const MapSectionEntry* MapFileReader::find(MapSectionType type, size_t record_size) const
+{
+    for (uint64_t i = 0; i < header->num_sections; ++i)
+        if (entries[i].type == type) {
+            if (entries[i].record_size != record_size)
+                throw std::runtime_error("[MapFileReader] unexpected record size in section " + std::to_string(type));
+            return &entries[i];
+        }
+    return NULL;
+}
+
+void MapFileReader::check(const MapListRef &ref, uint64_t n, int dim) const
+{
+    if (ref.begin > n || ref.count > (n - ref.begin) / dim)
+        throw std::runtime_error("[MapFileReader] list out of bounds");
+}
+
+const double* MapFileReader::doubles(const MapListRef &ref, int dim) const
+{
+    uint64_t n;
+    const double *d = records<double>(MAP_SEC_DOUBLES, n);
+    check(ref, n, dim);
+    return d == NULL ? NULL : d + ref.begin;
+}
+
+const int32_t* MapFileReader::ints(const MapListRef &ref) const
+{
+    uint64_t n;
+    const int32_t *d = records<int32_t>(MAP_SEC_INTS, n);
+    check(ref, n, 1);
+    return d == NULL ? NULL : d + ref.begin;
+}
+
+const char* MapFileReader::blob(uint64_t offset, uint64_t n) const
+{
+    uint64_t size_blob;
+    const char *b = records<char>(MAP_SEC_BLOB, size_blob);
+    if (offset > size_blob || n > size_blob - offset)
+        throw std::runtime_error("[MapFileReader] blob out of bounds");
+    return b == NULL ? NULL : b + offset;
+}
+
+cv::Mat MapFileReader::mat(const MapMatRef &ref) const
+{
+    if (ref.rows <= 0 || ref.cols <= 0)
+        return cv::Mat();
+    cv::Mat m(ref.rows, ref.cols, ref.type);
+    const uint64_t n = m.total() * m.elemSize();
+    std::memcpy(m.data, blob(ref.offset, n), n);
+    return m;
+}
+
+void MapFileReader::mats(const MapListRef &ref, std::vector<cv::Mat> &v) const
+{
+    const MapMatRef *m = list<MapMatRef>(MAP_SEC_MATS, ref);
+    v.resize(ref.count);
+    for (uint64_t i = 0; i < ref.count; ++i)
+        v[i] = mat(m[i]);
+}
+
+std::string MapFileReader::str(const MapBlobRef &ref) const
+{
+    return ref.size == 0 ? std::string() : std::string(blob(ref.offset, ref.size), ref.size);
+}
+
+// Stereo features
+
+void writeStereoFeatures(MapFileWriter &out, const StVO::StereoFrame *sf, MapListRef &points, MapListRef &lines)
+{
+    points.begin = out.count(MAP_SEC_KF_POINTS);
+    points.count = sf->stereo_pt.size();
+    for (const StVO::PointFeature* pt : sf->stereo_pt)
+    {
+        MapKFPointRecord p = MapKFPointRecord();
+        Map<Vector2d>(p.pl)      = pt->pl;
+        Map<Vector2d>(p.pl_obs)  = pt->pl_obs;
+        Map<Vector3d>(p.P)       = pt->P;
+        Map<Matrix3d>(p.covP_an) = pt->covariance( sf->cam );
+        p.disp   = pt->disp;
+        p.sigma2 = pt->sigma2;
+        p.idx    = pt->idx;
+        p.level  = pt->level;
+        p.inlier = pt->inlier;
+        out.add(MAP_SEC_KF_POINTS, p);
+    }
+
+    lines.begin = out.count(MAP_SEC_KF_LINES);
+    lines.count = sf->stereo_ls.size();
+    for (const StVO::LineFeature* ls : sf->stereo_ls)
+    {
+        MapKFLineRecord l = MapKFLineRecord();
+        Map<Vector2d>(l.spl)     = ls->spl;
+        Map<Vector2d>(l.epl)     = ls->epl;
+        Map<Vector2d>(l.spl_obs) = ls->spl_obs;
+        Map<Vector2d>(l.epl_obs) = ls->epl_obs;
+        Map<Vector3d>(l.sP)      = ls->sP;
+        Map<Vector3d>(l.eP)      = ls->eP;
+        Map<Vector3d>(l.le)      = ls->le;
+        Map<Vector3d>(l.le_obs)  = ls->le_obs;
+        Map<Matrix3d>(l.covE_an) = ls->endCovariance( sf->cam );
+        Map<Matrix3d>(l.covS_an) = ls->startCovariance( sf->cam );
+        Map<Vector6d>(l.NDc)     = ls->NDc;
+        l.sdisp     = ls->sdisp;
+        l.edisp     = ls->edisp;
+        l.angle     = ls->angle;
+        l.sdisp_obs = ls->sdisp_obs;
+        l.edisp_obs = ls->edisp_obs;
+        l.sigma2    = ls->sigma2;
+        l.idx       = ls->idx;
+        l.level     = ls->level;
+        l.inlier    = ls->inlier;
+        out.add(MAP_SEC_KF_LINES, l);
+    }
+}
+
+void readStereoFeatures(const MapFileReader &in, const MapListRef &points, const MapListRef &lines, StVO::StereoFrame *sf)
+{
+    const MapKFPointRecord* pt_recs = in.list<MapKFPointRecord>(MAP_SEC_KF_POINTS, points);
+    sf->stereo_pt.reserve( points.count );
+    for (uint64_t j = 0; j < points.count; j++)
+    {
+        const MapKFPointRecord &p = pt_recs[j];
+        StVO::PointFeature* pt = sf->arena->points.create( Vector2d(Map<const Vector2d>(p.pl)), p.disp, Vector3d(Map<const Vector3d>(p.P)),
+                                                     Vector2d(Map<const Vector2d>(p.pl_obs)), p.idx, p.level, p.sigma2,
+                                                     Matrix3d(Map<const Matrix3d>(p.covP_an)), bool(p.inlier) );
+        pt->idx = p.idx;
+        sf->stereo_pt.push_back( pt );
+    }
+
+    const MapKFLineRecord* ls_recs = in.list<MapKFLineRecord>(MAP_SEC_KF_LINES, lines);
+    sf->stereo_ls.reserve( lines.count );
+    for (uint64_t j = 0; j < lines.count; j++)
+    {
+        const MapKFLineRecord &l = ls_recs[j];
+        StVO::LineFeature* ls = sf->arena->lines.create( Vector2d(Map<const Vector2d>(l.spl)), l.sdisp, Vector3d(Map<const Vector3d>(l.sP)),
+                                                   Vector2d(Map<const Vector2d>(l.spl_obs)), l.sdisp_obs,
+                                                   Vector2d(Map<const Vector2d>(l.epl)), l.edisp, Vector3d(Map<const Vector3d>(l.eP)),
+                                                   Vector2d(Map<const Vector2d>(l.epl_obs)), l.edisp_obs,
+                                                   Vector3d(Map<const Vector3d>(l.le)), Vector3d(Map<const Vector3d>(l.le_obs)),
+                                                   l.angle, l.idx, l.level, bool(l.inlier), l.sigma2,
+                                                   Matrix3d(Map<const Matrix3d>(l.covE_an)), Matrix3d(Map<const Matrix3d>(l.covS_an)),
+                                                   Vector6d(Map<const Vector6d>(l.NDc)) );
+        ls->sigma2 = l.sigma2;  // the constructor rescales it with the octave
+        sf->stereo_ls.push_back( ls );
+    }
+    sf->updateFeatureArrays();
+}
+
+} // namespace PLSLAM
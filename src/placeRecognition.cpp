@@ -0,0 +1,179 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include <placeRecognition.h>
+
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+
+namespace PLSLAM{
+
+PlaceRecognition::PlaceRecognition() : voc_p(NULL), voc_l(NULL), db_p(NULL), db_l(NULL) {}
+
+PlaceRecognition::~PlaceRecognition()
+{
+    delete db_p;
+    delete db_l;
+}
+
+void PlaceRecognition::setVocabularies( const Vocabulary *voc_p_, const Vocabulary *voc_l_ )
+{
+    delete db_p;
+    delete db_l;
+    db_p = db_l = NULL;
+
+    voc_p = voc_p_;
+    voc_l = voc_l_;
+    // the direct index is not needed since the feature matching is performed on the full KF
+    if( voc_p != NULL )
+        db_p = new BowDatabase( *voc_p, false, 0 );
+    if( voc_l != NULL )
+        db_l = new BowDatabase( *voc_l, false, 0 );
+    entry_kf_idx.clear();
+}
+
+void PlaceRecognition::clear()
+{
+    if( db_p != NULL ) db_p->clear();
+    if( db_l != NULL ) db_l->clear();
+    entry_kf_idx.clear();
+}
+
+void PlaceRecognition::addKeyFrame( const KeyFrame *kf )
+{
+    if( !entry_kf_idx.empty() && kf->kf_idx <= entry_kf_idx.back() )
+        throw std::runtime_error("[PlaceRecognition->addKeyFrame] KFs must be inserted in increasing order");
+
+    // both databases are filled at the same time, so they share the entry ids
+    if( db_p != NULL )
+        db_p->add( kf->descDBoW_P );
+    if( db_l != NULL )
+        db_l->add( kf->descDBoW_L );
+    entry_kf_idx.push_back( kf->kf_idx );
+}
+
+void PlaceRecognition::featureWeights( const KeyFrame *kf, double &w_p, double &w_l ) const
+{
+    if( db_p == NULL || db_l == NULL )
+    {
+        w_p = ( db_p != NULL ) ? 1.0 : 0.0;
+        w_l = ( db_l != NULL ) ? 1.0 : 0.0;
+        return;
+    }
+
+    // estimate dispersion of point features
+    vector<double> pt_x, pt_y;
+    for (PointFeature* pt : kf->stereo_frame->stereo_pt)
+    {
+        pt_x.push_back( pt->pl(0) );
+        pt_y.push_back( pt->pl(1) );
+    }
+    double std_pt = vector_stdv( pt_x ) + vector_stdv( pt_y );
+    int    n_pt   = pt_x.size();
+
+    // estimate dispersion of line segment features
+    vector<double> ls_x, ls_y;
+    for (LineFeature* ls : kf->stereo_frame->stereo_ls)
+    {
+        Vector2d mp;
+        mp << (ls->spl + ls->epl)*0.5;
+        ls_x.push_back( mp(0) );
+        ls_y.push_back( mp(1) );
+    }
+    double std_ls = vector_stdv( ls_x ) + vector_stdv( ls_y );
+    double std_pl = std_ls + std_pt;
+    int    n_ls   = ls_x.size();
+    int    n_pl   = n_pt + n_ls;
+
+    // strategy#1 (number of features) + strategy#2 (dispersion of the features)
+    w_p = double(n_pt) / n_pl + std_pt / std_pl;
+    w_l = double(n_ls) / n_pl + std_ls / std_pl;
+}
+
+double PlaceRecognition::score( const KeyFrame *kf_q, const KeyFrame *kf ) const
+{
+    double w_p, w_l;
+    featureWeights( kf_q, w_p, w_l );
+    return weightedScore( kf_q, kf, w_p, w_l );
+}
+
+double PlaceRecognition::weightedScore( const KeyFrame *kf_q, const KeyFrame *kf, double w_p, double w_l ) const
+{
+    double score = 0.0;
+    if( voc_p != NULL && w_p > 0.0 )
+        score += w_p * voc_p->score( kf_q->descDBoW_P, kf->descDBoW_P );
+    if( voc_l != NULL && w_l > 0.0 )
+        score += w_l * voc_l->score( kf_q->descDBoW_L, kf->descDBoW_L );
+    return score;
+}
+
+int PlaceRecognition::maxEntryId( int max_kf_idx ) const
+{
+    // entries are sorted by kf_idx
+    vector<int>::const_iterator it = upper_bound( entry_kf_idx.begin(), entry_kf_idx.end(), max_kf_idx );
+    return int( it - entry_kf_idx.begin() ) - 1;
+}
+
+void PlaceRecognition::query( const KeyFrame *kf_q, int max_kf_idx, int max_results, const vector<KeyFrame*> &keyframes,
+                              vector<pair<int,double>> &candidates ) const
+{
+    candidates.clear();
+    // DBoW2 only returns the entries below max_id (and all of them for -1)
+    int last_id = maxEntryId( max_kf_idx );
+    if( last_id < 0 || max_results <= 0 )
+        return;
+    int max_id = last_id + 1;
+
+    // retrieve the best entries of each database through the inverted file
+    set<int> kf_idxs;
+    DBoW2::QueryResults ret;
+    if( db_p != NULL )
+    {
+        db_p->query( kf_q->descDBoW_P, ret, max_results, max_id );
+        for( const DBoW2::Result &r : ret )
+            kf_idxs.insert( entry_kf_idx[r.Id] );
+    }
+    if( db_l != NULL )
+    {
+        db_l->query( kf_q->descDBoW_L, ret, max_results, max_id );
+        for( const DBoW2::Result &r : ret )
+            kf_idxs.insert( entry_kf_idx[r.Id] );
+    }
+
+    // rescore the union with the combined score
+    double w_p, w_l;
+    featureWeights( kf_q, w_p, w_l );
+    for( int idx : kf_idxs )
+    {
+        if( idx >= int(keyframes.size()) || keyframes[idx] == NULL )
+            continue;
+        candidates.push_back( make_pair(idx, weightedScore(kf_q, keyframes[idx], w_p, w_l)) );
+    }
+
+    sort( candidates.begin(), candidates.end(),
+          [](const pair<int,double> &a, const pair<int,double> &b) { return a.second > b.second; } );
+    if( int(candidates.size()) > max_results )
+        candidates.resize( max_results );
+}
+
+}
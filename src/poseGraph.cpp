@@ -0,0 +1,243 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include <poseGraph.h>
+
+#include <cstdlib>
+
+#include <g2o/core/block_solver.h>
+#include <g2o/core/optimization_algorithm_levenberg.h>
+#include <g2o/solvers/cholmod/linear_solver_cholmod.h>
+#include <g2o/types/slam3d/edge_se3.h>
+#include <g2o/types/slam3d/vertex_se3.h>
+
+#include <auxiliar.h>
+#include <logger.h>
+
+namespace PLSLAM {
+
+PoseGraph::PoseGraph() : n_vertices(0), bytes(0) {
+
+    typedef g2o::BlockSolver<g2o::BlockSolverTraits<6,3>> BlockSolverType;
+    typedef g2o::LinearSolverCholmod<BlockSolverType::PoseMatrixType> LinearSolverType;
+    auto solver = new g2o::OptimizationAlgorithmLevenberg(g2o::make_unique<BlockSolverType>(
+            g2o::make_unique<LinearSolverType>()));
+    solver->setUserLambdaInit(1e-10);
+    optimizer.setAlgorithm(solver);
+    optimizer.setVerbose(false);
+
+    terminate = new g2o::SparseOptimizerTerminateAction();
+    optimizer.addPostIterationAction(terminate);
+}
+
+PoseGraph::~PoseGraph() {
+
+    optimizer.removePostIterationAction(terminate);
+    delete terminate;
+}
+
+void PoseGraph::clear() {
+
+    optimizer.clear();
+    edges.clear();
+    loops.clear();
+    n_vertices = 0;
+    updateBytes();
+}
+
+bool PoseGraph::hasVertex(int idx) const {
+
+    return optimizer.vertex(idx) != NULL;
+}
+
+void PoseGraph::setVertex(int idx, const Eigen::Matrix4d &T_kf_w, bool fixed) {
+
+    g2o::VertexSE3* v_se3 = static_cast<g2o::VertexSE3*>(optimizer.vertex(idx));
+    if( v_se3 == NULL )
+    {
+        v_se3 = new g2o::VertexSE3();
+        v_se3->setId(idx);
+        v_se3->setMarginalized(false);
+        optimizer.addVertex(v_se3);
+        n_vertices++;
+        updateBytes();
+    }
+    v_se3->setEstimate( g2o::SE3Quat::exp( reverse_se3(logmap_se3(T_kf_w)) ) );
+    v_se3->setFixed(fixed);
+}
+
+void PoseGraph::removeVertex(int idx) {
+
+    g2o::VertexSE3* v = static_cast<g2o::VertexSE3*>(optimizer.vertex(idx));
+    if( v == NULL )
+        return;
+
+    // closest KF constrained to the culled one
+    g2o::VertexSE3* v_anchor = NULL;
+    for( auto it = edges.begin(); it != edges.end(); it++ )
+    {
+        int k = it->first.first == idx ? it->first.second : ( it->first.second == idx ? it->first.first : -1 );
+        if( k >= 0 && ( v_anchor == NULL || std::abs(k - idx) < std::abs(v_anchor->id() - idx) ) )
+            v_anchor = static_cast<g2o::VertexSE3*>(optimizer.vertex(k));
+    }
+
+    // move its loops to the anchor, with the relative pose of the culled KF in the graph
+    for( auto it = loops.begin(); it != loops.end(); )
+    {
+        g2o::EdgeSE3* e = it->second;
+        bool first = e->vertex(0) == v;
+        if( !first && e->vertex(1) != v )
+        {
+            it++;
+            continue;
+        }
+        g2o::OptimizableGraph::Vertex* v_other = static_cast<g2o::OptimizableGraph::Vertex*>(e->vertex( first ? 1 : 0 ));
+        if( v_anchor == NULL || v_anchor == v_other )
+        {
+            it = loops.erase(it);
+            continue;
+        }
+        g2o::EdgeSE3* e_se3 = new g2o::EdgeSE3();
+        Eigen::Isometry3d T_anchor_v = v_anchor->estimate().inverse() * v->estimate();
+        if( first )
+        {
+            e_se3->setVertex( 0, v_anchor );
+            e_se3->setVertex( 1, v_other );
+            e_se3->setMeasurement( T_anchor_v * e->measurement() );
+        }
+        else
+        {
+            e_se3->setVertex( 0, v_other );
+            e_se3->setVertex( 1, v_anchor );
+            e_se3->setMeasurement( e->measurement() * T_anchor_v.inverse() );
+        }
+        e_se3->setInformation( e->information() );
+        optimizer.addEdge( e_se3 );
+        it->second = e_se3;
+        it++;
+    }
+
+    // g2o removes (and deletes) the edges of the vertex
+    optimizer.removeVertex(v);
+    n_vertices--;
+    for( auto it = edges.begin(); it != edges.end(); )
+    {
+        if( it->first.first == idx || it->first.second == idx )
+            it = edges.erase(it);
+        else
+            it++;
+    }
+    updateBytes();
+}
+
+bool PoseGraph::addEdge(int i, int j, const Eigen::Matrix<double,6,1> &x_ij, bool loop,
+                        const Eigen::Matrix<double,6,6> &information) {
+
+    if( optimizer.vertex(i) == NULL || optimizer.vertex(j) == NULL )
+        return false;
+    std::map< std::pair<int,int>, g2o::EdgeSE3* > &constraints = loop ? loops : edges;
+    auto it = constraints.find( std::make_pair(i,j) );
+    if( it != constraints.end() )
+    {
+        // the KFs have been refined since the constraint was measured
+        if( !loop )
+        {
+            it->second->setMeasurement( g2o::SE3Quat::exp( reverse_se3(x_ij) ) );
+            it->second->setInformation( information );
+        }
+        return false;
+    }
+    g2o::EdgeSE3* e_se3 = new g2o::EdgeSE3();
+    e_se3->setVertex( 0, optimizer.vertex(i) );
+    e_se3->setVertex( 1, optimizer.vertex(j) );
+    e_se3->setMeasurement( g2o::SE3Quat::exp( reverse_se3(x_ij) ) );
+    e_se3->setInformation( information );
+    optimizer.addEdge( e_se3 );
+    constraints[ std::make_pair(i,j) ] = e_se3;
+    updateBytes();
+    return true;
+}
+
+int PoseGraph::optimize(int first_idx, int max_iters, double min_gain) {
+
+    // vertices from first_idx on, and the older ones constrained to them (fixed meanwhile)
+    g2o::HyperGraph::VertexSet vset;
+    std::vector<g2o::OptimizableGraph::Vertex*> boundary;
+    for( auto &v : optimizer.vertices() )
+    {
+        if( v.first < first_idx )
+            continue;
+        vset.insert( v.second );
+        for( g2o::HyperGraph::Edge* e : v.second->edges() )
+        {
+            for( g2o::HyperGraph::Vertex* vj : e->vertices() )
+            {
+                if( vj->id() >= first_idx || !vset.insert(vj).second )
+                    continue;
+                g2o::OptimizableGraph::Vertex* oj = static_cast<g2o::OptimizableGraph::Vertex*>(vj);
+                if( !oj->fixed() )
+                {
+                    oj->setFixed(true);
+                    boundary.push_back(oj);
+                }
+            }
+        }
+    }
+    if( vset.empty() )
+        return 0;
+
+    terminate->setGainThreshold(min_gain);
+    terminate->setMaxIterations(max_iters);
+    // the action raises the stop flag of the optimizer when it ends a solve and only lowers it when
+    // invoked with iteration -1, otherwise the next loops would not iterate
+    g2o::HyperGraphAction::ParametersIteration reset(-1);
+    (*terminate)(&optimizer, &reset);
+    if( optimizer.terminate() )
+    {
+        LOG_ERROR( "[PoseGraph] the stop flag of the optimizer is still raised, the loop is not optimized" );
+        for( g2o::OptimizableGraph::Vertex* v : boundary )
+            v->setFixed(false);
+        return -1;
+    }
+    optimizer.initializeOptimization(vset);
+    optimizer.computeInitialGuess();
+    optimizer.computeActiveErrors();
+    int iters = optimizer.optimize(max_iters);
+
+    for( g2o::OptimizableGraph::Vertex* v : boundary )
+        v->setFixed(false);
+    return iters;
+}
+
+Eigen::Matrix4d PoseGraph::pose(int idx) {
+
+    g2o::VertexSE3* v_se3 = static_cast<g2o::VertexSE3*>(optimizer.vertex(idx));
+    return expmap_se3( reverse_se3( v_se3->estimateAsSE3Quat().log() ) );
+}
+
+void PoseGraph::updateBytes() {
+
+    bytes = n_vertices * ( sizeof(g2o::VertexSE3) + 2 * sizeof(void*) )
+          + ( edges.size() + loops.size() ) * ( sizeof(g2o::EdgeSE3) + sizeof(std::pair<int,int>) + 5 * sizeof(void*) );
+}
+
+} // namespace PLSLAM
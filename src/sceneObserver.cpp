@@ -0,0 +1,128 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include <sceneObserver.h>
+
+#include <algorithm>
+
+#include <stereoFrame.h>
+#include <threadRole.h>
+
+namespace PLSLAM {
+
+SceneObserver::SceneObserver(slamScene &scene_, const MapHandler *map_, double max_fps) :
+    scene(scene_), map(map_),
+    period(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / std::max(max_fps, 1.0)))),
+    kf_DT(Matrix4d::Identity()), drawn_DT(Matrix4d::Identity()), kf_seq(0), has_image(false), has_pose(false), map_dirty(false), stopping(false),
+    last_image(std::chrono::steady_clock::now() - period)
+{
+    viewer = std::thread(&SceneObserver::run, this);
+}
+
+SceneObserver::~SceneObserver()
+{
+    stop();
+}
+
+void SceneObserver::stop()
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (stopping) return;
+        stopping = true;
+    }
+    wake.notify_one();
+    viewer.join();
+}
+
+void SceneObserver::frameTracked(StVO::StereoFrame *frame, bool is_kf)
+{
+    // the frame is only accessible during the call: render its image here, but not faster than the viewer
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    Mat img;
+    if (now - last_image >= period) {
+        img = frame->plotStereoFrame();
+        last_image = now;
+    }
+
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!img.empty()) {
+        image = img;
+        has_image = true;
+    }
+    if (is_kf) {
+        // the map redraw moves the camera to the new KF
+        kf_DT     = Matrix4d::Identity();
+        drawn_DT  = Matrix4d::Identity();
+        has_pose  = false;
+        map_dirty = true;
+        kf_seq++;
+    } else {
+        kf_DT    = kf_DT * frame->DT;
+        has_pose   = true;
+    }
+}
+
+void SceneObserver::mapChanged(const MapHandler*)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    map_dirty = true;
+}
+
+void SceneObserver::run()
+{
+    StVO::setupThread(StVO::THREAD_VIEWER);
+    std::unique_lock<std::mutex> lk(mtx);
+    while (!stopping) {
+        wake.wait_for(lk, period);
+        if (stopping) break;
+        if (!(has_image || has_pose || map_dirty)) continue;
+
+        Mat img = image;
+        Matrix4d DT = kf_DT, DT_drawn = drawn_DT;
+        unsigned int seq = kf_seq;
+        bool draw_img = has_image, draw_pose = has_pose, draw_map = map_dirty;
+        image = Mat();
+        has_image = has_pose = map_dirty = false;
+        lk.unlock();
+
+        if (draw_img)
+            scene.setImage(img);
+        // the map redraw puts the camera back on the last KF: reapply the whole motion since that KF,
+        // otherwise only the part not drawn yet
+        bool map_drawn = draw_map && scene.updateSceneSafe(map);
+        if (!map_drawn || draw_pose || !DT.isIdentity()) {
+            scene.setPose(map_drawn ? DT : Matrix4d(inverse_se3(DT_drawn) * DT));
+            scene.updateScene();
+        }
+
+        lk.lock();
+        // a KF arrived meanwhile: its increments are drawn from the current camera
+        if (seq == kf_seq)
+            drawn_DT = DT;
+        // the map was busy: try again on the next period
+        if (draw_map && !map_drawn)
+            map_dirty = true;
+    }
+}
+
+} // namespace PLSLAM
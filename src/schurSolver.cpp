@@ -0,0 +1,268 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include <schurSolver.h>
+
+#include <cmath>
+#include <unordered_map>
+#include <eigen3/Eigen/Cholesky>
+#include <eigen3/Eigen/SparseCholesky>
+
+using namespace std;
+using namespace Eigen;
+
+namespace PLSLAM{
+
+SchurSolver::SchurSolver( int Nkf_, const vector<int> &lm_dims ) : analyzed(false), structure_changed(true), factorized(false)
+{
+    resize( Nkf_, lm_dims );
+}
+
+void SchurSolver::resize( int Nkf_, const vector<int> &lm_dims )
+{
+    Nkf = Nkf_;
+    Hpp.assign( Nkf, Matrix6d::Zero() );
+    Hll.resize( lm_dims.size() );
+    lm_off.resize( lm_dims.size() );
+    Hlp.assign( lm_dims.size(), vector<pair<int,MatrixX6d>>() );
+    N = 6 * Nkf;
+    for( size_t j = 0; j < lm_dims.size(); j++ )
+    {
+        Hll[j]    = MatrixXd::Zero( lm_dims[j], lm_dims[j] );
+        lm_off[j] = N;
+        N        += lm_dims[j];
+    }
+    analyzed          = false;
+    structure_changed = true;
+}
+
+void SchurSolver::setZero()
+{
+    for( Matrix6d &H : Hpp )
+        H.setZero();
+    for( MatrixXd &H : Hll )
+        H.setZero();
+    for( auto &blocks : Hlp )
+        for( auto &b : blocks )
+            b.second.setZero();
+}
+
+void SchurSolver::addPoseLandmark( int kf, int lm, const MatrixXd &Hji )
+{
+    if( addPoseLandmarkBlock( kf, lm, Hji ) )
+        structure_changed = true;
+}
+
+bool SchurSolver::addPoseLandmarkBlock( int kf, int lm, const MatrixXd &Hji )
+{
+    // a landmark is observed by a few KFs, so a linear search is enough
+    for( auto &b : Hlp[lm] )
+    {
+        if( b.first == kf )
+        {
+            b.second += Hji;
+            return false;
+        }
+    }
+    Hlp[lm].push_back( make_pair(kf, MatrixX6d(Hji)) );
+    return true;
+}
+
+SchurSolver::Accumulator::Accumulator( SchurSolver &solver_ )
+    : g_pose( VectorXd::Zero( 6 * solver_.Nkf ) ), err(0.0), solver(solver_), Hpp( solver_.Nkf, Matrix6d::Zero() ), new_blocks(false)
+{
+}
+
+void SchurSolver::Accumulator::merge( VectorXd &g )
+{
+    for( int i = 0; i < solver.Nkf; i++ )
+        solver.Hpp[i] += Hpp[i];
+    g.head( 6 * solver.Nkf ) += g_pose;
+    if( new_blocks )
+        solver.structure_changed = true;
+}
+
+double SchurSolver::maxDiagonal() const
+{
+    double Hmax = 0.0;
+    for( const Matrix6d &H : Hpp )
+        Hmax = max( Hmax, H.diagonal().cwiseAbs().maxCoeff() );
+    for( const MatrixXd &H : Hll )
+        if( H.rows() > 0 )
+            Hmax = max( Hmax, H.diagonal().cwiseAbs().maxCoeff() );
+    return Hmax;
+}
+
+void SchurSolver::addRelativeDamping( double lambda )
+{
+    for( Matrix6d &H : Hpp )
+        H.diagonal() *= ( 1.0 + lambda );
+    for( MatrixXd &H : Hll )
+        H.diagonal() *= ( 1.0 + lambda );
+}
+
+void SchurSolver::removeRelativeDamping( double lambda )
+{
+    for( Matrix6d &H : Hpp )
+        H.diagonal() /= ( 1.0 + lambda );
+    for( MatrixXd &H : Hll )
+        H.diagonal() /= ( 1.0 + lambda );
+}
+
+bool SchurSolver::solve( const VectorXd &g, VectorXd &DX )
+{
+    DX = VectorXd::Zero( N );
+    int Nlm = Hll.size();
+    factorized = false;
+
+    // invert the landmark blocks (block-diagonal)
+    vector<MatrixXd> Hll_inv( Nlm );
+    for( int j = 0; j < Nlm; j++ )
+    {
+        int dj = Hll[j].rows();
+        Hll_inv[j] = Hll[j].ldlt().solve( MatrixXd::Identity(dj,dj) );
+        if( !Hll_inv[j].allFinite() )
+            Hll_inv[j].setZero();   // degenerate landmark, keep it fixed
+    }
+
+    if( Nkf > 0 )
+    {
+        // reduced camera system: S = Hpp - sum_j Hjp^T Hjj^-1 Hjp  and  b = gp - sum_j Hjp^T Hjj^-1 gj
+        VectorXd b = g.head( 6*Nkf );
+        vector<unordered_map<int,Matrix6d>> S_blocks( Nkf );   // lower triangle, S_blocks[row][col]
+        for( int i = 0; i < Nkf; i++ )
+            S_blocks[i][i] = Hpp[i];
+        for( int j = 0; j < Nlm; j++ )
+        {
+            const vector<pair<int,MatrixX6d>> &blocks = Hlp[j];
+            VectorXd gj = g.segment( lm_off[j], Hll[j].rows() );
+            for( size_t a = 0; a < blocks.size(); a++ )
+            {
+                int i = blocks[a].first;
+                MatrixXd Y = blocks[a].second.transpose() * Hll_inv[j];     // 6 x dj
+                b.segment<6>(6*i) -= Y * gj;
+                for( size_t c = 0; c < blocks.size(); c++ )
+                {
+                    int k = blocks[c].first;
+                    if( k > i ) continue;
+                    Matrix6d Sik = Y * blocks[c].second;
+                    auto it = S_blocks[i].find(k);
+                    if( it == S_blocks[i].end() )
+                        S_blocks[i].insert( make_pair(k, -Sik) );
+                    else
+                        it->second -= Sik;
+                }
+            }
+        }
+
+        // assemble the sparse matrix (full 6x6 blocks so the pattern only depends on the structure)
+        vector<Triplet<double>> triplets;
+        for( int i = 0; i < Nkf; i++ )
+        {
+            for( const auto &blk : S_blocks[i] )
+            {
+                int k = blk.first;
+                for( int r = 0; r < 6; r++ )
+                {
+                    for( int c = 0; c < 6; c++ )
+                    {
+                        if( i == k && c > r ) continue;
+                        double v = blk.second(r,c);
+                        // unconstrained pose coordinates (no observations) are kept fixed
+                        if( i == k && r == c && Hpp[i](r,r) == 0.0 )
+                            v = 1.0;
+                        triplets.push_back( Triplet<double>(6*i+r, 6*k+c, v) );
+                    }
+                }
+            }
+        }
+        int nnz_prev = S.nonZeros();
+        S.resize( 6*Nkf, 6*Nkf );
+        S.setFromTriplets( triplets.begin(), triplets.end() );
+        if( S.nonZeros() != nnz_prev )
+            structure_changed = true;
+
+        // symbolic factorization only when the structure changes
+        if( !analyzed || structure_changed )
+        {
+            chol.analyzePattern( S );
+            analyzed          = true;
+            structure_changed = false;
+        }
+        chol.factorize( S );
+        VectorXd xp;
+        if( chol.info() == Success )
+            xp = chol.solve( b );
+        factorized = chol.info() == Success && xp.allFinite();
+        if( !factorized )
+        {
+            SimplicialLDLT< SparseMatrix<double>, Lower > ldlt( S );
+            if( ldlt.info() != Success )
+            {
+                DX.setZero();
+                return false;
+            }
+            xp = ldlt.solve( b );
+        }
+        DX.head( 6*Nkf ) = xp;
+    }
+
+    // back-substitution of the landmarks: DXj = Hjj^-1 ( gj - sum_i Hji * DXi )
+    for( int j = 0; j < Nlm; j++ )
+    {
+        VectorXd rj = g.segment( lm_off[j], Hll[j].rows() );
+        for( const auto &blk : Hlp[j] )
+            rj -= blk.second * DX.segment<6>( 6*blk.first );
+        DX.segment( lm_off[j], Hll[j].rows() ) = Hll_inv[j] * rj;
+    }
+
+    if( !DX.allFinite() )
+    {
+        DX.setZero();
+        return false;
+    }
+    return true;
+}
+
+bool SchurSolver::poseCovariance( int kf, Matrix6d &cov ) const
+{
+    if( !factorized || kf < 0 || kf >= Nkf )
+        return false;
+    MatrixXd E = MatrixXd::Zero( 6*Nkf, 6 );
+    E.block<6,6>( 6*kf, 0 ).setIdentity();
+    MatrixXd C = chol.solve( E );
+    cov = C.block<6,6>( 6*kf, 0 );
+    cov = 0.5 * ( cov + cov.transpose() );
+    return cov.allFinite();
+}
+
+bool SchurSolver::poseCovariances( MatrixXd &cov ) const
+{
+    if( !factorized || Nkf == 0 )
+        return false;
+    MatrixXd E = MatrixXd::Identity( 6*Nkf, 6*Nkf );
+    cov = chol.solve( E );
+    cov = 0.5 * ( cov + cov.transpose() );
+    return cov.allFinite();
+}
+
+}
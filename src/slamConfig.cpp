@@ -36,6 +36,7 @@ using namespace std;
 SlamConfig::SlamConfig()
     : Config()
 {
+    slam_config = true;
     // Note: do not set default values for StVO Config here! (they can be overriten by the default class constructor...)
 
     // SLAM parameters
@@ -43,10 +44,25 @@ SlamConfig::SlamConfig()
     fast_matching         = false;      // allow for the fast matching (window-based) of the map features
     has_refinement        = false;      // refine the pose between keyframes (disabled as it is also performed by the LBA)
     mutithread_slam       = true;       // if true the system runs with both the VO, LBA and LC in parallel threads
+    kf_queue_size         = 64;         // capacity of the lock-free KF queue between the VO and the mapping thread
+    kf_batch_max          = 4;          // max. queued KFs inserted together, with one local map and LBA, when the mapper lags behind (1: one at a time)
+    compact_kfs           = false;      // true to drop the images and raw keypoints of the KFs leaving the local map
+    kf_thumbnail_scale    = 0.25;       // scale of the thumbnail kept by compact KFs for visualization (0 to keep none)
+    map_save_file         = "";         // binary map written at the end of the sequence (empty to skip)
+    map_load_file         = "";         // binary map loaded at startup (empty to start from an empty map)
+    fe_record_file        = "";         // front-end record written at the end of the sequence, for plslam_replay (empty to skip)
+    link_queue_size       = 8;          // KFs waiting for the network before a remote front-end blocks (plslam_bench -R)
+    localization_only     = false;      // true to only localize against the map of map_load_file (no new KFs nor LBA)
+    scene_max_fps         = 30.0;       // max. refresh rate of the map viewer (it redraws on its own thread)
 
     // lm numbers and errors
     min_lm_obs            = 5;          // min number of observations for a landmark to be considered as inlier
-    max_common_fts_kf     = 0.9;        // max number of common features for a keyframe to be considered redundant (disabled)
+    desc_history          = 32;         // number of recent descriptors used to choose the landmark descriptor
+    desc_majority_vote    = false;      // landmark descriptor as the bitwise majority of the recent ones (instead of the medoid)
+    desc_max_obs          = 0;          // max. descriptors kept per landmark, the oldest are dropped (0 keeps all, at least desc_history)
+    max_common_fts_kf     = 0.9;        // min. ratio of the landmarks of a KF observed by 3 other KFs to cull it as redundant
+    kf_culling            = false;      // cull redundant KFs in the background (after each LBA)
+    kf_cull_time_budget   = 5.0;        // time budget of the background KF culling in ms
 
     max_kf_epip_p         = 1.0;        // max epip distance for points in LBA
     max_kf_epip_l         = 1.0;        // max epip distance for line segments in LBA
@@ -60,11 +76,30 @@ SlamConfig::SlamConfig()
     min_lm_ess_graph      = 150;        // minimum number of landmarks for connectivity in Essential graph
     min_lm_cov_graph      = 75;         // minimum number of landmarks for connectivity in Covisibility graph
     min_kf_local_map      = 3;          // min number of landmarks for the local mapping
+    lba_max_kfs           = 0;          // max KFs in the LBA window, the most covisible ones (0: unbounded)
+    lba_max_lms           = 0;          // max landmarks optimized by LBA, the most observed ones (0: unbounded)
+    lba_max_fixed_kfs     = 0;          // max fixed observer KFs outside the LBA window (0: all)
 
     // LBA
     lambda_lba_lm         = 0.00001;    // (if auto, this is the initial tau)
     lambda_lba_k          = 10.0;       // lambda_k for LM method in LBA
     max_iters_lba         = 15;         // maximum number of iterations
+    lba_time_budget       = 0.0;        // LBA time budget in ms, the best iterate is kept (0 unlimited)
+    lba_interrupt         = false;      // stop LBA early (best iterate) as soon as a new KF is waiting
+    lba_marginalize       = false;      // optimize the KFs out of the LBA window with a pose prior from their observations left out of it, instead of anchoring them
+    submap_max_kfs        = 0;          // KFs per sub-map, full sub-maps are closed and frozen (0 for a single map)
+    lm_paging             = false;      // true to page the descriptors of the landmarks far from the camera out to lm_page_file
+    lm_page_file          = "lm.page";  // page file of the landmark descriptors (created, and truncated, at startup)
+    lm_tile_size          = 10.0;       // side (m) of the cubic tiles the landmarks are paged by
+    lm_page_radius        = 2;          // tiles (Chebyshev distance) around the current KF kept in memory
+    mem_budget_images     = 0.0;        // MB of KF images (and thumbnails) before the non-local KFs are compacted (0 disables)
+    mem_budget_landmarks  = 0.0;        // MB of landmark descriptors and observation lists before the non-local landmarks are pruned (0 disables)
+    mem_budget_total      = 0.0;        // MB of the whole map before compaction, pruning and KF culling are forced, in that order (0 disables)
+    mem_prune_desc_rows   = 0;          // descriptors kept per pruned landmark (at least desc_history)
+    gba_g2o               = true;       // global BA on the g2o types (multi-threaded), otherwise the hand-written LM
+    max_iters_gba         = 20;         // maximum GBA iterations
+    gba_time_budget       = 0.0;        // GBA time budget in ms (0 unlimited)
+    gba_after_lc          = false;      // run a GBA in the loop closure thread after each loop closure
 
     // Loop closure
     vocabulary_p          = "/home/ruben/code/pl-slam-dev/vocabulary/mapir_orb.yml";
@@ -77,10 +112,20 @@ SlamConfig::SlamConfig()
     lc_rot                = 35.0;       // maximum rotation in relative pose estimation
 
     max_iters_pgo         = 100;        // maximum number of iterations of the PGO
+    pgo_incremental       = true;       // keep the pose graph between loops and only solve the KFs affected by the new ones
+    pgo_min_gain          = 1e-6;       // minimum relative decrease of the PGO error to keep iterating
+    pg_retention_kfs      = 0;          // newest KFs kept with their landmarks, the older ones out of the local map are reduced to the pose graph (0 keeps all), its constraints keep the shape of the LBA covariance, not its scale
     lc_kf_dist            = 50;         // minimum number of KFs from prev LC
     lc_kf_max_dist        = 50;         // max distance from last LC KF
     lc_nkf_closest        = 4;          // number of KFs closest to the match to consider it as positive
     lc_inlier_ratio       = 30.0;       // inlier ratio to consider or not a loop closure
+    lc_max_candidates     = 50;         // number of candidates retrieved from the place recognition database
+    lc_verify_candidates  = 3;          // number of best candidates verified geometrically (in parallel)
+    lc_ransac_hyps        = 64;         // hypotheses of the LC pose minimal solver (0: GN from identity)
+    lc_fuse_voxel         = 0.1;        // voxel of the duplicate point search after a LC in meters (0: off)
+    lc_fuse_desc_th       = 50;         // max. descriptor distance of two fused duplicate points
+    lc_bow_levels_up      = 4;          // levels above the words of the nodes that guide KF to KF matching (< 0 for brute force)
+    lc_bow_max_dist       = 100;        // max. descriptor distance of a match guided by the nodes (a single candidate passes the ratio test)
 
     min_pt_matches        = 10;         // min number of point observations
     min_ls_matches        = 6;          // min number of line segment observations
@@ -90,6 +135,9 @@ SlamConfig::~SlamConfig(){}
 
 SlamConfig& SlamConfig::getInstance()
 {
+    Config *cfg = Config::current();
+    if( cfg != NULL && cfg->slam_config )
+        return *static_cast<SlamConfig*>(cfg);
     static SlamConfig instance; // Instantiated on first use and guaranteed to be destroyed
     return instance;
 }
@@ -119,7 +167,12 @@ void SlamConfig::loadFromFile( const string &config_file )
     YAML::Node config = YAML::LoadFile(config_file);
 
     SlamConfig::minLMObs() = loadSafe(config, "min_lm_obs", SlamConfig::minLMObs());
+    SlamConfig::descHistory() = loadSafe(config, "desc_history", SlamConfig::descHistory());
+    SlamConfig::descMajorityVote() = loadSafe(config, "desc_majority_vote", SlamConfig::descMajorityVote());
+    SlamConfig::descMaxObs() = loadSafe(config, "desc_max_obs", SlamConfig::descMaxObs());
     SlamConfig::maxCommonFtsKF() = loadSafe(config, "max_common_fts_kf", SlamConfig::maxCommonFtsKF());
+    SlamConfig::kfCulling() = loadSafe(config, "kf_culling", SlamConfig::kfCulling());
+    SlamConfig::kfCullTimeBudget() = loadSafe(config, "kf_cull_time_budget", SlamConfig::kfCullTimeBudget());
 
     SlamConfig::maxKFEpipP() = loadSafe(config, "max_kf_epip_p", SlamConfig::maxKFEpipP());
     SlamConfig::maxKFEpipL() = loadSafe(config, "max_kf_epip_l", SlamConfig::maxKFEpipL());
@@ -133,10 +186,29 @@ void SlamConfig::loadFromFile( const string &config_file )
     SlamConfig::minLMEssGraph() = loadSafe(config, "min_lm_ess_graph", SlamConfig::minLMEssGraph());
     SlamConfig::minLMCovGraph() = loadSafe(config, "min_lm_cov_graph", SlamConfig::minLMCovGraph());
     SlamConfig::minKFLocalMap() = loadSafe(config, "min_kf_local_map", SlamConfig::minKFLocalMap());
+    SlamConfig::lbaMaxKFs() = loadSafe(config, "lba_max_kfs", SlamConfig::lbaMaxKFs());
+    SlamConfig::lbaMaxLMs() = loadSafe(config, "lba_max_lms", SlamConfig::lbaMaxLMs());
+    SlamConfig::lbaMaxFixedKFs() = loadSafe(config, "lba_max_fixed_kfs", SlamConfig::lbaMaxFixedKFs());
 
     SlamConfig::lambdaLbaLM() = loadSafe(config, "lambda_lba_lm", SlamConfig::lambdaLbaLM());
     SlamConfig::lambdaLbaK() = loadSafe(config, "lambda_lba_k", SlamConfig::lambdaLbaK());
     SlamConfig::maxItersLba() = loadSafe(config, "max_iters_lba", SlamConfig::maxItersLba());
+    SlamConfig::lbaTimeBudget() = loadSafe(config, "lba_time_budget", SlamConfig::lbaTimeBudget());
+    SlamConfig::lbaInterrupt() = loadSafe(config, "lba_interrupt", SlamConfig::lbaInterrupt());
+    SlamConfig::lbaMarginalize() = loadSafe(config, "lba_marginalize", SlamConfig::lbaMarginalize());
+    SlamConfig::submapMaxKFs() = loadSafe(config, "submap_max_kfs", SlamConfig::submapMaxKFs());
+    SlamConfig::lmPaging() = loadSafe(config, "lm_paging", SlamConfig::lmPaging());
+    SlamConfig::lmPageFile() = loadSafe(config, "lm_page_file", SlamConfig::lmPageFile());
+    SlamConfig::lmTileSize() = loadSafe(config, "lm_tile_size", SlamConfig::lmTileSize());
+    SlamConfig::lmPageRadius() = loadSafe(config, "lm_page_radius", SlamConfig::lmPageRadius());
+    SlamConfig::memBudgetImages() = loadSafe(config, "mem_budget_images", SlamConfig::memBudgetImages());
+    SlamConfig::memBudgetLandmarks() = loadSafe(config, "mem_budget_landmarks", SlamConfig::memBudgetLandmarks());
+    SlamConfig::memBudgetTotal() = loadSafe(config, "mem_budget_total", SlamConfig::memBudgetTotal());
+    SlamConfig::memPruneDescRows() = loadSafe(config, "mem_prune_desc_rows", SlamConfig::memPruneDescRows());
+    SlamConfig::gbaG2O() = loadSafe(config, "gba_g2o", SlamConfig::gbaG2O());
+    SlamConfig::maxItersGBA() = loadSafe(config, "max_iters_gba", SlamConfig::maxItersGBA());
+    SlamConfig::gbaTimeBudget() = loadSafe(config, "gba_time_budget", SlamConfig::gbaTimeBudget());
+    SlamConfig::gbaAfterLC() = loadSafe(config, "gba_after_lc", SlamConfig::gbaAfterLC());
 
     SlamConfig::dbowVocP() = loadSafe(config, "vocabulary_p", SlamConfig::dbowVocP());
     SlamConfig::dbowVocL() = loadSafe(config, "vocabulary_l", SlamConfig::dbowVocL());
@@ -149,10 +221,20 @@ void SlamConfig::loadFromFile( const string &config_file )
     SlamConfig::lcRot() = loadSafe(config, "lc_rot", SlamConfig::lcRot());
 
     SlamConfig::maxItersPGO() = loadSafe(config, "max_iters_pgo", SlamConfig::maxItersPGO());
+    SlamConfig::pgoIncremental() = loadSafe(config, "pgo_incremental", SlamConfig::pgoIncremental());
+    SlamConfig::pgoMinGain() = loadSafe(config, "pgo_min_gain", SlamConfig::pgoMinGain());
+    SlamConfig::pgRetentionKFs() = loadSafe(config, "pg_retention_kfs", SlamConfig::pgRetentionKFs());
     SlamConfig::lcKFDist() = loadSafe(config, "lc_kf_dist", SlamConfig::lcKFDist());
     SlamConfig::lcKFMaxDist() = loadSafe(config, "lc_kf_max_dist", SlamConfig::lcKFMaxDist());
     SlamConfig::lcNKFClosest() = loadSafe(config, "lc_nkf_closest", SlamConfig::lcNKFClosest());
     SlamConfig::lcInlierRatio() = loadSafe(config, "lc_inlier_ratio", SlamConfig::lcInlierRatio());
+    SlamConfig::lcMaxCandidates() = loadSafe(config, "lc_max_candidates", SlamConfig::lcMaxCandidates());
+    SlamConfig::lcVerifyCandidates() = loadSafe(config, "lc_verify_candidates", SlamConfig::lcVerifyCandidates());
+    SlamConfig::lcRansacHyps() = loadSafe(config, "lc_ransac_hyps", SlamConfig::lcRansacHyps());
+    SlamConfig::lcFuseVoxel() = loadSafe(config, "lc_fuse_voxel", SlamConfig::lcFuseVoxel());
+    SlamConfig::lcFuseDescTh() = loadSafe(config, "lc_fuse_desc_th", SlamConfig::lcFuseDescTh());
+    SlamConfig::lcBowLevelsUp() = loadSafe(config, "lc_bow_levels_up", SlamConfig::lcBowLevelsUp());
+    SlamConfig::lcBowMaxDist() = loadSafe(config, "lc_bow_max_dist", SlamConfig::lcBowMaxDist());
 
     SlamConfig::minPointMatches() = loadSafe(config, "min_pt_matches", SlamConfig::minPointMatches());
     SlamConfig::minLineMatches() = loadSafe(config, "min_ls_matches", SlamConfig::minLineMatches());
@@ -161,4 +243,14 @@ void SlamConfig::loadFromFile( const string &config_file )
     SlamConfig::fastMatching() = loadSafe(config, "fast_matching", SlamConfig::fastMatching());
     SlamConfig::hasRefinement() = loadSafe(config, "has_refinement", SlamConfig::hasRefinement());
     SlamConfig::multithreadSLAM() = loadSafe(config, "mutithread_slam", SlamConfig::multithreadSLAM());
+    SlamConfig::kfQueueSize() = loadSafe(config, "kf_queue_size", SlamConfig::kfQueueSize());
+    SlamConfig::kfBatchMax() = loadSafe(config, "kf_batch_max", SlamConfig::kfBatchMax());
+    SlamConfig::compactKFs() = loadSafe(config, "compact_kfs", SlamConfig::compactKFs());
+    SlamConfig::kfThumbnailScale() = loadSafe(config, "kf_thumbnail_scale", SlamConfig::kfThumbnailScale());
+    SlamConfig::mapSaveFile() = loadSafe(config, "map_save_file", SlamConfig::mapSaveFile());
+    SlamConfig::mapLoadFile() = loadSafe(config, "map_load_file", SlamConfig::mapLoadFile());
+    SlamConfig::feRecordFile() = loadSafe(config, "fe_record_file", SlamConfig::feRecordFile());
+    SlamConfig::linkQueueSize() = loadSafe(config, "link_queue_size", SlamConfig::linkQueueSize());
+    SlamConfig::localizationOnly() = loadSafe(config, "localization_only", SlamConfig::localizationOnly());
+    SlamConfig::sceneMaxFps() = loadSafe(config, "scene_max_fps", SlamConfig::sceneMaxFps());
 }
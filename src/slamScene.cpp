@@ -64,6 +64,12 @@ slamScene::slamScene(){
     hasPoints       = false;
     isKitti         = true;
 
+    lodDist         = 0.f;
+    lodStep         = 1;
+    lod_center      = Vector3d::Zero();
+    points_synced   = false;
+    lines_synced    = false;
+
 }
 
 slamScene::slamScene(string configFile){
@@ -96,6 +102,12 @@ slamScene::slamScene(string configFile){
     hasFrustum      = config.read_bool("Scene","hasFrustum",false);
     isKitti         = config.read_bool("Scene","isKitti",true);
 
+    lodDist         = config.read_double("Scene","lodDist",0.f);
+    lodStep         = max(1, config.read_int("Scene","lodStep",1));
+    lod_center      = Vector3d::Zero();
+    points_synced   = false;
+    lines_synced    = false;
+
     Matrix4d x_cw;
     x_cw << 1, 0, 0, 0, 0, 0, 1, 0, 0, -1, 0, 0, 0, 0, 0, 1;
     CPose3D x_aux(getPoseFormat(x_cw));
@@ -189,6 +201,8 @@ void slamScene::initializeScene(Matrix4d x_0){
     pointObj_local->setPointSize(2.0);
     pointObj_local->setColor(200,0,0);
     theScene->insert( pointObj_local );
+    points_synced = false;
+    lines_synced  = false;
 
     // Re-paint the scene
     win->unlockAccess3DScene();
@@ -394,17 +408,19 @@ bool slamScene::updateScene(const MapHandler* map){
     // Represent point LMs
     if( hasPoints )
     {
+        points_synced = false;
         pointObj->clear();
         pointObj_local->clear();
-        for( vector<MapPoint*>::const_iterator it = map->map_points.begin(); it!=map->map_points.end(); it++)
+        for( int i_pt : map->live_pts )
         {
+            const MapPoint* pt = map->map_points[i_pt];
             try{
-            if( (*it)!=NULL )
+            if( pt!=NULL )
             {
-                if( (*it)->local )
-                    pointObj_local->insertPoint( (*it)->point3D(0),(*it)->point3D(1),(*it)->point3D(2) );
+                if( pt->local )
+                    pointObj_local->insertPoint( pt->point3D(0),pt->point3D(1),pt->point3D(2) );
                 else
-                    pointObj->insertPoint( (*it)->point3D(0),(*it)->point3D(1),(*it)->point3D(2) );
+                    pointObj->insertPoint( pt->point3D(0),pt->point3D(1),pt->point3D(2) );
             }
             }catch(...){}
         }
@@ -413,16 +429,18 @@ bool slamScene::updateScene(const MapHandler* map){
     // Represent line LMs
     if( hasLines )
     {
+        lines_synced = false;
         lineObj->clear();
         lineObj_local->clear();
-        for( vector<MapLine*>::const_iterator it = map->map_lines.begin(); it!=map->map_lines.end(); it++)
+        for( int i_ls : map->live_ls )
         {
+            const MapLine* ls = map->map_lines[i_ls];
             try{
-            if( (*it)!=NULL )
+            if( ls!=NULL )
             {
                 Vector6d L;
-                L = (*it)->line3D;
-                if( (*it)->local )
+                L = ls->line3D;
+                if( ls->local )
                     lineObj_local->appendLine( L(0),L(1),L(2),L(3),L(4),L(5) );
                 else
                     lineObj->appendLine( L(0),L(1),L(2),L(3),L(4),L(5) );
@@ -540,6 +558,18 @@ bool slamScene::updateScene(const MapHandler* map){
 
 bool slamScene::updateSceneSafe(const MapHandler* map){
 
+    // never wait for the mapping threads: keep the previous map objects while the map is being written
+    SharedLock map_lk(map->map_mutex, std::try_to_lock);
+    if( !map_lk.owns_lock() )
+    {
+        theScene = win->get3DSceneAndLock();
+        if(hasImg)
+            image->setImageView( img_mrpt_image );
+        win->unlockAccess3DScene();
+        win->repaint();
+        return false;
+    }
+
     theScene = win->get3DSceneAndLock();
     bool restart = false;
 
@@ -548,10 +578,6 @@ bool slamScene::updateSceneSafe(const MapHandler* map){
     theScene->removeObject( frustObj );
     theScene->removeObject( frustObj1 );
 
-    // grab indices (so we don't have memory access problems)
-    int pt_idx = map->map_points.size();
-    int ls_idx = map->map_lines.size();
-
     // Represent KFs
     CPose3D kf_pose;
     Vector3d Pi;
@@ -630,43 +656,8 @@ bool slamScene::updateSceneSafe(const MapHandler* map){
     theScene->insert( kfsLinesObj );
     theScene->insert( kfsObj );
 
-    // Represent point LMs
-    if( hasPoints )
-    {
-        pointObj->clear();
-        pointObj_local->clear();
-        for( int i = 0; i < pt_idx; i++ )
-        {
-            MapPoint* it = map->map_points[i];
-            if( it!=NULL )
-            {
-                if( it->local && it->inlier )
-                    pointObj_local->insertPoint( it->point3D(0),it->point3D(1),it->point3D(2) );
-                else
-                    pointObj->insertPoint( it->point3D(0),it->point3D(1),it->point3D(2) );
-            }
-        }
-    }
-
-    // Represent line LMs
-    if( hasLines )
-    {
-        lineObj->clear();
-        lineObj_local->clear();
-        for( int i = 0; i < ls_idx; i++ )
-        {
-            MapLine* it = map->map_lines[i];
-            if( it!=NULL && it->inlier )
-            {
-                Vector6d L;
-                L = it->line3D;
-                if( it->local )
-                    lineObj_local->appendLine( L(0),L(1),L(2),L(3),L(4),L(5) );
-                else
-                    lineObj->appendLine( L(0),L(1),L(2),L(3),L(4),L(5) );
-            }
-        }
-    }
+    // Represent point and line LMs (only the ones changed since the last update)
+    updateLandmarks( map );
 
     // Update the text
     if(hasText){
@@ -775,6 +766,182 @@ bool slamScene::updateSceneSafe(const MapHandler* map){
 
 }
 
+void slamScene::updateLandmarks( const MapHandler* map )
+{
+
+    // always consume the journal, the objects are rebuilt if they missed some changes
+    MapHandler::MapChanges changes;
+    map->takeChanges( changes );
+
+    // the decimation depends on the camera: re-evaluate every drawn landmark once it moved a quarter of lodDist
+    Vector3d cam( pose.x(), pose.y(), pose.z() );
+    bool relod = lodDist > 0.f && lodStep > 1 && ( cam - lod_center ).norm() > 0.25 * lodDist;
+    if( relod || changes.all )
+        lod_center = cam;
+
+    if( hasPoints )
+    {
+        if( changes.all || !points_synced )
+        {
+            pointObj->clear();
+            pointObj_local->clear();
+            pt_slot.assign( pt_slot.size(), -1 );
+            pt_handles.clear();
+            pt_handles_local.clear();
+            for( int i : map->live_pts )
+                updatePoint( map, i );
+        }
+        else
+        {
+            for( int i : changes.erased_pts )
+                dropPoint( i );
+            for( int i : changes.pts )
+                updatePoint( map, i );
+            if( relod )
+                for( int i : map->live_pts )
+                    updatePoint( map, i );
+        }
+    }
+    points_synced = hasPoints;
+
+    if( hasLines )
+    {
+        if( changes.all || !lines_synced )
+        {
+            lineObj->clear();
+            lineObj_local->clear();
+            ls_slot.assign( ls_slot.size(), -1 );
+            ls_handles.clear();
+            ls_handles_local.clear();
+            for( int i : map->live_ls )
+                updateLine( map, i );
+        }
+        else
+        {
+            for( int i : changes.erased_ls )
+                dropLine( i );
+            for( int i : changes.ls )
+                updateLine( map, i );
+            if( relod )
+                for( int i : map->live_ls )
+                    updateLine( map, i );
+        }
+    }
+    lines_synced = hasLines;
+
+}
+
+void slamScene::updatePoint( const MapHandler* map, int h )
+{
+    const MapPoint* pt = map->map_points[h];
+    if( pt == NULL )
+    {
+        dropPoint( h );
+        return;
+    }
+    bool local = pt->local && pt->inlier;
+    if( isDecimated( h, pt->point3D, local ) )
+        dropPoint( h );
+    else
+        drawPoint( h, pt->point3D, local );
+}
+
+void slamScene::updateLine( const MapHandler* map, int h )
+{
+    const MapLine* ls = map->map_lines[h];
+    if( ls == NULL || !ls->inlier || isDecimated( h, 0.5 * ( ls->line3D.head(3) + ls->line3D.tail(3) ), ls->local ) )
+        dropLine( h );
+    else
+        drawLine( h, ls->line3D, ls->local );
+}
+
+bool slamScene::isDecimated( int h, const Vector3d &P, bool local ) const
+{
+    if( local || lodDist <= 0.f || lodStep <= 1 || h % lodStep == 0 )
+        return false;
+    return ( P - Vector3d( pose.x(), pose.y(), pose.z() ) ).norm() > lodDist;
+}
+
+void slamScene::drawPoint( int h, const Vector3d &P, bool local )
+{
+    if( h >= int(pt_slot.size()) )
+    {
+        pt_slot.resize( h+1, -1 );
+        pt_in_local.resize( h+1, 0 );
+    }
+    // moved inside the same cloud
+    if( pt_slot[h] >= 0 && bool(pt_in_local[h]) == local )
+    {
+        ( local ? pointObj_local : pointObj )->setPoint( pt_slot[h], P(0),P(1),P(2) );
+        return;
+    }
+    dropPoint( h );
+    vector<int> &handles = local ? pt_handles_local : pt_handles;
+    ( local ? pointObj_local : pointObj )->insertPoint( P(0),P(1),P(2) );
+    pt_slot[h]     = handles.size();
+    pt_in_local[h] = local;
+    handles.push_back( h );
+}
+
+void slamScene::drawLine( int h, const Vector6d &L, bool local )
+{
+    if( h >= int(ls_slot.size()) )
+    {
+        ls_slot.resize( h+1, -1 );
+        ls_in_local.resize( h+1, 0 );
+    }
+    if( ls_slot[h] >= 0 && bool(ls_in_local[h]) == local )
+    {
+        ( local ? lineObj_local : lineObj )->setLineByIndex( ls_slot[h], L(0),L(1),L(2),L(3),L(4),L(5) );
+        return;
+    }
+    dropLine( h );
+    vector<int> &handles = local ? ls_handles_local : ls_handles;
+    ( local ? lineObj_local : lineObj )->appendLine( L(0),L(1),L(2),L(3),L(4),L(5) );
+    ls_slot[h]     = handles.size();
+    ls_in_local[h] = local;
+    handles.push_back( h );
+}
+
+void slamScene::dropPoint( int h )
+{
+    if( h >= int(pt_slot.size()) || pt_slot[h] < 0 )
+        return;
+    opengl::CPointCloudPtr obj = pt_in_local[h] ? pointObj_local : pointObj;
+    vector<int> &handles       = pt_in_local[h] ? pt_handles_local : pt_handles;
+    // move the last point of the cloud to the freed slot
+    int s = pt_slot[h], last = int(handles.size()) - 1;
+    if( s != last )
+    {
+        obj->setPoint( s, obj->getArrayX()[last], obj->getArrayY()[last], obj->getArrayZ()[last] );
+        handles[s] = handles[last];
+        pt_slot[handles[s]] = s;
+    }
+    obj->resize( last );
+    handles.pop_back();
+    pt_slot[h] = -1;
+}
+
+void slamScene::dropLine( int h )
+{
+    if( h >= int(ls_slot.size()) || ls_slot[h] < 0 )
+        return;
+    opengl::CSetOfLinesPtr obj = ls_in_local[h] ? lineObj_local : lineObj;
+    vector<int> &handles       = ls_in_local[h] ? ls_handles_local : ls_handles;
+    int s = ls_slot[h], last = int(handles.size()) - 1;
+    if( s != last )
+    {
+        double x0, y0, z0, x1, y1, z1;
+        obj->getLineByIndex( last, x0,y0,z0, x1,y1,z1 );
+        obj->setLineByIndex( s, x0,y0,z0, x1,y1,z1 );
+        handles[s] = handles[last];
+        ls_slot[handles[s]] = s;
+    }
+    obj->resize( last );
+    handles.pop_back();
+    ls_slot[h] = -1;
+}
+
 void slamScene::updateSceneGraphs( const MapHandler* map )
 {
 
@@ -785,6 +952,8 @@ void slamScene::updateSceneGraphs( const MapHandler* map )
     pointObj_local->clear();
     lineObj->clear();
     lineObj_local->clear();
+    points_synced = false;
+    lines_synced  = false;
 
     // Represent KFs
     CPose3D kf_pose;
@@ -813,11 +982,12 @@ void slamScene::updateSceneGraphs( const MapHandler* map )
     int Nkf = map->full_graph.size();
     for( int i = 0; i < Nkf; i++ )
     {
-        for( int j = 0; j < Nkf; j++ )
+        for( auto nb : map->full_graph.neighbors(i) )
         {
+            int j = nb.first;
             if( map->map_keyframes[i] != NULL && map->map_keyframes[j] != NULL )
             {
-                if( map->full_graph[i][j] >= SlamConfig::minLMCovGraph() )
+                if( int(nb.second) >= SlamConfig::minLMCovGraph() )
                 {
                     Vector3d Pi = map->map_keyframes[i]->T_kf_w.col(3).head(3);
                     Vector3d Pj = map->map_keyframes[j]->T_kf_w.col(3).head(3);
@@ -834,16 +1004,18 @@ void slamScene::updateSceneGraphs( const MapHandler* map )
     // Represent point LMs
     if( hasPoints )
     {
+        points_synced = false;
         pointObj->clear();
         pointObj_local->clear();
-        for( vector<MapPoint*>::const_iterator it = map->map_points.begin(); it!=map->map_points.end(); it++)
+        for( int i_pt : map->live_pts )
         {
-            if( (*it)!=NULL )
+            const MapPoint* pt = map->map_points[i_pt];
+            if( pt!=NULL )
             {
-                if( (*it)->local )
-                    pointObj_local->insertPoint( (*it)->point3D(0),(*it)->point3D(1),(*it)->point3D(2) );
+                if( pt->local )
+                    pointObj_local->insertPoint( pt->point3D(0),pt->point3D(1),pt->point3D(2) );
                 else
-                    pointObj->insertPoint( (*it)->point3D(0),(*it)->point3D(1),(*it)->point3D(2) );
+                    pointObj->insertPoint( pt->point3D(0),pt->point3D(1),pt->point3D(2) );
             }
         }
     }
@@ -851,15 +1023,17 @@ void slamScene::updateSceneGraphs( const MapHandler* map )
     // Represent line LMs
     if( hasLines )
     {
+        lines_synced = false;
         lineObj->clear();
         lineObj_local->clear();
-        for( vector<MapLine*>::const_iterator it = map->map_lines.begin(); it!=map->map_lines.end(); it++)
+        for( int i_ls : map->live_ls )
         {
-            if( (*it)!=NULL )
+            const MapLine* ls = map->map_lines[i_ls];
+            if( ls!=NULL )
             {
                 Vector6d L;
-                L = (*it)->line3D;
-                if( (*it)->local )
+                L = ls->line3D;
+                if( ls->local )
                     lineObj_local->appendLine( L(0),L(1),L(2),L(3),L(4),L(5) );
                 else
                     lineObj->appendLine( L(0),L(1),L(2),L(3),L(4),L(5) );
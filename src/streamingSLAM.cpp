@@ -0,0 +1,125 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "streamingSLAM.h"
+
+#include <stdexcept>
+
+#include <keyFrame.h>
+#include <threadRole.h>
+
+using namespace StVO;
+
+namespace PLSLAM {
+
+StreamingSLAM::StreamingSLAM(PinholeStereoCamera *cam_, MapHandler *map_, int queue_size, FramePipeline::DropPolicy policy, int rig_) :
+    vo(cam_), pipeline(cam_, queue_size, policy), map(map_), rig(rig_), n_tracked(0), started(false), stopping(false), config(Config::current()) {
+
+    if (rig < 0 || rig >= map->numRigs())
+        throw std::runtime_error("[StreamingSLAM] unknown rig " + std::to_string(rig));
+}
+
+StreamingSLAM::~StreamingSLAM() {
+    stop();
+}
+
+void StreamingSLAM::addObserver(MapObserver *observer) {
+    observers.push_back(observer);
+    map->addObserver(observer);
+}
+
+void StreamingSLAM::start() {
+
+    if (started) return;
+    started  = true;
+    stopping = false;
+
+    map->attachFrontEnd();
+    pipeline.start();
+    tracker = std::thread(&StreamingSLAM::track, this);
+}
+
+void StreamingSLAM::stop() {
+
+    if (!started) return;
+    started = false;
+
+    // a rig may still be waiting for rig 0 to initialize the map
+    stopping = true;
+    map->wakeInitWaiters();
+    pipeline.endOfStream();
+    tracker.join();
+    pipeline.stop();
+    // the last front-end of the map finishes the mapping threads
+    map->detachFrontEnd();
+}
+
+void StreamingSLAM::track() {
+
+    Config::Scope scope(config);
+    setupThread(THREAD_TRACKING);
+
+    // same loop as plslam_dataset, on the frames of the pipeline
+    StereoFrame *frame;
+    while ((frame = pipeline.nextFrame()) != NULL) {
+        // the first KF of the other rigs is placed wrt the one of rig 0
+        if (n_tracked == 0 && rig > 0 && !map->waitInitialized(stopping)) {
+            delete frame;
+            break;
+        }
+        bool is_kf = false;
+        if (n_tracked == 0) {
+            vo.initialize(frame);
+            if (rig == 0)
+                map->initialize(new KeyFrame(vo.prev_frame, 0));
+            else {
+                KeyFrame *kf0 = new KeyFrame(vo.prev_frame);
+                kf0->rig = rig;
+                map->addKeyFrame(kf0);
+            }
+            is_kf = true;
+        } else {
+            if (Config::trackLocalMap())
+                vo.setLocalMap(map->localMapSnapshot(rig));
+            vo.insertStereoFrame(frame);
+            vo.optimizePose();
+            if (vo.needNewKF()) {
+                KeyFrame *curr_kf = new KeyFrame(vo.curr_frame);
+                curr_kf->rig = rig;
+                vo.currFrameIsKF();
+                map->addKeyFrame(curr_kf);
+                is_kf = true;
+            }
+        }
+
+        for (MapObserver *observer : observers)
+            observer->frameTracked(frame, is_kf);
+
+        if (n_tracked > 0) {
+            vo.updateFrame();
+            pipeline.setThresholds(vo.llength_th, vo.orb_fast_th);
+        }
+        n_tracked++;
+    }
+}
+
+} // namespace PLSLAM
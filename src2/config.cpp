@@ -33,8 +33,13 @@
 
 using namespace std;
 
+namespace {
+thread_local Config *session_config = NULL;
+}
+
 Config::Config()
 {
+    slam_config = false;
 
     // kf decision (SLAM) parameters
     min_entropy_ratio     = 0.85;
@@ -45,18 +50,44 @@ Config::Config()
     // -----------------------------------------------------------------------------------------------------
     has_points         = true;      // true if using points
     has_lines          = true;      // true if using line segments
+    line_model         = -1;        // lines of the VO and of the map (LBA, GBA) as endpoints (0) or Plucker lines (1), -1 for the build default (USE_LINE_PLUKER)
     use_fld_lines      = false;     // true if using FLD detector
+    use_gpu_features   = false;     // true if detecting the ORB features on the GPU (build with USE_CUDA_FEATURES)
     lr_in_parallel     = true;      // true if detecting and matching features in parallel
     pl_in_parallel     = true;      // true if detecting points and line segments in parallel
     best_lr_matches    = true;      // true if double-checking the matches between the two images
+    mih_min_rows       = 10000;     // train descriptors above which the indexed matchers use multi-index hashing (0: never)
+    mih_radius         = 2;         // max. Hamming radius per substring of the multi-index hashing search
+    klt_tracking       = false;     // true if tracking the features of the frames between KFs by optical flow instead of extracting them
+    klt_win_size       = 21;        // window size of the optical flow tracking
+    klt_levels         = 3;         // pyramid levels of the optical flow tracking
+    klt_min_tracks     = 0.6;       // min. fraction of the features of the last extraction tracked by optical flow
+    klt_kf_margin      = 0.7;       // fraction of the KF thresholds from which the features are extracted again
     adaptative_fast    = true;      // true if using adaptative fast_threshold
     use_motion_model   = false;     // true if using constant motion model
+    track_local_map    = false;     // true if the frames are also tracked against the local map published by the mapper
+    pipelined_vo       = false;     // true if overlapping image loading and feature extraction with the pose optimization
+    pipeline_queue_size = 2;        // max number of frames buffered between two pipeline stages
+    dataset_prefetch    = 0;        // frames read and rectified ahead by a dataset reader thread (0 to read them on demand)
+    rectify_gray        = false;    // true if converting the images to grayscale before the rectification (remaps a single channel)
+    rectify_crop        = false;    // true if cropping the rectified images to the region valid in both cameras
+    num_worker_threads  = 0;        // number of threads in the shared task pool (0 to use all the hardware threads)
+    cpus_tracking       = "";       // CPUs of the tracking and feature extraction threads, e.g. "2,3" or "2-3" (empty: any)
+    prio_tracking       = 0;        // priority of the tracking threads: >0 real-time (SCHED_FIFO) priority, <0 lowered by that nice value, 0 scheduling of the process
+    cpus_workers        = "";       // CPUs of the shared task pool workers
+    prio_workers        = 0;        // priority of the shared task pool workers
+    cpus_mapping        = "";       // CPUs of the mapping, local BA and loop closure threads
+    prio_mapping        = 0;        // priority of the mapping, local BA and loop closure threads
+    profile_stages      = false;    // true to collect per-stage latency statistics (printed at the end of the sequence)
+    trace_file          = "";       // if not empty and profiling, Chrome trace (JSON) written at the end of the sequence
+    log_level           = 1;        // console messages shown: 0 debug, 1 info, 2 warnings, 3 errors (LOG_MIN_LEVEL removes the lower ones at compile time)
 
     // Tracking parameters
     // -----------------------------------------------------------------------------------------------------
     // Point features
     max_dist_epip     = 1.0;        // max. epipolar distance in pixels
     min_disp          = 1.0;        // min. disparity (avoid points in the infinite)
+    stereo_min_depth  = 0.0;        // min. depth bounding the disparity search (0: matching_s_ws)
     min_ratio_12_p    = 0.9;        // min. ratio between the first and second best matches
 
     // Line segment features
@@ -74,6 +105,12 @@ Config::Config()
     fast_inc_th       = 5;          // base increment for the FAST threshold
     fast_feat_th      = 50;         // base number of features to increase/decrease FAST threshold
     fast_err_th       = 0.5;        // threshold for the optimization error
+    feat_budget       = false;      // true if the feature budget controller sets the per-frame caps and the FAST threshold
+    feat_latency_target = 20.0;     // target feature extraction time per frame [ms] (0 for no latency control)
+    feat_max_desc     = 0;          // max. number of descriptors per image, points and lines (0 for no cap)
+    feat_grid_cols    = 8;          // columns of the grid that spreads the point features
+    feat_grid_rows    = 6;          // rows of the grid that spreads the point features
+    feat_oversample   = 2.0;        // ratio of point candidates detected over the budget
 
     // Optimization parameters
     // -----------------------------------------------------------------------------------------------------
@@ -81,8 +118,11 @@ Config::Config()
     min_features     = 10;          // min. number of features to perform StVO
     max_iters        = 5;           // max. number of iterations in the first stage of the optimization
     max_iters_ref    = 10;          // max. number of iterations in the refinement stage
+    pose_warm_start  = true;        // true if the refinement starts from the first stage solution and the first stage from the last motion
     min_error        = 1e-7;        // min. error to stop the optimization
     min_error_change = 1e-7;        // min. error change to stop the optimization
+    min_rel_change   = 1e-4;        // min. error change relative to the previous error to stop the optimization
+    min_step_norm    = 1e-6;        // min. norm of the pose increment to stop the optimization
     inlier_k         = 4.0;         // factor to discard outliers before the refinement stage
 
     // Feature detection parameters
@@ -90,6 +130,10 @@ Config::Config()
     matching_strategy = 0;          // 0 - pure descriptor based  |  1 - window based plus descriptor
     matching_s_ws     = 10;         // size of the windows (in pixels) to look for stereo matches (if matching_stereo=1)
     matching_f2f_ws   = 3;          // size of the windows (in pixels) to look for f2f matches
+    local_map_ws      = 3;          // size of the windows (in grid cells) to look for local map matches
+    f2f_adaptive_ws   = false;      // true if sizing the f2f windows from the motion model and its covariance (brute force otherwise)
+    f2f_ws_sigma      = 3.0;        // number of standard deviations of the predicted projection covered by the f2f windows
+    f2f_max_ws        = 16;         // max size of the f2f windows (in grid cells), doubled on each retry until reached
 
     // ORB detector
     orb_nfeatures     = 1200;       // number of ORB features to detect
@@ -110,16 +154,50 @@ Config::Config()
     lsd_log_eps       = 1.0;        // detection threshold (only for advanced refinement)
     lsd_density_th    = 0.6;        // minimal density of aligned region points in the enclosing rectangle
     lsd_n_bins        = 1024;       // number of bins in pseudo-ordering of gradient modulus
+    lsd_tiles         = 1;          // number of horizontal strips detected in parallel by LSD, merged at the seams (1 for the whole image)
+    ls_merge          = false;      // true to join the collinear fragments of the line segments before describing them
+    ls_merge_angle    = 2.0;        // max. angle between two fragments of the same segment [deg]
+    ls_merge_dist     = 1.5;        // max. distance of the endpoints of a fragment to the merged segment [px]
+    ls_merge_gap      = 10.0;       // max. gap along the segment between two fragments [px]
+    ls_bucketing      = false;      // true to keep the lsd_nfeatures best lines of each region of the feat_grid_cols x feat_grid_rows grid
 }
 
 Config::~Config(){}
 
 Config& Config::getInstance()
 {
+    if (session_config != NULL)
+        return *session_config;
     static Config instance; // Instantiated on first use and guaranteed to be destroyed
     return instance;
 }
 
+Config* Config::current()
+{
+    return session_config;
+}
+
+Config::Scope::Scope(Config *cfg) : prev(session_config)
+{
+    session_config = cfg;
+}
+
+Config::Scope::~Scope()
+{
+    session_config = prev;
+}
+
+bool Config::plukerLines()
+{
+    if( lineModel() >= 0 )
+        return lineModel() == 1;
+#ifdef USE_LINE_PLUKER
+    return true;
+#else
+    return false;
+#endif
+}
+
 template<typename T>
 inline T loadSafe(const YAML::Node &config, std::string param, T default_value = T()) {
 
@@ -145,15 +223,41 @@ void Config::loadFromFile( const string &config_file )
 
     Config::hasPoints() = loadSafe(config, "has_points", Config::hasPoints());
     Config::hasLines() = loadSafe(config, "has_lines", Config::hasLines());
+    Config::lineModel() = loadSafe(config, "line_model", Config::lineModel());
     Config::useFLDLines() = loadSafe(config, "use_fld_lines", Config::useFLDLines());
+    Config::useGPUFeatures() = loadSafe(config, "use_gpu_features", Config::useGPUFeatures());
     Config::lrInParallel() = loadSafe(config, "lr_in_parallel", Config::lrInParallel());
     Config::plInParallel() = loadSafe(config, "pl_in_parallel", Config::plInParallel());
     Config::bestLRMatches() = loadSafe(config, "best_lr_matches", Config::bestLRMatches());
+    Config::mihMinRows() = loadSafe(config, "mih_min_rows", Config::mihMinRows());
+    Config::mihRadius() = loadSafe(config, "mih_radius", Config::mihRadius());
+    Config::kltTracking() = loadSafe(config, "klt_tracking", Config::kltTracking());
+    Config::kltWinSize() = loadSafe(config, "klt_win_size", Config::kltWinSize());
+    Config::kltLevels() = loadSafe(config, "klt_levels", Config::kltLevels());
+    Config::kltMinTracks() = loadSafe(config, "klt_min_tracks", Config::kltMinTracks());
+    Config::kltKFMargin() = loadSafe(config, "klt_kf_margin", Config::kltKFMargin());
     Config::adaptativeFAST() = loadSafe(config, "adaptative_fast", Config::adaptativeFAST());
     Config::useMotionModel() = loadSafe(config, "use_motion_model", Config::useMotionModel());
+    Config::trackLocalMap() = loadSafe(config, "track_local_map", Config::trackLocalMap());
+    Config::pipelinedVO() = loadSafe(config, "pipelined_vo", Config::pipelinedVO());
+    Config::pipelineQueueSize() = loadSafe(config, "pipeline_queue_size", Config::pipelineQueueSize());
+    Config::datasetPrefetch() = loadSafe(config, "dataset_prefetch", Config::datasetPrefetch());
+    Config::rectifyGray() = loadSafe(config, "rectify_gray", Config::rectifyGray());
+    Config::rectifyCrop() = loadSafe(config, "rectify_crop", Config::rectifyCrop());
+    Config::numWorkerThreads() = loadSafe(config, "num_worker_threads", Config::numWorkerThreads());
+    Config::cpusTracking() = loadSafe(config, "cpus_tracking", Config::cpusTracking());
+    Config::prioTracking() = loadSafe(config, "prio_tracking", Config::prioTracking());
+    Config::cpusWorkers() = loadSafe(config, "cpus_workers", Config::cpusWorkers());
+    Config::prioWorkers() = loadSafe(config, "prio_workers", Config::prioWorkers());
+    Config::cpusMapping() = loadSafe(config, "cpus_mapping", Config::cpusMapping());
+    Config::prioMapping() = loadSafe(config, "prio_mapping", Config::prioMapping());
+    Config::profileStages() = loadSafe(config, "profile_stages", Config::profileStages());
+    Config::traceFile() = loadSafe(config, "trace_file", Config::traceFile());
+    Config::logLevel() = loadSafe(config, "log_level", Config::logLevel());
 
     Config::maxDistEpip() = loadSafe(config, "max_dist_epip", Config::maxDistEpip());
     Config::minDisp() = loadSafe(config, "min_disp", Config::minDisp());
+    Config::stereoMinDepth() = loadSafe(config, "stereo_min_depth", Config::stereoMinDepth());
     Config::minRatio12P() = loadSafe(config, "min_ratio_12_p", Config::minRatio12P());
 
     Config::lineSimTh() = loadSafe(config, "line_sim_th", Config::lineSimTh());
@@ -169,6 +273,12 @@ void Config::loadFromFile( const string &config_file )
     Config::fastIncTh() = loadSafe(config, "fast_inc_th", Config::fastIncTh());
     Config::fastFeatTh() = loadSafe(config, "fast_feat_th", Config::fastFeatTh());
     Config::fastErrTh() = loadSafe(config, "fast_err_th", Config::fastErrTh());
+    Config::featBudget() = loadSafe(config, "feat_budget", Config::featBudget());
+    Config::featLatencyTarget() = loadSafe(config, "feat_latency_target", Config::featLatencyTarget());
+    Config::featMaxDesc() = loadSafe(config, "feat_max_desc", Config::featMaxDesc());
+    Config::featGridCols() = loadSafe(config, "feat_grid_cols", Config::featGridCols());
+    Config::featGridRows() = loadSafe(config, "feat_grid_rows", Config::featGridRows());
+    Config::featOversample() = loadSafe(config, "feat_oversample", Config::featOversample());
 
     Config::rgbdMinDepth() = loadSafe(config, "rgbd_min_depth", Config::rgbdMinDepth());
     Config::rgbdMaxDepth() = loadSafe(config, "rgbd_max_depth", Config::rgbdMaxDepth());
@@ -177,13 +287,20 @@ void Config::loadFromFile( const string &config_file )
     Config::minFeatures() = loadSafe(config, "min_features", Config::minFeatures());
     Config::maxIters() = loadSafe(config, "max_iters", Config::maxIters());
     Config::maxItersRef() = loadSafe(config, "max_iters_ref", Config::maxItersRef());
+    Config::poseWarmStart() = loadSafe(config, "pose_warm_start", Config::poseWarmStart());
     Config::minError() = loadSafe(config, "min_error", Config::minError());
     Config::minErrorChange() = loadSafe(config, "min_error_change", Config::minErrorChange());
+    Config::minRelChange() = loadSafe(config, "min_rel_change", Config::minRelChange());
+    Config::minStepNorm() = loadSafe(config, "min_step_norm", Config::minStepNorm());
     Config::inlierK() = loadSafe(config, "inlier_k", Config::inlierK());
 
     Config::matchingStrategy() = loadSafe(config, "matching_strategy", Config::matchingStrategy());
     Config::matchingSWs() = loadSafe(config, "matching_s_ws", Config::matchingSWs());
     Config::matchingF2FWs() = loadSafe(config, "matching_f2f_ws", Config::matchingF2FWs());
+    Config::localMapWs() = loadSafe(config, "local_map_ws", Config::localMapWs());
+    Config::f2fAdaptiveWs() = loadSafe(config, "f2f_adaptive_ws", Config::f2fAdaptiveWs());
+    Config::f2fWsSigma() = loadSafe(config, "f2f_ws_sigma", Config::f2fWsSigma());
+    Config::f2fMaxWs() = loadSafe(config, "f2f_max_ws", Config::f2fMaxWs());
 
     Config::orbNFeatures() = loadSafe(config, "orb_nfeatures", Config::orbNFeatures());
     Config::orbScaleFactor() = loadSafe(config, "orb_scale_factor", Config::orbScaleFactor());
@@ -203,4 +320,10 @@ void Config::loadFromFile( const string &config_file )
     Config::lsdLogEps() = loadSafe(config, "lsd_log_eps", Config::lsdLogEps());
     Config::lsdDensityTh() = loadSafe(config, "lsd_density_th", Config::lsdDensityTh());
     Config::lsdNBins() = loadSafe(config, "lsd_n_bins", Config::lsdNBins());
+    Config::lsdTiles() = loadSafe(config, "lsd_tiles", Config::lsdTiles());
+    Config::lsMerge() = loadSafe(config, "ls_merge", Config::lsMerge());
+    Config::lsMergeAngle() = loadSafe(config, "ls_merge_angle", Config::lsMergeAngle());
+    Config::lsMergeDist() = loadSafe(config, "ls_merge_dist", Config::lsMergeDist());
+    Config::lsMergeGap() = loadSafe(config, "ls_merge_gap", Config::lsMergeGap());
+    Config::lsBucketing() = loadSafe(config, "ls_bucketing", Config::lsBucketing());
 }
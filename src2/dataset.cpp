@@ -44,7 +44,10 @@
 //YAML
 #include <yaml-cpp/yaml.h>
 
+#include "config.h"
 #include "pinholeStereoCamera.h"
+#include "threadPool.h"
+#include "threadRole.h"
 
 namespace StVO {
 
@@ -86,7 +89,7 @@ void getSortedImages(const boost::filesystem::path &img_dir, std::function<bool(
 }
 
 Dataset::Dataset(const std::string &dataset_path, const PinholeStereoCamera &cam, int offset, int nmax, int step)
-    : cam(cam) {
+    : cam(cam), config(Config::current()) {
 
     boost::filesystem::path dataset_base(dataset_path);
     if (!boost::filesystem::exists(dataset_base) ||
@@ -174,29 +177,74 @@ Dataset::Dataset(const std::string &dataset_path, const PinholeStereoCamera &cam
         img_time.push_back(time);
     }
     fin.close();
+
+    // from now on the lists are only read by readFrame (on the reader thread if prefetching)
+    n_left = images_l.size();
+    if (Config::datasetPrefetch() > 0 && n_left > 0) {
+        prefetch_queue.reset(new BoundedQueue<ImagePair>(Config::datasetPrefetch()));
+        reader = std::thread(&Dataset::prefetchFrames, this);
+    }
 }
 
 Dataset::~Dataset() {
 
+    if (reader.joinable()) {
+        prefetch_queue->close();
+        reader.join();
+    }
 }
 
 bool Dataset::nextFrame(cv::Mat &img_l, cv::Mat &img_r, long double& t) {
     if (!hasNext()) return false;
 
-    img_l = cv::imread(images_l.front(), CV_LOAD_IMAGE_UNCHANGED);
-    img_r = cv::imread(images_r.front(), CV_LOAD_IMAGE_UNCHANGED);
-    cam.rectifyImagesLR(img_l, img_l, img_r, img_r);
-    images_l.pop_front();
-    images_r.pop_front();
+    ImagePair pair;
+    if (prefetch_queue) {
+        if (!prefetch_queue->pop(pair)) return false;
+    } else {
+        readFrame(pair);
+    }
+    n_left--;
 
-    t = img_time.front();
-    img_time.pop_front();
+    img_l = pair.img_l;
+    img_r = pair.img_r;
+    t = pair.t;
 
     return (!img_l.empty() && !img_r.empty());
 }
 
 bool Dataset::hasNext() {
-    return !(images_l.empty() || images_r.empty());
+    return n_left > 0;
+}
+
+void Dataset::readFrame(ImagePair &pair) {
+
+    // the right image is decoded by the pool while this thread decodes the left one
+    std::string path_r = images_r.front();
+    std::future<cv::Mat> img_r = ThreadPool::global().submit([path_r]() {
+        return cv::imread(path_r, CV_LOAD_IMAGE_UNCHANGED);
+    });
+    cv::Mat img_l = cv::imread(images_l.front(), CV_LOAD_IMAGE_UNCHANGED);
+    pair.img_r = ThreadPool::global().wait(img_r);
+    cam.rectifyImagesLR(img_l, pair.img_l, pair.img_r, pair.img_r);
+    images_l.pop_front();
+    images_r.pop_front();
+
+    pair.t = img_time.front();
+    img_time.pop_front();
+}
+
+void Dataset::prefetchFrames() {
+
+    Config::Scope scope(config);
+    setupThread(THREAD_LOADER);
+
+    while (!(images_l.empty() || images_r.empty())) {
+        ImagePair pair;
+        readFrame(pair);
+        if (!prefetch_queue->push(pair))
+            return;
+    }
+    prefetch_queue->close();
 }
 
 } // namespace StVO
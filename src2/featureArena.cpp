@@ -0,0 +1,61 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "featureArena.h"
+
+namespace StVO {
+
+void PointArrays::assign(const std::vector<PointFeature*> &points) {
+
+    const int n = points.size();
+    pl.resize(2, n);
+    disp.resize(1, n);
+    P.resize(3, n);
+    for (int i = 0; i < n; ++i) {
+        const PointFeature *pt = points[i];
+        pl.col(i) = pt->pl;
+        disp(i)   = pt->disp;
+        P.col(i)  = pt->P;
+    }
+}
+
+void LineArrays::assign(const std::vector<LineFeature*> &lines) {
+
+    const int n = lines.size();
+    spl.resize(2, n);
+    epl.resize(2, n);
+    sdisp.resize(1, n);
+    edisp.resize(1, n);
+    sP.resize(3, n);
+    eP.resize(3, n);
+    for (int i = 0; i < n; ++i) {
+        const LineFeature *ls = lines[i];
+        spl.col(i) = ls->spl;
+        epl.col(i) = ls->epl;
+        sdisp(i)   = ls->sdisp;
+        edisp(i)   = ls->edisp;
+        sP.col(i)  = ls->sP;
+        eP.col(i)  = ls->eP;
+    }
+}
+
+} // namespace StVO
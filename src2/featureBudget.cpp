@@ -0,0 +1,169 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "featureBudget.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "config.h"
+
+namespace StVO {
+
+FeatureBudget::FeatureBudget() { reset(); }
+
+void FeatureBudget::reset()
+{
+    fast_th    = Config::orbFastTh();
+    scale      = 1.0;
+    latency_ms = -1.0;
+    computeCaps();
+}
+
+int FeatureBudget::pointCandidates() const
+{
+    return std::max(n_points, int(std::ceil(Config::featOversample() * n_points)));
+}
+
+void FeatureBudget::computeCaps()
+{
+    int max_pts = Config::hasPoints() ? Config::orbNFeatures() : 0;
+    int max_ls  = Config::hasLines()  ? Config::lsdNFeatures() : 0;
+    const int max_desc = Config::featMaxDesc();
+
+    // lines without a cap take half of the descriptors
+    const bool cap_lines = (max_ls > 0 || max_desc > 0);
+    if( Config::hasLines() && max_ls == 0 && max_desc > 0 )
+        max_ls = max_desc / 2;
+
+    double s = scale;
+    if( max_desc > 0 && max_pts + max_ls > max_desc )
+        s *= double(max_desc) / double(max_pts + max_ls);
+
+    n_points = std::max(1, int(std::floor(s * max_pts)));
+    n_lines  = cap_lines ? std::max(1, int(std::floor(s * max_ls))) : 0;
+}
+
+void FeatureBudget::update(int n_pt_detected, double elapsed_ms)
+{
+    // additive increase, multiplicative decrease of the caps around the latency target
+    latency_ms = (latency_ms < 0.0) ? elapsed_ms : 0.8 * latency_ms + 0.2 * elapsed_ms;
+    const double target = Config::featLatencyTarget();
+    if( target > 0.0 )
+    {
+        if( latency_ms > target )
+            scale = std::max(0.25, 0.9 * scale);
+        else if( latency_ms < 0.8 * target )
+            scale = std::min(1.0, scale + 0.05);
+    }
+    computeCaps();
+
+    // FAST threshold, lower it when there are not enough candidates and raise it when they saturate
+    if( Config::hasPoints() )
+    {
+        if( n_pt_detected < n_points )
+            fast_th = std::max(Config::fastMinTh(), fast_th - Config::fastIncTh());
+        else if( n_pt_detected >= pointCandidates() )
+            fast_th = std::min(Config::fastMaxTh(), fast_th + Config::fastIncTh());
+    }
+}
+
+void FeatureBudget::selectPoints(std::vector<cv::KeyPoint> &points, cv::Size size, cv::Mat *desc) const
+{
+    if( int(points.size()) <= n_points )
+        return;
+
+    std::vector<cv::Point2f> pos;
+    std::vector<float> response;
+    pos.reserve(points.size());
+    response.reserve(points.size());
+    for( const cv::KeyPoint &kp : points )
+    {
+        pos.push_back(kp.pt);
+        response.push_back(kp.response);
+    }
+    std::vector<int> selected;
+    selectBucketed(pos, response, n_points, size, Config::featGridCols(), Config::featGridRows(), selected);
+
+    std::vector<cv::KeyPoint> points_sel;
+    points_sel.reserve(selected.size());
+    cv::Mat desc_sel;
+    for( int i : selected )
+    {
+        points_sel.push_back(points[i]);
+        if( desc != NULL )
+            desc_sel.push_back(desc->row(i));
+    }
+    points.swap(points_sel);
+    if( desc != NULL )
+        *desc = desc_sel;
+}
+
+void FeatureBudget::selectBucketed(const std::vector<cv::Point2f> &pos, const std::vector<float> &response, int n,
+                                   cv::Size size, int cols, int rows, std::vector<int> &selected)
+{
+    selected.clear();
+    const int N = pos.size();
+    if( N <= n )
+    {
+        for( int i = 0; i < N; i++ )
+            selected.push_back(i);
+        return;
+    }
+
+    cols = std::max(1, cols);
+    rows = std::max(1, rows);
+    std::vector<int> order(N);
+    for( int i = 0; i < N; i++ )
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&response](int a, int b){ return response[a] > response[b]; });
+
+    // first pass, the best ones of each cell up to its share
+    const int quota = std::max(1, n / (cols * rows));
+    std::vector<int>  count(cols * rows, 0);
+    std::vector<bool> taken(N, false);
+    const double sx = double(cols) / std::max(1, size.width);
+    const double sy = double(rows) / std::max(1, size.height);
+    for( int k = 0; k < N && int(selected.size()) < n; k++ )
+    {
+        const int i = order[k];
+        const int c = std::min(cols - 1, std::max(0, int(pos[i].x * sx)));
+        const int r = std::min(rows - 1, std::max(0, int(pos[i].y * sy)));
+        if( count[r * cols + c] < quota )
+        {
+            count[r * cols + c]++;
+            taken[i] = true;
+            selected.push_back(i);
+        }
+    }
+
+    // second pass, the best remaining ones wherever they are
+    for( int k = 0; k < N && int(selected.size()) < n; k++ )
+    {
+        if( !taken[order[k]] )
+            selected.push_back(order[k]);
+    }
+
+    std::sort(selected.begin(), selected.end());
+}
+
+} // namespace StVO
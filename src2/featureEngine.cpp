@@ -0,0 +1,120 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "featureEngine.h"
+
+#include "config.h"
+
+namespace StVO {
+
+FeatureEngine::FeatureEngine() : fld_min_length(-1.0) {}
+
+FeatureEngine& FeatureEngine::local() {
+    static thread_local FeatureEngine engine;
+    return engine;
+}
+
+cv::Ptr<cv::ORB> FeatureEngine::orb(int fast_th) {
+
+    if (orb_.empty())
+        orb_ = cv::ORB::create();
+
+    orb_->setMaxFeatures(Config::orbNFeatures());
+    orb_->setScaleFactor(Config::orbScaleFactor());
+    orb_->setNLevels(Config::orbNLevels());
+    orb_->setEdgeThreshold(Config::orbEdgeTh());
+    orb_->setFirstLevel(0);
+    orb_->setWTA_K(Config::orbWtaK());
+    orb_->setScoreType(Config::orbScore());
+    orb_->setPatchSize(Config::orbPatchSize());
+    orb_->setFastThreshold(fast_th);
+    return orb_;
+}
+
+bool FeatureEngine::detectORBOnGPU(const cv::Mat &img, int fast_th, std::vector<cv::KeyPoint> &points, cv::Mat &pdesc) {
+
+#ifdef USE_CUDA_FEATURES
+    static const bool has_device = (cv::cuda::getCudaEnabledDeviceCount() > 0);
+    if (!Config::useGPUFeatures() || !has_device || img.type() != CV_8UC1)
+        return false;
+
+    if (cuda_orb_.empty())
+        cuda_orb_ = cv::cuda::ORB::create();
+
+    cuda_orb_->setMaxFeatures(Config::orbNFeatures());
+    cuda_orb_->setScaleFactor(Config::orbScaleFactor());
+    cuda_orb_->setNLevels(Config::orbNLevels());
+    cuda_orb_->setEdgeThreshold(Config::orbEdgeTh());
+    cuda_orb_->setFirstLevel(0);
+    cuda_orb_->setWTA_K(Config::orbWtaK());
+    cuda_orb_->setScoreType(Config::orbScore());
+    cuda_orb_->setPatchSize(Config::orbPatchSize());
+    cuda_orb_->setFastThreshold(fast_th);
+
+    // the device buffers are kept, so they are only reallocated when the image size changes
+    gpu_img.upload(img);
+    cuda_orb_->detectAndCompute(gpu_img, cv::noArray(), points, gpu_desc, false);
+    gpu_desc.download(pdesc);
+    return true;
+#else
+    (void) img; (void) fast_th; (void) points; (void) pdesc;
+    return false;
+#endif
+}
+
+cv::Ptr<cv::line_descriptor::BinaryDescriptor> FeatureEngine::lbd() {
+
+    if (lbd_.empty())
+        lbd_ = cv::line_descriptor::BinaryDescriptor::createBinaryDescriptor();
+    return lbd_;
+}
+
+cv::Ptr<cv::line_descriptor::LSDDetectorC> FeatureEngine::lsd() {
+
+    if (lsd_.empty())
+        lsd_ = cv::line_descriptor::LSDDetectorC::createLSDDetectorC();
+    return lsd_;
+}
+
+cv::Ptr<cv::ximgproc::FastLineDetector> FeatureEngine::fld(double min_line_length) {
+
+    if (fld_.empty() || min_line_length != fld_min_length) {
+        fld_ = cv::ximgproc::createFastLineDetector(min_line_length);
+        fld_min_length = min_line_length;
+    }
+    return fld_;
+}
+
+cv::Ptr<cv::LineSegmentDetector> FeatureEngine::segmentDetector(const cv::line_descriptor::LSDDetectorC::LSDOptions &opts) {
+
+    if (segment_detector_.empty() || opts.refine != segment_opts.refine || opts.scale != segment_opts.scale ||
+            opts.sigma_scale != segment_opts.sigma_scale || opts.quant != segment_opts.quant ||
+            opts.ang_th != segment_opts.ang_th || opts.log_eps != segment_opts.log_eps ||
+            opts.density_th != segment_opts.density_th || opts.n_bins != segment_opts.n_bins) {
+        segment_detector_ = cv::createLineSegmentDetector(opts.refine, opts.scale, opts.sigma_scale, opts.quant,
+                                                          opts.ang_th, opts.log_eps, opts.density_th, opts.n_bins);
+        segment_opts = opts;
+    }
+    return segment_detector_;
+}
+
+} // namespace StVO
@@ -0,0 +1,165 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "framePipeline.h"
+
+//STL
+#include <algorithm>
+
+#include "config.h"
+#include "threadRole.h"
+
+namespace StVO {
+
+FramePipeline::FramePipeline(Dataset &dataset_, PinholeStereoCamera *cam_, int queue_size) :
+    dataset(&dataset_), cam(cam_), policy(BLOCK), n_pushed(0), n_dropped(0),
+    image_queue(queue_size), frame_queue(queue_size), started(false), config(Config::current()) {
+
+    // same thresholds as StereoFrameHandler::initialize
+    llength_th  = Config::minLineLength() * std::min( cam->getWidth(), cam->getHeight() );
+    orb_fast_th = Config::orbFastTh();
+}
+
+FramePipeline::FramePipeline(PinholeStereoCamera *cam_, int queue_size, DropPolicy policy_) :
+    dataset(NULL), cam(cam_), policy(policy_), n_pushed(0), n_dropped(0),
+    image_queue(queue_size), frame_queue(queue_size), started(false), config(Config::current()) {
+
+    llength_th  = Config::minLineLength() * std::min( cam->getWidth(), cam->getHeight() );
+    orb_fast_th = Config::orbFastTh();
+}
+
+FramePipeline::~FramePipeline() {
+    stop();
+}
+
+void FramePipeline::start() {
+
+    if (started) return;
+    started = true;
+
+    if (dataset != NULL)
+        loader = std::thread(&FramePipeline::loadImages, this);
+    extractor = std::thread(&FramePipeline::extractFeatures, this);
+}
+
+void FramePipeline::stop() {
+
+    if (!started) return;
+    started = false;
+
+    image_queue.close();
+    frame_queue.close();
+    if (loader.joinable())
+        loader.join();
+    extractor.join();
+
+    // release the frames that were never consumed
+    StereoFrame *frame;
+    while (frame_queue.pop(frame))
+        delete frame;
+}
+
+StereoFrame* FramePipeline::nextFrame() {
+
+    StereoFrame *frame;
+    if (!frame_queue.pop(frame))
+        return NULL;
+    return frame;
+}
+
+bool FramePipeline::pushStereoPair(const cv::Mat &img_l, const cv::Mat &img_r, long double t, std::shared_ptr<void> owner) {
+
+    // the frame index is the arrival order, so the dropped pairs leave gaps
+    ImagePair pair;
+    pair.img_l = img_l;
+    pair.img_r = img_r;
+    pair.owner = owner;
+    pair.t     = t;
+    pair.idx   = n_pushed++;
+
+    switch (policy) {
+    case DROP_OLDEST: {
+        int n = image_queue.pushDropOldest(pair);
+        if (n < 0)
+            return false;
+        n_dropped += n;
+        return true;
+    }
+    case DROP_NEWEST:
+        if (image_queue.tryPush(pair))
+            return true;
+        n_dropped++;
+        return false;
+    default:
+        return image_queue.push(pair);
+    }
+}
+
+void FramePipeline::endOfStream() {
+    image_queue.close();
+}
+
+void FramePipeline::setThresholds(double llength_th_, int orb_fast_th_) {
+    llength_th  = llength_th_;
+    orb_fast_th = orb_fast_th_;
+}
+
+void FramePipeline::loadImages() {
+
+    Config::Scope scope(config);
+    setupThread(THREAD_LOADER);
+
+    ImagePair pair;
+    pair.idx = 0;
+    while (dataset->nextFrame(pair.img_l, pair.img_r, pair.t)) {
+        if (!image_queue.push(pair))
+            return;
+        // new buffers, the queued pair keeps the previous ones
+        pair.img_l = cv::Mat();
+        pair.img_r = cv::Mat();
+        pair.idx++;
+    }
+    image_queue.close();
+}
+
+void FramePipeline::extractFeatures() {
+
+    Config::Scope scope(config);
+    setupThread(THREAD_EXTRACTION);
+
+    ImagePair pair;
+    while (image_queue.pop(pair)) {
+        StereoFrame *frame = new StereoFrame(pair.img_l, pair.img_r, pair.idx, cam, pair.t);
+        frame->img_owner = pair.owner;
+        if (Config::featBudget())
+            frame->extractStereoFeatures(llength_th, feat_budget);
+        else
+            frame->extractStereoFeatures(llength_th, orb_fast_th);
+        if (!frame_queue.push(frame)) {
+            delete frame;
+            return;
+        }
+    }
+    frame_queue.close();
+}
+
+} // namespace StVO
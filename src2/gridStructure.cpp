@@ -24,13 +24,14 @@
 
 //STL
 #include <algorithm>
+#include <cmath>
 #include <stdexcept>
 
 #include "lineIterator.h"
 
 namespace StVO {
 
-void getLineCoords(double x1, double y1, double x2, double y2, std::list<std::pair<int, int>> &line_coords) {
+void getLineCoords(double x1, double y1, double x2, double y2, std::vector<std::pair<int, int>> &line_coords) {
     line_coords.clear();
 
     LineIterator it(x1, y1, x2, y2);
@@ -41,28 +42,52 @@ void getLineCoords(double x1, double y1, double x2, double y2, std::list<std::pa
 }
 
 GridStructure::GridStructure(int rows, int cols)
-    : rows(rows), cols(cols) {
+    : rows(rows), cols(cols), built(false) {
 
     if (rows <= 0 || cols <= 0)
         throw std::runtime_error("[GridStructure] invalid dimension");
 
-    grid.resize(cols, std::vector<std::list<int>>(rows));
+    cell_start.resize(rows * cols + 1, 0);
 }
 
 GridStructure::~GridStructure() {
 
 }
 
-std::list<int>& GridStructure::at(int x, int y) {
+void GridStructure::add(int x, int y, int idx) {
 
     if (x >= 0 && x < cols &&
-            y >= 0 && y < rows)
-        return grid[x][y];
-    else
-        return out_of_bounds;
+            y >= 0 && y < rows) {
+        entries.push_back(std::make_pair(x * rows + y, idx));
+        built = false;
+    }
 }
 
-void GridStructure::get(int x, int y, const GridWindow &w, std::unordered_set<int> &indices) const {
+void GridStructure::build() {
+
+    // counting sort of the entries by cell, stable within each cell
+    std::fill(cell_start.begin(), cell_start.end(), 0);
+    for (const std::pair<int, int> &e : entries)
+        cell_start[e.first + 1]++;
+    for (int c = 0; c < rows * cols; ++c)
+        cell_start[c + 1] += cell_start[c];
+
+    cell_idx.resize(entries.size());
+    for (const std::pair<int, int> &e : entries)
+        cell_idx[cell_start[e.first]++] = e.second;
+
+    // the scatter advanced each offset to the start of the next cell
+    for (int c = rows * cols; c > 0; --c)
+        cell_start[c] = cell_start[c - 1];
+    cell_start[0] = 0;
+
+    built = true;
+}
+
+void GridStructure::get(int x, int y, const GridWindow &w, std::vector<int> &indices) const {
+
+    if (!built)
+        throw std::runtime_error("[GridStructure] build() must be called before get()");
 
     int min_x = std::max(0, x - w.width.first);
     int max_x = std::min(cols, x + w.width.second + 1);
@@ -70,16 +95,194 @@ void GridStructure::get(int x, int y, const GridWindow &w, std::unordered_set<in
     int min_y = std::max(0, y - w.height.first);
     int max_y = std::min(rows, y + w.height.second + 1);
 
+    if (min_y >= max_y) return;
+
+    // the cells of one column are contiguous
     for (int x_ = min_x; x_ < max_x; ++x_)
-        for (int y_ = min_y; y_ < max_y; ++y_)
-            indices.insert(grid[x_][y_].begin(), grid[x_][y_].end());
+        indices.insert(indices.end(),
+                       cell_idx.begin() + cell_start[x_ * rows + min_y],
+                       cell_idx.begin() + cell_start[x_ * rows + max_y]);
 }
 
 void GridStructure::clear() {
 
-    for (int x = 0; x < cols; ++x)
-        for (int y = 0; y < rows; ++y)
-            grid[x][y].clear();
+    entries.clear();
+    cell_idx.clear();
+    built = false;
+}
+
+LineRowIndex::LineRowIndex(int rows, int cols)
+    : rows(rows), cols(cols), built(false) {
+
+    if (rows <= 0 || cols <= 0)
+        throw std::runtime_error("[LineRowIndex] invalid dimension");
+
+    row_start.resize(rows + 1, 0);
+    row_width.resize(rows, 0.f);
+}
+
+void LineRowIndex::add(double x1, double y1, double x2, double y2, int idx) {
+
+    if (y1 > y2) {
+        std::swap(x1, x2);
+        std::swap(y1, y2);
+    }
+
+    const int first = std::max(0, static_cast<int>(std::floor(y1)));
+    const int last = std::min(rows - 1, static_cast<int>(std::floor(y2)));
+    const double dxdy = (y2 > y1) ? (x2 - x1) / (y2 - y1) : 0.0;
+
+    // x-extent of the part of the segment within each row
+    for (int r = first; r <= last; ++r) {
+        const double ya = std::max(y1, static_cast<double>(r));
+        const double yb = std::min(y2, static_cast<double>(r + 1));
+        const double xa = x1 + (ya - y1) * dxdy;
+        const double xb = (y2 > y1) ? x1 + (yb - y1) * dxdy : x2;
+
+        Span s;
+        s.x_min = static_cast<float>(std::min(xa, xb));
+        s.x_max = static_cast<float>(std::max(xa, xb));
+        s.idx = idx;
+        entries.push_back(std::make_pair(r, s));
+        built = false;
+    }
+}
+
+void LineRowIndex::build() {
+
+    // counting sort of the spans by row, then by x within each row
+    std::fill(row_start.begin(), row_start.end(), 0);
+    for (const std::pair<int, Span> &e : entries)
+        row_start[e.first + 1]++;
+    for (int r = 0; r < rows; ++r)
+        row_start[r + 1] += row_start[r];
+
+    spans.resize(entries.size());
+    for (const std::pair<int, Span> &e : entries)
+        spans[row_start[e.first]++] = e.second;
+
+    // the scatter advanced each offset to the start of the next row
+    for (int r = rows; r > 0; --r)
+        row_start[r] = row_start[r - 1];
+    row_start[0] = 0;
+
+    for (int r = 0; r < rows; ++r) {
+        std::sort(spans.begin() + row_start[r], spans.begin() + row_start[r + 1],
+                  [](const Span &a, const Span &b) { return a.x_min < b.x_min; });
+        float width = 0.f;
+        for (int k = row_start[r]; k < row_start[r + 1]; ++k)
+            width = std::max(width, spans[k].x_max - spans[k].x_min);
+        row_width[r] = width;
+    }
+
+    built = true;
+}
+
+void LineRowIndex::get(double min_x, double max_x, int min_y, int max_y, std::vector<int> &indices) const {
+
+    if (!built)
+        throw std::runtime_error("[LineRowIndex] build() must be called before get()");
+
+    min_y = std::max(0, min_y);
+    max_y = std::min(rows, max_y);
+
+    for (int r = min_y; r < max_y; ++r) {
+        // no span of this row starting before it can reach min_x
+        const float from = static_cast<float>(min_x) - row_width[r];
+        std::vector<Span>::const_iterator it =
+                std::lower_bound(spans.begin() + row_start[r], spans.begin() + row_start[r + 1], from,
+                                 [](const Span &s, float x) { return s.x_min < x; });
+        for (; it != spans.begin() + row_start[r + 1] && it->x_min < max_x; ++it)
+            if (it->x_max >= min_x)
+                indices.push_back(it->idx);
+    }
+}
+
+void LineRowIndex::get(int x, int y, const GridWindow &w, std::vector<int> &indices) const {
+
+    get(std::max(0, x - w.width.first), std::min(cols, x + w.width.second + 1),
+        y - w.height.first, y + w.height.second + 1, indices);
+}
+
+void LineRowIndex::clear() {
+
+    entries.clear();
+    spans.clear();
+    built = false;
+}
+
+EpipolarBandIndex::EpipolarBandIndex(double band_height)
+    : band_height(band_height), built(false) {
+
+    if (band_height <= 0.0)
+        throw std::runtime_error("[EpipolarBandIndex] invalid band height");
+}
+
+void EpipolarBandIndex::add(double x, double y, int idx) {
+
+    if (y >= 0.0) {
+        Entry e;
+        e.x = static_cast<float>(x);
+        e.y = static_cast<float>(y);
+        e.idx = idx;
+        entries.push_back(std::make_pair(static_cast<int>(y / band_height), e));
+        built = false;
+    }
+}
+
+void EpipolarBandIndex::build() {
+
+    int bands = 0;
+    for (const std::pair<int, Entry> &e : entries)
+        bands = std::max(bands, e.first + 1);
+
+    // counting sort of the points by band, then by x within each band
+    band_start.assign(bands + 1, 0);
+    for (const std::pair<int, Entry> &e : entries)
+        band_start[e.first + 1]++;
+    for (int b = 0; b < bands; ++b)
+        band_start[b + 1] += band_start[b];
+
+    points.resize(entries.size());
+    for (const std::pair<int, Entry> &e : entries)
+        points[band_start[e.first]++] = e.second;
+
+    // the scatter advanced each offset to the start of the next band
+    for (int b = bands; b > 0; --b)
+        band_start[b] = band_start[b - 1];
+    band_start[0] = 0;
+
+    for (int b = 0; b < bands; ++b)
+        std::sort(points.begin() + band_start[b], points.begin() + band_start[b + 1],
+                  [](const Entry &e1, const Entry &e2) { return e1.x < e2.x; });
+
+    built = true;
+}
+
+void EpipolarBandIndex::get(double y, double max_dy, double min_x, double max_x, std::vector<int> &indices) const {
+
+    if (!built)
+        throw std::runtime_error("[EpipolarBandIndex] build() must be called before get()");
+
+    const int bands = static_cast<int>(band_start.size()) - 1;
+    const int first = std::max(0, static_cast<int>(std::floor((y - max_dy) / band_height)));
+    const int last = std::min(bands - 1, static_cast<int>(std::floor((y + max_dy) / band_height)));
+
+    for (int b = first; b <= last; ++b) {
+        std::vector<Entry>::const_iterator it =
+                std::lower_bound(points.begin() + band_start[b], points.begin() + band_start[b + 1], min_x,
+                                 [](const Entry &e, double x) { return e.x < x; });
+        for (; it != points.begin() + band_start[b + 1] && it->x <= max_x; ++it)
+            if (std::abs(it->y - y) <= max_dy)
+                indices.push_back(it->idx);
+    }
+}
+
+void EpipolarBandIndex::clear() {
+
+    entries.clear();
+    points.clear();
+    built = false;
 }
 
 } //namesapce StVO
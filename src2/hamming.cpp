@@ -0,0 +1,242 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "hamming.h"
+
+//STL
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAMMING_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAMMING_NEON
+#endif
+
+namespace StVO {
+
+namespace {
+
+// distances from the 256-bit query q to the train rows (train + step * row)
+typedef void (*Kernel256)(const uchar *q, const uchar *train, size_t step, const int *idx, int n, int *dist);
+
+inline const uchar* trainRow(const uchar *train, size_t step, const int *idx, int k) {
+    return train + step * (idx ? idx[k] : k);
+}
+
+int popcountGeneric(const uchar *a, const uchar *b, int n_bytes) {
+    int d = 0, i = 0;
+    for (; i + 8 <= n_bytes; i += 8) {
+        uint64_t x, y;
+        std::memcpy(&x, a + i, 8);
+        std::memcpy(&y, b + i, 8);
+        d += __builtin_popcountll(x ^ y);
+    }
+    for (; i < n_bytes; ++i)
+        d += __builtin_popcount(a[i] ^ b[i]);
+    return d;
+}
+
+void kernelScalar(const uchar *q, const uchar *train, size_t step, const int *idx, int n, int *dist) {
+    for (int k = 0; k < n; ++k)
+        dist[k] = popcountGeneric(q, trainRow(train, step, idx, k), 32);
+}
+
+#ifdef HAMMING_X86
+
+__attribute__((target("avx2")))
+inline int reduce256(__m256i v) {
+    // sum of the four 64-bit lanes
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_cvtsi128_si32(s) + _mm_extract_epi32(s, 2);
+}
+
+__attribute__((target("avx2")))
+void kernelAVX2(const uchar *q, const uchar *train, size_t step, const int *idx, int n, int *dist) {
+    // nibble lookup popcount, summed with vpsadbw
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i vq  = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q));
+    for (int k = 0; k < n; ++k) {
+        const __m256i vt = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(trainRow(train, step, idx, k)));
+        const __m256i x  = _mm256_xor_si256(vq, vt);
+        const __m256i c  = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+                                           _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+        dist[k] = reduce256(_mm256_sad_epu8(c, _mm256_setzero_si256()));
+    }
+}
+
+__attribute__((target("avx2,avx512f,avx512vl,avx512vpopcntdq")))
+void kernelAVX512(const uchar *q, const uchar *train, size_t step, const int *idx, int n, int *dist) {
+    const __m256i vq = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q));
+    for (int k = 0; k < n; ++k) {
+        const __m256i vt = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(trainRow(train, step, idx, k)));
+        dist[k] = reduce256(_mm256_popcnt_epi64(_mm256_xor_si256(vq, vt)));
+    }
+}
+
+#endif
+
+#ifdef HAMMING_NEON
+
+void kernelNEON(const uchar *q, const uchar *train, size_t step, const int *idx, int n, int *dist) {
+    const uint8x16_t q0 = vld1q_u8(q), q1 = vld1q_u8(q + 16);
+    for (int k = 0; k < n; ++k) {
+        const uchar *t = trainRow(train, step, idx, k);
+        const uint8x16_t c = vaddq_u8(vcntq_u8(veorq_u8(q0, vld1q_u8(t))),
+                                      vcntq_u8(veorq_u8(q1, vld1q_u8(t + 16))));
+        dist[k] = vaddlvq_u8(c);
+    }
+}
+
+#endif
+
+struct Dispatch {
+    Kernel256 kernel;
+    const char *name;
+    Dispatch() : kernel(&kernelScalar), name("scalar") {
+#ifdef HAMMING_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vpopcntdq") && __builtin_cpu_supports("avx512vl")) {
+            kernel = &kernelAVX512;
+            name = "avx512";
+        } else if (__builtin_cpu_supports("avx2")) {
+            kernel = &kernelAVX2;
+            name = "avx2";
+        }
+#elif defined(HAMMING_NEON)
+        kernel = &kernelNEON;
+        name = "neon";
+#endif
+    }
+};
+
+const Dispatch& dispatch() {
+    static const Dispatch d;
+    return d;
+}
+
+void checkDescriptors(const cv::Mat &query, const cv::Mat &train) {
+    if (query.type() != CV_8U || train.type() != CV_8U || (!train.empty() && query.cols != train.cols))
+        throw std::runtime_error("[hamming] Descriptors must be CV_8U rows of the same length");
+}
+
+} // namespace
+
+Desc256::Desc256(const cv::Mat &row) {
+
+    w[0] = w[1] = w[2] = w[3] = 0;
+    if (row.empty())
+        return;
+    if (row.type() != CV_8U || row.rows != 1 || row.cols != 32)
+        throw std::runtime_error("[hamming] Desc256 needs a 32-byte CV_8U row");
+    std::memcpy(w, row.ptr<uchar>(), sizeof(w));
+}
+
+int hammingDistance(const Desc256 &a, const Desc256 &b) {
+    int d;
+    dispatch().kernel(a.data(), b.data(), 0, NULL, 1, &d);
+    return d;
+}
+
+void hammingDistances(const Desc256 &query, const Desc256 *train, const int *idx, int n, int *dist) {
+    if (n > 0)
+        dispatch().kernel(query.data(), train[0].data(), sizeof(Desc256), idx, n, dist);
+}
+
+int hammingDistance(const cv::Mat &a, const cv::Mat &b) {
+
+    checkDescriptors(a, b);
+    if (b.empty() || a.cols != b.cols)
+        throw std::runtime_error("[hamming] Descriptors must be CV_8U rows of the same length");
+    if (a.cols == 32) {
+        int d;
+        dispatch().kernel(a.ptr<uchar>(), b.ptr<uchar>(), 0, NULL, 1, &d);
+        return d;
+    }
+    return popcountGeneric(a.ptr<uchar>(), b.ptr<uchar>(), a.cols);
+}
+
+void hammingDistances(const cv::Mat &query, const cv::Mat &train, const int *idx, int n, int *dist) {
+
+    checkDescriptors(query, train);
+    if (n <= 0) return;
+
+    const uchar *q = query.ptr<uchar>();
+    const uchar *t = train.ptr<uchar>();
+    if (query.cols == 32)
+        dispatch().kernel(q, t, train.step, idx, n, dist);
+    else
+        for (int k = 0; k < n; ++k)
+            dist[k] = popcountGeneric(q, trainRow(t, train.step, idx, k), query.cols);
+}
+
+HammingMatch hammingBest2(const cv::Mat &query, const cv::Mat &train, const int *idx, int n) {
+
+    if (n < 0) n = train.rows;
+
+    HammingMatch m;
+    m.idx = -1;
+    m.best = m.second = std::numeric_limits<int>::max();
+
+    // distances in blocks, so the kernel runs on a stack buffer
+    const int block = 64;
+    int dist[block];
+    for (int k0 = 0; k0 < n; k0 += block) {
+        const int nk = std::min(block, n - k0);
+        if (idx)
+            hammingDistances(query, train, idx + k0, nk, dist);
+        else {
+            // rows k0, k0+1, ... are addressed from the block start
+            hammingDistances(query, train.rowRange(k0, k0 + nk), NULL, nk, dist);
+        }
+        for (int k = 0; k < nk; ++k) {
+            if (dist[k] < m.best) {
+                m.second = m.best;
+                m.best   = dist[k];
+                m.idx    = idx ? idx[k0 + k] : k0 + k;
+            } else if (dist[k] < m.second)
+                m.second = dist[k];
+        }
+    }
+
+    return m;
+}
+
+void hammingBest2(const cv::Mat &query, const cv::Mat &train, std::vector<HammingMatch> &matches) {
+
+    matches.resize(query.rows);
+    for (int i = 0; i < query.rows; ++i)
+        matches[i] = hammingBest2(query.row(i), train);
+}
+
+const char* hammingKernelName() {
+    return dispatch().name;
+}
+
+} // namespace StVO
@@ -0,0 +1,133 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "threadRole.h"
+
+namespace StVO {
+
+const std::size_t Logger::RING_SIZE;
+const std::size_t Logger::SLOT_CHARS;
+
+Logger& Logger::instance() {
+
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() : ring(new Slot[RING_SIZE]), head(0), tail(0), n_written(0), n_dropped(0),
+                   min_level(LOG_LEVEL_INFO), running(true) {
+
+    for (std::size_t i = 0; i < RING_SIZE; i++)
+        ring[i].seq.store(i, std::memory_order_relaxed);
+    writer = std::thread(&Logger::writerLoop, this);
+}
+
+Logger::~Logger() {
+
+    running.store(false);
+    writer.join();
+    if (dropped() > 0)
+        std::cerr << "[Logger] " << dropped() << " messages dropped (full ring)" << std::endl;
+}
+
+void Logger::write(int level, const std::string &msg) {
+
+    // claim a free slot (bounded MPMC ring), the message is dropped if the writer lags a full ring
+    std::size_t pos = head.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &ring[pos & (RING_SIZE - 1)];
+        std::size_t seq = slot->seq.load(std::memory_order_acquire);
+        std::ptrdiff_t dif = std::ptrdiff_t(seq) - std::ptrdiff_t(pos);
+        if (dif == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0) {
+            n_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+            pos = head.load(std::memory_order_relaxed);
+    }
+    slot->level = level;
+    slot->len   = std::min(msg.size(), SLOT_CHARS);
+    std::memcpy(slot->text, msg.data(), slot->len);
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+void Logger::flush() {
+
+    const std::size_t target = head.load(std::memory_order_acquire);
+    while (n_written.load(std::memory_order_acquire) < target)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+}
+
+bool Logger::drain() {
+
+    std::string out, err;
+    std::size_t n = 0;
+    while (true) {
+        Slot &slot = ring[tail & (RING_SIZE - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != tail + 1)
+            break;
+        std::string &dst = (slot.level >= LOG_LEVEL_WARN) ? err : out;
+        // the order between the two streams is kept at the switches
+        if (&dst == &err && !out.empty()) {
+            std::cout << out << std::flush;
+            out.clear();
+        }
+        else if (&dst == &out && !err.empty()) {
+            std::cerr << err << std::flush;
+            err.clear();
+        }
+        dst.append(slot.text, slot.len);
+        dst.push_back('\n');
+        slot.seq.store(tail + RING_SIZE, std::memory_order_release);
+        tail++;
+        n++;
+    }
+    if (!out.empty()) std::cout << out << std::flush;
+    if (!err.empty()) std::cerr << err << std::flush;
+    n_written.fetch_add(n, std::memory_order_release);
+    return n > 0;
+}
+
+void Logger::writerLoop() {
+
+    setupThread(THREAD_LOGGER);
+    // polled, so that the producers never wait on a lock or a notification
+    while (running.load()) {
+        if (!drain())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    drain();
+}
+
+} // namespace StVO
@@ -23,6 +23,7 @@
 #include "matching.h"
 
 //STL
+#include <algorithm>
 #include <cmath>
 #include <functional>
 #include <future>
@@ -35,6 +36,9 @@
 
 #include "config.h"
 #include "gridStructure.h"
+#include "hamming.h"
+#include "mihIndex.h"
+#include "threadPool.h"
 
 namespace StVO {
 
@@ -43,16 +47,15 @@ int matchNNR(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<
     int matches = 0;
     matches_12.resize(desc1.rows, -1);
 
-    std::vector<std::vector<cv::DMatch>> matches_;
-    cv::Ptr<cv::BFMatcher> bfm = cv::BFMatcher::create(cv::NORM_HAMMING, false); // cross-check
-    bfm->knnMatch(desc1, desc2, matches_, 2);
+    std::vector<HammingMatch> matches_;
+    hammingBest2(desc1, desc2, matches_);
 
     if (desc1.rows != matches_.size())
         throw std::runtime_error("[matchNNR] Different size for matches and descriptors!");
 
     for (int idx = 0; idx < desc1.rows; ++idx) {
-        if (matches_[idx][0].distance < matches_[idx][1].distance * nnr) {
-            matches_12[idx] = matches_[idx][0].trainIdx;
+        if (matches_[idx].idx >= 0 && matches_[idx].best < matches_[idx].second * nnr) {
+            matches_12[idx] = matches_[idx].idx;
             matches++;
         }
     }
@@ -60,21 +63,42 @@ int matchNNR(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<
     return matches;
 }
 
-int match(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<int> &matches_12) {
+int matchNNRIndexed(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<int> &matches_12) {
+
+    if (Config::mihMinRows() <= 0 || desc2.rows <= Config::mihMinRows() || desc2.type() != CV_8U || desc2.cols != 32)
+        return matchNNR(desc1, desc2, nnr, matches_12);
+
+    int matches = 0;
+    matches_12.assign(desc1.rows, -1);
+
+    const MihIndex index(desc2);
+    for (int idx = 0; idx < desc1.rows; ++idx) {
+        HammingMatch m = index.best2(desc1.row(idx), nnr, Config::mihRadius());
+        if (m.idx >= 0 && m.best < m.second * nnr) {
+            matches_12[idx] = m.idx;
+            matches++;
+        }
+    }
+
+    return matches;
+}
+
+int match(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<int> &matches_12, bool indexed) {
 
     if (Config::bestLRMatches()) {
         int matches;
         std::vector<int> matches_21;
+        int (*match_nnr)(const cv::Mat&, const cv::Mat&, float, std::vector<int>&) = indexed ? &matchNNRIndexed : &matchNNR;
         if (Config::lrInParallel()) {
-            auto match_12 = std::async(std::launch::async, &matchNNR,
-                                  std::cref(desc1), std::cref(desc2), nnr, std::ref(matches_12));
-            auto match_21 = std::async(std::launch::async, &matchNNR,
-                                  std::cref(desc2), std::cref(desc1), nnr, std::ref(matches_21));
-            matches = match_12.get();
-            match_21.wait();
+            auto match_12 = ThreadPool::global().submit(match_nnr,
+                                                        std::cref(desc1), std::cref(desc2), nnr, std::ref(matches_12));
+            auto match_21 = ThreadPool::global().submit(match_nnr,
+                                                        std::cref(desc2), std::cref(desc1), nnr, std::ref(matches_21));
+            matches = ThreadPool::global().wait(match_12);
+            ThreadPool::global().wait(match_21);
         } else {
-            matches = matchNNR(desc1, desc2, nnr, matches_12);
-            matchNNR(desc2, desc1, nnr, matches_21);
+            matches = match_nnr(desc1, desc2, nnr, matches_12);
+            match_nnr(desc2, desc1, nnr, matches_21);
         }
 
         for (int i1 = 0; i1 < matches_12.size(); ++i1) {
@@ -87,34 +111,71 @@ int match(const cv::Mat &desc1, const cv::Mat &desc2, float nnr, std::vector<int
 
         return matches;
     } else
-        return matchNNR(desc1, desc2, nnr, matches_12);
+        return indexed ? matchNNRIndexed(desc1, desc2, nnr, matches_12) : matchNNR(desc1, desc2, nnr, matches_12);
 }
 
 int distance(const cv::Mat &a, const cv::Mat &b) {
+    return hammingDistance(a, b);
+}
 
-    // adapted from: http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel
+int matchGroups(const cv::Mat &desc1, const cv::Mat &desc2,
+                const std::vector<const std::vector<unsigned int>*> &groups1,
+                const std::vector<const std::vector<unsigned int>*> &groups2,
+                float nnr, int max_dist, std::vector<int> &matches_12) {
 
-    const int *pa = a.ptr<int32_t>();
-    const int *pb = b.ptr<int32_t>();
+    if (groups1.size() != groups2.size())
+        throw std::runtime_error("[matchGroups] Different number of groups!");
 
-    int dist = 0;
-    for(int i = 0; i < 8; i++, pa++, pb++) {
-        unsigned  int v = *pa ^ *pb;
-        v = v - ((v >> 1) & 0x55555555);
-        v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
-        dist += (((v + (v >> 4)) & 0xF0F0F0F) * 0x1010101) >> 24;
+    int matches = 0;
+    matches_12.assign(desc1.rows, -1);
+
+    const bool lr = Config::bestLRMatches();
+    std::vector<int> matches_21;
+    if (lr) matches_21.assign(desc2.rows, -1);
+
+    std::vector<int> idx1, idx2;
+    for (int g = 0; g < groups1.size(); ++g) {
+        idx1.assign(groups1[g]->begin(), groups1[g]->end());
+        idx2.assign(groups2[g]->begin(), groups2[g]->end());
+        if (idx1.empty() || idx2.empty()) continue;
+
+        for (int i1 : idx1) {
+            HammingMatch m = hammingBest2(desc1.row(i1), desc2, idx2.data(), idx2.size());
+            if (m.idx >= 0 && m.best <= max_dist && m.best < m.second * nnr) {
+                matches_12[i1] = m.idx;
+                matches++;
+            }
+        }
+        if (!lr) continue;
+        for (int i2 : idx2) {
+            HammingMatch m = hammingBest2(desc2.row(i2), desc1, idx1.data(), idx1.size());
+            if (m.idx >= 0 && m.best <= max_dist && m.best < m.second * nnr)
+                matches_21[i2] = m.idx;
+        }
+    }
+
+    if (lr) {
+        for (int i1 = 0; i1 < matches_12.size(); ++i1) {
+            int &i2 = matches_12[i1];
+            if (i2 >= 0 && matches_21[i2] != i1) {
+                i2 = -1;
+                matches--;
+            }
+        }
     }
 
-    return dist;
+    return matches;
 }
 
-int matchGrid(const std::vector<point_2d> &points1, const cv::Mat &desc1, const GridStructure &grid, const cv::Mat &desc2, const GridWindow &w, std::vector<int> &matches_12) {
+namespace {
 
-    if (points1.size() != desc1.rows)
-        throw std::runtime_error("[matchGrid] Each point needs a corresponding descriptor!");
+// Nearest neighbour with ratio test among the candidates given for each
+// feature, get(i1, candidates) appends the candidates of the feature i1
+template <typename GetCandidates>
+int matchCandidates(int n1, const cv::Mat &desc1, const cv::Mat &desc2, GetCandidates get, std::vector<int> &matches_12) {
 
     int matches = 0;
-    matches_12.resize(desc1.rows, -1);
+    matches_12.assign(desc1.rows, -1);
 
     int best_d, best_d2, best_idx;
     std::vector<int> matches_21, distances;
@@ -124,23 +185,26 @@ int matchGrid(const std::vector<point_2d> &points1, const cv::Mat &desc1, const
         distances.resize(desc2.rows, std::numeric_limits<int>::max());
     }
 
-    for (int i1 = 0; i1 < points1.size(); ++i1) {
+    std::vector<int> candidates, dists;
+    for (int i1 = 0; i1 < n1; ++i1) {
 
         best_d = std::numeric_limits<int>::max();
         best_d2 = std::numeric_limits<int>::max();
         best_idx = -1;
 
-        const std::pair<int, int> &coords = points1[i1];
-        cv::Mat desc = desc1.row(i1);
-
-        std::unordered_set<int> candidates;
-        grid.get(coords.first, coords.second, w, candidates);
+        candidates.clear();
+        get(i1, candidates);
+        candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                        [&desc2](int i2) { return i2 < 0 || i2 >= desc2.rows; }),
+                         candidates.end());
 
         if (candidates.empty()) continue;
-        for (const int &i2 : candidates) {
-            if (i2 < 0 || i2 >= desc2.rows) continue;
-
-            const int d = distance(desc, desc2.row(i2));
+        cv::Mat desc = desc1.row(i1);
+        dists.resize(candidates.size());
+        hammingDistances(desc, desc2, candidates.data(), candidates.size(), dists.data());
+        for (int k = 0; k < candidates.size(); ++k) {
+            const int i2 = candidates[k];
+            const int d = dists[k];
 
             if (Config::bestLRMatches()) {
                 if (d < distances[i2]) {
@@ -176,85 +240,89 @@ int matchGrid(const std::vector<point_2d> &points1, const cv::Mat &desc1, const
     return matches;
 }
 
-int matchGrid(const std::vector<line_2d> &lines1, const cv::Mat &desc1,
-              const GridStructure &grid, const cv::Mat &desc2, const std::vector<std::pair<double, double>> &directions2,
-              const GridWindow &w,
-              std::vector<int> &matches_12) {
-
-    if (lines1.size() != desc1.rows)
-        throw std::runtime_error("[matchGrid] Each line needs a corresponding descriptor!");
-
-    int matches = 0;
-    matches_12.resize(desc1.rows, -1);
+// w_step is 0 for a window shared by all the features, 1 for a window per feature
+int matchGridPoints(const std::vector<point_2d> &points1, const cv::Mat &desc1, const GridStructure &grid, const cv::Mat &desc2,
+                    const GridWindow *w, int w_step, std::vector<int> &matches_12) {
 
-    int best_d, best_d2, best_idx;
-    std::vector<int> matches_21, distances;
-
-    if (Config::bestLRMatches()) {
-        matches_21.resize(desc2.rows, -1);
-        distances.resize(desc2.rows, std::numeric_limits<int>::max());
-    }
+    if (points1.size() != desc1.rows)
+        throw std::runtime_error("[matchGrid] Each point needs a corresponding descriptor!");
 
-    for (int i1 = 0; i1 < lines1.size(); ++i1) {
+    // each point lies in a single cell, so there are no duplicates
+    return matchCandidates(points1.size(), desc1, desc2,
+                           [&](int i1, std::vector<int> &candidates) {
+                               grid.get(points1[i1].first, points1[i1].second, w[i1 * w_step], candidates);
+                           }, matches_12);
+}
 
-        best_d = std::numeric_limits<int>::max();
-        best_d2 = std::numeric_limits<int>::max();
-        best_idx = -1;
+int matchGridLines(const std::vector<line_2d> &lines1, const cv::Mat &desc1,
+                   const LineRowIndex &grid, const cv::Mat &desc2, const std::vector<std::pair<double, double>> &directions2,
+                   const GridWindow *w, int w_step,
+                   std::vector<int> &matches_12) {
 
-        const line_2d &coords = lines1[i1];
-        cv::Mat desc = desc1.row(i1);
+    if (lines1.size() != desc1.rows)
+        throw std::runtime_error("[matchGrid] Each line needs a corresponding descriptor!");
 
-        const point_2d sp = coords.first;
-        const point_2d ep = coords.second;
+    return matchCandidates(lines1.size(), desc1, desc2,
+                           [&](int i1, std::vector<int> &candidates) {
+                               const point_2d sp = lines1[i1].first;
+                               const point_2d ep = lines1[i1].second;
+
+                               std::pair<double, double> v = std::make_pair(ep.first - sp.first, ep.second - sp.second);
+                               normalize(v);
+
+                               // a line spans several rows, remove the repeated candidates
+                               grid.get(sp.first, sp.second, w[i1 * w_step], candidates);
+                               grid.get(ep.first, ep.second, w[i1 * w_step], candidates);
+                               std::sort(candidates.begin(), candidates.end());
+                               candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+                               candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                                               [&](int i2) { return i2 < 0 || i2 >= desc2.rows ||
+                                                                                    std::abs(dot(v, directions2[i2])) < Config::lineSimTh(); }),
+                                                candidates.end());
+                           }, matches_12);
+}
 
-        std::pair<double, double> v = std::make_pair(ep.first - sp.first, ep.second - sp.second);
-        normalize(v);
+} // namespace
 
-        std::unordered_set<int> candidates;
-        grid.get(sp.first, sp.second, w, candidates);
-        grid.get(ep.first, ep.second, w, candidates);
+int matchGrid(const std::vector<point_2d> &points1, const cv::Mat &desc1, const GridStructure &grid, const cv::Mat &desc2, const GridWindow &w, std::vector<int> &matches_12) {
+    return matchGridPoints(points1, desc1, grid, desc2, &w, 0, matches_12);
+}
 
-        if (candidates.empty()) continue;
-        for (const int &i2 : candidates) {
-            if (i2 < 0 || i2 >= desc2.rows) continue;
+int matchGrid(const std::vector<point_2d> &points1, const cv::Mat &desc1, const GridStructure &grid, const cv::Mat &desc2, const std::vector<GridWindow> &w, std::vector<int> &matches_12) {
 
-            if (std::abs(dot(v, directions2[i2])) < Config::lineSimTh())
-                continue;
+    if (points1.size() != w.size())
+        throw std::runtime_error("[matchGrid] Each point needs a corresponding window!");
+    return matchGridPoints(points1, desc1, grid, desc2, w.data(), 1, matches_12);
+}
 
-            const int d = distance(desc, desc2.row(i2));
+int matchEpipolar(const std::vector<std::pair<double, double>> &points1, const cv::Mat &desc1, const EpipolarBandIndex &index, const cv::Mat &desc2,
+                  double max_dy, double min_disp, double max_disp, std::vector<int> &matches_12) {
 
-            if (Config::bestLRMatches()) {
-                if (d < distances[i2]) {
-                    distances[i2] = d;
-                    matches_21[i2] = i1;
-                } else continue;
-            }
+    if (points1.size() != desc1.rows)
+        throw std::runtime_error("[matchEpipolar] Each point needs a corresponding descriptor!");
 
-            if (d < best_d) {
-                best_d2 = best_d;
-                best_d = d;
-                best_idx = i2;
-            } else if (d < best_d2)
-                best_d2 = d;
-        }
+    return matchCandidates(points1.size(), desc1, desc2,
+                           [&](int i1, std::vector<int> &candidates) {
+                               const std::pair<double, double> &p = points1[i1];
+                               index.get(p.second, max_dy, p.first - max_disp, p.first - min_disp, candidates);
+                           }, matches_12);
+}
 
-        if (best_d < best_d2 * Config::minRatio12P()) {
-            matches_12[i1] = best_idx;
-            matches++;
-        }
-    }
+int matchGrid(const std::vector<line_2d> &lines1, const cv::Mat &desc1,
+              const LineRowIndex &grid, const cv::Mat &desc2, const std::vector<std::pair<double, double>> &directions2,
+              const GridWindow &w,
+              std::vector<int> &matches_12) {
+    return matchGridLines(lines1, desc1, grid, desc2, directions2, &w, 0, matches_12);
+}
 
-    if (Config::bestLRMatches()) {
-        for (int i1 = 0; i1 < matches_12.size(); ++i1) {
-            int &i2 = matches_12[i1];
-            if (i2 >= 0 && matches_21[i2] != i1) {
-                i2 = -1;
-                matches--;
-            }
-        }
-    }
+int matchGrid(const std::vector<line_2d> &lines1, const cv::Mat &desc1,
+              const LineRowIndex &grid, const cv::Mat &desc2, const std::vector<std::pair<double, double>> &directions2,
+              const std::vector<GridWindow> &w,
+              std::vector<int> &matches_12) {
 
-    return matches;
+    if (lines1.size() != w.size())
+        throw std::runtime_error("[matchGrid] Each line needs a corresponding window!");
+    return matchGridLines(lines1, desc1, grid, desc2, directions2, w.data(), 1, matches_12);
 }
 
 } //namesapce StVO
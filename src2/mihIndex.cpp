@@ -0,0 +1,170 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "mihIndex.h"
+
+//STL
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace StVO {
+
+namespace {
+
+// bits [start, start + bits) of the code, bits <= 32
+inline uint32_t substring(const Desc256 &code, int start, int bits) {
+    const int word = start >> 6, shift = start & 63;
+    uint64_t v = code.w[word] >> shift;
+    if (shift + bits > 64)
+        v |= code.w[word + 1] << (64 - shift);
+    return uint32_t(v & ((uint64_t(1) << bits) - 1));
+}
+
+// next integer with the same number of set bits (Gosper's hack)
+inline uint32_t nextCombination(uint32_t v) {
+    const uint32_t t = v | (v - 1);
+    return (t + 1) | (((~t & -~t) - 1) >> (__builtin_ctz(v) + 1));
+}
+
+} // namespace
+
+void MihIndex::build(const cv::Mat &desc) {
+
+    if (!desc.empty() && (desc.type() != CV_8U || desc.cols != 32))
+        throw std::runtime_error("[MihIndex] 256-bit CV_8U descriptors are needed");
+
+    codes.resize(desc.rows);
+    for (int i = 0; i < desc.rows; ++i)
+        codes[i] = Desc256(desc.row(i));
+
+    // m substrings of about log2(N) bits, the first ones get the remainder bits (8 to 16 bits each)
+    const int key_bits = std::max(8, std::min(16, int(std::round(std::log2(std::max(desc.rows, 2))))));
+    n_chunks = (256 + key_bits - 1) / key_bits;
+    const int bits = (256 + n_chunks - 1) / n_chunks;
+    const int n_long = 256 - n_chunks * (bits - 1);
+
+    chunks.resize(n_chunks);
+    int start = 0, offset = 0;
+    for (int k = 0; k < n_chunks; ++k) {
+        chunks[k].start = start;
+        chunks[k].bits = (k < n_long) ? bits : bits - 1;
+        chunks[k].offset = offset;
+        start += chunks[k].bits;
+        offset += (1 << chunks[k].bits) + 1;
+    }
+
+    // counting sort of the rows by key, one table per substring
+    buckets.assign(offset, 0);
+    ids.resize(size_t(n_chunks) * codes.size());
+    for (const Chunk &c : chunks) {
+        uint32_t *table = &buckets[c.offset];
+        for (const Desc256 &code : codes)
+            table[substring(code, c.start, c.bits) + 1]++;
+        for (int key = 0; key < (1 << c.bits); ++key)
+            table[key + 1] += table[key];
+    }
+    for (int k = 0; k < n_chunks; ++k) {
+        const Chunk &c = chunks[k];
+        std::vector<uint32_t> next(buckets.begin() + c.offset, buckets.begin() + c.offset + (1 << c.bits));
+        int *table_ids = &ids[size_t(k) * codes.size()];
+        for (int i = 0; i < codes.size(); ++i)
+            table_ids[next[substring(codes[i], c.start, c.bits)]++] = i;
+    }
+}
+
+HammingMatch MihIndex::best2(const cv::Mat &query, float nnr, int max_radius) const {
+
+    HammingMatch m;
+    m.idx = -1;
+    m.best = m.second = std::numeric_limits<int>::max();
+    if (codes.empty())
+        return m;
+
+    const Desc256 q(query);
+
+    // rows already compared to this query (tick per query, shared by the indices of the thread)
+    static thread_local std::vector<uint32_t> seen;
+    static thread_local std::vector<int> fresh, dist;
+    static thread_local uint32_t tick = 0;
+    if (seen.size() < codes.size())
+        seen.resize(codes.size(), tick);
+    if (++tick == 0) {
+        std::fill(seen.begin(), seen.end(), 0);
+        tick = 1;
+    }
+
+    int exact = 0;  // every row closer than exact has been compared
+    for (int r = 0; r <= max_radius; ++r) {
+
+        fresh.clear();
+        for (int k = 0; k < n_chunks; ++k) {
+            const Chunk &c = chunks[k];
+            if (r > c.bits) continue;
+            const uint32_t key = substring(q, c.start, c.bits);
+            const uint32_t *table = &buckets[c.offset];
+            const int *table_ids = &ids[size_t(k) * codes.size()];
+
+            // keys at distance r from the query substring
+            for (uint32_t flip = (uint32_t(1) << r) - 1; flip < (uint32_t(1) << c.bits); ) {
+                const uint32_t probe = key ^ flip;
+                for (uint32_t j = table[probe]; j < table[probe + 1]; ++j) {
+                    const int i = table_ids[j];
+                    if (seen[i] != tick) {
+                        seen[i] = tick;
+                        fresh.push_back(i);
+                    }
+                }
+                if (flip == 0) break;
+                flip = nextCombination(flip);
+            }
+        }
+
+        dist.resize(fresh.size());
+        hammingDistances(q, codes.data(), fresh.data(), fresh.size(), dist.data());
+        for (int k = 0; k < fresh.size(); ++k) {
+            const int i = fresh[k], d = dist[k];
+            // ties resolved to the lowest row, as the exhaustive search
+            if (d < m.best || (d == m.best && i < m.idx)) {
+                m.second = m.best;
+                m.best = d;
+                m.idx = i;
+            } else if (d < m.second)
+                m.second = d;
+        }
+
+        exact = n_chunks * (r + 1);
+        if (m.second < exact || (m.best < exact && m.best < nnr * exact))
+            break;
+    }
+
+    if (m.best >= exact) {
+        m.idx = -1;
+        m.best = m.second = std::numeric_limits<int>::max();
+    } else
+        m.second = std::min(m.second, exact);
+
+    return m;
+}
+
+} // namespace StVO
@@ -22,11 +22,64 @@
 
 #include <pinholeStereoCamera.h>
 
+#include <algorithm>
 #include <cmath>
+#include <future>
 #include <stdexcept>
 #include <boost/filesystem.hpp>
 #include <yaml-cpp/yaml.h>
 
+#include "config.h"
+#include "threadPool.h"
+
+namespace {
+
+// grayscale conversion (if enabled) fused with the remap, so a single channel is interpolated
+void rectifySingle(const Mat &img_src, Mat &img_rec, const Mat &map1, const Mat &map2, bool dist) {
+    Mat src = img_src;
+    if (StVO::Config::rectifyGray() && src.channels() > 1) {
+        Mat gray;
+        cvtColor(src, gray, src.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+        src = gray;
+    }
+    if (dist)
+        remap(src, img_rec, map1, map2, cv::INTER_LINEAR);
+    else if (src.data != img_src.data)
+        img_rec = src;
+    else
+        src.copyTo(img_rec);
+}
+
+// bounding box of the rectified pixels whose (integer) source location lies inside the source image,
+// shrunk one border line at a time (the one with more invalid pixels) until the four borders are valid
+cv::Rect validMapROI(const Mat &map1, int src_width, int src_height) {
+    Mat valid(map1.size(), CV_8U);
+    for (int r = 0; r < map1.rows; r++) {
+        const cv::Vec2s *m = map1.ptr<cv::Vec2s>(r);
+        uchar *v = valid.ptr<uchar>(r);
+        for (int c = 0; c < map1.cols; c++)
+            v[c] = (m[c][0] >= 0 && m[c][0] < src_width - 1 && m[c][1] >= 0 && m[c][1] < src_height - 1);
+    }
+
+    int x0 = 0, y0 = 0, x1 = map1.cols, y1 = map1.rows;
+    while (x0 < x1 && y0 < y1) {
+        int w = x1 - x0, h = y1 - y0;
+        int n_invalid[4] = { w - countNonZero(valid(cv::Rect(x0, y0, w, 1))),
+                             w - countNonZero(valid(cv::Rect(x0, y1 - 1, w, 1))),
+                             h - countNonZero(valid(cv::Rect(x0, y0, 1, h))),
+                             h - countNonZero(valid(cv::Rect(x1 - 1, y0, 1, h))) };
+        int worst = std::max_element(n_invalid, n_invalid + 4) - n_invalid;
+        if (n_invalid[worst] == 0) break;
+        if (worst == 0) y0++;
+        else if (worst == 1) y1--;
+        else if (worst == 2) x0++;
+        else x1--;
+    }
+    return cv::Rect(x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0));
+}
+
+} // namespace
+
 PinholeStereoCamera::PinholeStereoCamera(const string &params_file) {
     // read content of the .yaml dataset configuration file
     if  (!boost::filesystem::exists(params_file) || !boost::filesystem::is_regular(params_file))
@@ -96,6 +149,9 @@ PinholeStereoCamera::PinholeStereoCamera(const string &params_file) {
             cy = Pl.at<double>(1,2);
 
             K << fx, 0.0, cx, 0.0, fy, cy, 0.0, 0.0, 1.0;
+
+            if (StVO::Config::rectifyCrop())
+                cropToValidROI();
         } else {
             fx = std::abs(cam_config["cam_fx"].as<double>());
             fy = std::abs(cam_config["cam_fy"].as<double>());
@@ -183,32 +239,46 @@ PinholeStereoCamera::PinholeStereoCamera( int width_, int height_, double b_, Ma
 
     K << fx, 0.0, cx, 0.0, fy, cy, 0.0, 0.0, 1.0;
 
+    if (StVO::Config::rectifyCrop())
+        cropToValidROI();
 }
 
 PinholeStereoCamera::~PinholeStereoCamera() {
 
 }
 
+void PinholeStereoCamera::cropToValidROI()
+{
+    // both images keep the same crop, so the rows stay aligned and the disparities unchanged
+    cv::Rect roi = validMapROI(undistmap1l, width, height) & validMapROI(undistmap1r, width, height);
+    if (roi.area() <= 0 || roi.size() == cv::Size(width, height))
+        return;
+
+    undistmap1l = undistmap1l(roi).clone();
+    undistmap2l = undistmap2l(roi).clone();
+    undistmap1r = undistmap1r(roi).clone();
+    undistmap2r = undistmap2r(roi).clone();
+
+    width  = roi.width;
+    height = roi.height;
+    cx    -= roi.x;
+    cy    -= roi.y;
+    K << fx, 0.0, cx, 0.0, fy, cy, 0.0, 0.0, 1.0;
+}
+
 void PinholeStereoCamera::rectifyImage( const Mat& img_src, Mat& img_rec) const
 {
-    if(dist)
-      remap( img_src, img_rec, undistmap1l, undistmap2l, cv::INTER_LINEAR);
-    else
-      img_src.copyTo(img_rec);
+    rectifySingle(img_src, img_rec, undistmap1l, undistmap2l, dist);
 }
 
 void PinholeStereoCamera::rectifyImagesLR( const Mat& img_src_l, Mat& img_rec_l, const Mat& img_src_r, Mat& img_rec_r ) const
 {
-    if(dist)
-    {
-        remap( img_src_l, img_rec_l, undistmap1l, undistmap2l, cv::INTER_LINEAR);
-        remap( img_src_r, img_rec_r, undistmap1r, undistmap2r, cv::INTER_LINEAR);
-    }
-    else
-    {
-        img_src_l.copyTo(img_rec_l);
-        img_src_r.copyTo(img_rec_r);
-    }
+    // the right image is rectified by the pool while this thread rectifies the left one
+    std::future<void> rect_r = StVO::ThreadPool::global().submit([&]() {
+        rectifySingle(img_src_r, img_rec_r, undistmap1r, undistmap2r, dist);
+    });
+    rectifySingle(img_src_l, img_rec_l, undistmap1l, undistmap2l, dist);
+    StVO::ThreadPool::global().wait(rect_r);
 }
 
 // Proyection and Back-projection (internally we are supposed to work with rectified images because of the line segments)
@@ -232,6 +302,24 @@ Vector3d PinholeStereoCamera::backProjection( const double &u, const double &v,
     return P;
 }
 
+Matrix3d PinholeStereoCamera::backProjectionCov( double u, double v, double disp, double sigma2_px ) const
+{
+    const double px_hat = u - cx;
+    const double py_hat = v - cy;
+    const double disp2  = disp * disp;
+    Matrix3d cov;
+    cov(0,0) = disp2 + 2.0*px_hat*px_hat;
+    cov(0,1) = 2.0*px_hat*py_hat;
+    cov(0,2) = 2.0*fx*px_hat;
+    cov(1,1) = disp2 + 2.0*py_hat*py_hat;
+    cov(1,2) = 2.0*fx*py_hat;
+    cov(2,2) = 2.0*fx*fx;
+    cov(1,0) = cov(0,1);
+    cov(2,0) = cov(0,2);
+    cov(2,1) = cov(1,2);
+    return cov * ( b*b*sigma2_px / (disp2*disp2) );
+}
+
 Vector2d PinholeStereoCamera::projection(const Vector3d &P )
 {
     Vector2d uv_unit;
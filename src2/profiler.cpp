@@ -0,0 +1,300 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+
+namespace StVO {
+
+namespace {
+// nearest-rank percentile of an already sorted vector
+double percentile(const std::vector<double> &v, double p) {
+    size_t rank = (size_t) std::ceil(p * v.size());
+    return v[std::min(v.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+// count, mean, p50, p95, p99 and max (us) of a stage
+struct StageStats {
+    long long count;
+    double mean, p50, p95, p99, max;
+};
+
+StageStats sampleStats(const std::vector<double> &samples) {
+    std::vector<double> v(samples);
+    std::sort(v.begin(), v.end());
+    double sum = 0.0;
+    for (double d : v) sum += d;
+    StageStats st = {(long long) v.size(), sum / v.size(), percentile(v, 0.50), percentile(v, 0.95),
+                     percentile(v, 0.99), v.back()};
+    return st;
+}
+
+StageStats histogramStats(const StageHistogram &hist) {
+    StageStats st = {hist.count(), hist.mean(), hist.percentile(0.50), hist.percentile(0.95),
+                     hist.percentile(0.99), hist.max()};
+    return st;
+}
+
+// sampled and aggregated stages by name (the empty histograms are left out)
+std::map<std::string, StageStats> stageStats(const std::map<std::string, std::vector<double>> &samples,
+                                             const std::set<StageHistogram*> &histograms) {
+    std::map<std::string, StageStats> stages;
+    for (const auto &s : samples)
+        stages[s.first] = sampleStats(s.second);
+    for (const StageHistogram *hist : histograms)
+        if (hist->count() > 0)
+            stages[hist->name()] = histogramStats(*hist);
+    return stages;
+}
+}
+
+StageHistogram::StageHistogram(const std::string &name) : n(0), sum_ns(0), max_ns(0) {
+
+    for (int b = 0; b < n_buckets; b++)
+        buckets[b].store(0, std::memory_order_relaxed);
+    Profiler &prof = Profiler::instance();
+    stage = prof.intern(name);
+    prof.addHistogram(this);
+}
+
+StageHistogram::~StageHistogram() {
+
+    Profiler::instance().removeHistogram(this);
+}
+
+void StageHistogram::add(double duration) {
+
+    long long ns = (long long) (duration * 1e3);
+    int b = 0;
+    for (long long us = ns / 1000; us > 0 && b < n_buckets - 1; us >>= 1)
+        b++;
+    n.fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    buckets[b].fetch_add(1, std::memory_order_relaxed);
+    long long prev = max_ns.load(std::memory_order_relaxed);
+    while (ns > prev && !max_ns.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+}
+
+void StageHistogram::clear() {
+
+    n.store(0, std::memory_order_relaxed);
+    sum_ns.store(0, std::memory_order_relaxed);
+    max_ns.store(0, std::memory_order_relaxed);
+    for (int b = 0; b < n_buckets; b++)
+        buckets[b].store(0, std::memory_order_relaxed);
+}
+
+double StageHistogram::mean() const {
+
+    long long cnt = count();
+    return cnt > 0 ? 1e-3 * sum_ns.load(std::memory_order_relaxed) / cnt : 0.0;
+}
+
+double StageHistogram::percentile(double p) const {
+
+    long long total = 0;
+    for (int b = 0; b < n_buckets; b++)
+        total += buckets[b].load(std::memory_order_relaxed);
+    long long rank = std::max(1LL, (long long) std::ceil(p * total)), cum = 0;
+    for (int b = 0; b < n_buckets; b++) {
+        cum += buckets[b].load(std::memory_order_relaxed);
+        if (cum >= rank)
+            return std::min(std::ldexp(1.0, b), max());
+    }
+    return max();
+}
+
+Profiler::Profiler() : is_enabled(false), is_tracing(false), epoch(std::chrono::steady_clock::now()) {}
+
+Profiler& Profiler::instance() {
+
+    static Profiler profiler;
+    return profiler;
+}
+
+void Profiler::setEnabled(bool enabled, bool trace) {
+
+    std::lock_guard<std::mutex> lk(mtx);
+    is_enabled = enabled;
+    is_tracing = enabled && trace;
+}
+
+double Profiler::now() const {
+
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+const char* Profiler::intern(const std::string &name) {
+
+    std::lock_guard<std::mutex> lk(mtx);
+    return names.insert(name).first->c_str();
+}
+
+void Profiler::addHistogram(StageHistogram *hist) {
+
+    std::lock_guard<std::mutex> lk(mtx);
+    histograms.insert(hist);
+}
+
+void Profiler::removeHistogram(StageHistogram *hist) {
+
+    std::lock_guard<std::mutex> lk(mtx);
+    histograms.erase(hist);
+}
+
+int Profiler::threadIndex() {
+
+    auto it = thread_ids.find(std::this_thread::get_id());
+    if (it == thread_ids.end())
+        it = thread_ids.insert(std::make_pair(std::this_thread::get_id(), (int) thread_ids.size())).first;
+    return it->second;
+}
+
+void Profiler::addSample(const char *stage, double t_start, double duration) {
+
+    std::lock_guard<std::mutex> lk(mtx);
+    samples[stage].push_back(duration);
+    if (is_tracing) {
+        Event ev = {stage, t_start, duration, threadIndex()};
+        events.push_back(ev);
+    }
+}
+
+void Profiler::addCount(const char *name, long long n) {
+
+    if (!is_enabled) return;
+    std::lock_guard<std::mutex> lk(mtx);
+    counters[name] += n;
+}
+
+void Profiler::setGauge(const char *name, long long value) {
+
+    if (!is_enabled) return;
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = gauges.find(name);
+    if (it == gauges.end())
+        gauges.insert(std::make_pair(std::string(name), std::make_pair(value, value)));
+    else
+        it->second = std::make_pair(value, std::max(value, it->second.second));
+}
+
+void Profiler::printReport(std::ostream &os) const {
+
+    std::lock_guard<std::mutex> lk(mtx);
+    std::map<std::string, StageStats> stages = stageStats(samples, histograms);
+    if (stages.empty() && counters.empty() && gauges.empty()) return;
+
+    os << std::endl << "[Profiler] per-stage latency (ms)" << std::endl;
+    os << std::left << std::setw(48) << "stage" << std::right
+       << std::setw(8) << "count" << std::setw(10) << "mean" << std::setw(10) << "p50"
+       << std::setw(10) << "p95" << std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+    os << std::fixed << std::setprecision(3);
+    for (const auto &s : stages) {
+        os << std::left << std::setw(48) << s.first << std::right
+           << std::setw(8) << s.second.count
+           << std::setw(10) << s.second.mean * 1e-3
+           << std::setw(10) << s.second.p50 * 1e-3
+           << std::setw(10) << s.second.p95 * 1e-3
+           << std::setw(10) << s.second.p99 * 1e-3
+           << std::setw(10) << s.second.max * 1e-3 << std::endl;
+    }
+    for (const auto &c : counters)
+        os << std::left << std::setw(48) << c.first << std::right << std::setw(8) << c.second << std::endl;
+    if (!gauges.empty()) {
+        os << std::endl << "[Profiler] gauges (last / peak)" << std::endl;
+        for (const auto &g : gauges)
+            os << std::left << std::setw(48) << g.first << std::right
+               << std::setw(14) << g.second.first << std::setw(14) << g.second.second << std::endl;
+    }
+    os.unsetf(std::ios_base::floatfield);
+    os << std::setprecision(6);
+}
+
+void Profiler::writeReportJSON(std::ostream &os) const {
+
+    std::lock_guard<std::mutex> lk(mtx);
+    os << "{\"stages\":{";
+    os << std::fixed << std::setprecision(4);
+    bool first = true;
+    for (const auto &s : stageStats(samples, histograms)) {
+        os << (first ? "" : ",") << "\"" << s.first << "\":{\"count\":" << s.second.count
+           << ",\"mean_ms\":" << s.second.mean * 1e-3
+           << ",\"p50_ms\":" << s.second.p50 * 1e-3
+           << ",\"p95_ms\":" << s.second.p95 * 1e-3
+           << ",\"p99_ms\":" << s.second.p99 * 1e-3
+           << ",\"max_ms\":" << s.second.max * 1e-3 << "}";
+        first = false;
+    }
+    os << "},\"counters\":{";
+    first = true;
+    for (const auto &c : counters) {
+        os << (first ? "" : ",") << "\"" << c.first << "\":" << c.second;
+        first = false;
+    }
+    os << "},\"gauges\":{";
+    first = true;
+    for (const auto &g : gauges) {
+        os << (first ? "" : ",") << "\"" << g.first << "\":{\"last\":" << g.second.first
+           << ",\"peak\":" << g.second.second << "}";
+        first = false;
+    }
+    os << "}}";
+    os.unsetf(std::ios_base::floatfield);
+    os << std::setprecision(6);
+}
+
+bool Profiler::writeTrace(const std::string &file) const {
+
+    std::lock_guard<std::mutex> lk(mtx);
+    if (file.empty() || events.empty()) return false;
+
+    std::ofstream out(file.c_str());
+    if (!out.is_open()) return false;
+
+    out << "{\"traceEvents\":[" << std::endl;
+    out << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < events.size(); ++i) {
+        const Event &ev = events[i];
+        out << "{\"name\":\"" << ev.stage << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << ev.tid
+            << ",\"ts\":" << ev.t_start << ",\"dur\":" << ev.duration << "}"
+            << (i + 1 < events.size() ? "," : "") << std::endl;
+    }
+    out << "],\"displayTimeUnit\":\"ms\"}" << std::endl;
+    return true;
+}
+
+void Profiler::clear() {
+
+    std::lock_guard<std::mutex> lk(mtx);
+    samples.clear();
+    counters.clear();
+    gauges.clear();
+    events.clear();
+    for (StageHistogram *hist : histograms)
+        hist->clear();
+}
+
+} // namespace StVO
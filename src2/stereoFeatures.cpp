@@ -21,13 +21,14 @@
 *****************************************************************************/
 
 #include <stereoFeatures.h>
+#include <pinholeStereoCamera.h>
 
 namespace StVO{
 
 // Point feature
 
 PointFeature::PointFeature( Vector3d P_, Vector2d pl_obs_) :
-    P(P_), pl_obs(pl_obs_), level(0)
+    P(P_), pl_obs(pl_obs_), inlier(true), level(0)
 {}
 
 PointFeature::PointFeature( Vector2d pl_, double disp_, Vector3d P_ ) :
@@ -47,7 +48,7 @@ PointFeature::PointFeature( Vector2d pl_, double disp_, Vector3d P_, int idx_, i
 }
 
 PointFeature::PointFeature( Vector2d pl_, double disp_, Vector3d P_, int idx_, int level_, Matrix3d covP_an_ ) :
-    pl(pl_), disp(disp_), P(P_), inlier(true), idx(idx_), level(level_), covP_an(covP_an_)
+    pl(pl_), disp(disp_), P(P_), inlier(true), idx(idx_), level(level_), covP_an(covP_an_), has_cov(true)
 {
     for( int i = 0; i < level; i++ )
         sigma2 *= Config::orbScaleFactor();
@@ -60,11 +61,24 @@ PointFeature::PointFeature( Vector2d pl_, double disp_, Vector3d P_, Vector2d pl
 
 PointFeature::PointFeature( Vector2d pl_, double disp_, Vector3d P_, Vector2d pl_obs_,
               int idx_, int level_, double sigma2_, Matrix3d covP_an_, bool inlier_ ) :
-    pl(pl_), disp(disp_), P(P_), pl_obs(pl_obs_), inlier(inlier_), level(level_), sigma2(sigma2_), covP_an(covP_an_)
+    pl(pl_), disp(disp_), P(P_), pl_obs(pl_obs_), inlier(inlier_), level(level_), sigma2(sigma2_), covP_an(covP_an_), has_cov(true)
 {}
 
 PointFeature* PointFeature::safeCopy(){
-    return new PointFeature( pl, disp, P, pl_obs, idx, level, sigma2, covP_an, inlier );
+    PointFeature* pt = new PointFeature( pl, disp, P, pl_obs, idx, level, sigma2, covP_an, inlier );
+    pt->has_cov = has_cov;
+    return pt;
+}
+
+const Matrix3d& PointFeature::covariance( const PinholeStereoCamera *cam ) const
+{
+    if( !has_cov )
+    {
+        // sigma2 is the inverse of the variance of the pyramid level
+        covP_an = cam->backProjectionCov( pl(0), pl(1), disp, 1.0 / sigma2 );
+        has_cov = true;
+    }
+    return covP_an;
 }
 
 
@@ -72,12 +86,12 @@ PointFeature* PointFeature::safeCopy(){
 // Line segment feature
 
 LineFeature::LineFeature( Vector3d sP_, Vector3d eP_, Vector3d le_obs_) :
-    sP(sP_), eP(eP_), le_obs(le_obs_), level(0)
+    sP(sP_), eP(eP_), le_obs(le_obs_), inlier(true), level(0)
 {}
 
 
 LineFeature::LineFeature( Vector3d sP_, Vector3d eP_, Vector3d le_obs_, Vector2d spl_obs_, Vector2d epl_obs_) :
-    sP(sP_), eP(eP_), le_obs(le_obs_), spl_obs(spl_obs_), epl_obs(epl_obs_), level(0)
+    sP(sP_), eP(eP_), le_obs(le_obs_), spl_obs(spl_obs_), epl_obs(epl_obs_), inlier(true), level(0)
 {}
 
 
@@ -121,7 +135,7 @@ LineFeature::LineFeature( Vector2d spl_, double sdisp_, Vector3d sP_, Vector2d s
 
     spl(spl_), sdisp(sdisp_), sP(sP_), spl_obs(spl_obs_), sdisp_obs(sdisp_obs_),
     epl(epl_), edisp(edisp_), eP(eP_), epl_obs(epl_obs_), edisp_obs(edisp_obs_),
-    le(le_), le_obs(le_obs_), angle(angle_), idx(idx_), level(level_), inlier(inlier_), sigma2(sigma2_), covE_an(covE_an_), covS_an(covS_an_), NDc(nd_)
+    le(le_), le_obs(le_obs_), angle(angle_), idx(idx_), level(level_), inlier(inlier_), sigma2(sigma2_), covE_an(covE_an_), covS_an(covS_an_), has_cov(true), NDc(nd_)
 {
     for( int i = 0; i < level; i++ )
         sigma2 *= Config::lsdScale();
@@ -129,9 +143,28 @@ LineFeature::LineFeature( Vector2d spl_, double sdisp_, Vector3d sP_, Vector2d s
 }
 
 LineFeature* LineFeature::safeCopy(){
-    return new LineFeature( spl, sdisp, sP, spl_obs, sdisp_obs,
-                            epl, edisp, eP, epl_obs, edisp_obs,
-                            le, le_obs, angle, idx, level, inlier, sigma2, covE_an, covS_an, NDc );
+    LineFeature* ls = new LineFeature( spl, sdisp, sP, spl_obs, sdisp_obs,
+                                       epl, edisp, eP, epl_obs, edisp_obs,
+                                       le, le_obs, angle, idx, level, inlier, sigma2, covE_an, covS_an, NDc );
+    ls->has_cov = has_cov;
+    return ls;
+}
+
+const Matrix3d& LineFeature::startCovariance( const PinholeStereoCamera *cam ) const
+{
+    if( !has_cov )
+    {
+        covS_an = cam->backProjectionCov( spl(0), spl(1), sdisp, 1.0 / sigma2 );
+        covE_an = cam->backProjectionCov( epl(0), epl(1), edisp, 1.0 / sigma2 );
+        has_cov = true;
+    }
+    return covS_an;
+}
+
+const Matrix3d& LineFeature::endCovariance( const PinholeStereoCamera *cam ) const
+{
+    startCovariance( cam );
+    return covE_an;
 }
 
 /*LineFeature::LineFeature( Vector2d spl_, double sdisp_, Vector3d sP_,
@@ -29,17 +29,62 @@
 #include <map>
 #include <stdexcept>
 
-#include "lineIterator.h"
+#include <opencv2/video/tracking.hpp>
+
+#include "featureEngine.h"
 #include "matching.h"
+#include "profiler.h"
+#include "threadPool.h"
+#include "tiledLineDetector.h"
+#include "timer.h"
 
 namespace StVO{
 
+// single channel version of img, as the detectors convert it (no copy if it already is)
+static void toGray( const Mat &img, Mat &gray )
+{
+    if( img.channels() == 3 )
+        cvtColor( img, gray, COLOR_BGR2GRAY );
+    else if( img.channels() == 4 )
+        cvtColor( img, gray, COLOR_BGRA2GRAY );
+    else
+        gray = img;
+}
+
+// joins the collinear fragments (ls_merge) and keeps the max_lines best segments (0 for all of them),
+// by response or spread over the grid (ls_bucketing)
+static void pruneLineSegments( const Mat &img, vector<KeyLine> &lines, int max_lines )
+{
+    if( Config::lsMerge() )
+        mergeCollinearLines( img, Config::lsMergeAngle(), Config::lsMergeDist(), Config::lsMergeGap(), lines );
+    if( lines.size()>max_lines && max_lines!=0  )
+    {
+        if( Config::lsBucketing() )
+            selectLinesBucketed( lines, max_lines, img.size(), Config::featGridCols(), Config::featGridRows() );
+        else
+        {
+            // sort lines by their response
+            sort( lines.begin(), lines.end(), sort_lines_by_response() );
+            lines.resize(max_lines);
+            // reassign index
+            for( int i = 0; i < max_lines; i++  )
+                lines[i].class_id = i;
+        }
+    }
+}
+
+// the VO and the map share the line model, Plücker lines need the Plücker coordinates
+static bool plukerObservations()
+{
+    return Config::plukerLines();
+}
+
 /* Constructor and main method */
 
-StereoFrame::StereoFrame(){}
+StereoFrame::StereoFrame() : arena(std::make_shared<FrameFeatureArena>()), klt_tracked(false), budget(NULL), n_pt_detected(0) {}
 
 StereoFrame::StereoFrame(const Mat img_l_, const Mat img_r_ , const int idx_, PinholeStereoCamera *cam_, const long double t_) :
-    img_l(img_l_), img_r(img_r_), frame_idx(idx_), cam(cam_) {
+    img_l(img_l_), img_r(img_r_), frame_idx(idx_), cam(cam_), arena(std::make_shared<FrameFeatureArena>()), klt_tracked(false), budget(NULL), n_pt_detected(0) {
 
     if (img_l_.size != img_r_.size)
         throw std::runtime_error("[StereoFrame] Left and right images have different sizes");
@@ -49,23 +94,21 @@ StereoFrame::StereoFrame(const Mat img_l_, const Mat img_r_ , const int idx_, Pi
     t = t_;
 }
 
-StereoFrame::~StereoFrame()
-{
-    for( auto pt: stereo_pt )
-        delete pt;
-    for( auto ls: stereo_ls )
-        delete ls;
-}
+StereoFrame::~StereoFrame(){}
 
 void StereoFrame::extractStereoFeatures( double llength_th, int fast_th )
 {
 
+    // the color conversion is done once per image, not by each detector and descriptor
+    toGray( img_l, gray_l );
+    toGray( img_r, gray_r );
+
     if( Config::plInParallel() )
     {
-        auto detect_p = async(launch::async, &StereoFrame::detectStereoPoints,        this, fast_th );
-        auto detect_l = async(launch::async, &StereoFrame::detectStereoLineSegments,  this, llength_th );
-        detect_p.wait();
-        detect_l.wait();
+        auto detect_p = ThreadPool::global().submit(&StereoFrame::detectStereoPoints,        this, fast_th );
+        auto detect_l = ThreadPool::global().submit(&StereoFrame::detectStereoLineSegments,  this, llength_th );
+        ThreadPool::global().wait(detect_p);
+        ThreadPool::global().wait(detect_l);
     }
     else
     {
@@ -73,12 +116,226 @@ void StereoFrame::extractStereoFeatures( double llength_th, int fast_th )
         detectStereoLineSegments(llength_th);
     }
 
+    // the left image is kept for the optical flow tracking of the next frame
+    if( !Config::kltTracking() )
+        gray_l.release();
+    gray_r.release();
+
+    updateFeatureArrays();
+}
+
+void StereoFrame::extractStereoFeatures( double llength_th, FeatureBudget &budget_ )
+{
+    Timer timer;
+    timer.start();
+    budget        = &budget_;
+    n_pt_detected = 0;
+    extractStereoFeatures( llength_th, budget_.fastTh() );
+    budget        = NULL;
+    budget_.update( n_pt_detected, timer.stop() );
+}
+
+bool StereoFrame::trackStereoFeatures( const StereoFrame* prev, const Matrix4d &DT_pred, int min_tracks )
+{
+    PROFILE_SCOPE("StereoFrame::trackStereoFeatures");
+
+    toGray( img_l, gray_l );
+
+    // points and line endpoints of prev, their projection with DT_pred is the initial flow
+    const int n_pt = prev->stereo_pt.size();
+    const int n_ls = prev->stereo_ls.size();
+    vector<Point2f> pts_prev, pts_curr;
+    pts_prev.reserve( n_pt + 2*n_ls );
+    pts_curr.reserve( n_pt + 2*n_ls );
+    const Matrix3d R = DT_pred.block<3,3>(0,0);
+    const Vector3d t = DT_pred.col(3).head(3);
+    auto addTrack = [&]( const Vector2d &pl, const Vector3d &P ) {
+        pts_prev.push_back( Point2f( pl(0), pl(1) ) );
+        Vector3d P_ = R * P + t;
+        if( P_(2) > 0.0 )
+        {
+            Vector2d pl_ = cam->projection( P_ );
+            pts_curr.push_back( Point2f( pl_(0), pl_(1) ) );
+        }
+        else
+            pts_curr.push_back( pts_prev.back() );
+    };
+    for( const PointFeature* pt : prev->stereo_pt )
+        addTrack( pt->pl, pt->P );
+    for( const LineFeature* ls : prev->stereo_ls )
+    {
+        addTrack( ls->spl, ls->sP );
+        addTrack( ls->epl, ls->eP );
+    }
+    if( pts_prev.empty() || prev->gray_l.empty() )
+        return false;
+
+    vector<uchar> status;
+    vector<float> err;
+    const int ws = Config::kltWinSize();
+    calcOpticalFlowPyrLK( prev->gray_l, gray_l, pts_prev, pts_curr, status, err, Size(ws,ws), Config::kltLevels(),
+                          TermCriteria( TermCriteria::COUNT + TermCriteria::EPS, 30, 0.01 ), OPTFLOW_USE_INITIAL_FLOW );
+    auto tracked = [&]( int i ) {
+        return status[i] && pts_curr[i].x >= 0.f && pts_curr[i].y >= 0.f && pts_curr[i].x < img_l.cols && pts_curr[i].y < img_l.rows;
+    };
+
+    int n_tracks = 0;
+    for( int i = 0; i < n_pt; i++ )
+        n_tracks += tracked(i);
+    for( int i = 0; i < n_ls; i++ )
+        n_tracks += tracked(n_pt+2*i) && tracked(n_pt+2*i+1);
+    if( n_tracks < min_tracks )
+        return false;
+
+    // tracked features keep the descriptors, level and depth of their source features
+    for( int i = 0; i < n_pt; i++ )
+    {
+        if( !tracked(i) ) continue;
+        const PointFeature* pt = prev->stereo_pt[i];
+        stereo_pt.push_back( arena->points.create( Vector2d(pts_curr[i].x,pts_curr[i].y), pt->disp, pt->P, -1, pt->level ) );
+        pdesc_l.push_back( prev->pdesc_l.row(i) );
+        pt_src.push_back( i );
+    }
+    for( int i = 0; i < n_ls; i++ )
+    {
+        const int is = n_pt + 2*i, ie = is + 1;
+        if( !tracked(is) || !tracked(ie) ) continue;
+        const LineFeature* ls = prev->stereo_ls[i];
+        Vector3d sp_l; sp_l << pts_curr[is].x, pts_curr[is].y, 1.0;
+        Vector3d ep_l; ep_l << pts_curr[ie].x, pts_curr[ie].y, 1.0;
+        Vector3d le_l; le_l << sp_l.cross(ep_l); le_l = le_l / std::sqrt( le_l(0)*le_l(0) + le_l(1)*le_l(1) );
+        double angle_l = std::atan2( ep_l(1)-sp_l(1), ep_l(0)-sp_l(0) );
+        stereo_ls.push_back( arena->lines.create( sp_l.head(2), ls->sdisp, ls->sP, ep_l.head(2), ls->edisp, ls->eP,
+                                                  le_l, angle_l, -1, ls->level, ls->NDc ) );
+        ldesc_l.push_back( prev->ldesc_l.row(i) );
+        ls_src.push_back( i );
+    }
+    klt_tracked = true;
+
+    updateTrackedFeatures( prev, DT_pred );
+    return true;
+}
+
+void StereoFrame::updateTrackedFeatures( const StereoFrame* prev, const Matrix4d &DT,
+                                         const vector<bool> &pt_inlier, const vector<bool> &ls_inlier )
+{
+    // drop the outliers, with their descriptors
+    if( pt_inlier.size() == stereo_pt.size() )
+    {
+        Mat pdesc_aux;
+        size_t n = 0;
+        for( size_t i = 0; i < stereo_pt.size(); i++ )
+        {
+            if( !pt_inlier[i] ) continue;
+            stereo_pt[n] = stereo_pt[i];
+            pt_src[n++]  = pt_src[i];
+            pdesc_aux.push_back( pdesc_l.row(i) );
+        }
+        stereo_pt.resize(n);
+        pt_src.resize(n);
+        pdesc_l = pdesc_aux;
+    }
+    if( ls_inlier.size() == stereo_ls.size() )
+    {
+        Mat ldesc_aux;
+        size_t n = 0;
+        for( size_t i = 0; i < stereo_ls.size(); i++ )
+        {
+            if( !ls_inlier[i] ) continue;
+            stereo_ls[n] = stereo_ls[i];
+            ls_src[n++]  = ls_src[i];
+            ldesc_aux.push_back( ldesc_l.row(i) );
+        }
+        stereo_ls.resize(n);
+        ls_src.resize(n);
+        ldesc_l = ldesc_aux;
+    }
+
+    // depth of the source features moved by DT, along the bearing of the tracked positions
+    const Matrix3d R  = DT.block<3,3>(0,0);
+    const Vector3d t  = DT.col(3).head(3);
+    const double   fb = cam->getFx() * cam->getB();
+    for( size_t i = 0; i < stereo_pt.size(); i++ )
+    {
+        PointFeature* pt = stereo_pt[i];
+        const double z = ( R * prev->stereo_pt[pt_src[i]]->P + t )(2);
+        if( z <= 0.0 ) continue;
+        pt->disp = fb / z;
+        pt->P    = cam->backProjection( pt->pl(0), pt->pl(1), pt->disp );
+    }
+    for( size_t i = 0; i < stereo_ls.size(); i++ )
+    {
+        LineFeature* ls = stereo_ls[i];
+        const LineFeature* ls_prev = prev->stereo_ls[ls_src[i]];
+        const double zs = ( R * ls_prev->sP + t )(2);
+        const double ze = ( R * ls_prev->eP + t )(2);
+        if( zs <= 0.0 || ze <= 0.0 ) continue;
+        ls->sdisp = fb / zs;
+        ls->edisp = fb / ze;
+        ls->sP    = cam->backProjection( ls->spl(0), ls->spl(1), ls->sdisp );
+        ls->eP    = cam->backProjection( ls->epl(0), ls->epl(1), ls->edisp );
+        if( plukerObservations() )
+        {
+            Vector3d sp_l; sp_l << ls->spl, 1.0;
+            Vector3d ep_l; ep_l << ls->epl, 1.0;
+            Vector3d sp_r; sp_r << ls->spl(0) - ls->sdisp, ls->spl(1), 1.0;
+            Vector3d ep_r; ep_r << ls->epl(0) - ls->edisp, ls->epl(1), 1.0;
+            ls->NDc = stereoPluker( sp_l, ep_l, sp_r, ep_r );
+        }
+    }
+
+    updateFeatureArrays();
+}
+
+void StereoFrame::updateFeatureArrays()
+{
+    pt_arrays.assign( stereo_pt );
+    ls_arrays.assign( stereo_ls );
+}
+
+void StereoFrame::copyFeatures( const StereoFrame* sf )
+{
+    arena = std::make_shared<FrameFeatureArena>();
+    stereo_pt.assign( sf->stereo_pt.size(), NULL );
+    for( size_t i = 0; i < sf->stereo_pt.size(); i++ )
+    {
+        if( sf->stereo_pt[i] == NULL )
+            continue;
+        stereo_pt[i] = arena->points.create( *sf->stereo_pt[i] );
+        stereo_pt[i]->covariance( sf->cam );
+    }
+    stereo_ls.assign( sf->stereo_ls.size(), NULL );
+    for( size_t i = 0; i < sf->stereo_ls.size(); i++ )
+    {
+        if( sf->stereo_ls[i] == NULL )
+            continue;
+        stereo_ls[i] = arena->lines.create( *sf->stereo_ls[i] );
+        stereo_ls[i]->startCovariance( sf->cam );
+    }
+    pt_arrays = sf->pt_arrays;
+    ls_arrays = sf->ls_arrays;
+}
+
+FrameMemory StereoFrame::memoryUsage() const
+{
+    FrameMemory mem;
+    mem.images = matBytes(img_l) + matBytes(img_r) + matBytes(gray_l) + matBytes(gray_r);
+    if( arena )
+        mem.features = arena->points.capacity() * sizeof(PointFeature) + arena->lines.capacity() * sizeof(LineFeature);
+    mem.features += vectorBytes(stereo_pt) + vectorBytes(stereo_ls)
+                  + ( pt_arrays.pl.size() + pt_arrays.disp.size() + pt_arrays.P.size() ) * sizeof(double)
+                  + ( ls_arrays.spl.size() + ls_arrays.epl.size() + ls_arrays.sdisp.size() + ls_arrays.edisp.size()
+                    + ls_arrays.sP.size() + ls_arrays.eP.size() ) * sizeof(double)
+                  + vectorBytes(points_l) + vectorBytes(points_r) + vectorBytes(lines_l) + vectorBytes(lines_r)
+                  + matBytes(pdesc_l) + matBytes(pdesc_r) + matBytes(ldesc_l) + matBytes(ldesc_r);
+    return mem;
 }
 
 /* Stereo point features extraction */
 
 void StereoFrame::detectStereoPoints( int fast_th )
 {
+    PROFILE_SCOPE("StereoFrame::detectStereoPoints");
 
     if( !Config::hasPoints() )
         return;
@@ -86,15 +343,15 @@ void StereoFrame::detectStereoPoints( int fast_th )
     // detect and estimate each descriptor for both the left and right image
     if( Config::lrInParallel() )
     {
-        auto detect_l = async(launch::async, &StereoFrame::detectPointFeatures, this, img_l, ref(points_l), ref(pdesc_l), fast_th );
-        auto detect_r = async(launch::async, &StereoFrame::detectPointFeatures, this, img_r, ref(points_r), ref(pdesc_r), fast_th );
-        detect_l.wait();
-        detect_r.wait();
+        auto detect_l = ThreadPool::global().submit(&StereoFrame::detectPointFeatures, this, gray_l, ref(points_l), ref(pdesc_l), fast_th, &n_pt_detected );
+        auto detect_r = ThreadPool::global().submit(&StereoFrame::detectPointFeatures, this, gray_r, ref(points_r), ref(pdesc_r), fast_th, (int*)NULL );
+        ThreadPool::global().wait(detect_l);
+        ThreadPool::global().wait(detect_r);
     }
     else
     {
-        detectPointFeatures( img_l, points_l, pdesc_l, fast_th );
-        detectPointFeatures( img_r, points_r, pdesc_r, fast_th );
+        detectPointFeatures( gray_l, points_l, pdesc_l, fast_th, &n_pt_detected );
+        detectPointFeatures( gray_r, points_r, pdesc_r, fast_th );
     }
 
     // perform the stereo matching
@@ -102,7 +359,7 @@ void StereoFrame::detectStereoPoints( int fast_th )
 
 }
 
-void StereoFrame::detectPointFeatures( Mat img, vector<KeyPoint> &points, Mat &pdesc, int fast_th )
+void StereoFrame::detectPointFeatures( Mat img, vector<KeyPoint> &points, Mat &pdesc, int fast_th, int *n_detected )
 {
     // Detect point features
     if( Config::hasPoints() )
@@ -110,16 +367,39 @@ void StereoFrame::detectPointFeatures( Mat img, vector<KeyPoint> &points, Mat &p
         int fast_th_ = Config::orbFastTh();
         if( fast_th != 0 )
             fast_th_ = fast_th;
-        Ptr<ORB> orb = ORB::create( Config::orbNFeatures(), Config::orbScaleFactor(), Config::orbNLevels(),
-                                    Config::orbEdgeTh(), 0, Config::orbWtaK(), Config::orbScore(),
-                                    Config::orbPatchSize(), fast_th_ );
+        FeatureEngine &engine = FeatureEngine::local();
+        if( engine.detectORBOnGPU( img, fast_th_, points, pdesc ) )
+        {
+            // already described, the budget only drops the extra ones
+            if( n_detected != NULL )
+                *n_detected = points.size();
+            if( budget != NULL )
+                budget->selectPoints( points, img.size(), &pdesc );
+            return;
+        }
+        // the detector of this thread, created once and reused across frames
+        Ptr<ORB> orb = engine.orb( fast_th_ );
+        if( budget != NULL )
+        {
+            // oversampled candidates spread over the grid, only the kept ones are described
+            orb->setMaxFeatures( budget->pointCandidates() );
+            orb->detect( img, points );
+            if( n_detected != NULL )
+                *n_detected = points.size();
+            budget->selectPoints( points, img.size() );
+            orb->compute( img, points, pdesc );
+            return;
+        }
         orb->detectAndCompute( img, Mat(), points, pdesc, false);
+        if( n_detected != NULL )
+            *n_detected = points.size();
     }
 
 }
 
 void StereoFrame::matchStereoPoints( vector<KeyPoint> points_l, vector<KeyPoint> points_r, Mat &pdesc_l_, Mat pdesc_r, bool initial )
 {
+    PROFILE_SCOPE("StereoFrame::matchStereoPoints");
 
     // Points stereo matching
     // --------------------------------------------------------------------------------------------------------------------
@@ -127,24 +407,28 @@ void StereoFrame::matchStereoPoints( vector<KeyPoint> points_l, vector<KeyPoint>
     if (!Config::hasPoints() || points_l.empty() || points_r.empty())
         return;
 
-    std::vector<point_2d> coords;
+    std::vector<std::pair<double, double>> coords;
     coords.reserve(points_l.size());
     for (const KeyPoint &kp : points_l)
-        coords.push_back(std::make_pair(kp.pt.x * inv_width, kp.pt.y * inv_height));
+        coords.push_back(std::make_pair(kp.pt.x, kp.pt.y));
 
-    //Fill in grid
-    GridStructure grid(GRID_ROWS, GRID_COLS);
+    //Fill in epipolar bands, the rectified matches lie on the same rows
+    const double max_dy = Config::maxDistEpip();
+    static thread_local EpipolarBandIndex index(std::max(1.0, 2.0 * max_dy)); // storage reused across frames
+    index.clear();
     for (int idx = 0; idx < points_r.size(); ++idx) {
         const KeyPoint &kp = points_r[idx];
-        grid.at(kp.pt.x * inv_width, kp.pt.y * inv_height).push_back(idx);
+        index.add(kp.pt.x, kp.pt.y, idx);
     }
+    index.build();
 
-    GridWindow w;
-    w.width = std::make_pair(Config::matchingSWs(), 0);
-    w.height = std::make_pair(0, 0);
+    // disparity range, up to the old search window or the min. depth
+    double max_disp = (Config::matchingSWs() + 1) / inv_width;
+    if (Config::stereoMinDepth() > 0.0)
+        max_disp = std::min(max_disp, cam->getFx() * cam->getB() / Config::stereoMinDepth());
 
     std::vector<int> matches_12;
-    matchGrid(coords, pdesc_l, grid, pdesc_r, w, matches_12);
+    matchEpipolar(coords, pdesc_l, index, pdesc_r, max_dy, Config::minDisp(), max_disp, matches_12);
 //    match(pdesc_l, pdesc_r, Config::minRatio12P(), matches_12);
 
     // bucle around pmatches
@@ -163,9 +447,9 @@ void StereoFrame::matchStereoPoints( vector<KeyPoint> points_l, vector<KeyPoint>
                 Vector2d pl_(points_l[i1].pt.x, points_l[i1].pt.y);
                 Vector3d P_ = cam->backProjection(pl_(0), pl_(1), disp_);
                 if (initial)
-                    stereo_pt.push_back(new PointFeature(pl_, disp_, P_, pt_idx++, points_l[i1].octave));
+                    stereo_pt.push_back(arena->points.create(pl_, disp_, P_, pt_idx++, points_l[i1].octave));
                 else
-                    stereo_pt.push_back(new PointFeature(pl_, disp_, P_, -1, points_l[i1].octave));
+                    stereo_pt.push_back(arena->points.create(pl_, disp_, P_, -1, points_l[i1].octave));
             }
         }
     }
@@ -182,6 +466,7 @@ void StereoFrame::matchPointFeatures(BFMatcher* bfm, Mat pdesc_1, Mat pdesc_2, v
 
 void StereoFrame::detectStereoLineSegments(double llength_th)
 {
+    PROFILE_SCOPE("StereoFrame::detectStereoLineSegments");
 
     if( !Config::hasLines() )
         return;
@@ -189,15 +474,15 @@ void StereoFrame::detectStereoLineSegments(double llength_th)
     // detect and estimate each descriptor for both the left and right image
     if( Config::lrInParallel() )
     {
-        auto detect_l = async(launch::async, &StereoFrame::detectLineFeatures, this, img_l, ref(lines_l), ref(ldesc_l), llength_th );
-        auto detect_r = async(launch::async, &StereoFrame::detectLineFeatures, this, img_r, ref(lines_r), ref(ldesc_r), llength_th );
-        detect_l.wait();
-        detect_r.wait();
+        auto detect_l = ThreadPool::global().submit(&StereoFrame::detectLineFeatures, this, gray_l, ref(lines_l), ref(ldesc_l), llength_th );
+        auto detect_r = ThreadPool::global().submit(&StereoFrame::detectLineFeatures, this, gray_r, ref(lines_r), ref(ldesc_r), llength_th );
+        ThreadPool::global().wait(detect_l);
+        ThreadPool::global().wait(detect_r);
     }
     else
     {
-        detectLineFeatures( img_l, lines_l, ldesc_l, llength_th );
-        detectLineFeatures( img_r, lines_r, ldesc_r, llength_th );
+        detectLineFeatures( gray_l, lines_l, ldesc_l, llength_th );
+        detectLineFeatures( gray_r, lines_r, ldesc_r, llength_th );
     }
 
     // perform the stereo matching
@@ -210,13 +495,15 @@ void StereoFrame::detectLineFeatures( Mat img, vector<KeyLine> &lines, Mat &ldes
 
     // Detect line features
     lines.clear();
-    Ptr<BinaryDescriptor>   lbd = BinaryDescriptor::createBinaryDescriptor();
+    // the detectors of this thread, created once and reused across frames
+    FeatureEngine &engine = FeatureEngine::local();
+    Ptr<BinaryDescriptor>   lbd = engine.lbd();
+    const int max_lines = ( budget != NULL ) ? budget->maxLines() : Config::lsdNFeatures();
     if( Config::hasLines() )
     {
 
         if( !Config::useFLDLines() )
         {
-            Ptr<line_descriptor::LSDDetectorC> lsd = line_descriptor::LSDDetectorC::createLSDDetectorC();
             // lsd parameters
             line_descriptor::LSDDetectorC::LSDOptions opts;
             opts.refine       = Config::lsdRefine();
@@ -228,23 +515,17 @@ void StereoFrame::detectLineFeatures( Mat img, vector<KeyLine> &lines, Mat &ldes
             opts.density_th   = Config::lsdDensityTh();
             opts.n_bins       = Config::lsdNBins();
             opts.min_length   = min_line_length;
-            lsd->detect( img, lines, Config::lsdScale(), 1, opts);
+            if( Config::lsdTiles() > 1 )
+                detectLinesTiled( img, opts, Config::lsdTiles(), lines );
+            else
+                engine.lsd()->detect( img, lines, Config::lsdScale(), 1, opts);
             // filter lines
-            if( lines.size()>Config::lsdNFeatures() && Config::lsdNFeatures()!=0  )
-            {
-                // sort lines by their response
-                sort( lines.begin(), lines.end(), sort_lines_by_response() );
-                //sort( lines.begin(), lines.end(), sort_lines_by_length() );
-                lines.resize(Config::lsdNFeatures());
-                // reassign index
-                for( int i = 0; i < Config::lsdNFeatures(); i++  )
-                    lines[i].class_id = i;
-            }
+            pruneLineSegments( img, lines, max_lines );
             lbd->compute( img, lines, ldesc);
         }
         else
         {
-            Mat fld_img, img_gray;
+            Mat &fld_img = engine.fld_img, &img_gray = engine.img_gray;
             vector<Vec4f> fld_lines;
 
             if( img.channels() != 1 )
@@ -255,15 +536,16 @@ void StereoFrame::detectLineFeatures( Mat img, vector<KeyLine> &lines, Mat &ldes
             else
                 img.convertTo( fld_img, CV_8UC1 );
 
-            Ptr<cv::ximgproc::FastLineDetector> fld = cv::ximgproc::createFastLineDetector(min_line_length);
+            Ptr<cv::ximgproc::FastLineDetector> fld = engine.fld(min_line_length);
             fld->detect( fld_img, fld_lines );
 
-            // filter lines
-            if( fld_lines.size()>Config::lsdNFeatures() && Config::lsdNFeatures()!=0  )
+            // filter lines (after the merging, which needs them all)
+            const bool prune_keylines = Config::lsMerge() || Config::lsBucketing();
+            if( !prune_keylines && fld_lines.size()>max_lines && max_lines!=0  )
             {
                 // sort lines by their response
                 sort( fld_lines.begin(), fld_lines.end(), sort_flines_by_length() );
-                fld_lines.resize(Config::lsdNFeatures());
+                fld_lines.resize(max_lines);
             }
 
             // loop over lines object transforming into a vector<KeyLine>
@@ -300,6 +582,9 @@ void StereoFrame::detectLineFeatures( Mat img, vector<KeyLine> &lines, Mat &ldes
 
             }
 
+            if( prune_keylines )
+                pruneLineSegments( fld_img, lines, max_lines );
+
             // compute lbd descriptor
             lbd->compute( fld_img, lines, ldesc);
         }
@@ -309,6 +594,7 @@ void StereoFrame::detectLineFeatures( Mat img, vector<KeyLine> &lines, Mat &ldes
 
 void StereoFrame::matchStereoLines( vector<KeyLine> lines_l, vector<KeyLine> lines_r, Mat &ldesc_l_, Mat ldesc_r, bool initial )
 {
+    PROFILE_SCOPE("StereoFrame::matchStereoLines");
 
     // Line segments stereo matching
     // --------------------------------------------------------------------------------------------------------------------
@@ -322,9 +608,9 @@ void StereoFrame::matchStereoLines( vector<KeyLine> lines_l, vector<KeyLine> lin
         coords.push_back(std::make_pair(std::make_pair(kl.startPointX * inv_width, kl.startPointY * inv_height),
                                         std::make_pair(kl.endPointX * inv_width, kl.endPointY * inv_height)));
 
-    //Fill in grid & directions
-    list<pair<int, int>> line_coords;
-    GridStructure grid(GRID_ROWS, GRID_COLS);
+    //Fill in row index & directions
+    static thread_local LineRowIndex grid(GRID_ROWS, GRID_COLS); // storage reused across frames
+    grid.clear();
     std::vector<std::pair<double, double>> directions(lines_r.size());
     for (int idx = 0; idx < lines_r.size(); ++idx) {
         const KeyLine &kl = lines_r[idx];
@@ -333,10 +619,9 @@ void StereoFrame::matchStereoLines( vector<KeyLine> lines_l, vector<KeyLine> lin
         v = std::make_pair((kl.endPointX - kl.startPointX) * inv_width, (kl.endPointY - kl.startPointY) * inv_height);
         normalize(v);
 
-        getLineCoords(kl.startPointX * inv_width, kl.startPointY * inv_height, kl.endPointX * inv_width, kl.endPointY * inv_height, line_coords);
-        for (const std::pair<int, int> &p : line_coords)
-            grid.at(p.first, p.second).push_back(idx);
+        grid.add(kl.startPointX * inv_width, kl.startPointY * inv_height, kl.endPointX * inv_width, kl.endPointY * inv_height, idx);
     }
+    grid.build();
 
     GridWindow w;
     w.width = std::make_pair(Config::matchingSWs(), 0);
@@ -378,27 +663,14 @@ void StereoFrame::matchStereoLines( vector<KeyLine> lines_l, vector<KeyLine> lin
             Vector3d eP_; eP_ = cam->backProjection( ep_l(0), ep_l(1), disp_e);
             double angle_l = lines_l[i1].angle;
 
-#ifdef USE_LINE_PLUKER
-            double depth;  //useless,just to fix the function
-            Vector3d obs1s = cam->backProjection_unit(sp_l(0), sp_l(1), 1, depth);  //归一化坐标
-            Vector3d obs1e = cam->backProjection_unit(ep_l(0), ep_l(1), 1, depth);
-
-            Vector3d obs2s = cam->backProjection_unit(sp_r(0), sp_r(1), 1, depth);
-            Vector3d obs2e = cam->backProjection_unit(ep_r(0), ep_r(1), 1, depth);
-            obs2s << obs2s[0] + cam->getB(), obs2s[1], obs2s[2];
-            obs2e << obs2e[0] + cam->getB(), obs2e[1], obs2e[2];
-
-            Vector3d o1(0,0,0);
-            Vector3d o2(cam->getB(), 0, 0);
-
-            Vector4d pi1 = pi_from_ppp(obs1s, obs1e, o1);
-            Vector4d pi2 = pi_from_ppp(obs2s, obs2e, o2);
-
-            Vector6d line_pluker = pipi_plk(pi1, pi2);
+            // Plücker coordinates, for the Plücker pose of the front end and the Plücker map lines
+            Vector6d line_pluker = Vector6d::Zero();
+            if( plukerObservations() )
+                line_pluker = stereoPluker( sp_l, ep_l, sp_r, ep_r );
             if( initial )
             {
                 ldesc_l_aux.push_back( ldesc_l_.row(i1) );
-                stereo_ls.push_back( new LineFeature(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,
+                stereo_ls.push_back( arena->lines.create(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,
                                                      Vector2d(ep_l(0),ep_l(1)),disp_e,eP_,
                                                      le_l,angle_l,ls_idx,lines_l[i1].octave, line_pluker) );
                 ls_idx++;
@@ -406,34 +678,36 @@ void StereoFrame::matchStereoLines( vector<KeyLine> lines_l, vector<KeyLine> lin
             else
             {
                 ldesc_l_aux.push_back( ldesc_l_.row(i1) );
-                stereo_ls.push_back( new LineFeature(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,
+                stereo_ls.push_back( arena->lines.create(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,
                                                      Vector2d(ep_l(0),ep_l(1)),disp_e,eP_,
                                                      le_l,angle_l,-1,lines_l[i1].octave, line_pluker) );
-                //std::cout<<"Line d: "<<line_pluker.head(3).norm() / line_pluker.tail(3).norm();
-            }
-#else
-            if( initial )
-            {
-                ldesc_l_aux.push_back( ldesc_l_.row(i1) );
-                stereo_ls.push_back( new LineFeature(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,
-                                                     Vector2d(ep_l(0),ep_l(1)),disp_e,eP_,
-                                                     le_l,angle_l,ls_idx,lines_l[i1].octave) );
-                ls_idx++;
             }
-            else
-            {
-                ldesc_l_aux.push_back( ldesc_l_.row(i1) );
-                stereo_ls.push_back( new LineFeature(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,
-                                                     Vector2d(ep_l(0),ep_l(1)),disp_e,eP_,
-                                                     le_l,angle_l,-1,lines_l[i1].octave) );
-            }
-#endif
         }
     }
 
     ldesc_l_aux.copyTo(ldesc_l_);
 }
 
+Vector6d StereoFrame::stereoPluker( const Vector3d &sp_l, const Vector3d &ep_l, const Vector3d &sp_r, const Vector3d &ep_r )
+{
+    double depth;  //useless,just to fix the function
+    Vector3d obs1s = cam->backProjection_unit(sp_l(0), sp_l(1), 1, depth);  //归一化坐标
+    Vector3d obs1e = cam->backProjection_unit(ep_l(0), ep_l(1), 1, depth);
+
+    Vector3d obs2s = cam->backProjection_unit(sp_r(0), sp_r(1), 1, depth);
+    Vector3d obs2e = cam->backProjection_unit(ep_r(0), ep_r(1), 1, depth);
+    obs2s << obs2s[0] + cam->getB(), obs2s[1], obs2s[2];
+    obs2e << obs2e[0] + cam->getB(), obs2e[1], obs2e[2];
+
+    Vector3d o1(0,0,0);
+    Vector3d o2(cam->getB(), 0, 0);
+
+    Vector4d pi1 = pi_from_ppp(obs1s, obs1e, o1);
+    Vector4d pi2 = pi_from_ppp(obs2s, obs2e, o2);
+
+    return pipi_plk(pi1, pi2);
+}
+
 void StereoFrame::matchLineFeatures(BFMatcher* bfm, Mat ldesc_1, Mat ldesc_2, vector<vector<DMatch>> &lmatches_12  )
 {
     bfm->knnMatch( ldesc_1, ldesc_2, lmatches_12, 2);
@@ -713,10 +987,10 @@ void StereoFrame::extractRGBDFeatures( double llength_th, int fast_th )
     {
         if( Config::plInParallel() )
         {
-            auto detect_p = async(launch::async, &StereoFrame::detectPointFeatures, this, img_l, ref(points_l), ref(pdesc_l), fast_th );
-            auto detect_l = async(launch::async, &StereoFrame::detectLineFeatures,  this, img_l, ref(lines_l), ref(ldesc_l), llength_th );
-            detect_p.wait();
-            detect_l.wait();
+            auto detect_p = ThreadPool::global().submit(&StereoFrame::detectPointFeatures, this, img_l, ref(points_l), ref(pdesc_l), fast_th, (int*)NULL );
+            auto detect_l = ThreadPool::global().submit(&StereoFrame::detectLineFeatures,  this, img_l, ref(lines_l), ref(ldesc_l), llength_th );
+            ThreadPool::global().wait(detect_p);
+            ThreadPool::global().wait(detect_l);
         }
         else
         {
@@ -754,7 +1028,7 @@ void StereoFrame::extractRGBDFeatures( double llength_th, int fast_th )
                         pdesc_l_.push_back( pdesc_l.row(i) );
                         Vector2d pl_; pl_ << points_l[i].pt.x, points_l[i].pt.y;
                         Vector3d P_;  P_ = cam->backProjection( pl_(0), pl_(1), disp);
-                        stereo_pt.push_back( new PointFeature(pl_,disp,P_,-1) );
+                        stereo_pt.push_back( arena->points.create(pl_,disp,P_,-1) );
                         pt_idx++;
                     }
                 }
@@ -774,7 +1048,7 @@ void StereoFrame::extractRGBDFeatures( double llength_th, int fast_th )
                         pdesc_l_.push_back( pdesc_l.row(i) );
                         Vector2d pl_; pl_ << points_l[i].pt.x, points_l[i].pt.y;
                         Vector3d P_;  P_ = cam->backProjection( pl_(0), pl_(1), disp);
-                        stereo_pt.push_back( new PointFeature(pl_,disp,P_,-1) );
+                        stereo_pt.push_back( arena->points.create(pl_,disp,P_,-1) );
                         pt_idx++;
                     }
                 }
@@ -813,7 +1087,7 @@ void StereoFrame::extractRGBDFeatures( double llength_th, int fast_th )
                         Vector3d sP_; sP_ = cam->backProjection( sp_l(0), sp_l(1), disp_s);
                         Vector3d eP_; eP_ = cam->backProjection( ep_l(0), ep_l(1), disp_e);
                         double angle_l = lines_l[i].angle;
-                        stereo_ls.push_back( new LineFeature(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,Vector2d(ep_l(0),ep_l(1)),disp_e,eP_,le_l,angle_l,-1) );
+                        stereo_ls.push_back( arena->lines.create(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,Vector2d(ep_l(0),ep_l(1)),disp_e,eP_,le_l,angle_l,-1) );
                         ls_idx++;
                     }
                 }
@@ -842,7 +1116,7 @@ void StereoFrame::extractRGBDFeatures( double llength_th, int fast_th )
                         Vector3d sP_; sP_ = cam->backProjection( sp_l(0), sp_l(1), disp_s);
                         Vector3d eP_; eP_ = cam->backProjection( ep_l(0), ep_l(1), disp_e);
                         double angle_l = lines_l[i].angle;
-                        stereo_ls.push_back( new LineFeature(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,Vector2d(ep_l(0),ep_l(1)),disp_e,eP_,le_l,angle_l,-1) );
+                        stereo_ls.push_back( arena->lines.create(Vector2d(sp_l(0),sp_l(1)),disp_s,sP_,Vector2d(ep_l(0),ep_l(1)),disp_e,eP_,le_l,angle_l,-1) );
                         ls_idx++;
                     }
                 }
@@ -852,6 +1126,7 @@ void StereoFrame::extractRGBDFeatures( double llength_th, int fast_th )
         ldesc_l_.copyTo(ldesc_l);
     }
 
+    updateFeatureArrays();
 }
 
 void StereoFrame::filterLineSegmentDisparity( double &disp_s, double &disp_e )
@@ -867,18 +1142,22 @@ void StereoFrame::filterLineSegmentDisparity( double &disp_s, double &disp_e )
     }
 }
 
-Vector4d StereoFrame::pi_from_ppp(Vector3d x1, Vector3d x2, Vector3d x3) {
+Vector4d StereoFrame::pi_from_ppp(const Vector3d& x1, const Vector3d& x2, const Vector3d& x3) {
     Vector4d pi;
     pi << ( x1 - x3 ).cross( x2 - x3 ), - x3.dot( x1.cross( x2 ) ); // d = - x3.dot( (x1-x3).cross( x2-x3 ) ) = - x3.dot( x1.cross( x2 ) )
 
     return pi;
 }
 
-Vector6d StereoFrame::pipi_plk( Vector4d pi1, Vector4d pi2){
+Vector6d StereoFrame::pipi_plk(const Vector4d& pi1, const Vector4d& pi2){
+    // entries of the dual Plücker matrix dp = pi1 * pi2^T - pi2 * pi1^T
     Vector6d plk;
-    Matrix4d dp = pi1 * pi2.transpose() - pi2 * pi1.transpose();
-
-    plk << dp(0,3), dp(1,3), dp(2,3), - dp(1,2), dp(0,2), - dp(0,1);
+    plk << pi1(0) * pi2(3) - pi2(0) * pi1(3),
+           pi1(1) * pi2(3) - pi2(1) * pi1(3),
+           pi1(2) * pi2(3) - pi2(2) * pi1(3),
+           pi2(1) * pi1(2) - pi1(1) * pi2(2),
+           pi1(0) * pi2(2) - pi2(0) * pi1(2),
+           pi2(0) * pi1(1) - pi1(0) * pi2(1);
     return plk;
 }
 
@@ -22,11 +22,95 @@
 
 #include <stereoFrameHandler.h>
 
+#include "logger.h"
 #include "matching.h"
+#include "profiler.h"
+#include "threadPool.h"
 
 namespace StVO{
 
-StereoFrameHandler::StereoFrameHandler( PinholeStereoCamera *cam_ ) : cam(cam_) {}
+namespace {
+
+// grows the column storage of m to hold at least n columns
+template<int Rows>
+void reserveCols( Matrix<PoseScalar,Rows,Dynamic> &m, int n )
+{
+    if( m.cols() < n )
+        m.resize( Rows, std::max<int>( n, 2 * m.cols() ) );
+}
+
+// observations per partial product of the normal equations, summed in double
+const int accum_block = 256;
+
+// KFs kept in the chain that places an older local map snapshot
+const size_t kf_chain_size = 16;
+
+// H += J W J^T and g += J W r over the first n observations
+void accumulateNormalEquations( const Matrix<PoseScalar,6,Dynamic> &J, const Matrix<PoseScalar,1,Dynamic> &r,
+                                const Matrix<PoseScalar,1,Dynamic> &w, int n, Matrix<PoseScalar,6,Dynamic> &Jw,
+                                Matrix6d &H, Vector6d &g )
+{
+    if( n == 0 ) return;
+    Jw.leftCols(n) = J.leftCols(n) * w.head(n).asDiagonal();
+    for( int i0 = 0; i0 < n; i0 += accum_block )
+    {
+        const int m = std::min( accum_block, n - i0 );
+        H.noalias() += ( Jw.middleCols(i0,m) * J.middleCols(i0,m).transpose() ).cast<double>();
+        g.noalias() += ( Jw.middleCols(i0,m) * r.segment(i0,m).transpose() ).cast<double>();
+    }
+}
+
+// robust (MAD) scale of the first n residual norms
+double residualScale( const Matrix<PoseScalar,1,Dynamic> &r, int n, vector<double> &res )
+{
+    const double th_min = 0.0001;
+    const double th_max = sqrt(7.815);
+    res.assign( r.data(), r.data() + n );
+    double s = vector_stdv_mad( res );
+    if( s < th_min )
+        s = th_min;
+    if( s > th_max )
+        s = th_max;
+    return s;
+}
+
+// stop tests of the pose solvers: small absolute or relative error change, small increment
+bool smallErrorChange( double err, double err_prev )
+{
+    return fabs(err-err_prev) < std::max( Config::minErrorChange(), Config::minRelChange() * err_prev ) ||
+           err < Config::minError();
+}
+
+bool smallPoseStep( const Vector6d &DT_inc )
+{
+    return DT_inc.norm() < Config::minStepNorm();
+}
+
+// std. dev. (in pixels) of the projection of P under the pose uncertainty cov
+Vector2d projectionStdv( const PinholeStereoCamera *cam, const Vector3d &P, const Matrix6d &cov )
+{
+    const double iz = 1.0 / P(2);
+    Matrix<double,2,3> J_P;
+    J_P << cam->getFx() * iz, 0.0, -cam->getFx() * P(0) * iz * iz,
+           0.0, cam->getFy() * iz, -cam->getFy() * P(1) * iz * iz;
+    Matrix<double,2,6> J;
+    J.leftCols<3>()  = J_P;
+    J.rightCols<3>() = - J_P * skew( P );
+    const Matrix2d cov_uv = J * cov * J.transpose();
+    return Vector2d( sqrt( std::max(0.0, cov_uv(0,0)) ), sqrt( std::max(0.0, cov_uv(1,1)) ) );
+}
+
+// half size of a window covering k std. devs., at least one cell
+int windowCells( double stdv, double k, int max_ws )
+{
+    return std::min( max_ws, std::max( 1, int( std::ceil( k * stdv ) ) ) );
+}
+
+}
+
+StereoFrameHandler::StereoFrameHandler( PinholeStereoCamera *cam_ ) : cam(cam_), prev_f_shared(false), curr_f_shared(false),
+    pose_iters(0), kf_t_dist(0.0), kf_r_dist(0.0), kf_entropy_ratio(1.0), kf_count(0), T_prevKF_map(Matrix4d::Identity()),
+    n_inliers_map(0), n_extracted(0) {}
 
 StereoFrameHandler::~StereoFrameHandler(){}
 
@@ -38,8 +122,22 @@ void StereoFrameHandler::initialize(const Mat img_l_, const Mat img_r_ , const i
     orb_fast_th = Config::orbFastTh();
     llength_th  = Config::minLineLength() * std::min( cam->getWidth(), cam->getHeight() ) ;
     // define StereoFrame
-    prev_frame = new StereoFrame( img_l_, img_r_, idx_, cam , t_);
-    prev_frame->extractStereoFeatures( llength_th, orb_fast_th );
+    StereoFrame* frame = new StereoFrame( img_l_, img_r_, idx_, cam , t_);
+    feat_budget.reset();
+    if( Config::featBudget() )
+        frame->extractStereoFeatures( llength_th, feat_budget );
+    else
+        frame->extractStereoFeatures( llength_th, orb_fast_th );
+    initialize( frame );
+}
+
+void StereoFrameHandler::initialize( StereoFrame* frame )
+{
+    // variables for adaptative thresholds
+    orb_fast_th = Config::orbFastTh();
+    llength_th  = Config::minLineLength() * std::min( cam->getWidth(), cam->getHeight() ) ;
+    // the frame already contains its stereo features
+    prev_frame = frame;
     prev_frame->Tfw     = Matrix4d::Identity();
     prev_frame->Tfw_cov = Matrix6d::Identity();
     prev_frame->DT      = Matrix4d::Identity();
@@ -49,13 +147,98 @@ void StereoFrameHandler::initialize(const Mat img_l_, const Mat img_r_ , const i
     cov_prevKF_currF = Matrix6d::Zero();
     prev_f_iskf      = true;
     N_prevKF_currF   = 0;
+    kf_t_dist        = 0.0;
+    kf_r_dist        = 0.0;
+    kf_entropy_ratio = 1.0;
+    n_extracted      = frame->stereo_pt.size() + frame->stereo_ls.size();
+    // local map tracking
+    kf_count         = 0;
+    local_map.reset();
+    T_prevKF_map     = Matrix4d::Identity();
+    kf_chain.clear();
 }
 
 void StereoFrameHandler::insertStereoPair(const Mat img_l_, const Mat img_r_ , const int idx_, const long double t_)
 {
     //curr_frame.reset( new StereoFrame( img_l_, img_r_, idx_, cam ) );
-    curr_frame =  new StereoFrame( img_l_, img_r_, idx_, cam, t_ );
-    curr_frame->extractStereoFeatures( llength_th, orb_fast_th );
+    StereoFrame* frame = new StereoFrame( img_l_, img_r_, idx_, cam, t_ );
+    if( !trackStereoFrame( frame ) )
+    {
+        if( Config::featBudget() )
+            frame->extractStereoFeatures( llength_th, feat_budget );
+        else
+            frame->extractStereoFeatures( llength_th, orb_fast_th );
+        n_extracted = frame->stereo_pt.size() + frame->stereo_ls.size();
+    }
+    insertStereoFrame( frame );
+}
+
+bool StereoFrameHandler::trackStereoFrame( StereoFrame* frame )
+{
+    // optical flow tracking between KFs, the features are extracted again close to a new KF
+    if( !Config::kltTracking() || nearNewKF() )
+        return false;
+    Matrix4d DT_pred = Matrix4d::Identity();
+    if( isGoodSolution(prev_frame->DT,prev_frame->DT_cov,prev_frame->err_norm) )
+        DT_pred = inverse_se3( prev_frame->DT );
+    const int min_tracks = std::ceil( Config::kltMinTracks() * n_extracted );
+    if( !frame->trackStereoFeatures( prev_frame, DT_pred, std::max( min_tracks, Config::minFeatures() ) ) )
+        return false;
+    Profiler::instance().addCount( "StereoFrameHandler::kltFrames" );
+    return true;
+}
+
+bool StereoFrameHandler::nearNewKF() const
+{
+    // the KF criteria of the last needNewKF within the margin of their thresholds, or the frame count about to be exceeded
+    const double margin = Config::kltKFMargin();
+    return kf_t_dist > margin * Config::maxKFTDist() || kf_r_dist > margin * Config::maxKFRDist()
+        || !( 1.0 - kf_entropy_ratio <= margin * ( 1.0 - Config::minEntropyRatio() ) ) || N_prevKF_currF >= 10;
+}
+
+void StereoFrameHandler::updateTrackedFrame()
+{
+    // the f2f matches of a tracked frame follow the order of its features,
+    // without a pose (err_norm < 0) the depth predicted by the motion is kept
+    if( curr_frame->err_norm < 0.0 )
+        return;
+    vector<bool> pt_inlier, ls_inlier;
+    if( matched_pt.size() >= curr_frame->stereo_pt.size() )
+    {
+        auto it = matched_pt.begin();
+        for( size_t i = 0; i < curr_frame->stereo_pt.size(); i++, it++ )
+            pt_inlier.push_back( (*it)->inlier );
+    }
+    if( matched_ls.size() >= curr_frame->stereo_ls.size() )
+    {
+        auto it = matched_ls.begin();
+        for( size_t i = 0; i < curr_frame->stereo_ls.size(); i++, it++ )
+            ls_inlier.push_back( (*it)->inlier );
+    }
+    curr_frame->updateTrackedFeatures( prev_frame, inverse_se3( curr_frame->DT ), pt_inlier, ls_inlier );
+}
+
+void StereoFrameHandler::extractKFFeatures()
+{
+    // the tracked features only keep the descriptors and depth of the last extraction, the mapper
+    // matches and triangulates the KF from its own stereo features
+    if( !curr_frame->klt_tracked )
+        return;
+    curr_frame->klt_tracked = false;
+    curr_frame->pt_src.clear();
+    curr_frame->ls_src.clear();
+    if( Config::featBudget() )
+        curr_frame->extractStereoFeatures( llength_th, feat_budget );
+    else
+        curr_frame->extractStereoFeatures( llength_th, orb_fast_th );
+    n_extracted = curr_frame->stereo_pt.size() + curr_frame->stereo_ls.size();
+    Profiler::instance().addCount( "StereoFrameHandler::kltKFExtractions" );
+}
+
+void StereoFrameHandler::insertStereoFrame( StereoFrame* frame )
+{
+    // the frame already contains its stereo features (e.g. from FramePipeline)
+    curr_frame = frame;
     f2fTracking();
 }
 
@@ -63,7 +246,8 @@ void StereoFrameHandler::updateFrame()
 {
 
     // update FAST threshold for the keypoint detection
-    if( Config::adaptativeFAST() )
+    // with feat_budget the FAST threshold is set by the budget
+    if( Config::adaptativeFAST() && !Config::featBudget() )
     {
         int min_fast  = Config::fastMinTh();
         int max_fast  = Config::fastMaxTh();
@@ -98,13 +282,44 @@ void StereoFrameHandler::updateFrame()
     delete prev_frame;
     prev_frame = curr_frame;
     curr_frame = NULL;
+    prev_f_shared = curr_f_shared;
+    curr_f_shared = false;
+
+    if( Profiler::instance().enabled() )
+    {
+        TrackingMemory mem = memoryUsage();
+        Profiler &prof = Profiler::instance();
+        prof.setGauge( "StereoFrameHandler::bytes.images",    mem.frames.images );
+        prof.setGauge( "StereoFrameHandler::bytes.features",  mem.frames.features );
+        prof.setGauge( "StereoFrameHandler::bytes.buffers",   mem.buffers );
+        prof.setGauge( "StereoFrameHandler::bytes.local_map", mem.local_map );
+    }
 
 }
 
+TrackingMemory StereoFrameHandler::memoryUsage() const
+{
+    TrackingMemory mem;
+    for( const StereoFrame* frame : { prev_frame, curr_frame } )
+    {
+        if( frame == NULL )
+            continue;
+        FrameMemory fm = frame->memoryUsage();
+        mem.frames.images   += fm.images;
+        mem.frames.features += fm.features;
+    }
+    mem.buffers = pose_obs.bytes() + f2f_pt_matched.capacity() / 8 + vectorBytes(map_visible) + matBytes(map_desc)
+                + ( matched_pt.size() * sizeof(PointFeature) + matched_ls.size() * sizeof(LineFeature) );
+    if( local_map )
+        mem.local_map = local_map->P.size() * sizeof(double) + matBytes(local_map->pdesc);
+    return mem;
+}
+
 /*  tracking methods  */
 
 void StereoFrameHandler::f2fTracking()
 {
+    PROFILE_SCOPE("StereoFrameHandler::f2fTracking");
 
     // feature matching
     matched_pt.clear();
@@ -112,10 +327,10 @@ void StereoFrameHandler::f2fTracking()
 
     if( Config::plInParallel() && Config::hasPoints() && Config::hasLines() )
     {
-        auto detect_p = async(launch::async, &StereoFrameHandler::matchF2FPoints, this );
-        auto detect_l = async(launch::async, &StereoFrameHandler::matchF2FLines,  this );
-        detect_p.wait();
-        detect_l.wait();
+        auto detect_p = ThreadPool::global().submit(&StereoFrameHandler::matchF2FPoints, this );
+        auto detect_l = ThreadPool::global().submit(&StereoFrameHandler::matchF2FLines,  this );
+        ThreadPool::global().wait(detect_p);
+        ThreadPool::global().wait(detect_l);
     }
     else
     {
@@ -123,6 +338,10 @@ void StereoFrameHandler::f2fTracking()
         if (Config::hasLines()) matchF2FLines();
     }
 
+    // points from the local map not tracked from the previous frame
+    if( Config::trackLocalMap() && Config::hasPoints() )
+        trackLocalMap();
+
     n_inliers_pt = matched_pt.size();
     n_inliers_ls = matched_ls.size();
     n_inliers    = n_inliers_pt + n_inliers_ls;
@@ -134,21 +353,32 @@ void StereoFrameHandler::matchF2FPoints()
     // points f2f tracking
     // --------------------------------------------------------------------------------------------------------------------
     matched_pt.clear();
+    f2f_pt_matched.assign( curr_frame->stereo_pt.size(), false );
     if ( !Config::hasPoints() || curr_frame->stereo_pt.empty() || prev_frame->stereo_pt.empty() )
         return;
 
     std::vector<int> matches_12;
-    match(prev_frame->pdesc_l, curr_frame->pdesc_l, Config::minRatio12P(), matches_12);
+    if( curr_frame->klt_tracked )
+    {
+        matches_12.assign( prev_frame->stereo_pt.size(), -1 );
+        for( int i2 = 0; i2 < curr_frame->pt_src.size(); i2++ )
+            matches_12[ curr_frame->pt_src[i2] ] = i2;
+    }
+    else if( !Config::f2fAdaptiveWs() || !matchF2FPointsGuided(matches_12) )
+        match(prev_frame->pdesc_l, curr_frame->pdesc_l, Config::minRatio12P(), matches_12);
 
     // bucle around pmatches
     for (int i1 = 0; i1 < matches_12.size(); ++i1) {
         const int i2 = matches_12[i1];
         if (i2 < 0) continue;
 
-        prev_frame->stereo_pt[i1]->pl_obs = curr_frame->stereo_pt[i2]->pl;
-        prev_frame->stereo_pt[i1]->inlier = true;
-        matched_pt.push_back( prev_frame->stereo_pt[i1]->safeCopy() );
-        curr_frame->stereo_pt[i2]->idx = prev_frame->stereo_pt[i1]->idx; // prev idx
+        // the observation is stored in the copy, the features of prev_frame stay as detected
+        PointFeature* pt = prev_frame->stereo_pt[i1]->safeCopy();
+        pt->pl_obs = curr_frame->stereo_pt[i2]->pl;
+        pt->inlier = true;
+        matched_pt.push_back( pt );
+        curr_frame->stereo_pt[i2]->idx = prev_f_shared ? i1 : prev_frame->stereo_pt[i1]->idx; // prev idx
+        f2f_pt_matched[i2] = true;
     }
 }
 
@@ -161,21 +391,272 @@ void StereoFrameHandler::matchF2FLines()
         return;
 
     std::vector<int> matches_12;
-    match(prev_frame->ldesc_l, curr_frame->ldesc_l, Config::minRatio12L(), matches_12);
+    if( curr_frame->klt_tracked )
+    {
+        matches_12.assign( prev_frame->stereo_ls.size(), -1 );
+        for( int i2 = 0; i2 < curr_frame->ls_src.size(); i2++ )
+            matches_12[ curr_frame->ls_src[i2] ] = i2;
+    }
+    else if( !Config::f2fAdaptiveWs() || !matchF2FLinesGuided(matches_12) )
+        match(prev_frame->ldesc_l, curr_frame->ldesc_l, Config::minRatio12L(), matches_12);
 
     // bucle around pmatches
     for (int i1 = 0; i1 < matches_12.size(); ++i1) {
         const int i2 = matches_12[i1];
         if (i2 < 0) continue;
 
-        prev_frame->stereo_ls[i1]->sdisp_obs = curr_frame->stereo_ls[i2]->sdisp;
-        prev_frame->stereo_ls[i1]->edisp_obs = curr_frame->stereo_ls[i2]->edisp;
-        prev_frame->stereo_ls[i1]->spl_obs   = curr_frame->stereo_ls[i2]->spl;
-        prev_frame->stereo_ls[i1]->epl_obs   = curr_frame->stereo_ls[i2]->epl;
-        prev_frame->stereo_ls[i1]->le_obs    = curr_frame->stereo_ls[i2]->le;
-        prev_frame->stereo_ls[i1]->inlier    = true;
-        matched_ls.push_back( prev_frame->stereo_ls[i1]->safeCopy() );
-        curr_frame->stereo_ls[i2]->idx = prev_frame->stereo_ls[i1]->idx; // prev idx
+        // the observation is stored in the copy, the features of prev_frame stay as detected
+        LineFeature* ls = prev_frame->stereo_ls[i1]->safeCopy();
+        ls->sdisp_obs = curr_frame->stereo_ls[i2]->sdisp;
+        ls->edisp_obs = curr_frame->stereo_ls[i2]->edisp;
+        ls->spl_obs   = curr_frame->stereo_ls[i2]->spl;
+        ls->epl_obs   = curr_frame->stereo_ls[i2]->epl;
+        ls->le_obs    = curr_frame->stereo_ls[i2]->le;
+        ls->inlier    = true;
+        matched_ls.push_back( ls );
+        curr_frame->stereo_ls[i2]->idx = prev_f_shared ? i1 : prev_frame->stereo_ls[i1]->idx; // prev idx
+    }
+}
+
+bool StereoFrameHandler::predictMotion( Matrix4d &DT_pred, Matrix6d &DT_pred_cov )
+{
+    // constant velocity: the current increment is predicted as the previous one
+    DT_pred     = Matrix4d::Identity();
+    DT_pred_cov = Matrix6d::Zero();
+    if( !Config::useMotionModel() || !isGoodSolution(prev_frame->DT,prev_frame->DT_cov,prev_frame->err_norm) )
+        return false;
+    DT_pred     = inverse_se3( prev_frame->DT );
+    DT_pred_cov = prev_frame->DT_cov;
+    return true;
+}
+
+bool StereoFrameHandler::matchF2FPointsGuided( std::vector<int> &matches_12 )
+{
+    Matrix4d DT_pred;
+    Matrix6d DT_pred_cov;
+    if( !predictMotion(DT_pred, DT_pred_cov) )
+        return false;
+
+    // grid with the current points
+    static thread_local GridStructure grid(GRID_ROWS, GRID_COLS); // storage reused across frames
+    grid.clear();
+    for( int i2 = 0; i2 < curr_frame->stereo_pt.size(); i2++ )
+    {
+        const PointFeature* pt = curr_frame->stereo_pt[i2];
+        grid.add( pt->pl(0) * curr_frame->inv_width, pt->pl(1) * curr_frame->inv_height, i2 );
+    }
+    grid.build();
+
+    // predicted projection of the previous points and its std. dev. (grid cells)
+    const int n = prev_frame->stereo_pt.size();
+    static thread_local std::vector<point_2d> pj_points;
+    static thread_local std::vector<std::pair<double,double>> stdv;
+    static thread_local std::vector<GridWindow> windows;
+    pj_points.resize(n);
+    stdv.resize(n);
+    windows.resize(n);
+    for( int i1 = 0; i1 < n; i1++ )
+    {
+        Vector3d P_ = DT_pred.block<3,3>(0,0) * prev_frame->stereo_pt[i1]->P + DT_pred.block<3,1>(0,3);
+        if( P_(2) <= 0.0 )
+        {
+            // no window: the point is not searched
+            pj_points[i1] = std::make_pair(-1, -1);
+            stdv[i1]      = std::make_pair(-1.0, -1.0);
+            continue;
+        }
+        Vector2d pl_ = cam->projection( P_ );
+        Vector2d s_  = projectionStdv( cam, P_, DT_pred_cov );
+        pj_points[i1] = std::make_pair( pl_(0) * curr_frame->inv_width, pl_(1) * curr_frame->inv_height );
+        stdv[i1]      = std::make_pair( s_(0) * curr_frame->inv_width, s_(1) * curr_frame->inv_height );
+    }
+
+    // widen the windows until there are enough matches, brute force once the max size is reached
+    const int max_ws = Config::f2fMaxWs();
+    for( double k = Config::f2fWsSigma(); ; k *= 2.0 )
+    {
+        int ws_max = 0;
+        for( int i1 = 0; i1 < n; i1++ )
+        {
+            GridWindow &w = windows[i1];
+            if( stdv[i1].first < 0.0 )
+            {
+                w.width = w.height = std::make_pair(0, 0);
+                continue;
+            }
+            const int wx = windowCells( stdv[i1].first,  k, max_ws );
+            const int wy = windowCells( stdv[i1].second, k, max_ws );
+            w.width  = std::make_pair(wx, wx);
+            w.height = std::make_pair(wy, wy);
+            ws_max = std::max( ws_max, std::max(wx, wy) );
+        }
+        if( matchGrid(pj_points, prev_frame->pdesc_l, grid, curr_frame->pdesc_l, windows, matches_12) >= Config::minFeatures() )
+            return true;
+        if( ws_max >= max_ws || ws_max == 0 )
+            return false;
+    }
+}
+
+bool StereoFrameHandler::matchF2FLinesGuided( std::vector<int> &matches_12 )
+{
+    Matrix4d DT_pred;
+    Matrix6d DT_pred_cov;
+    if( !predictMotion(DT_pred, DT_pred_cov) )
+        return false;
+
+    // row index with the current line segments
+    static thread_local LineRowIndex grid(GRID_ROWS, GRID_COLS); // storage reused across frames
+    static thread_local std::vector<std::pair<double, double>> directions;
+    grid.clear();
+    directions.resize( curr_frame->stereo_ls.size() );
+    for( int i2 = 0; i2 < curr_frame->stereo_ls.size(); i2++ )
+    {
+        const LineFeature* ls = curr_frame->stereo_ls[i2];
+        std::pair<double, double> &v = directions[i2];
+        v = std::make_pair((ls->epl(0) - ls->spl(0)) * curr_frame->inv_width, (ls->epl(1) - ls->spl(1)) * curr_frame->inv_height);
+        normalize(v);
+        grid.add(ls->spl(0) * curr_frame->inv_width, ls->spl(1) * curr_frame->inv_height,
+                 ls->epl(0) * curr_frame->inv_width, ls->epl(1) * curr_frame->inv_height, i2);
+    }
+    grid.build();
+
+    // predicted projection of the previous endpoints and its largest std. dev. (grid cells)
+    const int n = prev_frame->stereo_ls.size();
+    static thread_local std::vector<line_2d> pj_lines;
+    static thread_local std::vector<std::pair<double,double>> stdv;
+    static thread_local std::vector<GridWindow> windows;
+    pj_lines.resize(n);
+    stdv.resize(n);
+    windows.resize(n);
+    for( int i1 = 0; i1 < n; i1++ )
+    {
+        const LineFeature* ls = prev_frame->stereo_ls[i1];
+        Vector3d sP_ = DT_pred.block<3,3>(0,0) * ls->sP + DT_pred.block<3,1>(0,3);
+        Vector3d eP_ = DT_pred.block<3,3>(0,0) * ls->eP + DT_pred.block<3,1>(0,3);
+        if( sP_(2) <= 0.0 || eP_(2) <= 0.0 )
+        {
+            // no window: the line is not searched
+            pj_lines[i1] = std::make_pair( std::make_pair(-1, -1), std::make_pair(-1, -1) );
+            stdv[i1]     = std::make_pair(-1.0, -1.0);
+            continue;
+        }
+        Vector2d spl_ = cam->projection( sP_ );
+        Vector2d epl_ = cam->projection( eP_ );
+        Vector2d s_   = projectionStdv( cam, sP_, DT_pred_cov ).cwiseMax( projectionStdv( cam, eP_, DT_pred_cov ) );
+        pj_lines[i1] = std::make_pair( std::make_pair( spl_(0) * curr_frame->inv_width, spl_(1) * curr_frame->inv_height ),
+                                       std::make_pair( epl_(0) * curr_frame->inv_width, epl_(1) * curr_frame->inv_height ) );
+        stdv[i1]     = std::make_pair( s_(0) * curr_frame->inv_width, s_(1) * curr_frame->inv_height );
+    }
+
+    // widen the windows until there are enough matches, brute force once the max size is reached
+    const int max_ws = Config::f2fMaxWs();
+    for( double k = Config::f2fWsSigma(); ; k *= 2.0 )
+    {
+        int ws_max = 0;
+        for( int i1 = 0; i1 < n; i1++ )
+        {
+            GridWindow &w = windows[i1];
+            if( stdv[i1].first < 0.0 )
+            {
+                w.width = w.height = std::make_pair(0, 0);
+                continue;
+            }
+            const int wx = windowCells( stdv[i1].first,  k, max_ws );
+            const int wy = windowCells( stdv[i1].second, k, max_ws );
+            w.width  = std::make_pair(wx, wx);
+            w.height = std::make_pair(wy, wy);
+            ws_max = std::max( ws_max, std::max(wx, wy) );
+        }
+        if( matchGrid(pj_lines, prev_frame->ldesc_l, grid, curr_frame->ldesc_l, directions, windows, matches_12) >= Config::minFeatures() )
+            return true;
+        if( ws_max >= max_ws || ws_max == 0 )
+            return false;
+    }
+}
+
+void StereoFrameHandler::setLocalMap( const std::shared_ptr<const LocalMapSnapshot> &snapshot )
+{
+    // the mapper may still be on an older KF: its snapshot is placed wrt the current KF with the KF
+    // chain, unless it is older than the cached one or than the chain
+    if( !snapshot || snapshot == local_map || ( local_map && snapshot->kf_idx < local_map->kf_idx ) )
+        return;
+    const int age = kf_count - snapshot->kf_idx;
+    if( age < 0 || age > int(kf_chain.size()) )
+        return;
+    Matrix4d T_kf_map = Matrix4d::Identity();
+    for( int i = kf_chain.size() - age; i < int(kf_chain.size()); i++ )
+        T_kf_map = kf_chain[i] * T_kf_map;
+    local_map    = snapshot;
+    T_prevKF_map = T_kf_map;
+}
+
+void StereoFrameHandler::trackLocalMap()
+{
+    PROFILE_SCOPE("StereoFrameHandler::trackLocalMap");
+
+    n_inliers_map = 0;
+    if( !local_map || local_map->P.cols() == 0 || curr_frame->stereo_pt.empty() )
+        return;
+
+    // predicted pose of the current frame wrt the previous one (identity without motion model)
+    Matrix4d DT_pred;
+    Matrix6d DT_pred_cov;
+    predictMotion( DT_pred, DT_pred_cov );
+
+    // landmarks in the previous frame, and predicted in the current one
+    const Matrix4d T_prev_map = inverse_se3( prev_frame->Tfw ) * T_prevKF_map;
+    const Matrix4d T_curr_map = DT_pred * T_prev_map;
+
+    // grid with the current points not tracked from the previous frame
+    static thread_local GridStructure grid(GRID_ROWS, GRID_COLS); // storage reused across frames
+    grid.clear();
+    for( int i2 = 0; i2 < curr_frame->stereo_pt.size(); i2++ )
+    {
+        if( f2f_pt_matched[i2] ) continue;
+        const PointFeature* pt = curr_frame->stereo_pt[i2];
+        grid.add( pt->pl(0) * curr_frame->inv_width, pt->pl(1) * curr_frame->inv_height, i2 );
+    }
+    grid.build();
+
+    // project the landmarks with the predicted pose, keeping the ones inside the image
+    const int n_map = local_map->P.cols();
+    if( map_desc.rows < n_map || map_desc.cols != local_map->pdesc.cols || map_desc.type() != local_map->pdesc.type() )
+        map_desc.create( n_map, local_map->pdesc.cols, local_map->pdesc.type() );
+    static thread_local std::vector<point_2d> pj_points;
+    pj_points.clear();
+    map_visible.clear();
+    for( int i = 0; i < n_map; i++ )
+    {
+        Vector3d P_ = T_curr_map.block<3,3>(0,0) * local_map->P.col(i) + T_curr_map.block<3,1>(0,3);
+        if( P_(2) <= 0.0 ) continue;
+        Vector2d pl_ = cam->projection( P_ );
+        if( pl_(0) <= 0.0 || pl_(0) >= cam->getWidth() || pl_(1) <= 0.0 || pl_(1) >= cam->getHeight() ) continue;
+        local_map->pdesc.row(i).copyTo( map_desc.row( map_visible.size() ) );
+        map_visible.push_back( i );
+        pj_points.push_back( std::make_pair( pl_(0) * curr_frame->inv_width, pl_(1) * curr_frame->inv_height ) );
+    }
+    if( map_visible.empty() )
+        return;
+
+    GridWindow w;
+    const int ws = Config::localMapWs();
+    w.width  = std::make_pair(ws, ws);
+    w.height = std::make_pair(ws, ws);
+    std::vector<int> matches_12;
+    matchGrid( pj_points, map_desc.rowRange(0, map_visible.size()), grid, curr_frame->pdesc_l, w, matches_12 );
+
+    // the matched landmarks enter the pose problem as points of the previous frame
+    for( int i1 = 0; i1 < matches_12.size(); i1++ )
+    {
+        const int i2 = matches_12[i1];
+        if( i2 < 0 ) continue;
+        Vector3d P = T_prev_map.block<3,3>(0,0) * local_map->P.col( map_visible[i1] ) + T_prev_map.block<3,1>(0,3);
+        if( P(2) <= 0.0 ) continue;
+        const PointFeature* obs = curr_frame->stereo_pt[i2];
+        PointFeature* pt = new PointFeature( cam->projection(P), cam->getFx() * cam->getB() / P(2), P, obs->pl,
+                                             -1, obs->level, obs->sigma2, Matrix3d::Identity(), true );
+        matched_pt.push_back( pt );
+        n_inliers_map++;
     }
 }
 
@@ -296,7 +777,7 @@ bool StereoFrameHandler::isGoodSolution( Matrix4d DT, Matrix6d DTcov, double err
 
     if( DT_cov_eig(0)<0.0 || DT_cov_eig(5)>1.0 || err < 0.0 || err > 1.0 || !is_finite(DT) )
     {
-        cout << endl << DT_cov_eig(0) << "\t" << DT_cov_eig(5) << "\t" << err << endl;
+        LOG_DEBUG( DT_cov_eig(0) << "\t" << DT_cov_eig(5) << "\t" << err );
         return false;
     }
 
@@ -306,20 +787,23 @@ bool StereoFrameHandler::isGoodSolution( Matrix4d DT, Matrix6d DTcov, double err
 
 void StereoFrameHandler::optimizePose()
 {
+    PROFILE_SCOPE("StereoFrameHandler::optimizePose");
 
     // definitions
     Matrix4d DT, DT_;
     Matrix6d DT_cov;
     double   err = numeric_limits<double>::max(), e_prev;
     err = -1.0;
+    pose_iters = 0;
 
-    // set init pose (depending on the use of prior information or not, and on the goodness of previous solution)
-    if( Config::useMotionModel() )
+    // set init pose (depending on the use of prior information or not, and on the goodness of previous solution),
+    // the previous motion is stored inverted (as the frame increment, see below)
+    if( Config::useMotionModel() || Config::poseWarmStart() )
     {
-        DT     = prev_frame->DT;
+        DT     = inverse_se3( prev_frame->DT );
         DT_cov = prev_frame->DT_cov;
         e_prev = prev_frame->err_norm;
-        if( !isGoodSolution(DT,DT_cov,e_prev) )
+        if( !isGoodSolution(prev_frame->DT,DT_cov,e_prev) )
             DT = Matrix4d::Identity();
     }
     else
@@ -328,48 +812,44 @@ void StereoFrameHandler::optimizePose()
     // optimization mode
     int mode = 1;   // GN - GNR - LM
 
+    // line model of the pose (line_model)
+    const bool pluker = Config::plukerLines();
+
     // solver
     if( n_inliers >= Config::minFeatures() )
     {
         // optimize
         DT_ = DT;
-#ifdef USE_LINE_PLUKER
-        gaussNewtonOptimizationforPluker(DT_,DT_cov,err,Config::maxIters());
-        //gaussNewtonOptimizationRobust(DT_,DT_cov,err,Config::maxIters());
-#else
-        if( mode == 0 )      gaussNewtonOptimization(DT_,DT_cov,err,Config::maxIters());
+        if( pluker )         gaussNewtonOptimizationforPluker(DT_,DT_cov,err,Config::maxIters());
+        else if( mode == 0 ) gaussNewtonOptimization(DT_,DT_cov,err,Config::maxIters());
         else if( mode == 1 ) gaussNewtonOptimizationRobust(DT_,DT_cov,err,Config::maxIters());
         else if( mode == 2 ) levenbergMarquardtOptimization(DT_,DT_cov,err,Config::maxIters());
-#endif
         // remove outliers (implement some logic based on the covariance's eigenvalues and optim error)
         if( isGoodSolution(DT_,DT_cov,err) )
         {
             removeOutliers(DT_);
-            // refine without outliers
+            // refine without outliers (from the first stage solution, whose robust weights it keeps)
+            if( Config::poseWarmStart() )
+                DT = DT_;
             if( n_inliers >= Config::minFeatures() )
             {
-#ifdef USE_LINE_PLUKER
-                gaussNewtonOptimizationforPluker(DT,DT_cov,err,Config::maxItersRef());
-               // gaussNewtonOptimizationRobust(DT,DT_cov,err,Config::maxItersRef());
-#else
-                if( mode == 0 )      gaussNewtonOptimization(DT,DT_cov,err,Config::maxItersRef());
+                if( pluker )         gaussNewtonOptimizationforPluker(DT,DT_cov,err,Config::maxItersRef());
+                else if( mode == 0 ) gaussNewtonOptimization(DT,DT_cov,err,Config::maxItersRef());
                 else if( mode == 1 ) gaussNewtonOptimizationRobust(DT,DT_cov,err,Config::maxItersRef());
                 else if( mode == 2 ) levenbergMarquardtOptimization(DT,DT_cov,err,Config::maxItersRef());
-#endif
             }
             else
             {
                 DT     = Matrix4d::Identity();
-                cout << "[StVO] not enough inliers (after removal)" << endl;
+                LOG_WARN( "[StVO] not enough inliers (after removal)" );
             }
         }
         else
         {
-#ifdef USE_LINE_PLUKER
-            std::cout<<"Not implemented now...."<<std::endl;
-#else
-            gaussNewtonOptimizationRobust(DT,DT_cov,err,Config::maxItersRef());
-#endif
+            if( pluker )
+                LOG_WARN( "Not implemented now...." );
+            else
+                gaussNewtonOptimizationRobust(DT,DT_cov,err,Config::maxItersRef());
             //DT     = Matrix4d::Identity();
             //cout << "[StVO] optimization didn't converge" << endl;
         }
@@ -377,8 +857,10 @@ void StereoFrameHandler::optimizePose()
     else
     {
         DT     = Matrix4d::Identity();
-        cout << "[StVO] not enough inliers (before optimization)" << endl;
+        LOG_WARN( "[StVO] not enough inliers (before optimization)" );
     }
+    Profiler::instance().addCount("StereoFrameHandler::poseSolves");
+    Profiler::instance().setGauge("StereoFrameHandler::poseIterationsPerFrame", pose_iters);
 
 
     // set estimated pose
@@ -402,10 +884,16 @@ void StereoFrameHandler::optimizePose()
         curr_frame->Tfw_cov  = prev_frame->Tfw_cov;
         curr_frame->DT_cov_eig = Vector6d::Zero();
     }
+
+    // depth of the tracked features with the estimated pose
+    if( curr_frame->klt_tracked )
+        updateTrackedFrame();
 }
 
 void StereoFrameHandler::gaussNewtonOptimization(Matrix4d &DT, Matrix6d &DT_cov, double &err_, int max_iters)
 {
+    buildPoseObservations();
+
     Matrix6d H;
     Vector6d g, DT_inc;
     double err, err_prev = 999999999.9;
@@ -415,6 +903,8 @@ void StereoFrameHandler::gaussNewtonOptimization(Matrix4d &DT, Matrix6d &DT_cov,
     {
         // estimate hessian and gradient (select)
         optimizeFunctions( DT, H, g, err );
+        Profiler::instance().addCount("StereoFrameHandler::poseIterations");
+        pose_iters++;
         if (err > err_prev) {
             if (iters > 0)
                 break;
@@ -422,8 +912,8 @@ void StereoFrameHandler::gaussNewtonOptimization(Matrix4d &DT, Matrix6d &DT_cov,
             return;
         }
         // if the difference is very small stop
-        if( ( ( err < Config::minError()) || abs(err-err_prev) < Config::minErrorChange() ) ) {
-            cout << "[StVO] Small optimization improvement" << endl;
+        if( smallErrorChange( err, err_prev ) ) {
+            LOG_DEBUG( "[StVO] Small optimization improvement" );
             break;
         }
         // update step
@@ -431,8 +921,8 @@ void StereoFrameHandler::gaussNewtonOptimization(Matrix4d &DT, Matrix6d &DT_cov,
         DT_inc = solver.solve(g);
         DT  << DT * inverse_se3( expmap_se3(DT_inc) );
         // if the parameter change is small stop
-        if( DT_inc.head(3).norm() < Config::minErrorChange() && DT_inc.tail(3).norm() < Config::minErrorChange()) {
-            cout << "[StVO] Small optimization solution variance" << endl;
+        if( smallPoseStep( DT_inc ) ) {
+            LOG_DEBUG( "[StVO] Small optimization solution variance" );
             break;
         }
         // update previous values
@@ -445,6 +935,7 @@ void StereoFrameHandler::gaussNewtonOptimization(Matrix4d &DT, Matrix6d &DT_cov,
 
 void StereoFrameHandler::gaussNewtonOptimizationRobust(Matrix4d &DT, Matrix6d &DT_cov, double &err_, int max_iters)
 {
+    buildPoseObservations();
 
     Matrix4d DT_;
     Matrix6d H;
@@ -459,8 +950,10 @@ void StereoFrameHandler::gaussNewtonOptimizationRobust(Matrix4d &DT, Matrix6d &D
     {
         // estimate hessian and gradient (select)
         optimizeFunctionsRobust( DT, H, g, err );
+        Profiler::instance().addCount("StereoFrameHandler::poseIterations");
+        pose_iters++;
         // if the difference is very small stop
-        if( ( fabs(err-err_prev) < Config::minErrorChange() ) || ( err < Config::minError()) )// || err > err_prev )
+        if( smallErrorChange( err, err_prev ) )// || err > err_prev )
             break;
         // update step
         ColPivHouseholderQR<Matrix6d> solver(H);
@@ -473,7 +966,7 @@ void StereoFrameHandler::gaussNewtonOptimizationRobust(Matrix4d &DT, Matrix6d &D
         //DT  << DT * inverse_se3( expmap_se3(DT_inc) );
         DT << inverse_se3( expmap_se3(DT_inc)) * DT;
         // if the parameter change is small stop (TODO: change with two parameters, one for R and another one for t)
-        if( DT_inc.norm() < Config::minErrorChange() )
+        if( smallPoseStep( DT_inc ) )
             break;
         // update previous values
         err_prev = err;
@@ -495,6 +988,8 @@ void StereoFrameHandler::gaussNewtonOptimizationRobust(Matrix4d &DT, Matrix6d &D
 
 void StereoFrameHandler::levenbergMarquardtOptimization(Matrix4d &DT, Matrix6d &DT_cov, double &err_, int max_iters)
 {
+    buildPoseObservations();
+
     Matrix6d H;
     Vector6d g, DT_inc;
     double err, err_prev = 999999999.9;
@@ -530,8 +1025,10 @@ void StereoFrameHandler::levenbergMarquardtOptimization(Matrix4d &DT, Matrix6d &
         // estimate hessian and gradient (select)
 //        optimizeFunctionsRobust( DT, H, g, err );
         optimizeFunctions( DT, H, g, err );
+        Profiler::instance().addCount("StereoFrameHandler::poseIterations");
+        pose_iters++;
         // if the difference is very small stop
-        if( ( fabs(err-err_prev) < Config::minErrorChange() ) || ( err < Config::minError()) )
+        if( smallErrorChange( err, err_prev ) )
             break;
         // add lambda to hessian
         for(int i = 0; i < 6; i++)
@@ -550,7 +1047,7 @@ void StereoFrameHandler::levenbergMarquardtOptimization(Matrix4d &DT, Matrix6d &
         // plot each iteration
         //plotStereoFrameProjerr(DT,iters+1);
         // if the parameter change is small stop
-        if( DT_inc.head(3).norm() < Config::minErrorChange() && DT_inc.tail(3).norm() < Config::minErrorChange())
+        if( smallPoseStep( DT_inc ) )
             break;
         // update previous values
         err_prev = err;
@@ -562,246 +1059,14 @@ void StereoFrameHandler::levenbergMarquardtOptimization(Matrix4d &DT, Matrix6d &
 
 //pluker
 void StereoFrameHandler::optimizeFunctionsUsingPluker(Matrix4d DT, Matrix6d &H, Vector6d &g, double &e) {
-        // define hessians, gradients, and residuals
-        Matrix6d H_l, H_p;
-        Vector6d g_l, g_p;
-        double   e_l = 0.0, e_p = 0.0, S_l, S_p;
-        H   = Matrix6d::Zero(); H_l = H; H_p = H;
-        g   = Vector6d::Zero(); g_l = g; g_p = g;
-        e   = 0.0;
-
-        vector<double> res_p, res_l;
-
-        // point features pre-weight computation
-        for( auto it = matched_pt.begin(); it!=matched_pt.end(); it++)
-        {
-            if( (*it)->inlier )
-            {
-                Vector3d P_ = DT.block(0,0,3,3) * (*it)->P + DT.col(3).head(3);
-                Vector2d pl_proj = cam->projection( P_ );
-                // projection error
-                Vector2d err_i    = pl_proj - (*it)->pl_obs;
-                res_p.push_back( err_i.norm());
-            }
-        }
-
-        // line segment features pre-weight computation
-        for( auto it = matched_ls.begin(); it!=matched_ls.end(); it++)
-        {
-            if( (*it)->inlier )
-            {
-                //line in curr frame
-                Vector6d pluker_line_curr = TransformForPluker(DT, (*it)->NDc);
-                //line project to curr image
-                Vector3d pixel_line_curr = cam->getPlukerK() * pluker_line_curr.head(3);
-
-                double err0 = (*it)->spl_obs[0] * pixel_line_curr[0] + (*it)->spl_obs[1] * pixel_line_curr[1] + pixel_line_curr[2];
-                err0 = err0 / (sqrt(pixel_line_curr[0]*pixel_line_curr[0]+pixel_line_curr[1]*pixel_line_curr[1]));
-
-                double err1 = (*it)->epl_obs[0] * pixel_line_curr[0] + (*it)->epl_obs[1] * pixel_line_curr[1] + pixel_line_curr[2];
-                err1 = err1 / (sqrt(pixel_line_curr[0]*pixel_line_curr[0] + pixel_line_curr[1]*pixel_line_curr[1]));
-
-                res_l.push_back( sqrt(err0*err0+err1*err1) );
-            }
 
-        }
-
-        // estimate scale of the residuals
-        double s_p = 1.0, s_l = 1.0;
-        double th_min = 0.0001;
-        double th_max = sqrt(7.815);
-
-        if( false )
-        {
-
-            res_p.insert( res_p.end(), res_l.begin(), res_l.end() );
-            s_p = vector_stdv_mad( res_p );
-
-            //cout << s_p << "\t";
-            //if( res_p.size() < 4*Config::minFeatures() )
-            //s_p = 1.0;
-            //cout << s_p << endl;
-
-            if( s_p < th_min )
-                s_p = th_min;
-            if( s_p > th_max )
-                s_p = th_max;
-
-            s_l = s_p;
-
-        }
-        else
-        {
-
-            s_p = vector_stdv_mad( res_p );
-            s_l = vector_stdv_mad( res_l );
-
-            if( s_p < th_min )
-                s_p = th_min;
-            if( s_p > th_max )
-                s_p = th_max;
-
-            if( s_l < th_min )
-                s_l = th_min;
-            if( s_l > th_max )
-                s_l = th_max;
-
-        }
-
-        // point features
-        int N_p = 0;
-
-        for( auto it = matched_pt.begin(); it!=matched_pt.end(); it++)
-        {
-            if( (*it)->inlier )
-            {
-                Vector3d P_ = DT.block(0,0,3,3) * (*it)->P + DT.col(3).head(3);
-                Vector2d pl_proj = cam->projection( P_ );
-                // projection error
-                Vector2d err_i    = pl_proj - (*it)->pl_obs;
-                double err_i_norm = err_i.norm();
-                // estimate variables for J, H, and g
-                double gx   = P_(0);
-                double gy   = P_(1);
-                double gz   = P_(2);
-                double gz2  = gz*gz;
-                double fgz2 = cam->getFx() / std::max(Config::homogTh(),gz2);
-                double dx   = err_i(0);
-                double dy   = err_i(1);
-                // jacobian
-                Vector6d J_aux;
-                J_aux << + fgz2 * dx * gz,
-                        + fgz2 * dy * gz,
-                        - fgz2 * ( gx*dx + gy*dy ),
-                        - fgz2 * ( gx*gy*dx + gy*gy*dy + gz*gz*dy ),
-                        + fgz2 * ( gx*gx*dx + gz*gz*dx + gx*gy*dy ),
-                        + fgz2 * ( gx*gz*dy - gy*gz*dx );
-                J_aux = J_aux / std::max(Config::homogTh(),err_i_norm);
-                // define the residue
-                double s2 = (*it)->sigma2;
-                double r = err_i_norm ;
-                // if employing robust cost function
-                double w  = 1.0;
-                double x = r / s_p;
-                w = robustWeightCauchy(x) ;
-
-                // if down-weighting far samples
-                //double zdist   = P_(2) * 1.0 / ( cam->getB()*cam->getFx());
-                //if( false ) w *= 1.0 / ( s2 + zdist * zdist );
-
-                // update hessian, gradient, and error
-                H_p += J_aux * J_aux.transpose() * w;
-                g_p += J_aux * r * w;
-                e_p += r * r * w;
-                N_p++;
-            }
-        }
-
-        // line segment features
-        int N_l = 0;
-        for( auto it = matched_ls.begin(); it!=matched_ls.end(); it++)
-        {
-            if( (*it)->inlier )
-            {
-                Vector3d sP_ = DT.block(0,0,3,3) * (*it)->sP + DT.col(3).head(3);
-                Vector2d spl_proj = cam->projection( sP_ );
-                Vector3d eP_ = DT.block(0,0,3,3) * (*it)->eP + DT.col(3).head(3);
-                Vector2d epl_proj = cam->projection( eP_ );
-
-                //line in curr frame
-                Vector6d pluker_line_curr = TransformForPluker(DT, (*it)->NDc);
-                //line project to curr image
-                Vector3d pixel_line_curr = cam->getPlukerK() * pluker_line_curr.head(3);
-
-                double err0 = (*it)->spl_obs[0] * pixel_line_curr[0] + (*it)->spl_obs[1] * pixel_line_curr[1] + pixel_line_curr[2];
-                err0 = err0 / (sqrt(pixel_line_curr[0]*pixel_line_curr[0]+pixel_line_curr[1]*pixel_line_curr[1]));
-
-                double err1 = (*it)->epl_obs[0] * pixel_line_curr[0] + (*it)->epl_obs[1] * pixel_line_curr[1] + pixel_line_curr[2];
-                err1 = err1 / (sqrt(pixel_line_curr[0]*pixel_line_curr[0] + pixel_line_curr[1]*pixel_line_curr[1]));
-
-                double a0 = (*it)->spl_obs[0];
-                double b0 = (*it)->spl_obs[1];
-                double a1 = (*it)->epl_obs[0];
-                double b1 = (*it)->epl_obs[1];
-                double lx = pixel_line_curr[0];
-                double ly = pixel_line_curr[1];
-                double lz = pixel_line_curr[2];
-                double fm = 1.0 / sqrt(lx*lx + ly*ly);
-                double err_i_norm = sqrt(err0*err0 + err1*err1);
-
-                Matrix<double,1,3> fai_e0_pixelLineCurr;
-                fai_e0_pixelLineCurr << a0*fm-lx*err0*fm*fm, b0*fm-ly*err0*fm*fm, fm;
-
-                Matrix<double,1,3> fai_e1_pixelLineCurr;
-                fai_e1_pixelLineCurr << a1*fm-lx*err1*fm*fm, b1*fm-ly*err1*fm*fm, fm;
-
-                Matrix<double,3,6> fai_pixelLineCurr_lineCurr;
-                fai_pixelLineCurr_lineCurr.setZero();
-                fai_pixelLineCurr_lineCurr.block<3,3>(0,0) = cam->getPlukerK();
-
-                Matrix<double,6,6> fai_lineCurr_RT;
-                fai_lineCurr_RT.setZero();
-                fai_lineCurr_RT.block<3,3>(0,3) = -vectorHat(DT.block(0,0,3,3)*(*it)->NDc.head(3))
-                                                  -vectorHat(DT.block(0,3,3,1))*
-                                                  vectorHat(DT.block(0,0,3,3)*(*it)->NDc.tail(3));
-                fai_lineCurr_RT.block<3,3>(0,0) = -vectorHat(DT.block(0,0,3,3)*(*it)->NDc.tail(3));
-
-                Matrix<double,1,6> jac0 = fai_e0_pixelLineCurr * fai_pixelLineCurr_lineCurr * fai_lineCurr_RT;
-                Matrix<double,1,6> jac1 = fai_e1_pixelLineCurr * fai_pixelLineCurr_lineCurr * fai_lineCurr_RT;
-
-                Vector6d J_aux;
-                J_aux = ( jac0.transpose() * err0 + jac1.transpose() * err1 ) / std::max(Config::homogTh(),err_i_norm);
-
-                // define the residue
-                double s2 = (*it)->sigma2;
-                double r = err_i_norm * sqrt(s2);
-//               Vector2d r;
-//               r(0) = err0;
-//               r(1) = err1;
-
-                // if employing robust cost function
-                double w  = 1.0;
-                double x = err_i_norm / s_l;
-                w = robustWeightCauchy(x) ;
-
-                // estimating overlap between line segments
-                bool has_overlap = true;
-                double overlap = prev_frame->lineSegmentOverlap( (*it)->spl, (*it)->epl, spl_proj, epl_proj );
-                if( has_overlap )
-                    w *= overlap;
-
-                // if down-weighting far samples
-                /*double zdist = max( sP_(2), eP_(2) ) / ( cam->getB()*cam->getFx());
-                if( false )
-                    w *= 1.0 / ( s2 + zdist * zdist );*/
-
-                // update hessian, gradient, and error
-                H_l += J_aux * J_aux.transpose() * w;
-                g_l += J_aux * r * w;
-                e_l += err_i_norm * err_i_norm * w;
-                N_l++;
-            }
-
-        }
-
-        // sum H, g and err from both points and lines
-        H = H_p + H_l;
-        g = g_p + g_l;
-        e = e_p + e_l;
-//        H = H_p;
-//        g = g_p;
-//        e = e_p;
-//        e /= N_p;
-
-        // normalize error
-        e /= (N_l+N_p);
-
-//        std::cout<<"Point Num: "<<N_p<<"    "<<"Point err: "<<e_p<<std::endl;
-//        std::cout<<"Pluker Line Num: "<<N_l<<"    "<<"Line err: "<<e_l<<std::endl;
+    robustNormalEquations( true, DT, H, g, e );
 }
 
 void StereoFrameHandler::gaussNewtonOptimizationforPluker(Matrix4d &DT, Matrix6d &DT_cov, double &err_, int max_iters)
 {
+    buildPoseObservations();
+
     Matrix4d DT_;
     Matrix6d H;
     Vector6d g, DT_inc;
@@ -816,8 +1081,10 @@ void StereoFrameHandler::gaussNewtonOptimizationforPluker(Matrix4d &DT, Matrix6d
         // estimate hessian and gradient (select)
         //optimizeFunctionsRobust( DT, H, g, err );
         optimizeFunctionsUsingPluker(DT, H, g, err);
+        Profiler::instance().addCount("StereoFrameHandler::poseIterations");
+        pose_iters++;
         // if the difference is very small stop
-        if( ( fabs(err-err_prev) < Config::minErrorChange() ) || ( err < Config::minError()) )// || err > err_prev )
+        if( smallErrorChange( err, err_prev ) )// || err > err_prev )
             break;
         // update step
         ColPivHouseholderQR<Matrix6d> solver(H);
@@ -833,7 +1100,7 @@ void StereoFrameHandler::gaussNewtonOptimizationforPluker(Matrix4d &DT, Matrix6d
 //       DT.block<3,3>(0,0) = expmap_se3(DT_inc).block(0,0,3,3).inverse() * DT.block<3,3>(0,0);
 //       DT.block<3,1>(0,3) = DT.block<3,1>(0,3) - DT_inc.head(3);
        // if the parameter change is small stop (TODO: change with two parameters, one for R and another one for t)
-       if( DT_inc.norm() < Config::minErrorChange() )
+       if( smallPoseStep( DT_inc ) )
            break;
        // update previous values
        err_prev = err;
@@ -852,428 +1119,325 @@ void StereoFrameHandler::gaussNewtonOptimizationforPluker(Matrix4d &DT, Matrix6d
     }
 }
 
-void StereoFrameHandler::optimizeFunctions(Matrix4d DT, Matrix6d &H, Vector6d &g, double &e )
+void PoseObservations::reserve( int n_pt_, int n_ls_ )
 {
+    n_pt = n_pt_;
+    n_ls = n_ls_;
+    reserveCols( P, n_pt );
+    reserveCols( P_, n_pt );
+    reserveCols( pl_obs, n_pt );
+    reserveCols( sigma2_pt, n_pt );
+    reserveCols( J_pt, n_pt );
+    reserveCols( r_pt, n_pt );
+    reserveCols( sP, n_ls );
+    reserveCols( eP, n_ls );
+    reserveCols( le_obs, n_ls );
+    reserveCols( spl, n_ls );
+    reserveCols( epl, n_ls );
+    reserveCols( spl_obs, n_ls );
+    reserveCols( epl_obs, n_ls );
+    reserveCols( NDc, n_ls );
+    reserveCols( sigma2_ls, n_ls );
+    reserveCols( J_ls, n_ls );
+    reserveCols( r_ls, n_ls );
+    reserveCols( overlap_ls, n_ls );
+    int n = std::max( n_pt, n_ls );
+    reserveCols( Jw, n );
+    reserveCols( w, n );
+    reserveCols( rw, n );
+}
 
-    // define hessians, gradients, and residuals
-    Matrix6d H_l, H_p;
-    Vector6d g_l, g_p;
-    double   e_l = 0.0, e_p = 0.0, S_l, S_p;
-    H   = Matrix6d::Zero(); H_l = H; H_p = H;
-    g   = Vector6d::Zero(); g_l = g; g_p = g;
-    e   = 0.0;
-
-    // point features
-    int N_p = 0;
+size_t PoseObservations::bytes() const
+{
+    size_t n = P.size() + P_.size() + pl_obs.size() + sigma2_pt.size()
+             + sP.size() + eP.size() + le_obs.size() + spl.size() + epl.size() + spl_obs.size() + epl_obs.size()
+             + NDc.size() + sigma2_ls.size() + J_pt.size() + J_ls.size() + Jw.size()
+             + r_pt.size() + r_ls.size() + overlap_ls.size() + w.size() + rw.size();
+    return n * sizeof(PoseScalar) + vectorBytes(res);
+}
 
-    for( auto it = matched_pt.begin(); it!=matched_pt.end(); it++)
+void StereoFrameHandler::buildPoseObservations()
+{
+    int n_pt = 0, n_ls = 0;
+    for( auto pt : matched_pt )
+        if( pt->inlier ) n_pt++;
+    for( auto ls : matched_ls )
+        if( ls->inlier ) n_ls++;
+    pose_obs.reserve( n_pt, n_ls );
+
+    int i = 0;
+    for( auto pt : matched_pt )
     {
-        if( (*it)->inlier )
-        {
-            Vector3d P_ = DT.block(0,0,3,3) * (*it)->P + DT.col(3).head(3);
-            Vector2d pl_proj = cam->projection( P_ );
-            // projection error
-            Vector2d err_i    = pl_proj - (*it)->pl_obs;
-            double err_i_norm = err_i.norm();
-            // estimate variables for J, H, and g
-            double gx   = P_(0);
-            double gy   = P_(1);
-            double gz   = P_(2);
-            double gz2  = gz*gz;
-            double fgz2 = cam->getFx() / std::max(Config::homogTh(),gz2);
-            double dx   = err_i(0);
-            double dy   = err_i(1);
-            // jacobian
-            Vector6d J_aux;
-            J_aux << + fgz2 * dx * gz,
-                     + fgz2 * dy * gz,
-                     - fgz2 * ( gx*dx + gy*dy ),
-                     - fgz2 * ( gx*gy*dx + gy*gy*dy + gz*gz*dy ),
-                     + fgz2 * ( gx*gx*dx + gz*gz*dx + gx*gy*dy ),
-                     + fgz2 * ( gx*gz*dy - gy*gz*dx );
-            J_aux = J_aux / std::max(Config::homogTh(),err_i_norm);
-            // define the residue
-            double s2 = (*it)->sigma2;
-            double r = err_i_norm * sqrt(s2);
-            // if employing robust cost function
-            double w  = 1.0;
-            w = robustWeightCauchy(r) ;
-
-            // if down-weighting far samples
-            //double zdist   = P_(2) * 1.0 / ( cam->getB()*cam->getFx());
-            //if( false ) w *= 1.0 / ( s2 + zdist * zdist );
-
-            // update hessian, gradient, and error
-            H_p += J_aux * J_aux.transpose() * w;
-            g_p += J_aux * r * w;
-            e_p += r * r * w;
-            N_p++;
-        }
+        if( !pt->inlier ) continue;
+        pose_obs.P.col(i)         = pt->P.cast<PoseScalar>();
+        pose_obs.pl_obs.col(i)    = pt->pl_obs.cast<PoseScalar>();
+        pose_obs.sigma2_pt(i)     = pt->sigma2;
+        i++;
     }
 
-    // line segment features
-    int N_l = 0;
-    for( auto it = matched_ls.begin(); it!=matched_ls.end(); it++)
+    i = 0;
+    for( auto ls : matched_ls )
     {
-        if( (*it)->inlier )
-        {
-            Vector3d sP_ = DT.block(0,0,3,3) * (*it)->sP + DT.col(3).head(3);
-            Vector2d spl_proj = cam->projection( sP_ );
-            Vector3d eP_ = DT.block(0,0,3,3) * (*it)->eP + DT.col(3).head(3);
-            Vector2d epl_proj = cam->projection( eP_ );
-            Vector3d l_obs = (*it)->le_obs;
-            // projection error
-            Vector2d err_i;
-            err_i(0) = l_obs(0) * spl_proj(0) + l_obs(1) * spl_proj(1) + l_obs(2);
-            err_i(1) = l_obs(0) * epl_proj(0) + l_obs(1) * epl_proj(1) + l_obs(2);
-            double err_i_norm = err_i.norm();
-            // estimate variables for J, H, and g
-            // -- start point
-            double gx   = sP_(0);
-            double gy   = sP_(1);
-            double gz   = sP_(2);
-            double gz2  = gz*gz;
-            double fgz2 = cam->getFx() / std::max(Config::homogTh(),gz2);
-            double ds   = err_i(0);
-            double de   = err_i(1);
-            double lx   = l_obs(0);
-            double ly   = l_obs(1);
-            Vector6d Js_aux;
-            Js_aux << + fgz2 * lx * gz,
-                      + fgz2 * ly * gz,
-                      - fgz2 * ( gx*lx + gy*ly ),
-                      - fgz2 * ( gx*gy*lx + gy*gy*ly + gz*gz*ly ),
-                      + fgz2 * ( gx*gx*lx + gz*gz*lx + gx*gy*ly ),
-                      + fgz2 * ( gx*gz*ly - gy*gz*lx );
-            // -- end point
-            gx   = eP_(0);
-            gy   = eP_(1);
-            gz   = eP_(2);
-            gz2  = gz*gz;
-            fgz2 = cam->getFx() / std::max(Config::homogTh(),gz2);
-            Vector6d Je_aux, J_aux;
-            Je_aux << + fgz2 * lx * gz,
-                      + fgz2 * ly * gz,
-                      - fgz2 * ( gx*lx + gy*ly ),
-                      - fgz2 * ( gx*gy*lx + gy*gy*ly + gz*gz*ly ),
-                      + fgz2 * ( gx*gx*lx + gz*gz*lx + gx*gy*ly ),
-                      + fgz2 * ( gx*gz*ly - gy*gz*lx );
-            // jacobian
-            J_aux = ( Js_aux * ds + Je_aux * de ) / std::max(Config::homogTh(),err_i_norm);
-
-            // define the residue
-            double s2 = (*it)->sigma2;
-            double r = err_i_norm * sqrt(s2);
-
-            // if employing robust cost function
-            double w  = 1.0;
-            w = robustWeightCauchy(r) ;
-
-            // estimating overlap between line segments
-            bool has_overlap = true;
-            double overlap = prev_frame->lineSegmentOverlap( (*it)->spl, (*it)->epl, spl_proj, epl_proj );
-            if( has_overlap )
-                w *= overlap;
-
-            // if down-weighting far samples
-            /*double zdist = max( sP_(2), eP_(2) ) / ( cam->getB()*cam->getFx());
-            if( false )
-                w *= 1.0 / ( s2 + zdist * zdist );*/
-
-            // update hessian, gradient, and error
-            H_l += J_aux * J_aux.transpose() * w;
-            g_l += J_aux * r * w;
-            e_l += r * r * w;
-            N_l++;
-        }
-
+        if( !ls->inlier ) continue;
+        pose_obs.sP.col(i)        = ls->sP.cast<PoseScalar>();
+        pose_obs.eP.col(i)        = ls->eP.cast<PoseScalar>();
+        pose_obs.le_obs.col(i)    = ls->le_obs.cast<PoseScalar>();
+        pose_obs.spl.col(i)       = ls->spl.cast<PoseScalar>();
+        pose_obs.epl.col(i)       = ls->epl.cast<PoseScalar>();
+        pose_obs.spl_obs.col(i)   = ls->spl_obs.cast<PoseScalar>();
+        pose_obs.epl_obs.col(i)   = ls->epl_obs.cast<PoseScalar>();
+        pose_obs.NDc.col(i)       = ls->NDc.cast<PoseScalar>();
+        pose_obs.sigma2_ls(i)     = ls->sigma2;
+        i++;
     }
+}
 
-    // sum H, g and err from both points and lines
-    H = H_p + H_l;
-    g = g_p + g_l;
-    e = e_p + e_l;
+void StereoFrameHandler::pointJacobians( const Matrix4d &DT )
+{
+    const int n = pose_obs.n_pt;
+    if( n == 0 ) return;
 
-    // normalize error
-    e /= (N_l+N_p);
+    // transform all the points at once
+    pose_obs.P_.leftCols(n).noalias() = DT.block<3,3>(0,0).cast<PoseScalar>() * pose_obs.P.leftCols(n);
+    pose_obs.P_.leftCols(n).colwise() += DT.block<3,1>(0,3).cast<PoseScalar>();
 
-//    H = H_p;
-//    g = g_p;
-//    e = e_p;
-//
-//    e/= N_p;
-    std::cout<<"Point Num: "<<N_p<<"    "<<"Point err: "<<e_p<<std::endl;
-    std::cout<<"Line Num: "<<N_l<<"    "<<"Line err: "<<e_l<<std::endl;
+    const PoseScalar fx = cam->getFx(), fy = cam->getFy(), cx = cam->getCx(), cy = cam->getCy();
+    const PoseScalar homog_th = Config::homogTh();
+    for( int i = 0; i < n; i++ )
+    {
+        const PoseScalar gx  = pose_obs.P_(0,i);
+        const PoseScalar gy  = pose_obs.P_(1,i);
+        const PoseScalar gz  = pose_obs.P_(2,i);
+        // projection error
+        const PoseScalar dx  = cx + fx * gx / gz - pose_obs.pl_obs(0,i);
+        const PoseScalar dy  = cy + fy * gy / gz - pose_obs.pl_obs(1,i);
+        const PoseScalar err_i_norm = std::sqrt( dx*dx + dy*dy );
+        // jacobian
+        const PoseScalar fgz2 = fx / std::max(homog_th,gz*gz) / std::max(homog_th,err_i_norm);
+        pose_obs.J_pt(0,i) = + fgz2 * dx * gz;
+        pose_obs.J_pt(1,i) = + fgz2 * dy * gz;
+        pose_obs.J_pt(2,i) = - fgz2 * ( gx*dx + gy*dy );
+        pose_obs.J_pt(3,i) = - fgz2 * ( gx*gy*dx + gy*gy*dy + gz*gz*dy );
+        pose_obs.J_pt(4,i) = + fgz2 * ( gx*gx*dx + gz*gz*dx + gx*gy*dy );
+        pose_obs.J_pt(5,i) = + fgz2 * ( gx*gz*dy - gy*gz*dx );
+        pose_obs.r_pt(i)   = err_i_norm;
+    }
+}
 
+void StereoFrameHandler::lineJacobians( const Matrix4d &DT )
+{
+    const int n = pose_obs.n_ls;
+    if( n == 0 ) return;
+
+    const Matrix3d R = DT.block<3,3>(0,0);
+    const Vector3d t = DT.block<3,1>(0,3);
+    const double fx = cam->getFx();
+    const double homog_th = Config::homogTh();
+    for( int i = 0; i < n; i++ )
+    {
+        // per-line math in double, only the storage follows PoseScalar
+        Vector3d sP_ = R * pose_obs.sP.col(i).cast<double>() + t;
+        Vector3d eP_ = R * pose_obs.eP.col(i).cast<double>() + t;
+        Vector2d spl_proj = cam->projection( sP_ );
+        Vector2d epl_proj = cam->projection( eP_ );
+        const double lx = pose_obs.le_obs(0,i);
+        const double ly = pose_obs.le_obs(1,i);
+        const double lz = pose_obs.le_obs(2,i);
+        // projection error
+        const double ds = lx * spl_proj(0) + ly * spl_proj(1) + lz;
+        const double de = lx * epl_proj(0) + ly * epl_proj(1) + lz;
+        const double err_i_norm = sqrt( ds*ds + de*de );
+        // jacobian (start and end point contributions)
+        double gx = sP_(0), gy = sP_(1), gz = sP_(2);
+        double fs = fx / std::max(homog_th,gz*gz) * ds;
+        Vector6d J_aux;
+        J_aux << + fs * lx * gz,
+                 + fs * ly * gz,
+                 - fs * ( gx*lx + gy*ly ),
+                 - fs * ( gx*gy*lx + gy*gy*ly + gz*gz*ly ),
+                 + fs * ( gx*gx*lx + gz*gz*lx + gx*gy*ly ),
+                 + fs * ( gx*gz*ly - gy*gz*lx );
+        gx = eP_(0); gy = eP_(1); gz = eP_(2);
+        double fe = fx / std::max(homog_th,gz*gz) * de;
+        J_aux(0) += + fe * lx * gz;
+        J_aux(1) += + fe * ly * gz;
+        J_aux(2) += - fe * ( gx*lx + gy*ly );
+        J_aux(3) += - fe * ( gx*gy*lx + gy*gy*ly + gz*gz*ly );
+        J_aux(4) += + fe * ( gx*gx*lx + gz*gz*lx + gx*gy*ly );
+        J_aux(5) += + fe * ( gx*gz*ly - gy*gz*lx );
+        pose_obs.J_ls.col(i)    = ( J_aux / std::max(homog_th,err_i_norm) ).cast<PoseScalar>();
+        pose_obs.r_ls(i)        = err_i_norm;
+        // overlap between the observed and the projected segments
+        pose_obs.overlap_ls(i)  = prev_frame->lineSegmentOverlap( pose_obs.spl.col(i).cast<double>(), pose_obs.epl.col(i).cast<double>(), spl_proj, epl_proj );
+    }
 }
 
-void StereoFrameHandler::optimizeFunctionsRobust(Matrix4d DT, Matrix6d &H, Vector6d &g, double &e )
+void StereoFrameHandler::plukerLineJacobians( const Matrix4d &DT )
+{
+    const int n = pose_obs.n_ls;
+    if( n == 0 ) return;
+
+    const Matrix3d R = DT.block<3,3>(0,0);
+    const Vector3d t = DT.block<3,1>(0,3);
+    const Matrix3d t_hat = vectorHat(t);
+    const Matrix3d &K = cam->getPlukerK();
+    const double homog_th = Config::homogTh();
+    for( int i = 0; i < n; i++ )
+    {
+        Vector2d spl_proj = cam->projection( R * pose_obs.sP.col(i).cast<double>() + t );
+        Vector2d epl_proj = cam->projection( R * pose_obs.eP.col(i).cast<double>() + t );
+
+        // line in the current frame projected to the current image
+        Vector3d Rn = R * pose_obs.NDc.block<3,1>(0,i).cast<double>();
+        Vector3d Rd = R * pose_obs.NDc.block<3,1>(3,i).cast<double>();
+        Vector3d pixel_line_curr = K * ( Rn + t_hat * Rd );
+        const double lx = pixel_line_curr[0];
+        const double ly = pixel_line_curr[1];
+        const double lz = pixel_line_curr[2];
+        const double fm = 1.0 / sqrt(lx*lx + ly*ly);
+
+        const double a0 = pose_obs.spl_obs(0,i), b0 = pose_obs.spl_obs(1,i);
+        const double a1 = pose_obs.epl_obs(0,i), b1 = pose_obs.epl_obs(1,i);
+        const double err0 = ( a0 * lx + b0 * ly + lz ) * fm;
+        const double err1 = ( a1 * lx + b1 * ly + lz ) * fm;
+        const double err_i_norm = sqrt(err0*err0 + err1*err1);
+
+        // d(err)/d(pixel line) stacked for both endpoints, then chained with K and d(line)/d(pose)
+        Matrix<double,1,3> fai_e_pixelLineCurr;
+        fai_e_pixelLineCurr << ( a0*fm-lx*err0*fm*fm ) * err0 + ( a1*fm-lx*err1*fm*fm ) * err1,
+                               ( b0*fm-ly*err0*fm*fm ) * err0 + ( b1*fm-ly*err1*fm*fm ) * err1,
+                               fm * ( err0 + err1 );
+        Matrix<double,1,3> fai_e_lineCurr = fai_e_pixelLineCurr * K;
+
+        Matrix<double,1,6> jac;
+        jac.head<3>() = - fai_e_lineCurr * vectorHat(Rd);
+        jac.tail<3>() = - fai_e_lineCurr * ( vectorHat(Rn) + t_hat * vectorHat(Rd) );
+
+        pose_obs.J_ls.col(i)    = ( jac.transpose() / std::max(homog_th,err_i_norm) ).cast<PoseScalar>();
+        pose_obs.r_ls(i)        = err_i_norm;
+        pose_obs.overlap_ls(i)  = prev_frame->lineSegmentOverlap( pose_obs.spl.col(i).cast<double>(), pose_obs.epl.col(i).cast<double>(), spl_proj, epl_proj );
+    }
+}
+
+void StereoFrameHandler::optimizeFunctions(Matrix4d DT, Matrix6d &H, Vector6d &g, double &e )
 {
 
     // define hessians, gradients, and residuals
-    Matrix6d H_l, H_p;
-    Vector6d g_l, g_p;
-    double   e_l = 0.0, e_p = 0.0, S_l, S_p;
-    H   = Matrix6d::Zero(); H_l = H; H_p = H;
-    g   = Vector6d::Zero(); g_l = g; g_p = g;
-    e   = 0.0;
+    double e_l = 0.0, e_p = 0.0;
+    H = Matrix6d::Zero();
+    g = Vector6d::Zero();
+    e = 0.0;
 
-    vector<double> res_p, res_l;
+    pointJacobians( DT );
+    lineJacobians( DT );
+    const int N_p = pose_obs.n_pt, N_l = pose_obs.n_ls;
 
-    // point features pre-weight computation
-    for( auto it = matched_pt.begin(); it!=matched_pt.end(); it++)
+    // point features
+    for( int i = 0; i < N_p; i++ )
     {
-        if( (*it)->inlier )
-        {
-            Vector3d P_ = DT.block(0,0,3,3) * (*it)->P + DT.col(3).head(3);
-            Vector2d pl_proj = cam->projection( P_ );
-            // projection error
-            Vector2d err_i    = pl_proj - (*it)->pl_obs;
-            res_p.push_back( err_i.norm());
-        }
+        double r = pose_obs.r_pt(i) * sqrt( pose_obs.sigma2_pt(i) );
+        double w = robustWeightCauchy( r );
+        pose_obs.w(i)  = w;
+        pose_obs.rw(i) = r;
+        e_p += r * r * w;
     }
+    accumulateNormalEquations( pose_obs.J_pt, pose_obs.rw, pose_obs.w, N_p, pose_obs.Jw, H, g );
 
-    // line segment features pre-weight computation
-    for( auto it = matched_ls.begin(); it!=matched_ls.end(); it++)
+    // line segment features (weighted by the overlap with the projected segment)
+    for( int i = 0; i < N_l; i++ )
     {
-        if( (*it)->inlier )
-        {
-            Vector3d sP_ = DT.block(0,0,3,3) * (*it)->sP + DT.col(3).head(3);
-            Vector2d spl_proj = cam->projection( sP_ );
-            Vector3d eP_ = DT.block(0,0,3,3) * (*it)->eP + DT.col(3).head(3);
-            Vector2d epl_proj = cam->projection( eP_ );
-            Vector3d l_obs = (*it)->le_obs;
-            // projection error
-            Vector2d err_i;
-            err_i(0) = l_obs(0) * spl_proj(0) + l_obs(1) * spl_proj(1) + l_obs(2);
-            err_i(1) = l_obs(0) * epl_proj(0) + l_obs(1) * epl_proj(1) + l_obs(2);
-            res_l.push_back( err_i.norm() );
-        }
-
+        double r = pose_obs.r_ls(i) * sqrt( pose_obs.sigma2_ls(i) );
+        double w = robustWeightCauchy( r ) * pose_obs.overlap_ls(i);
+        pose_obs.w(i)  = w;
+        pose_obs.rw(i) = r;
+        e_l += r * r * w;
     }
+    accumulateNormalEquations( pose_obs.J_ls, pose_obs.rw, pose_obs.w, N_l, pose_obs.Jw, H, g );
 
-    // estimate scale of the residuals
-    double s_p = 1.0, s_l = 1.0;
-    double th_min = 0.0001;
-    double th_max = sqrt(7.815);
-
-    if( false )
-    {
-
-        res_p.insert( res_p.end(), res_l.begin(), res_l.end() );
-        s_p = vector_stdv_mad( res_p );
-
-        //cout << s_p << "\t";
-        //if( res_p.size() < 4*Config::minFeatures() )
-            //s_p = 1.0;
-        //cout << s_p << endl;
-
-        if( s_p < th_min )
-            s_p = th_min;
-        if( s_p > th_max )
-            s_p = th_max;
+    // normalize error
+    e = ( e_p + e_l ) / ( N_l + N_p );
 
-        s_l = s_p;
+    LOG_DEBUG( "Point Num: " << N_p << "    " << "Point err: " << e_p );
+    LOG_DEBUG( "Line Num: " << N_l << "    " << "Line err: " << e_l );
 
-    }
-    else
-    {
+}
 
-        s_p = vector_stdv_mad( res_p );
-        s_l = vector_stdv_mad( res_l );
+void StereoFrameHandler::optimizeFunctionsRobust(Matrix4d DT, Matrix6d &H, Vector6d &g, double &e )
+{
+    robustNormalEquations( false, DT, H, g, e );
+}
 
-        if( s_p < th_min )
-            s_p = th_min;
-        if( s_p > th_max )
-            s_p = th_max;
+template< int F >
+void StereoFrameHandler::robustNormalEquations( const Matrix4d &DT, Matrix6d &H, Vector6d &g, double &e )
+{
+    // compile-time constants, the branches of the other configurations are removed
+    const bool has_pt = ( F & POSE_POINTS ) != 0;
+    const bool has_ls = ( F & POSE_LINES  ) != 0;
+    const bool pluker = ( F & POSE_PLUKER ) != 0;
 
-        if( s_l < th_min )
-            s_l = th_min;
-        if( s_l > th_max )
-            s_l = th_max;
+    // define hessians, gradients, and residuals
+    double e_l = 0.0, e_p = 0.0;
+    H = Matrix6d::Zero();
+    g = Vector6d::Zero();
+    e = 0.0;
 
-    }
+    const int N_p = has_pt ? pose_obs.n_pt : 0;
+    const int N_l = has_ls ? pose_obs.n_ls : 0;
 
     // point features
-    int N_p = 0;
-    for( auto it = matched_pt.begin(); it!=matched_pt.end(); it++)
+    if( has_pt )
     {
-        if( (*it)->inlier )
+        pointJacobians( DT );
+        // estimate scale of the residuals
+        double s_p = residualScale( pose_obs.r_pt, N_p, pose_obs.res );
+        for( int i = 0; i < N_p; i++ )
         {
-            Vector3d P_ = DT.block(0,0,3,3) * (*it)->P + DT.col(3).head(3);
-            Vector2d pl_proj = cam->projection( P_ );
-            // projection error
-            Vector2d err_i    = pl_proj - (*it)->pl_obs;
-            double err_i_norm = err_i.norm();
-            // estimate variables for J, H, and g
-            double gx   = P_(0);
-            double gy   = P_(1);
-            double gz   = P_(2);
-            double gz2  = gz*gz;
-            double fgz2 = cam->getFx() / std::max(Config::homogTh(),gz2);
-            double dx   = err_i(0);
-            double dy   = err_i(1);
-            // jacobian
-            Vector6d J_aux;
-            J_aux << + fgz2 * dx * gz,
-                     + fgz2 * dy * gz,
-                     - fgz2 * ( gx*dx + gy*dy ),
-                     - fgz2 * ( gx*gy*dx + gy*gy*dy + gz*gz*dy ),
-                     + fgz2 * ( gx*gx*dx + gz*gz*dx + gx*gy*dy ),
-                     + fgz2 * ( gx*gz*dy - gy*gz*dx );
-            J_aux = J_aux / std::max(Config::homogTh(),err_i_norm);
-            // define the residue
-            double s2 = (*it)->sigma2;
-            double r = err_i_norm ;
-            // if employing robust cost function
-            double w  = 1.0;
-            double x = r / s_p;
-            w = robustWeightCauchy(x) ;
-
-            // if using uncertainty weights
-            //----------------------------------------------------
-            if( false )
-            {
-                Matrix2d covp;
-                Matrix3d covP_ = (*it)->covP_an;
-                MatrixXd J_Pp(2,3), J_pr(1,2);
-                // uncertainty of the projection
-                J_Pp  << gz, 0.f, -gx, 0.f, gz, -gy;
-                J_Pp  << J_Pp * DT.block(0,0,3,3);
-                covp  << J_Pp * covP_ * J_Pp.transpose();
-                covp  << covp / std::max(Config::homogTh(),gz2*gz2);               // Covariance of the 3D projection \hat{p} up to f2*b2*sigma2
-                covp  = sqrt(s2) * cam->getB()* cam->getFx() * covp;
-                covp(0,0) += s2;
-                covp(1,1) += s2;
-                // Point Uncertainty constants
-                /*bsigmaP   = f * baseline * sigmaP;
-                bsigmaP   = bsigmaP * bsigmaP;
-                bsigmaP_inv   = 1.f / bsigmaP;
-                sigmaP2       = sigmaP * sigmaP;
-                sigmaP2_inv   = 1.f / sigmaP2;
-                // Line Uncertainty constants
-                bsigmaL   = baseline * sigmaL;
-                bsigmaL   = bsigmaL * bsigmaL;
-                bsigmaL_inv   = 1.f / bsigmaL;*/
-                // uncertainty of the residual
-                J_pr << dx / r, dy / r;
-                double cov_res = (J_pr * covp * J_pr.transpose())(0);
-                cov_res = 1.0 / std::max(Config::homogTh(),cov_res);
-                double zdist   = P_(2) * 1.0 / ( cam->getB()*cam->getFx());
-
-                //zdist   = 1.0 / std::max(Config::homogTh(),zdist);
-                /*cout.setf(ios::fixed,ios::floatfield); cout.precision(8);
-                cout << endl << cov_res << " " << 1.0 / cov_res << " " << zdist << " " << 1.0 / zdist << " " << 1.0 / (zdist*40.0) << "\t"
-                     << 1.0 / ( 1.0 +  cov_res * cov_res + zdist * zdist ) << " \t"
-                     << 1.0 / ( cov_res * cov_res + zdist * zdist )
-                     << endl;
-                cout.setf(ios::fixed,ios::floatfield); cout.precision(3);*/
-                //w *= 1.0 / ( cov_res * cov_res + zdist * zdist );
-                w *= 1.0 / ( s2 + zdist * zdist );
-            }
-
-
-            //----------------------------------------------------
-
-            // update hessian, gradient, and error
-            H_p += J_aux * J_aux.transpose() * w;
-            g_p += J_aux * r * w;
+            double r = pose_obs.r_pt(i);
+            double w = robustWeightCauchy( r / s_p );
+            pose_obs.w(i)  = w;
+            pose_obs.rw(i) = r;
             e_p += r * r * w;
-            N_p++;
         }
+        accumulateNormalEquations( pose_obs.J_pt, pose_obs.rw, pose_obs.w, N_p, pose_obs.Jw, H, g );
     }
 
-    // line segment features
-    int N_l = 0;
-    for( auto it = matched_ls.begin(); it!=matched_ls.end(); it++)
+    // line segment features (weighted by the overlap with the projected segment)
+    if( has_ls )
     {
-        if( (*it)->inlier )
+        if( pluker )
+            plukerLineJacobians( DT );
+        else
+            lineJacobians( DT );
+        double s_l = residualScale( pose_obs.r_ls, N_l, pose_obs.res );
+        for( int i = 0; i < N_l; i++ )
         {
-            Vector3d sP_ = DT.block(0,0,3,3) * (*it)->sP + DT.col(3).head(3);
-            Vector2d spl_proj = cam->projection( sP_ );
-            Vector3d eP_ = DT.block(0,0,3,3) * (*it)->eP + DT.col(3).head(3);
-            Vector2d epl_proj = cam->projection( eP_ );
-            Vector3d l_obs = (*it)->le_obs;
-            // projection error
-            Vector2d err_i;
-            err_i(0) = l_obs(0) * spl_proj(0) + l_obs(1) * spl_proj(1) + l_obs(2);
-            err_i(1) = l_obs(0) * epl_proj(0) + l_obs(1) * epl_proj(1) + l_obs(2);
-            double err_i_norm = err_i.norm();
-            // estimate variables for J, H, and g
-            // -- start point
-            double gx   = sP_(0);
-            double gy   = sP_(1);
-            double gz   = sP_(2);
-            double gz2  = gz*gz;
-            double fgz2 = cam->getFx() / std::max(Config::homogTh(),gz2);
-            double ds   = err_i(0);
-            double de   = err_i(1);
-            double lx   = l_obs(0);
-            double ly   = l_obs(1);
-            Vector6d Js_aux;
-            Js_aux << + fgz2 * lx * gz,
-                      + fgz2 * ly * gz,
-                      - fgz2 * ( gx*lx + gy*ly ),
-                      - fgz2 * ( gx*gy*lx + gy*gy*ly + gz*gz*ly ),
-                      + fgz2 * ( gx*gx*lx + gz*gz*lx + gx*gy*ly ),
-                      + fgz2 * ( gx*gz*ly - gy*gz*lx );
-            // -- end point
-            gx   = eP_(0);
-            gy   = eP_(1);
-            gz   = eP_(2);
-            gz2  = gz*gz;
-            fgz2 = cam->getFx() / std::max(Config::homogTh(),gz2);
-            Vector6d Je_aux, J_aux;
-            Je_aux << + fgz2 * lx * gz,
-                      + fgz2 * ly * gz,
-                      - fgz2 * ( gx*lx + gy*ly ),
-                      - fgz2 * ( gx*gy*lx + gy*gy*ly + gz*gz*ly ),
-                      + fgz2 * ( gx*gx*lx + gz*gz*lx + gx*gy*ly ),
-                      + fgz2 * ( gx*gz*ly - gy*gz*lx );
-            // jacobian
-            J_aux = ( Js_aux * ds + Je_aux * de ) / std::max(Config::homogTh(),err_i_norm);
-            // define the residue
-            double s2 = (*it)->sigma2;
-            double r = err_i_norm;
-            // if employing robust cost function
-            double w  = 1.0;
-            double x = r / s_l;
-            w = robustWeightCauchy(x) ;
-            // estimating overlap between line segments
-            bool has_overlap = true;
-            double overlap = prev_frame->lineSegmentOverlap( (*it)->spl, (*it)->epl, spl_proj, epl_proj );
-            if( has_overlap )
-                w *= overlap;
-
-            //----------------- DEBUG: 27/11/2017 ----------------------
-            if( false )
-            {
-                //double cov3d = (*it)->cov3d;
-                //cov3d = 1.0;
-                //w *= 1.0 / ( 1.0 +  cov3d * cov3d + zdist * zdist );
-                double zdist = max( sP_(2), eP_(2) ) / ( cam->getB()*cam->getFx());
-                w *= 1.0 / ( s2 + zdist * zdist );
-            }
-            //----------------------------------------------------------
-
-            // update hessian, gradient, and error
-            H_l += J_aux * J_aux.transpose() * w;
-            g_l += J_aux * r * w;
+            double r = pose_obs.r_ls(i);
+            double w = robustWeightCauchy( r / s_l ) * pose_obs.overlap_ls(i);
+            pose_obs.w(i)  = w;
+            pose_obs.rw(i) = pluker ? r * sqrt( pose_obs.sigma2_ls(i) ) : r;
             e_l += r * r * w;
-            N_l++;
         }
-
+        accumulateNormalEquations( pose_obs.J_ls, pose_obs.rw, pose_obs.w, N_l, pose_obs.Jw, H, g );
     }
 
-    // sum H, g and err from both points and lines
-    H = H_p + H_l;
-    g = g_p + g_l;
-    e = e_p + e_l;
-
     // normalize error
-    e /= (N_l+N_p);
-//    std::cout<<"Point Num: "<<N_p<<"    "<<"Point err: "<<e_p<<std::endl;
-//    std::cout<<"Line Num: "<<N_l<<"    "<<"Robust Line err: "<<e_l<<std::endl;
+    e = ( e_p + e_l ) / ( N_l + N_p );
+}
+
+void StereoFrameHandler::robustNormalEquations( bool pluker, const Matrix4d &DT, Matrix6d &H, Vector6d &g, double &e )
+{
+    if( Config::hasPoints() && !Config::hasLines() )
+        robustNormalEquations< POSE_POINTS >( DT, H, g, e );
+    else if( !Config::hasPoints() && Config::hasLines() )
+    {
+        if( pluker ) robustNormalEquations< POSE_LINES | POSE_PLUKER >( DT, H, g, e );
+        else         robustNormalEquations< POSE_LINES >( DT, H, g, e );
+    }
+    else
+    {
+        if( pluker ) robustNormalEquations< POSE_POINTS | POSE_LINES | POSE_PLUKER >( DT, H, g, e );
+        else         robustNormalEquations< POSE_POINTS | POSE_LINES >( DT, H, g, e );
+    }
 }
 
 void StereoFrameHandler::resetOutliers() {
@@ -1341,22 +1505,25 @@ void StereoFrameHandler::removeOutliers(Matrix4d DT)
         // line segment features
         vector<double> res_l;
         res_l.reserve(matched_ls.size());
+        const bool pluker = Config::plukerLines();
         int iter = 0;
         for( auto it = matched_ls.begin(); it!=matched_ls.end(); it++, iter++)
         {
-#ifdef USE_LINE_PLUKER
-            //line in curr frame
-            Vector6d pluker_line_curr = TransformForPluker(DT, (*it)->NDc);
-            //line project to curr image
-            Vector3d pixel_line_curr = cam->getPlukerK() * pluker_line_curr.head(3);
-
-            double err0 = (*it)->spl_obs[0] * pixel_line_curr[0] + (*it)->spl_obs[1] * pixel_line_curr[1] + pixel_line_curr[2];
-            err0 = err0 / (sqrt(pixel_line_curr[0]*pixel_line_curr[0]+pixel_line_curr[1]*pixel_line_curr[1]));
-
-            double err1 = (*it)->epl_obs[0] * pixel_line_curr[0] + (*it)->epl_obs[1] * pixel_line_curr[1] + pixel_line_curr[2];
-            err1 = err1 / (sqrt(pixel_line_curr[0]*pixel_line_curr[0] + pixel_line_curr[1]*pixel_line_curr[1]));
-            res_l.push_back( sqrt(err0*err0+err1*err1) * sqrt( (*it)->sigma2) );
-#else
+            if( pluker )
+            {
+                //line in curr frame
+                Vector6d pluker_line_curr = TransformForPluker(DT, (*it)->NDc);
+                //line project to curr image
+                Vector3d pixel_line_curr = cam->getPlukerK() * pluker_line_curr.head(3);
+
+                double err0 = (*it)->spl_obs[0] * pixel_line_curr[0] + (*it)->spl_obs[1] * pixel_line_curr[1] + pixel_line_curr[2];
+                err0 = err0 / (sqrt(pixel_line_curr[0]*pixel_line_curr[0]+pixel_line_curr[1]*pixel_line_curr[1]));
+
+                double err1 = (*it)->epl_obs[0] * pixel_line_curr[0] + (*it)->epl_obs[1] * pixel_line_curr[1] + pixel_line_curr[2];
+                err1 = err1 / (sqrt(pixel_line_curr[0]*pixel_line_curr[0] + pixel_line_curr[1]*pixel_line_curr[1]));
+                res_l.push_back( sqrt(err0*err0+err1*err1) * sqrt( (*it)->sigma2) );
+                continue;
+            }
             // projection error
             Vector3d sP_ = DT.block(0,0,3,3) * (*it)->sP + DT.col(3).head(3);
             Vector3d eP_ = DT.block(0,0,3,3) * (*it)->eP + DT.col(3).head(3);
@@ -1368,7 +1535,6 @@ void StereoFrameHandler::removeOutliers(Matrix4d DT)
             err_li(1) = l_obs(0) * epl_proj(0) + l_obs(1) * epl_proj(1) + l_obs(2);
             res_l.push_back( err_li.norm() * sqrt( (*it)->sigma2 ) );
             //res_l.push_back( err_li.norm() );
-#endif
         }
 
         // estimate robust parameters
@@ -1493,6 +1659,9 @@ bool StereoFrameHandler::needNewKF()
     cov_prevKF_currF += adjTprevkf * covDTinv * adjTprevkf.transpose();
     double entropy_curr  = 3.0*(1.0+log(2.0*acos(-1))) + 0.5*log( cov_prevKF_currF.determinant() );
     double entropy_ratio = entropy_curr / entropy_first_prevKF;
+    kf_t_dist        = t;
+    kf_r_dist        = r;
+    kf_entropy_ratio = entropy_ratio;
 
     //cout << endl << curr_frame->DT     << endl << endl;
     //cout << endl << curr_frame->DT_cov << endl << endl;
@@ -1503,13 +1672,14 @@ bool StereoFrameHandler::needNewKF()
         ( curr_frame->DT_cov == Matrix6d::Zero() && curr_frame->DT == Matrix4d::Identity() ) ||
         t > Config::maxKFTDist() || r > Config::maxKFRDist() || N_prevKF_currF > 10 )
     {
-        cout << endl << "Entropy ratio: " << entropy_ratio   << "\t" << t << " " << r << " " << N_prevKF_currF << endl;
+        LOG_DEBUG( "Entropy ratio: " << entropy_ratio << "\t" << t << " " << r << " " << N_prevKF_currF );
+        extractKFFeatures();
         return true;
     }
     else
     {
-        cout << endl << "No new KF needed: " << entropy_ratio << "\t" << entropy_curr << " " << entropy_first_prevKF
-             << " " << cov_prevKF_currF.determinant() << "\t" << t << " " << r << " " << N_prevKF_currF << endl << endl;
+        LOG_DEBUG( "No new KF needed: " << entropy_ratio << "\t" << entropy_curr << " " << entropy_first_prevKF
+             << " " << cov_prevKF_currF.determinant() << "\t" << t << " " << r << " " << N_prevKF_currF );
         N_prevKF_currF++;
         return false;
     }
@@ -1518,21 +1688,16 @@ bool StereoFrameHandler::needNewKF()
 void StereoFrameHandler::currFrameIsKF()
 {
 
-    // restart point indices
-    int idx_pt = 0;
-    for( auto it = curr_frame->stereo_pt.begin(); it != curr_frame->stereo_pt.end(); it++)
-    {
-        (*it)->idx = idx_pt;
-        idx_pt++;
-    }
+    // restart point and line indices: the features are now shared with the KF,
+    // so instead of renumbering them the next f2f tracking uses their positions
+    curr_f_shared = true;
 
-    // restart line indices
-    int idx_ls = 0;
-    for( auto it = curr_frame->stereo_ls.begin(); it != curr_frame->stereo_ls.end(); it++)
-    {
-        (*it)->idx = idx_ls;
-        idx_ls++;
-    }
+    // move the local map snapshot to the new reference KF
+    T_prevKF_map = inverse_se3( curr_frame->Tfw ) * T_prevKF_map;
+    kf_chain.push_back( inverse_se3( curr_frame->Tfw ) );
+    if( kf_chain.size() > kf_chain_size )
+        kf_chain.pop_front();
+    kf_count++;
 
     // update KF
     curr_frame->Tfw     = Matrix4d::Identity();
@@ -1543,6 +1708,9 @@ void StereoFrameHandler::currFrameIsKF()
     cov_prevKF_currF = Matrix6d::Zero();
     prev_f_iskf = true;
     N_prevKF_currF = 0;
+    kf_t_dist        = 0.0;
+    kf_r_dist        = 0.0;
+    kf_entropy_ratio = 1.0;
 
 }
 
@@ -1818,6 +1986,8 @@ void StereoFrameHandler::optimizePoseDebug()
 
 void StereoFrameHandler::gaussNewtonOptimizationRobustDebug(Matrix4d &DT, Matrix6d &DT_cov, double &err_, int max_iters)
 {
+    buildPoseObservations();
+
     Matrix6d H;
     Vector6d g, DT_inc;
     double err, err_prev = 999999999.9;
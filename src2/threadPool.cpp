@@ -0,0 +1,127 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "threadPool.h"
+
+#include "config.h"
+#include "threadRole.h"
+
+namespace StVO {
+
+namespace {
+// pool and deque owned by the calling thread (NULL/-1 outside the workers)
+thread_local const ThreadPool *worker_pool = NULL;
+thread_local int worker_idx = -1;
+}
+
+ThreadPool::ThreadPool(unsigned int n_workers) : pending(0), next_queue(0), stopping(false) {
+
+    if (n_workers < 1) n_workers = 1;
+    for (unsigned int i = 0; i < n_workers; ++i)
+        queues.emplace_back(new WorkQueue());
+    for (unsigned int i = 0; i < n_workers; ++i)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+
+    {
+        std::lock_guard<std::mutex> lk(sleep_mtx);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+ThreadPool& ThreadPool::global() {
+
+    static ThreadPool pool(Config::numWorkerThreads() > 0 ?
+                           Config::numWorkerThreads() : std::thread::hardware_concurrency());
+    return pool;
+}
+
+void ThreadPool::push(Task task) {
+
+    // the task runs with the configuration of the session that submitted it
+    Config *cfg = Config::current();
+    Task scoped = [cfg, task]() {
+        Config::Scope scope(cfg);
+        task();
+    };
+
+    // workers keep their own tasks local, other threads spread them round-robin
+    const unsigned int q = (worker_pool == this) ? worker_idx : next_queue++ % queues.size();
+    {
+        std::lock_guard<std::mutex> lk(queues[q]->mtx);
+        queues[q]->tasks.push_back(std::move(scoped));
+    }
+    {
+        std::lock_guard<std::mutex> lk(sleep_mtx);
+        pending++;
+    }
+    wake.notify_one();
+}
+
+bool ThreadPool::tryRun() {
+
+    const int n = queues.size();
+    const int self = (worker_pool == this) ? worker_idx : -1;
+
+    Task task;
+    if (self >= 0) {
+        std::lock_guard<std::mutex> lk(queues[self]->mtx);
+        if (!queues[self]->tasks.empty()) {
+            task = std::move(queues[self]->tasks.back());
+            queues[self]->tasks.pop_back();
+        }
+    }
+    for (int i = 1; i <= n && !task; ++i) {
+        WorkQueue &victim = *queues[(self + i + n) % n];
+        std::lock_guard<std::mutex> lk(victim.mtx);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+    }
+
+    if (!task) return false;
+    pending--;
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(int idx) {
+
+    worker_pool = this;
+    worker_idx  = idx;
+    setupThread(THREAD_WORKER, idx);
+
+    while (true) {
+        if (tryRun()) continue;
+        std::unique_lock<std::mutex> lk(sleep_mtx);
+        wake.wait(lk, [this]{ return stopping || pending > 0; });
+        if (stopping && pending == 0) return;
+    }
+}
+
+} // namespace StVO
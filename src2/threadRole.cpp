@@ -0,0 +1,208 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "threadRole.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "config.h"
+
+namespace StVO {
+
+#ifdef __linux__
+namespace {
+
+const char* roleName( ThreadRole role )
+{
+    switch( role )
+    {
+    case THREAD_TRACKING:      return "plslam-track";
+    case THREAD_EXTRACTION:    return "plslam-extract";
+    case THREAD_LOADER:        return "plslam-load";
+    case THREAD_WORKER:        return "plslam-work";
+    case THREAD_KF_HANDLER:    return "plslam-kf";
+    case THREAD_LOCAL_MAPPING: return "plslam-lba";
+    case THREAD_LOOP_CLOSURE:  return "plslam-lc";
+    case THREAD_VIEWER:        return "plslam-view";
+    case THREAD_LOGGER:        return "plslam-log";
+    case THREAD_LINK:          return "plslam-link";
+    }
+    return "plslam";
+}
+
+// CPU list and priority of the role (empty and 0 for the defaults)
+void roleSettings( ThreadRole role, std::string &cpus, int &prio )
+{
+    switch( role )
+    {
+    case THREAD_TRACKING:
+    case THREAD_EXTRACTION:
+        cpus = Config::cpusTracking();
+        prio = Config::prioTracking();
+        break;
+    case THREAD_WORKER:
+        cpus = Config::cpusWorkers();
+        prio = Config::prioWorkers();
+        break;
+    case THREAD_KF_HANDLER:
+    case THREAD_LOCAL_MAPPING:
+    case THREAD_LOOP_CLOSURE:
+        cpus = Config::cpusMapping();
+        prio = Config::prioMapping();
+        break;
+    default:
+        cpus.clear();
+        prio = 0;
+    }
+}
+
+// new threads inherit the affinity and scheduling of their creator (e.g. the tracking thread),
+// so the defaults are the ones of the process at startup
+struct ProcessScheduling {
+    cpu_set_t   cpus;
+    int         nice;
+    int         policy;
+    sched_param param;
+    ProcessScheduling() {
+        if( sched_getaffinity( 0, sizeof(cpus), &cpus ) != 0 )
+            CPU_ZERO( &cpus );
+        if( pthread_getschedparam( pthread_self(), &policy, &param ) != 0 )
+        {
+            policy = SCHED_OTHER;
+            param.sched_priority = 0;
+        }
+        errno = 0;
+        nice = getpriority( PRIO_PROCESS, 0 );
+        if( errno != 0 )
+            nice = 0;
+    }
+};
+const ProcessScheduling process_scheduling;
+
+} // namespace
+#endif
+
+std::vector<int> parseCpuList( const std::string &cpus )
+{
+    std::vector<int> list;
+    std::stringstream ss( cpus );
+    std::string item;
+    while( std::getline( ss, item, ',' ) )
+    {
+        int first, last;
+        char dash, extra;
+        if( item.find('-') != std::string::npos )
+        {
+            std::stringstream is( item );
+            if( !( is >> first >> dash >> last ) || dash != '-' || ( is >> extra ) )
+                throw std::runtime_error("[ThreadRole] Malformed CPU list: " + cpus);
+        }
+        else
+        {
+            std::stringstream is( item );
+            if( !( is >> first ) || ( is >> extra ) )
+                throw std::runtime_error("[ThreadRole] Malformed CPU list: " + cpus);
+            last = first;
+        }
+        if( first < 0 || last < first )
+            throw std::runtime_error("[ThreadRole] Malformed CPU list: " + cpus);
+        for( int cpu = first; cpu <= last; cpu++ )
+            list.push_back( cpu );
+    }
+    return list;
+}
+
+void setupThread( ThreadRole role, int idx )
+{
+#ifdef __linux__
+    // thread names are limited to 15 characters
+    char name[16];
+    if( idx >= 0 )
+        snprintf( name, sizeof(name), "%s%d", roleName(role), idx );
+    else
+        snprintf( name, sizeof(name), "%s", roleName(role) );
+    pthread_setname_np( pthread_self(), name );
+
+    std::string cpus;
+    int prio;
+    roleSettings( role, cpus, prio );
+
+    // a malformed list keeps the CPUs of the process
+    std::vector<int> cpu_list;
+    try {
+        cpu_list = parseCpuList( cpus );
+    } catch( const std::runtime_error &e ) {
+        std::cerr << e.what() << std::endl;
+    }
+    cpu_set_t set = process_scheduling.cpus;
+    if( !cpu_list.empty() )
+    {
+        CPU_ZERO( &set );
+        for( int cpu : cpu_list )
+            if( cpu < CPU_SETSIZE )
+                CPU_SET( cpu, &set );
+    }
+    int err = CPU_COUNT( &set ) > 0 ? pthread_setaffinity_np( pthread_self(), sizeof(set), &set ) : 0;
+    if( err != 0 )
+        std::cerr << "[ThreadRole] " << name << ": CPUs " << cpus << " not set (" << strerror(err) << ")" << std::endl;
+
+    // real-time priority above 0, lower (nice) priority below, otherwise the policy of the process
+    // (e.g. started with chrt), only changed if the thread does not have it already
+    int policy = process_scheduling.policy;
+    sched_param param = process_scheduling.param;
+    if( prio > 0 )
+    {
+        policy = SCHED_FIFO;
+        param.sched_priority = prio;
+    }
+    int curr_policy;
+    sched_param curr_param;
+    err = pthread_getschedparam( pthread_self(), &curr_policy, &curr_param );
+    if( err != 0 || curr_policy != policy || curr_param.sched_priority != param.sched_priority )
+        err = pthread_setschedparam( pthread_self(), policy, &param );
+    if( err != 0 )
+        std::cerr << "[ThreadRole] " << name << ": scheduling priority " << param.sched_priority << " not set (" << strerror(err) << ")" << std::endl;
+    const int nice = process_scheduling.nice + std::max( -prio, 0 );
+    const id_t tid = syscall(SYS_gettid);
+    if( getpriority( PRIO_PROCESS, tid ) != nice && setpriority( PRIO_PROCESS, tid, nice ) != 0 )
+        std::cerr << "[ThreadRole] " << name << ": nice value " << nice << " not set (" << strerror(errno) << ")" << std::endl;
+#else
+    (void)role;
+    (void)idx;
+#endif
+}
+
+} // namespace StVO
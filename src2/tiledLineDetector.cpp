@@ -0,0 +1,300 @@
+/*****************************************************************************
+**      Stereo VO and SLAM by combining point and line segment features     **
+******************************************************************************
+**                                                                          **
+**  Copyright(c) 2016-2018, Ruben Gomez-Ojeda, University of Malaga         **
+**  Copyright(c) 2016-2018, David Zuñiga-Noël, University of Malaga         **
+**  Copyright(c) 2016-2018, MAPIR group, University of Malaga               **
+**                                                                          **
+**  This program is free software: you can redistribute it and/or modify    **
+**  it under the terms of the GNU General Public License (version 3) as     **
+**  published by the Free Software Foundation.                              **
+**                                                                          **
+**  This program is distributed in the hope that it will be useful, but     **
+**  WITHOUT ANY WARRANTY; without even the implied warranty of              **
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            **
+**  GNU General Public License for more details.                            **
+**                                                                          **
+**  You should have received a copy of the GNU General Public License       **
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.   **
+**                                                                          **
+*****************************************************************************/
+
+#include "tiledLineDetector.h"
+
+//STL
+#include <algorithm>
+#include <cmath>
+#include <future>
+
+//OpenCV
+#include <opencv2/imgproc.hpp>
+
+#include "featureBudget.h"
+#include "featureEngine.h"
+#include "threadPool.h"
+
+namespace StVO {
+
+namespace {
+
+const int   seam_margin = 16;   // rows shared by two neighbouring strips
+const float seam_dist   = 1.5f; // max distance (in pixels) between the pieces of a segment cut by a seam
+
+struct Strip {
+    int y0, y1;         // rows owned by the strip
+    int top, bottom;    // rows where the segments are detected
+};
+
+struct Segment {
+    cv::Vec4f l;
+    bool merged;
+};
+
+void detectStrip(const cv::Mat &img, const Strip &strip, const cv::line_descriptor::LSDDetectorC::LSDOptions &opts,
+                 std::vector<Segment> &segments) {
+
+    // full width rows, so the strip is a continuous matrix without copying it
+    std::vector<cv::Vec4f> lines;
+    FeatureEngine::local().segmentDetector(opts)->detect(img.rowRange(strip.top, strip.bottom), lines);
+
+    segments.resize(lines.size());
+    for (size_t i = 0; i < lines.size(); ++i) {
+        cv::Vec4f &l = lines[i];
+        l[1] += strip.top;
+        l[3] += strip.top;
+        segments[i].l = l;
+        segments[i].merged = false;
+    }
+}
+
+// distance from p to the line through l
+float lineDistance(const cv::Vec4f &l, float x, float y) {
+    const float dx = l[2] - l[0], dy = l[3] - l[1];
+    return std::abs(dy * (x - l[0]) - dx * (y - l[1])) / std::sqrt(dx * dx + dy * dy);
+}
+
+// pieces of the same segment on both sides of a seam: parallel and aligned
+bool sameSegment(const cv::Vec4f &a, const cv::Vec4f &b, float cos_th) {
+
+    const float ax = a[2] - a[0], ay = a[3] - a[1], bx = b[2] - b[0], by = b[3] - b[1];
+    const float na = std::sqrt(ax * ax + ay * ay), nb = std::sqrt(bx * bx + by * by);
+    if (na == 0.f || nb == 0.f || std::abs(ax * bx + ay * by) < cos_th * na * nb)
+        return false;
+    return lineDistance(a, b[0], b[1]) < seam_dist && lineDistance(a, b[2], b[3]) < seam_dist;
+}
+
+// union of two aligned pieces, keeping the orientation (gradient side) of a
+cv::Vec4f mergeSegments(const cv::Vec4f &a, const cv::Vec4f &b) {
+
+    const float dx = a[2] - a[0], dy = a[3] - a[1];
+    const float px[4] = {a[0], a[2], b[0], b[2]};
+    const float py[4] = {a[1], a[3], b[1], b[3]};
+    int i_min = 0, i_max = 0;
+    float t_min = 0.f, t_max = 0.f;
+    for (int i = 0; i < 4; ++i) {
+        const float t = (px[i] - a[0]) * dx + (py[i] - a[1]) * dy;
+        if (i == 0 || t < t_min) { t_min = t; i_min = i; }
+        if (i == 0 || t > t_max) { t_max = t; i_max = i; }
+    }
+    return cv::Vec4f(px[i_min], py[i_min], px[i_max], py[i_max]);
+}
+
+// fragments of the same segment: same direction (gradient side), both endpoints of b close
+// to the line of a and a gap between them along a of at most max_gap
+bool collinearFragments(const cv::Vec4f &a, const cv::Vec4f &b, float cos_th, float max_dist, float max_gap) {
+
+    const float ax = a[2] - a[0], ay = a[3] - a[1], bx = b[2] - b[0], by = b[3] - b[1];
+    const float na = std::sqrt(ax * ax + ay * ay), nb = std::sqrt(bx * bx + by * by);
+    if (na == 0.f || nb == 0.f || ax * bx + ay * by < cos_th * na * nb)
+        return false;
+    if (lineDistance(a, b[0], b[1]) > max_dist || lineDistance(a, b[2], b[3]) > max_dist)
+        return false;
+    const float t0 = ((b[0] - a[0]) * ax + (b[1] - a[1]) * ay) / na;
+    const float t1 = ((b[2] - a[0]) * ax + (b[3] - a[1]) * ay) / na;
+    return std::max(std::min(t0, t1) - na, -std::max(t0, t1)) <= max_gap;
+}
+
+void checkLineExtremes(cv::Vec4f &l, const cv::Size &size) {
+    l[0] = std::min(std::max(l[0], 0.f), size.width - 1.f);
+    l[2] = std::min(std::max(l[2], 0.f), size.width - 1.f);
+    l[1] = std::min(std::max(l[1], 0.f), size.height - 1.f);
+    l[3] = std::min(std::max(l[3], 0.f), size.height - 1.f);
+}
+
+// keyline of a single octave segment (as LSDDetectorC::detectImpl)
+void fillKeyLine(const cv::Mat &img, const cv::Vec4f &extremes, double length, cv::line_descriptor::KeyLine &kl) {
+
+    kl.startPointX = extremes[0];
+    kl.startPointY = extremes[1];
+    kl.endPointX = extremes[2];
+    kl.endPointY = extremes[3];
+    kl.sPointInOctaveX = extremes[0];
+    kl.sPointInOctaveY = extremes[1];
+    kl.ePointInOctaveX = extremes[2];
+    kl.ePointInOctaveY = extremes[3];
+    kl.lineLength = length;
+
+    cv::LineIterator li(img, cv::Point2f(extremes[0], extremes[1]), cv::Point2f(extremes[2], extremes[3]));
+    kl.numOfPixels = li.count;
+
+    kl.angle = std::atan2(kl.endPointY - kl.startPointY, kl.endPointX - kl.startPointX);
+    kl.octave = 0;
+    kl.size = (kl.endPointX - kl.startPointX) * (kl.endPointY - kl.startPointY);
+    kl.response = kl.lineLength / std::max(img.cols, img.rows);
+    kl.pt = cv::Point2f((kl.endPointX + kl.startPointX) / 2, (kl.endPointY + kl.startPointY) / 2);
+}
+
+} // namespace
+
+void detectLinesTiled(const cv::Mat &img, const cv::line_descriptor::LSDDetectorC::LSDOptions &opts, int n_strips,
+                      std::vector<cv::line_descriptor::KeyLine> &keylines) {
+
+    keylines.clear();
+    if (img.empty())
+        return;
+
+    // strips of at least two margins, so that only neighbouring strips overlap
+    n_strips = std::max(1, std::min(n_strips, img.rows / (2 * seam_margin)));
+    std::vector<Strip> strips(n_strips);
+    for (int i = 0; i < n_strips; ++i) {
+        Strip &s = strips[i];
+        s.y0 = i * img.rows / n_strips;
+        s.y1 = (i + 1) * img.rows / n_strips;
+        s.top = std::max(0, s.y0 - seam_margin);
+        s.bottom = std::min(img.rows, s.y1 + seam_margin);
+    }
+
+    std::vector<std::vector<Segment>> segments(n_strips);
+    std::vector<std::future<void>> tasks;
+    tasks.reserve(n_strips);
+    for (int i = 0; i < n_strips; ++i)
+        tasks.push_back(ThreadPool::global().submit(&detectStrip, std::cref(img), std::cref(strips[i]), std::cref(opts),
+                                                    std::ref(segments[i])));
+    for (std::future<void> &task : tasks)
+        ThreadPool::global().wait(task);
+
+    // join the pieces cut by each seam, the result is left in the lower strip
+    // (so that it can be joined again at the next seam)
+    const float cos_th = std::cos(opts.ang_th * CV_PI / 180.0);
+    for (int i = 0; i + 1 < n_strips; ++i) {
+        std::vector<Segment> &upper = segments[i], &lower = segments[i + 1];
+        const float upper_border = strips[i].bottom - 1.f - seam_dist;
+        const float lower_border = strips[i + 1].top + seam_dist;
+        for (size_t ia = 0; ia < upper.size(); ++ia) {
+            const cv::Vec4f &a = upper[ia].l;
+            if (std::max(a[1], a[3]) < upper_border) continue;
+            for (size_t ib = 0; ib < lower.size(); ++ib) {
+                const cv::Vec4f &b = lower[ib].l;
+                if (std::min(b[1], b[3]) > lower_border || !sameSegment(a, b, cos_th)) continue;
+                lower[ib].l = mergeSegments(a, b);
+                lower[ib].merged = true;
+                upper.erase(upper.begin() + ia--);
+                break;
+            }
+        }
+    }
+
+    // keylines (as LSDDetectorC::detectImpl with a single octave)
+    int class_counter = -1;
+    for (int i = 0; i < n_strips; ++i) {
+        for (const Segment &s : segments[i]) {
+            // the strip containing its midpoint keeps a segment repeated in an overlap
+            const float ym = 0.5f * (s.l[1] + s.l[3]);
+            if (!s.merged && (ym < strips[i].y0 || ym >= strips[i].y1)) continue;
+
+            cv::Vec4f extremes = s.l;
+            checkLineExtremes(extremes, img.size());
+            const double length = std::sqrt(std::pow(extremes[0] - extremes[2], 2) + std::pow(extremes[1] - extremes[3], 2));
+            if (length <= opts.min_length) continue;
+
+            cv::line_descriptor::KeyLine kl;
+            fillKeyLine(img, extremes, length, kl);
+            kl.class_id = ++class_counter;
+            keylines.push_back(kl);
+        }
+    }
+}
+
+void mergeCollinearLines(const cv::Mat &img, double ang_th, double max_dist, double max_gap,
+                         std::vector<cv::line_descriptor::KeyLine> &keylines) {
+
+    const int n = keylines.size();
+    if (n < 2)
+        return;
+
+    // longest first, so each segment absorbs the shorter fragments along it
+    std::vector<int> order(n);
+    for (int i = 0; i < n; ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&keylines](int a, int b) {
+        return keylines[a].lineLength > keylines[b].lineLength;
+    });
+    std::vector<Segment> segments(n);
+    for (int k = 0; k < n; ++k) {
+        const cv::line_descriptor::KeyLine &kl = keylines[order[k]];
+        segments[k].l = cv::Vec4f(kl.startPointX, kl.startPointY, kl.endPointX, kl.endPointY);
+        segments[k].merged = false;
+    }
+
+    const float cos_th = std::cos(ang_th * CV_PI / 180.0);
+    std::vector<bool> absorbed(n, false);
+    for (int ia = 0; ia < n; ++ia) {
+        if (absorbed[ia]) continue;
+        // again while it grows, a longer segment reaches further fragments
+        bool grown = true;
+        while (grown) {
+            grown = false;
+            for (int ib = ia + 1; ib < n; ++ib) {
+                if (absorbed[ib] || !collinearFragments(segments[ia].l, segments[ib].l, cos_th, max_dist, max_gap))
+                    continue;
+                segments[ia].l = mergeSegments(segments[ia].l, segments[ib].l);
+                segments[ia].merged = true;
+                absorbed[ib] = true;
+                grown = true;
+            }
+        }
+    }
+
+    std::vector<cv::line_descriptor::KeyLine> merged;
+    merged.reserve(n);
+    for (int k = 0; k < n; ++k) {
+        if (absorbed[k]) continue;
+        merged.push_back(keylines[order[k]]);
+        if (segments[k].merged) {
+            cv::Vec4f extremes = segments[k].l;
+            checkLineExtremes(extremes, img.size());
+            const double length = std::sqrt(std::pow(extremes[0] - extremes[2], 2) + std::pow(extremes[1] - extremes[3], 2));
+            fillKeyLine(img, extremes, length, merged.back());
+        }
+        merged.back().class_id = merged.size() - 1;
+    }
+    keylines.swap(merged);
+}
+
+void selectLinesBucketed(std::vector<cv::line_descriptor::KeyLine> &keylines, int n, cv::Size size, int cols, int rows) {
+
+    if (n <= 0 || int(keylines.size()) <= n)
+        return;
+
+    std::vector<cv::Point2f> pos;
+    std::vector<float> response;
+    pos.reserve(keylines.size());
+    response.reserve(keylines.size());
+    for (const cv::line_descriptor::KeyLine &kl : keylines) {
+        pos.push_back(cv::Point2f((kl.startPointX + kl.endPointX) / 2, (kl.startPointY + kl.endPointY) / 2));
+        response.push_back(kl.response);
+    }
+    std::vector<int> selected;
+    FeatureBudget::selectBucketed(pos, response, n, size, cols, rows, selected);
+
+    std::vector<cv::line_descriptor::KeyLine> kept;
+    kept.reserve(selected.size());
+    for (int i : selected) {
+        kept.push_back(keylines[i]);
+        kept.back().class_id = kept.size() - 1;
+    }
+    keylines.swap(kept);
+}
+
+} // namespace StVO